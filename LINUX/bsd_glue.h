@@ -110,6 +110,11 @@ static inline u64 hrtimer_forward_now(struct hrtimer *timer,
 }
 #endif
 
+#ifndef NETMAP_LINUX_HAVE_DMA_MAX_MAPPING_SIZE
+/* unknown limit (e.g., swiotlb bounce buffers): map one cluster at a time */
+#define dma_max_mapping_size(dev)	((size_t)0)
+#endif
+
 #ifndef NETMAP_LINUX_HAVE_PHYS_ADDR_T
 typedef unsigned long phys_addr_t;
 #endif
@@ -258,6 +263,11 @@ struct thread;
  * and it is 0 for no setting, ring_nr+1 otherwise.
  */
 #define MBUF_TXQ(m)		skb_get_queue_mapping(m)
+#ifdef NETMAP_LINUX_HAVE_SKB_GET_HASH
+#define MBUF_HASH(m)		skb_get_hash(m)
+#else
+#define MBUF_HASH(m)		MBUF_TXQ(m)
+#endif /* NETMAP_LINUX_HAVE_SKB_GET_HASH */
 #define MBUF_RXQ(m)		(skb_rx_queue_recorded(m) ? skb_get_rx_queue(m) : 0)
 #define SET_MBUF_DESTRUCTOR(m, f) m->destructor = (void *)f
 
@@ -430,6 +440,16 @@ static inline int ilog2(uint64_t n)
 		split_page(p_, order_);				\
 	(p_ != NULL ? (char*)page_address(p_) : NULL); })
 
+/* same as contigmalloc, on NUMA node 'node' */
+#define contigmalloc_node(sz, ty, flags, a, b, pgsz, c, node) ({	\
+	unsigned int order_ =					\
+		ilog2(roundup_pow_of_two(sz)/PAGE_SIZE);	\
+	struct page *p_ = alloc_pages_node(node,		\
+		GFP_USER | __GFP_ZERO, order_);			\
+	if (p_ != NULL) 					\
+		split_page(p_, order_);				\
+	(p_ != NULL ? (char*)page_address(p_) : NULL); })
+
 #define contigfree(va, sz, ty)					\
 	do {							\
 		unsigned int npages_ =				\
@@ -284,6 +284,8 @@ i40e_netmap_attach(struct i40e_vsi *vsi)
 	na.num_rx_desc = NM_I40E_RX_RING(vsi, 0)->count;
 	na.num_tx_rings = na.num_rx_rings = vsi->num_queue_pairs;
 	na.rx_buf_maxsize = vsi->rx_buf_len;
+	na.tx_meta_caps = NM_META_TX_IP_CSUM | NM_META_TX_TCP_CSUM |
+			  NM_META_TX_UDP_CSUM;
 	na.nm_txsync = i40e_netmap_txsync;
 	na.nm_rxsync = i40e_netmap_rxsync;
 	na.nm_register = i40e_netmap_reg;
@@ -317,6 +319,40 @@ i40e_netmap_read_hwtail(void *base, int nslots)
 	return le32toh(*(volatile __le32 *)&desc[nslots]);
 }
 
+/*
+ * Checksum offload bits for the data descriptors of the packet starting
+ * at 'slot' (NETMAP_REQ_OPT_SLOT_META). The XL710 needs no context
+ * descriptor for this, so the netmap and NIC rings stay in step.
+ */
+static inline u64
+i40e_netmap_tx_offload(struct netmap_kring *kring, struct netmap_slot *slot)
+{
+	const struct nm_slot_meta *meta = nm_slot_meta_tx(kring, slot);
+	u32 cmd = 0, off;
+
+	if (likely(meta == NULL) || !(meta->flags & (NM_META_TX_IP_CSUM |
+			NM_META_TX_TCP_CSUM | NM_META_TX_UDP_CSUM)))
+		return 0;
+
+	if (meta->flags & NM_META_TX_IPV6)
+		cmd |= I40E_TX_DESC_CMD_IIPT_IPV6;
+	else if (meta->flags & NM_META_TX_IP_CSUM)
+		cmd |= I40E_TX_DESC_CMD_IIPT_IPV4_CSUM;
+	else
+		cmd |= I40E_TX_DESC_CMD_IIPT_IPV4;
+	off = ((meta->l2_len >> 1) << I40E_TX_DESC_LENGTH_MACLEN_SHIFT) |
+	      ((meta->l3_len >> 2) << I40E_TX_DESC_LENGTH_IPLEN_SHIFT);
+	if (meta->flags & NM_META_TX_TCP_CSUM) {
+		cmd |= I40E_TX_DESC_CMD_L4T_EOFT_TCP;
+		off |= (meta->l4_len >> 2) << I40E_TX_DESC_LENGTH_L4_FC_LEN_SHIFT;
+	} else if (meta->flags & NM_META_TX_UDP_CSUM) {
+		cmd |= I40E_TX_DESC_CMD_L4T_EOFT_UDP;
+		off |= (8 >> 2) << I40E_TX_DESC_LENGTH_L4_FC_LEN_SHIFT;
+	}
+	return ((u64)cmd << I40E_TXD_QW1_CMD_SHIFT) |
+	       ((u64)off << I40E_TXD_QW1_OFFSET_SHIFT);
+}
+
 int
 i40e_netmap_txsync(struct netmap_kring *kring, int flags)
 {
@@ -333,6 +369,8 @@ i40e_netmap_txsync(struct netmap_kring *kring, int flags)
 	 * them every half ring, or where NS_REPORT is set
 	 */
 	u_int report_frequency = kring->nkr_num_slots >> 1;
+	u64 offload = 0;	/* same for all the slots of a packet */
+	int first = 1;
 
 	/* device-specific */
 	struct i40e_netdev_priv *np = netdev_priv(ifp);
@@ -407,6 +445,9 @@ i40e_netmap_txsync(struct netmap_kring *kring, int flags)
 			PNMB(na, slot, &paddr);
 			NM_CHECK_ADDR_LEN_OFF(na, len, offset);
 
+			if (first)
+				offload = i40e_netmap_tx_offload(kring, slot);
+			first = !(slot->flags & NS_MOREFRAG);
 			if (!(slot->flags & NS_MOREFRAG)) {
 				hw_flags |= ((u64)(I40E_TX_DESC_CMD_EOP) <<
 						I40E_TXD_QW1_CMD_SHIFT);
@@ -430,7 +471,7 @@ i40e_netmap_txsync(struct netmap_kring *kring, int flags)
 			curr->buffer_addr = htole64(paddr + offset);
 			curr->cmd_type_offset_bsz = htole64(
 			    ((u64)len << I40E_TXD_QW1_TX_BUF_SZ_SHIFT) |
-			    hw_flags |
+			    hw_flags | offload |
 			    ((u64)(I40E_TX_DESC_CMD_ICRC) << I40E_TXD_QW1_CMD_SHIFT)
 			  ); /* more flags may be needed */
 
@@ -21,6 +21,40 @@ extern int ix_crcstrip;
  * methods should be handled by the individual drivers.
  */
 
+/*
+ * Checksum offload bits for the data descriptors of the packet starting
+ * at 'slot' (NETMAP_REQ_OPT_SLOT_META). As on i40e, no context descriptor
+ * is needed, so the netmap and NIC rings stay in step.
+ */
+static inline u64
+ice_netmap_tx_offload(struct netmap_kring *kring, struct netmap_slot *slot)
+{
+	const struct nm_slot_meta *meta = nm_slot_meta_tx(kring, slot);
+	u32 cmd = 0, off;
+
+	if (likely(meta == NULL) || !(meta->flags & (NM_META_TX_IP_CSUM |
+			NM_META_TX_TCP_CSUM | NM_META_TX_UDP_CSUM)))
+		return 0;
+
+	if (meta->flags & NM_META_TX_IPV6)
+		cmd |= ICE_TX_DESC_CMD_IIPT_IPV6;
+	else if (meta->flags & NM_META_TX_IP_CSUM)
+		cmd |= ICE_TX_DESC_CMD_IIPT_IPV4_CSUM;
+	else
+		cmd |= ICE_TX_DESC_CMD_IIPT_IPV4;
+	off = ((meta->l2_len >> 1) << ICE_TX_DESC_LEN_MACLEN_S) |
+	      ((meta->l3_len >> 2) << ICE_TX_DESC_LEN_IPLEN_S);
+	if (meta->flags & NM_META_TX_TCP_CSUM) {
+		cmd |= ICE_TX_DESC_CMD_L4T_EOFT_TCP;
+		off |= (meta->l4_len >> 2) << ICE_TX_DESC_LEN_L4_LEN_S;
+	} else if (meta->flags & NM_META_TX_UDP_CSUM) {
+		cmd |= ICE_TX_DESC_CMD_L4T_EOFT_UDP;
+		off |= (8 >> 2) << ICE_TX_DESC_LEN_L4_LEN_S;
+	}
+	return ((u64)cmd << ICE_TXD_QW1_CMD_S) |
+	       ((u64)off << ICE_TXD_QW1_OFFSET_S);
+}
+
 int
 ice_netmap_txsync(struct netmap_kring *kring, int flags)
 {
@@ -37,6 +71,8 @@ ice_netmap_txsync(struct netmap_kring *kring, int flags)
 	 * them every half ring, or where NS_REPORT is set
 	 */
 	//u_int report_frequency = kring->nkr_num_slots >> 1;
+	u64 offload = 0;	/* same for all the slots of a packet */
+	int first = 1;
 
 	/* device-specific */
 	struct ice_netdev_priv *np = netdev_priv(ifp);
@@ -111,6 +147,9 @@ ice_netmap_txsync(struct netmap_kring *kring, int flags)
 			PNMB(na, slot, &paddr);
 			NM_CHECK_ADDR_LEN_OFF(na, len, offset);
 
+			if (first)
+				offload = ice_netmap_tx_offload(kring, slot);
+			first = !(slot->flags & NS_MOREFRAG);
 			if (!(slot->flags & NS_MOREFRAG)) {
 				hw_flags |= ((u64)(ICE_TX_DESC_CMD_EOP) <<
 						ICE_TXD_QW1_CMD_S);
@@ -135,7 +174,7 @@ ice_netmap_txsync(struct netmap_kring *kring, int flags)
 			curr->buf_addr = htole64(paddr + offset);
 			curr->cmd_type_offset_bsz = htole64(
 			    ((u64)len << ICE_TXD_QW1_TX_BUF_SZ_S) |
-			    hw_flags // TODO
+			    hw_flags | offload // TODO
 			  ); /* more flags may be needed */
 
 			nm_i = nm_next(nm_i, lim);
@@ -452,6 +491,8 @@ ice_netmap_attach(struct ice_pf *pf)
 	na.num_tx_rings = vsi->num_txq;
 	na.num_rx_rings = vsi->num_rxq;
 	na.rx_buf_maxsize = vsi->rx_buf_len;
+	na.tx_meta_caps = NM_META_TX_IP_CSUM | NM_META_TX_TCP_CSUM |
+			  NM_META_TX_UDP_CSUM;
 	na.nm_txsync = ice_netmap_txsync;
 	na.nm_rxsync = ice_netmap_rxsync;
 	na.nm_register = ice_netmap_reg;
@@ -43,6 +43,47 @@ static int stmmac_release(struct net_device *dev);
 #define MODULENAME "stmmac" NETMAP_LINUX_DRIVER_SUFFIX
 #endif
 
+/*
+ * Cache maintenance of the netmap buffers, for non coherent DMA.
+ * Consecutive slots often use adjacent buffers, so we collect them in
+ * a single range and issue one dma_sync call per range rather than
+ * one per descriptor. The range may cover the unused tail of the
+ * buffers in the middle, which is harmless.
+ */
+struct stmmac_nm_sync {
+	phys_addr_t start; /* dma address of the range */
+	uint64_t next;	/* where the next buffer must start to extend it */
+	u_int len;
+	int dev;	/* sync for the device (1) or for the cpu (0) */
+	enum txrx t;
+};
+
+static inline void
+stmmac_netmap_sync_flush(struct netmap_adapter *na, struct stmmac_nm_sync *s)
+{
+	bus_dmamap_t map = &s->start;
+
+	if (s->len == 0)
+		return;
+	if (s->dev)
+		netmap_sync_map_dev(na, (bus_dma_tag_t)na->pdev, map, s->len, s->t);
+	else
+		netmap_sync_map_cpu(na, (bus_dma_tag_t)na->pdev, map, s->len, s->t);
+	s->len = 0;
+}
+
+static inline void
+stmmac_netmap_sync_add(struct netmap_adapter *na, struct stmmac_nm_sync *s,
+		       uint64_t paddr, u_int len)
+{
+	if (s->len == 0 || paddr != s->next) {
+		stmmac_netmap_sync_flush(na, s);
+		s->start = paddr;
+	}
+	s->len = paddr + len - s->start;
+	s->next = paddr + NETMAP_BUF_SIZE(na);
+}
+
 /*
  * Register/unregister, mostly the reinit task
  */
@@ -86,6 +127,7 @@ static int stmmac_netmap_txsync(struct netmap_kring *kring, int flags)
 
 	/* device-specific */
 	struct stmmac_priv *stmac_priv = netdev_priv(ifp);
+	struct stmmac_nm_sync sync = { .dev = 1, .t = NR_TX };
 
 	rmb();
 
@@ -99,6 +141,18 @@ static int stmmac_netmap_txsync(struct netmap_kring *kring, int flags)
 	nm_i = kring->nr_hwcur;
 	/* we have new packets to send */
 	if (nm_i != head) {
+		/* the buffers must reach memory before the descriptors
+		 * are given to the DMA */
+		for (; nm_i != head; nm_i = nm_next(nm_i, lim)) {
+			struct netmap_slot *slot = &ring->slot[nm_i];
+			uint64_t paddr;
+
+			PNMB(na, slot, &paddr);
+			stmmac_netmap_sync_add(na, &sync, paddr, slot->len);
+		}
+		stmmac_netmap_sync_flush(na, &sync);
+
+		nm_i = kring->nr_hwcur;
 		nic_i = netmap_idx_k2n(kring, nm_i);
 		for (n = 0; nm_i != head; n++) {
 			struct netmap_slot *slot = &ring->slot[nm_i];
@@ -194,6 +248,7 @@ static int stmmac_netmap_rxsync(struct netmap_kring *kring, int flags)
 
 	int force_update =
 		(flags & NAF_FORCE_READ) || kring->nr_kflags & NKR_PENDINTR;
+	struct stmmac_nm_sync sync = { .dev = 0, .t = NR_RX };
 
 	if (!netif_carrier_ok(ifp))
 		return 0;
@@ -217,6 +272,7 @@ static int stmmac_netmap_rxsync(struct netmap_kring *kring, int flags)
 		while (nm_i != stop_i) {
 			int status;
 			struct dma_desc *pdam_desc;
+			uint64_t paddr;
 
 			if (stmac_priv->extend_desc)
 				pdam_desc =
@@ -252,11 +308,14 @@ static int stmmac_netmap_rxsync(struct netmap_kring *kring, int flags)
 
 			ring->slot[nm_i].len = frame_len;
 			ring->slot[nm_i].flags = 0;
+			PNMB(na, &ring->slot[nm_i], &paddr);
+			stmmac_netmap_sync_add(na, &sync, paddr, frame_len);
 
 			nm_i = nm_next(nm_i, lim);
 			entry = nm_next(entry, lim);
 		}
 
+		stmmac_netmap_sync_flush(na, &sync);
 		stmac_priv->cur_rx = entry;
 
 		kring->nr_hwtail = nm_i;
@@ -268,6 +327,7 @@ static int stmmac_netmap_rxsync(struct netmap_kring *kring, int flags)
 	*/
 	nm_i = kring->nr_hwcur;
 	if (nm_i != head) {
+		sync.dev = 1;
 		entry = netmap_idx_k2n(kring, nm_i);
 		for (n = 0; nm_i != head; n++) {
 			uint32_t erdes1 = 0x0;
@@ -289,6 +349,8 @@ static int stmmac_netmap_rxsync(struct netmap_kring *kring, int flags)
 
 			if (addr == NETMAP_BUF_BASE(na)) /* bad buf */
 				goto ring_reset;
+			stmmac_netmap_sync_add(na, &sync, paddr,
+					       NETMAP_BUF_SIZE(na));
 
 			if (entry == lim) /* mark end of ring */
 				erdes1 |= ERDES1_END_RING;
@@ -306,6 +368,7 @@ static int stmmac_netmap_rxsync(struct netmap_kring *kring, int flags)
 			entry = nm_next(entry, lim);
 		}
 
+		stmmac_netmap_sync_flush(na, &sync);
 		kring->nr_hwcur = head;
 		wmb();
 	}
@@ -854,9 +854,12 @@ virtio_net_netmap_rxsync(struct netmap_kring *kring, int flags)
 
 	/*
 	 * Second part: skip past packets that userspace has released.
+	 * The buffers are published in batches (see netmap_rx_refill_batch),
+	 * so that the descriptors are written and the host is kicked
+	 * once for many of them, with both split and packed rings.
 	 */
 	nm_i = kring->nr_hwcur; /* netmap ring index */
-	if (nm_i != head) {
+	if (nm_i != head && !nm_kr_rxrefill_defer(kring, head)) {
 		int nospace = 0;
 
 		for (; nm_i != head; nm_i = nm_next(nm_i, lim)) {
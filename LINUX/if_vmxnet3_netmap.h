@@ -8,6 +8,24 @@
 
 #define SOFTC_T vmxnet3_adapter
 
+/*
+ * device-specific sysctl variables:
+ *
+ * vmxnet3_tx_defer: up to this many tx slots can be left in the ring
+ *	without writing TXPROD, so that the doorbell (a trap to the
+ *	hypervisor) is shared by several txsyncs. The slots are also
+ *	pushed by a txsync that brings nothing new, by NAF_FORCE_RECLAIM
+ *	and once vmxnet3_tx_defer_us have passed since the first of them.
+ *	0 (default) writes TXPROD at the end of every txsync.
+ */
+SYSCTL_DECL(_dev_netmap);
+int vmxnet3_tx_defer = 0;
+SYSCTL_INT(_dev_netmap, OID_AUTO, vmxnet3_tx_defer,
+		CTLFLAG_RW, &vmxnet3_tx_defer, 0, "Max tx slots before the vmxnet3 doorbell");
+int vmxnet3_tx_defer_us = 50;
+SYSCTL_INT(_dev_netmap, OID_AUTO, vmxnet3_tx_defer_us,
+		CTLFLAG_RW, &vmxnet3_tx_defer_us, 0, "Max delay of a deferred vmxnet3 doorbell");
+
 static int vmxnet3_rq_create_all(struct vmxnet3_adapter *adapter);
 static void vmxnet3_unmap_tx_buf(struct vmxnet3_tx_buf_info *tbi,
 				 struct pci_dev *pdev);
@@ -332,14 +350,31 @@ static int vmxnet3_netmap_txsync(struct netmap_kring *kring, int flags)
 	}
 
 	//
-	// Notify vSwitch that packets are available.
+	// Notify vSwitch that packets are available, possibly sharing
+	// the doorbell with the next txsyncs (kring->last_reclaim holds
+	// the time of the first slot not yet notified).
 	//
 
 	if (deferred >= 1) {
-		VMXNET3_WRITE_BAR0_REG(adapter, (VMXNET3_REG_TXPROD +
-						 tq->qid * VMXNET3_REG_ALIGN),
-				       tq->tx_ring.next2fill);
+		u32 pending = le32_to_cpu(tq->shared->txNumDeferred);
+		u64 now = ktime_to_ns(ktime_get());
+
+		if (pending == 0)
+			kring->last_reclaim = now;
+		pending += deferred;
+		if (vmxnet3_tx_defer > 0 && pending < (u32)vmxnet3_tx_defer &&
+		    !(flags & NAF_FORCE_RECLAIM) &&
+		    now - kring->last_reclaim < (u64)vmxnet3_tx_defer_us * 1000) {
+			tq->shared->txNumDeferred = cpu_to_le32(pending);
+			return 0;
+		}
+	} else if (tq->shared->txNumDeferred == 0) {
+		return 0;
 	}
+	tq->shared->txNumDeferred = 0;
+	VMXNET3_WRITE_BAR0_REG(adapter, (VMXNET3_REG_TXPROD +
+					 tq->qid * VMXNET3_REG_ALIGN),
+			       tq->tx_ring.next2fill);
 
 	return 0;
 }
@@ -261,9 +261,13 @@ ixgbe_netmap_reg(struct netmap_adapter *na, int onoff)
  * The caller (netmap) guarantees that there is only one instance
  * running at any time. Any interference with other driver
  * methods should be handled by the individual drivers.
+ *
+ * 'offsets' is a constant, and the rings without offsets use a copy of
+ * this function without the per-slot offset code (see nm_txsync_fast).
  */
-static int
-ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
+static __always_inline int
+ixgbe_netmap_txsync_common(struct netmap_kring *kring, int flags,
+		const int offsets)
 {
 	struct netmap_adapter *na = kring->na;
 	struct ifnet *ifp = na->ifp;
@@ -330,7 +334,7 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 			struct netmap_slot *slot = &ring->slot[nm_i];
 			u_int len = slot->len;
 			uint64_t paddr;
-			uint64_t offset = nm_get_offset(kring, slot);
+			uint64_t offset = offsets ? nm_get_offset(kring, slot) : 0;
 
 			/* device-specific */
 			union ixgbe_adv_tx_desc *curr = NM_IXGBE_TX_DESC(txr, nic_i);
@@ -344,7 +348,7 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 			report = slot->flags & NS_REPORT ||
 				nic_i == 0 ||
 				nic_i == report_frequency;
-			if (slot->flags & NS_MOREFRAG) {
+			if (unlikely(slot->flags & NS_MOREFRAG)) {
 				/* There is some duplicated code here, but
 				 * mixing everything up in the outer loop makes
 				 * things less transparent, and it also adds
@@ -376,7 +380,8 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 					slot = &ring->slot[nm_i];
 					len = slot->len;
 					PNMB(na, slot, &paddr);
-					offset = nm_get_offset(kring, slot);
+					offset = offsets ?
+						nm_get_offset(kring, slot) : 0;
 					NM_CHECK_ADDR_LEN_OFF(na, len, offset);
 					curr = NM_IXGBE_TX_DESC(txr, nic_i);
 					totlen += len;
@@ -495,6 +500,55 @@ out:
 	return 0;
 }
 
+static int
+ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
+{
+	return ixgbe_netmap_txsync_common(kring, flags, 1);
+}
+
+static int
+ixgbe_netmap_txsync_fast(struct netmap_kring *kring, int flags)
+{
+	return ixgbe_netmap_txsync_common(kring, flags, 0);
+}
+
+
+#ifdef NETIF_F_HW_VLAN_CTAG_RX
+#define NM_IXGBE_VLAN_RX	NETIF_F_HW_VLAN_CTAG_RX
+#else
+#define NM_IXGBE_VLAN_RX	NETIF_F_HW_VLAN_RX
+#endif
+
+/*
+ * Store the offload results found in the writeback descriptor of the
+ * last slot of a packet in front of it (NETMAP_REQ_OPT_SLOT_META).
+ */
+static inline void
+ixgbe_netmap_rx_meta(struct netmap_kring *kring, struct netmap_slot *slot,
+		union ixgbe_adv_rx_desc *curr, uint32_t staterr)
+{
+	struct nm_slot_meta *meta = nm_slot_meta(kring, slot);
+
+	if (meta == NULL)
+		return;
+	if (le16toh(curr->wb.lower.lo_dword.hs_rss.pkt_info) &
+			IXGBE_RXDADV_RSSTYPE_MASK) {
+		meta->hash = le32toh(curr->wb.lower.hi_dword.rss);
+		meta->flags |= NM_META_HASH;
+	}
+	if ((staterr & IXGBE_RXD_STAT_VP) &&
+	    (kring->na->ifp->features & NM_IXGBE_VLAN_RX)) {
+		meta->vlan_tci = le16toh(curr->wb.upper.vlan);
+		meta->flags |= NM_META_VLAN;
+	}
+	if (staterr & IXGBE_RXD_STAT_IPCS)
+		meta->flags |= (staterr & IXGBE_RXDADV_ERR_IPE) ?
+			NM_META_CSUM_BAD : NM_META_L3_CSUM_OK;
+	if (staterr & IXGBE_RXD_STAT_L4CS)
+		meta->flags |= (staterr & IXGBE_RXDADV_ERR_TCPE) ?
+			NM_META_CSUM_BAD : NM_META_L4_CSUM_OK;
+	meta->flags &= kring->meta_flags;
+}
 
 /*
  * Reconcile kernel and user view of the receive ring.
@@ -507,9 +561,13 @@ out:
  *
  * If (flags & NAF_FORCE_READ) also check for incoming packets irrespective
  * of whether or not we received an interrupt.
+ *
+ * As for the txsync, 'offsets' is a constant. Without offsets there
+ * is also no slot metadata, which needs the headroom.
  */
-static int
-ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
+static __always_inline int
+ixgbe_netmap_rxsync_common(struct netmap_kring *kring, int flags,
+		const int offsets)
 {
 	struct netmap_adapter *na = kring->na;
 	struct ifnet *ifp = na->ifp;
@@ -576,6 +634,8 @@ ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
 			PNMB_O(kring, slot, &paddr);
 			netmap_sync_map_cpu(na, (bus_dma_tag_t) na->pdev,
 					&paddr, size, NR_RX);
+			if (offsets && complete && unlikely(kring->meta_flags))
+				ixgbe_netmap_rx_meta(kring, slot, curr, staterr);
 
 			nm_i = nm_next(nm_i, lim);
 			nic_i = nm_next(nic_i, lim);
@@ -613,7 +673,7 @@ ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
 			struct netmap_slot *slot = &ring->slot[nm_i];
 			uint64_t paddr;
 			void *addr = PNMB(na, slot, &paddr);
-			uint64_t offset = nm_get_offset(kring, slot);
+			uint64_t offset = offsets ? nm_get_offset(kring, slot) : 0;
 
 			union ixgbe_adv_rx_desc *curr = NM_IXGBE_RX_DESC(rxr, nic_i);
 			if (addr == NETMAP_BUF_BASE(na)) /* bad buf */
@@ -647,6 +707,18 @@ ring_reset:
 	return netmap_ring_reinit(kring);
 }
 
+static int
+ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
+{
+	return ixgbe_netmap_rxsync_common(kring, flags, 1);
+}
+
+static int
+ixgbe_netmap_rxsync_fast(struct netmap_kring *kring, int flags)
+{
+	return ixgbe_netmap_rxsync_common(kring, flags, 0);
+}
+
 
 /*
  * if in netmap mode, attach the netmap buffers to the ring and return true.
@@ -905,8 +977,12 @@ ixgbe_netmap_attach(struct NM_IXGBE_ADAPTER *adapter)
 	na.num_tx_rings = adapter->num_tx_queues;
 	na.num_rx_rings = adapter->num_rx_queues;
 	na.rx_buf_maxsize = 1500; /* will be overwritten by nm_config */
+	na.rx_meta_caps = NM_META_HASH | NM_META_VLAN | NM_META_L3_CSUM_OK |
+			  NM_META_L4_CSUM_OK | NM_META_CSUM_BAD;
 	na.nm_txsync = ixgbe_netmap_txsync;
 	na.nm_rxsync = ixgbe_netmap_rxsync;
+	na.nm_txsync_fast = ixgbe_netmap_txsync_fast;
+	na.nm_rxsync_fast = ixgbe_netmap_rxsync_fast;
 	na.nm_register = ixgbe_netmap_reg;
 	na.nm_krings_create = ixgbe_netmap_krings_create;
 	na.nm_krings_delete = ixgbe_netmap_krings_delete;
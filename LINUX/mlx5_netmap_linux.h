@@ -89,6 +89,18 @@
 
 #define NM_MLX5E_ADAPTER mlx5e_priv
 
+/*
+ * device-specific sysctl variables:
+ *
+ * mlx5e_tx_inline: frames up to this size are copied whole into the
+ *	send WQE, so the NIC does not need a DMA read of the buffer.
+ *	Larger frames only inline the Ethernet header. 0 disables it.
+ */
+SYSCTL_DECL(_dev_netmap);
+int mlx5e_tx_inline = 64;
+SYSCTL_INT(_dev_netmap, OID_AUTO, mlx5e_tx_inline,
+		CTLFLAG_RW, &mlx5e_tx_inline, 64, "Max frame size inlined in mlx5 WQEs");
+
 /* This function is in en_rx.c but needed here to
  * deal with compressed CQEs
  */
@@ -141,6 +153,35 @@ int mlx5e_netmap_reg(struct netmap_adapter *na, int onoff) {
 #define MLX5E_SQ_STOP_ROOM (MLX5_SEND_WQE_MAX_WQEBBS +\
                 MLX5E_SQ_NOPS_ROOM)
 
+/* ask for a completion at least every so many WQEs */
+#define MLX5E_NM_CQE_BATCH 64
+
+/* wqe_info[].skb stores the netmap slot of the WQE with this bit set,
+ * so that slot 0 is not mistaken for a NOP */
+#define MLX5E_NM_WQE_SLOT 0x01000000
+
+/* Fill the end of the send queue with NOPs so that a WQE of
+ * num_wqebbs basic blocks does not wrap around (from mlx5e_post_nop) */
+static inline struct mlx5_wqe_ctrl_seg *
+mlx5e_netmap_pad_edge(struct mlx5e_txqsq *sq, u8 num_wqebbs,
+                      struct mlx5_wqe_ctrl_seg *last) {
+  struct mlx5_wq_cyc *wq = &sq->wq;
+
+  while ((sq->pc & wq->fbc.sz_m1) + num_wqebbs > wq->fbc.sz_m1 + 1) {
+    u16 pi = sq->pc & wq->fbc.sz_m1;
+    struct mlx5_wqe_ctrl_seg *cseg = mlx5_wq_cyc_get_wqe(wq, pi);
+
+    memset(cseg, 0, sizeof(*cseg));
+    cseg->opmod_idx_opcode = cpu_to_be32((sq->pc << 8) | MLX5_OPCODE_NOP);
+    cseg->qpn_ds = cpu_to_be32((sq->sqn << 8) | 0x01);
+    sq->db.wqe_info[pi].skb = NULL;
+    sq->db.wqe_info[pi].num_wqebbs = 1;
+    sq->pc++;
+    last = cseg;
+  }
+  return last;
+}
+
 /*
  * Reconcile kernel and user view of the transmit ring.
  *
@@ -175,7 +216,7 @@ int mlx5e_netmap_txsync(struct netmap_kring *kring, int flags) {
   struct mlx5e_cq *cq = &(sq->cq);
   struct mlx5e_tx_wqe *wqe = NULL;
   struct mlx5_cqe64 *cqe = NULL;
-  struct mlx5_wqe_ctrl_seg *cseg;
+  struct mlx5_wqe_ctrl_seg *cseg, *last_cseg = NULL;
   struct mlx5_wqe_eth_seg *eseg;
   struct mlx5_wqe_data_seg *dseg;
   u16 sqcc;
@@ -186,8 +227,9 @@ int mlx5e_netmap_txsync(struct netmap_kring *kring, int flags) {
    * iterate over the netmap ring, fetch buffer address and length
    * and create a suitable WQE for each packet to send.
    *
-   * Only the last WQE requests a CQE is created to report
-   * completion.
+   * Only the last WQE, and one every MLX5E_NM_CQE_BATCH, requests a
+   * CQE to report completion, and the doorbell is rung once for the
+   * whole batch.
    */
 
   if (!netif_carrier_ok(ifp)) {
@@ -221,13 +263,30 @@ int mlx5e_netmap_txsync(struct netmap_kring *kring, int flags) {
       u16 ihs; /* inline hdr size */
       u8 num_wqebbs = 0;
 
+      NM_CHECK_ADDR_LEN(na, addr, len); /* limit len to buf size */
+
+      /* Use minimum inline header to minimise data copying,
+       * or the whole frame if it is small */
+      ihs = ETH_HLEN;
+
+      if (len <= (u_int)mlx5e_tx_inline || unlikely(ihs > len))
+        ihs = len; /* whole packet fits inline */
+
+      /* size of the WQE, to keep it from wrapping around */
+      ds_cnt = sizeof(*wqe) / MLX5_SEND_WQE_DS +
+          DIV_ROUND_UP(ihs - sizeof(eseg->inline_hdr.start), MLX5_SEND_WQE_DS) +
+          (len > ihs ? 1 : 0);
+      num_wqebbs = DIV_ROUND_UP(ds_cnt, MLX5_SEND_WQEBB_NUM_DS);
+      if (num_wqebbs > 1) {
+        last_cseg = mlx5e_netmap_pad_edge(sq, num_wqebbs, last_cseg);
+        pi = sq->pc & wq->fbc.sz_m1;
+      }
+
       wqe = mlx5_wq_cyc_get_wqe(wq, pi);
       cseg = &wqe->ctrl; /* ctrl seg */
       eseg = &wqe->eth;  /* ethernet seg */
       ds_cnt = sizeof(*wqe) / MLX5_SEND_WQE_DS;
 
-      NM_CHECK_ADDR_LEN(na, addr, len); /* limit len to buf size */
-
       slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
 
       memset(wqe, 0, sizeof(*wqe));
@@ -235,12 +294,6 @@ int mlx5e_netmap_txsync(struct netmap_kring *kring, int flags) {
       /* request checksum generation in hw */
       eseg->cs_flags = MLX5_ETH_WQE_L3_CSUM | MLX5_ETH_WQE_L4_CSUM;
 
-      /* Use minimum inline header to minimise data copying */
-      ihs = ETH_HLEN;
-
-      if (unlikely(ihs > len))
-        ihs = len; /* whole packet fits inline */
-
       memcpy(eseg->inline_hdr.start, addr, ihs);
       eseg->inline_hdr.sz = cpu_to_be16(ihs);
 
@@ -261,27 +314,32 @@ int mlx5e_netmap_txsync(struct netmap_kring *kring, int flags) {
 
       cseg->opmod_idx_opcode = cpu_to_be32((sq->pc << 8) | opcode);
       cseg->qpn_ds = cpu_to_be32((sq->sqn << 8) | ds_cnt);
+      if ((n % MLX5E_NM_CQE_BATCH) == MLX5E_NM_CQE_BATCH - 1)
+        cseg->fm_ce_se = MLX5_WQE_CTRL_CQ_UPDATE;
 
-      num_wqebbs = DIV_ROUND_UP(ds_cnt, MLX5_SEND_WQEBB_NUM_DS);
       sq->pc += num_wqebbs;
 
       /* Instead of storing pointer to a skb in sq->skb[pi], we use
        * it to store info we will need at completion:
-       *   - number of wqebbs in this wqe (shifted up by 24 bits)
        *   - slot number in the netmap kring that this wqe is sending
-       *           (in bottom 24 bits)
+       *           (in bottom 24 bits), marked by MLX5E_NM_WQE_SLOT
        */
-      sq->db.wqe_info[pi].skb = (void *)(uintptr_t)(nm_i & 0x00FFFFFF);
+      sq->db.wqe_info[pi].skb =
+          (void *)(uintptr_t)((nm_i & 0x00FFFFFF) | MLX5E_NM_WQE_SLOT);
       sq->db.wqe_info[pi].num_wqebbs = num_wqebbs;
-
-      mlx5e_notify_hw(&sq->wq, sq->pc, sq->uar_map, cseg);
-
-      sq->stats->packets++;
+      last_cseg = cseg;
 
       /* next netmap slot */
       nm_i = nm_next(nm_i, lim);
     } /* next packet */
 
+    if (likely(last_cseg != NULL)) {
+      /* complete the batch and ring the doorbell once */
+      last_cseg->fm_ce_se = MLX5_WQE_CTRL_CQ_UPDATE;
+      mlx5e_notify_hw(&sq->wq, sq->pc, sq->uar_map, last_cseg);
+      sq->stats->packets += n;
+    }
+
     kring->nr_hwcur = nm_i;
   }
 
@@ -178,6 +178,247 @@ nm_os_ifnet_mtu(struct ifnet *ifp)
 	return ifp->mtu;
 }
 
+int
+nm_os_ifnet_numa_node(struct ifnet *ifp)
+{
+	if (ifp->dev.parent == NULL)
+		return -1;
+	return dev_to_node(ifp->dev.parent); /* NUMA_NO_NODE is -1 */
+}
+
+#ifdef NETMAP_LINUX_HAVE_SET_RXNFC
+/* Translate a netmap flow rule into an ethtool one. */
+static int
+linux_flow_rule_spec(struct nmreq_flow_rule *req,
+		struct ethtool_rx_flow_spec *fs)
+{
+	uint32_t m = req->nr_match;
+	int l4_type = -1;
+
+	if (m & NR_FLOW_PROTO) {
+		switch (req->nr_proto) {
+		case IPPROTO_TCP:
+			l4_type = (m & NR_FLOW_IPV6) ? TCP_V6_FLOW : TCP_V4_FLOW;
+			break;
+		case IPPROTO_UDP:
+			l4_type = (m & NR_FLOW_IPV6) ? UDP_V6_FLOW : UDP_V4_FLOW;
+			break;
+		case IPPROTO_SCTP:
+			l4_type = (m & NR_FLOW_IPV6) ? SCTP_V6_FLOW : SCTP_V4_FLOW;
+			break;
+		}
+	}
+	if ((m & (NR_FLOW_SRC_PORT | NR_FLOW_DST_PORT)) && l4_type < 0)
+		return EINVAL;
+
+	if ((m & NR_FLOW_IPV6) && l4_type >= 0) {
+		struct ethtool_tcpip6_spec *h = &fs->h_u.tcp_ip6_spec;
+		struct ethtool_tcpip6_spec *k = &fs->m_u.tcp_ip6_spec;
+
+		fs->flow_type = l4_type;
+		if (m & NR_FLOW_SRC_IP) {
+			memcpy(h->ip6src, req->nr_src_ip, sizeof(h->ip6src));
+			memset(k->ip6src, 0xff, sizeof(k->ip6src));
+		}
+		if (m & NR_FLOW_DST_IP) {
+			memcpy(h->ip6dst, req->nr_dst_ip, sizeof(h->ip6dst));
+			memset(k->ip6dst, 0xff, sizeof(k->ip6dst));
+		}
+		if (m & NR_FLOW_SRC_PORT) {
+			h->psrc = req->nr_src_port;
+			k->psrc = htons(0xffff);
+		}
+		if (m & NR_FLOW_DST_PORT) {
+			h->pdst = req->nr_dst_port;
+			k->pdst = htons(0xffff);
+		}
+	} else if (m & NR_FLOW_IPV6) {
+		struct ethtool_usrip6_spec *h = &fs->h_u.usr_ip6_spec;
+		struct ethtool_usrip6_spec *k = &fs->m_u.usr_ip6_spec;
+
+		fs->flow_type = IPV6_USER_FLOW;
+		if (m & NR_FLOW_SRC_IP) {
+			memcpy(h->ip6src, req->nr_src_ip, sizeof(h->ip6src));
+			memset(k->ip6src, 0xff, sizeof(k->ip6src));
+		}
+		if (m & NR_FLOW_DST_IP) {
+			memcpy(h->ip6dst, req->nr_dst_ip, sizeof(h->ip6dst));
+			memset(k->ip6dst, 0xff, sizeof(k->ip6dst));
+		}
+		if (m & NR_FLOW_PROTO) {
+			h->l4_proto = req->nr_proto;
+			k->l4_proto = 0xff;
+		}
+	} else if (l4_type >= 0) {
+		struct ethtool_tcpip4_spec *h = &fs->h_u.tcp_ip4_spec;
+		struct ethtool_tcpip4_spec *k = &fs->m_u.tcp_ip4_spec;
+
+		fs->flow_type = l4_type;
+		if (m & NR_FLOW_SRC_IP) {
+			memcpy(&h->ip4src, req->nr_src_ip, sizeof(h->ip4src));
+			k->ip4src = htonl(0xffffffff);
+		}
+		if (m & NR_FLOW_DST_IP) {
+			memcpy(&h->ip4dst, req->nr_dst_ip, sizeof(h->ip4dst));
+			k->ip4dst = htonl(0xffffffff);
+		}
+		if (m & NR_FLOW_SRC_PORT) {
+			h->psrc = req->nr_src_port;
+			k->psrc = htons(0xffff);
+		}
+		if (m & NR_FLOW_DST_PORT) {
+			h->pdst = req->nr_dst_port;
+			k->pdst = htons(0xffff);
+		}
+	} else {
+		struct ethtool_usrip4_spec *h = &fs->h_u.usr_ip4_spec;
+		struct ethtool_usrip4_spec *k = &fs->m_u.usr_ip4_spec;
+
+		fs->flow_type = IP_USER_FLOW;
+		h->ip_ver = ETH_RX_NFC_IP4;
+		if (m & NR_FLOW_SRC_IP) {
+			memcpy(&h->ip4src, req->nr_src_ip, sizeof(h->ip4src));
+			k->ip4src = htonl(0xffffffff);
+		}
+		if (m & NR_FLOW_DST_IP) {
+			memcpy(&h->ip4dst, req->nr_dst_ip, sizeof(h->ip4dst));
+			k->ip4dst = htonl(0xffffffff);
+		}
+		if (m & NR_FLOW_PROTO) {
+			h->proto = req->nr_proto;
+			k->proto = 0xff;
+		}
+	}
+	fs->ring_cookie = req->nr_ring;
+	return 0;
+}
+
+/* Choose a free location for a new rule, as ethtool(8) does for the
+ * drivers that cannot choose one by themselves. Called with the rtnl
+ * lock held.
+ */
+static int
+linux_flow_rule_loc(struct ifnet *ifp, u32 *loc)
+{
+	const struct ethtool_ops *ops = ifp->ethtool_ops;
+	struct ethtool_rxnfc info;
+	unsigned long *used = NULL;
+	u32 *locs = NULL;
+	u32 i, size;
+	int error;
+
+	memset(&info, 0, sizeof(info));
+	info.cmd = ETHTOOL_GRXCLSRLCNT;
+	error = -ops->get_rxnfc(ifp, &info, NULL);
+	if (error)
+		return error;
+	if (info.data & RX_CLS_LOC_SPECIAL) {
+		*loc = RX_CLS_LOC_ANY;
+		return 0;
+	}
+	size = info.data;
+	if (size == 0)
+		return ENOSPC;
+
+	locs = kcalloc(info.rule_cnt + 1, sizeof(*locs), GFP_KERNEL);
+	used = kcalloc(BITS_TO_LONGS(size), sizeof(*used), GFP_KERNEL);
+	if (locs == NULL || used == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	info.cmd = ETHTOOL_GRXCLSRLALL;
+	error = -ops->get_rxnfc(ifp, &info, locs);
+	if (error)
+		goto out;
+	for (i = 0; i < info.rule_cnt; i++) {
+		if (locs[i] < size)
+			set_bit(locs[i], used);
+	}
+	*loc = find_first_zero_bit(used, size);
+	if (*loc >= size)
+		error = ENOSPC;
+out:
+	kfree(used);
+	kfree(locs);
+	return error;
+}
+#endif /* NETMAP_LINUX_HAVE_SET_RXNFC */
+
+int
+nm_os_flow_rule(struct ifnet *ifp, struct nmreq_flow_rule *req, int add)
+{
+#ifdef NETMAP_LINUX_HAVE_SET_RXNFC
+	const struct ethtool_ops *ops = ifp->ethtool_ops;
+	struct ethtool_rxnfc cmd;
+	int error = 0;
+
+	if (ops == NULL || ops->get_rxnfc == NULL || ops->set_rxnfc == NULL)
+		return EOPNOTSUPP;
+
+	memset(&cmd, 0, sizeof(cmd));
+	if (add) {
+		cmd.cmd = ETHTOOL_SRXCLSRLINS;
+		error = linux_flow_rule_spec(req, &cmd.fs);
+		if (error)
+			return error;
+	} else {
+		cmd.cmd = ETHTOOL_SRXCLSRLDEL;
+	}
+	cmd.fs.location = req->nr_rule_id;
+
+	rtnl_lock();
+	if (add && req->nr_rule_id == NR_FLOW_RULE_ANY)
+		error = linux_flow_rule_loc(ifp, &cmd.fs.location);
+	if (!error)
+		error = -ops->set_rxnfc(ifp, &cmd);
+	rtnl_unlock();
+	if (!error && add)
+		req->nr_rule_id = cmd.fs.location;
+	if (error && netmap_verbose)
+		nm_prerr("%s: cannot %s rule %u (%d)", ifp->name,
+			 add ? "install" : "remove", req->nr_rule_id, error);
+	return error;
+#else /* !NETMAP_LINUX_HAVE_SET_RXNFC */
+	return EOPNOTSUPP;
+#endif /* NETMAP_LINUX_HAVE_SET_RXNFC */
+}
+
+#ifdef WITH_TRACE
+#define CREATE_TRACE_POINTS
+#include "netmap_trace.h"
+
+void
+nm_os_trace_sync(struct netmap_kring *kring, u_int head, u_int cur)
+{
+	trace_netmap_sync(kring->name, kring->tx == NR_TX, kring->nr_hwcur,
+			  kring->nr_hwtail, head, cur);
+}
+
+void
+nm_os_trace_bwrap_intr(struct netmap_kring *kring, u_int slots)
+{
+	trace_netmap_bwrap_intr(kring->name, slots);
+}
+
+void
+nm_os_trace_vale_flush(struct netmap_kring *kring, u_int slots)
+{
+	trace_netmap_vale_flush(kring->name, slots);
+}
+
+void
+nm_os_trace_latency(struct netmap_kring *kring, uint64_t ns)
+{
+	trace_netmap_latency(kring->name, ns);
+}
+
+uint64_t
+nm_os_trace_ns(void)
+{
+	return ktime_get_ns();
+}
+#endif /* WITH_TRACE */
+
 #ifdef WITH_EXTMEM
 struct nm_os_extmem {
 	struct page **pages;
@@ -409,14 +650,48 @@ nm_os_csum_fold(rawsum_t cur_sum)
 	return csum_fold(cur_sum);
 }
 
-/* on linux we send up one packet at a time */
+/*
+ * On linux the skbs are chained through skb->next and handed to the
+ * stack in a single batch on the last call (m == NULL, prev == head).
+ * The batch goes through netif_receive_skb_list() where available,
+ * which saves the enqueue to the per-cpu backlog and the softirq
+ * round trip of netif_rx(). With interrupts disabled we cannot run
+ * the receive path here, so we fall back to netif_rx().
+ */
 void *
 nm_os_send_up(struct ifnet *ifp, struct mbuf *m, struct mbuf *prev)
 {
+	struct mbuf *next;
+#ifdef NETMAP_LINUX_HAVE_RECEIVE_SKB_LIST
+	LIST_HEAD(batch);
+#endif /* NETMAP_LINUX_HAVE_RECEIVE_SKB_LIST */
+
 	(void)ifp;
-	(void)prev;
-	m->priority = NM_MAGIC_PRIORITY_RX; /* do not reinject to netmap */
-	netif_rx(m);
+	if (m != NULL) {
+		m->priority = NM_MAGIC_PRIORITY_RX; /* do not reinject to netmap */
+		m->next = NULL;
+		if (prev != NULL)
+			prev->next = m;
+		return m;
+	}
+
+#ifdef NETMAP_LINUX_HAVE_RECEIVE_SKB_LIST
+	if (!irqs_disabled()) {
+		for (m = prev; m != NULL; m = next) {
+			next = m->next; /* skb->list overlaps skb->next */
+			list_add_tail(&m->list, &batch);
+		}
+		local_bh_disable();
+		netif_receive_skb_list(&batch);
+		local_bh_enable();
+		return NULL;
+	}
+#endif /* NETMAP_LINUX_HAVE_RECEIVE_SKB_LIST */
+	for (m = prev; m != NULL; m = next) {
+		next = m->next;
+		m->next = NULL;
+		netif_rx(m);
+	}
 	return NULL;
 }
 
@@ -464,6 +739,7 @@ generic_timer_handler(struct hrtimer *t)
 	mit->mit_pending = 0;
 	/* below is a variation of netmap_generic_irq  XXX revise */
 	if (nm_netmap_on(mit->mit_na)) {
+		mit->mit_tot_notify++;
 		netmap_common_irq(mit->mit_na, mit->mit_ring_idx, &work_done);
 		generic_rate(0, 0, 0, 0, 0, 1);
 	}
@@ -488,13 +764,15 @@ nm_os_mitigation_init(struct nm_generic_mit *mit, int idx,
 void
 nm_os_mitigation_start(struct nm_generic_mit *mit)
 {
-	hrtimer_start(&mit->mit_timer, ktime_set(0, netmap_generic_mit), HRTIMER_MODE_REL);
+	hrtimer_start(&mit->mit_timer,
+		ktime_set(0, generic_mit_interval(mit, 0)), HRTIMER_MODE_REL);
 }
 
 void
 nm_os_mitigation_restart(struct nm_generic_mit *mit)
 {
-	hrtimer_forward_now(&mit->mit_timer, ktime_set(0, netmap_generic_mit));
+	hrtimer_forward_now(&mit->mit_timer,
+		ktime_set(0, generic_mit_interval(mit, 1)));
 }
 
 int
@@ -509,6 +787,51 @@ nm_os_mitigation_cleanup(struct nm_generic_mit *mit)
 	hrtimer_cancel(&mit->mit_timer);
 }
 
+struct nm_os_timer {
+	struct hrtimer t;
+	void (*fn)(void *);
+	void *arg;
+};
+
+static enum hrtimer_restart
+nm_os_timer_handler(struct hrtimer *t)
+{
+	struct nm_os_timer *nt = container_of(t, struct nm_os_timer, t);
+
+	nt->fn(nt->arg);
+	return HRTIMER_NORESTART;
+}
+
+struct nm_os_timer *
+nm_os_timer_create(void (*fn)(void *), void *arg)
+{
+	struct nm_os_timer *nt = nm_os_malloc(sizeof(*nt));
+
+	if (nt == NULL)
+		return NULL;
+	hrtimer_init(&nt->t, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	nt->t.function = &nm_os_timer_handler;
+	nt->fn = fn;
+	nt->arg = arg;
+	return nt;
+}
+
+void
+nm_os_timer_arm(struct nm_os_timer *nt, u_int us)
+{
+	/* also from the callback, or while it runs */
+	if (!hrtimer_is_queued(&nt->t))
+		hrtimer_start(&nt->t, ktime_set(0, us * 1000UL),
+			HRTIMER_MODE_REL);
+}
+
+void
+nm_os_timer_destroy(struct nm_os_timer *nt)
+{
+	hrtimer_cancel(&nt->t);
+	nm_os_free(nt);
+}
+
 
 
 /* #################### GENERIC ADAPTER SUPPORT ################### */
@@ -958,15 +1281,14 @@ nm_os_catch_tx(struct netmap_generic_adapter *gna, int intercept)
 /* Used to cover cases where ETH_P_802_3_MIN is undefined */
 #define NM_ETH_P_802_3_MIN 0x0600
 
-/* Transmit routine used by generic_netmap_txsync(). Returns 0 on success
-   and -1 on error (which may be packet drops or other errors). */
-int
-nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
+/* Fill the mbuf of a->m with the netmap buffer and mark it so that
+ * generic_ndo_start_xmit() passes it to the driver. */
+static void
+generic_xmit_prepare(struct nm_os_gen_arg *a)
 {
 	struct mbuf *m = a->m;
 	struct ifnet *ifp = a->ifp;
 	u_int len = a->len;
-	netdev_tx_t ret;
 	uint16_t ethertype;
 
 	/* We know that the driver needs to prepend LL_RESERVED_SPACE(ifp) bytes
@@ -1049,7 +1371,126 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 		nm_prlim(1, "Warning: resetting skb->next as it is not NULL\n");
 		m->next = NULL;
 	}
+}
+
+/* Hand the mbufs pending in a->head to the driver, using the xmit_more
+ * hint to defer the doorbell until the last one. If the driver stops
+ * the queue in the middle of the batch, the remaining mbufs go through
+ * dev_queue_xmit(), so that the qdisc holds them until there is room. */
+static void
+generic_xmit_flush(struct nm_os_gen_arg *a)
+{
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+	struct ifnet *ifp = a->ifp;
+	struct netdev_queue *txq = netdev_get_tx_queue(ifp, a->ring_nr);
+	struct mbuf *m = a->head, *next;
+	netdev_tx_t ret;
+
+	a->head = a->tail = NULL;
+	a->qlen = 0;
+
+	local_bh_disable();
+	HARD_TX_LOCK(ifp, txq, smp_processor_id());
+	while (m != NULL && !netif_xmit_frozen_or_stopped(txq)) {
+		next = m->next;
+		m->next = NULL;
+		/* Drivers ring the doorbell anyway when they stop the
+		 * queue, so a missing last packet does not stall it. */
+		ret = netdev_start_xmit(m, ifp, txq, next != NULL);
+		if (unlikely(!dev_xmit_complete(ret))) {
+			/* Not consumed, retry it through the qdisc. */
+			m->next = next;
+			break;
+		}
+		m = next;
+	}
+	HARD_TX_UNLOCK(ifp, txq);
+	local_bh_enable();
+
+	for (; m != NULL; m = next) {
+		next = m->next;
+		m->next = NULL;
+		m->priority = NM_MAGIC_PRIORITY_TX;
+		if (unlikely(dev_queue_xmit(m) != NET_XMIT_SUCCESS)) {
+			m->priority = 0;
+			nm_prlim(3, "Warning: dev_queue_xmit() is dropping");
+		}
+	}
+#endif /* NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
+}
 
+/* Batching bypasses the qdisc and the software checksum fallback of
+ * dev_queue_xmit(). The latter is done by generic_xmit_csum() where
+ * the kernel allows it, otherwise batching is not used together with
+ * netmap_generic_hwcsum. Each kring sends on its own device queue, so
+ * the queue must exist. */
+static inline int
+generic_xmit_batching(struct ifnet *ifp, u_int ring_nr)
+{
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+	struct netmap_generic_adapter *gna =
+		(struct netmap_generic_adapter *)NA(ifp);
+
+	return netmap_generic_txbatch > 1 && !gna->txqdisc &&
+#ifndef NETMAP_LINUX_HAVE_SKB_CSUM_HWOFFLOAD_HELP
+		!netmap_generic_hwcsum &&
+#endif /* !NETMAP_LINUX_HAVE_SKB_CSUM_HWOFFLOAD_HELP */
+		ring_nr < ifp->real_num_tx_queues;
+#else  /* !NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
+	return 0;
+#endif /* !NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
+}
+
+/* Compute in software the checksum that generic_xmit_prepare() asked
+ * to the device, if the device cannot do it, as validate_xmit_skb()
+ * does on the dev_queue_xmit() path. The frames are plain Ethernet,
+ * so the features of the device are those of the frame. */
+static inline void
+generic_xmit_csum(struct mbuf *m, struct ifnet *ifp)
+{
+#ifdef NETMAP_LINUX_HAVE_SKB_CSUM_HWOFFLOAD_HELP
+	if (m->ip_summed == CHECKSUM_PARTIAL &&
+	    unlikely(skb_csum_hwoffload_help(m, ifp->features))) {
+		nm_prlim(3, "Warning: checksum fallback failed");
+	}
+#endif /* NETMAP_LINUX_HAVE_SKB_CSUM_HWOFFLOAD_HELP */
+}
+
+/* Transmit routine used by generic_netmap_txsync(). Returns 0 on success
+   and -1 on error (which may be packet drops or other errors).
+   With netmap_generic_txbatch > 1 the mbufs are queued in a->head and
+   handed to the driver in batches; a call with a->addr == NULL sends
+   what is left. */
+int
+nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
+{
+	struct mbuf *m = a->m;
+	netdev_tx_t ret;
+
+	if (a->addr == NULL) {
+		generic_xmit_flush(a);
+		return 0;
+	}
+
+	if (generic_xmit_batching(a->ifp, a->ring_nr)) {
+		if (netif_xmit_frozen_or_stopped(
+				netdev_get_tx_queue(a->ifp, a->ring_nr))) {
+			/* Let generic_netmap_txsync() back off. */
+			return -1;
+		}
+		generic_xmit_prepare(a);
+		generic_xmit_csum(m, a->ifp);
+		if (a->tail == NULL)
+			a->head = m;
+		else
+			((struct mbuf *)a->tail)->next = m;
+		a->tail = m;
+		if (++a->qlen >= netmap_generic_txbatch)
+			generic_xmit_flush(a);
+		return 0;
+	}
+
+	generic_xmit_prepare(a);
 	ret = dev_queue_xmit(m);
 
 	if (unlikely(ret != NET_XMIT_SUCCESS)) {
@@ -1490,6 +1931,37 @@ out:
 }
 
 
+#if defined(NETMAP_LINUX_HAVE_IO_URING_CMD_H) || defined(NETMAP_LINUX_HAVE_URING_CMD)
+#ifdef NETMAP_LINUX_HAVE_IO_URING_CMD_H
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+/*
+ * io_uring support. An IORING_OP_URING_CMD with cmd_op NIOCTXSYNC or
+ * NIOCRXSYNC syncs the rings bound to the file as the ioctl would,
+ * and completes inline with 0 or -errno, so that the rings of many
+ * ports can be synced with one io_uring_enter(). Readiness is
+ * reported by (multishot) IORING_OP_POLL_ADD, which goes through
+ * linux_netmap_poll() and is woken up by the kring notifications
+ * like poll(2).
+ */
+static int
+linux_netmap_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct netmap_priv_d *priv = ioucmd->file->private_data;
+
+	switch (ioucmd->cmd_op) {
+	case NIOCTXSYNC:
+	case NIOCRXSYNC:
+		return -netmap_ioctl(priv, ioucmd->cmd_op, NULL, NULL, 0);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+#define NETMAP_LINUX_URING_CMD
+#endif /* HAVE_IO_URING_CMD_H || HAVE_URING_CMD */
+
 static struct file_operations netmap_fops = {
 	.owner = THIS_MODULE,
 	.open = linux_netmap_open,
@@ -1499,9 +1971,33 @@ static struct file_operations netmap_fops = {
 	.compat_ioctl = linux_netmap_compat_ioctl,
 #endif
 	.poll = linux_netmap_poll,
+#ifdef NETMAP_LINUX_URING_CMD
+	.uring_cmd = linux_netmap_uring_cmd,
+#endif
 	.release = linux_netmap_release,
 };
 
+struct netmap_priv_d *
+nm_os_priv_get(int fd, void **ref)
+{
+	struct file *filp = fget(fd);
+
+	if (filp == NULL)
+		return NULL;
+	if (filp->f_op != &netmap_fops || filp->private_data == NULL) {
+		fput(filp);
+		return NULL;
+	}
+	*ref = filp;
+	return filp->private_data;
+}
+
+void
+nm_os_priv_put(void *ref)
+{
+	fput((struct file *)ref);
+}
+
 
 #ifdef CONFIG_NET_NS
 #include <net/netns/generic.h>
@@ -1654,6 +2150,38 @@ nm_os_ncpus(void)
 	return nr_cpu_ids;
 }
 
+u_int
+nm_os_curcpu(void)
+{
+	return raw_smp_processor_id();
+}
+
+uint64_t
+nm_os_realtime_ns(void)
+{
+	return ktime_get_real_ns();
+}
+
+uint64_t
+nm_os_uptime_ns(void)
+{
+	return ktime_get_ns();
+}
+
+/* also keep out the softirqs, where the generic adapter runs */
+u_int
+nm_os_cpu_pin(void)
+{
+	local_bh_disable();
+	return smp_processor_id();
+}
+
+void
+nm_os_cpu_unpin(void)
+{
+	local_bh_enable();
+}
+
 struct nm_kctx {
 	struct mm_struct *mm;       /* to access guest memory */
 	struct task_struct *worker; /* the kernel thread */
@@ -1666,6 +2194,8 @@ struct nm_kctx {
 
 	/* integer to manage multiple worker contexts */
 	long type;
+
+	int kicked;		/* see nm_os_kctx_wakeup() */
 };
 
 static int
@@ -1711,6 +2241,33 @@ nm_os_kctx_worker_setaff(struct nm_kctx *nmk, int affinity)
 	nmk->affinity = affinity;
 }
 
+void
+nm_os_kctx_sleep_us(u_int us)
+{
+	usleep_range(us, us + us / 4 + 1);
+}
+
+int
+nm_os_kctx_wait_us(struct nm_kctx *nmk, u_int us)
+{
+	int kicked;
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	if (!READ_ONCE(nmk->kicked) && !kthread_should_stop())
+		schedule_timeout(usecs_to_jiffies(us));
+	__set_current_state(TASK_RUNNING);
+	kicked = xchg(&nmk->kicked, 0);
+	return kicked;
+}
+
+void
+nm_os_kctx_wakeup(struct nm_kctx *nmk)
+{
+	WRITE_ONCE(nmk->kicked, 1);
+	if (nmk->worker)
+		wake_up_process(nmk->worker);
+}
+
 struct nm_kctx *
 nm_os_kctx_create(struct nm_kctx_cfg *cfg, void *opaque)
 {
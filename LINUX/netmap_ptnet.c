@@ -66,11 +66,17 @@ struct ptnet_queue {
 	char msix_name[64];
 };
 
+/* Number of RX pages for which we keep a reference after they have
+ * been attached to an skb, to reuse them once the stack drops its own. */
+#define PTNET_RX_RECYCLE	256
+
 struct ptnet_rx_queue {
 	struct ptnet_queue q;
 	struct napi_struct napi;
 	struct page *rx_pool;
 	int rx_pool_num;
+	struct page *rx_recycle[PTNET_RX_RECYCLE];
+	unsigned int rx_recycle_next;
 #ifdef HANGCTRL
 #define HANG_INTVAL_MS		3000
 	struct timer_list hang_timer;
@@ -190,7 +196,9 @@ ptnet_copy_to_ring(struct xmit_copy_args *a,
 	}
 }
 
-#ifdef NETMAP_LINUX_HAVE_XMIT_MORE
+#if defined(NETMAP_LINUX_HAVE_NETDEV_XMIT_MORE)
+#define XMIT_MORE(skb) netdev_xmit_more()
+#elif defined(NETMAP_LINUX_HAVE_XMIT_MORE)
 #define XMIT_MORE(skb) skb->xmit_more
 #else
 #define XMIT_MORE(skb) false
@@ -308,16 +316,19 @@ ptnet_start_xmit(struct sk_buff *skb, struct net_device *netdev)
 	kring->rcur = a.ring->cur;
 	kring->rhead = a.ring->head;
 
-	if (!XMIT_MORE(skb)) {
+	/* If the stack has more packets for this queue, publish them
+	 * all together with the last one, unless we are about to stop
+	 * the queue. */
+	if (!XMIT_MORE(skb) || ptnet_tx_slots(a.ring) < pi->min_tx_slots) {
 		/* Tell the host to process the new packets, updating cur and
 		 * head in the CSB. */
 		nm_sync_kloop_appl_write(atok, kring->rcur, kring->rhead);
-	}
 
-	/* Ask for a kick from a guest to the host if needed. */
-	if (NM_ACCESS_ONCE(ktoa->kern_need_kick)) {
-		atok->sync_flags = NAF_FORCE_RECLAIM;
-		iowrite32(0, pq->kick);
+		/* Ask for a kick from a guest to the host if needed. */
+		if (NM_ACCESS_ONCE(ktoa->kern_need_kick)) {
+			atok->sync_flags = NAF_FORCE_RECLAIM;
+			iowrite32(0, pq->kick);
+		}
 	}
 
 	/* No more TX slots for further transmissions. We have to stop the
@@ -427,17 +438,54 @@ ptnet_rx_intr(int irq, void *data)
 static struct page *
 ptnet_alloc_page(struct ptnet_rx_queue *prq)
 {
-	struct page *p = prq->rx_pool;
+	struct page **rp = &prq->rx_recycle[prq->rx_recycle_next];
+	struct page *p = *rp;
+
+	if (++prq->rx_recycle_next == PTNET_RX_RECYCLE) {
+		prq->rx_recycle_next = 0;
+	}
+
+	/* The pages handed to the stack are reused in the same order,
+	 * as soon as we hold the only reference left. */
+	if (p) {
+		if (likely(page_count(p) == 1)) {
+			get_page(p);
+			return p;
+		}
+		/* Still in use, let the stack free it. */
+		put_page(p);
+		*rp = NULL;
+	}
 
+	p = prq->rx_pool;
 	if (p) {
 		prq->rx_pool = (struct page *)(p->private);
 		prq->rx_pool_num--;
 		p->private = (unsigned long)NULL;
-
-		return p;
+	} else {
+		p = alloc_page(GFP_ATOMIC);
+		if (unlikely(!p)) {
+			return NULL;
+		}
 	}
+	get_page(p);
+	*rp = p;
 
-	return alloc_page(GFP_ATOMIC);
+	return p;
+}
+
+static void
+ptnet_rx_recycle_fini(struct ptnet_rx_queue *prq)
+{
+	int i;
+
+	for (i = 0; i < PTNET_RX_RECYCLE; i++) {
+		if (prq->rx_recycle[i]) {
+			put_page(prq->rx_recycle[i]);
+			prq->rx_recycle[i] = NULL;
+		}
+	}
+	prq->rx_recycle_next = 0;
 }
 
 static inline void
@@ -653,34 +701,14 @@ ptnet_rx_poll(struct napi_struct *napi, int budget)
 		}
 
 		/*
-		 * We should always use napi_gro_receive() in place of
-		 * netif_receive_skb(). However, currently we have an
-		 * issue (probably due this driver and/or netmap) such
-		 * that when virtio-net header is not null using
-		 * napi_gro_receive() causes sometimes reordering
-		 * of two consecutive sk_buffs. This reordering usually
-		 * causes the network stack to issue a TCP DUPACK, and
-		 * so a retransmission on the sender side. This bug
-		 * seems to disappear if we use netif_receive_skb(skb)
-		 * here.
-		 *
-		 * I've also noticed that when the reordering happens,
-		 * i.e.
-		 *
-		 *    skb1, skb2 --> napi_gro_receive() --> skb2, skb1
-		 *
-		 * then it is always true that
-		 *
-		 *    (skb1->len == MTU+14) && (skb2->len > skb1->len)
-		 *    && skb_is_gso(skb1) == 0 && skb_is_gso(skb2) != 0
-		 *
-		 * where usually MTU == 1500.
+		 * All the packets must go through napi_gro_receive().
+		 * Passing some of them to netif_receive_skb() (e.g.,
+		 * the GSO ones) lets them overtake the ones still held
+		 * by GRO, which are only flushed on napi_complete(),
+		 * and the reordering causes TCP DUPACKs and
+		 * retransmissions on the sender side.
 		 */
-		if (have_vnet_hdr && vh->hdr.flags) {
-			netif_receive_skb(skb);
-		} else {
-			napi_gro_receive(napi, skb);
-		}
+		napi_gro_receive(napi, skb);
 
 		work_done ++;
 	}
@@ -849,6 +877,39 @@ ptnet_irqs_fini(struct ptnet_info *pi)
 #endif
 }
 
+/*
+ * Spread the CPUs over the TX queues, so that each CPU always
+ * transmits on the same queue, and the queues are all used.
+ */
+static void
+ptnet_set_xps(struct ptnet_info *pi, unsigned int queue_pairs)
+{
+#if defined(CONFIG_XPS) && defined(NETMAP_LINUX_HAVE_NETIF_SET_XPS_QUEUE)
+	cpumask_var_t mask;
+	unsigned int i;
+	int cpu, n;
+
+	if (queue_pairs < 2 || !zalloc_cpumask_var(&mask, GFP_KERNEL)) {
+		return;
+	}
+
+	for (i = 0; i < queue_pairs; i++) {
+		cpumask_clear(mask);
+		n = 0;
+		for_each_online_cpu(cpu) {
+			if (n++ % queue_pairs == i) {
+				cpumask_set_cpu(cpu, mask);
+			}
+		}
+		if (netif_set_xps_queue(pi->netdev, mask, i)) {
+			pr_warn("%s: failed to set XPS for queue %u\n",
+				pi->netdev->name, i);
+		}
+	}
+	free_cpumask_var(mask);
+#endif /* CONFIG_XPS && NETMAP_LINUX_HAVE_NETIF_SET_XPS_QUEUE */
+}
+
 static int ptnet_nm_register(struct netmap_adapter *na, int onoff);
 /*
  * ptnet_open - Called when a network interface is made active
@@ -982,6 +1043,7 @@ ptnet_close(struct net_device *netdev)
 		}
 		prq->rx_pool = NULL;
 		prq->rx_pool_num = 0;
+		ptnet_rx_recycle_fini(prq);
 	}
 
 
@@ -1448,6 +1510,7 @@ ptnet_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 	err = register_netdev(netdev);
 	if (err)
 		goto err_netreg;
+	ptnet_set_xps(pi, queue_pairs);
 
 	/* Read the nifp_offset for the passed-through interface. */
 	nifp_offset = ioread32(ioaddr + PTNET_IO_NIFP_OFS);
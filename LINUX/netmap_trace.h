@@ -0,0 +1,119 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tracepoints of the netmap hot paths, built with --enable-trace.
+ * They show up under /sys/kernel/tracing/events/netmap/ and are
+ * fired from the nm_os_trace_*() hooks in netmap_linux.c.
+ * The ring name is copied in the event, truncated to 31 characters.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM netmap
+
+#if !defined(_NETMAP_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _NETMAP_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+#define NM_TRACE_NAMSIZ	32
+
+/* start of a txsync or rxsync, with the new head and cur */
+TRACE_EVENT(netmap_sync,
+	TP_PROTO(const char *name, int tx, u32 hwcur, u32 hwtail,
+		 u32 head, u32 cur),
+	TP_ARGS(name, tx, hwcur, hwtail, head, cur),
+	TP_STRUCT__entry(
+		__array(char, name, NM_TRACE_NAMSIZ)
+		__field(int, tx)
+		__field(u32, hwcur)
+		__field(u32, hwtail)
+		__field(u32, head)
+		__field(u32, cur)
+	),
+	TP_fast_assign(
+		memcpy(__entry->name, name, NM_TRACE_NAMSIZ - 1);
+		__entry->name[NM_TRACE_NAMSIZ - 1] = '\0';
+		__entry->tx = tx;
+		__entry->hwcur = hwcur;
+		__entry->hwtail = hwtail;
+		__entry->head = head;
+		__entry->cur = cur;
+	),
+	TP_printk("%s %s hwcur %u hwtail %u head %u cur %u", __entry->name,
+		  __entry->tx ? "txsync" : "rxsync", __entry->hwcur,
+		  __entry->hwtail, __entry->head, __entry->cur)
+);
+
+DECLARE_EVENT_CLASS(netmap_slots,
+	TP_PROTO(const char *name, u32 slots),
+	TP_ARGS(name, slots),
+	TP_STRUCT__entry(
+		__array(char, name, NM_TRACE_NAMSIZ)
+		__field(u32, slots)
+	),
+	TP_fast_assign(
+		memcpy(__entry->name, name, NM_TRACE_NAMSIZ - 1);
+		__entry->name[NM_TRACE_NAMSIZ - 1] = '\0';
+		__entry->slots = slots;
+	),
+	TP_printk("%s slots %u", __entry->name, __entry->slots)
+);
+
+/* a NIC attached to a VALE switch forwards what it has received */
+DEFINE_EVENT(netmap_slots, netmap_bwrap_intr,
+	TP_PROTO(const char *name, u32 slots),
+	TP_ARGS(name, slots)
+);
+
+/* a tx ring of a VALE port forwards a batch */
+DEFINE_EVENT(netmap_slots, netmap_vale_flush,
+	TP_PROTO(const char *name, u32 slots),
+	TP_ARGS(name, slots)
+);
+
+/* a latency sample, see nm_trace_lat_sync() */
+TRACE_EVENT(netmap_latency,
+	TP_PROTO(const char *name, u64 ns),
+	TP_ARGS(name, ns),
+	TP_STRUCT__entry(
+		__array(char, name, NM_TRACE_NAMSIZ)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		memcpy(__entry->name, name, NM_TRACE_NAMSIZ - 1);
+		__entry->name[NM_TRACE_NAMSIZ - 1] = '\0';
+		__entry->ns = ns;
+	),
+	TP_printk("%s %llu ns", __entry->name,
+		  (unsigned long long)__entry->ns)
+);
+
+#endif /* _NETMAP_TRACE_H_ */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE netmap_trace
+#include <trace/define_trace.h>
@@ -40,6 +40,8 @@ struct netmap_veth_adapter {
 	struct netmap_hw_adapter up;
 	struct netmap_veth_adapter *peer;
 	int peer_ref;
+	/* allocator of this end while it borrows the one of the peer */
+	struct netmap_mem_d *own_mem;
 };
 
 /* To be called under RCU read lock. This also sets peer_ref in the
@@ -74,6 +76,45 @@ veth_get_peer_na(struct netmap_adapter *na)
 	return &vna->peer->up.up;
 }
 
+/*
+ * The two ends share their rings and swap buffers like the ends of a
+ * pipe, so they must use the same allocator. The end that registers
+ * first lends its allocator to the other, which gets its own back
+ * when the shared rings are deleted.
+ */
+static int
+veth_netmap_share_mem(struct netmap_adapter *na, struct netmap_adapter *peer_na)
+{
+	struct netmap_veth_adapter *pvna =
+		(struct netmap_veth_adapter *)peer_na;
+
+	if (peer_na->nm_mem == na->nm_mem)
+		return 0;
+	if (peer_na->active_fds > 0 || (peer_na->na_flags & NAF_MEM_OWNER)) {
+		nm_prerr("%s and %s use different allocators", na->name,
+				peer_na->name);
+		return EINVAL;
+	}
+	if (pvna->own_mem == NULL)
+		pvna->own_mem = peer_na->nm_mem;
+	else
+		netmap_mem_put(peer_na->nm_mem);
+	peer_na->nm_mem = netmap_mem_get(na->nm_mem);
+	return 0;
+}
+
+static void
+veth_netmap_restore_mem(struct netmap_adapter *na)
+{
+	struct netmap_veth_adapter *vna = (struct netmap_veth_adapter *)na;
+
+	if (vna->own_mem != NULL) {
+		netmap_mem_put(na->nm_mem);
+		na->nm_mem = vna->own_mem;
+		vna->own_mem = NULL;
+	}
+}
+
 static void
 veth_netmap_dtor(struct netmap_adapter *na)
 {
@@ -84,6 +125,7 @@ veth_netmap_dtor(struct netmap_adapter *na)
 		vna->peer->peer = NULL;
 		netmap_adapter_put(&vna->peer->up.up);
 	}
+	veth_netmap_restore_mem(na);
 }
 
 /*
@@ -108,6 +150,12 @@ veth_netmap_reg(struct netmap_adapter *na, int onoff)
 	if (!peer_na) {
 		return EINVAL;
 	}
+	if (onoff && peer_na->nm_mem != na->nm_mem) {
+		/* the peer rings are already in another allocator */
+		nm_prerr("%s must use the allocator of %s", na->name,
+				peer_na->name);
+		return EINVAL;
+	}
 
 	was_up = netif_running(ifp);
 	if (na->active_fds == 0 && was_up) {
@@ -187,8 +235,16 @@ veth_netmap_krings_create(struct netmap_adapter *na)
 		return ENXIO;
 	}
 
-	if (vna->peer_ref)
-		return netmap_pipe_krings_create_both(na, peer_na);
+	if (vna->peer_ref) {
+		int error = veth_netmap_share_mem(na, peer_na);
+
+		if (error)
+			return error;
+		error = netmap_pipe_krings_create_both(na, peer_na);
+		if (error)
+			veth_netmap_restore_mem(peer_na);
+		return error;
+	}
 
 	return 0;
 }
@@ -216,6 +272,7 @@ veth_netmap_krings_delete(struct netmap_adapter *na)
 	}
 
 	netmap_pipe_krings_delete_both(na, peer_na);
+	veth_netmap_restore_mem(peer_na);
 
 	netmap_adapter_put(&vna->peer->up.up);
 	vna->peer_ref = 0;
@@ -158,7 +158,7 @@ void win32_init_lookaside_buffers(struct net_device *ifp){
 	if (!ifp->lookasideListsAlreadyAllocated) {
 		ifp->lookasideListsAlreadyAllocated = TRUE;
 		ExInitializeNPagedLookasideList(&ifp->mbuf_pool, NULL, NULL, 0, sizeof(struct mbuf), M_DEVBUF, 0);
-		ExInitializeNPagedLookasideList(&ifp->mbuf_packets_pool, NULL, NULL, 0, 2048, M_DEVBUF, 0);
+		ExInitializeNPagedLookasideList(&ifp->mbuf_packets_pool, NULL, NULL, 0, WIN_MBUF_PKT_SIZE, M_DEVBUF, 0);
 	}
 }
 
@@ -183,7 +183,12 @@ void win32_clear_lookaside_buffers(struct net_device *ifp){
 struct mbuf *
 win_make_mbuf(struct net_device *ifp, uint32_t length, const char *data)
 {
-	struct mbuf *m = ExAllocateFromNPagedLookasideList(&ifp->mbuf_pool);
+	struct mbuf *m;
+
+	if (length > WIN_MBUF_PKT_SIZE) {
+		return NULL;
+	}
+	m = ExAllocateFromNPagedLookasideList(&ifp->mbuf_pool);
 	//DbgPrint("win_make_mbuf - Data: %p - length: %i", data, length);
 	if (m == NULL) {
 		DbgPrint("Netmap.sys: Failed to allocate memory from the mbuf!!!");
@@ -197,6 +202,7 @@ win_make_mbuf(struct net_device *ifp, uint32_t length, const char *data)
 		return NULL;
 	}
 	m->dev = ifp;
+	m->pkt_borrowed = FALSE;
 	if (data) // XXX otherwise zero memory ?
 		RtlCopyMemory(m->pkt, data, length);
 	return m;
@@ -244,6 +250,113 @@ windows_handle_tx(struct net_device *ifp, uint32_t length, const char *data)
 	return NULL;
 }
 
+/*
+ * Wrap one NET_BUFFER in an mbuf. If 'borrow' is set and the miniport
+ * data is contiguous, the mbuf points straight into the NDIS buffer,
+ * which is only valid until the NBL chain is returned; otherwise the
+ * data is copied (and gathered, if it spans several MDLs) into a
+ * buffer of the packets pool.
+ */
+static struct mbuf *
+win_nb_to_mbuf(struct net_device *ifp, PNET_BUFFER nb, int borrow)
+{
+	uint32_t length = NET_BUFFER_DATA_LENGTH(nb);
+	struct mbuf *m;
+	PVOID data;
+
+	if (borrow) {
+		data = NdisGetDataBuffer(nb, length, NULL, 1, 0);
+		if (data != NULL) {
+			m = ExAllocateFromNPagedLookasideList(&ifp->mbuf_pool);
+			if (m == NULL)
+				return NULL;
+			m->m_len = length;
+			m->dev = ifp;
+			m->pkt = data;
+			m->pkt_borrowed = TRUE;
+			return m;
+		}
+	}
+	m = win_make_mbuf(ifp, length, NULL);
+	if (m == NULL)
+		return NULL;
+	/* NDIS copies into m->pkt only if the data is not contiguous */
+	data = NdisGetDataBuffer(nb, length, m->pkt, 1, 0);
+	if (data == NULL) {
+		m_freem(m);
+		return NULL;
+	}
+	if (data != m->pkt)
+		RtlCopyMemory(m->pkt, data, length);
+	return m;
+}
+
+#define WIN_RX_BATCH	64
+
+/*
+ * Batched version of windows_handle_rx(), called by nm-ndis with the
+ * whole NBL chain of a receive indication. Packets are passed to the
+ * generic adapter WIN_RX_BATCH at a time, so the receiver is woken
+ * up once per batch. In direct receive mode (dev.netmap.generic_rxdirect)
+ * generic_rx_direct() copies each packet into the netmap ring before
+ * we return, so the mbufs can borrow the miniport buffers and the
+ * data is copied once, straight into the netmap buffers.
+ * The caller returns the chain to NDIS.
+ */
+void
+windows_handle_rx_nbl(struct net_device *ifp, PNET_BUFFER_LIST nbl)
+{
+	struct netmap_generic_adapter *gna =
+		(struct netmap_generic_adapter *)NA(ifp);
+	struct mbuf *batch[WIN_RX_BATCH];
+	int borrow = gna->rxdirect;
+	PNET_BUFFER nb;
+	u_int i, n = 0;
+
+	for (; nbl != NULL; nbl = NET_BUFFER_LIST_NEXT_NBL(nbl)) {
+		for (nb = NET_BUFFER_LIST_FIRST_NB(nbl); nb != NULL;
+				nb = NET_BUFFER_NEXT_NB(nb)) {
+			struct mbuf *m = win_nb_to_mbuf(ifp, nb, borrow);
+
+			if (m == NULL)
+				continue;
+			batch[n++] = m;
+			if (n < WIN_RX_BATCH)
+				continue;
+			generic_rx_handler_batch(ifp, batch, n);
+			for (i = 0; i < n; i++)
+				m_freem(batch[i]);
+			n = 0;
+		}
+	}
+	if (n > 0) {
+		generic_rx_handler_batch(ifp, batch, n);
+		for (i = 0; i < n; i++)
+			m_freem(batch[i]);
+	}
+}
+
+/*
+ * Same as windows_handle_tx() for the NBL chain of a send request.
+ * The host rx ring keeps the mbufs after we return, so the data is
+ * always copied.
+ */
+void
+windows_handle_tx_nbl(struct net_device *ifp, PNET_BUFFER_LIST nbl)
+{
+	PNET_BUFFER nb;
+
+	for (; nbl != NULL; nbl = NET_BUFFER_LIST_NEXT_NBL(nbl)) {
+		for (nb = NET_BUFFER_LIST_FIRST_NB(nbl); nb != NULL;
+				nb = NET_BUFFER_NEXT_NB(nb)) {
+			struct mbuf *m = win_nb_to_mbuf(ifp, nb, 0);
+
+			if (m != NULL)
+				netmap_transmit(ifp, m);
+		}
+	}
+}
+
 /*
  * we default to always allocating and zeroing
  */
@@ -654,6 +767,8 @@ ioctlInternalDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 	/* tell ndis whom to call when a packet arrives */
 	data->handle_rx = &windows_handle_rx;
 	data->handle_tx = &windows_handle_tx;
+	data->handle_rx_nbl = &windows_handle_rx_nbl;
+	data->handle_tx_nbl = &windows_handle_tx_nbl;
 
 	/* function(s) to access interface parameters */
 	ndis_hooks.ndis_regif = data->ndis_regif;
@@ -933,6 +1048,29 @@ nm_os_ifnet_mtu(struct ifnet *ifp)
        return 1500; /* XXX hardwired */
 }
 
+int
+nm_os_ifnet_numa_node(struct ifnet *ifp)
+{
+       return -1; /* unknown */
+}
+
+int
+nm_os_flow_rule(struct ifnet *ifp, struct nmreq_flow_rule *req, int add)
+{
+       return EOPNOTSUPP;
+}
+
+struct netmap_priv_d *
+nm_os_priv_get(int fd, void **ref)
+{
+       return NULL;
+}
+
+void
+nm_os_priv_put(void *ref)
+{
+}
+
 /*
  * Mitigation support
  */
@@ -1010,12 +1148,52 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit)
 	//hrtimer_cancel(&mit->mit_timer);
 }
 
+struct nm_os_timer *
+nm_os_timer_create(void (*fn)(void *), void *arg)
+{
+	// TODO
+	return NULL;
+}
+
+void
+nm_os_timer_arm(struct nm_os_timer *nt, u_int us)
+{
+	// TODO
+}
+
+void
+nm_os_timer_destroy(struct nm_os_timer *nt)
+{
+	// TODO
+}
+
 u_int
 nm_os_ncpus(void)
 {
 	return 1;  // TODO
 }
 
+u_int
+nm_os_curcpu(void)
+{
+	return 0;  // TODO
+}
+
+uint64_t
+nm_os_realtime_ns(void)
+{
+	LARGE_INTEGER tm;
+
+	KeQuerySystemTime(&tm);	/* 100ns units since 1601 */
+	return (uint64_t)(tm.QuadPart - 116444736000000000LL) * 100;
+}
+
+uint64_t
+nm_os_uptime_ns(void)
+{
+	return (uint64_t)KeQueryInterruptTime() * 100;
+}
+
 int
 nm_os_mbuf_has_csum_offld(struct mbuf *m)
 {
@@ -1051,6 +1229,25 @@ nm_os_kctx_worker_setaff(struct nm_kctx *nmk, int affinity)
 	// TODO
 }
 
+void
+nm_os_kctx_sleep_us(u_int us)
+{
+	// TODO
+}
+
+int
+nm_os_kctx_wait_us(struct nm_kctx *nmk, u_int us)
+{
+	// TODO
+	return 0;
+}
+
+void
+nm_os_kctx_wakeup(struct nm_kctx *nmk)
+{
+	// TODO
+}
+
 struct nm_kctx *
 nm_os_kctx_create(struct nm_kctx_cfg *cfg, void *opaque)
 {
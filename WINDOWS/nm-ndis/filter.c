@@ -186,6 +186,8 @@ Return Value:
 	    // prepare input parameters returned by the netmap ioctl
 	    netmap_hooks.handle_tx = NULL;
 	    netmap_hooks.handle_rx = NULL;
+	    netmap_hooks.handle_tx_nbl = NULL;
+	    netmap_hooks.handle_rx_nbl = NULL;
 	    // and output parameters that we pass to it
 		netmap_hooks.ndis_regif = &ndis_regif;
 		netmap_hooks.ndis_rele = &ndis_rele;
@@ -823,6 +825,8 @@ Return Value:
 		// prepare input parameters returned by the netmap ioctl
 		netmap_hooks.handle_tx = NULL;
 		netmap_hooks.handle_rx = NULL;
+		netmap_hooks.handle_tx_nbl = NULL;
+		netmap_hooks.handle_rx_nbl = NULL;
 		// telle netmap module we are unloading
 		netmap_hooks.ndis_regif = NULL;
 		netmap_hooks.ndis_rele = NULL;
@@ -1502,9 +1506,15 @@ Arguments:
 	 * Unless SendFlags says so, the packet stays alive and we can queue the packet
 	 * until we send the completion. For netmap, this is useful because we
 	 * can write the handle_tx as a function that queues the packets in an mbq
-	 * XXX at the moment, however, just make a deep copy
+	 * XXX at the moment, however, just make a deep copy.
+	 * handle_tx_nbl, if available, takes the whole chain in one call.
 	 */
-        if (netmap_hooks.handle_tx != NULL && (pFilter->intercept & NM_WIN_CATCH_TX)) {
+        if (netmap_hooks.handle_tx_nbl != NULL && (pFilter->intercept & NM_WIN_CATCH_TX)) {
+	    netmap_hooks.handle_tx_nbl(pFilter->ifp, NetBufferLists);
+	    /* we are done with the packets */
+	    NdisFSendNetBufferListsComplete(pFilter->FilterHandle, NetBufferLists, SendFlags);
+        }
+        else if (netmap_hooks.handle_tx != NULL && (pFilter->intercept & NM_WIN_CATCH_TX)) {
 	    int result = -1;
 	    PNET_BUFFER pkt = NULL;
 	    PNET_BUFFER_LIST current_list = NetBufferLists;
@@ -1769,9 +1779,21 @@ N.B.: It is important to check the ReceiveFlags in NDIS_TEST_RECEIVE_CANNOT_PEND
         }
 
 	/*
-	 * path for packets from the NIC going to a netmap ring
+	 * path for packets from the NIC going to a netmap ring.
+	 * handle_rx_nbl, if available, takes the whole chain in one call
+	 * and notifies the netmap receiver once per batch.
 	 */
-	if (netmap_hooks.handle_rx != NULL && (pFilter->intercept & NM_WIN_CATCH_RX))
+	if (netmap_hooks.handle_rx_nbl != NULL && (pFilter->intercept & NM_WIN_CATCH_RX))
+	{
+		netmap_hooks.handle_rx_nbl(pFilter->ifp, NetBufferLists);
+		if (NDIS_TEST_RECEIVE_CAN_PEND(ReceiveFlags))
+		{
+			NdisFReturnNetBufferLists(pFilter->FilterHandle, NetBufferLists,
+				NDIS_TEST_RECEIVE_AT_DISPATCH_LEVEL(ReceiveFlags) ?
+				NDIS_RETURN_FLAGS_DISPATCH_LEVEL : 0);
+		}
+	}
+	else if (netmap_hooks.handle_rx != NULL && (pFilter->intercept & NM_WIN_CATCH_RX))
 	{
 		int result = -1;
 		PNET_BUFFER pkt = NULL;
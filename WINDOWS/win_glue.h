@@ -289,6 +289,7 @@ struct mbuf {
 	uint32_t		m_len;
 	struct net_device	*dev;
 	PVOID			pkt;
+	BOOLEAN			pkt_borrowed;	/* pkt points into an NDIS buffer */
 	void*(*netmap_default_mbuf_destructor)(struct mbuf *m);
 };
 
@@ -299,6 +300,9 @@ typedef struct _FUNCTION_POINTER_XCHANGE {
 	/* ndis -> netmap calls */
 	struct NET_BUFFER* (*handle_rx)(struct net_device*, uint32_t length, const char* data);
 	struct NET_BUFFER* (*handle_tx)(struct net_device*, uint32_t length, const char* data);
+	/* same as above for a whole NBL chain, NULL if not supported */
+	void (*handle_rx_nbl)(struct net_device*, PNET_BUFFER_LIST nbl);
+	void (*handle_tx_nbl)(struct net_device*, PNET_BUFFER_LIST nbl);
 
 	/* netmap -> ndis calls */
 	NTSTATUS (*ndis_regif)(struct net_device *ifp);
@@ -313,6 +317,7 @@ typedef struct _FUNCTION_POINTER_XCHANGE {
 #define GEN_TX_MBUF_IFP(m)			m->dev
 #define MBUF_LEN(m)				((m)->m_len)
 #define MBUF_TXQ(m)                             0
+#define MBUF_HASH(m)                            0
 
 int MBUF_TRANSMIT(struct netmap_adapter *na, struct ifnet *ifp, struct mbuf *m);
 
@@ -328,6 +333,9 @@ struct device;	// XXX unused, in some place in netmap_mem2.c
 #define bcopy(_s, _d, _l)			RtlCopyMemory(_d, _s, _l)
 #define bzero(addr, size)			RtlZeroMemory(addr, size)
 
+/* size of the buffers of the mbuf packets pool */
+#define WIN_MBUF_PKT_SIZE	2048
+
 struct mbuf *win_make_mbuf(struct net_device *, uint32_t, const char *);
 
 #define nm_os_get_mbuf(ifp, _l)	win_make_mbuf(ifp, _l, NULL)
@@ -338,7 +346,7 @@ static inline void
 win32_ndis_packet_freem(struct mbuf* m)
 {
 	if (m != NULL) {
-		if (m->pkt != NULL) {
+		if (m->pkt != NULL && !m->pkt_borrowed) {
 			//free(m->pkt, M_DEVBUF);
 			ExFreeToNPagedLookasideList(&m->dev->mbuf_packets_pool, m->pkt);
 			m->pkt = NULL;
@@ -354,7 +362,7 @@ win32_ndis_packet_freem(struct mbuf* m)
  */
 #define m_devget(data, len, offset, dev, fn)		win_make_mbuf(dev, len, data)
 #define m_freem(mbuf)					win32_ndis_packet_freem(mbuf);
-#define m_copydata(source, offset, length, dst)		RtlCopyMemory(dst, source->pkt, length)
+#define m_copydata(source, offset, length, dst)		RtlCopyMemory(dst, (char *)(source)->pkt + (offset), length)
 
 
 #define le64toh(x)		_byteswap_uint64(x)	//defined in intrin.h
@@ -9,23 +9,57 @@
  * $FreeBSD$
  */
 
+#define _GNU_SOURCE	/* for CPU_SET() */
 #include <libnetmap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/poll.h>
 #include <sys/ioctl.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#ifdef __FreeBSD__
+#include <pthread_np.h> /* pthread w/ affinity */
+#include <sys/cpuset.h> /* cpu_set */
+#endif /* __FreeBSD__ */
+
+#ifdef linux
+#define cpuset_t        cpu_set_t
+#endif
+
+#if defined(__APPLE__) || defined(_WIN32)
+#define cpuset_t        uint64_t        // XXX
+#define CPU_ZERO(p)	(*(p) = 0)
+#define CPU_SET(i, p)	(*(p) |= 1ULL << ((i) & 0x3f))
+#define pthread_setaffinity_np(a, b, c) ((void)a, 0)
+#endif
+
 #if defined(_WIN32)
 #define BUSYWAIT
 #endif
 
 static int verbose = 0;
 
-static int do_abort = 0;
+static volatile int do_abort = 0;
 static int zerocopy = 1; /* enable zerocopy if possible */
 
+/*
+ * A forwarding context: the two ports (or the same ring pair of the
+ * two ports, with several threads) and the packets moved each way.
+ */
+struct fwd_ctx {
+	struct nmport_d *pa, *pb;
+	char msg_a2b[256], msg_b2a[256];
+	int zerocopy;
+	int affinity;		/* cpu, -1 for none */
+	pthread_t thread;
+	volatile uint64_t a2b, b2a;
+};
+
 static void
 sigint_h(int sig)
 {
@@ -69,7 +103,7 @@ tx_slots_avail(struct nmport_d *d)
  */
 static int
 rings_move(struct netmap_ring *rxring, struct netmap_ring *txring,
-	      u_int limit, const char *msg)
+	      u_int limit, int zerocopy, const char *msg)
 {
 	u_int j, k, m = 0;
 
@@ -137,7 +171,7 @@ rings_move(struct netmap_ring *rxring, struct netmap_ring *txring,
 /* Move packets from source port to destination port. */
 static int
 ports_move(struct nmport_d *src, struct nmport_d *dst, u_int limit,
-	const char *msg)
+	int zerocopy, const char *msg)
 {
 	struct netmap_ring *txring, *rxring;
 	u_int m = 0, si = src->first_rx_ring, di = dst->first_tx_ring;
@@ -153,13 +187,222 @@ ports_move(struct nmport_d *src, struct nmport_d *dst, u_int limit,
 			di++;
 			continue;
 		}
-		m += rings_move(rxring, txring, limit, msg);
+		m += rings_move(rxring, txring, limit, zerocopy, msg);
 	}
 
 	return (m);
 }
 
 
+/* set the thread affinity. */
+static int
+setaffinity(pthread_t me, int i)
+{
+	cpuset_t cpumask;
+
+	if (i == -1)
+		return 0;
+
+	CPU_ZERO(&cpumask);
+	CPU_SET(i, &cpumask);
+
+	if (pthread_setaffinity_np(me, sizeof(cpuset_t), &cpumask) != 0) {
+		D("Unable to set affinity: %s", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * -A: the NUMA node of a port and the cpus of a node,
+ * from sysfs. Return -1 if not known.
+ */
+static int
+port_numa_node(const struct nmport_d *d)
+{
+	char path[128 + IFNAMSIZ];
+	FILE *f;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%.*s/device/numa_node",
+		IFNAMSIZ, d->hdr.nr_name);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+	return node;
+}
+
+/* the n-th cpu (modulo their number) of a node, -1 if none */
+static int
+numa_node_cpu(int node, int n)
+{
+	char path[64];
+	int cpus[256], k = 0, a, b;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		node);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	/* a list like 0-7,16-23 */
+	while (k < 256 && fscanf(f, "%d", &a) == 1) {
+		b = a;
+		if (fscanf(f, "-%d", &b) != 1)
+			b = a;
+		for (; a <= b && k < 256; a++)
+			cpus[k++] = a;
+		if (fgetc(f) != ',')
+			break;
+	}
+	fclose(f);
+	return k > 0 ? cpus[n % k] : -1;
+}
+
+static u_int burst = 1024;
+
+/* forward between the two ports of a context until interrupted */
+static void *
+fwd_body(void *arg)
+{
+	struct fwd_ctx *c = arg;
+	struct nmport_d *pa = c->pa, *pb = c->pb;
+	struct pollfd pollfd[2];
+
+	setaffinity(pthread_self(), c->affinity);
+
+	/* setup poll(2) array */
+	memset(pollfd, 0, sizeof(pollfd));
+	pollfd[0].fd = pa->fd;
+	pollfd[1].fd = pb->fd;
+
+	while (!do_abort) {
+		int n0, n1, ret;
+		pollfd[0].events = pollfd[1].events = 0;
+		pollfd[0].revents = pollfd[1].revents = 0;
+		n0 = rx_slots_avail(pa);
+		n1 = rx_slots_avail(pb);
+#ifdef BUSYWAIT
+		if (n0) {
+			pollfd[1].revents = POLLOUT;
+		} else {
+			ioctl(pollfd[0].fd, NIOCRXSYNC, NULL);
+		}
+		if (n1) {
+			pollfd[0].revents = POLLOUT;
+		} else {
+			ioctl(pollfd[1].fd, NIOCRXSYNC, NULL);
+		}
+		ret = 1;
+#else  /* !defined(BUSYWAIT) */
+		if (n0)
+			pollfd[1].events |= POLLOUT;
+		else
+			pollfd[0].events |= POLLIN;
+		if (n1)
+			pollfd[0].events |= POLLOUT;
+		else
+			pollfd[1].events |= POLLIN;
+
+		/* poll() also cause kernel to txsync/rxsync the NICs */
+		ret = poll(pollfd, 2, 2500);
+#endif /* !defined(BUSYWAIT) */
+		if (ret <= 0 || verbose)
+		    D("poll %s [0] ev %x %x rx %d@%d tx %d,"
+			     " [1] ev %x %x rx %d@%d tx %d",
+				ret <= 0 ? "timeout" : "ok",
+				pollfd[0].events,
+				pollfd[0].revents,
+				rx_slots_avail(pa),
+				NETMAP_RXRING(pa->nifp, pa->cur_rx_ring)->head,
+				tx_slots_avail(pa),
+				pollfd[1].events,
+				pollfd[1].revents,
+				rx_slots_avail(pb),
+				NETMAP_RXRING(pb->nifp, pb->cur_rx_ring)->head,
+				tx_slots_avail(pb)
+			);
+		if (ret < 0)
+			continue;
+		if (pollfd[0].revents & POLLERR) {
+			struct netmap_ring *rx = NETMAP_RXRING(pa->nifp, pa->cur_rx_ring);
+			D("error on fd0, rx [%d,%d,%d)",
+			    rx->head, rx->cur, rx->tail);
+		}
+		if (pollfd[1].revents & POLLERR) {
+			struct netmap_ring *rx = NETMAP_RXRING(pb->nifp, pb->cur_rx_ring);
+			D("error on fd1, rx [%d,%d,%d)",
+			    rx->head, rx->cur, rx->tail);
+		}
+		if (pollfd[0].revents & POLLOUT) {
+			c->b2a += ports_move(pb, pa, burst, c->zerocopy,
+					c->msg_b2a);
+#ifdef BUSYWAIT
+			ioctl(pollfd[0].fd, NIOCTXSYNC, NULL);
+#endif
+		}
+
+		if (pollfd[1].revents & POLLOUT) {
+			c->a2b += ports_move(pa, pb, burst, c->zerocopy,
+					c->msg_a2b);
+#ifdef BUSYWAIT
+			ioctl(pollfd[1].fd, NIOCTXSYNC, NULL);
+#endif
+		}
+
+		/*
+		 * We don't need ioctl(NIOCTXSYNC) on the two file descriptors.
+		 * here. The kernel will txsync on next poll().
+		 */
+	}
+	return NULL;
+}
+
+static void
+fwd_ctx_init(struct fwd_ctx *c, struct nmport_d *pa, struct nmport_d *pb)
+{
+	int pa_sw_rings, pb_sw_rings;
+
+	c->pa = pa;
+	c->pb = pb;
+	c->zerocopy = zerocopy && (pa->mem == pb->mem);
+	c->affinity = -1;
+	c->a2b = c->b2a = 0;
+
+	pa_sw_rings = (pa->reg.nr_mode == NR_REG_SW ||
+	    pa->reg.nr_mode == NR_REG_ONE_SW);
+	pb_sw_rings = (pb->reg.nr_mode == NR_REG_SW ||
+	    pb->reg.nr_mode == NR_REG_ONE_SW);
+
+	snprintf(c->msg_a2b, sizeof(c->msg_a2b), "%s:%s --> %s:%s",
+			pa->hdr.nr_name, pa_sw_rings ? "host" : "nic",
+			pb->hdr.nr_name, pb_sw_rings ? "host" : "nic");
+
+	snprintf(c->msg_b2a, sizeof(c->msg_b2a), "%s:%s --> %s:%s",
+			pb->hdr.nr_name, pb_sw_rings ? "host" : "nic",
+			pa->hdr.nr_name, pa_sw_rings ? "host" : "nic");
+}
+
+/* open one hardware ring pair of a port */
+static struct nmport_d *
+ring_open(const char *ifname, int ring)
+{
+	struct nmport_d *d = nmport_prepare(ifname);
+
+	if (d == NULL)
+		return NULL;
+	d->reg.nr_mode = NR_REG_ONE_NIC;
+	d->reg.nr_ringid = ring;
+	if (nmport_open_desc(d) < 0) {
+		nmport_undo_prepare(d);
+		return NULL;
+	}
+	return d;
+}
+
 static void
 usage(void)
 {
@@ -168,6 +411,7 @@ usage(void)
 			"netmap ports\n"
 		"    usage(1): bridge [-v] [-i ifa] [-i ifb] [-b burst] "
 			"[-w wait_time] [-L]\n"
+		"                     [-p threads] [-a cpu | -A]\n"
 		"    usage(2): bridge [-v] [-w wait_time] [-L] "
 			"[ifa [ifb [burst]]]\n"
 		"\n"
@@ -182,6 +426,11 @@ usage(void)
 		"    promiscuous mode. Otherwise, if bridging with the \n"
 		"    host stack, the interface must have the offloads \n"
 		"    disabled.\n"
+		"\n"
+		"    -p threads forwards ring i of ifa to ring i of ifb, and\n"
+		"    back, in thread i modulo threads (0: one thread per ring).\n"
+		"    -a cpu pins thread i to cpu + i, -A to the cpus of the\n"
+		"    NUMA node of ifa.\n"
 		);
 	exit(1);
 }
@@ -196,19 +445,18 @@ usage(void)
 int
 main(int argc, char **argv)
 {
-	char msg_a2b[256], msg_b2a[256];
-	struct pollfd pollfd[2];
-	u_int burst = 1024, wait_link = 4;
+	u_int wait_link = 4;
 	struct nmport_d *pa = NULL, *pb = NULL;
 	char *ifa = NULL, *ifb = NULL;
 	char ifabuf[64] = { 0 };
-	int pa_sw_rings, pb_sw_rings;
+	struct fwd_ctx *ctx;
+	int nthreads = 1, affinity = -1, numa = 0, nrings, node;
 	int loopback = 0;
-	int ch;
+	int ch, i;
 
 	fprintf(stderr, "%s built %s %s\n\n", argv[0], __DATE__, __TIME__);
 
-	while ((ch = getopt(argc, argv, "hb:ci:vw:L")) != -1) {
+	while ((ch = getopt(argc, argv, "hb:ci:vw:Lp:a:A")) != -1) {
 		switch (ch) {
 		default:
 			D("bad option %c %s", ch, optarg);
@@ -240,6 +488,15 @@ main(int argc, char **argv)
 		case 'L':
 			loopback = 1;
 			break;
+		case 'p':
+			nthreads = atoi(optarg);
+			break;
+		case 'a':
+			affinity = atoi(optarg);
+			break;
+		case 'A':
+			numa = 1;
+			break;
 		}
 
 	}
@@ -267,6 +524,10 @@ main(int argc, char **argv)
 		D("invalid wait_link %d, set to 4", wait_link);
 		wait_link = 4;
 	}
+	if (nthreads < 0) {
+		D("invalid number of threads %d, set to 1", nthreads);
+		nthreads = 1;
+	}
 	if (!strcmp(ifa, ifb)) {
 		if (!loopback) {
 			D("same interface, endpoint 0 goes to host");
@@ -290,114 +551,118 @@ main(int argc, char **argv)
 		nmport_close(pa);
 		return (1);
 	}
-	zerocopy = zerocopy && (pa->mem == pb->mem);
-	D("------- zerocopy %ssupported", zerocopy ? "" : "NOT ");
 
-	/* setup poll(2) array */
-	memset(pollfd, 0, sizeof(pollfd));
-	pollfd[0].fd = pa->fd;
-	pollfd[1].fd = pb->fd;
+	/* one context per ring pair if there are several threads */
+	nrings = 1;
+	if (nthreads != 1) {
+		if (pa->reg.nr_mode != NR_REG_ALL_NIC ||
+		    pb->reg.nr_mode != NR_REG_ALL_NIC) {
+			D("-p needs all the hardware rings of both ports");
+			nmport_close(pb);
+			nmport_close(pa);
+			return (1);
+		}
+		nrings = pa->reg.nr_rx_rings;
+		if (nrings > pa->reg.nr_tx_rings)
+			nrings = pa->reg.nr_tx_rings;
+		if (nrings > pb->reg.nr_rx_rings)
+			nrings = pb->reg.nr_rx_rings;
+		if (nrings > pb->reg.nr_tx_rings)
+			nrings = pb->reg.nr_tx_rings;
+		if (nthreads == 0 || nthreads > nrings)
+			nthreads = nrings;
+	}
+	node = numa ? port_numa_node(pa) : -1;
+	ctx = calloc(nthreads, sizeof(*ctx));
+	if (ctx == NULL) {
+		D("out of memory");
+		return (1);
+	}
+	if (nthreads == 1) {
+		fwd_ctx_init(&ctx[0], pa, pb);
+	} else {
+		/* the ring pairs beyond nthreads are not forwarded */
+		if (nrings > nthreads)
+			D("forwarding only the first %d of %d ring pairs",
+				nthreads, nrings);
+		nmport_close(pb);
+		nmport_close(pa);
+		for (i = 0; i < nthreads; i++) {
+			pa = ring_open(ifa, i);
+			pb = pa ? ring_open(ifb, i) : NULL;
+			if (pb == NULL) {
+				D("cannot open ring %d of %s and %s", i,
+					ifa, ifb);
+				if (pa)
+					nmport_close(pa);
+				while (i-- > 0) {
+					nmport_close(ctx[i].pb);
+					nmport_close(ctx[i].pa);
+				}
+				return (1);
+			}
+			fwd_ctx_init(&ctx[i], pa, pb);
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (node >= 0)
+			ctx[i].affinity = numa_node_cpu(node, i);
+		else if (affinity >= 0)
+			ctx[i].affinity = affinity + i;
+	}
+	D("------- zerocopy %ssupported", ctx[0].zerocopy ? "" : "NOT ");
 
 	D("Wait %d secs for link to come up...", wait_link);
 	sleep(wait_link);
-	D("Ready to go, %s 0x%x/%d <-> %s 0x%x/%d.",
-		pa->hdr.nr_name, pa->first_rx_ring, pa->reg.nr_rx_rings,
-		pb->hdr.nr_name, pb->first_rx_ring, pb->reg.nr_rx_rings);
-
-	pa_sw_rings = (pa->reg.nr_mode == NR_REG_SW ||
-	    pa->reg.nr_mode == NR_REG_ONE_SW);
-	pb_sw_rings = (pb->reg.nr_mode == NR_REG_SW ||
-	    pb->reg.nr_mode == NR_REG_ONE_SW);
-
-	snprintf(msg_a2b, sizeof(msg_a2b), "%s:%s --> %s:%s",
-			pa->hdr.nr_name, pa_sw_rings ? "host" : "nic",
-			pb->hdr.nr_name, pb_sw_rings ? "host" : "nic");
-
-	snprintf(msg_b2a, sizeof(msg_b2a), "%s:%s --> %s:%s",
-			pb->hdr.nr_name, pb_sw_rings ? "host" : "nic",
-			pa->hdr.nr_name, pa_sw_rings ? "host" : "nic");
+	for (i = 0; i < nthreads; i++) {
+		pa = ctx[i].pa;
+		pb = ctx[i].pb;
+		D("Ready to go, %s 0x%x/%d <-> %s 0x%x/%d, cpu %d.",
+			pa->hdr.nr_name, pa->first_rx_ring, pa->reg.nr_rx_rings,
+			pb->hdr.nr_name, pb->first_rx_ring, pb->reg.nr_rx_rings,
+			ctx[i].affinity);
+	}
 
 	/* main loop */
 	signal(SIGINT, sigint_h);
-	while (!do_abort) {
-		int n0, n1, ret;
-		pollfd[0].events = pollfd[1].events = 0;
-		pollfd[0].revents = pollfd[1].revents = 0;
-		n0 = rx_slots_avail(pa);
-		n1 = rx_slots_avail(pb);
-#ifdef BUSYWAIT
-		if (n0) {
-			pollfd[1].revents = POLLOUT;
-		} else {
-			ioctl(pollfd[0].fd, NIOCRXSYNC, NULL);
-		}
-		if (n1) {
-			pollfd[0].revents = POLLOUT;
-		} else {
-			ioctl(pollfd[1].fd, NIOCRXSYNC, NULL);
-		}
-		ret = 1;
-#else  /* !defined(BUSYWAIT) */
-		if (n0)
-			pollfd[1].events |= POLLOUT;
-		else
-			pollfd[0].events |= POLLIN;
-		if (n1)
-			pollfd[0].events |= POLLOUT;
-		else
-			pollfd[1].events |= POLLIN;
-
-		/* poll() also cause kernel to txsync/rxsync the NICs */
-		ret = poll(pollfd, 2, 2500);
-#endif /* !defined(BUSYWAIT) */
-		if (ret <= 0 || verbose)
-		    D("poll %s [0] ev %x %x rx %d@%d tx %d,"
-			     " [1] ev %x %x rx %d@%d tx %d",
-				ret <= 0 ? "timeout" : "ok",
-				pollfd[0].events,
-				pollfd[0].revents,
-				rx_slots_avail(pa),
-				NETMAP_RXRING(pa->nifp, pa->cur_rx_ring)->head,
-				tx_slots_avail(pa),
-				pollfd[1].events,
-				pollfd[1].revents,
-				rx_slots_avail(pb),
-				NETMAP_RXRING(pb->nifp, pb->cur_rx_ring)->head,
-				tx_slots_avail(pb)
-			);
-		if (ret < 0)
-			continue;
-		if (pollfd[0].revents & POLLERR) {
-			struct netmap_ring *rx = NETMAP_RXRING(pa->nifp, pa->cur_rx_ring);
-			D("error on fd0, rx [%d,%d,%d)",
-			    rx->head, rx->cur, rx->tail);
-		}
-		if (pollfd[1].revents & POLLERR) {
-			struct netmap_ring *rx = NETMAP_RXRING(pb->nifp, pb->cur_rx_ring);
-			D("error on fd1, rx [%d,%d,%d)",
-			    rx->head, rx->cur, rx->tail);
-		}
-		if (pollfd[0].revents & POLLOUT) {
-			ports_move(pb, pa, burst, msg_b2a);
-#ifdef BUSYWAIT
-			ioctl(pollfd[0].fd, NIOCTXSYNC, NULL);
-#endif
+	if (nthreads == 1) {
+		fwd_body(&ctx[0]);
+	} else {
+		uint64_t *prev = calloc(2 * nthreads, sizeof(*prev));
+
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&ctx[i].thread, NULL, fwd_body,
+					&ctx[i]) != 0) {
+				D("cannot start thread %d", i);
+				do_abort = 1;
+				nthreads = i;
+				break;
+			}
 		}
-
-		if (pollfd[1].revents & POLLOUT) {
-			ports_move(pa, pb, burst, msg_a2b);
-#ifdef BUSYWAIT
-			ioctl(pollfd[1].fd, NIOCTXSYNC, NULL);
-#endif
+		/* per-thread rates, once per second */
+		while (!do_abort) {
+			sleep(1);
+			for (i = 0; verbose && prev && i < nthreads; i++) {
+				uint64_t a2b = ctx[i].a2b, b2a = ctx[i].b2a;
+
+				D("thread %d: %" PRIu64 " pps a->b, %" PRIu64
+					" pps b->a", i, a2b - prev[2 * i],
+					b2a - prev[2 * i + 1]);
+				prev[2 * i] = a2b;
+				prev[2 * i + 1] = b2a;
+			}
 		}
-
-		/*
-		 * We don't need ioctl(NIOCTXSYNC) on the two file descriptors.
-		 * here. The kernel will txsync on next poll().
-		 */
+		for (i = 0; i < nthreads; i++)
+			pthread_join(ctx[i].thread, NULL);
+		free(prev);
+	}
+	for (i = 0; i < nthreads; i++) {
+		D("thread %d: %" PRIu64 " packets a->b, %" PRIu64
+			" packets b->a", i, ctx[i].a2b, ctx[i].b2a);
+		nmport_close(ctx[i].pb);
+		nmport_close(ctx[i].pa);
 	}
-	nmport_close(pb);
-	nmport_close(pa);
+	free(ctx);
 
 	return (0);
 }
@@ -9,6 +9,7 @@
 #define NETMAP_WITH_LIBS
 #include <net/netmap_user.h>
 #include <sys/poll.h>
+#include <pthread.h>
 #include "dedup.h"
 
 int verbose = 0;
@@ -29,7 +30,9 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-		"dedup\n"
+		"usage: dedup [-v] [-c] [-H] [-w wait-link] [-W win-usec] "
+		"[-F fifo-size]\n"
+		"\t[-S shards] [-I] -i ifa -i ifb\n"
 		);
 	exit(1);
 }
@@ -37,17 +40,201 @@ usage(void)
 struct dedup dedup;
 struct nm_desc *pa = NULL, *pb = NULL;
 
+/*
+ * Sharded operation (-S).
+ *
+ * The input packets are partitioned among the shards by their dedup hash,
+ * so that all the copies of a packet are checked by the same shard.
+ * Each shard runs in its own thread and owns a struct dedup, with its
+ * own hash map, fifo and time window. The fifo always holds copies.
+ *
+ * The main thread dispatches the slots of the input ring to the shards
+ * and then merges the verdicts: the fresh packets are moved to the output
+ * ring in the order of the input ring, so the order of each flow (and of
+ * the whole stream) is preserved. A slot of the input ring is released
+ * only when its packet has been checked and forwarded or dropped.
+ */
+enum { V_PENDING = 0, V_FRESH, V_DUP };
+
+struct shard {
+	struct dedup d;
+	pthread_t tid;
+	uint32_t *q;		/* input ring slots to check */
+	unsigned long q_in;	/* written by the main thread */
+	unsigned long q_next;	/* not yet published q_in */
+} __attribute__ ((aligned (64)));
+
+static struct shard *shards;
+static unsigned int nshards;
+static uint32_t q_size;		/* input ring size */
+static uint8_t *verdict;	/* per input slot */
+static uint64_t *slot_hash;	/* per input slot */
+static struct timeval *arrival;	/* per input slot */
+
+static void *
+shard_body(void *arg)
+{
+	struct shard *sh = arg;
+	struct netmap_ring *ri = sh->d.in_ring;
+	unsigned long q_out = 0;
+
+	while (!do_abort) {
+		unsigned long q_in = __atomic_load_n(&sh->q_in, __ATOMIC_ACQUIRE);
+
+		for (; q_out != q_in; q_out++) {
+			uint32_t i = sh->q[q_out % q_size];
+			int fresh = dedup_shard_check(&sh->d, ri->slot + i,
+					slot_hash[i], &arrival[i]);
+
+			__atomic_store_n(&verdict[i], fresh ? V_FRESH : V_DUP,
+					__ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+/* assign the slots in [*disp, tail) to the shards */
+static void
+shards_dispatch(struct netmap_ring *ri, uint32_t *disp)
+{
+	uint32_t i;
+	unsigned int j;
+
+	for (i = *disp; i != ri->tail; i = nm_ring_next(ri, i)) {
+		uint64_t h = dedup_slot_hash(&shards[0].d, ri->slot + i);
+		/* the low bits of the hash index the hash maps, mix them */
+		struct shard *sh = shards +
+			((h * 0x9E3779B97F4A7C15ULL) >> 40) % nshards;
+
+		slot_hash[i] = h;
+		arrival[i] = ri->ts;
+		sh->q[sh->q_next++ % q_size] = i;
+	}
+	*disp = i;
+	for (j = 0; j < nshards; j++)
+		__atomic_store_n(&shards[j].q_in, shards[j].q_next,
+				__ATOMIC_RELEASE);
+}
+
+/*
+ * move the checked packets in [head, disp) to the output ring, in order.
+ * Returns the number of slots still waiting.
+ */
+static int
+shards_merge(struct netmap_ring *ri, struct netmap_ring *ro, uint32_t disp)
+{
+	uint32_t head = ri->head, out = ro->head;
+	int out_space = nm_ring_space(ro), n;
+
+	for (; head != disp; head = nm_ring_next(ri, head)) {
+		uint8_t v = __atomic_load_n(&verdict[head], __ATOMIC_ACQUIRE);
+
+		if (v == V_PENDING)
+			break;
+		if (v == V_FRESH) {
+			if (out_space == 0)
+				break;
+			dedup_forward(&shards[0].d, ri->slot + head,
+					ro->slot + out);
+			out = nm_ring_next(ro, out);
+			out_space--;
+		}
+		verdict[head] = V_PENDING;
+	}
+	ri->head = ri->cur = head;
+	ro->head = ro->cur = out;
+	n = disp - head;
+	if (n < 0)
+		n += ri->num_slots;
+	return n;
+}
+
+static int
+shards_init(unsigned int fifo_size, struct netmap_ring *in,
+		struct netmap_ring *out, uint32_t buf_head)
+{
+	unsigned int i;
+
+	q_size = in->num_slots;
+	shards = calloc(nshards, sizeof(*shards));
+	verdict = calloc(q_size, sizeof(*verdict));
+	slot_hash = calloc(q_size, sizeof(*slot_hash));
+	arrival = calloc(q_size, sizeof(*arrival));
+	if (shards == NULL || verdict == NULL || slot_hash == NULL ||
+			arrival == NULL)
+		return -1;
+	for (i = 0; i < nshards; i++) {
+		struct shard *sh = shards + i;
+
+		sh->q = calloc(q_size, sizeof(*sh->q));
+		if (sh->q == NULL)
+			return -1;
+		if (dedup_init(&sh->d, fifo_size, in, out) < 0) {
+			D("shard %u: failed to initialize dedup", i);
+			return -1;
+		}
+		/* each shard takes fifo_size of the extra buffers */
+		if (buf_head != 0)
+			buf_head = dedup_set_fifo_buffers(&sh->d, NULL, buf_head);
+		if (sh->d.fifo_slot == NULL) {
+			D("shard %u: not enough extra buffers", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+shards_loop(struct pollfd *pollfd)
+{
+	struct netmap_ring *ri = shards[0].d.in_ring,
+			   *ro = shards[0].d.out_ring;
+	uint32_t disp = ri->head;
+	unsigned int i;
+	int n = 0;
+
+	for (i = 0; i < nshards; i++)
+		pthread_create(&shards[i].tid, NULL, shard_body, shards + i);
+
+	while (!do_abort) {
+		if (n == 0) {
+			/* nothing in flight, wait for input */
+			pollfd[0].events = POLLIN;
+			pollfd[1].events = 0;
+			pollfd[0].revents = pollfd[1].revents = 0;
+			if (poll(pollfd, 2, 1000) <= 0 || verbose)
+				D("poll [0] ev %x %x [1] ev %x %x",
+					pollfd[0].events, pollfd[0].revents,
+					pollfd[1].events, pollfd[1].revents);
+		} else {
+			ioctl(pollfd[0].fd, NIOCRXSYNC, NULL);
+			ioctl(pollfd[1].fd, NIOCTXSYNC, NULL);
+		}
+		shards_dispatch(ri, &disp);
+		n = shards_merge(ri, ro, disp);
+	}
+	for (i = 0; i < nshards; i++)
+		pthread_join(shards[i].tid, NULL);
+}
+
 static void
 free_buffers(void)
 {
 	struct netmap_ring *ring;
+	unsigned int i;
 
 	if (pa == NULL)
 		return;
 
 	ring = NETMAP_RXRING(pa->nifp, pa->first_rx_ring);
 
-	dedup_get_fifo_buffers(&dedup, ring, &pa->nifp->ni_bufs_head);
+	if (shards != NULL) {
+		for (i = 0; i < nshards; i++)
+			dedup_get_fifo_buffers(&shards[i].d, ring,
+					&pa->nifp->ni_bufs_head);
+	} else {
+		dedup_get_fifo_buffers(&dedup, ring, &pa->nifp->ni_bufs_head);
+	}
 	nm_close(pa);
 	nm_close(pb);
 }
@@ -62,6 +249,7 @@ main(int argc, char **argv)
 	int win_size_usec = 50;
 	unsigned int fifo_size = 10;
 	int n;
+	unsigned int i;
 	int hold = 0;
 	struct nmreq base_req;
 	uint32_t buf_head = 0;
@@ -71,7 +259,7 @@ main(int argc, char **argv)
 
 	fprintf(stderr, "%s built %s %s\n\n", argv[0], __DATE__, __TIME__);
 
-	while ((ch = getopt(argc, argv, "hci:vw:W:F:H")) != -1) {
+	while ((ch = getopt(argc, argv, "hci:vw:W:F:HS:I")) != -1) {
 		switch (ch) {
 		default:
 			D("bad option %c %s", ch, optarg);
@@ -106,6 +294,12 @@ main(int argc, char **argv)
 		case 'H':
 			hold = 1;
 			break;
+		case 'S':
+			nshards = atoi(optarg);
+			break;
+		case 'I':
+			dedup.invariant_hdr = 1;
+			break;
 		}
 
 	}
@@ -114,9 +308,17 @@ main(int argc, char **argv)
 		D("missing interface");
 		usage();
 	}
+	if (nshards > 64) {
+		D("too many shards %u (max 64)", nshards);
+		usage();
+	}
+	if (nshards && hold) {
+		D("-S and -H are incompatible, shards always copy");
+		usage();
+	}
 	memset(&base_req, 0, sizeof(base_req));
 	if (!hold) {
-		base_req.nr_arg3 = fifo_size;
+		base_req.nr_arg3 = fifo_size * (nshards ? nshards : 1);
 	}
 	pa = nm_open(ifa, &base_req, 0, NULL);
 	if (pa == NULL) {
@@ -124,8 +326,9 @@ main(int argc, char **argv)
 		return (1);
 	}
 	if (!hold) {
-	        if (base_req.nr_arg3 != fifo_size) {
-			D("failed to allocate %u extra buffers", fifo_size);
+	        if (base_req.nr_arg3 != fifo_size * (nshards ? nshards : 1)) {
+			D("failed to allocate %u extra buffers",
+				fifo_size * (nshards ? nshards : 1));
 			return (1); // XXX failover to copy?
 		} else {
 			buf_head = pa->nifp->ni_bufs_head;
@@ -150,21 +353,29 @@ main(int argc, char **argv)
 		return (1);
 	}
 
-	memset(&dedup, 0, sizeof(dedup));
-	dedup.out_slot = dedup.out_ring->slot;
-	if (dedup_init(&dedup, fifo_size, 
-			NETMAP_RXRING(pa->nifp, pa->first_rx_ring),
-			NETMAP_TXRING(pb->nifp, pb->first_tx_ring)) < 0) {
-		D("failed to initialize dedup with fifo_size %u", fifo_size);
-		return (1);
-	}
-	if (fifo_size >= dedup.out_ring->num_slots - 1) {
-		D("fifo_size %u too large (max %u)", fifo_size, dedup.out_ring->num_slots - 1);
-		return (1);
-	}
-	if (dedup_set_fifo_buffers(&dedup, NULL, buf_head) != 0) {
-		D("failed to set 'hold packets' option");
-		return (1);
+	if (nshards) {
+		if (shards_init(fifo_size,
+				NETMAP_RXRING(pa->nifp, pa->first_rx_ring),
+				NETMAP_TXRING(pb->nifp, pb->first_tx_ring),
+				buf_head) < 0) {
+			D("failed to initialize %u shards", nshards);
+			return (1);
+		}
+	} else {
+		if (dedup_init(&dedup, fifo_size,
+				NETMAP_RXRING(pa->nifp, pa->first_rx_ring),
+				NETMAP_TXRING(pb->nifp, pb->first_tx_ring)) < 0) {
+			D("failed to initialize dedup with fifo_size %u", fifo_size);
+			return (1);
+		}
+		if (fifo_size >= dedup.out_ring->num_slots - 1) {
+			D("fifo_size %u too large (max %u)", fifo_size, dedup.out_ring->num_slots - 1);
+			return (1);
+		}
+		if (dedup_set_fifo_buffers(&dedup, NULL, buf_head) != 0) {
+			D("failed to set 'hold packets' option");
+			return (1);
+		}
 	}
 	pa->nifp->ni_bufs_head = 0;
 	atexit(free_buffers);
@@ -179,6 +390,15 @@ main(int argc, char **argv)
 	dedup.win_size.tv_usec = win_size_usec % 1000000;
 	D("win_size %lld+%lld", (long long) dedup.win_size.tv_sec,
 			(long long) dedup.win_size.tv_usec);
+	for (i = 0; i < nshards; i++) {
+		struct dedup *d = &shards[i].d;
+
+		d->in_memid = dedup.in_memid;
+		d->out_memid = dedup.out_memid;
+		d->fifo_memid = dedup.in_memid;
+		d->win_size = dedup.win_size;
+		d->invariant_hdr = dedup.invariant_hdr;
+	}
 
 	/* setup poll(2) array */
 	memset(pollfd, 0, sizeof(pollfd));
@@ -191,6 +411,11 @@ main(int argc, char **argv)
 
 	/* main loop */
 	signal(SIGINT, sigint_h);
+	if (nshards) {
+		D("%u shards", nshards);
+		shards_loop(pollfd);
+		return (0);
+	}
 	n = 0;
 	while (!do_abort) {
 		int ret;
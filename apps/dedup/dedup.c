@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <limits.h>
 #include <malloc.h>
+#include <arpa/inet.h>	/* htons */
 #define NETMAP_WITH_LIBS
 #include <net/netmap_user.h>
 #include "dedup.h"
@@ -38,7 +39,7 @@ dedup_init(struct dedup *d, unsigned int fifo_size, struct netmap_ring *in, stru
 
 	sh = (unsigned int)(sizeof(fifo_size) * CHAR_BIT - __builtin_clz(fifo_size - 1)) + 1;
 	D("sh %u size %lu", sh, 1UL << sh);
-	if (sh > sizeof(unsigned short) * CHAR_BIT - 1)
+	if (sh > DEDUP_HASH_BITS)
 		goto err;
 	d->hashmap = calloc(1UL << sh, sizeof(struct dedup_hashmap_entry));
 	if (d->hashmap == NULL)
@@ -141,18 +142,97 @@ dedup_fifo_empty(const struct dedup *d)
 }
 
 static inline uint32_t
-dedup_hash(const char *data)
+dedup_crc(uint32_t crc, const void *data, size_t len)
 {
-	return dedup_sse42 ? crc32c_hw(0, data, 64) : crc32c_sw(0, data, 64);
+	return dedup_sse42 ? crc32c_hw(crc, data, len) : crc32c_sw(crc, data, len);
+}
+
+/*
+ * Copy in key the first DEDUP_KEY_LEN bytes of the packet that take part
+ * in the comparison, zero padded, and return their offset in buf.
+ * Normally this is the whole packet. With invariant_hdr we start from
+ * the network header (routers rewrite the MAC addresses) and clear the
+ * fields that change at every hop: the IPv4 TTL and header checksum,
+ * the IPv6 hop limit.
+ */
+static unsigned int
+dedup_key(const struct dedup *d, const char *buf, unsigned int len, char *key)
+{
+	unsigned int off = 0, l;
+	uint16_t type;
+
+	if (d->invariant_hdr && len >= 14) {
+		off = 14;
+		memcpy(&type, buf + 12, sizeof(type));
+		if (type == htons(0x8100) && len >= 18) { /* one vlan tag */
+			off = 18;
+			memcpy(&type, buf + 16, sizeof(type));
+		}
+	}
+	l = len - off;
+	if (l > DEDUP_KEY_LEN)
+		l = DEDUP_KEY_LEN;
+	memcpy(key, buf + off, l);
+	memset(key + l, 0, DEDUP_KEY_LEN - l);
+	if (off == 0)
+		return 0;
+	if (type == htons(0x0800) && (key[0] & 0xf0) == 0x40) {
+		key[8] = 0;		/* ttl */
+		key[10] = key[11] = 0;	/* header checksum */
+	} else if (type == htons(0x86dd) && (key[0] & 0xf0) == 0x60) {
+		key[7] = 0;		/* hop limit */
+	}
+	return off;
+}
+
+/*
+ * The 64 bit fingerprint of a packet: the low half is the crc32c of the
+ * key, and selects the bucket; the high half covers the length and the
+ * next DEDUP_KEY_LEN bytes, so that the packets that only differ there
+ * are told apart without looking at the held copies.
+ */
+static uint64_t
+dedup_hash(const struct dedup *d, const char *buf, unsigned int len)
+{
+	char key[DEDUP_KEY_LEN];
+	unsigned int off = dedup_key(d, buf, len, key), l = len - off;
+	uint32_t lo, hi;
+
+	lo = dedup_crc(0, key, DEDUP_KEY_LEN);
+	hi = l > DEDUP_KEY_LEN ? dedup_crc(l, buf + off + DEDUP_KEY_LEN,
+		l - DEDUP_KEY_LEN > DEDUP_KEY_LEN ? DEDUP_KEY_LEN :
+		l - DEDUP_KEY_LEN) : l;
+	return (uint64_t)hi << 32 | lo;
+}
+
+/* compare two packets with the same fingerprint */
+static int
+dedup_same(const struct dedup *d, const char *a, unsigned int alen,
+		const char *b, unsigned int blen)
+{
+	char ka[DEDUP_KEY_LEN], kb[DEDUP_KEY_LEN];
+	unsigned int aoff, boff;
+
+	if (!d->invariant_hdr)
+		return alen == blen && memcmp(a, b, alen) == 0;
+	aoff = dedup_key(d, a, alen, ka);
+	boff = dedup_key(d, b, blen, kb);
+	if (alen - aoff != blen - boff || memcmp(ka, kb, DEDUP_KEY_LEN))
+		return 0;
+	if (alen - aoff <= DEDUP_KEY_LEN)
+		return 1;
+	return memcmp(a + aoff + DEDUP_KEY_LEN, b + boff + DEDUP_KEY_LEN,
+			alen - aoff - DEDUP_KEY_LEN) == 0;
 }
 
 static void
-dedup_hashmap_insert(struct dedup *d, unsigned short h)
+dedup_hashmap_insert(struct dedup *d, unsigned int h, uint64_t fp)
 {
 	struct dedup_hashmap_entry *he = d->hashmap + h;
 	struct dedup_fifo_entry *fe = d->fifo + d->fifo_in.f;
 	fe->bucket_next = (he->valid ? d->fifo_in.r - he->bucket_head : 0);
 	fe->hashmap_entry = h;
+	fe->fp = fp;
 	he->bucket_head = d->fifo_in.r;
 	he->valid = 1;
 #ifdef DEDUP_HASH_STAT
@@ -178,12 +258,17 @@ dedup_hashmap_remove(struct dedup *d)
 #endif
 }
 
+uint64_t
+dedup_slot_hash(const struct dedup *d, const struct netmap_slot *s)
+{
+	return dedup_hash(d, NETMAP_BUF(d->in_ring, s->buf_idx), s->len);
+}
+
 static long
-dedup_fresh_packet(struct dedup *d, const struct netmap_slot *s)
+dedup_fresh_packet(struct dedup *d, const struct netmap_slot *s, uint64_t fp)
 {
 	const void *buf = NETMAP_BUF(d->in_ring, s->buf_idx);
-	unsigned int h = dedup_hash(buf);
-	unsigned short i = h & d->hashmap_mask;
+	unsigned int i = fp & d->hashmap_mask;
 	struct dedup_hashmap_entry *he = d->hashmap + i;
 	unsigned long fi = he->bucket_head;
 	unsigned long fifo_win = d->fifo_in.r - d->fifo_out.r;
@@ -204,10 +289,11 @@ dedup_fresh_packet(struct dedup *d, const struct netmap_slot *s)
 		ND("checking %lu %lu: lengths %u %u buf %d", fi, rfi, fs->len, s->len,
 				fs->buf_idx);
 
-		if (fs->len != s->len)
+		/* most mismatches stop here, without touching fbuf */
+		if (d->fifo[rfi].fp != fp)
 			goto next;
 		fbuf = NETMAP_BUF(d->fifo_ring, fs->buf_idx);
-		if (memcmp(buf, fbuf, s->len))
+		if (!dedup_same(d, buf, s->len, fbuf, fs->len))
 			goto next;
 		return -1;
 	next:
@@ -289,11 +375,13 @@ dedup_push_in(struct dedup *d, const struct timeval *now)
 
 	for (head = ri->head; n; head = nm_ring_next(ri, head), n--) {
 		struct netmap_slot *src_slot, *dst_slot;
+		uint64_t fp;
 		long h;
 
 		src_slot = d->in_slot + head;
 
-		h = dedup_fresh_packet(d, src_slot);
+		fp = dedup_slot_hash(d, src_slot);
+		h = dedup_fresh_packet(d, src_slot, fp);
 		if (h < 0) { /* duplicate */
 			ND("dropping %u", head);
 			continue;
@@ -332,7 +420,7 @@ dedup_push_in(struct dedup *d, const struct timeval *now)
 				 d->in_memid == d->fifo_memid));
 		}
 
-		dedup_hashmap_insert(d, h);
+		dedup_hashmap_insert(d, h, fp);
 		dedup_ptr_inc(d, &d->fifo_in);
 		out_space--;
 	}
@@ -342,3 +430,49 @@ dedup_push_in(struct dedup *d, const struct timeval *now)
 	ro->cur = dedup_can_hold(d) ? d->fifo_in.o : ro->head;
 	return n;
 }
+
+/*
+ * Sharded operation: the packet in slot s of the input ring,
+ * and fingerprint fp, has been assigned to the shard d. Returns 1 if the packet is fresh (and
+ * a copy of it is now held in the fifo of the shard), 0 if it is a duplicate.
+ * The shard does not touch the input or the output ring, the caller moves
+ * the fresh packets with dedup_forward().
+ */
+int
+dedup_shard_check(struct dedup *d, const struct netmap_slot *s, uint64_t fp,
+		const struct timeval *arrival)
+{
+	long i;
+
+	dedup_fifo_slide_win(d, arrival);
+
+	i = dedup_fresh_packet(d, s, fp);
+	if (i < 0)
+		return 0;
+
+	if (dedup_fifo_full(d)) {
+		dedup_hashmap_remove(d);
+		dedup_ptr_inc(d, &d->fifo_out);
+	}
+	d->fifo[d->fifo_in.f].arrival = *arrival;
+	dedup_transfer_pkt(d,
+		d->in_ring,
+		(struct netmap_slot *)s,
+		d->fifo_ring,
+		d->fifo_slot + d->fifo_in.f,
+		0);
+	dedup_hashmap_insert(d, i, fp);
+	dedup_ptr_inc(d, &d->fifo_in);
+	return 1;
+}
+
+void
+dedup_forward(struct dedup *d, struct netmap_slot *src, struct netmap_slot *dst)
+{
+	dedup_transfer_pkt(d,
+		d->in_ring,
+		src,
+		d->out_ring,
+		dst,
+		d->in_memid == d->out_memid);
+}
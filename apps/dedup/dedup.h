@@ -7,15 +7,19 @@
 #include <time.h>
 #include <limits.h>
 
+#define DEDUP_KEY_LEN	64	/* bytes covered by the bucket hash */
+#define DEDUP_HASH_BITS	24	/* max log2 of the hash map size */
+
 struct dedup_ptr {
 	unsigned long r; /* free running, wraps naturally */
 	unsigned short o;  /* wraps at out_ring-size */
-	unsigned short f;  /* wraps at fifo_size */
+	unsigned int f;  /* wraps at fifo_size */
 };
 
 struct dedup_fifo_entry {
 	struct timeval arrival;
-	unsigned short hashmap_entry;
+	uint64_t fp; /* fingerprint of the held packet */
+	unsigned int hashmap_entry;
 	unsigned int bucket_next; /* collision chain */
 };
 
@@ -57,6 +61,7 @@ struct dedup {
 	unsigned int fifo_size;
 	struct timeval win_size;
 	int zcopy_in_out;
+	int invariant_hdr; /* ignore L2 and the per-hop L3 fields */
 };
 
 int dedup_init(struct dedup *d, unsigned int fifo_size, struct netmap_ring *in,
@@ -77,6 +82,12 @@ static inline void dedup_ptr_inc(struct dedup *d, struct dedup_ptr *p)
 
 int dedup_push_in(struct dedup *d, const struct timeval *now);
 
+/* sharded operation, see dedup-main.c */
+uint64_t dedup_slot_hash(const struct dedup *d, const struct netmap_slot *s);
+int dedup_shard_check(struct dedup *d, const struct netmap_slot *s, uint64_t fp,
+		const struct timeval *arrival);
+void dedup_forward(struct dedup *d, struct netmap_slot *src, struct netmap_slot *dst);
+
 void dedup_fini(struct dedup *d);
 
 #endif
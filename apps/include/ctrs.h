@@ -4,7 +4,14 @@
 /* $FreeBSD$ */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 /* counters to accumulate statistics */
@@ -114,5 +121,204 @@ wait_for_next_report(struct timeval *prev, struct timeval *cur,
 	timersub(cur, prev, &delta);
 	return delta.tv_sec* 1000000 + delta.tv_usec;
 }
+
+/*
+ * Live counters in shared memory.
+ *
+ * A program publishes its counters in a POSIX shared memory segment
+ * named CTRS_SHM_PREFIX<name>, one slot per thread (or per pipe, port,
+ * ...), so that other processes (e.g. nmstat) can read them while it
+ * runs. Slots are cache-line aligned and each one is protected by a
+ * sequence counter, odd while the slot is being written: readers retry
+ * until they get the same even value before and after the copy.
+ * There is a single writer per slot, normally the thread that already
+ * collects the counters for the periodic reports, so that the packet
+ * loops are not touched at all.
+ */
+#define CTRS_SHM_PREFIX		"/netmap-ctrs."
+#define CTRS_SHM_MAGIC		0x4e4d4354	/* "NMCT" */
+#define CTRS_SHM_VERSION	1
+#define CTRS_SHM_NAMELEN	32
+#define CTRS_SHM_ALIGN		64
+
+struct ctrs_shm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;	/* slots following the header */
+	uint32_t slot_size;	/* sizeof(struct ctrs_shm_slot) */
+	int64_t pid;
+	struct timeval start;
+	char prog[CTRS_SHM_NAMELEN];
+} __attribute__((aligned(CTRS_SHM_ALIGN)));
+
+struct ctrs_shm_slot {
+	uint32_t seq;		/* odd while the slot is updated */
+	uint32_t pad;
+	char name[CTRS_SHM_NAMELEN];
+	struct my_ctrs c;
+} __attribute__((aligned(CTRS_SHM_ALIGN)));
+
+/* a mapping of a segment, on the writer or the reader side */
+struct ctrs_shm {
+	struct ctrs_shm_hdr *hdr;
+	struct ctrs_shm_slot *slot;
+	size_t size;
+	int owner;
+	char path[CTRS_SHM_NAMELEN + sizeof(CTRS_SHM_PREFIX)];
+};
+
+/*
+ * Creates (or replaces) the segment 'name' with 'nslots' slots, all
+ * zero. Returns 0 or -1 with errno set.
+ */
+static __inline int
+ctrs_shm_create(struct ctrs_shm *s, const char *name, const char *prog,
+		u_int nslots)
+{
+	void *p;
+	int fd;
+
+	memset(s, 0, sizeof(*s));
+	if (nslots == 0 || strlen(name) >= CTRS_SHM_NAMELEN ||
+			strchr(name, '/') != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	snprintf(s->path, sizeof(s->path), "%s%s", CTRS_SHM_PREFIX, name);
+	s->size = sizeof(*s->hdr) + nslots * sizeof(*s->slot);
+	shm_unlink(s->path); /* a leftover of a previous run */
+	fd = shm_open(s->path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, s->size) < 0) {
+		close(fd);
+		shm_unlink(s->path);
+		return -1;
+	}
+	p = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(s->path);
+		return -1;
+	}
+	s->hdr = p;
+	s->slot = (struct ctrs_shm_slot *)(s->hdr + 1);
+	s->owner = 1;
+	s->hdr->version = CTRS_SHM_VERSION;
+	s->hdr->nslots = nslots;
+	s->hdr->slot_size = sizeof(*s->slot);
+	s->hdr->pid = getpid();
+	gettimeofday(&s->hdr->start, NULL);
+	snprintf(s->hdr->prog, sizeof(s->hdr->prog), "%s", prog);
+	/* readers check the magic last */
+	__atomic_store_n(&s->hdr->magic, CTRS_SHM_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Maps the segment 'name' read-only. Returns 0 or -1 with errno set. */
+static __inline int
+ctrs_shm_attach(struct ctrs_shm *s, const char *name)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	memset(s, 0, sizeof(*s));
+	if (strlen(name) >= CTRS_SHM_NAMELEN || strchr(name, '/') != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	snprintf(s->path, sizeof(s->path), "%s%s", CTRS_SHM_PREFIX, name);
+	fd = shm_open(s->path, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*s->hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	s->size = st.st_size;
+	p = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+	s->hdr = p;
+	s->slot = (struct ctrs_shm_slot *)(s->hdr + 1);
+	if (__atomic_load_n(&s->hdr->magic, __ATOMIC_ACQUIRE) !=
+			CTRS_SHM_MAGIC ||
+			s->hdr->version != CTRS_SHM_VERSION ||
+			s->hdr->slot_size != sizeof(*s->slot) ||
+			s->size < sizeof(*s->hdr) +
+			(size_t)s->hdr->nslots * sizeof(*s->slot)) {
+		munmap(p, s->size);
+		s->hdr = NULL;
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+/* Unmaps the segment, and removes it on the writer side. */
+static __inline void
+ctrs_shm_close(struct ctrs_shm *s)
+{
+	if (s->hdr == NULL)
+		return;
+	munmap(s->hdr, s->size);
+	if (s->owner)
+		shm_unlink(s->path);
+	s->hdr = NULL;
+}
+
+static __inline void
+ctrs_shm_set_name(struct ctrs_shm *s, u_int i, const char *name)
+{
+	if (s->hdr == NULL || i >= s->hdr->nslots)
+		return;
+	snprintf(s->slot[i].name, sizeof(s->slot[i].name), "%s", name);
+}
+
+/* Copies 'c' into slot i. Only one thread may write a given slot. */
+static __inline void
+ctrs_shm_publish(struct ctrs_shm *s, u_int i, const struct my_ctrs *c)
+{
+	struct ctrs_shm_slot *sl;
+	uint32_t seq;
+
+	if (s->hdr == NULL || i >= s->hdr->nslots)
+		return;
+	sl = &s->slot[i];
+	seq = sl->seq;
+	__atomic_store_n(&sl->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&sl->c, c, sizeof(*c));
+	__atomic_store_n(&sl->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Takes a consistent snapshot of slot i. Returns 0, or -1 if the
+ * slot does not exist or the writer kept it busy.
+ */
+static __inline int
+ctrs_shm_read(const struct ctrs_shm *s, u_int i, struct my_ctrs *c)
+{
+	const struct ctrs_shm_slot *sl;
+	uint32_t seq;
+	int tries;
+
+	if (s->hdr == NULL || i >= s->hdr->nslots)
+		return -1;
+	sl = &s->slot[i];
+	for (tries = 0; tries < 1000; tries++) {
+		seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(c, &sl->c, sizeof(*c));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&sl->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -1;
+}
 #endif /* CTRS_H_ */
 
@@ -0,0 +1,162 @@
+#ifndef PACER_H_
+#define PACER_H_
+
+/* $FreeBSD$ */
+
+/*
+ * Transmit pacing shared by nmreplay and tlem.
+ *
+ * The consumer stages in the tx ring all the packets due before the
+ * deadline of the first one plus a tolerance (gap_tol), waits for
+ * that deadline and issues a single txsync for the whole burst.
+ * Short waits are done spinning on the clock, long ones in usleep().
+ *
+ * The pacer also keeps a histogram of the difference between the
+ * requested and the achieved inter-packet gap, where the achieved
+ * time of a packet is the time of the txsync that handed it to the NIC.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PACER_MAX_BURST		1024	/* packets recorded per sync */
+#define PACER_HIST_BUCKETS	12	/* < 64ns, < 128ns ... >= 64us */
+
+struct pacer {
+	uint64_t gap_tol;	/* coalescing tolerance (ns) */
+	uint64_t spin_ns;	/* spin for waits shorter than this */
+	uint32_t n;		/* staged packets */
+	uint64_t req[PACER_MAX_BURST];	/* their deadlines */
+	/* statistics */
+	int have_last;
+	uint64_t last_req, last_act;
+	uint64_t early[PACER_HIST_BUCKETS];	/* achieved gap too short */
+	uint64_t late[PACER_HIST_BUCKETS];	/* achieved gap too long */
+};
+
+static __inline void
+pacer_init(struct pacer *pc, uint64_t gap_tol, uint64_t spin_ns)
+{
+	memset(pc, 0, sizeof(*pc));
+	pc->gap_tol = gap_tol;
+	pc->spin_ns = spin_ns;
+}
+
+/* same time base as set_tns_now() in the applications */
+static __inline uint64_t
+pacer_now(uint64_t t0)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_REALTIME, &t);
+	return (uint64_t)t.tv_nsec + 1000000000ULL * t.tv_sec - t0;
+}
+
+/* true if a packet due at ts can join the burst being built */
+static __inline int
+pacer_ready(const struct pacer *pc, uint64_t ts, uint64_t now)
+{
+	uint64_t lim = now;
+
+	if (pc->n > 0 && (int64_t)(pc->req[0] - now) > 0)
+		lim = pc->req[0]; /* the burst leaves at this time */
+	return (int64_t)(ts - (lim + pc->gap_tol)) <= 0;
+}
+
+static __inline void
+pacer_stage(struct pacer *pc, uint64_t ts)
+{
+	if (pc->n < PACER_MAX_BURST)
+		pc->req[pc->n] = ts;
+	pc->n++;
+}
+
+/*
+ * wait until the deadline, return the current time. Returns
+ * immediately if the deadline is more than spin_ns away and
+ * may_sleep is 0.
+ */
+static __inline uint64_t
+pacer_wait(struct pacer *pc, uint64_t deadline, uint64_t t0, int may_sleep)
+{
+	uint64_t now = pacer_now(t0);
+	int64_t left = (int64_t)(deadline - now);
+
+	if (left > (int64_t)pc->spin_ns) {
+		if (!may_sleep)
+			return now;
+		usleep((left - pc->spin_ns) / 1000);
+	}
+	while ((int64_t)(deadline - now) > 0)
+		now = pacer_now(t0);
+	return now;
+}
+
+/* wait for the deadline of the staged burst; call txsync afterwards */
+static __inline uint64_t
+pacer_wait_burst(struct pacer *pc, uint64_t t0)
+{
+	if (pc->n == 0)
+		return pacer_now(t0);
+	return pacer_wait(pc, pc->req[0], t0, 1);
+}
+
+static __inline int
+pacer_bucket(uint64_t err)
+{
+	int b = 0;
+
+	for (err >>= 6; err > 0 && b < PACER_HIST_BUCKETS - 1; err >>= 1)
+		b++;
+	return b;
+}
+
+/* the staged packets have been handed to the NIC at time act */
+static __inline void
+pacer_synced(struct pacer *pc, uint64_t act)
+{
+	uint32_t i, n = pc->n < PACER_MAX_BURST ? pc->n : PACER_MAX_BURST;
+
+	for (i = 0; i < n; i++) {
+		uint64_t req = pc->req[i];
+
+		if (pc->have_last) {
+			int64_t err = (int64_t)((act - pc->last_act) -
+					(req - pc->last_req));
+
+			if (err < 0)
+				pc->early[pacer_bucket(-err)]++;
+			else
+				pc->late[pacer_bucket(err)]++;
+		}
+		pc->have_last = 1;
+		pc->last_req = req;
+		pc->last_act = act;
+	}
+	pc->n = 0;
+}
+
+static __inline void
+pacer_print(const struct pacer *pc, FILE *f, const char *name)
+{
+	int i;
+
+	fprintf(f, "%s: inter-packet gap error (achieved - requested)\n", name);
+	for (i = 0; i < PACER_HIST_BUCKETS; i++) {
+		if (pc->early[i] == 0 && pc->late[i] == 0)
+			continue;
+		if (i < PACER_HIST_BUCKETS - 1)
+			fprintf(f, "  < %6lluns: early %12llu late %12llu\n",
+				64ULL << i, (unsigned long long)pc->early[i],
+				(unsigned long long)pc->late[i]);
+		else
+			fprintf(f, "  >=%6lluns: early %12llu late %12llu\n",
+				32ULL << i, (unsigned long long)pc->early[i],
+				(unsigned long long)pc->late[i]);
+	}
+}
+
+#endif /* PACER_H_ */
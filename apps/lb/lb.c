@@ -23,8 +23,10 @@
  * SUCH DAMAGE.
  */
 /* $FreeBSD$ */
+#define _GNU_SOURCE	/* for CPU_SET() */
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <libnetmap.h>
 #include <netinet/in.h>		/* htonl */
@@ -37,7 +39,15 @@
 #include <syslog.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/time.h>
 #include <unistd.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h> /* pthread w/ affinity */
+#include <sys/cpuset.h> /* cpu_set */
+#endif /* __FreeBSD__ */
+#ifdef linux
+#define cpuset_t        cpu_set_t
+#endif /* linux */
 
 #include "pkt_hash.h"
 #include "ctrs.h"
@@ -89,6 +99,7 @@ struct compact_ipv6_hdr {
 #define DEF_STATS_INT	600
 #define BUF_REVOKE	150
 #define STAT_MSG_MAXSIZE 1024
+#define HASH_BURST	64	/* packets hashed at once */
 
 static struct {
 	char ifname[MAX_IFNAMELEN + 1];
@@ -102,6 +113,18 @@ static struct {
 	int syslog_interval;
 	int wait_link;
 	bool busy_wait;
+	bool per_ring;		/* one worker per input ring */
+	int first_cpu;		/* workers pinned from here, -1: no pinning */
+	bool hash_only;		/* benchmark the hash, do not forward */
+	int bp_policy;		/* what to do when a pipe is saturated */
+#define BP_DROP_OLDEST	0	/* revoke buffers from the longest queue */
+#define BP_DROP_NEWEST	1	/* drop the incoming packet */
+#define BP_PAUSE	2	/* stop reading the input ring */
+	uint32_t oq_credits;	/* max overflow queue length per pipe */
+	bool consistent;	/* consistent hashing in all the groups */
+	char *weights_file;	/* reread on SIGHUP */
+	char *ctrs_name;	/* counters published in shm */
+	struct ctrs_shm ctrs;
 } glob_arg;
 
 /*
@@ -116,8 +139,6 @@ struct overflow_queue {
 	uint32_t size;
 };
 
-static struct overflow_queue *freeq;
-
 static inline int
 oq_full(struct overflow_queue *q)
 {
@@ -160,13 +181,7 @@ oq_deq(struct overflow_queue *q)
 }
 
 static volatile int do_abort = 0;
-
-static uint64_t dropped = 0;
-static uint64_t forwarded = 0;
-static uint64_t received_bytes = 0;
-static uint64_t received_pkts = 0;
-static uint64_t non_ip = 0;
-static uint32_t freeq_n = 0;
+static volatile int do_reload = 0;
 
 struct port_des {
 	char interface[MAX_PORTNAMELEN];
@@ -176,23 +191,37 @@ struct port_des {
 	struct overflow_queue *oq;
 	struct nmport_d *nmd;
 	struct netmap_ring *ring;
-	struct group_des *group;
 };
 
-static struct port_des *ports;
-
 /* each group of pipes receives all the packets */
 struct group_des {
 	char pipename[MAX_IFNAMELEN];
-	struct port_des *ports;
+	int first_port;	/* index of the first port in worker->ports */
 	int first_id;
 	int nports;
 	int last;
 	int custom_port;
+	/* consistent hashing (see build_table()), table == NULL otherwise */
+	uint32_t *weights;
+	uint16_t *table;
+	uint16_t *old_table;	/* still possibly used by the workers */
 };
 
+#define MAGLEV_SIZE	65537	/* prime, much larger than nports */
+#define MAGLEV_EMPTY	0xFFFF
+#define MAX_GROUP_PORTS	(MAGLEV_EMPTY - 1)
+
 static struct group_des *groups;
 
+/* packets dropped (or held back) by reason */
+struct bp_ctrs {
+	uint64_t no_oq;		/* ring full, no overflow queue space */
+	uint64_t no_credit;	/* the pipe used all its credits */
+	uint64_t oldest;	/* revoked from the longest queue */
+	uint64_t newest;	/* no free buffer, incoming packet dropped */
+	uint64_t paused;	/* times the input was paused */
+};
+
 /* statistcs */
 struct counters {
 	struct timeval ts;
@@ -200,13 +229,39 @@ struct counters {
 	uint64_t received_pkts;
 	uint64_t received_bytes;
 	uint64_t non_ip;
+	struct bp_ctrs bp;
 	uint32_t freeq_n;
 	int status __attribute__((aligned(64)));
 #define COUNTERS_EMPTY	0
 #define COUNTERS_FULL	1
 };
 
-static struct counters counters_buf;
+/*
+ * Each worker serves one or all the rings of the input port, and owns
+ * one tx ring in each output pipe (the pipes have as many rings as
+ * there are workers), so the workers never share a ring.
+ * Overflow queues, free queue and counters are also per worker.
+ */
+struct worker {
+	int id;
+	pthread_t thread;
+	struct port_des *ports;	/* the output pipes, then the input port */
+	struct overflow_queue *oq; /* one per pipe, if any */
+	struct overflow_queue *freeq;
+	uint64_t dropped;
+	uint64_t forwarded;
+	uint64_t received_bytes;
+	uint64_t received_pkts;
+	uint64_t non_ip;
+	struct bp_ctrs bp;
+	uint64_t hash_cycles;	/* spent in the hash (-H only) */
+	struct counters counters_buf;
+};
+
+static struct worker *workers;
+static int num_workers = 1;
+
+static void reload_weights(void);
 
 static void *
 print_stats(void *arg)
@@ -215,13 +270,25 @@ print_stats(void *arg)
 	int sys_int = 0;
 	(void)arg;
 	struct my_ctrs cur, prev;
-	struct my_ctrs *pipe_prev;
+	struct my_ctrs *pipe_prev, *pipe_cur;
+	struct counters *snap;
+	int w;
 
 	pipe_prev = calloc(npipes, sizeof(struct my_ctrs));
-	if (pipe_prev == NULL) {
+	pipe_cur = calloc(npipes, sizeof(struct my_ctrs));
+	/* the last complete snapshot taken by each worker */
+	snap = calloc(num_workers, sizeof(*snap));
+	if (pipe_prev == NULL || pipe_cur == NULL || snap == NULL) {
 		D("out of memory");
 		exit(1);
 	}
+	for (w = 0; w < num_workers; w++) {
+		snap[w].ctrs = calloc(npipes, sizeof(struct my_ctrs));
+		if (snap[w].ctrs == NULL) {
+			D("out of memory");
+			exit(1);
+		}
+	}
 
 	char stat_msg[STAT_MSG_MAXSIZE] = "";
 
@@ -229,20 +296,49 @@ print_stats(void *arg)
 	while (!do_abort) {
 		int j, dosyslog = 0, dostdout = 0, newdata;
 		uint64_t pps = 0, dps = 0, bps = 0, dbps = 0, usec = 0;
+		uint64_t received_pkts = 0, non_ip = 0;
+		struct bp_ctrs bp;
+		uint32_t freeq_n = 0;
 		struct my_ctrs x;
 
-		counters_buf.status = COUNTERS_EMPTY;
+		for (w = 0; w < num_workers; w++)
+			workers[w].counters_buf.status = COUNTERS_EMPTY;
 		newdata = 0;
 		memset(&cur, 0, sizeof(cur));
+		memset(&bp, 0, sizeof(bp));
 		sleep(1);
-		if (counters_buf.status == COUNTERS_FULL) {
-			__sync_synchronize();
-			newdata = 1;
-			cur.t = counters_buf.ts;
-			if (prev.t.tv_sec || prev.t.tv_usec) {
-				usec = (cur.t.tv_sec - prev.t.tv_sec) * 1000000 +
-					cur.t.tv_usec - prev.t.tv_usec;
+		if (do_reload) {
+			do_reload = 0;
+			reload_weights();
+		}
+		for (w = 0; w < num_workers; w++) {
+			struct counters *cb = &workers[w].counters_buf;
+
+			if (cb->status == COUNTERS_FULL) {
+				__sync_synchronize();
+				newdata = 1;
+				memcpy(snap[w].ctrs, cb->ctrs,
+					npipes * sizeof(struct my_ctrs));
+				snap[w].ts = cb->ts;
+				snap[w].received_pkts = cb->received_pkts;
+				snap[w].non_ip = cb->non_ip;
+				snap[w].bp = cb->bp;
+				snap[w].freeq_n = cb->freeq_n;
 			}
+			if (timercmp(&snap[w].ts, &cur.t, >))
+				cur.t = snap[w].ts;
+			received_pkts += snap[w].received_pkts;
+			non_ip += snap[w].non_ip;
+			freeq_n += snap[w].freeq_n;
+			bp.no_oq += snap[w].bp.no_oq;
+			bp.no_credit += snap[w].bp.no_credit;
+			bp.oldest += snap[w].bp.oldest;
+			bp.newest += snap[w].bp.newest;
+			bp.paused += snap[w].bp.paused;
+		}
+		if (newdata && (prev.t.tv_sec || prev.t.tv_usec)) {
+			usec = (cur.t.tv_sec - prev.t.tv_sec) * 1000000 +
+				cur.t.tv_usec - prev.t.tv_usec;
 		}
 
 		++sys_int;
@@ -252,7 +348,18 @@ print_stats(void *arg)
 				dosyslog = 1;
 
 		for (j = 0; j < npipes; ++j) {
-			struct my_ctrs *c = &counters_buf.ctrs[j];
+			struct my_ctrs *c = &pipe_cur[j];
+
+			memset(c, 0, sizeof(*c));
+			for (w = 0; w < num_workers; w++) {
+				struct my_ctrs *wc = &snap[w].ctrs[j];
+
+				c->pkts += wc->pkts;
+				c->drop += wc->drop;
+				c->drop_bytes += wc->drop_bytes;
+				c->bytes += wc->bytes;
+				c->oq_n += wc->oq_n;
+			}
 			cur.pkts += c->pkts;
 			cur.drop += c->drop;
 			cur.drop_bytes += c->drop_bytes;
@@ -269,6 +376,10 @@ print_stats(void *arg)
 				dbps = ((x.drop_bytes*1000000 + usec/2) / usec) * 8;
 			}
 			pipe_prev[j] = *c;
+			if (newdata) {
+				c->t = cur.t;
+				ctrs_shm_publish(&glob_arg.ctrs, j, c);
+			}
 
 			if ( (dosyslog || dostdout) && newdata )
 				snprintf(stat_msg, STAT_MSG_MAXSIZE,
@@ -284,7 +395,7 @@ print_stats(void *arg)
 				       "\"packet_drop_rate_kpps\":%.4f,"
 				       "\"overflow_queue_size\":%" PRIu32
 				       "}", cur.t.tv_sec + (cur.t.tv_usec / 1000000.0),
-				            ports[j].interface,
+				            workers[0].ports[j].interface,
 				            j,
 				            c->pkts,
 				            c->drop,
@@ -324,27 +435,44 @@ print_stats(void *arg)
 			         "\"data_drop_rate_Mbps\":%.4f,"
 			         "\"packet_forward_rate_kpps\":%.4f,"
 			         "\"packet_drop_rate_kpps\":%.4f,"
-			         "\"free_buffer_slots\":%" PRIu32
+			         "\"free_buffer_slots\":%" PRIu32 ","
+			         "\"drops_no_overflow_queue\":%" PRIu64 ","
+			         "\"drops_no_credit\":%" PRIu64 ","
+			         "\"drops_oldest\":%" PRIu64 ","
+			         "\"drops_newest\":%" PRIu64 ","
+			         "\"input_pauses\":%" PRIu64
 			         "}", cur.t.tv_sec + (cur.t.tv_usec / 1000000.0),
 			              glob_arg.ifname,
 			              received_pkts,
 			              cur.pkts,
 			              cur.drop,
-			              counters_buf.non_ip,
+			              non_ip,
 			              (double)bps / 1024 / 1024,
 			              (double)dbps / 1024 / 1024,
 			              (double)pps / 1000,
 			              (double)dps / 1000,
-			              counters_buf.freeq_n);
+			              freeq_n,
+			              bp.no_oq,
+			              bp.no_credit,
+			              bp.oldest,
+			              bp.newest,
+			              bp.paused);
 
 		if (dosyslog && stat_msg[0])
 			syslog(LOG_INFO, "%s", stat_msg);
 		if (dostdout && stat_msg[0])
 			printf("%s\n", stat_msg);
 
-		prev = cur;
+		if (newdata) {
+			ctrs_shm_publish(&glob_arg.ctrs, npipes, &cur);
+			prev = cur;
+		}
 	}
 
+	for (w = 0; w < num_workers; w++)
+		free(snap[w].ctrs);
+	free(snap);
+	free(pipe_cur);
 	free(pipe_prev);
 
 	return NULL;
@@ -353,30 +481,43 @@ print_stats(void *arg)
 static void
 free_buffers(void)
 {
-	int i, tot = 0;
-	struct port_des *rxport = &ports[glob_arg.output_rings];
+	int i, w, tot = 0;
 
-	/* build a netmap free list with the buffers in all the overflow queues */
-	for (i = 0; i < glob_arg.output_rings + 1; i++) {
-		struct port_des *cp = &ports[i];
-		struct overflow_queue *q = cp->oq;
+	for (w = 0; w < num_workers; w++) {
+		struct worker *wk = &workers[w];
+		struct port_des *rxport;
 
-		if (!q)
+		if (wk->ports == NULL)
 			continue;
+		rxport = &wk->ports[glob_arg.output_rings];
+
+		/* build a netmap free list with the buffers in all the
+		 * overflow queues of this worker */
+		for (i = 0; i < glob_arg.output_rings + 1; i++) {
+			struct port_des *cp = &wk->ports[i];
+			struct overflow_queue *q = cp->oq;
+
+			if (!q || !rxport->nmd)
+				continue;
 
-		while (q->n) {
-			struct netmap_slot s = oq_deq(q);
-			uint32_t *b = (uint32_t *)NETMAP_BUF(cp->ring, s.buf_idx);
+			while (q->n) {
+				struct netmap_slot s = oq_deq(q);
+				uint32_t *b = (uint32_t *)NETMAP_BUF(rxport->ring, s.buf_idx);
 
-			*b = rxport->nmd->nifp->ni_bufs_head;
-			rxport->nmd->nifp->ni_bufs_head = s.buf_idx;
-			tot++;
+				*b = rxport->nmd->nifp->ni_bufs_head;
+				rxport->nmd->nifp->ni_bufs_head = s.buf_idx;
+				tot++;
+			}
 		}
 	}
 	D("added %d buffers to netmap free list", tot);
 
-	for (i = 0; i < glob_arg.output_rings + 1; ++i) {
-		nmport_close(ports[i].nmd);
+	for (w = 0; w < num_workers; w++) {
+		if (workers[w].ports == NULL)
+			continue;
+		for (i = 0; i < glob_arg.output_rings + 1; ++i) {
+			nmport_close(workers[w].ports[i].nmd);
+		}
 	}
 }
 
@@ -388,6 +529,12 @@ static void sigint_h(int sig)
 	signal(SIGINT, SIG_DFL);
 }
 
+static void sighup_h(int sig)
+{
+	(void)sig;		/* UNUSED */
+	do_reload = 1;
+}
+
 static void usage()
 {
 	printf("usage: lb [options]\n");
@@ -395,10 +542,19 @@ static void usage()
 	printf("  -h              	view help text\n");
 	printf("  -i iface        	interface name (required)\n");
 	printf("  -p [prefix:]npipes	add a new group of output pipes\n");
+	printf("  -p [prefix:]w0,w1,..	same, with consistent hashing and weights\n");
 	printf("  -B nbufs        	number of extra buffers (default: %d)\n", DEF_EXTRA_BUFS);
 	printf("  -b batch        	batch size (default: %d)\n", DEF_BATCH);
 	printf("  -w seconds        	wait for link up (default: %d)\n", DEF_WAIT_LINK);
 	printf("  -W                    enable busy waiting. this will run your CPU at 100%%\n");
+	printf("  -t                    one worker thread per input ring\n");
+	printf("  -c cpu                pin the workers starting from cpu (default: 0, -1: no pinning)\n");
+	printf("  -H                    only hash the input packets and report the cost\n");
+	printf("  -P policy             when a pipe is full: oldest (default), newest, pause\n");
+	printf("  -C credits            max overflow queue length of each pipe\n");
+	printf("  -m                    consistent hashing in all the groups\n");
+	printf("  -R file               pipe weights to load on SIGHUP\n");
+	printf("  -E name               publish the counters in shared memory\n");
 	printf("  -s seconds      	seconds between syslog stats messages (default: 0)\n");
 	printf("  -o seconds      	seconds between stdout stats messages (default: 0)\n");
 	exit(0);
@@ -410,6 +566,7 @@ parse_pipes(const char *spec)
 	const char *end = index(spec, ':');
 	static int max_groups = 0;
 	struct group_des *g;
+	int i;
 
 	ND("spec %s num_groups %d", spec, glob_arg.num_groups);
 	if (max_groups < glob_arg.num_groups + 1) {
@@ -446,9 +603,43 @@ parse_pipes(const char *spec)
 	}
 	if (*end == '\0') {
 		g->nports = DEF_OUT_PIPES;
+	} else if (index(end, ',') != NULL) {
+		/* list of weights */
+		const char *scan = end;
+		uint32_t sum = 0;
+
+		g->nports = 1;
+		while ((scan = index(scan, ',')) != NULL) {
+			g->nports++;
+			scan++;
+		}
+		if (g->nports > MAX_GROUP_PORTS) {
+			D("too many pipes in '%s'", end);
+			return 1;
+		}
+		g->weights = calloc(g->nports, sizeof(*g->weights));
+		if (g->weights == NULL) {
+			D("out of memory");
+			return 1;
+		}
+		for (i = 0, scan = end; i < g->nports; i++) {
+			char *next;
+
+			g->weights[i] = strtoul(scan, &next, 10);
+			if (next == scan || (*next != ',' && *next != '\0')) {
+				D("invalid weight list '%s'", end);
+				return 1;
+			}
+			sum += g->weights[i];
+			scan = next + 1;
+		}
+		if (sum == 0) {
+			D("all the weights are zero in '%s'", end);
+			return 1;
+		}
 	} else {
 		g->nports = atoi(end);
-		if (g->nports < 1) {
+		if (g->nports < 1 || g->nports > MAX_GROUP_PORTS) {
 			D("invalid number of pipes '%s' (must be at least 1)", end);
 			return 1;
 		}
@@ -458,17 +649,102 @@ parse_pipes(const char *spec)
 	return 0;
 }
 
+/* FNV-1a of the pipe name, used to place the pipes in the table */
+static uint32_t
+pipe_name_hash(const struct group_des *g, int k, uint32_t seed)
+{
+	char name[MAX_IFNAMELEN + 16];
+	const char *c;
+	uint32_t h = 2166136261U ^ seed;
+
+	snprintf(name, sizeof(name), "%s}%d", g->pipename, g->first_id + k);
+	for (c = name; *c; c++) {
+		h ^= (uint8_t)*c;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Build the lookup table of a consistent hashing group (Maglev).
+ * Each pipe walks the table along its own permutation, which only
+ * depends on the pipe name, and takes the first free entry: pipes
+ * take turns, proportionally to their weight, until the table is full.
+ * When a weight changes only the entries of the affected pipes move,
+ * so most flows keep their pipe.
+ */
+static uint16_t *
+build_table(const struct group_des *g, const uint32_t *weights)
+{
+	uint16_t *table;
+	uint32_t *offset, *skip, *next;
+	uint32_t wmax = 0, filled = 0;
+	uint64_t round;
+	int k;
+
+	table = malloc(MAGLEV_SIZE * sizeof(*table));
+	offset = calloc(3 * g->nports, sizeof(*offset));
+	if (table == NULL || offset == NULL) {
+		D("out of memory");
+		free(table);
+		free(offset);
+		return NULL;
+	}
+	skip = offset + g->nports;
+	next = skip + g->nports;
+
+	for (k = 0; k < g->nports; k++) {
+		offset[k] = pipe_name_hash(g, k, 0) % MAGLEV_SIZE;
+		skip[k] = pipe_name_hash(g, k, 0x5bd1e995) % (MAGLEV_SIZE - 1) + 1;
+		if (weights[k] > wmax)
+			wmax = weights[k];
+	}
+	for (k = 0; k < MAGLEV_SIZE; k++)
+		table[k] = MAGLEV_EMPTY;
+
+	for (round = 0; filled < MAGLEV_SIZE; round++) {
+		for (k = 0; k < g->nports && filled < MAGLEV_SIZE; k++) {
+			/* the heaviest pipes take one entry per round */
+			uint64_t turns = ((round + 1) * weights[k]) / wmax -
+				(round * weights[k]) / wmax;
+
+			while (turns-- > 0 && filled < MAGLEV_SIZE) {
+				uint32_t c;
+
+				do {
+					c = (offset[k] + (uint64_t)next[k] * skip[k]) %
+						MAGLEV_SIZE;
+					next[k]++;
+				} while (table[c] != MAGLEV_EMPTY);
+				table[c] = k;
+				filled++;
+			}
+		}
+	}
+	free(offset);
+	return table;
+}
+
+/* the pipe of group g that receives the packets with the given hash */
+static inline uint32_t
+group_port(const struct group_des *g, uint32_t hash)
+{
+	const uint16_t *table = __atomic_load_n(&g->table, __ATOMIC_ACQUIRE);
+
+	if (table != NULL)
+		return table[hash % MAGLEV_SIZE];
+	return hash % g->nports;
+}
+
 /* complete the initialization of the groups data structure */
-static void
+static int
 init_groups(void)
 {
 	int i, j, t = 0;
 	struct group_des *g = NULL;
 	for (i = 0; i < glob_arg.num_groups; i++) {
 		g = &groups[i];
-		g->ports = &ports[t];
-		for (j = 0; j < g->nports; j++)
-			g->ports[j].group = g;
+		g->first_port = t;
 		t += g->nports;
 		if (!g->custom_port)
 			strcpy(g->pipename, glob_arg.base_name);
@@ -477,8 +753,102 @@ init_groups(void)
 			if (!strcmp(h->pipename, g->pipename))
 				g->first_id += h->nports;
 		}
+		if (g->weights == NULL && glob_arg.consistent) {
+			g->weights = calloc(g->nports, sizeof(*g->weights));
+			if (g->weights == NULL) {
+				D("out of memory");
+				return 1;
+			}
+			for (j = 0; j < g->nports; j++)
+				g->weights[j] = 1;
+		}
+		if (g->weights != NULL) {
+			g->table = build_table(g, g->weights);
+			if (g->table == NULL)
+				return 1;
+		}
 	}
 	g->last = 1;
+	return 0;
+}
+
+/*
+ * Reload the weights from glob_arg.weights_file, one
+ * "group pipe weight" line for each change (groups and pipes are
+ * numbered from 0). Pipes cannot be created here, but a pipe with
+ * weight 0 receives nothing and can be brought in later.
+ * Called by the stats thread only.
+ */
+static void
+reload_weights(void)
+{
+	FILE *f = fopen(glob_arg.weights_file, "r");
+	uint32_t **neww;
+	char line[128];
+	int i, lineno = 0;
+
+	if (f == NULL) {
+		D("cannot open %s: %s", glob_arg.weights_file, strerror(errno));
+		return;
+	}
+	neww = calloc(glob_arg.num_groups, sizeof(*neww));
+	if (neww == NULL) {
+		D("out of memory");
+		fclose(f);
+		return;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		int gi, k;
+		unsigned int weight;
+		struct group_des *g;
+
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%d %d %u", &gi, &k, &weight) != 3 ||
+		    gi < 0 || gi >= glob_arg.num_groups ||
+		    k < 0 || k >= groups[gi].nports ||
+		    groups[gi].weights == NULL) {
+			D("%s:%d: ignoring invalid line", glob_arg.weights_file, lineno);
+			continue;
+		}
+		g = &groups[gi];
+		if (neww[gi] == NULL) {
+			neww[gi] = malloc(g->nports * sizeof(*neww[gi]));
+			if (neww[gi] == NULL) {
+				D("out of memory");
+				break;
+			}
+			memcpy(neww[gi], g->weights, g->nports * sizeof(*neww[gi]));
+		}
+		neww[gi][k] = weight;
+	}
+	fclose(f);
+
+	for (i = 0; i < glob_arg.num_groups; i++) {
+		struct group_des *g = &groups[i];
+		uint16_t *table;
+		uint32_t sum = 0;
+		int k;
+
+		if (neww[i] == NULL)
+			continue;
+		for (k = 0; k < g->nports; k++)
+			sum += neww[i][k];
+		if (sum == 0) {
+			D("group %d: all the weights are zero, not changed", i);
+		} else if ((table = build_table(g, neww[i])) != NULL) {
+			/* the workers may still be using the old table
+			 * for a while: free the one before that */
+			free(g->old_table);
+			g->old_table = g->table;
+			__atomic_store_n(&g->table, table, __ATOMIC_RELEASE);
+			memcpy(g->weights, neww[i], g->nports * sizeof(*neww[i]));
+			D("group %d: new weights loaded", i);
+		}
+		free(neww[i]);
+	}
+	free(neww);
 }
 
 
@@ -509,11 +879,12 @@ struct morefrag {
  * Return a free buffer.
  */
 static uint32_t
-forward_packet(struct group_des *g, struct netmap_slot *rs)
+forward_packet(struct worker *w, struct group_des *g, struct netmap_slot *rs)
 {
 	uint32_t hash = rs->ptr;
-	uint32_t output_port = hash % g->nports;
-	struct port_des *port = &g->ports[output_port];
+	uint32_t output_port = group_port(g, hash);
+	struct port_des *port = &w->ports[g->first_port + output_port];
+	struct overflow_queue *freeq = w->freeq;
 	struct netmap_ring *ring = port->ring;
 	struct overflow_queue *q = port->oq;
 	struct morefrag *mf = (struct morefrag *)ring->sem;
@@ -540,30 +911,23 @@ forward_packet(struct group_des *g, struct netmap_slot *rs)
 				curmf, ts->flags, mf->shadow_head, ring->head, ring->tail);
 		port->ctr.bytes += rs->len;
 		port->ctr.pkts++;
-		forwarded++;
+		w->forwarded++;
 		return old_slot.buf_idx;
 	}
 
 	/* use the overflow queue, if available */
 	if (q == NULL || oq_full(q)) {
-		uint32_t scan;
-		/* no space left on the ring and no overflow queue
-		 * available: we are forced to drop the packet
-		 */
-
-		/* drop previous fragments, if any */
-		for (scan = ring->head; scan != mf->shadow_head;
-				scan = nm_ring_next(ring, scan)) {
-			struct netmap_slot *ts = &ring->slot[scan];
-			dropped++;
-			port->ctr.drop_bytes += ts->len;
-		}
-		mf->shadow_head = ring->head;
-
-		dropped++;
-		port->ctr.drop++;
-		port->ctr.drop_bytes += rs->len;
-		return rs->buf_idx;
+		w->bp.no_oq++;
+		goto drop;
+	}
+	if (q->n >= glob_arg.oq_credits) {
+		w->bp.no_credit++;
+		goto drop;
+	}
+	if (oq_empty(freeq) && glob_arg.bp_policy != BP_DROP_OLDEST) {
+		/* we would need to revoke queued packets */
+		w->bp.newest++;
+		goto drop;
 	}
 
 	oq_enq(q, rs);
@@ -577,12 +941,12 @@ forward_packet(struct group_des *g, struct netmap_slot *rs)
 		 * from the longest overflow queue
 		 */
 		uint32_t j;
-		struct port_des *lp = &ports[0];
+		struct port_des *lp = &w->ports[0];
 		uint32_t max = lp->oq->n;
 
 		/* let lp point to the port with the longest queue */
 		for (j = 1; j < glob_arg.output_rings; j++) {
-			struct port_des *cp = &ports[j];
+			struct port_des *cp = &w->ports[j];
 			if (cp->oq->n > max) {
 				lp = cp;
 				max = cp->oq->n;
@@ -599,7 +963,8 @@ forward_packet(struct group_des *g, struct netmap_slot *rs)
 		for (j = 0; lp->oq->n > NETMAP_MAX_FRAGS && j < BUF_REVOKE; j++) {
 			struct netmap_slot tmp = oq_deq(lp->oq);
 
-			dropped++;
+			w->dropped++;
+			w->bp.oldest++;
 			lp->ctr.drop++;
 			lp->ctr.drop_bytes += tmp.len;
 
@@ -610,140 +975,142 @@ forward_packet(struct group_des *g, struct netmap_slot *rs)
 	}
 
 	return oq_deq(freeq).buf_idx;
-}
-
-int main(int argc, char **argv)
-{
-	int ch;
-	uint32_t i;
-	int rv;
-	unsigned int iter = 0;
-	int poll_timeout = 10; /* default */
-
-	glob_arg.ifname[0] = '\0';
-	glob_arg.output_rings = 0;
-	glob_arg.batch = DEF_BATCH;
-	glob_arg.wait_link = DEF_WAIT_LINK;
-	glob_arg.busy_wait = false;
-	glob_arg.syslog_interval = 0;
-	glob_arg.stdout_interval = 0;
-
-	while ( (ch = getopt(argc, argv, "hi:p:b:B:s:o:w:W")) != -1) {
-		switch (ch) {
-		case 'i':
-			D("interface is %s", optarg);
-			if (strlen(optarg) > MAX_IFNAMELEN - 8) {
-				D("ifname too long %s", optarg);
-				return 1;
-			}
-			if (strncmp(optarg, "netmap:", 7) && strncmp(optarg, "vale", 4)) {
-				sprintf(glob_arg.ifname, "netmap:%s", optarg);
-			} else {
-				strcpy(glob_arg.ifname, optarg);
-			}
-			break;
-
-		case 'p':
-			if (parse_pipes(optarg)) {
-				usage();
-				return 1;
-			}
-			break;
 
-		case 'B':
-			glob_arg.extra_bufs = atoi(optarg);
-			D("requested %d extra buffers", glob_arg.extra_bufs);
-			break;
+drop:
+	{
+		uint32_t scan;
+		/* no space left on the ring and no overflow queue
+		 * available: we are forced to drop the packet
+		 */
 
-		case 'b':
-			glob_arg.batch = atoi(optarg);
-			D("batch is %d", glob_arg.batch);
-			break;
+		/* drop previous fragments, if any */
+		for (scan = ring->head; scan != mf->shadow_head;
+				scan = nm_ring_next(ring, scan)) {
+			struct netmap_slot *ts = &ring->slot[scan];
+			w->dropped++;
+			port->ctr.drop_bytes += ts->len;
+		}
+		mf->shadow_head = ring->head;
 
-		case 'w':
-			glob_arg.wait_link = atoi(optarg);
-			D("link wait for up time is %d", glob_arg.wait_link);
-			break;
+		w->dropped++;
+		port->ctr.drop++;
+		port->ctr.drop_bytes += rs->len;
+		return rs->buf_idx;
+	}
+}
 
-		case 'W':
-			glob_arg.busy_wait = true;
-			break;
+/*
+ * With BP_PAUSE, true if a new packet with the given hash could not
+ * be forwarded to group g without dropping something: the input ring
+ * is then left alone until the pipe drains.
+ */
+static int
+group_saturated(struct worker *w, struct group_des *g, uint32_t hash)
+{
+	struct port_des *port = &w->ports[g->first_port + group_port(g, hash)];
+	struct overflow_queue *q = port->oq;
+	struct morefrag *mf = (struct morefrag *)port->ring->sem;
 
-		case 'o':
-			glob_arg.stdout_interval = atoi(optarg);
-			break;
+	if (mf->shadow_head != port->ring->tail && (q == NULL || oq_empty(q)))
+		return 0;
+	return q == NULL || oq_full(q) || q->n >= glob_arg.oq_credits ||
+		oq_empty(w->freeq);
+}
 
-		case 's':
-			glob_arg.syslog_interval = atoi(optarg);
-			break;
+/* set the thread affinity. */
+static int
+setaffinity(pthread_t me, int i)
+{
+	cpuset_t cpumask;
 
-		case 'h':
-			usage();
-			return 0;
-			break;
+	if (i == -1)
+		return 0;
 
-		default:
-			D("bad option %c %s", ch, optarg);
-			usage();
-			return 1;
-		}
-	}
+	/* Set thread affinity affinity.*/
+	CPU_ZERO(&cpumask);
+	CPU_SET(i, &cpumask);
 
-	if (glob_arg.ifname[0] == '\0') {
-		D("missing interface name");
-		usage();
+	if (pthread_setaffinity_np(me, sizeof(cpuset_t), &cpumask) != 0) {
+		D("Unable to set affinity: %s", strerror(errno));
 		return 1;
 	}
+	return 0;
+}
 
-	if (glob_arg.num_groups == 0)
-		parse_pipes("");
-
-	if (glob_arg.syslog_interval) {
-		setlogmask(LOG_UPTO(LOG_INFO));
-		openlog("lb", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+/* number of rx rings of the port described by d, or -1 on error */
+static int
+port_rx_rings(struct nmport_d *d)
+{
+	struct nmreq_header hdr;
+	struct nmreq_port_info_get req;
+	int fd, ret;
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0) {
+		D("cannot open /dev/netmap: %s", strerror(errno));
+		return -1;
 	}
+	hdr = d->hdr;
+	hdr.nr_reqtype = NETMAP_REQ_PORT_INFO_GET;
+	hdr.nr_options = 0;
+	hdr.nr_body = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_mem_id = d->reg.nr_mem_id;
+	ret = ioctl(fd, NIOCCTRL, &hdr);
+	close(fd);
+	if (ret < 0) {
+		D("cannot get info for %s: %s", d->hdr.nr_name, strerror(errno));
+		return -1;
+	}
+	return req.nr_rx_rings;
+}
 
+/* open the input ring(s) and the output pipes of worker w */
+static int
+worker_init(struct worker *w)
+{
 	uint32_t npipes = glob_arg.output_rings;
+	struct port_des *rxport;
+	struct overflow_queue *oq = NULL;
+	uint32_t extra_bufs, i;
+	int j, t = 0;
 
-
-	pthread_t stat_thread;
-
-	ports = calloc(npipes + 1, sizeof(struct port_des));
-	if (!ports) {
+	w->ports = calloc(npipes + 1, sizeof(struct port_des));
+	if (!w->ports) {
 		D("failed to allocate the stats array");
 		return 1;
 	}
-	struct port_des *rxport = &ports[npipes];
+	w->counters_buf.ctrs = calloc(npipes, sizeof(struct my_ctrs));
+	if (!w->counters_buf.ctrs) {
+		D("failed to allocate the counters snapshot buffer");
+		return 1;
+	}
+	rxport = &w->ports[npipes];
 
 	rxport->nmd = nmport_prepare(glob_arg.ifname);
 	if (rxport->nmd == NULL) {
 		D("cannot parse %s", glob_arg.ifname);
 		return (1);
 	}
-	/* extract the base name */
-	strncpy(glob_arg.base_name, rxport->nmd->hdr.nr_name, MAX_IFNAMELEN);
-
-	init_groups();
-
-	memset(&counters_buf, 0, sizeof(counters_buf));
-	counters_buf.ctrs = calloc(npipes, sizeof(struct my_ctrs));
-	if (!counters_buf.ctrs) {
-		D("failed to allocate the counters snapshot buffer");
-		return 1;
+	if (glob_arg.per_ring) {
+		rxport->nmd->reg.nr_mode = NR_REG_ONE_NIC;
+		rxport->nmd->reg.nr_ringid = w->id;
 	}
-
 	rxport->nmd->reg.nr_extra_bufs = glob_arg.extra_bufs;
 
 	if (nmport_open_desc(rxport->nmd) < 0) {
 		D("cannot open %s", glob_arg.ifname);
 		return (1);
 	}
-	D("successfully opened %s", glob_arg.ifname);
+	D("successfully opened %s (worker %d)", glob_arg.ifname, w->id);
 
-	uint32_t extra_bufs = rxport->nmd->reg.nr_extra_bufs;
-	struct overflow_queue *oq = NULL;
+	extra_bufs = rxport->nmd->reg.nr_extra_bufs;
 	/* reference ring to access the buffers */
-	rxport->ring = NETMAP_RXRING(rxport->nmd->nifp, 0);
+	rxport->ring = NETMAP_RXRING(rxport->nmd->nifp,
+			rxport->nmd->first_rx_ring);
+
+	if (glob_arg.hash_only)
+		return 0; /* no pipes needed */
 
 	if (!glob_arg.extra_bufs)
 		goto run;
@@ -761,15 +1128,16 @@ int main(int argc, char **argv)
 		goto run;
 	}
 
-	freeq = &oq[npipes];
-	rxport->oq = freeq;
+	w->oq = oq;
+	w->freeq = &oq[npipes];
+	rxport->oq = w->freeq;
 
-	freeq->slots = calloc(extra_bufs, sizeof(struct netmap_slot));
-	if (!freeq->slots) {
+	w->freeq->slots = calloc(extra_bufs, sizeof(struct netmap_slot));
+	if (!w->freeq->slots) {
 		D("failed to allocate the free list");
 	}
-	freeq->size = extra_bufs;
-	snprintf(freeq->name, MAX_IFNAMELEN, "free queue");
+	w->freeq->size = extra_bufs;
+	snprintf(w->freeq->name, MAX_IFNAMELEN, "free queue");
 
 	/*
 	 * the list of buffers uses the first uint32_t in each buffer
@@ -785,36 +1153,53 @@ int main(int argc, char **argv)
 		s.ptr = 0;
 		s.buf_idx = scan;
 		ND("freeq <- %d", s.buf_idx);
-		oq_enq(freeq, &s);
+		oq_enq(w->freeq, &s);
 	}
 
 
-	if (freeq->n != extra_bufs) {
+	if (w->freeq->n != extra_bufs) {
 		D("something went wrong: netmap reported %d extra_bufs, but the free list contained %d",
-				extra_bufs, freeq->n);
+				extra_bufs, w->freeq->n);
 		return 1;
 	}
 	rxport->nmd->nifp->ni_bufs_head = 0;
 
 run:
-	atexit(free_buffers);
-
-	int j, t = 0;
 	for (j = 0; j < glob_arg.num_groups; j++) {
 		struct group_des *g = &groups[j];
 		int k;
 		for (k = 0; k < g->nports; ++k) {
-			struct port_des *p = &g->ports[k];
+			struct port_des *p = &w->ports[g->first_port + k];
+			char spec[MAX_PORTNAMELEN];
+
 			snprintf(p->interface, MAX_PORTNAMELEN, "%s%s{%d/xT@%d",
 					(strncmp(g->pipename, "vale", 4) ? "netmap:" : ""),
 					g->pipename, g->first_id + k,
 					rxport->nmd->reg.nr_mem_id);
-			D("opening pipe named %s", p->interface);
+			if (glob_arg.per_ring) {
+				/* each worker uses its own ring of the pipe */
+				snprintf(spec, MAX_PORTNAMELEN, "%s%s{%d-%d/xT@%d",
+					(strncmp(g->pipename, "vale", 4) ? "netmap:" : ""),
+					g->pipename, g->first_id + k, w->id,
+					rxport->nmd->reg.nr_mem_id);
+			} else {
+				strcpy(spec, p->interface);
+			}
+			D("opening pipe named %s", spec);
 
-			p->nmd = nmport_open(p->interface);
+			p->nmd = nmport_prepare(spec);
+			if (p->nmd != NULL && glob_arg.per_ring) {
+				/* used by the first worker to create the pipe */
+				p->nmd->reg.nr_tx_rings = num_workers;
+				p->nmd->reg.nr_rx_rings = num_workers;
+			}
+			if (p->nmd != NULL && nmport_open_desc(p->nmd) < 0) {
+				nmport_close(p->nmd);
+				p->nmd = NULL;
+			}
 
 			if (p->nmd == NULL) {
-				D("cannot open %s", p->interface);
+				D("cannot open %s", spec);
 				return (1);
 			} else if (p->nmd->mem != rxport->nmd->mem) {
 				D("failed to open pipe #%d in zero-copy mode, "
@@ -826,8 +1211,9 @@ run:
 				struct morefrag *mf;
 
 				D("successfully opened pipe #%d %s (tx slots: %d)",
-				  k + 1, p->interface, p->nmd->reg.nr_tx_slots);
-				p->ring = NETMAP_TXRING(p->nmd->nifp, 0);
+				  k + 1, spec, p->nmd->reg.nr_tx_slots);
+				p->ring = NETMAP_TXRING(p->nmd->nifp,
+						p->nmd->first_tx_ring);
 				p->last_tail = nm_ring_next(p->ring, p->ring->tail);
 				mf = (struct morefrag *)p->ring->sem;
 				mf->last_flag = 0;	/* unused */
@@ -858,24 +1244,132 @@ run:
 			for (i = 0; i < npipes + 1; i++) {
 				free(oq[i].slots);
 				oq[i].slots = NULL;
+				w->ports[i].oq = NULL;
 			}
 			free(oq);
 			oq = NULL;
+			w->oq = NULL;
+			w->freeq = NULL;
 		}
 		D("*** overflow queues disabled ***");
 	}
+	return 0;
+}
 
-	sleep(glob_arg.wait_link);
+/* hash the next (at most HASH_BURST) packets of rxring */
+static u_int
+hash_burst(struct netmap_ring *rxring, uint32_t *hashes)
+{
+	const unsigned char *bufs[HASH_BURST];
+	u_int n = nm_ring_space(rxring), j = rxring->head, k;
+
+	if (n > HASH_BURST)
+		n = HASH_BURST;
+	for (k = 0; k < n; k++) {
+		bufs[k] = (const unsigned char *)NETMAP_BUF(rxring,
+				rxring->slot[j].buf_idx);
+		j = nm_ring_next(rxring, j);
+	}
+	// 'B' is just a hashing seed
+	pkt_hdr_hash_batch(bufs, hashes, n, 4, 'B');
+	return n;
+}
 
-	/* start stats thread after wait_link */
-	if (pthread_create(&stat_thread, NULL, print_stats, NULL) == -1) {
-		D("unable to create the stats thread: %s", strerror(errno));
-		return 1;
+static inline uint64_t
+read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* -H: hash the input packets and drop them, measuring the hash cost */
+static void *
+hash_body(void *arg)
+{
+	struct worker *w = arg;
+	struct port_des *rxport = &w->ports[glob_arg.output_rings];
+	struct pollfd pollfd;
+	uint32_t i;
+
+	if (glob_arg.per_ring && glob_arg.first_cpu >= 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		setaffinity(pthread_self(), (glob_arg.first_cpu + w->id) %
+				(ncpus > 0 ? ncpus : 1));
 	}
 
+	while (!do_abort) {
+		pollfd.fd = rxport->nmd->fd;
+		pollfd.events = POLLIN;
+		pollfd.revents = 0;
+		if (poll(&pollfd, 1, 10) <= 0)
+			goto send_stats;
+
+		for (i = rxport->nmd->first_rx_ring; i <= rxport->nmd->last_rx_ring; i++) {
+			struct netmap_ring *rxring = NETMAP_RXRING(rxport->nmd->nifp, i);
+
+			while (!nm_ring_empty(rxring)) {
+				uint32_t hashes[HASH_BURST];
+				uint64_t start = read_cycles();
+				u_int n = hash_burst(rxring, hashes), k;
+
+				w->hash_cycles += read_cycles() - start;
+				for (k = 0; k < n; k++) {
+					w->received_bytes +=
+						rxring->slot[rxring->head].len;
+					if (hashes[k] == 0)
+						w->non_ip++;
+					rxring->head = rxring->cur =
+						nm_ring_next(rxring, rxring->head);
+				}
+				w->received_pkts += n;
+			}
+		}
+
+	send_stats:
+		if (w->counters_buf.status == COUNTERS_FULL)
+			continue;
+		gettimeofday(&w->counters_buf.ts, NULL);
+		w->counters_buf.received_pkts = w->received_pkts;
+		w->counters_buf.received_bytes = w->received_bytes;
+		w->counters_buf.non_ip = w->non_ip;
+		__sync_synchronize();
+		w->counters_buf.status = COUNTERS_FULL;
+	}
+
+	return NULL;
+}
+
+/* the receive and forward loop of worker w */
+static void *
+worker_body(void *arg)
+{
+	struct worker *w = arg;
+	uint32_t npipes = glob_arg.output_rings;
+	struct port_des *ports = w->ports;
+	struct port_des *rxport = &ports[npipes];
+	struct overflow_queue *oq = w->oq, *freeq = w->freeq;
 	struct pollfd pollfd[npipes + 1];
+	unsigned int iter = 0;
+	int poll_timeout = 10; /* default */
+	int paused = 0;
+	uint32_t i;
+	int j, rv;
+
+	if (glob_arg.per_ring && glob_arg.first_cpu >= 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		setaffinity(pthread_self(), (glob_arg.first_cpu + w->id) %
+				(ncpus > 0 ? ncpus : 1));
+	}
+
 	memset(&pollfd, 0, sizeof(pollfd));
-	signal(SIGINT, sigint_h);
 
 	/* make sure we wake up as often as needed, even when there are no
 	 * packets coming in
@@ -918,10 +1412,13 @@ run:
 			++polli;
 		}
 
-		pollfd[polli].fd = rxport->nmd->fd;
-		pollfd[polli].events = POLLIN;
-		pollfd[polli].revents = 0;
-		++polli;
+		/* while paused, wait for the pipes to drain instead */
+		if (!paused || polli == 0) {
+			pollfd[polli].fd = rxport->nmd->fd;
+			pollfd[polli].events = POLLIN;
+			pollfd[polli].revents = 0;
+			++polli;
+		}
 
 		ND(5, "polling %d file descriptors", polli);
 		rv = poll(pollfd, polli, poll_timeout);
@@ -942,7 +1439,7 @@ run:
 			struct group_des *g = &groups[i - 1];
 
 			for (j = 0; j < g->nports; j++) {
-				struct port_des *p = &g->ports[j];
+				struct port_des *p = &ports[g->first_port + j];
 				struct netmap_ring *ring = p->ring;
 				uint32_t last = p->last_tail,
 					 stop = nm_ring_next(ring, ring->tail);
@@ -953,7 +1450,7 @@ run:
 				for ( ; last != stop; last = nm_ring_next(ring, last)) {
 					struct netmap_slot *rs = &ring->slot[last];
 					// XXX less aggressive?
-					rs->buf_idx = forward_packet(g + 1, rs);
+					rs->buf_idx = forward_packet(w, g + 1, rs);
 					rs->flags = NS_BUF_CHANGED;
 					rs->ptr = 0;
 				}
@@ -1004,62 +1501,72 @@ run:
 
 		/* push any new packets from the input port to the first group */
 		int batch = 0;
+		paused = 0;
 		for (i = rxport->nmd->first_rx_ring; i <= rxport->nmd->last_rx_ring; i++) {
 			struct netmap_ring *rxring = NETMAP_RXRING(rxport->nmd->nifp, i);
 			struct morefrag *mf = (struct morefrag *)rxring->sem;
 
 			//D("prepare to scan rings");
-			int next_head = rxring->head;
-			struct netmap_slot *next_slot = &rxring->slot[next_head];
-			const char *next_buf = NETMAP_BUF(rxring, next_slot->buf_idx);
 			while (!nm_ring_empty(rxring)) {
-				struct netmap_slot *rs = next_slot;
-				struct group_des *g = &groups[0];
-				++received_pkts;
-				received_bytes += rs->len;
-
-				// CHOOSE THE CORRECT OUTPUT PIPE
-				// If the previous slot had NS_MOREFRAG set, this is another
-				// fragment of the last packet and it should go to the same
-				// output pipe as before.
-				if (!mf->last_flag) {
-					// 'B' is just a hashing seed
-					mf->last_hash = pkt_hdr_hash((const unsigned char *)next_buf, 4, 'B');
-				}
-				mf->last_flag = rs->flags & NS_MOREFRAG;
-				rs->ptr = mf->last_hash;
-				if (rs->ptr == 0) {
-					non_ip++; // XXX ??
-				}
-				// prefetch the buffer for the next round
-				next_head = nm_ring_next(rxring, next_head);
-				next_slot = &rxring->slot[next_head];
-				next_buf = NETMAP_BUF(rxring, next_slot->buf_idx);
-				__builtin_prefetch(next_buf);
-				rs->buf_idx = forward_packet(g, rs);
-				rs->flags = NS_BUF_CHANGED;
-				rxring->head = rxring->cur = next_head;
-
-				batch++;
-				if (unlikely(batch >= glob_arg.batch)) {
-					ioctl(rxport->nmd->fd, NIOCRXSYNC, NULL);
-					batch = 0;
+				uint32_t hashes[HASH_BURST];
+				u_int n = hash_burst(rxring, hashes), k;
+
+				for (k = 0; k < n; k++) {
+					struct netmap_slot *rs = &rxring->slot[rxring->head];
+					struct group_des *g = &groups[0];
+
+					/* leave the slot (and the rest of the
+					 * ring) to the next round */
+					if (glob_arg.bp_policy == BP_PAUSE &&
+					    !mf->last_flag &&
+					    group_saturated(w, g, hashes[k])) {
+						w->bp.paused++;
+						paused = 1;
+						break;
+					}
+					++w->received_pkts;
+					w->received_bytes += rs->len;
+
+					// CHOOSE THE CORRECT OUTPUT PIPE
+					// If the previous slot had NS_MOREFRAG set, this is another
+					// fragment of the last packet and it should go to the same
+					// output pipe as before (its own hash is meaningless).
+					if (!mf->last_flag) {
+						mf->last_hash = hashes[k];
+					}
+					mf->last_flag = rs->flags & NS_MOREFRAG;
+					rs->ptr = mf->last_hash;
+					if (rs->ptr == 0) {
+						w->non_ip++; // XXX ??
+					}
+					rs->buf_idx = forward_packet(w, g, rs);
+					rs->flags = NS_BUF_CHANGED;
+					rxring->head = rxring->cur =
+						nm_ring_next(rxring, rxring->head);
+
+					batch++;
+					if (unlikely(batch >= glob_arg.batch)) {
+						ioctl(rxport->nmd->fd, NIOCRXSYNC, NULL);
+						batch = 0;
+					}
+					ND(1,
+					   "Forwarded Packets: %"PRIu64" Dropped packets: %"PRIu64"   Percent: %.2f",
+					   w->forwarded, w->dropped,
+					   ((float)w->dropped / (float)w->forwarded * 100));
 				}
-				ND(1,
-				   "Forwarded Packets: %"PRIu64" Dropped packets: %"PRIu64"   Percent: %.2f",
-				   forwarded, dropped,
-				   ((float)dropped / (float)forwarded * 100));
+				if (k < n)
+					break; /* paused */
 			}
 
 		}
 
 	send_stats:
-		if (counters_buf.status == COUNTERS_FULL)
+		if (w->counters_buf.status == COUNTERS_FULL)
 			continue;
 		/* take a new snapshot of the counters */
-		gettimeofday(&counters_buf.ts, NULL);
+		gettimeofday(&w->counters_buf.ts, NULL);
 		for (i = 0; i < npipes; i++) {
-			struct my_ctrs *c = &counters_buf.ctrs[i];
+			struct my_ctrs *c = &w->counters_buf.ctrs[i];
 			*c = ports[i].ctr;
 			/*
 			 * If there are overflow queues, copy the number of them for each
@@ -1068,27 +1575,276 @@ run:
 			if (ports[i].oq != NULL)
 				c->oq_n = ports[i].oq->n;
 		}
-		counters_buf.received_pkts = received_pkts;
-		counters_buf.received_bytes = received_bytes;
-		counters_buf.non_ip = non_ip;
+		w->counters_buf.received_pkts = w->received_pkts;
+		w->counters_buf.received_bytes = w->received_bytes;
+		w->counters_buf.non_ip = w->non_ip;
+		w->counters_buf.bp = w->bp;
 		if (freeq != NULL)
-			counters_buf.freeq_n = freeq->n;
+			w->counters_buf.freeq_n = freeq->n;
 		__sync_synchronize();
-		counters_buf.status = COUNTERS_FULL;
+		w->counters_buf.status = COUNTERS_FULL;
 	}
 
-	/*
-	 * If freeq exists, copy the number to the freeq_n member of the
-	 * message struct, otherwise set it to 0.
-	 */
-	if (freeq != NULL) {
-		freeq_n = freeq->n;
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+	int w;
+	uint64_t forwarded = 0, dropped = 0;
+	void *(*body)(void *) = worker_body;
+
+	glob_arg.ifname[0] = '\0';
+	glob_arg.output_rings = 0;
+	glob_arg.batch = DEF_BATCH;
+	glob_arg.wait_link = DEF_WAIT_LINK;
+	glob_arg.busy_wait = false;
+	glob_arg.syslog_interval = 0;
+	glob_arg.stdout_interval = 0;
+	glob_arg.per_ring = false;
+	glob_arg.first_cpu = 0;
+	glob_arg.hash_only = false;
+	glob_arg.bp_policy = BP_DROP_OLDEST;
+	glob_arg.oq_credits = UINT32_MAX;
+
+	while ( (ch = getopt(argc, argv, "hi:p:b:B:s:o:w:Wtc:HP:C:mR:E:")) != -1) {
+		switch (ch) {
+		case 'i':
+			D("interface is %s", optarg);
+			if (strlen(optarg) > MAX_IFNAMELEN - 8) {
+				D("ifname too long %s", optarg);
+				return 1;
+			}
+			if (strncmp(optarg, "netmap:", 7) && strncmp(optarg, "vale", 4)) {
+				sprintf(glob_arg.ifname, "netmap:%s", optarg);
+			} else {
+				strcpy(glob_arg.ifname, optarg);
+			}
+			break;
+
+		case 'p':
+			if (parse_pipes(optarg)) {
+				usage();
+				return 1;
+			}
+			break;
+
+		case 'B':
+			glob_arg.extra_bufs = atoi(optarg);
+			D("requested %d extra buffers", glob_arg.extra_bufs);
+			break;
+
+		case 'b':
+			glob_arg.batch = atoi(optarg);
+			D("batch is %d", glob_arg.batch);
+			break;
+
+		case 'w':
+			glob_arg.wait_link = atoi(optarg);
+			D("link wait for up time is %d", glob_arg.wait_link);
+			break;
+
+		case 'W':
+			glob_arg.busy_wait = true;
+			break;
+
+		case 't':
+			glob_arg.per_ring = true;
+			break;
+
+		case 'c':
+			glob_arg.first_cpu = atoi(optarg);
+			break;
+
+		case 'H':
+			glob_arg.hash_only = true;
+			break;
+
+		case 'P':
+			if (!strcmp(optarg, "oldest")) {
+				glob_arg.bp_policy = BP_DROP_OLDEST;
+			} else if (!strcmp(optarg, "newest")) {
+				glob_arg.bp_policy = BP_DROP_NEWEST;
+			} else if (!strcmp(optarg, "pause")) {
+				glob_arg.bp_policy = BP_PAUSE;
+			} else {
+				D("unknown policy %s", optarg);
+				usage();
+				return 1;
+			}
+			break;
+
+		case 'm':
+			glob_arg.consistent = true;
+			break;
+
+		case 'R':
+			glob_arg.weights_file = optarg;
+			break;
+
+		case 'E':
+			glob_arg.ctrs_name = optarg;
+			break;
+
+		case 'C':
+			glob_arg.oq_credits = atoi(optarg);
+			if (glob_arg.oq_credits == 0) {
+				D("credits must be positive");
+				return 1;
+			}
+			break;
+
+		case 'o':
+			glob_arg.stdout_interval = atoi(optarg);
+			break;
+
+		case 's':
+			glob_arg.syslog_interval = atoi(optarg);
+			break;
+
+		case 'h':
+			usage();
+			return 0;
+			break;
+
+		default:
+			D("bad option %c %s", ch, optarg);
+			usage();
+			return 1;
+		}
+	}
+
+	if (glob_arg.ifname[0] == '\0') {
+		D("missing interface name");
+		usage();
+		return 1;
+	}
+
+	if (glob_arg.num_groups == 0)
+		parse_pipes("");
+
+	if (glob_arg.syslog_interval) {
+		setlogmask(LOG_UPTO(LOG_INFO));
+		openlog("lb", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+	}
+
+	pthread_t stat_thread;
+
+	{
+		struct nmport_d *d = nmport_prepare(glob_arg.ifname);
+
+		if (d == NULL) {
+			D("cannot parse %s", glob_arg.ifname);
+			return (1);
+		}
+		/* extract the base name */
+		strncpy(glob_arg.base_name, d->hdr.nr_name, MAX_IFNAMELEN);
+		if (glob_arg.per_ring) {
+			if (d->reg.nr_mode != NR_REG_ALL_NIC) {
+				D("-t needs all the rings of %s", glob_arg.ifname);
+				nmport_close(d);
+				return 1;
+			}
+			num_workers = port_rx_rings(d);
+			if (num_workers < 1) {
+				nmport_close(d);
+				return 1;
+			}
+			D("starting %d workers", num_workers);
+		}
+		nmport_close(d);
+	}
+
+	if (init_groups())
+		return 1;
+
+	workers = calloc(num_workers, sizeof(*workers));
+	if (!workers) {
+		D("failed to allocate the workers");
+		return 1;
+	}
+
+	atexit(free_buffers);
+
+	for (w = 0; w < num_workers; w++) {
+		workers[w].id = w;
+		if (worker_init(&workers[w]))
+			return 1;
+	}
+
+	sleep(glob_arg.wait_link);
+
+	if (glob_arg.ctrs_name != NULL) {
+		int i;
+
+		/* one slot per output pipe and the totals */
+		if (ctrs_shm_create(&glob_arg.ctrs, glob_arg.ctrs_name, "lb",
+				glob_arg.output_rings + 1) < 0) {
+			D("cannot publish the counters in %s: %s",
+				glob_arg.ctrs_name, strerror(errno));
+		} else {
+			for (i = 0; i < glob_arg.output_rings; i++)
+				ctrs_shm_set_name(&glob_arg.ctrs, i,
+					workers[0].ports[i].interface);
+			ctrs_shm_set_name(&glob_arg.ctrs, i, glob_arg.ifname);
+		}
+	}
+
+	/* start stats thread after wait_link */
+	if (pthread_create(&stat_thread, NULL, print_stats, NULL) == -1) {
+		D("unable to create the stats thread: %s", strerror(errno));
+		return 1;
+	}
+
+	signal(SIGINT, sigint_h);
+	if (glob_arg.weights_file != NULL)
+		signal(SIGHUP, sighup_h);
+
+	if (glob_arg.hash_only)
+		body = hash_body;
+	if (!glob_arg.per_ring) {
+		body(&workers[0]);
 	} else {
-		freeq_n = 0;
+		for (w = 0; w < num_workers; w++) {
+			if (pthread_create(&workers[w].thread, NULL,
+					body, &workers[w]) != 0) {
+				D("unable to create worker %d: %s", w,
+						strerror(errno));
+				do_abort = 1;
+				num_workers = w;
+				break;
+			}
+		}
+		for (w = 0; w < num_workers; w++)
+			pthread_join(workers[w].thread, NULL);
 	}
 
 	pthread_join(stat_thread, NULL);
+	ctrs_shm_close(&glob_arg.ctrs);
+
+	if (glob_arg.hash_only) {
+		uint64_t pkts = 0, cycles = 0;
 
+		for (w = 0; w < num_workers; w++) {
+			pkts += workers[w].received_pkts;
+			cycles += workers[w].hash_cycles;
+		}
+		printf("%"PRIu64" packets hashed, %.1f %s/packet\n", pkts,
+		       pkts ? (double)cycles / pkts : 0.0,
+#if defined(__x86_64__) || defined(__i386__)
+		       "cycles"
+#else
+		       "ns"
+#endif
+		       );
+		return 0;
+	}
+
+	for (w = 0; w < num_workers; w++) {
+		forwarded += workers[w].forwarded;
+		dropped += workers[w].dropped;
+	}
 	printf("%"PRIu64" packets forwarded.  %"PRIu64" packets dropped. Total %"PRIu64"\n", forwarded,
 	       dropped, forwarded + dropped);
 	return 0;
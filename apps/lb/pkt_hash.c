@@ -52,6 +52,7 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
 
 //#include <libnet.h>
 /*---------------------------------------------------------------------*/
@@ -82,8 +83,11 @@ build_sym_key_cache(uint32_t *cache, int cache_len)
         }
 }
 
+static uint32_t byte_cache[256][4];
+static pthread_once_t byte_cache_once = PTHREAD_ONCE_INIT;
+
 static void
-build_byte_cache(uint32_t byte_cache[256][4])
+build_byte_cache(void)
 {
 #define KEY_CACHE_LEN			96
 	int i, j, k;
@@ -113,17 +117,13 @@ static uint32_t
 sym_hash_fn(uint32_t sip, uint32_t dip, uint16_t sp, uint32_t dp)
 {
 	uint32_t rc = 0;
-	static int first_time = 1;
-	static uint32_t byte_cache[256][4];
 	uint8_t *sip_b = (uint8_t *)&sip,
 		*dip_b = (uint8_t *)&dip,
 		*sp_b  = (uint8_t *)&sp,
 		*dp_b  = (uint8_t *)&dp;
 
-	if (first_time) {
-		build_byte_cache(byte_cache);
-		first_time = 0;
-	}
+	/* lb may hash from several threads */
+	pthread_once(&byte_cache_once, build_byte_cache);
 
 	rc = byte_cache[sip_b[3]][0] ^
 	     byte_cache[sip_b[2]][1] ^
@@ -363,6 +363,30 @@ pkt_hdr_hash(const unsigned char *buffer, uint8_t hash_split, uint8_t seed)
 	return rc;
 }
 
+/*---------------------------------------------------------------------*/
+/**
+ ** Batch version of pkt_hdr_hash(). The table lookups hit in the L1
+ ** cache, so the cost per packet is dominated by the miss on the
+ ** packet header: issue the prefetch PKT_HASH_PREFETCH packets ahead.
+ **/
+#define PKT_HASH_PREFETCH	4
+
+void
+pkt_hdr_hash_batch(const unsigned char * const *bufs, uint32_t *hashes,
+		   unsigned int n, uint8_t hash_split, uint8_t seed)
+{
+	unsigned int i;
+
+	for (i = 0; i < n && i < PKT_HASH_PREFETCH; i++)
+		__builtin_prefetch(bufs[i]);
+
+	for (i = 0; i < n; i++) {
+		if (likely(i + PKT_HASH_PREFETCH < n))
+			__builtin_prefetch(bufs[i + PKT_HASH_PREFETCH]);
+		hashes[i] = pkt_hdr_hash(bufs[i], hash_split, seed);
+	}
+}
+
 /*---------------------------------------------------------------------*/
 /**
  ** Parser + hash function for the GRE packet
@@ -75,5 +75,17 @@ pkt_hdr_hash(const unsigned char *buffer,
 	     uint8_t hash_split,
 	     uint8_t seed);
 /*---------------------------------------------------------------------*/
+/**
+ ** Same as pkt_hdr_hash() for a burst of n packets: hashes[i] is the
+ ** hash of bufs[i]. The headers of the next packets are prefetched
+ ** while the current one is parsed.
+ **/
+void
+pkt_hdr_hash_batch(const unsigned char * const *bufs,
+		   uint32_t *hashes,
+		   unsigned int n,
+		   uint8_t hash_split,
+		   uint8_t seed);
+/*---------------------------------------------------------------------*/
 #endif /* LB_PKT_HASH_H */
 
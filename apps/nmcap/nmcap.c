@@ -0,0 +1,766 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/* $FreeBSD$ */
+
+/*
+ * nmcap: capture the packets received on a netmap port (a NIC, a
+ * monitor, a VALE port, ...) into a pcap or pcapng file.
+ *
+ * The receive loop runs in the main thread, and a writer thread does
+ * the I/O, so that the rings are drained while the disk is busy. Two
+ * ways to hand the packets to the writer:
+ *
+ *  - copy (default): records are appended to a queue of large blocks
+ *    (-B MB each, -n of them), and the writer writes whole blocks,
+ *    optionally with O_DIRECT (-D) since the blocks are page aligned
+ *    and records may straddle two blocks. This is one copy per packet,
+ *    into memory that is written out with few large system calls.
+ *
+ *  - zero copy (-z nbufs): nbufs netmap extra buffers are swapped with
+ *    the receive slots, and the writer sends the packets to disk
+ *    straight from the netmap buffers, with writev() calls of up to
+ *    IOV_MAX segments (header, data and trailer for each packet), then
+ *    gives the buffers back to the receive loop.
+ *
+ * When the writer falls behind, the receive loop stops draining the
+ * rings, so packets are dropped by the port (and counted there), not
+ * silently in the queue.
+ */
+
+#define _GNU_SOURCE	/* for CPU_SET() and O_DIRECT */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libnetmap.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h> /* pthread w/ affinity */
+#include <sys/cpuset.h> /* cpu_set */
+#endif /* __FreeBSD__ */
+#ifdef linux
+#define cpuset_t        cpu_set_t
+#endif /* linux */
+
+#ifndef O_DIRECT
+#define O_DIRECT	0
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
+
+#define NMCAP_ALIGN	4096	/* alignment of the blocks, for O_DIRECT */
+#define NMCAP_MAX_REC	64	/* largest record header plus trailer */
+
+/* pcap, nanosecond resolution */
+#define PCAP_MAGIC_NS	0xa1b23c4d
+#define LINKTYPE_ETHERNET 1
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_pkthdr {
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+/* pcapng, one interface with nanosecond resolution */
+#define PCAPNG_SHB	0x0A0D0D0A
+#define PCAPNG_IDB	0x00000001
+#define PCAPNG_EPB	0x00000006
+#define PCAPNG_BOM	0x1A2B3C4D
+
+struct pcapng_epb {
+	uint32_t type;
+	uint32_t total_len;
+	uint32_t if_id;
+	uint32_t ts_high;
+	uint32_t ts_low;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+/* one packet, or one fragment of a packet, queued in zero copy mode */
+struct zc_ent {
+	uint32_t buf_idx;
+	uint16_t len;		/* data bytes in the buffer */
+	uint8_t hdr_len;	/* bytes in hdr, first fragment only */
+	uint8_t tr_len;		/* bytes in tr, last fragment only */
+	union {
+		struct pcap_pkthdr pcap;
+		struct pcapng_epb epb;
+	} hdr;
+	uint8_t tr[8];		/* pcapng padding and total length */
+};
+
+static struct {
+	const char *ifname;
+	const char *fname;
+	int pcapng;
+	uint32_t snaplen;
+	size_t blksize;
+	u_int nblocks;
+	int direct;
+	u_int zerocopy;		/* extra buffers, 0 for copy mode */
+	uint64_t count;		/* stop after this many packets */
+	int affinity;
+	int report;		/* seconds between reports */
+
+	struct nmport_d *d;
+	int fd;
+	uint64_t written;	/* bytes written to the file */
+	int error;		/* errno of the writer */
+
+	/* copy mode: blocks [b_tail, b_head) are full, b_head is being
+	 * filled, the others are free. */
+	char **blk;
+	size_t b_fill;
+	volatile u_int b_head, b_tail;
+
+	/* zero copy mode: zq[zq_tail, zq_head) waits for the writer,
+	 * fq[fq_tail, fq_head) holds the free buffers. */
+	u_int zq_size;		/* power of 2 */
+	struct zc_ent *zq;
+	uint32_t *fq;
+	volatile u_int zq_head, zq_tail;
+	volatile u_int fq_head, fq_tail;
+
+	/* statistics, updated by the receive loop */
+	uint64_t pkts, bytes, stalls;
+} g;
+
+static volatile int do_abort;
+static volatile int rx_done;	/* the writer can drain and exit */
+
+static void
+sigint_h(int sig)
+{
+	(void)sig;
+	do_abort = 1;
+	signal(SIGINT, SIG_DFL);
+}
+
+static int
+setaffinity(int i)
+{
+	cpuset_t cpumask;
+
+	if (i < 0)
+		return 0;
+	CPU_ZERO(&cpumask);
+	CPU_SET(i, &cpumask);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset_t),
+	    &cpumask) != 0) {
+		fprintf(stderr, "unable to set affinity: %s\n",
+		    strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int
+write_all(const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(g.fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		p += n;
+		len -= n;
+		g.written += n;
+	}
+	return 0;
+}
+
+/*
+ * copy mode
+ */
+
+/* append len bytes to the stream of blocks, waiting for the writer
+ * when all of them are full */
+static void
+blk_put(const void *src, size_t len)
+{
+	const char *s = src;
+
+	while (len > 0) {
+		size_t n = g.blksize - g.b_fill;
+
+		if (n > len)
+			n = len;
+		memcpy(g.blk[g.b_head % g.nblocks] + g.b_fill, s, n);
+		g.b_fill += n;
+		s += n;
+		len -= n;
+		if (g.b_fill < g.blksize)
+			break;
+		/* block full, wait for a free one and pass it on */
+		while (g.b_head + 1 - __atomic_load_n(&g.b_tail,
+		    __ATOMIC_ACQUIRE) >= g.nblocks && !g.error) {
+			g.stalls++;
+			usleep(50);
+		}
+		__atomic_store_n(&g.b_head, g.b_head + 1, __ATOMIC_RELEASE);
+		g.b_fill = 0;
+	}
+}
+
+static void *
+blk_writer(void *arg)
+{
+	(void)arg;
+	for (;;) {
+		u_int tail = g.b_tail;
+
+		if (tail == __atomic_load_n(&g.b_head, __ATOMIC_ACQUIRE)) {
+			if (rx_done)
+				break;
+			usleep(100);
+			continue;
+		}
+		g.error = write_all(g.blk[tail % g.nblocks], g.blksize);
+		if (g.error)
+			break;
+		__atomic_store_n(&g.b_tail, tail + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* write the partial block left after the writer has exited */
+static int
+blk_flush(void)
+{
+	uint64_t total;
+	size_t len;
+	int error;
+
+	if (g.error || g.b_fill == 0)
+		return g.error;
+	total = g.written + g.b_fill;
+	len = g.b_fill;
+	if (g.direct) {
+		/* O_DIRECT needs whole sectors, cut the file afterwards */
+		len = (len + NMCAP_ALIGN - 1) & ~(size_t)(NMCAP_ALIGN - 1);
+		memset(g.blk[g.b_head % g.nblocks] + g.b_fill, 0,
+		    len - g.b_fill);
+	}
+	error = write_all(g.blk[g.b_head % g.nblocks], len);
+	if (error)
+		return error;
+	if (len != g.b_fill && ftruncate(g.fd, total) < 0)
+		return errno;
+	g.written = total;
+	return 0;
+}
+
+/*
+ * zero copy mode
+ */
+
+static void *
+zc_writer(void *arg)
+{
+	struct netmap_ring *ring = NETMAP_RXRING(g.d->nifp, g.d->first_rx_ring);
+	struct iovec *iov;
+	u_int mask = g.zq_size - 1;
+
+	(void)arg;
+	iov = calloc(IOV_MAX, sizeof(*iov));
+	if (iov == NULL) {
+		g.error = ENOMEM;
+		return NULL;
+	}
+	for (;;) {
+		u_int tail = g.zq_tail, head, i, n = 0;
+		ssize_t left;
+
+		head = __atomic_load_n(&g.zq_head, __ATOMIC_ACQUIRE);
+		if (tail == head) {
+			if (rx_done)
+				break;
+			usleep(100);
+			continue;
+		}
+		/* up to IOV_MAX segments, three per entry at most */
+		for (i = tail; i != head && n + 3 <= IOV_MAX; i++) {
+			struct zc_ent *e = &g.zq[i & mask];
+
+			if (e->hdr_len) {
+				iov[n].iov_base = &e->hdr;
+				iov[n++].iov_len = e->hdr_len;
+			}
+			if (e->len) {
+				iov[n].iov_base = NETMAP_BUF(ring, e->buf_idx);
+				iov[n++].iov_len = e->len;
+			}
+			if (e->tr_len) {
+				iov[n].iov_base = e->tr;
+				iov[n++].iov_len = e->tr_len;
+			}
+		}
+		head = i;
+		left = writev(g.fd, iov, n);
+		if (left < 0 && errno == EINTR)
+			continue;
+		if (left < 0) {
+			g.error = errno;
+			break;
+		}
+		g.written += left;
+		/* short write: complete the remaining segments */
+		for (i = 0; i < n; i++) {
+			if ((size_t)left >= iov[i].iov_len) {
+				left -= iov[i].iov_len;
+				continue;
+			}
+			g.error = write_all((char *)iov[i].iov_base + left,
+			    iov[i].iov_len - left);
+			left = 0;
+			if (g.error)
+				break;
+		}
+		if (g.error)
+			break;
+		/* give the buffers back */
+		for (i = tail; i != head; i++) {
+			g.fq[g.fq_head & mask] = g.zq[i & mask].buf_idx;
+			__atomic_store_n(&g.fq_head, g.fq_head + 1,
+			    __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&g.zq_tail, head, __ATOMIC_RELEASE);
+	}
+	free(iov);
+	return NULL;
+}
+
+/* take the extra buffers from the interface, and size the queues */
+static int
+zc_init(void)
+{
+	struct netmap_if *nifp = g.d->nifp;
+	struct netmap_ring *ring = NETMAP_RXRING(nifp, g.d->first_rx_ring);
+	uint32_t n = g.d->reg.nr_extra_bufs, idx;
+
+	if (n == 0) {
+		fprintf(stderr, "no extra buffers available\n");
+		return -1;
+	}
+	for (g.zq_size = 1; g.zq_size < n; g.zq_size <<= 1)
+		;
+	g.zq = calloc(g.zq_size, sizeof(*g.zq));
+	g.fq = calloc(g.zq_size, sizeof(*g.fq));
+	if (g.zq == NULL || g.fq == NULL)
+		return -1;
+	for (idx = nifp->ni_bufs_head; idx != 0;
+	    idx = *(uint32_t *)NETMAP_BUF(ring, idx))
+		g.fq[g.fq_head++] = idx;
+	/* the buffers are ours now, zc_fini() gives them back */
+	nifp->ni_bufs_head = 0;
+	return 0;
+}
+
+/* put all our buffers back in the list freed by the kernel on close */
+static void
+zc_fini(void)
+{
+	struct netmap_if *nifp = g.d->nifp;
+	struct netmap_ring *ring = NETMAP_RXRING(nifp, g.d->first_rx_ring);
+	u_int mask = g.zq_size - 1, i;
+
+	for (i = g.zq_tail; i != g.zq_head; i++)
+		g.fq[g.fq_head++ & mask] = g.zq[i & mask].buf_idx;
+	for (i = g.fq_tail; i != g.fq_head; i++) {
+		uint32_t idx = g.fq[i & mask];
+
+		*(uint32_t *)NETMAP_BUF(ring, idx) = nifp->ni_bufs_head;
+		nifp->ni_bufs_head = idx;
+	}
+	g.fq_tail = g.fq_head;
+}
+
+/* queue one fragment, swapping its buffer with a free one */
+static void
+zc_put(struct netmap_slot *slot, u_int len, const void *hdr, u_int hdr_len,
+    const void *tr, u_int tr_len)
+{
+	u_int mask = g.zq_size - 1;
+	struct zc_ent *e;
+
+	while (g.fq_tail == __atomic_load_n(&g.fq_head, __ATOMIC_ACQUIRE) &&
+	    !g.error) {
+		g.stalls++;
+		usleep(50);
+	}
+	if (g.error)
+		return;
+	e = &g.zq[g.zq_head & mask];
+	e->buf_idx = slot->buf_idx;
+	e->len = len;
+	e->hdr_len = hdr_len;
+	e->tr_len = tr_len;
+	memcpy(&e->hdr, hdr, hdr_len);
+	memcpy(e->tr, tr, tr_len);
+	slot->buf_idx = g.fq[g.fq_tail & mask];
+	slot->flags |= NS_BUF_CHANGED;
+	__atomic_store_n(&g.fq_tail, g.fq_tail + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&g.zq_head, g.zq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * records
+ */
+
+static int
+write_file_header(void)
+{
+	if (g.pcapng) {
+		uint32_t shb[7] = { PCAPNG_SHB, 28, PCAPNG_BOM, 1, 0xffffffff,
+		    0xffffffff, 28 };
+		/* IDB with if_tsresol = 9 (ns) */
+		uint32_t idb[8] = { PCAPNG_IDB, 32, LINKTYPE_ETHERNET,
+		    g.snaplen, 0x00010009, 0x9, 0, 32 };
+
+		blk_put(shb, sizeof(shb));
+		blk_put(idb, sizeof(idb));
+	} else {
+		struct pcap_file_header fh = {
+			.magic = PCAP_MAGIC_NS,
+			.version_major = 2,
+			.version_minor = 4,
+			.snaplen = g.snaplen,
+			.linktype = LINKTYPE_ETHERNET,
+		};
+
+		blk_put(&fh, sizeof(fh));
+	}
+	return 0;
+}
+
+/*
+ * Write the packet starting at slot i of the ring, made of nfrags slots
+ * and len bytes, received at ts (ns).
+ */
+static void
+put_packet(struct netmap_ring *ring, u_int i, u_int nfrags, u_int len,
+    uint64_t ts)
+{
+	union {
+		struct pcap_pkthdr pcap;
+		struct pcapng_epb epb;
+	} h;
+	uint8_t tr[8] = { 0 };
+	u_int caplen = len < g.snaplen ? len : g.snaplen;
+	u_int hdr_len, tr_len = 0, left = caplen, k;
+
+	if (g.pcapng) {
+		u_int pad = (4 - (caplen & 3)) & 3;
+		uint32_t total = sizeof(h.epb) + caplen + pad + 4;
+
+		h.epb.type = PCAPNG_EPB;
+		h.epb.total_len = total;
+		h.epb.if_id = 0;
+		h.epb.ts_high = ts >> 32;
+		h.epb.ts_low = (uint32_t)ts;
+		h.epb.caplen = caplen;
+		h.epb.len = len;
+		hdr_len = sizeof(h.epb);
+		memcpy(tr + pad, &total, 4);
+		tr_len = pad + 4;
+	} else {
+		h.pcap.ts_sec = ts / 1000000000;
+		h.pcap.ts_nsec = ts % 1000000000;
+		h.pcap.caplen = caplen;
+		h.pcap.len = len;
+		hdr_len = sizeof(h.pcap);
+	}
+
+	if (!g.zerocopy)
+		blk_put(&h, hdr_len);
+	for (k = 0; k < nfrags; k++, i = nm_ring_next(ring, i)) {
+		struct netmap_slot *slot = &ring->slot[i];
+		u_int n = slot->len < left ? slot->len : left;
+		int last = (k == nfrags - 1);
+
+		left -= n;
+		if (g.zerocopy) {
+			zc_put(slot, n, &h, k == 0 ? hdr_len : 0,
+			    tr, last ? tr_len : 0);
+		} else {
+			blk_put(NETMAP_BUF_OFFSET(ring, slot), n);
+		}
+	}
+	if (!g.zerocopy && tr_len)
+		blk_put(tr, tr_len);
+}
+
+/* capture the packets available in the ring, returns how many */
+static u_int
+rx_ring(struct netmap_ring *ring)
+{
+	uint64_t ts = ring->ts.tv_sec * 1000000000ULL +
+	    ring->ts.tv_usec * 1000ULL;
+	u_int i = ring->head, n = 0;
+
+	while (i != ring->tail && !g.error) {
+		u_int j = i, nfrags = 1, len = ring->slot[i].len;
+
+		/* a packet is only complete if all its slots are here */
+		while (ring->slot[j].flags & NS_MOREFRAG) {
+			j = nm_ring_next(ring, j);
+			if (j == ring->tail)
+				goto out;
+			len += ring->slot[j].len;
+			nfrags++;
+		}
+		put_packet(ring, i, nfrags, len, ts);
+		g.pkts++;
+		g.bytes += len;
+		n++;
+		i = nm_ring_next(ring, j);
+		if (g.count && g.pkts >= g.count) {
+			do_abort = 1;
+			break;
+		}
+	}
+out:
+	ring->head = ring->cur = i;
+	return n;
+}
+
+static void
+usage(int code)
+{
+	fprintf(stderr,
+	    "usage: nmcap -i port -w file [-F pcap|pcapng] [-s snaplen]\n"
+	    "             [-B block_mb] [-n blocks] [-D] [-z nbufs]\n"
+	    "             [-c count] [-a cpu] [-r report_s]\n"
+	    "\t-i port\t\tnetmap port to capture from\n"
+	    "\t-w file\t\toutput file\n"
+	    "\t-F format\tpcap (default, ns timestamps) or pcapng\n"
+	    "\t-s snaplen\tbytes saved per packet (default 65535)\n"
+	    "\t-B MB\t\tsize of the write blocks (default 4)\n"
+	    "\t-n blocks\tnumber of write blocks (default 16)\n"
+	    "\t-D\t\twrite the blocks with O_DIRECT\n"
+	    "\t-z nbufs\tzero copy, with nbufs extra buffers\n"
+	    "\t-c count\tstop after count packets\n"
+	    "\t-a cpu\t\tpin the receive loop to cpu\n"
+	    "\t-r seconds\tinterval between reports (0: none, default 1)\n");
+	exit(code);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct timeval t0, t1, tr;
+	uint64_t pkts0 = 0, bytes0 = 0;
+	pthread_t writer;
+	struct pollfd pfd;
+	int ch, flags;
+	u_int i;
+
+	memset(&g, 0, sizeof(g));
+	g.snaplen = 65535;
+	g.blksize = 4;
+	g.nblocks = 16;
+	g.affinity = -1;
+	g.report = 1;
+	g.fd = -1;
+
+	while ((ch = getopt(argc, argv, "hi:w:F:s:B:n:Dz:c:a:r:")) != -1) {
+		switch (ch) {
+		case 'h':
+			usage(0);
+			break;
+		case 'i':
+			g.ifname = optarg;
+			break;
+		case 'w':
+			g.fname = optarg;
+			break;
+		case 'F':
+			if (!strcmp(optarg, "pcapng"))
+				g.pcapng = 1;
+			else if (strcmp(optarg, "pcap"))
+				usage(1);
+			break;
+		case 's':
+			g.snaplen = atoi(optarg);
+			break;
+		case 'B':
+			g.blksize = atoi(optarg);
+			break;
+		case 'n':
+			g.nblocks = atoi(optarg);
+			break;
+		case 'D':
+			g.direct = 1;
+			break;
+		case 'z':
+			g.zerocopy = atoi(optarg);
+			break;
+		case 'c':
+			g.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'a':
+			g.affinity = atoi(optarg);
+			break;
+		case 'r':
+			g.report = atoi(optarg);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	if (g.ifname == NULL || g.fname == NULL || g.snaplen == 0 ||
+	    g.blksize < 1 || g.blksize > 1024 || g.nblocks < 2)
+		usage(1);
+	if (g.zerocopy && g.direct) {
+		fprintf(stderr, "-D is only supported in copy mode\n");
+		return 1;
+	}
+	g.blksize <<= 20;
+
+	g.d = nmport_prepare(g.ifname);
+	if (g.d == NULL)
+		return 1;
+	g.d->reg.nr_extra_bufs = g.zerocopy;
+	if (nmport_open_desc(g.d) < 0) {
+		nmport_close(g.d);
+		return 1;
+	}
+	for (i = g.d->first_rx_ring; i <= g.d->last_rx_ring; i++)
+		NETMAP_RXRING(g.d->nifp, i)->flags |= NR_TIMESTAMP;
+	if (g.zerocopy && zc_init())
+		goto out;
+
+	flags = O_WRONLY | O_CREAT | O_TRUNC | (g.direct ? O_DIRECT : 0);
+	g.fd = open(g.fname, flags, 0644);
+	if (g.fd < 0) {
+		fprintf(stderr, "%s: %s\n", g.fname, strerror(errno));
+		goto out;
+	}
+	/* the file header goes through a block in both modes */
+	g.blk = calloc(g.nblocks, sizeof(*g.blk));
+	if (g.blk == NULL)
+		goto out;
+	for (i = 0; i < (g.zerocopy ? 1 : g.nblocks); i++) {
+		if (posix_memalign((void **)&g.blk[i], NMCAP_ALIGN,
+		    g.blksize)) {
+			fprintf(stderr, "cannot allocate the write blocks\n");
+			goto out;
+		}
+	}
+	write_file_header();
+	if (g.zerocopy) {
+		if ((g.error = blk_flush()) != 0)
+			goto out;
+		g.b_fill = 0;
+	}
+
+	if (pthread_create(&writer, NULL, g.zerocopy ? zc_writer : blk_writer,
+	    NULL)) {
+		fprintf(stderr, "cannot start the writer thread\n");
+		goto out;
+	}
+	signal(SIGINT, sigint_h);
+	setaffinity(g.affinity);
+
+	pfd.fd = g.d->fd;
+	pfd.events = POLLIN;
+	gettimeofday(&t0, NULL);
+	tr = t0;
+	while (!do_abort && !g.error) {
+		if (poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+			break;
+		for (i = g.d->first_rx_ring; i <= g.d->last_rx_ring; i++)
+			rx_ring(NETMAP_RXRING(g.d->nifp, i));
+		if (g.report == 0)
+			continue;
+		gettimeofday(&t1, NULL);
+		if (t1.tv_sec - tr.tv_sec >= g.report) {
+			double dt = (t1.tv_sec - tr.tv_sec) +
+			    (t1.tv_usec - tr.tv_usec) * 1e-6;
+
+			fprintf(stderr, "%.3f Mpps %.3f Gbps, %" PRIu64
+			    " packets, %" PRIu64 " stalls\n",
+			    (g.pkts - pkts0) / dt / 1e6,
+			    (g.bytes - bytes0) * 8 / dt / 1e9, g.pkts,
+			    g.stalls);
+			pkts0 = g.pkts;
+			bytes0 = g.bytes;
+			tr = t1;
+		}
+	}
+
+	rx_done = 1;
+	pthread_join(writer, NULL);
+	if (!g.zerocopy && g.error == 0)
+		g.error = blk_flush();
+	gettimeofday(&t1, NULL);
+	fprintf(stderr, "%" PRIu64 " packets, %" PRIu64 " bytes written "
+	    "to %s in %.3f s, %" PRIu64 " stalls\n", g.pkts, g.written,
+	    g.fname, (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) *
+	    1e-6, g.stalls);
+	if (g.error)
+		fprintf(stderr, "%s: %s\n", g.fname, strerror(g.error));
+out:
+	if (g.fd >= 0)
+		close(g.fd);
+	if (g.zq != NULL && g.fq != NULL)
+		zc_fini();
+	nmport_close(g.d);
+	if (g.blk) {
+		for (i = 0; i < g.nblocks; i++)
+			free(g.blk[i]);
+		free(g.blk);
+	}
+	free(g.zq);
+	free(g.fq);
+	return g.error ? 1 : 0;
+}
@@ -0,0 +1,830 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/* $FreeBSD$ */
+
+/*
+ * nmflow: flow accounting on netmap ports, exported with IPFIX.
+ *
+ * Each -i port (typically one of the output pipes of lb, or a monitor
+ * of a NIC) is served by its own thread, with a private flow table and
+ * its own IPFIX observation domain, so the threads share nothing.
+ *
+ * The packets of each rx batch are hashed with pkt_hdr_hash_batch()
+ * from lb, which prefetches the headers, and looked up in an
+ * open-addressing table of 64-byte entries with linear probing. The
+ * hash is stored in the entry and compared with the key, so tunnelled
+ * packets, which lb hashes on the inner header, are accounted per
+ * inner flow (the collector sums the delta counters of the records).
+ *
+ * Aging is done in batches: after each round the thread scans the
+ * share of the table corresponding to the time elapsed, so that the
+ * whole table is visited once per second, and exports the flows idle
+ * for -I ms or active for more than -A ms. Entries are removed with
+ * backward shifting, so lookups never see tombstones.
+ *
+ * Records go to the collector in IPFIX messages (RFC 7011) over UDP,
+ * sent when full or at least once per second, with the templates
+ * repeated every minute.
+ */
+
+#define _GNU_SOURCE	/* for CPU_SET() */
+#include <errno.h>
+#include <inttypes.h>
+#include <libnetmap.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h> /* pthread w/ affinity */
+#include <sys/cpuset.h> /* cpu_set */
+#endif /* __FreeBSD__ */
+#ifdef linux
+#define cpuset_t        cpu_set_t
+#endif /* linux */
+
+#include "pkt_hash.h"
+
+#define NMFLOW_MAX_PORTS	64
+#define NMFLOW_BATCH		32	/* packets hashed together */
+#define NMFLOW_SWEEP_MS		1000	/* the whole table is aged in... */
+#define NMFLOW_FLUSH_MS		1000	/* max delay of a record */
+#define NMFLOW_TMPL_MS		60000	/* template refresh */
+
+#define IPFIX_VERSION		10
+#define IPFIX_PORT		"4739"
+#define IPFIX_MSG_MAX		1400	/* stay below the path MTU */
+#define IPFIX_HDR_LEN		16
+#define IPFIX_SET_HDR_LEN	4
+#define IPFIX_TMPL_SET		2
+#define IPFIX_TMPL_V4		256
+#define IPFIX_TMPL_V6		257
+
+struct ipfix_field {
+	uint16_t id;
+	uint16_t len;
+};
+
+/* the two templates only differ in the address fields */
+static const struct ipfix_field ipfix_v4_addrs[] = {
+	{ 8, 4 },	/* sourceIPv4Address */
+	{ 12, 4 },	/* destinationIPv4Address */
+};
+static const struct ipfix_field ipfix_v6_addrs[] = {
+	{ 27, 16 },	/* sourceIPv6Address */
+	{ 28, 16 },	/* destinationIPv6Address */
+};
+static const struct ipfix_field ipfix_common[] = {
+	{ 7, 2 },	/* sourceTransportPort */
+	{ 11, 2 },	/* destinationTransportPort */
+	{ 4, 1 },	/* protocolIdentifier */
+	{ 6, 1 },	/* tcpControlBits, reduced size encoding */
+	{ 5, 1 },	/* ipClassOfService */
+	{ 1, 8 },	/* octetDeltaCount */
+	{ 2, 8 },	/* packetDeltaCount */
+	{ 152, 8 },	/* flowStartMilliseconds */
+	{ 153, 8 },	/* flowEndMilliseconds */
+};
+#define NFIELDS(a)	(sizeof(a) / sizeof((a)[0]))
+#define IPFIX_REC_V4	(2 * 4 + 2 + 2 + 1 + 1 + 1 + 4 * 8)
+#define IPFIX_REC_V6	(2 * 16 + 2 + 2 + 1 + 1 + 1 + 4 * 8)
+
+/* Addresses of IPv4 flows are in the first 4 bytes, the rest is 0,
+ * so that keys can be compared with memcmp(). ICMP type and code are
+ * stored in dport, as NetFlow does. */
+struct flow_key {
+	uint8_t		src[16];
+	uint8_t		dst[16];
+	uint16_t	sport;		/* host order */
+	uint16_t	dport;
+	uint8_t		proto;
+	uint8_t		v6;
+};
+
+/* one cache line; pkts == 0 marks a free entry */
+struct flow {
+	struct flow_key	key;
+	uint8_t		tos;
+	uint8_t		tcp_flags;	/* OR of all the packets */
+	uint32_t	hash;
+	uint32_t	pkts;
+	uint64_t	bytes;		/* from the IP header on */
+	uint32_t	first_ms;	/* relative to flow_thread.t0 */
+	uint32_t	last_ms;
+};
+
+struct flow_table {
+	struct flow	*f;
+	uint32_t	mask;		/* size - 1 */
+	uint32_t	count;
+	uint32_t	max;		/* at most 3/4 full */
+};
+
+struct exporter {
+	int		fd;
+	uint32_t	domain;		/* observation domain id */
+	uint32_t	seq;		/* data records sent so far */
+	uint32_t	nrec;		/* data records in the message */
+	uint16_t	set_id;		/* of the open set, 0 if none */
+	u_int		set_off;	/* offset of the open set */
+	u_int		len;		/* 0: no message started */
+	uint32_t	last_flush_ms;
+	uint32_t	last_tmpl_ms;
+	uint64_t	msgs, errors;
+	uint8_t		buf[IPFIX_MSG_MAX];
+};
+
+struct flow_thread {
+	pthread_t		th;
+	int			idx;
+	const char		*ifname;
+	struct nmport_d		*d;
+	struct flow_table	t;
+	struct exporter		x;
+	struct timespec		t0;	/* monotonic time at start */
+	uint64_t		t0_unix_ms;	/* the same, wall clock */
+	uint32_t		age_ms;	/* last aging round */
+	uint32_t		age_pos;	/* next entry to age */
+
+	uint64_t		pkts, bytes;
+	uint64_t		untracked;	/* not IP, or truncated */
+	uint64_t		full;		/* table full */
+	uint64_t		flows, exported;
+};
+
+static struct {
+	int			nports;
+	const char		*ifname[NMFLOW_MAX_PORTS];
+	int			affinity[NMFLOW_MAX_PORTS];
+	struct sockaddr_storage	collector;
+	socklen_t		collector_len;
+	uint32_t		active_ms;
+	uint32_t		idle_ms;
+	u_int			table_bits;
+	uint32_t		domain;
+	int			report;
+} g;
+
+static volatile int do_abort;
+
+static void
+sigint_h(int sig)
+{
+	(void)sig;
+	do_abort = 1;
+	signal(SIGINT, SIG_DFL);
+}
+
+static int
+setaffinity(int i)
+{
+	cpuset_t cpumask;
+
+	if (i < 0)
+		return 0;
+	CPU_ZERO(&cpumask);
+	CPU_SET(i, &cpumask);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset_t),
+	    &cpumask) != 0) {
+		fprintf(stderr, "unable to set affinity: %s\n",
+		    strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static uint32_t
+now_ms(const struct flow_thread *ft)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - ft->t0.tv_sec) * 1000 +
+	    (ts.tv_nsec - ft->t0.tv_nsec) / 1000000;
+}
+
+/*
+ * IPFIX export.
+ */
+
+static void
+x_put16(struct exporter *x, uint16_t v)
+{
+	x->buf[x->len++] = v >> 8;
+	x->buf[x->len++] = v;
+}
+
+static void
+x_put32(struct exporter *x, uint32_t v)
+{
+	x_put16(x, v >> 16);
+	x_put16(x, v);
+}
+
+static void
+x_put64(struct exporter *x, uint64_t v)
+{
+	x_put32(x, v >> 32);
+	x_put32(x, v);
+}
+
+static void
+x_set16(struct exporter *x, u_int off, uint16_t v)
+{
+	x->buf[off] = v >> 8;
+	x->buf[off + 1] = v;
+}
+
+static void
+x_set32(struct exporter *x, u_int off, uint32_t v)
+{
+	x_set16(x, off, v >> 16);
+	x_set16(x, off + 2, v);
+}
+
+static void
+x_close_set(struct exporter *x)
+{
+	if (x->set_id == 0)
+		return;
+	x_set16(x, x->set_off + 2, x->len - x->set_off);
+	x->set_id = 0;
+}
+
+/* send the message being built, if any */
+static void
+x_flush(struct flow_thread *ft, uint32_t now)
+{
+	struct exporter *x = &ft->x;
+
+	x->last_flush_ms = now;
+	if (x->len == 0)
+		return;
+	x_close_set(x);
+	x_set16(x, 0, IPFIX_VERSION);
+	x_set16(x, 2, x->len);
+	x_set32(x, 4, (ft->t0_unix_ms + now) / 1000);
+	x_set32(x, 8, x->seq);
+	x_set32(x, 12, x->domain);
+	if (send(x->fd, x->buf, x->len, 0) < 0)
+		x->errors++;	/* e.g., no collector yet */
+	else
+		x->msgs++;
+	x->seq += x->nrec;
+	x->nrec = 0;
+	x->len = 0;
+}
+
+/* make room for need bytes in a set with the given id */
+static void
+x_reserve(struct flow_thread *ft, uint16_t set_id, u_int need, uint32_t now)
+{
+	struct exporter *x = &ft->x;
+
+	if (x->set_id != set_id)
+		need += IPFIX_SET_HDR_LEN;
+	if (x->len + need > IPFIX_MSG_MAX)
+		x_flush(ft, now);
+	if (x->len == 0)
+		x->len = IPFIX_HDR_LEN;	/* filled by x_flush() */
+	if (x->set_id != set_id) {
+		x_close_set(x);
+		x->set_id = set_id;
+		x->set_off = x->len;
+		x_put16(x, set_id);
+		x_put16(x, 0);		/* filled by x_close_set() */
+	}
+}
+
+static void
+x_put_fields(struct exporter *x, const struct ipfix_field *f, u_int n)
+{
+	u_int i;
+
+	for (i = 0; i < n; i++) {
+		x_put16(x, f[i].id);
+		x_put16(x, f[i].len);
+	}
+}
+
+static void
+x_templates(struct flow_thread *ft, uint32_t now)
+{
+	struct exporter *x = &ft->x;
+	u_int n4 = NFIELDS(ipfix_v4_addrs) + NFIELDS(ipfix_common);
+	u_int n6 = NFIELDS(ipfix_v6_addrs) + NFIELDS(ipfix_common);
+
+	x_reserve(ft, IPFIX_TMPL_SET, 4 * (2 + n4 + n6), now);
+	x_put16(x, IPFIX_TMPL_V4);
+	x_put16(x, n4);
+	x_put_fields(x, ipfix_v4_addrs, NFIELDS(ipfix_v4_addrs));
+	x_put_fields(x, ipfix_common, NFIELDS(ipfix_common));
+	x_put16(x, IPFIX_TMPL_V6);
+	x_put16(x, n6);
+	x_put_fields(x, ipfix_v6_addrs, NFIELDS(ipfix_v6_addrs));
+	x_put_fields(x, ipfix_common, NFIELDS(ipfix_common));
+	x->last_tmpl_ms = now;
+}
+
+static void
+x_record(struct flow_thread *ft, const struct flow *f, uint32_t now)
+{
+	struct exporter *x = &ft->x;
+	u_int alen = f->key.v6 ? 16 : 4;
+
+	x_reserve(ft, f->key.v6 ? IPFIX_TMPL_V6 : IPFIX_TMPL_V4,
+	    f->key.v6 ? IPFIX_REC_V6 : IPFIX_REC_V4, now);
+	memcpy(x->buf + x->len, f->key.src, alen);
+	memcpy(x->buf + x->len + alen, f->key.dst, alen);
+	x->len += 2 * alen;
+	x_put16(x, f->key.sport);
+	x_put16(x, f->key.dport);
+	x->buf[x->len++] = f->key.proto;
+	x->buf[x->len++] = f->tcp_flags;
+	x->buf[x->len++] = f->tos;
+	x_put64(x, f->bytes);
+	x_put64(x, f->pkts);
+	x_put64(x, ft->t0_unix_ms + f->first_ms);
+	x_put64(x, ft->t0_unix_ms + f->last_ms);
+	x->nrec++;
+	ft->exported++;
+}
+
+static int
+x_open(struct exporter *x)
+{
+	x->fd = socket(g.collector.ss_family, SOCK_DGRAM, 0);
+	if (x->fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(x->fd, (struct sockaddr *)&g.collector,
+	    g.collector_len) < 0) {
+		perror("connect");
+		close(x->fd);
+		x->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Flow table.
+ */
+
+/* parse the headers of a frame into k; returns the number of bytes
+ * from the IP header on, or 0 if the frame is not accounted */
+static u_int
+flow_parse(const uint8_t *p, u_int len, struct flow_key *k, uint8_t *tos,
+	uint8_t *tcp_flags)
+{
+	u_int off = 14, l4, i;
+	uint16_t etype;
+
+	if (len < 14)
+		return 0;
+	etype = (p[12] << 8) | p[13];
+	for (i = 0; i < 2 && (etype == 0x8100 || etype == 0x88a8); i++) {
+		if (len < off + 4)
+			return 0;
+		etype = (p[off + 2] << 8) | p[off + 3];
+		off += 4;
+	}
+	memset(k, 0, sizeof(*k));
+	if (etype == 0x0800) {
+		if (len < off + 20 || (p[off] & 0xf) < 5)
+			return 0;
+		*tos = p[off + 1];
+		k->proto = p[off + 9];
+		memcpy(k->src, p + off + 12, 4);
+		memcpy(k->dst, p + off + 16, 4);
+		l4 = off + ((p[off] & 0xf) << 2);
+		/* only the first fragment has the ports */
+		if ((p[off + 6] & 0x1f) || p[off + 7])
+			l4 = len;
+	} else if (etype == 0x86dd) {
+		if (len < off + 40)
+			return 0;
+		*tos = ((p[off] & 0xf) << 4) | (p[off + 1] >> 4);
+		k->proto = p[off + 6];
+		k->v6 = 1;
+		memcpy(k->src, p + off + 8, 16);
+		memcpy(k->dst, p + off + 24, 16);
+		l4 = off + 40;
+	} else {
+		return 0;
+	}
+	*tcp_flags = 0;
+	switch (k->proto) {
+	case 6:		/* TCP */
+		if (len >= l4 + 14)
+			*tcp_flags = p[l4 + 13];
+		/* FALLTHROUGH */
+	case 17:	/* UDP */
+	case 132:	/* SCTP */
+		if (len >= l4 + 4) {
+			k->sport = (p[l4] << 8) | p[l4 + 1];
+			k->dport = (p[l4 + 2] << 8) | p[l4 + 3];
+		}
+		break;
+	case 1:		/* ICMP */
+	case 58:	/* ICMPv6 */
+		if (len >= l4 + 2)
+			k->dport = (p[l4] << 8) | p[l4 + 1];
+		break;
+	}
+	return len - off;
+}
+
+static int
+flow_table_init(struct flow_table *t, u_int bits)
+{
+	size_t size = (size_t)1 << bits;
+
+	if (posix_memalign((void **)&t->f, 64, size * sizeof(*t->f)))
+		return -1;
+	memset(t->f, 0, size * sizeof(*t->f));
+	t->mask = size - 1;
+	t->count = 0;
+	t->max = size / 4 * 3;
+	return 0;
+}
+
+/* the entry of the flow, or the free entry where it must go */
+static inline struct flow *
+flow_lookup(struct flow_table *t, const struct flow_key *k, uint32_t hash)
+{
+	uint32_t i = hash & t->mask;
+
+	for (;;) {
+		struct flow *f = &t->f[i];
+
+		if (f->pkts == 0 || (f->hash == hash &&
+		    memcmp(&f->key, k, sizeof(*k)) == 0))
+			return f;
+		i = (i + 1) & t->mask;
+	}
+}
+
+/* free entry i, moving back the entries of the same probe sequence */
+static void
+flow_delete(struct flow_table *t, uint32_t i)
+{
+	uint32_t j = i, home;
+
+	for (;;) {
+		j = (j + 1) & t->mask;
+		if (t->f[j].pkts == 0)
+			break;
+		home = t->f[j].hash & t->mask;
+		/* j can fill the hole only if i is between its home and j */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		t->f[i] = t->f[j];
+		i = j;
+	}
+	t->f[i].pkts = 0;
+	t->count--;
+}
+
+static void
+flow_account(struct flow_thread *ft, const uint8_t *buf, u_int len,
+	uint32_t hash, uint32_t now)
+{
+	struct flow_key k;
+	struct flow *f;
+	uint8_t tos = 0, tcp_flags = 0;
+	u_int bytes;
+
+	bytes = flow_parse(buf, len, &k, &tos, &tcp_flags);
+	if (bytes == 0) {
+		ft->untracked++;
+		return;
+	}
+	f = flow_lookup(&ft->t, &k, hash);
+	if (f->pkts == 0) {
+		if (ft->t.count >= ft->t.max) {
+			ft->full++;
+			return;
+		}
+		f->key = k;
+		f->hash = hash;
+		f->tos = tos;
+		f->tcp_flags = 0;
+		f->bytes = 0;
+		f->first_ms = now;
+		ft->t.count++;
+		ft->flows++;
+	}
+	f->pkts++;
+	f->bytes += bytes;
+	f->tcp_flags |= tcp_flags;
+	f->last_ms = now;
+}
+
+/* age the share of the table due since the last round (all of it if
+ * flush is set), exporting the expired flows */
+static void
+flow_age(struct flow_thread *ft, uint32_t now, int flush)
+{
+	struct flow_table *t = &ft->t;
+	uint64_t n = (uint64_t)(t->mask + 1) * (now - ft->age_ms) /
+		NMFLOW_SWEEP_MS;
+	uint32_t i = ft->age_pos;
+
+	if (flush || n > t->mask)
+		n = t->mask + 1;
+	if (n == 0)
+		return;
+	ft->age_ms = now;
+	while (n--) {
+		struct flow *f = &t->f[i];
+
+		/* a deletion may move a later entry into i, which
+		 * we then look at in the next iteration */
+		while (f->pkts != 0 && (flush ||
+		    now - f->last_ms >= g.idle_ms ||
+		    now - f->first_ms >= g.active_ms)) {
+			x_record(ft, f, now);
+			flow_delete(t, i);
+		}
+		i = (i + 1) & t->mask;
+	}
+	ft->age_pos = i;
+}
+
+static void
+rx_ring(struct flow_thread *ft, struct netmap_ring *ring, uint32_t now)
+{
+	const unsigned char *bufs[NMFLOW_BATCH];
+	uint32_t hashes[NMFLOW_BATCH];
+	u_int lens[NMFLOW_BATCH];
+	u_int head = ring->head, n = nm_ring_space(ring), m, i;
+
+	while (n > 0) {
+		m = n < NMFLOW_BATCH ? n : NMFLOW_BATCH;
+		for (i = 0; i < m; i++) {
+			struct netmap_slot *slot = &ring->slot[head];
+
+			bufs[i] = (const unsigned char *)
+				NETMAP_BUF(ring, slot->buf_idx);
+			lens[i] = slot->len;
+			ft->bytes += slot->len;
+			head = nm_ring_next(ring, head);
+		}
+		pkt_hdr_hash_batch(bufs, hashes, m, 4, 'B');
+		for (i = 0; i < m; i++)
+			flow_account(ft, bufs[i], lens[i], hashes[i], now);
+		ft->pkts += m;
+		n -= m;
+	}
+	ring->head = ring->cur = head;
+}
+
+static void *
+flow_thread_body(void *arg)
+{
+	struct flow_thread *ft = arg;
+	struct nmport_d *d = ft->d;
+	struct pollfd pfd;
+	uint32_t now;
+	int i;
+
+	setaffinity(g.affinity[ft->idx]);
+	pfd.fd = d->fd;
+	pfd.events = POLLIN;
+	x_templates(ft, 0);
+	while (!do_abort) {
+		if (poll(&pfd, 1, 100) < 0 && errno != EINTR)
+			break;
+		now = now_ms(ft);
+		for (i = d->first_rx_ring; i <= d->last_rx_ring; i++)
+			rx_ring(ft, NETMAP_RXRING(d->nifp, i), now);
+		flow_age(ft, now, 0);
+		if (now - ft->x.last_tmpl_ms >= NMFLOW_TMPL_MS)
+			x_templates(ft, now);
+		if (now - ft->x.last_flush_ms >= NMFLOW_FLUSH_MS)
+			x_flush(ft, now);
+	}
+	now = now_ms(ft);
+	flow_age(ft, now, 1);
+	x_flush(ft, now);
+	return NULL;
+}
+
+static int
+parse_collector(const char *arg)
+{
+	struct addrinfo hints, *res;
+	char buf[256], *host = buf, *p;
+	const char *port = IPFIX_PORT;
+	int err;
+
+	if (snprintf(buf, sizeof(buf), "%s", arg) >= (int)sizeof(buf))
+		return -1;
+	/* host:port, [v6addr]:port, or host alone */
+	if (buf[0] == '[' && (p = strchr(buf, ']')) != NULL) {
+		host = buf + 1;
+		*p = '\0';
+		if (p[1] == ':')
+			port = p + 2;
+	} else if ((p = strchr(host, ':')) != NULL &&
+	    strchr(p + 1, ':') == NULL) {
+		*p = '\0';
+		port = p + 1;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", arg, gai_strerror(err));
+		return -1;
+	}
+	memcpy(&g.collector, res->ai_addr, res->ai_addrlen);
+	g.collector_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return 0;
+}
+
+static void
+usage(int code)
+{
+	fprintf(stderr,
+	    "usage: nmflow -i port [-i port ...] -c collector[:port]\n"
+	    "              [-A active_ms] [-I idle_ms] [-s log2_entries]\n"
+	    "              [-D domain] [-a cpu] [-r report_s]\n"
+	    "\t-i port\t\tnetmap port to read, one thread each\n"
+	    "\t-c host[:port]\tIPFIX collector (UDP, default port "
+	    IPFIX_PORT ")\n"
+	    "\t-A ms\t\texport long flows every ms (default 60000)\n"
+	    "\t-I ms\t\texport flows idle for ms (default 15000)\n"
+	    "\t-s bits\t\t2^bits entries per thread (default 18)\n"
+	    "\t-D domain\tobservation domain of the first port "
+	    "(default 1)\n"
+	    "\t-a cpu\t\tpin the thread of the next -i port to cpu\n"
+	    "\t-r seconds\tinterval between reports (0: none, default 0)\n");
+	exit(code);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct flow_thread *ft;
+	int ch, i, affinity = -1, ret = 1;
+	time_t last_report;
+
+	memset(&g, 0, sizeof(g));
+	g.active_ms = 60000;
+	g.idle_ms = 15000;
+	g.table_bits = 18;
+	g.domain = 1;
+
+	while ((ch = getopt(argc, argv, "hi:c:A:I:s:D:a:r:")) != -1) {
+		switch (ch) {
+		case 'h':
+			usage(0);
+			break;
+		case 'i':
+			if (g.nports == NMFLOW_MAX_PORTS) {
+				fprintf(stderr, "too many ports\n");
+				usage(1);
+			}
+			g.affinity[g.nports] = affinity;
+			if (affinity >= 0)
+				affinity = -1;
+			g.ifname[g.nports++] = optarg;
+			break;
+		case 'c':
+			if (parse_collector(optarg) < 0)
+				return 1;
+			break;
+		case 'A':
+			g.active_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			g.idle_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			g.table_bits = atoi(optarg);
+			break;
+		case 'D':
+			g.domain = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			affinity = atoi(optarg);
+			break;
+		case 'r':
+			g.report = atoi(optarg);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	if (g.nports == 0 || g.collector_len == 0 || g.table_bits < 8 ||
+	    g.table_bits > 28 || g.active_ms == 0 || g.idle_ms == 0)
+		usage(1);
+
+	ft = calloc(g.nports, sizeof(*ft));
+	if (ft == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < g.nports; i++) {
+		struct timespec ts;
+
+		ft[i].idx = i;
+		ft[i].ifname = g.ifname[i];
+		ft[i].x.fd = -1;
+		ft[i].x.domain = g.domain + i;
+		ft[i].d = nmport_open(g.ifname[i]);
+		if (ft[i].d == NULL)
+			goto out;
+		if (flow_table_init(&ft[i].t, g.table_bits) < 0) {
+			fprintf(stderr, "cannot allocate the flow table\n");
+			goto out;
+		}
+		if (x_open(&ft[i].x) < 0)
+			goto out;
+		clock_gettime(CLOCK_MONOTONIC, &ft[i].t0);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ft[i].t0_unix_ms = (uint64_t)ts.tv_sec * 1000 +
+		    ts.tv_nsec / 1000000;
+	}
+
+	signal(SIGINT, sigint_h);
+	for (i = 0; i < g.nports; i++) {
+		if (pthread_create(&ft[i].th, NULL, flow_thread_body,
+		    &ft[i])) {
+			fprintf(stderr, "cannot start thread %d\n", i);
+			do_abort = 1;
+			while (--i >= 0)
+				pthread_join(ft[i].th, NULL);
+			goto out;
+		}
+	}
+	last_report = time(NULL);
+	while (!do_abort) {
+		usleep(100000);
+		if (g.report == 0 || time(NULL) - last_report < g.report)
+			continue;
+		last_report = time(NULL);
+		for (i = 0; i < g.nports; i++) {
+			/* unlocked reads, good enough for a report */
+			fprintf(stderr, "%s: %" PRIu64 " packets, %u flows "
+			    "active, %" PRIu64 " exported, %" PRIu64
+			    " table full\n", ft[i].ifname, ft[i].pkts,
+			    ft[i].t.count, ft[i].exported, ft[i].full);
+		}
+	}
+	for (i = 0; i < g.nports; i++)
+		pthread_join(ft[i].th, NULL);
+	for (i = 0; i < g.nports; i++) {
+		fprintf(stderr, "%s: %" PRIu64 " packets, %" PRIu64 " bytes, "
+		    "%" PRIu64 " not accounted, %" PRIu64 " table full, "
+		    "%" PRIu64 " flows, %" PRIu64 " records in %" PRIu64
+		    " messages, %" PRIu64 " send errors\n", ft[i].ifname,
+		    ft[i].pkts, ft[i].bytes, ft[i].untracked, ft[i].full,
+		    ft[i].flows, ft[i].exported, ft[i].x.msgs,
+		    ft[i].x.errors);
+	}
+	ret = 0;
+out:
+	for (i = 0; i < g.nports; i++) {
+		if (ft[i].d != NULL)
+			nmport_close(ft[i].d);
+		if (ft[i].x.fd >= 0)
+			close(ft[i].x.fd);
+		free(ft[i].t.f);
+	}
+	free(ft);
+	return ret;
+}
@@ -126,6 +126,7 @@
 #include <sys/resource.h> // setpriority
 #include <sys/time.h>
 #include <unistd.h>
+#include "pacer.h"
 
 /*
  *
@@ -367,6 +368,9 @@ readpcap(const char *fn)
 	pf->swap = 1;
 	pf->resolution = 1; /* nanoseconds */
 	break;
+    case 0x0A0D0D0A: /* pcapng section header */
+	EEE("%s is a pcapng file, use -S to read it", fn);
+	return NULL;
     default:
 	EEE("unknown magic 0x%x", magic);
 	return NULL;
@@ -435,12 +439,335 @@ readpcap(const char *fn)
     return pf;
 }
 
+/*
+ * Streaming reader, used with -S: the file is read sequentially
+ * through a window, so that the transmission can start right away
+ * and the trace does not need to fit in memory.
+ * It understands pcap (us and ns resolution, both byte orders) and
+ * pcapng (SHB, IDB, EPB and SPB blocks; other blocks are skipped).
+ */
+#define STREAM_WINDOW	(4U << 20)	/* read size */
+#define PCAPNG_SHB	0x0A0D0D0A
+#define PCAPNG_IDB	0x00000001
+#define PCAPNG_SPB	0x00000003
+#define PCAPNG_EPB	0x00000006
+#define PCAPNG_BOM	0x1A2B3C4D	/* byte order magic */
+#define PCAPNG_MAX_IF	64
+
+struct nm_pcap_stream {
+    int fd;
+    char *buf;		/* window on the file */
+    uint32_t bufsize;
+    uint32_t len;	/* valid bytes in buf */
+    uint32_t pos;	/* current position in buf */
+    uint64_t done;	/* file offset of buf[0] */
+    int eof;
+    int swap;
+    int ng;		/* pcapng */
+    uint32_t resolution; /* pcap: ns per timestamp unit */
+    uint64_t last_ts;
+    /* pcapng: timestamp resolution of each interface */
+    uint32_t n_if;
+    uint8_t tsresol[PCAPNG_MAX_IF];
+};
+
+static void
+stream_close(struct nm_pcap_stream *s)
+{
+    if (s == NULL)
+	return;
+    close(s->fd);
+    free(s->buf);
+    free(s);
+}
+
+/* make sure that n bytes are available at s->buf + s->pos */
+static int
+stream_fill(struct nm_pcap_stream *s, uint32_t n)
+{
+    if (s->len - s->pos >= n)
+	return 0;
+    if (s->pos > 0) {
+	/* move the leftover to the beginning of the window */
+	memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+#ifdef POSIX_FADV_DONTNEED
+	/* we will not need the data already used */
+	posix_fadvise(s->fd, 0, s->done + s->pos, POSIX_FADV_DONTNEED);
+#endif
+	s->done += s->pos;
+	s->len -= s->pos;
+	s->pos = 0;
+    }
+    if (n > s->bufsize - STREAM_WINDOW) {
+	/* a block larger than the window */
+	uint32_t newsize = n + STREAM_WINDOW;
+	char *nb = realloc(s->buf, newsize);
+
+	if (nb == NULL) {
+	    EEE("cannot grow the window to %u bytes", newsize);
+	    return -1;
+	}
+	s->buf = nb;
+	s->bufsize = newsize;
+    }
+    while (s->len < n && !s->eof) {
+	ssize_t l = read(s->fd, s->buf + s->len, s->bufsize - s->len);
+
+	if (l < 0 && errno == EINTR)
+	    continue;
+	if (l < 0) {
+	    EEE("read error: %s", strerror(errno));
+	    return -1;
+	}
+	if (l == 0)
+	    s->eof = 1;
+	s->len += l;
+    }
+    return s->len - s->pos >= n ? 0 : -1;
+}
+
+static inline uint32_t
+stream_u32(struct nm_pcap_stream *s, uint32_t ofs)
+{
+    return cvt(s->buf + s->pos + ofs, 4, s->swap);
+}
+
+/* convert a pcapng timestamp of the given resolution to ns */
+static uint64_t
+pcapng_ts(uint64_t units, uint8_t tsresol)
+{
+    uint32_t v = tsresol & 0x7f;
+    uint64_t sec, frac;
+
+    if (tsresol & 0x80) {	/* 2^-v */
+	if (v >= 64)
+	    return 0;
+	sec = units >> v;
+	frac = units & ((1ULL << v) - 1);
+	return sec * NS_SCALE + (uint64_t)((double)frac * NS_SCALE / (double)(1ULL << v));
+    }
+    /* 10^-v */
+    for (; v < 9; v++)
+	units *= 10;
+    for (; v > 9; v--)
+	units /= 10;
+    return units;
+}
+
+/* parse an interface description block */
+static void
+pcapng_idb(struct nm_pcap_stream *s, uint32_t blen)
+{
+    uint32_t ofs = 16; /* type, len, linktype + reserved, snaplen */
+    uint8_t tsresol = 6; /* the default is microseconds */
+
+    while (ofs + 4 <= blen - 4) {
+	uint32_t opt = cvt(s->buf + s->pos + ofs, 2, s->swap);
+	uint32_t olen = cvt(s->buf + s->pos + ofs + 2, 2, s->swap);
+
+	if (opt == 0) /* opt_endofopt */
+	    break;
+	if (opt == 9 && olen == 1) /* if_tsresol */
+	    tsresol = s->buf[s->pos + ofs + 4];
+	ofs += 4 + pad(olen);
+    }
+    if (s->n_if < PCAPNG_MAX_IF)
+	s->tsresol[s->n_if] = tsresol;
+    else
+	WWW("too many interfaces, using the resolution of the last one");
+    s->n_if++;
+}
+
+/* read the section header, return 0 on success */
+static int
+pcapng_shb(struct nm_pcap_stream *s)
+{
+    uint32_t bom;
+
+    if (stream_fill(s, 12))
+	return -1;
+    memcpy(&bom, s->buf + s->pos + 8, 4);
+    if (bom == PCAPNG_BOM) {
+	s->swap = 0;
+    } else if (cvt(&bom, 4, 1) == PCAPNG_BOM) {
+	s->swap = 1;
+    } else {
+	EEE("bad pcapng byte order magic 0x%x", bom);
+	return -1;
+    }
+    s->n_if = 0; /* the interfaces are per section */
+    return 0;
+}
+
+static struct nm_pcap_stream *
+stream_open(const char *fn)
+{
+    struct nm_pcap_stream *s = calloc(1, sizeof(*s));
+    uint32_t magic;
+
+    if (s == NULL)
+	return NULL;
+    s->bufsize = 2 * STREAM_WINDOW;
+    s->buf = malloc(s->bufsize);
+    s->fd = open(fn, O_RDONLY);
+    if (s->buf == NULL || s->fd < 0) {
+	EEE("cannot open file %s", fn);
+	free(s->buf);
+	free(s);
+	return NULL;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    if (stream_fill(s, 4))
+	goto fail;
+    memcpy(&magic, s->buf, 4);
+    switch (magic) {
+    case 0xa1b2c3d4: /* native, us resolution */
+    case 0xd4c3b2a1: /* swapped, us resolution */
+	s->resolution = 1000;
+	break;
+    case 0xa1b23c4d:	/* native, ns resolution */
+    case 0x4d3cb2a1:	/* swapped, ns resolution */
+	s->resolution = 1; /* nanoseconds */
+	break;
+    case PCAPNG_SHB:
+	s->ng = 1;
+	break;
+    default:
+	EEE("unknown magic 0x%x", magic);
+	goto fail;
+    }
+    if (s->ng) {
+	if (pcapng_shb(s))
+	    goto fail;
+    } else {
+	s->swap = (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1);
+	if (stream_fill(s, sizeof(struct pcap_file_header)))
+	    goto fail;
+	s->pos = sizeof(struct pcap_file_header);
+    }
+    ED("streaming %s: %s, swap %d", fn, s->ng ? "pcapng" : "pcap", s->swap);
+    return s;
+
+fail:
+    stream_close(s);
+    return NULL;
+}
+
+/*
+ * Return the next packet in *pkt, *caplen, *len and its timestamp
+ * in *ts (ns). Returns 1 on success, 0 at the end of the file,
+ * -1 on errors. Timestamps going backwards are reported and replaced
+ * by the previous one.
+ */
+static int
+stream_next(struct nm_pcap_stream *s, uint64_t *ts, const char **pkt,
+	uint32_t *caplen, uint32_t *len)
+{
+    for (;;) {
+	uint32_t type, blen;
+
+	if (s->len == s->pos && (s->eof || stream_fill(s, 1)))
+	    return 0;
+	if (!s->ng) {
+	    if (stream_fill(s, 16))
+		return -1;
+	    *ts = stream_u32(s, 0) * NS_SCALE +
+		(uint64_t)stream_u32(s, 4) * s->resolution;
+	    *caplen = stream_u32(s, 8);
+	    *len = stream_u32(s, 12);
+	    if (stream_fill(s, 16 + *caplen))
+		return -1;
+	    *pkt = s->buf + s->pos + 16;
+	    s->pos += 16 + *caplen;
+	    break;
+	}
+
+	/* pcapng: type, total length, body, total length */
+	if (stream_fill(s, 8))
+	    return -1;
+	type = stream_u32(s, 0);
+	if (type == PCAPNG_SHB) {
+	    if (pcapng_shb(s))
+		return -1;
+	}
+	blen = stream_u32(s, 4);
+	if (blen < 12 || (blen & 3)) {
+	    EEE("bad pcapng block length %u", blen);
+	    return -1;
+	}
+	if (stream_fill(s, blen))
+	    return -1;
+	if (type == PCAPNG_IDB) {
+	    pcapng_idb(s, blen);
+	} else if (type == PCAPNG_EPB && blen >= 32) {
+	    uint32_t ifid = stream_u32(s, 8);
+	    uint64_t units = ((uint64_t)stream_u32(s, 12) << 32) |
+		stream_u32(s, 16);
+
+	    if (ifid >= s->n_if) {
+		EEE("packet on unknown interface %u", ifid);
+		return -1;
+	    }
+	    *ts = pcapng_ts(units, s->tsresol[ifid < PCAPNG_MAX_IF ?
+		ifid : PCAPNG_MAX_IF - 1]);
+	    *caplen = stream_u32(s, 20);
+	    *len = stream_u32(s, 24);
+	    if (*caplen > blen - 32) {
+		EEE("bad pcapng packet length %u", *caplen);
+		return -1;
+	    }
+	    *pkt = s->buf + s->pos + 28;
+	    s->pos += blen;
+	    break;
+	} else if (type == PCAPNG_SPB && blen >= 16) {
+	    /* no timestamp, use the previous one */
+	    *ts = s->last_ts;
+	    *len = stream_u32(s, 8);
+	    *caplen = blen - 16 < *len ? blen - 16 : *len;
+	    *pkt = s->buf + s->pos + 12;
+	    s->pos += blen;
+	    break;
+	}
+	s->pos += blen; /* skip the block */
+    }
+    if (*ts < s->last_ts) {
+	RD(1, "timestamp going backwards by %.6f s",
+		1e-9 * (s->last_ts - *ts));
+	*ts = s->last_ts;
+    }
+    s->last_ts = *ts;
+    return 1;
+}
+
 enum my_pcap_mode { PM_NONE, PM_FAST, PM_FIXED, PM_REAL };
 
 static int verbose = 0;
 
 static int do_abort = 0;
 
+/*
+ * With several queues (-q), the packets of the trace are split among
+ * nq queues, each one with its own producer/consumer thread and tx ring.
+ */
+static int nq = 1;
+static int split_rr = 0;		/* round robin instead of flow hash */
+static volatile int queues_ready = 0;	/* queues waiting to start */
+static volatile int queues_go = 0;
+static uint64_t start_t0;		/* common start of times */
+static int streaming = 0;		/* -S: stream the file */
+static volatile int queues_done = 0;
+#define STREAM_QLEN	(64ULL << 20)	/* queue size when streaming */
+static uint64_t pace_tol = 0;		/* -T: burst coalescing (ns) */
+#define PACE_SPIN_NS	2000		/* spin instead of usleep below this */
+static int zerocopy = 0;		/* -Z: send from extra buffers */
+static int rewrite = 0;			/* -M: fields changed at each pass */
+#define RW_SRC		0x1
+#define RW_DST		0x2
+#define RW_SPORT	0x4
+#define RW_DPORT	0x8
+
 #ifdef linux
 #define cpuset_t        cpu_set_t
 #endif
@@ -540,6 +867,7 @@ pointer, prod_tail_1, used to check for expired packets. This is done lazily.
 
 struct _qs { /* shared queue */
 	uint64_t	t0;	/* start of times */
+	int		qid;	/* queue (and tx ring) index */
 
 	uint64_t 	buflen;	/* queue length */
 	char *buf;
@@ -556,6 +884,9 @@ struct _qs { /* shared queue */
 	uint64_t	prod_tail;	/* cached copy */
 	uint64_t	prod_drop;	/* drop packet count */
 	uint64_t	prod_max_gap;	/* rx round duration */
+	uint64_t	loop_tx;	/* duration of a pass over the queue */
+	uint64_t	prod_last_ts;	/* streaming: last trace timestamp */
+	volatile int	prod_done;	/* streaming: no more packets */
 
 	struct nm_pcap_file	*pcap;		/* the pcap struct */
 
@@ -618,6 +949,12 @@ struct _qs { /* shared queue */
 	uint64_t	cons_tail;	/* cached copy */
 	uint64_t	cons_now;	/* most recent producer timestamp */
 	uint64_t	rx_wait;	/* stats */
+	uint32_t	iter;		/* passes over the queue so far */
+	uint32_t	pkt_i;		/* packets sent in this pass */
+	uint32_t	rw_i;		/* packets rewritten in this pass */
+	uint32_t	zc_n;		/* -Z: packets in the queue */
+	uint32_t	*zc_buf;	/* -Z: the extra buffer of each one */
+	uint32_t	*zc_ring_buf;	/* -Z: original buffers of the slots */
 
 	/* shared fields */
 	volatile uint64_t _tail ALIGN_CACHE ;	/* producer writes here */
@@ -637,6 +974,8 @@ struct pipe_args {
 	struct nmport_d *pa;		/* netmap descriptor */
 	struct nmport_d *pb;
 
+	struct pacer	pacer;		/* used by cons() */
+
 	struct _qs	q;
 };
 
@@ -737,10 +1076,104 @@ null_run_fn(struct _qs *q, struct _cfg *cfg)
 
 
 
+/*
+ * symmetric hash of the addresses (and ports) of a packet, so that
+ * both directions of a flow end up in the same queue.
+ * The ports of IP fragments are not used, or the fragments of a
+ * packet could be reordered.
+ */
+static uint32_t
+flow_hash(const unsigned char *p, uint32_t caplen)
+{
+#define BE16(x)	((uint32_t)(x)[0] << 8 | (x)[1])
+#define BE32(x)	(BE16(x) << 16 | BE16((x) + 2))
+    uint32_t h = 0, ofs = 14, type, proto = 0, i;
+
+    if (caplen < 14)
+	return 0;
+    type = BE16(p + 12);
+    if (type == 0x8100 && caplen >= 18) {	/* vlan */
+	type = BE16(p + 16);
+	ofs = 18;
+    }
+    if (type == 0x0800 && caplen >= ofs + 20) {
+	const unsigned char *ip = p + ofs;
+	uint32_t hl = (ip[0] & 0xf) * 4;
+
+	proto = ip[9];
+	h = BE32(ip + 12) ^ BE32(ip + 16);
+	if ((BE16(ip + 6) & 0x3fff) == 0)	/* not a fragment */
+	    ofs += hl;
+	else
+	    proto = 0;
+    } else if (type == 0x86dd && caplen >= ofs + 40) {
+	const unsigned char *ip6 = p + ofs;
+
+	proto = ip6[6];
+	for (i = 8; i < 40; i += 4)
+	    h ^= BE32(ip6 + i);
+	ofs += 40;
+    } else {
+	for (i = 0; i < 12; i += 2)
+	    h ^= BE16(p + i);
+    }
+    if ((proto == 6 || proto == 17) && caplen >= ofs + 4)
+	h ^= BE16(p + ofs) ^ BE16(p + ofs + 2);
+    h ^= proto;
+    /* mix the bits, the queue is h % nq */
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h;
+#undef BE32
+#undef BE16
+}
+
+/*
+ * apply the loss, bandwidth and delay emulation to the current packet
+ * and compute its exit time. Returns 0 if the packet must be dropped.
+ */
+static int
+schedule_pkt(struct _qs *q)
+{
+    uint64_t t_tx, tt;
+
+    q->c_loss.run(q, &q->c_loss);
+    if (q->cur_drop)
+	return 0;
+    q->c_bw.run(q, &q->c_bw);
+    tt = q->cur_tt;
+    q->qt_qout += tt;
+#if 0
+    if (drop_after(q))
+	return 0;
+#endif
+    q->c_delay.run(q, &q->c_delay); /* compute delay */
+    t_tx = q->qt_qout + q->cur_delay;
+    ND(5, "tt %ld qout %ld tx %ld qt_tx %ld", tt, q->qt_qout, t_tx, q->qt_tx);
+    /* insure no reordering and spacing by transmission time */
+    q->qt_tx = (t_tx >= q->qt_tx + tt) ? t_tx : q->qt_tx + tt;
+    return 1;
+}
+
+/* the queue of the i-th packet of the trace */
+static inline int
+queue_of(const char *pkt, uint32_t caplen, uint64_t i)
+{
+    if (nq == 1)
+	return 0;
+    if (split_rr)
+	return i % nq;
+    return flow_hash((const unsigned char *)pkt, caplen) % nq;
+}
+
 /*
  * put packet data into the buffer.
  * We read from the mmapped pcap file, construct header, copy
  * the captured length of the packet and pad with zeroes.
+ * With several queues, only the packets of queue q->qid are stored,
+ * and the time between them includes the gaps of the packets that
+ * go to the other queues.
  */
 static void *
 pcap_prod(void *_pa)
@@ -751,8 +1184,27 @@ pcap_prod(void *_pa)
     uint32_t loops, i, tot_pkts;
 
     /* data plus the loop record */
-    uint64_t need;
-    uint64_t t_tx, tt, last_ts; /* last timestamp from trace */
+    uint64_t need, own_bytes = pf->tot_bytes_rounded;
+    uint64_t last_ts; /* last timestamp from trace */
+    uint64_t gap = 0; /* time since the last packet of this queue */
+
+    if (nq > 1) {
+	/* only reserve room for our share of the trace */
+	own_bytes = 0;
+	pf->cur = pf->data + sizeof(struct pcap_file_header);
+	pf->err = 0;
+	for (i = 0; i < pf->tot_pkt; i++) {
+	    uint32_t caplen, len;
+
+	    read_next_info(pf, 4);
+	    read_next_info(pf, 4);
+	    caplen = read_next_info(pf, 4);
+	    len = read_next_info(pf, 4);
+	    if (queue_of(pf->cur, caplen, i) == q->qid)
+		own_bytes += pad(len) + sizeof(struct q_pkt);
+	    pf->cur += caplen;
+	}
+    }
 
     /*
      * For speed we make sure the trace is at least some 1000 packets,
@@ -760,7 +1212,7 @@ pcap_prod(void *_pa)
      */
     loops = (1 + 10000 / pf->tot_pkt);
     tot_pkts = loops * pf->tot_pkt;
-    need = loops * pf->tot_bytes_rounded + sizeof(struct q_pkt);
+    need = loops * own_bytes + sizeof(struct q_pkt);
     q->buf = calloc(1, need);
     if (q->buf == NULL) {
 	D("alloc %lld bytes for queue failed, exiting",(long long)need);
@@ -781,6 +1233,7 @@ pcap_prod(void *_pa)
     for (loops = 0, i = 0; i < tot_pkts && !do_abort; i++) {
 	const char *next_pkt; /* in the pcap buffer */
 	uint64_t cur_ts;
+	int mine;
 
 	/* read values from the pcap buffer */
 	cur_ts = read_next_info(pf, 4) * NS_SCALE +
@@ -789,10 +1242,13 @@ pcap_prod(void *_pa)
 	q->cur_len = read_next_info(pf, 4);
 	next_pkt = pf->cur + q->cur_caplen;
 
+	mine = queue_of(pf->cur, q->cur_caplen, i % pf->tot_pkt) == q->qid;
+
 	/* prepare fields in q for the generator */
 	q->cur_pkt = pf->cur;
 	/* initial estimate of tx time */
-	q->cur_tt = cur_ts - last_ts;
+	gap += cur_ts - last_ts;
+	q->cur_tt = gap;
 	    // -pf->first_ts + loops * pf->total_tx_time - last_ts;
 
 	if ((i % pf->tot_pkt) == 0)
@@ -808,21 +1264,11 @@ pcap_prod(void *_pa)
 	    loops++;
 	}
 
-	q->c_loss.run(q, &q->c_loss);
-	if (q->cur_drop)
+	if (!mine)
 	    continue;
-	q->c_bw.run(q, &q->c_bw);
-	tt = q->cur_tt;
-	q->qt_qout += tt;
-#if 0
-	if (drop_after(q))
+	gap = 0;
+	if (!schedule_pkt(q))
 	    continue;
-#endif
-	q->c_delay.run(q, &q->c_delay); /* compute delay */
-	t_tx = q->qt_qout + q->cur_delay;
-	ND(5, "tt %ld qout %ld tx %ld qt_tx %ld", tt, q->qt_qout, t_tx, q->qt_tx);
-	/* insure no reordering and spacing by transmission time */
-	q->qt_tx = (t_tx >= q->qt_tx + tt) ? t_tx : q->qt_tx + tt;
 	enq(q);
 
 	q->tx++;
@@ -831,31 +1277,376 @@ pcap_prod(void *_pa)
     /* loop marker ? */
     ED("done q->prod_tail:%d",(int)q->prod_tail);
     q->_tail = q->prod_tail; /* publish */
+    /* the next pass starts after the trailing packets of the other queues */
+    q->loop_tx = q->qt_tx + gap;
 
     return NULL;
 fail:
     if (q->buf != NULL) {
 	free(q->buf);
+	q->buf = NULL;
     }
     nmport_close(pa->pb);
+    do_abort = 1;
     return (NULL);
 }
 
 
+/*
+ * Streaming: the queue is a circular buffer. A record with pktlen 0
+ * tells the consumer to continue from the beginning of the buffer.
+ * Returns 1 if there is room for need bytes at q->prod_tail (which may
+ * have wrapped), 0 if we must wait for the consumer.
+ */
+static int
+stream_room(struct _qs *q, uint64_t need)
+{
+    uint64_t h = q->_head, t = q->prod_tail;
+
+    __sync_synchronize();
+    if (h > t)
+	return t + need < h;
+    /* always leave room for the wrap record */
+    if (t + need + sizeof(struct q_pkt) <= q->buflen)
+	return 1;
+    if (need >= h)
+	return 0;
+    pkt_at(q, t)->pktlen = 0;
+    pkt_at(q, t)->next = 0;
+    q->prod_tail = 0;
+    __sync_synchronize();
+    q->_tail = 0;
+    return 1;
+}
+
+/*
+ * Streaming producer, one for all the queues: read the trace and
+ * push each packet to its queue, waiting when the queue is full.
+ */
+static void *
+stream_prod(void *_qp)
+{
+    struct pipe_args *qp = _qp;
+    struct nm_pcap_stream *s;
+    const char *pkt;
+    uint32_t caplen, len;
+    uint64_t ts, i;
+    int ret = 0;
+
+    setaffinity(qp[0].prod_core);
+    s = stream_open(qp[0].q.prod_ifname);
+    if (s == NULL) {
+	do_abort = 1;
+	return NULL;
+    }
+    for (i = 0; !do_abort && (ret = stream_next(s, &ts, &pkt, &caplen, &len)) > 0; i++) {
+	struct _qs *q = &qp[queue_of(pkt, caplen, i)].q;
+	uint64_t need;
+	int k;
+
+	if (i == 0) {
+	    for (k = 0; k < nq; k++)
+		qp[k].q.prod_last_ts = ts;
+	}
+	if (caplen > len)
+	    caplen = len;
+	if (len == 0 || len > MAX_PKT) {
+	    RD(1, "skipping packet %lu, len %u", (u_long)i, len);
+	    continue;
+	}
+	q->cur_pkt = pkt;
+	q->cur_caplen = caplen;
+	q->cur_len = len;
+	/* the gap includes the packets of the other queues */
+	q->cur_tt = ts - q->prod_last_ts;
+	q->prod_last_ts = ts;
+	if (!schedule_pkt(q))
+	    continue;
+	need = pad(len) + sizeof(struct q_pkt);
+	while (!stream_room(q, need) && !do_abort)
+	    usleep(10);
+	enq(q);
+	__sync_synchronize();
+	q->_tail = q->prod_tail; /* publish */
+    }
+    if (ret < 0)
+	WWW("stopping at packet %lu", (u_long)i);
+    ED("end of trace after %lu packets", (u_long)i);
+    for (i = 0; i < (uint64_t)nq; i++)
+	qp[i].q.prod_done = 1;
+    stream_close(s);
+    return NULL;
+}
+
+/*
+ * -M: add one to the addresses and/or ports of a packet, at each pass
+ * over the queue after the first, so that the flows of a pass are not
+ * those of the previous ones. The checksums are updated incrementally
+ * (RFC 1624). Only the low 32 bits of IPv6 addresses change.
+ */
+static inline uint16_t
+rd16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static void
+csum_fix(unsigned char *sum, uint16_t old, uint16_t new, int udp)
+{
+    uint32_t s;
+
+    if (sum == NULL)
+	return;
+    s = (uint16_t)~rd16(sum) + (uint16_t)~old + new;
+    s = (s & 0xffff) + (s >> 16);
+    s = (s & 0xffff) + (s >> 16);
+    s = ~s & 0xffff;
+    if (udp && s == 0)
+	s = 0xffff;	/* 0 means no checksum */
+    sum[0] = s >> 8;
+    sum[1] = s;
+}
+
+/* increment the big endian field of len bytes at p */
+static void
+field_inc(unsigned char *p, int len, unsigned char *ipsum, unsigned char *l4sum,
+	int udp)
+{
+    int i;
+
+    for (i = len - 2; i >= 0; i -= 2) {
+	uint16_t o = rd16(p + i), n = o + 1;
+
+	p[i] = n >> 8;
+	p[i + 1] = n;
+	csum_fix(ipsum, o, n, 0);
+	csum_fix(l4sum, o, n, udp);
+	if (n != 0)
+	    break;	/* no carry */
+    }
+}
+
+static void
+pkt_rewrite(unsigned char *p, uint32_t len)
+{
+    unsigned char *ip, *src, *dst, *l4 = NULL, *ipsum = NULL, *l4sum = NULL;
+    uint32_t ofs = 14, type, proto;
+    int udp = 0;
+
+    if (len < 14)
+	return;
+    type = rd16(p + 12);
+    if (type == 0x8100 && len >= 18) {	/* vlan */
+	type = rd16(p + 16);
+	ofs = 18;
+    }
+    ip = p + ofs;
+    if (type == 0x0800 && len >= ofs + 20) {
+	proto = ip[9];
+	ipsum = ip + 10;
+	src = ip + 12;
+	dst = ip + 16;
+	/* the first fragment has the ports and the l4 checksum */
+	if ((rd16(ip + 6) & 0x1fff) == 0)
+	    l4 = ip + (ip[0] & 0xf) * 4;
+    } else if (type == 0x86dd && len >= ofs + 40) {
+	proto = ip[6];
+	src = ip + 20;
+	dst = ip + 36;
+	l4 = ip + 40;
+    } else {
+	return;
+    }
+    if (l4 != NULL && l4 + 8 <= p + len) {
+	if (proto == 6 && l4 + 18 <= p + len) {
+	    l4sum = l4 + 16;
+	} else if (proto == 17) {
+	    udp = 1;
+	    if (type == 0x86dd || rd16(l4 + 6) != 0)
+		l4sum = l4 + 6;
+	} else if (proto == 58) {	/* icmp6 has a pseudo header */
+	    l4sum = l4 + 2;
+	}
+    }
+    if (l4 == NULL || l4 + 8 > p + len || (proto != 6 && proto != 17))
+	l4 = NULL;	/* no ports */
+    if (rewrite & RW_SRC)
+	field_inc(src, 4, ipsum, l4sum, udp);
+    if (rewrite & RW_DST)
+	field_inc(dst, 4, ipsum, l4sum, udp);
+    if (l4 != NULL && (rewrite & RW_SPORT))
+	field_inc(l4, 2, NULL, l4sum, udp);
+    if (l4 != NULL && (rewrite & RW_DPORT))
+	field_inc(l4 + 2, 2, NULL, l4sum, udp);
+}
+
+/* number of packets in a (loaded) queue */
+static uint32_t
+queue_pkts(struct _qs *q)
+{
+    uint64_t ofs;
+    uint32_t n = 0;
+
+    for (ofs = 0; ofs != q->_tail; ofs = pkt_at(q, ofs)->next)
+	n++;
+    return n;
+}
+
+/*
+ * -Z: copy the packets of the queue, once, into extra buffers of the
+ * output port, so that cons() sends them by just putting the buffer
+ * index in a slot. The original buffers of the slots are saved, and
+ * put back by zc_fini(). On failure the packets are copied as usual.
+ */
+static int
+zc_init(struct pipe_args *pa)
+{
+    struct _qs *q = &pa->q;
+    struct nmport_d *d = pa->pb;
+    struct netmap_ring *ring = NETMAP_TXRING(d->nifp, d->first_tx_ring);
+    uint32_t n = queue_pkts(q), slots = 0, idx, i, j, k;
+    uint64_t ofs;
+    int r;
+
+    for (r = d->first_tx_ring; r <= d->last_tx_ring; r++)
+	slots += NETMAP_TXRING(d->nifp, r)->num_slots;
+    if (rewrite && n <= slots) {
+	/* a buffer must not change while it is still in a slot */
+	WWW("-Z with -M needs more packets (%u) than tx slots (%u)",
+	    n, slots);
+	return -1;
+    }
+    if (d->reg.nr_extra_bufs < n) {
+	WWW("got %u extra buffers, %u needed", d->reg.nr_extra_bufs, n);
+	return -1;
+    }
+    for (ofs = 0; ofs != q->_tail; ofs = pkt_at(q, ofs)->next) {
+	if (pkt_at(q, ofs)->pktlen > ring->nr_buf_size) {
+	    WWW("packets longer than %u bytes", ring->nr_buf_size);
+	    return -1;
+	}
+    }
+    q->zc_buf = calloc(n, sizeof(*q->zc_buf));
+    q->zc_ring_buf = calloc(slots, sizeof(*q->zc_ring_buf));
+    if (q->zc_buf == NULL || q->zc_ring_buf == NULL) {
+	free(q->zc_buf);
+	free(q->zc_ring_buf);
+	q->zc_buf = q->zc_ring_buf = NULL;
+	return -1;
+    }
+    idx = d->nifp->ni_bufs_head;
+    for (i = 0, ofs = 0; i < n; i++, ofs = pkt_at(q, ofs)->next) {
+	struct q_pkt *p = pkt_at(q, ofs);
+	char *buf = NETMAP_BUF(ring, idx);
+
+	q->zc_buf[i] = idx;
+	idx = *(uint32_t *)buf;	/* the list is in the buffers */
+	memcpy(buf, p + 1, p->pktlen);
+    }
+    d->nifp->ni_bufs_head = idx;	/* the spare ones, if any */
+    for (k = 0, r = d->first_tx_ring; r <= d->last_tx_ring; r++) {
+	ring = NETMAP_TXRING(d->nifp, r);
+	for (j = 0; j < ring->num_slots; j++)
+	    q->zc_ring_buf[k++] = ring->slot[j].buf_idx;
+    }
+    q->zc_n = n;
+    ED("queue %d: %u packets preloaded in extra buffers", q->qid, n);
+    return 0;
+}
+
+/* give back to the kernel the buffers taken by zc_init() */
+static void
+zc_fini(struct pipe_args *pa)
+{
+    struct _qs *q = &pa->q;
+    struct nmport_d *d = pa->pb;
+    struct netmap_ring *ring;
+    uint32_t i, j, k;
+    int r, tries;
+
+    if (q->zc_buf == NULL)
+	return;
+    /* let the packets in flight go */
+    for (tries = 0; tries < 100; tries++) {
+	int pending = 0;
+
+	ioctl(d->fd, NIOCTXSYNC, 0);
+	for (r = d->first_tx_ring; r <= d->last_tx_ring; r++)
+	    pending |= nm_tx_pending(NETMAP_TXRING(d->nifp, r));
+	if (!pending)
+	    break;
+	usleep(1000);
+    }
+    for (k = 0, r = d->first_tx_ring; r <= d->last_tx_ring; r++) {
+	ring = NETMAP_TXRING(d->nifp, r);
+	for (j = 0; j < ring->num_slots; j++) {
+	    ring->slot[j].buf_idx = q->zc_ring_buf[k++];
+	    ring->slot[j].flags |= NS_BUF_CHANGED;
+	}
+    }
+    ring = NETMAP_TXRING(d->nifp, d->first_tx_ring);
+    for (i = 0; i < q->zc_n; i++) {
+	*(uint32_t *)NETMAP_BUF(ring, q->zc_buf[i]) = d->nifp->ni_bufs_head;
+	d->nifp->ni_bufs_head = q->zc_buf[i];
+    }
+    free(q->zc_buf);
+    free(q->zc_ring_buf);
+    q->zc_buf = q->zc_ring_buf = NULL;
+}
+
+/* -Z: queue the i-th packet of the queue in a free slot */
+static int
+zc_inject(struct pipe_args *pa, uint32_t i, uint32_t len)
+{
+    struct nmport_d *d = pa->pb;
+    u_int c, n = d->last_tx_ring - d->first_tx_ring + 1, ri = d->cur_tx_ring;
+
+    for (c = 0; c < n; c++, ri++) {
+	struct netmap_ring *ring;
+	struct netmap_slot *slot;
+
+	if (ri > d->last_tx_ring)
+	    ri = d->first_tx_ring;
+	ring = NETMAP_TXRING(d->nifp, ri);
+	if (nm_ring_space(ring) == 0)
+	    continue;
+	slot = &ring->slot[ring->cur];
+	slot->buf_idx = pa->q.zc_buf[i];
+	slot->len = len;
+	slot->flags = NS_BUF_CHANGED;
+	ring->head = ring->cur = nm_ring_next(ring, ring->cur);
+	d->cur_tx_ring = ri;
+	return 1;
+    }
+    return 0;
+}
+
 /*
  * the consumer reads from the queue using head,
  * advances it every now and then.
  */
+/* send the staged burst at its deadline */
+static void
+cons_flush(struct pipe_args *pa)
+{
+    struct _qs *q = &pa->q;
+
+    q->cons_now = pacer_wait_burst(&pa->pacer, q->t0);
+    ioctl(pa->pb->fd, NIOCTXSYNC, 0);
+    pacer_synced(&pa->pacer, q->cons_now);
+}
+
 static void *
 cons(void *_pa)
 {
     struct pipe_args *pa = _pa;
     struct _qs *q = &pa->q;
-    int pending = 0;
-    uint64_t last_ts = 0;
+    struct pacer *pc = &pa->pacer;
+    char name[32];
 
-    /* read the start of times in q->t0 */
-    set_tns_now(&q->t0, 0);
+    pacer_init(pc, pace_tol, PACE_SPIN_NS);
+    /* the start of times, common to all the queues */
+    q->t0 = start_t0;
     /* set the time (cons_now) to clock - q->t0 */
     set_tns_now(&q->cons_now, q->t0);
     q->cons_head = q->_head;
@@ -865,50 +1656,142 @@ cons(void *_pa)
 
 	__builtin_prefetch (q->buf + p->next);
 
+	if (q->cons_head == q->cons_tail && streaming) {
+	    int done = q->prod_done;
+
+	    __sync_synchronize();
+	    q->cons_tail = q->_tail;
+	    __sync_synchronize();
+	    if (q->cons_head != q->cons_tail)
+		continue;
+	    cons_flush(pa);
+	    if (done)
+		break; /* end of the trace */
+	    q->rx_wait++;
+	    usleep(1);
+	    set_tns_now(&q->cons_now, q->t0);
+	    continue;
+	}
+	if (streaming && p->pktlen == 0) { /* wrap record */
+	    q->cons_head = 0;
+	    q->_head = 0;
+	    continue;
+	}
 	if (q->cons_head == q->cons_tail) {	//reset record
 	    ND("Transmission restarted");
+	    /* the staged packets use the old start of times */
+	    if (pc->n > 0)
+		cons_flush(pa);
 	    /*
 	     * add to q->t0 the time for the last packet
 	     */
-	    q->t0 += last_ts;
+	    q->t0 += q->loop_tx;
 	    set_tns_now(&q->cons_now, q->t0);
 	    q->cons_head = 0;	//restart from beginning of the queue
+	    q->iter++;
+	    q->pkt_i = q->rw_i = 0;
 	    continue;
 	}
-	last_ts = p->pt_tx;
-	if (ts_cmp(p->pt_tx, q->cons_now) > 0) {
+	if (!pacer_ready(pc, p->pt_tx, q->cons_now)) {
 	    // packet not ready
+	    if (pc->n > 0) {
+		/* not part of this burst */
+		cons_flush(pa);
+		continue;
+	    }
 	    q->rx_wait++;
-	    /* the ioctl should be conditional */
-	    ioctl(pa->pb->fd, NIOCTXSYNC, 0); // XXX just in case
-	    pending = 0;
-	    usleep(20);
-	    set_tns_now(&q->cons_now, q->t0);
+	    /* spin if the deadline is close */
+	    q->cons_now = pacer_wait(pc, p->pt_tx, q->t0, 0);
+	    if (ts_cmp(p->pt_tx, q->cons_now) > 0) {
+		/* the ioctl should be conditional */
+		ioctl(pa->pb->fd, NIOCTXSYNC, 0); // XXX just in case
+		usleep(20);
+		set_tns_now(&q->cons_now, q->t0);
+	    }
 	    continue;
 	}
+	if (rewrite && q->iter > 0 && q->rw_i == q->pkt_i) {
+	    /* once per pass, also if the send below fails */
+	    pkt_rewrite(q->zc_buf == NULL ? (unsigned char *)(p + 1) :
+		(unsigned char *)NETMAP_BUF(NETMAP_TXRING(pa->pb->nifp,
+		pa->pb->first_tx_ring), q->zc_buf[q->pkt_i]), p->pktlen);
+	    q->rw_i++;
+	}
 	/* XXX copy is inefficient but simple */
-	if (nmport_inject(pa->pb, (char *)(p + 1), p->pktlen) == 0) {
+	if ((q->zc_buf != NULL ? zc_inject(pa, q->pkt_i, p->pktlen) :
+		nmport_inject(pa->pb, (char *)(p + 1), p->pktlen)) == 0) {
 	    RD(1, "inject failed len %d now %ld tx %ld h %ld t %ld next %ld",
 		(int)p->pktlen, (u_long)q->cons_now, (u_long)p->pt_tx,
 		(u_long)q->_head, (u_long)q->_tail, (u_long)p->next);
-	    ioctl(pa->pb->fd, NIOCTXSYNC, 0);
-	    pending = 0;
+	    cons_flush(pa);
 	    continue;
 	}
-	pending++;
-	if (pending > q->burst) {
-	    ioctl(pa->pb->fd, NIOCTXSYNC, 0);
-	    pending = 0;
-	}
+	pacer_stage(pc, p->pt_tx);
+	if (pc->n > (uint32_t)q->burst)
+	    cons_flush(pa);
 
 	q->cons_head = p->next;
+	q->pkt_i++;
+	if (streaming) {
+	    __sync_synchronize();
+	    q->_head = q->cons_head; /* release the record */
+	}
 	/* drain packets from the queue */
 	q->rx++;
     }
     D("exiting on abort");
+    zc_fini(pa);
+    snprintf(name, sizeof(name), "queue %d", q->qid);
+    pacer_print(pc, stderr, name);
     return NULL;
 }
 
+/*
+ * open the output port of a queue and wait for all the queues to be
+ * ready. Returns 0 if the consumer can run.
+ */
+static int
+start_cons(struct pipe_args *a)
+{
+    struct _qs *q = &a->q;
+
+    a->pb = nmport_prepare(q->cons_ifname);
+    if (a->pb != NULL && nq > 1) {
+	/* each queue uses its own tx ring */
+	a->pb->reg.nr_mode = NR_REG_ONE_NIC;
+	a->pb->reg.nr_ringid = q->qid;
+    }
+    if (a->pb != NULL && zerocopy)
+	a->pb->reg.nr_extra_bufs = queue_pkts(q);
+    if (a->pb != NULL && nmport_open_desc(a->pb) < 0) {
+	nmport_close(a->pb);
+	a->pb = NULL;
+    }
+    if (a->pb == NULL) {
+	EEE("cannot open netmap on %s", q->cons_ifname);
+	do_abort = 1; // XXX any better way ?
+	return 1;
+    }
+    if (zerocopy && zc_init(a) < 0)
+	WWW("queue %d: sending by copy", q->qid);
+    /* continue as cons() */
+    WWW("prepare to send packets");
+    usleep(1000);
+    /* wait for the other queues, the last one sets the start of times */
+    if (__sync_add_and_fetch(&queues_ready, 1) == nq) {
+	set_tns_now(&start_t0, 0);
+	__sync_synchronize();
+	queues_go = 1;
+    }
+    while (!queues_go && !do_abort)
+	usleep(100);
+    if (q->_tail == 0 && !streaming) {
+	WWW("queue %d is empty", q->qid);
+	return 1;
+    }
+    return 0;
+}
+
 /*
  * In case of pcap file as input, the program acts in 2 different
  * phases. It first fill the queue and then starts the cons()
@@ -933,15 +1816,8 @@ nmreplay_main(void *_a)
     pcap_prod((void*)a);
     destroy_pcap(q->pcap);
     q->pcap = NULL;
-    a->pb = nmport_open(q->cons_ifname);
-    if (a->pb == NULL) {
-	EEE("cannot open netmap on %s", q->cons_ifname);
-	do_abort = 1; // XXX any better way ?
+    if (start_cons(a))
 	return NULL;
-    }
-    /* continue as cons() */
-    WWW("prepare to send packets");
-    usleep(1000);
     cons((void*)a);
     EEE("exiting on abort");
 fail:
@@ -952,7 +1828,19 @@ fail:
     return NULL;
 }
 
+/* streaming: the consumer thread of a queue */
+static void *
+stream_main(void *_a)
+{
+    struct pipe_args *a = _a;
 
+    setaffinity(a->cons_core);
+    if (start_cons(a) == 0)
+	cons((void*)a);
+    if (__sync_add_and_fetch(&queues_done, 1) == nq)
+	do_abort = 1; /* the whole trace has been sent */
+    return NULL;
+}
 static void
 sigint_h(int sig)
 {
@@ -968,7 +1856,9 @@ usage(void)
 {
 	fprintf(stderr,
 	    "usage: nmreplay [-v] [-D delay] [-B {[constant,]bps|ether,bps|real,speedup}] [-L loss]\n"
-	    "\t[-b burst] -f pcap-file -i <netmap:ifname|valeSSS:PPP>\n");
+	    "\t[-b burst] [-q nqueues] [-P flow|rr] [-S] [-T tolerance]\n"
+	    "\t[-Z] [-M src,dst,sport,dport]\n"
+	    "\t-f pcap-file -i <netmap:ifname|valeSSS:PPP>\n");
 	exit(1);
 }
 
@@ -1080,7 +1970,9 @@ static struct _cfg delay_cfg[];
 static struct _cfg bw_cfg[];
 static struct _cfg loss_cfg[];
 
+#define U_PARSE_ERR ~(0ULL)
 static uint64_t parse_bw(const char *arg);
+static uint64_t parse_time(const char *arg);
 
 /*
  * prodcons [options]
@@ -1103,6 +1995,7 @@ int
 main(int argc, char **argv)
 {
 	int ch, i, err=0;
+	struct pipe_args *qp;	/* one per queue */
 
 #define	N_OPTS	1
 	struct pipe_args bp[N_OPTS];
@@ -1143,8 +2036,13 @@ main(int argc, char **argv)
 	// b	batch size
 	// v	verbose
 	// C	cpu placement
+	// q	number of queues (tx rings)
+	// P	how to split the trace among the queues
+	// S	stream the pcap file
+	// Z	send from preloaded extra buffers
+	// M	fields to change at each pass
 
-	while ( (ch = getopt(argc, argv, "B:C:D:L:b:f:i:vw:")) != -1) {
+	while ( (ch = getopt(argc, argv, "B:C:D:L:b:f:i:vw:q:P:ST:ZM:")) != -1) {
 		switch (ch) {
 		default:
 			D("bad option %c %s", ch, optarg);
@@ -1207,6 +2105,59 @@ main(int argc, char **argv)
 		case 'w':
 			bp[0].wait_link = atoi(optarg);
 			break;
+		case 'q':	/* number of queues */
+			nq = atoi(optarg);
+			if (nq < 1 || nq > 256) {
+				ED("invalid number of queues %s", optarg);
+				usage();
+			}
+			break;
+		case 'T':	/* pacing tolerance */
+			pace_tol = parse_time(optarg);
+			if (pace_tol == U_PARSE_ERR) {
+				ED("invalid tolerance %s", optarg);
+				usage();
+			}
+			break;
+		case 'S':	/* streaming */
+			streaming = 1;
+			break;
+		case 'Z':	/* zero copy */
+			zerocopy = 1;
+			break;
+		case 'M':	/* rewrite at each pass */
+			{
+				int ac = 0, k;
+				char **av = split_arg(optarg, &ac);
+
+				for (k = 0; k < ac; k++) {
+					if (!strcmp(av[k], "src"))
+						rewrite |= RW_SRC;
+					else if (!strcmp(av[k], "dst"))
+						rewrite |= RW_DST;
+					else if (!strcmp(av[k], "sport"))
+						rewrite |= RW_SPORT;
+					else if (!strcmp(av[k], "dport"))
+						rewrite |= RW_DPORT;
+					else {
+						ED("-M accepts src, dst, sport, dport");
+						usage();
+					}
+				}
+				if (av)
+					free(av);
+			}
+			break;
+		case 'P':	/* split policy */
+			if (!strcmp(optarg, "rr")) {
+				split_rr = 1;
+			} else if (!strcmp(optarg, "flow")) {
+				split_rr = 0;
+			} else {
+				ED("-P accepts flow or rr");
+				usage();
+			}
+			break;
 		}
 
 	}
@@ -1226,6 +2177,10 @@ main(int argc, char **argv)
 		ED("missing interface");
 		usage();
 	}
+	if (streaming && (zerocopy || rewrite)) {
+		ED("-Z and -M need the trace in memory, not -S");
+		usage();
+	}
 	if (bp[0].q.burst < 1 || bp[0].q.burst > 8192) {
 		WWW("invalid burst %d, set to 1024", bp[0].q.burst);
 		bp[0].q.burst = 1024; // XXX 128 is probably better
@@ -1251,24 +2206,65 @@ main(int argc, char **argv)
 		err += cmd_apply(loss_cfg, l[i], qs, &qs->c_loss);
 	}
 
-	pthread_create(&bp[0].cons_tid, NULL, nmreplay_main, (void*)&bp[0]);
+	/* all the queues start from the same configuration */
+	qp = calloc(nq, sizeof(*qp));
+	if (qp == NULL) {
+		ED("out of memory");
+		exit(1);
+	}
+	for (i = 0; i < nq; i++) {
+		qp[i] = bp[0];
+		qp[i].q.qid = i;
+		if (cores[0] >= 0)
+			qp[i].cons_core = cores[0] + i;
+	}
+	if (nq > 1)
+		ED("%d queues, split by %s", nq, split_rr ? "round robin" : "flow");
+
 	signal(SIGINT, sigint_h);
+	if (streaming) {
+		for (i = 0; i < nq; i++) {
+			qp[i].q.buflen = STREAM_QLEN;
+			qp[i].q.buf = calloc(1, STREAM_QLEN);
+			if (qp[i].q.buf == NULL) {
+				ED("alloc %lld bytes for queue failed, exiting",
+					(long long)STREAM_QLEN);
+				exit(1);
+			}
+		}
+		for (i = 0; i < nq; i++)
+			pthread_create(&qp[i].cons_tid, NULL, stream_main, (void*)&qp[i]);
+		pthread_create(&qp[0].prod_tid, NULL, stream_prod, (void*)qp);
+	} else {
+		for (i = 0; i < nq; i++)
+			pthread_create(&qp[i].cons_tid, NULL, nmreplay_main, (void*)&qp[i]);
+	}
 	sleep(1);
 	while (!do_abort) {
-	    struct _qs olda = bp[0].q;
-	    struct _qs *q0 = &bp[0].q;
+	    uint64_t rx[nq], tx[nq], drx = 0, dtx = 0;
+	    struct _qs *q0 = &qp[0].q;
 
+	    for (i = 0; i < nq; i++) {
+		rx[i] = qp[i].q.rx;
+		tx[i] = qp[i].q.tx;
+	    }
 	    sleep(1);
+	    for (i = 0; i < nq; i++) {
+		drx += qp[i].q.rx - rx[i];
+		dtx += qp[i].q.tx - tx[i];
+	    }
 	    ED("%lld -> %lld maxq %d round %lld",
-		(long long)(q0->rx - olda.rx), (long long)(q0->tx - olda.tx),
+		(long long)drx, (long long)dtx,
 		q0->rx_qmax, (long long)q0->prod_max_gap
 		);
 	    ED("plr nominal %le actual %le",
 		(double)(q0->c_loss.d[0])/(1<<24),
 		q0->c_loss.d[1] == 0 ? 0 :
 		(double)(q0->c_loss.d[2])/q0->c_loss.d[1]);
-	    bp[0].q.rx_qmax = (bp[0].q.rx_qmax * 7)/8; // ewma
-	    bp[0].q.prod_max_gap = (bp[0].q.prod_max_gap * 7)/8; // ewma
+	    for (i = 0; i < nq; i++) {
+		qp[i].q.rx_qmax = (qp[i].q.rx_qmax * 7)/8; // ewma
+		qp[i].q.prod_max_gap = (qp[i].q.prod_max_gap * 7)/8; // ewma
+	    }
 	}
 	D("exiting on abort");
 	sleep(1);
@@ -1327,7 +2323,6 @@ done:
 	return d;
 }
 
-#define U_PARSE_ERR ~(0ULL)
 
 /* returns a value in nanoseconds */
 static uint64_t
@@ -0,0 +1,179 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * nmstat: read the counters that netmap applications (pkt-gen -E,
+ * lb -E) publish in shared memory, see ctrs.h.
+ *
+ * By default prints the rates of each slot every report interval; with
+ * -1 prints the current totals once, one "metric{labels} value" line
+ * per counter, which is easy to scrape.
+ */
+
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/types.h>
+#include "ctrs.h"
+
+static volatile sig_atomic_t do_abort;
+
+static void
+sigint_h(int sig)
+{
+	(void)sig;
+	do_abort = 1;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: nmstat [-1] [-T report_ms] [-n reports] "
+			"name ...\n");
+	exit(1);
+}
+
+static void
+print_totals(const struct ctrs_shm *s, const char *name)
+{
+	static const char *fmt = "netmap_%s{segment=\"%s\",prog=\"%s\","
+		"slot=\"%.*s\"} %" PRIu64 "\n";
+	struct my_ctrs c;
+	u_int i;
+
+	for (i = 0; i < s->hdr->nslots; i++) {
+		const char *sl = s->slot[i].name;
+		int l = strnlen(sl, CTRS_SHM_NAMELEN);
+
+		if (ctrs_shm_read(s, i, &c) < 0)
+			continue;
+		printf(fmt, "packets", name, s->hdr->prog, l, sl, c.pkts);
+		printf(fmt, "bytes", name, s->hdr->prog, l, sl, c.bytes);
+		printf(fmt, "events", name, s->hdr->prog, l, sl, c.events);
+		printf(fmt, "drops", name, s->hdr->prog, l, sl, c.drop);
+		printf(fmt, "drop_bytes", name, s->hdr->prog, l, sl,
+			c.drop_bytes);
+	}
+}
+
+/* prints the rates of all the slots since the previous snapshot */
+static void
+print_rates(const struct ctrs_shm *s, const char *name, struct my_ctrs *prev)
+{
+	char b1[40], b2[40], b3[40];
+	struct my_ctrs c;
+	u_int i;
+
+	for (i = 0; i < s->hdr->nslots; i++) {
+		double dt;
+
+		if (ctrs_shm_read(s, i, &c) < 0)
+			continue;
+		if (!timerisset(&prev[i].t) || !timercmp(&c.t, &prev[i].t, >)) {
+			/* first snapshot, or not updated since */
+			if (!timerisset(&prev[i].t))
+				prev[i] = c;
+			continue;
+		}
+		dt = (c.t.tv_sec - prev[i].t.tv_sec) +
+			(c.t.tv_usec - prev[i].t.tv_usec) * 1e-6;
+		printf("%s %.*s: %spps %sbps %sdrops/s\n", name,
+			CTRS_SHM_NAMELEN, s->slot[i].name,
+			norm(b1, (c.pkts - prev[i].pkts) / dt, 1),
+			norm(b2, (c.bytes - prev[i].bytes) * 8 / dt, 1),
+			norm(b3, (c.drop - prev[i].drop) / dt, 1));
+		prev[i] = c;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct ctrs_shm *s;
+	struct my_ctrs **prev;
+	int ch, i, once = 0, report_ms = 1000;
+	long reports = 0, n;
+
+	while ((ch = getopt(argc, argv, "1T:n:")) != -1) {
+		switch (ch) {
+		case '1':
+			once = 1;
+			break;
+		case 'T':
+			report_ms = atoi(optarg);
+			break;
+		case 'n':
+			reports = atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0 || report_ms <= 0 || reports < 0)
+		usage();
+
+	s = calloc(argc, sizeof(*s));
+	prev = calloc(argc, sizeof(*prev));
+	if (s == NULL || prev == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < argc; i++) {
+		if (ctrs_shm_attach(&s[i], argv[i]) < 0) {
+			fprintf(stderr, "cannot attach %s: %s\n", argv[i],
+				strerror(errno));
+			return 1;
+		}
+		prev[i] = calloc(s[i].hdr->nslots, sizeof(**prev));
+		if (prev[i] == NULL) {
+			perror("calloc");
+			return 1;
+		}
+	}
+
+	if (once) {
+		for (i = 0; i < argc; i++)
+			print_totals(&s[i], argv[i]);
+		goto out;
+	}
+	signal(SIGINT, sigint_h);
+	for (i = 0; i < argc; i++)
+		print_rates(&s[i], argv[i], prev[i]);
+	for (n = 0; !do_abort && (reports == 0 || n < reports); n++) {
+		usleep(report_ms * 1000);
+		for (i = 0; i < argc; i++)
+			print_rates(&s[i], argv[i], prev[i]);
+		fflush(stdout);
+	}
+out:
+	for (i = 0; i < argc; i++) {
+		ctrs_shm_close(&s[i]);
+		free(prev[i]);
+	}
+	free(prev);
+	free(s);
+	return 0;
+}
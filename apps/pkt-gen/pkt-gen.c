@@ -47,6 +47,7 @@
 #include <libnetmap.h>
 #include <math.h>
 #include <net/ethernet.h>
+#include <net/netmap_csum.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
@@ -283,6 +284,7 @@ struct glob_arg {
 #define OPT_RANDOM_SRC  512
 #define OPT_RANDOM_DST  1024
 #define OPT_PPS_STATS   2048
+#define OPT_REFLECT_L3  4096	/* reflect: swap also IP and ports */
 	int dev_type;
 #ifndef NO_PCAP
 	pcap_t *p;
@@ -309,6 +311,25 @@ struct glob_arg {
 	int64_t win[STATS_WIN];
 	int wait_link;
 	int framing;		/* #bits of framing (for bw output) */
+	u_int pool_size;	/* -Q: precomputed frames per thread */
+	u_int pcap_nframes;	/* -P with -Q: all the frames of the file */
+	char **pcap_frames;
+	uint16_t *pcap_len;
+	int imix;		/* -l imix */
+
+	/* -i given more than once: nthreads threads on each port */
+	int nports;
+#define MAX_PORTS	16
+	struct {
+		char ifname[MAX_IFNAMELEN];
+		struct nmport_d *nmd;
+		uint32_t orig_mode;
+	} ports[MAX_PORTS];
+	int numa_affinity;	/* -a numa */
+	int start_ready;	/* threads waiting for the start */
+	int start_go;
+	const char *ctrs_name;	/* -E: counters published in shm */
+	struct ctrs_shm ctrs;
 };
 enum dev_type { DEV_NONE, DEV_NETMAP, DEV_PCAP, DEV_TAP };
 
@@ -316,6 +337,7 @@ enum {
 	TD_TYPE_SENDER = 1,
 	TD_TYPE_RECEIVER,
 	TD_TYPE_OTHER,
+	TD_TYPE_REFLECTOR,
 };
 
 /*
@@ -344,6 +366,22 @@ struct targ {
 	uint16_t seed[3];
 	u_int frags;
 	u_int frag_size;
+
+	struct frame_pool *pools;	/* -Q, one per tx ring */
+};
+
+/*
+ * A pool of ready frames for one tx ring, stored in extra buffers.
+ * The pool must be at least as large as the ring, so that a frame
+ * is only attached to a slot again after its previous transmission
+ * has completed.
+ */
+struct frame_pool {
+	uint32_t *orig;		/* ring buffers, restored at exit */
+	uint32_t *idx;		/* pool buffers */
+	uint16_t *len;
+	u_int n;
+	u_int next;		/* next frame to send */
 };
 
 static __inline uint16_t
@@ -726,31 +764,69 @@ setaffinity(pthread_t me, int i)
 	return 0;
 }
 
+/*
+ * -a numa: the NUMA node of a port and the cpus of a node,
+ * from sysfs. Return -1 if not known.
+ */
+static int
+port_numa_node(const struct nmport_d *d)
+{
+	char path[128 + IFNAMSIZ];
+	FILE *f;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%.*s/device/numa_node",
+		IFNAMSIZ, d->hdr.nr_name);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+	return node;
+}
 
-/* Compute the checksum of the given ip header. */
+/* the n-th cpu (modulo their number) of a node, ncpus if none */
+static int
+numa_node_cpu(int node, int n, int ncpus)
+{
+	char path[64];
+	int cpus[256], k = 0, a, b;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		node);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return ncpus;
+	/* a list like 0-7,16-23 */
+	while (k < 256 && fscanf(f, "%d", &a) == 1) {
+		b = a;
+		if (fscanf(f, "-%d", &b) != 1)
+			b = a;
+		for (; a <= b && k < 256; a++)
+			if (a < ncpus)
+				cpus[k++] = a;
+		if (fgetc(f) != ',')
+			break;
+	}
+	fclose(f);
+	return k > 0 ? cpus[n % k] : ncpus;
+}
+
+
+/*
+ * Compute the checksum of the given ip header. 'sum' and the return
+ * value are 16 bit partial sums in host byte order, while
+ * nm_csum_partial() sums the words as they are in memory: the
+ * checksum does not depend on the byte order, so swapping the
+ * reduced sum converts between the two.
+ */
 static uint32_t
 checksum(const void *data, uint16_t len, uint32_t sum)
 {
-	const uint8_t *addr = data;
-	uint32_t i;
-
-	/* Checksum all the pairs of bytes first... */
-	for (i = 0; i < (len & ~1U); i += 2) {
-		sum += (uint16_t)ntohs(*((const uint16_t *)(addr + i)));
-		if (sum > 0xFFFF)
-			sum -= 0xFFFF;
-	}
-	/*
-	 * If there's a single byte left over, checksum it, too.
-	 * Network byte order is big-endian, so the remaining byte is
-	 * the high byte.
-	 */
-	if (i < len) {
-		sum += addr[i] << 8;
-		if (sum > 0xFFFF)
-			sum -= 0xFFFF;
-	}
-	return sum;
+	sum += ntohs(nm_csum_reduce(nm_csum_partial(data, len, 0)));
+	return nm_csum_reduce(sum);
 }
 
 static uint16_t
@@ -1148,7 +1224,7 @@ get_vnet_hdr_len(struct glob_arg *g)
 }
 
 static void
-set_vnet_hdr_len(struct glob_arg *g)
+set_vnet_hdr_len(struct glob_arg *g, const struct nmport_d *d)
 {
 	int err, l = g->virt_header;
 	struct nmreq_header hdr;
@@ -1157,7 +1233,7 @@ set_vnet_hdr_len(struct glob_arg *g)
 	if (l == 0)
 		return;
 
-	hdr = g->nmd->hdr; /* copy name and version */
+	hdr = d->hdr; /* copy name and version */
 	hdr.nr_reqtype = NETMAP_REQ_PORT_HDR_SET;
 	hdr.nr_options = 0;
 	memset(&ph, 0, sizeof(ph));
@@ -1257,6 +1333,267 @@ send_packets(struct netmap_ring *ring, struct pkt *pkt, void *frame,
 	return (sent);
 }
 
+/*
+ * transmit frames from the pool by attaching their buffers to the slots,
+ * without touching the packet data.
+ */
+static int
+send_pool(struct netmap_ring *ring, struct frame_pool *fp, u_int count,
+		uint64_t *bytes)
+{
+	u_int n, sent, head = ring->head;
+	struct netmap_slot *slot = &ring->slot[head];
+
+	n = nm_ring_space(ring);
+	for (sent = 0; sent < count && n > 0; sent++, n--) {
+		slot = &ring->slot[head];
+		slot->buf_idx = fp->idx[fp->next];
+		slot->len = fp->len[fp->next];
+		slot->flags = NS_BUF_CHANGED;
+		*bytes += slot->len;
+		if (++fp->next == fp->n)
+			fp->next = 0;
+		head = nm_ring_next(ring, head);
+	}
+	if (sent) {
+		slot->flags |= NS_REPORT;
+		ring->head = ring->cur = head;
+	}
+	if (sent < count) {
+		/* tell netmap that we need more slots */
+		ring->cur = ring->tail;
+	}
+
+	return (sent);
+}
+
+/* simple IMIX, 7:4:1 (sizes without CRC) */
+static const uint16_t imix_sizes[] = {
+	60, 60, 590, 60, 60, 590, 60, 60, 590, 60, 590, 1514
+};
+
+/* fix the lengths and the checksums of a frame cut at len bytes */
+static void
+frame_set_len(const struct glob_arg *g, char *f, u_int len)
+{
+	char *l3 = f + sizeof(struct ether_header);
+	struct udphdr udp;
+	uint16_t paylen;
+	uint32_t csum;
+
+	if (g->af == AF_INET) {
+		struct ip ip;
+
+		paylen = len - sizeof(struct ether_header) - sizeof(ip);
+		memcpy(&ip, l3, sizeof(ip));
+		ip.ip_len = htons(len - sizeof(struct ether_header));
+		ip.ip_sum = 0;
+		ip.ip_sum = wrapsum(checksum(&ip, sizeof(ip), 0));
+		memcpy(l3, &ip, sizeof(ip));
+		csum = checksum(&ip.ip_src, 2 * sizeof(ip.ip_src),
+			IPPROTO_UDP + (uint32_t)paylen);
+		l3 += sizeof(ip);
+	} else {
+		struct ip6_hdr ip6;
+
+		paylen = len - sizeof(struct ether_header) - sizeof(ip6);
+		memcpy(&ip6, l3, sizeof(ip6));
+		ip6.ip6_plen = htons(paylen);
+		memcpy(l3, &ip6, sizeof(ip6));
+		/* as in initialize_packet() */
+		csum = IPPROTO_UDP << 24;
+		csum = checksum(&csum, sizeof(csum), paylen);
+		csum = checksum(&ip6.ip6_src, 2 * sizeof(ip6.ip6_src), csum);
+		l3 += sizeof(ip6);
+	}
+	memcpy(&udp, l3, sizeof(udp));
+	udp.uh_ulen = htons(paylen);
+	udp.uh_sum = 0;
+	udp.uh_sum = wrapsum(checksum(&udp, sizeof(udp),
+		checksum(l3 + sizeof(udp), paylen - sizeof(udp), csum)));
+	memcpy(l3, &udp, sizeof(udp));
+}
+
+#ifndef NO_PCAP
+/*
+ * -P with -Q: read all the frames of the pcap file once, so that the
+ * threads can spread them over their pools. Frames that cannot fit in
+ * a buffer are skipped.
+ */
+static int
+pcap_load_frames(struct glob_arg *g)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct pcap_pkthdr *h;
+	const u_char *pkt;
+	u_int max = 0, skipped = 0;
+	pcap_t *file;
+
+	file = pcap_open_offline(g->packet_file, errbuf);
+	if (file == NULL) {
+		D("failed to open pcap file %s: %s", g->packet_file, errbuf);
+		return -1;
+	}
+	while (pcap_next_ex(file, &h, &pkt) > 0) {
+		if (h->caplen < 14 || h->caplen > MAX_PKTSIZE) {
+			skipped++;
+			continue;
+		}
+		if (g->pcap_nframes == max) {
+			max = max ? 2 * max : 1024;
+			g->pcap_frames = realloc(g->pcap_frames,
+				max * sizeof(*g->pcap_frames));
+			g->pcap_len = realloc(g->pcap_len,
+				max * sizeof(*g->pcap_len));
+			if (g->pcap_frames == NULL || g->pcap_len == NULL)
+				goto nomem;
+		}
+		g->pcap_frames[g->pcap_nframes] = malloc(h->caplen);
+		if (g->pcap_frames[g->pcap_nframes] == NULL)
+			goto nomem;
+		memcpy(g->pcap_frames[g->pcap_nframes], pkt, h->caplen);
+		g->pcap_len[g->pcap_nframes++] = h->caplen;
+	}
+	pcap_close(file);
+	if (skipped)
+		D("skipped %u frames with bad length", skipped);
+	if (g->pcap_nframes == 0) {
+		D("no frames in %s", g->packet_file);
+		return -1;
+	}
+	D("%u frames loaded from %s", g->pcap_nframes, g->packet_file);
+	return 0;
+
+nomem:
+	D("out of memory");
+	pcap_close(file);
+	return -1;
+}
+#endif /* !NO_PCAP */
+
+/*
+ * -Q: split the extra buffers among the tx rings of the thread and fill
+ * them with frames of successive flows and of the requested sizes, or
+ * with the frames of the pcap file given with -P. In the latter case
+ * the threads take the frames in turn, so that together they send the
+ * whole file.
+ */
+static int
+pool_init(struct targ *t, void *frame)
+{
+	struct glob_arg *g = t->g;
+	struct netmap_if *nifp = t->nmd->nifp;
+	u_int nrings = t->nmd->last_tx_ring - t->nmd->first_tx_ring + 1;
+	u_int per = t->nmd->reg.nr_extra_bufs / nrings, i, j, k = 0;
+	u_int hdrmin = sizeof(struct ether_header) + sizeof(struct udphdr) +
+		(g->af == AF_INET ? sizeof(struct ip) : sizeof(struct ip6_hdr));
+	uint32_t scan = nifp->ni_bufs_head;
+
+	t->pools = calloc(nrings, sizeof(*t->pools));
+	if (t->pools == NULL)
+		return -1;
+	for (i = 0; i < nrings; i++) {
+		struct netmap_ring *ring =
+			NETMAP_TXRING(nifp, t->nmd->first_tx_ring + i);
+		struct frame_pool *fp = &t->pools[i];
+
+		if (per < ring->num_slots) {
+			D("%u extra buffers per ring, need at least %u",
+				per, ring->num_slots);
+			return -1;
+		}
+		fp->orig = calloc(ring->num_slots, sizeof(*fp->orig));
+		fp->idx = calloc(per, sizeof(*fp->idx));
+		fp->len = calloc(per, sizeof(*fp->len));
+		if (fp->orig == NULL || fp->idx == NULL || fp->len == NULL)
+			return -1;
+		for (j = 0; j < ring->num_slots; j++)
+			fp->orig[j] = ring->slot[j].buf_idx;
+		for (j = 0; j < per && scan != 0; j++, k++) {
+			char *p = NETMAP_BUF(ring, scan);
+			u_int len = g->pkt_size;
+
+			fp->idx[j] = scan;
+			fp->n = j + 1;
+			scan = *(uint32_t *)p;
+			nifp->ni_bufs_head = scan;
+			if (g->imix)
+				len = imix_sizes[k % (sizeof(imix_sizes) /
+						sizeof(imix_sizes[0]))];
+			else if (g->pkt_min_size > 0)
+				len = nrand48(t->seed) %
+					(g->pkt_size - g->pkt_min_size) +
+					g->pkt_min_size;
+			if (g->pcap_nframes > 0) {
+				u_int f = (k * global_nthreads + t->me) %
+					g->pcap_nframes;
+
+				len = g->pcap_len[f];
+				if (len + g->virt_header > ring->nr_buf_size) {
+					D("frame %u too long (%u bytes)",
+						f, len);
+					return -1;
+				}
+				memset(p, 0, g->virt_header);
+				memcpy(p + g->virt_header, g->pcap_frames[f],
+					len);
+				fp->len[j] = len + g->virt_header;
+				continue;
+			}
+			if (t->frame != NULL) { /* from a pcap file, as is */
+				len = g->pkt_size;
+			} else if (len < hdrmin) {
+				len = hdrmin;
+			}
+			memcpy(p, frame, len + g->virt_header);
+			if (t->frame == NULL)
+				frame_set_len(g, p + g->virt_header, len);
+			fp->len[j] = len + g->virt_header;
+			update_addresses(&t->pkt, t);
+		}
+		if (j < per) {
+			D("extra buffer list too short");
+			return -1;
+		}
+	}
+	D("%u frames per ring, %u rings", per, nrings);
+	return 0;
+}
+
+/* give the ring buffers back to the slots and the pool to the kernel */
+static void
+pool_fini(struct targ *t)
+{
+	struct netmap_if *nifp = t->nmd->nifp;
+	u_int nrings = t->nmd->last_tx_ring - t->nmd->first_tx_ring + 1;
+	u_int i, j;
+
+	if (t->pools == NULL)
+		return;
+	for (i = 0; i < nrings; i++) {
+		struct netmap_ring *ring =
+			NETMAP_TXRING(nifp, t->nmd->first_tx_ring + i);
+		struct frame_pool *fp = &t->pools[i];
+
+		if (fp->n > 0) {
+			for (j = 0; j < ring->num_slots; j++) {
+				ring->slot[j].buf_idx = fp->orig[j];
+				ring->slot[j].flags = NS_BUF_CHANGED;
+			}
+		}
+		for (j = 0; j < fp->n; j++) {
+			*(uint32_t *)NETMAP_BUF(ring, fp->idx[j]) =
+				nifp->ni_bufs_head;
+			nifp->ni_bufs_head = fp->idx[j];
+		}
+		free(fp->orig);
+		free(fp->idx);
+		free(fp->len);
+	}
+	free(t->pools);
+	t->pools = NULL;
+}
+
 /*
  * Index of the highest bit set
  */
@@ -1290,6 +1627,271 @@ wait_time(struct timespec ts)
 	}
 }
 
+/*
+ * Latency mode (-f lat). Probes carry a sequence number and a cycle
+ * counter timestamp after the UDP header, and are sent open loop, at
+ * the -R rate or as fast as possible, to a pkt-gen in pong mode.
+ * RTTs go in log-linear histograms: values below 2^LAT_SUB_BITS ns
+ * have their own bucket, larger ones keep LAT_SUB_BITS significant
+ * bits (about 1.5% resolution).
+ */
+#define LAT_MAGIC	0x6c617431	/* "lat1" */
+#define LAT_SUB_BITS	7
+#define LAT_BUCKETS	((66 - LAT_SUB_BITS) << (LAT_SUB_BITS - 1))
+
+struct lat_probe {
+	uint32_t magic;
+	uint32_t seq;
+	uint64_t tsc;
+} __attribute__((__packed__));
+
+struct lat_hist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t b[LAT_BUCKETS];
+};
+
+static u_int
+lat_bucket(uint64_t v)
+{
+	u_int m, shift;
+
+	if (v < (1ULL << LAT_SUB_BITS))
+		return v;
+	m = msb64(v);
+	shift = m - LAT_SUB_BITS + 1;
+	return ((shift + 1) << (LAT_SUB_BITS - 1)) +
+		(v >> shift) - (1U << (LAT_SUB_BITS - 1));
+}
+
+/* the largest value that falls in bucket i */
+static uint64_t
+lat_bucket_top(u_int i)
+{
+	u_int shift;
+	uint64_t sub;
+
+	if (i < (1U << LAT_SUB_BITS))
+		return i;
+	shift = (i >> (LAT_SUB_BITS - 1)) - 1;
+	sub = (i & ((1U << (LAT_SUB_BITS - 1)) - 1)) +
+		(1U << (LAT_SUB_BITS - 1));
+	return ((sub + 1) << shift) - 1;
+}
+
+static void
+lat_add(struct lat_hist *h, uint64_t v)
+{
+	h->b[lat_bucket(v)]++;
+	h->count++;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* q in parts per million */
+static uint64_t
+lat_percentile(const struct lat_hist *h, uint64_t q)
+{
+	uint64_t want = (h->count * q + 999999) / 1000000, sum = 0;
+	u_int i;
+
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		sum += h->b[i];
+		if (sum >= want && sum > 0) {
+			uint64_t top = lat_bucket_top(i);
+			return top < h->max ? top : h->max;
+		}
+	}
+	return h->max;
+}
+
+static void
+lat_print(const struct lat_hist *h, const char *what)
+{
+	D("%s %llu probes RTT p50 %llu p99 %llu p99.9 %llu max %llu ns", what,
+		(unsigned long long)h->count,
+		(unsigned long long)lat_percentile(h, 500000),
+		(unsigned long long)lat_percentile(h, 990000),
+		(unsigned long long)lat_percentile(h, 999000),
+		(unsigned long long)h->max);
+}
+
+static inline uint64_t
+lat_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* cycles per microsecond, measured against the monotonic clock */
+static double
+lat_calibrate(void)
+{
+	struct timespec a, b;
+	uint64_t c0, c1, ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	c0 = lat_cycles();
+	usleep(100000);
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	c1 = lat_cycles();
+	ns = (b.tv_sec - a.tv_sec) * 1000000000ULL + b.tv_nsec - a.tv_nsec;
+	return (double)(c1 - c0) * 1000 / ns;
+}
+
+static void *
+latency_body(void *data)
+{
+	struct targ *targ = (struct targ *) data;
+	struct glob_arg *g = targ->g;
+	struct netmap_if *nifp = targ->nmd->nifp;
+	struct lat_hist *cur, *tot;
+	void *frame;
+	int size, i;
+	u_int ofs = g->virt_header + sizeof(struct ether_header) +
+		(g->af == AF_INET ? sizeof(struct ip) : sizeof(struct ip6_hdr)) +
+		sizeof(struct udphdr);
+	uint64_t sent = 0, rcvd = 0, reord = 0, n = g->npackets, event = 0;
+	uint64_t next_tx, period = 0, next_print, print_period, drain_end = 0;
+	uint32_t last_seq = 0;
+	double cpu;
+
+	frame = (char*)&targ->pkt + sizeof(targ->pkt.vh) - g->virt_header;
+	size = g->pkt_size + g->virt_header;
+
+	if (g->nthreads > 1) {
+		D("can only measure latency with 1 thread");
+		return NULL;
+	}
+	if ((u_int)size < ofs + sizeof(struct lat_probe)) {
+		D("packets too short for the probes, need -l %u",
+			(u_int)(ofs + sizeof(struct lat_probe)) - g->virt_header);
+		return NULL;
+	}
+	cur = calloc(1, sizeof(*cur));
+	tot = calloc(1, sizeof(*tot));
+	if (cur == NULL || tot == NULL) {
+		D("out of memory");
+		goto quit;
+	}
+
+	cpu = lat_calibrate();	/* cycles per us */
+	D("%.1f cycles per us", cpu);
+	if (g->tx_rate)
+		period = (g->tx_period.tv_sec * 1000000000ULL +
+			g->tx_period.tv_nsec) * cpu / 1000;
+	print_period = g->report_interval * 1000 * cpu;
+	clock_gettime(CLOCK_REALTIME_PRECISE, &targ->tic);
+	next_tx = lat_cycles();
+	next_print = next_tx + print_period;
+
+	while (!targ->cancel) {
+		struct netmap_ring *ring = NETMAP_TXRING(nifp, targ->nmd->first_tx_ring);
+		uint64_t now = lat_cycles();
+
+		if ((n == 0 || sent < n) && (int64_t)(now - next_tx) >= 0) {
+			uint64_t limit = g->burst, m;
+
+			if (n > 0 && n - sent < limit)
+				limit = n - sent;
+			for (m = 0; m < limit && !nm_ring_empty(ring); m++) {
+				struct netmap_slot *slot = &ring->slot[ring->head];
+				char *p = NETMAP_BUF(ring, slot->buf_idx);
+				struct lat_probe lp;
+
+				nm_pkt_copy(frame, p, size);
+				lp.magic = LAT_MAGIC;
+				lp.seq = (uint32_t)sent;
+				lp.tsc = lat_cycles();
+				memcpy(p + ofs, &lp, sizeof(lp));
+				slot->len = size;
+				sent++;
+				ring->head = ring->cur = nm_ring_next(ring, ring->head);
+			}
+			if (m > 0) {
+				event++;
+				ioctl(targ->fd, NIOCTXSYNC, NULL);
+			}
+			/* open loop: a full ring does not delay the schedule */
+			next_tx = period ? next_tx + period : now;
+			targ->ctr.pkts = sent;
+			targ->ctr.bytes = sent*size;
+			targ->ctr.events = event;
+			if (n > 0 && sent == n) /* wait for the last replies */
+				drain_end = now + 100000 * cpu;
+		}
+
+		ioctl(targ->fd, NIOCRXSYNC, NULL);
+		for (i = targ->nmd->first_rx_ring; i <= targ->nmd->last_rx_ring; i++) {
+			ring = NETMAP_RXRING(nifp, i);
+			while (!nm_ring_empty(ring)) {
+				struct netmap_slot *slot = &ring->slot[ring->head];
+				char *p = NETMAP_BUF(ring, slot->buf_idx);
+				struct lat_probe lp;
+
+				if (slot->len >= ofs + sizeof(lp)) {
+					memcpy(&lp, p + ofs, sizeof(lp));
+					if (lp.magic == LAT_MAGIC) {
+						uint64_t rtt = (lat_cycles() - lp.tsc) * 1000 / cpu;
+
+						lat_add(cur, rtt);
+						if (rcvd > 0 && (int32_t)(lp.seq - last_seq) < 0)
+							reord++;
+						else
+							last_seq = lp.seq;
+						rcvd++;
+					}
+				}
+				ring->head = ring->cur = nm_ring_next(ring, ring->head);
+			}
+		}
+
+		now = lat_cycles();
+		if ((int64_t)(now - next_print) >= 0) {
+			if (cur->count > 0) {
+				for (i = 0; i < LAT_BUCKETS; i++)
+					tot->b[i] += cur->b[i];
+				tot->count += cur->count;
+				if (cur->max > tot->max)
+					tot->max = cur->max;
+				lat_print(cur, "interval");
+				memset(cur, 0, sizeof(*cur));
+			}
+			next_print += print_period;
+		}
+		if (drain_end && ((int64_t)(now - drain_end) >= 0 || rcvd == sent))
+			break;
+	}
+
+	for (i = 0; i < LAT_BUCKETS; i++)
+		tot->b[i] += cur->b[i];
+	tot->count += cur->count;
+	if (cur->max > tot->max)
+		tot->max = cur->max;
+	lat_print(tot, "total");
+	D("sent %llu received %llu lost %llu reordered %llu",
+		(unsigned long long)sent, (unsigned long long)rcvd,
+		(unsigned long long)(sent - rcvd), (unsigned long long)reord);
+	clock_gettime(CLOCK_REALTIME_PRECISE, &targ->toc);
+	targ->completed = 1;
+quit:
+	free(cur);
+	free(tot);
+	/* reset the ``used`` flag. */
+	targ->used = 0;
+
+	return NULL;
+}
+
 /*
  * Send a packet, and wait for a response.
  * The payload (after UDP header, ofs 42) has a 4-byte sequence
@@ -1586,6 +2188,167 @@ pong_body(void *data)
 	return NULL;
 }
 
+/*
+ * swap the addresses of a frame in place: always the MACs and, with
+ * OPT_REFLECT_L3, the IPv4/IPv6 addresses and the UDP/TCP ports.
+ * Swapping two fields of a sum leaves the checksums unchanged.
+ */
+static void
+reflect_swap(char *p, u_int len, int l3)
+{
+	uint8_t tmp[16], *b = (uint8_t *)p, *l4 = NULL;
+	uint16_t type;
+	u_int hl;
+
+	if (len < sizeof(struct ether_header))
+		return;
+	memcpy(tmp, b, 6);
+	memcpy(b, b + 6, 6);
+	memcpy(b + 6, tmp, 6);
+	if (!l3)
+		return;
+	memcpy(&type, b + 12, 2);
+	b += sizeof(struct ether_header);
+	len -= sizeof(struct ether_header);
+	if (type == htons(ETHERTYPE_IP) && len >= sizeof(struct ip)) {
+		struct ip *ip = (struct ip *)b;
+
+		memcpy(tmp, &ip->ip_src, 4);
+		memcpy(&ip->ip_src, &ip->ip_dst, 4);
+		memcpy(&ip->ip_dst, tmp, 4);
+		hl = ip->ip_hl << 2;
+		/* ports only in the first fragment */
+		if ((ip->ip_p == IPPROTO_UDP || ip->ip_p == IPPROTO_TCP) &&
+		    (ntohs(ip->ip_off) & IP_OFFMASK) == 0 && len >= hl + 4)
+			l4 = b + hl;
+	} else if (type == htons(ETHERTYPE_IPV6) &&
+			len >= sizeof(struct ip6_hdr)) {
+		struct ip6_hdr *ip6 = (struct ip6_hdr *)b;
+
+		memcpy(tmp, &ip6->ip6_src, 16);
+		memcpy(&ip6->ip6_src, &ip6->ip6_dst, 16);
+		memcpy(&ip6->ip6_dst, tmp, 16);
+		hl = sizeof(*ip6);
+		/* no extension headers */
+		if ((ip6->ip6_nxt == IPPROTO_UDP ||
+		     ip6->ip6_nxt == IPPROTO_TCP) && len >= hl + 4)
+			l4 = b + hl;
+	}
+	if (l4 != NULL) {
+		memcpy(tmp, l4, 2);
+		memcpy(l4, l4 + 2, 2);
+		memcpy(l4 + 2, tmp, 2);
+	}
+}
+
+/*
+ * reflector: send every frame back to where it came from, with the
+ * addresses swapped, on the tx ring paired with the rx ring it was
+ * received on. The frames are not copied: the buffers of the rx and
+ * tx slots are exchanged, so each thread (one per ring pair with -p)
+ * only touches the headers.
+ */
+static void *
+reflect_body(void *data)
+{
+	struct targ *targ = (struct targ *) data;
+	struct pollfd pfd = { .fd = targ->fd, .events = POLLIN };
+	struct netmap_if *nifp = targ->nmd->nifp;
+	int l3 = targ->g->options & OPT_REFLECT_L3;
+	u_int off = targ->g->virt_header;
+	uint64_t n = targ->g->npackets;
+	struct my_ctrs cur;
+	int i;
+
+	memset(&cur, 0, sizeof(cur));
+
+	if (setaffinity(targ->thread, targ->affinity))
+		goto quit;
+
+	D("reflecting on %s fd %d rings rx %d-%d tx %d-%d", targ->g->ifname,
+		targ->fd, targ->nmd->first_rx_ring, targ->nmd->last_rx_ring,
+		targ->nmd->first_tx_ring, targ->nmd->last_tx_ring);
+	clock_gettime(CLOCK_REALTIME_PRECISE, &targ->tic);
+	while (!targ->cancel && (n == 0 || cur.pkts < n)) {
+#ifdef BUSYWAIT
+		if (ioctl(pfd.fd, NIOCRXSYNC, NULL) < 0) {
+			D("ioctl error on queue %d: %s", targ->me,
+					strerror(errno));
+			goto quit;
+		}
+#else /* !BUSYWAIT */
+		/* the poll also pushes out what we queued on the tx rings */
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		if (pfd.revents & POLLERR) {
+			D("poll err");
+			goto quit;
+		}
+#endif /* !BUSYWAIT */
+		for (i = targ->nmd->first_rx_ring; i <= targ->nmd->last_rx_ring; i++) {
+			int t = targ->nmd->first_tx_ring + i -
+				targ->nmd->first_rx_ring;
+			struct netmap_ring *rxring, *txring;
+			u_int rxhead, txhead, m, k;
+
+			if (t > targ->nmd->last_tx_ring)
+				break;
+			rxring = NETMAP_RXRING(nifp, i);
+			txring = NETMAP_TXRING(nifp, t);
+			m = nm_ring_space(rxring);
+			k = nm_ring_space(txring);
+			if (m > k)
+				m = k;
+			if (m > (u_int)targ->g->burst)
+				m = targ->g->burst;
+			if (n > 0 && m > n - cur.pkts)
+				m = n - cur.pkts;
+			if (m == 0)
+				continue;
+			rxhead = rxring->head;
+			txhead = txring->head;
+			for (k = 0; k < m; k++) {
+				struct netmap_slot *rs = &rxring->slot[rxhead];
+				struct netmap_slot *ts = &txring->slot[txhead];
+				uint32_t idx = ts->buf_idx;
+
+				if (rs->len > off)
+					reflect_swap(NETMAP_BUF(rxring,
+						rs->buf_idx) + off,
+						rs->len - off, l3);
+				ts->buf_idx = rs->buf_idx;
+				rs->buf_idx = idx;
+				ts->len = rs->len;
+				ts->flags = (rs->flags & NS_MOREFRAG) |
+					NS_BUF_CHANGED;
+				rs->flags |= NS_BUF_CHANGED;
+				cur.bytes += rs->len;
+				rxhead = nm_ring_next(rxring, rxhead);
+				txhead = nm_ring_next(txring, txhead);
+			}
+			rxring->head = rxring->cur = rxhead;
+			txring->head = txring->cur = txhead;
+			cur.pkts += m;
+			cur.events++;
+		}
+#ifdef BUSYWAIT
+		ioctl(pfd.fd, NIOCTXSYNC, NULL);
+#endif
+		targ->ctr = cur;
+	}
+	/* push out the last frames */
+	ioctl(pfd.fd, NIOCTXSYNC, NULL);
+	clock_gettime(CLOCK_REALTIME_PRECISE, &targ->toc);
+	targ->completed = 1;
+	targ->ctr = cur;
+
+quit:
+	/* reset the ``used`` flag. */
+	targ->used = 0;
+
+	return (NULL);
+}
+
 
 static void *
 sender_body(void *data)
@@ -1595,7 +2358,7 @@ sender_body(void *data)
 	struct netmap_if *nifp;
 	struct netmap_ring *txring = NULL;
 	int i;
-	uint64_t n = targ->g->npackets / targ->g->nthreads;
+	uint64_t n = targ->g->npackets / global_nthreads;
 	uint64_t sent = 0;
 	uint64_t event = 0;
 	int options = targ->g->options | OPT_COPY;
@@ -1672,6 +2435,10 @@ sender_body(void *data)
 			targ->frags++;
 	}
 	D("frags %u frag_size %u", targ->frags, targ->frag_size);
+	if (targ->g->pool_size > 0 && pool_init(targ, frame) < 0) {
+		D("cannot build the frame pool on queue %d", targ->me);
+		goto pool_out;
+	}
 	while (!targ->cancel && (n == 0 || sent < n)) {
 		int rv;
 
@@ -1725,6 +2492,12 @@ sender_body(void *data)
 			if (nm_ring_empty(txring))
 				continue;
 
+			if (targ->pools != NULL) {
+				m = send_pool(txring,
+					&targ->pools[i - targ->nmd->first_tx_ring],
+					limit, &targ->ctr.bytes);
+				goto sent_some;
+			}
 			if (targ->g->pkt_min_size > 0) {
 				size = nrand48(targ->seed) %
 					(targ->g->pkt_size - targ->g->pkt_min_size) +
@@ -1732,13 +2505,14 @@ sender_body(void *data)
 			}
 			m = send_packets(txring, pkt, frame, size, targ,
 					 limit, options);
+			targ->ctr.bytes += m*size;
+		sent_some:
 			ND("limit %lu tail %d m %d",
 				limit, txring->tail, m);
 			sent += m;
 			if (m > 0) //XXX-ste: can m be 0?
 				event++;
 			targ->ctr.pkts = sent;
-			targ->ctr.bytes += m*size;
 			targ->ctr.events = event;
 			if (rate_limit) {
 				tosend -= m;
@@ -1765,12 +2539,27 @@ sender_body(void *data)
 			usleep(1); /* wait 1 tick */
 		}
 	}
+pool_out:
+	if (targ->pools != NULL) {
+		/* the pool buffers must not be in flight any more */
+		for (i = targ->nmd->first_tx_ring; i <= targ->nmd->last_tx_ring; i++) {
+			int tries;
+
+			txring = NETMAP_TXRING(nifp, i);
+			for (tries = 0; nm_tx_pending(txring) && tries < 1000; tries++) {
+				ioctl(pfd.fd, NIOCTXSYNC, NULL);
+				usleep(1);
+			}
+		}
+		pool_fini(targ);
+	}
     } /* end DEV_NETMAP */
 
 	clock_gettime(CLOCK_REALTIME_PRECISE, &targ->toc);
 	targ->completed = 1;
 	targ->ctr.pkts = sent;
-	targ->ctr.bytes = sent*size;
+	if (targ->g->pool_size == 0)
+		targ->ctr.bytes = sent*size;
 	targ->ctr.events = event;
 quit:
 	/* reset the ``used`` flag. */
@@ -1944,6 +2733,233 @@ quit:
 	return (NULL);
 }
 
+/*
+ * Sequence tracking for txseq/rxseq. The 4-byte sequence number after
+ * the UDP header counts the packets of each flow (the addresses and
+ * ports of the packet), so several flows can be checked at once, e.g.
+ * with address ranges on the sender. The receiver keeps, for each
+ * flow, a bitmap of the last SEQ_WINDOW sequence numbers, to tell
+ * losses, reordering (with the distance from the highest number seen)
+ * and duplicates apart, with a few operations per packet. Packets
+ * arriving more than SEQ_WINDOW behind are only counted as late.
+ */
+#define SEQ_WINDOW	1024	/* power of 2 */
+#define SEQ_MAX_FLOWS	65536	/* power of 2 */
+#define SEQ_HBUCKETS	10	/* reorder distance 1, 2-3, ..., 512-1023 */
+
+struct seq_key {
+	uint8_t src[16], dst[16];
+	uint16_t sport, dport;
+	uint32_t af;
+};
+
+struct seq_table {
+	uint32_t *hash;		/* 0 if empty, 1 + index of the entry */
+	char *ent;		/* entries, starting with the key */
+	size_t esize;
+	u_int n;
+	uint64_t untracked;	/* packets of flows that did not fit */
+};
+
+struct seq_tx_flow {
+	struct seq_key key;
+	uint32_t next;
+};
+
+struct seq_rx_flow {
+	struct seq_key key;
+	uint32_t base;		/* first sequence number received */
+	uint32_t top;		/* highest sequence number received + 1 */
+	uint64_t pkts, missing, reord, dups, late;
+	uint64_t win[SEQ_WINDOW / 64];
+};
+
+struct seq_stats {
+	uint64_t pkts, missing, reord, dups, late;
+	uint64_t hist[SEQ_HBUCKETS];
+};
+
+static int
+seq_table_init(struct seq_table *t, size_t esize)
+{
+	t->esize = esize;
+	t->n = 0;
+	t->untracked = 0;
+	t->hash = calloc(2 * SEQ_MAX_FLOWS, sizeof(*t->hash));
+	t->ent = calloc(SEQ_MAX_FLOWS, esize);
+	if (t->hash == NULL || t->ent == NULL) {
+		free(t->hash);
+		free(t->ent);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+seq_table_fini(struct seq_table *t)
+{
+	free(t->hash);
+	free(t->ent);
+}
+
+/* fills k with the flow of pkt, the headers must be in the buffer */
+static void
+seq_key_get(const struct pkt *pkt, int af, struct seq_key *k)
+{
+	memset(k, 0, sizeof(*k));
+	k->af = af;
+	if (af == AF_INET) {
+		memcpy(k->src, &pkt->ipv4.ip.ip_src, 4);
+		memcpy(k->dst, &pkt->ipv4.ip.ip_dst, 4);
+		k->sport = pkt->ipv4.udp.uh_sport;
+		k->dport = pkt->ipv4.udp.uh_dport;
+	} else {
+		memcpy(k->src, &pkt->ipv6.ip.ip6_src, 16);
+		memcpy(k->dst, &pkt->ipv6.ip.ip6_dst, 16);
+		k->sport = pkt->ipv6.udp.uh_sport;
+		k->dport = pkt->ipv6.udp.uh_dport;
+	}
+}
+
+/* returns the entry of flow k, a new zeroed one if not found, or NULL
+ * if the table is full */
+static void *
+seq_lookup(struct seq_table *t, const struct seq_key *k)
+{
+	const uint32_t *w = (const uint32_t *)k;
+	uint32_t h = 2166136261u, mask = 2 * SEQ_MAX_FLOWS - 1;
+	u_int i;
+	char *e;
+
+	for (i = 0; i < sizeof(*k) / 4; i++)
+		h = (h ^ w[i]) * 16777619u;
+	h ^= h >> 15;
+	for (h &= mask; t->hash[h] != 0; h = (h + 1) & mask) {
+		e = t->ent + (t->hash[h] - 1) * t->esize;
+		if (memcmp(e, k, sizeof(*k)) == 0)
+			return e;
+	}
+	if (t->n == SEQ_MAX_FLOWS) {
+		t->untracked++;
+		return NULL;
+	}
+	e = t->ent + t->n * t->esize;
+	memcpy(e, k, sizeof(*k));
+	t->hash[h] = ++t->n;
+	return e;
+}
+
+static inline int
+seq_win_test(struct seq_rx_flow *f, uint32_t s)
+{
+	s &= SEQ_WINDOW - 1;
+	return (f->win[s / 64] >> (s % 64)) & 1;
+}
+
+static inline void
+seq_win_set(struct seq_rx_flow *f, uint32_t s)
+{
+	s &= SEQ_WINDOW - 1;
+	f->win[s / 64] |= 1ULL << (s % 64);
+}
+
+static inline void
+seq_win_clear(struct seq_rx_flow *f, uint32_t s)
+{
+	s &= SEQ_WINDOW - 1;
+	f->win[s / 64] &= ~(1ULL << (s % 64));
+}
+
+/* accounts sequence number s received on flow f */
+static void
+seq_rx(struct seq_rx_flow *f, uint32_t s, struct seq_stats *st)
+{
+	uint32_t back;
+	int32_t d;
+
+	f->pkts++;
+	if (f->pkts == 1) {
+		f->base = s;
+		f->top = s + 1;
+		seq_win_set(f, s);
+		return;
+	}
+	d = (int32_t)(s - f->top);
+	if (d >= 0) {
+		/* new highest: the numbers in between are missing, for now */
+		f->missing += d;
+		if ((uint32_t)d >= SEQ_WINDOW)
+			memset(f->win, 0, sizeof(f->win));
+		else
+			for (; f->top != s; f->top++)
+				seq_win_clear(f, f->top);
+		f->top = s + 1;
+		seq_win_set(f, s);
+		return;
+	}
+	back = f->top - 1 - s;
+	if ((int32_t)(s - f->base) < 0 || back >= SEQ_WINDOW) {
+		f->late++;
+	} else if (seq_win_test(f, s)) {
+		f->dups++;
+	} else {
+		seq_win_set(f, s);
+		f->missing--;
+		f->reord++;
+		st->hist[31 - __builtin_clz(back)]++;
+	}
+}
+
+static void
+seq_print(struct seq_table *t, struct seq_stats *st, const char *what)
+{
+	char buf[256] = "", a1[INET6_ADDRSTRLEN], a2[INET6_ADDRSTRLEN];
+	int len = 0;
+	u_int i;
+
+	for (i = 0; i < t->n; i++) {
+		struct seq_rx_flow *f =
+			(struct seq_rx_flow *)(t->ent + i * t->esize);
+
+		st->pkts += f->pkts;
+		st->missing += f->missing;
+		st->reord += f->reord;
+		st->dups += f->dups;
+		st->late += f->late;
+		if (verbose < 2)
+			continue;
+		inet_ntop(f->key.af, f->key.src, a1, sizeof(a1));
+		inet_ntop(f->key.af, f->key.dst, a2, sizeof(a2));
+		D("%s %s:%u -> %s:%u: %llu pkts %llu lost %llu reordered "
+			"%llu dups %llu late", what,
+			a1, ntohs(f->key.sport), a2, ntohs(f->key.dport),
+			(unsigned long long)f->pkts,
+			(unsigned long long)f->missing,
+			(unsigned long long)f->reord,
+			(unsigned long long)f->dups,
+			(unsigned long long)f->late);
+	}
+	D("%s %u flows %llu pkts %llu lost (%.4f%%) %llu reordered "
+		"%llu dups %llu late %llu untracked", what, t->n,
+		(unsigned long long)st->pkts,
+		(unsigned long long)st->missing,
+		st->pkts + st->missing ?
+		100.0 * st->missing / (st->pkts + st->missing) : 0,
+		(unsigned long long)st->reord,
+		(unsigned long long)st->dups,
+		(unsigned long long)st->late,
+		(unsigned long long)t->untracked);
+	if (st->reord == 0)
+		return;
+	for (i = 0; i < SEQ_HBUCKETS && len < (int)sizeof(buf); i++) {
+		if (st->hist[i] == 0)
+			continue;
+		len += snprintf(buf + len, sizeof(buf) - len, " %u:%llu",
+			1U << i, (unsigned long long)st->hist[i]);
+	}
+	D("%s reorder distance%s", what, buf);
+}
+
 static void *
 txseq_body(void *data)
 {
@@ -1957,7 +2973,10 @@ txseq_body(void *data)
 	int rate_limit = targ->g->tx_rate;
 	struct pkt *pkt = &targ->pkt;
 	int frags = targ->g->frags;
-	uint32_t sequence = 0;
+	uint32_t sequence = 0, seq;
+	struct seq_table flows;
+	struct seq_tx_flow *flow = NULL;
+	struct seq_key key;
 	int budget = 0;
 	void *frame;
 	int size;
@@ -1966,6 +2985,10 @@ txseq_body(void *data)
 		D("can only txseq ping with 1 thread");
 		return NULL;
 	}
+	if (seq_table_init(&flows, sizeof(*flow))) {
+		D("failed to allocate the flow table");
+		return NULL;
+	}
 
 	if (targ->g->npackets > 0) {
 		D("Ignoring -n argument");
@@ -2056,19 +3079,28 @@ txseq_body(void *data)
 
 			memcpy(&sum, targ->g->af == AF_INET ? &pkt->ipv4.udp.uh_sum : &pkt->ipv6.udp.uh_sum, sizeof(sum));
 
+			/* one sequence per flow, a global one past the
+			 * size of the table */
+			if (flow == NULL) {
+				seq_key_get(pkt, targ->g->af, &key);
+				flow = seq_lookup(&flows, &key);
+			}
+			seq = flow ? flow->next++ : sequence;
+
 			slot->flags = 0;
 			t = *w;
-			PKT(pkt, body, targ->g->af)[0] = sequence >> 24;
-			PKT(pkt, body, targ->g->af)[1] = (sequence >> 16) & 0xff;
+			PKT(pkt, body, targ->g->af)[0] = seq >> 24;
+			PKT(pkt, body, targ->g->af)[1] = (seq >> 16) & 0xff;
 			sum = ~cksum_add(~sum, cksum_add(~t, *w));
 			t = *++w;
-			PKT(pkt, body, targ->g->af)[2] = (sequence >> 8) & 0xff;
-			PKT(pkt, body, targ->g->af)[3] = sequence & 0xff;
+			PKT(pkt, body, targ->g->af)[2] = (seq >> 8) & 0xff;
+			PKT(pkt, body, targ->g->af)[3] = seq & 0xff;
 			sum = ~cksum_add(~sum, cksum_add(~t, *w));
 			memcpy(targ->g->af == AF_INET ? &pkt->ipv4.udp.uh_sum : &pkt->ipv6.udp.uh_sum, &sum, sizeof(sum));
 			nm_pkt_copy(frame, p, size);
 			if (fcnt == frags) {
 				update_addresses(pkt, targ);
+				flow = NULL;
 			}
 
 			if (options & OPT_DUMP) {
@@ -2123,7 +3155,11 @@ txseq_body(void *data)
 	targ->ctr.pkts = sent;
 	targ->ctr.bytes = sent * size;
 	targ->ctr.events = event;
+	if (flows.untracked)
+		D("%u flows, %llu packets of other flows with a shared sequence",
+			flows.n, (unsigned long long)flows.untracked);
 quit:
+	seq_table_fini(&flows);
 	/* reset the ``used`` flag. */
 	targ->used = 0;
 
@@ -2165,21 +3201,23 @@ rxseq_body(void *data)
 	struct my_ctrs cur;
 	unsigned int frags = 0;
 	int first_packet = 1;
-	int first_slot = 1;
-	int i, j, af, nrings;
-	uint32_t seq, *seq_exp = NULL;
+	int i, j, af;
+	uint32_t seq;
+	struct seq_table flows;
+	struct seq_stats st;
+	struct seq_key key;
 
 	memset(&cur, 0, sizeof(cur));
+	memset(&st, 0, sizeof(st));
 
-	if (setaffinity(targ->thread, targ->affinity))
-		goto quit;
+	if (seq_table_init(&flows, sizeof(struct seq_rx_flow))) {
+		D("failed to allocate the flow table");
+		targ->used = 0;
+		return (NULL);
+	}
 
-	nrings = targ->nmd->last_rx_ring - targ->nmd->first_rx_ring + 1;
-	seq_exp = calloc(nrings, sizeof(uint32_t));
-	if (seq_exp == NULL) {
-		D("failed to allocate seq array");
+	if (setaffinity(targ->thread, targ->affinity))
 		goto quit;
-	}
 
 	D("reading from %s fd %d main_fd %d",
 		targ->g->ifname, targ->fd, targ->g->main_fd);
@@ -2287,28 +3325,16 @@ rxseq_body(void *data)
 					RD(1, "%s: packet too small (len=%u)", __func__,
 							slot->len);
 				} else {
+					struct seq_rx_flow *f;
+
 					seq = (PKT(pkt, body, af)[0] << 24) |
 						(PKT(pkt, body, af)[1] << 16) |
 						(PKT(pkt, body, af)[2] << 8) |
 						PKT(pkt, body, af)[3];
-					if (first_slot) {
-						/* Grab the first one, whatever it
-						   is. */
-						seq_exp[j] = seq;
-						first_slot = 0;
-					} else if (seq != seq_exp[j]) {
-						uint32_t delta = seq - seq_exp[j];
-
-						if (delta < (0xFFFFFFFF >> 1)) {
-							RD(2, "Sequence GAP: exp %u found %u",
-									seq_exp[j], seq);
-						} else {
-							RD(2, "Sequence OUT OF ORDER: "
-									"exp %u found %u", seq_exp[j], seq);
-						}
-						seq_exp[j] = seq;
-					}
-					seq_exp[j]++;
+					seq_key_get(pkt, af, &key);
+					f = seq_lookup(&flows, &key);
+					if (f != NULL)
+						seq_rx(f, seq, &st);
 				}
 
 				cur.bytes += slot->len;
@@ -2329,10 +3355,10 @@ out:
 #endif /* !BUSYWAIT */
 	targ->completed = 1;
 	targ->ctr = cur;
+	seq_print(&flows, &st, "rxseq");
 
 quit:
-	if (seq_exp != NULL)
-		free(seq_exp);
+	seq_table_fini(&flows);
 	/* reset the ``used`` flag. */
 	targ->used = 0;
 
@@ -2389,11 +3415,19 @@ usage(int errcode)
 "             Name of the network interface that pkt-gen operates on.  It can be a system network interface\n"
 "             (e.g., em0), the name of a vale(4) port (e.g., valeSSS:PPP), the name of a netmap pipe or\n"
 "             monitor, or any valid netmap port name accepted by the nm_open library function, as docu-\n"
-"             mented in netmap(4) (NIOCREGIF section).\n"
+"             mented in netmap(4) (NIOCREGIF section).  In tx and rx mode the option can be repeated to\n"
+"             run on several netmap ports at once, with -p threads on each port; the threads start\n"
+"             together and their counters are reported together.\n"
 "\n"
 "     -f function\n"
 "             The function to be executed by pkt-gen.  Specify tx for transmission, rx for reception, ping\n"
-"             for client-side ping-pong operation, and pong for server-side ping-pong operation.\n"
+"             for client-side ping-pong operation, pong for server-side ping-pong operation, and lat for\n"
+"             open-loop latency measurements against a pong (RTT percentiles per report interval).\n"
+"             txseq and rxseq send and check per-flow sequence numbers; rxseq reports losses,\n"
+"             reordering (with a distance histogram), duplicates and late packets at exit.\n"
+"             reflect sends every frame back on the tx ring paired with its rx ring, with the MAC\n"
+"             addresses (and with -o 4096 also the IP addresses and ports) swapped, exchanging the\n"
+"             buffers instead of copying; with -p each thread serves one ring pair.\n"
 "\n"
 "     -n count\n"
 "             Number of iterations of the pkt-gen function (with 0 meaning infinite).  In case of tx or rx,\n"
@@ -2402,7 +3436,8 @@ usage(int errcode)
 "\n"
 "     -l pkt_size\n"
 "             Packet size in bytes excluding CRC.  If passed a second time, use random sizes larger or\n"
-"             equal than the second one and lower than the first one.\n"
+"             equal than the second one and lower than the first one.  With -Q, imix selects the simple\n"
+"             IMIX mix (7:4:1 of 60, 590 and 1514 bytes).\n"
 "\n"
 "     -b burst_size\n"
 "             Transmit or receive up to burst_size packets at a time.\n"
@@ -2425,7 +3460,8 @@ usage(int errcode)
 "\n"
 "     -a cpu_id\n"
 "             Pin the first thread of pkt-gen to a particular CPU using pthread_setaffinity_np(3).  If more\n"
-"             threads are used, they are pinned to the subsequent CPUs, one per thread.\n"
+"             threads are used, they are pinned to the subsequent CPUs, one per thread.  With numa, the\n"
+"             threads of each port are pinned to distinct CPUs of the NUMA node of the port.\n"
 "\n"
 "     -c cpus\n"
 "             Maximum number of CPUs to use (0 means to use all the available ones).\n"
@@ -2448,7 +3484,8 @@ usage(int errcode)
 "             Packet transmission rate.  Not setting the packet transmission rate tells pkt-gen to transmit\n"
 "             packets as quickly as possible.  On servers from 2010 onward netmap(4) is able to com-\n"
 "             pletely use all of the bandwidth of a 10 or 40Gbps link, so this option should be used unless\n"
-"             your intention is to saturate the link.\n"
+"             your intention is to saturate the link.  With several ports, rate is the total for all the\n"
+"             threads, otherwise it applies to each thread.\n"
 "\n"
 "     -X      Dump payload of each packet transmitted or received.\n"
 "\n"
@@ -2457,7 +3494,8 @@ usage(int errcode)
 "\n"
 "     -P file\n"
 "             Load the packet to be transmitted from a pcap file rather than constructing it within\n"
-"             pkt-gen.\n"
+"             pkt-gen.  With -Q, all the frames of the file are loaded in the frame pool and sent\n"
+"             in a loop.\n"
 "\n"
 "     -z      Use random IPv4/IPv6 src address/port.\n"
 "\n"
@@ -2475,6 +3513,16 @@ usage(int errcode)
 "             In multi-slot mode, frag_size specifies the size of each fragment, if smaller than the packet\n"
 "             length divided by num_frags.\n"
 "\n"
+"     -Q pool_size\n"
+"             In tx mode, build pool_size ready frames per thread in extra netmap buffers before\n"
+"             starting, with successive flows and the requested sizes, and transmit them by attaching\n"
+"             their buffers to the tx slots, without touching the packet data.  The frames of a thread\n"
+"             are split among its tx rings, and each ring needs at least as many frames as slots.\n"
+"\n"
+"     -E name\n"
+"             Publish the counters of each thread in the shared memory segment name, updated at\n"
+"             every report, for nmstat(8) or other readers.\n"
+"\n"
 "     -I      Use indirect buffers.  It is only valid for transmitting on VALE ports, and it is implemented\n"
 "             by setting the NS_INDIRECT flag in the netmap slots.\n"
 "\n"
@@ -2512,53 +3560,113 @@ usage(int errcode)
 "				OPT_RANDOM_SRC  512\n"
 "				OPT_RANDOM_DST  1024\n"
 "				OPT_PPS_STATS   2048\n"
+"				OPT_REFLECT_L3  4096\n"
+"					(reflect also IP addresses and ports)\n"
 		     "",
 		cmd);
 	exit(errcode);
 }
 
+/* open a netmap port, with one ring per thread if there are more threads */
+static struct nmport_d *
+port_open(struct glob_arg *g, const char *ifname, uint32_t *orig_mode)
+{
+	struct nmport_d *d = nmport_prepare(ifname);
+
+	if (d == NULL)
+		return NULL;
+
+	parse_nmr_config(g->nmr_config, &d->reg);
+
+	d->reg.nr_flags |= NR_ACCEPT_VNET_HDR;
+	/* each thread (clone) gets its own set */
+	d->reg.nr_extra_bufs = g->pool_size;
+
+	*orig_mode = d->reg.nr_mode;
+	if (g->nthreads > 1) {
+		switch (*orig_mode) {
+		case NR_REG_ALL_NIC:
+		case NR_REG_NIC_SW:
+			d->reg.nr_mode = NR_REG_ONE_NIC;
+			break;
+		case NR_REG_SW:
+			d->reg.nr_mode = NR_REG_ONE_SW;
+			break;
+		default:
+			break;
+		}
+		d->reg.nr_ringid = 0;
+	}
+	if (nmport_open_desc(d) < 0) {
+		nmport_undo_prepare(d);
+		return NULL;
+	}
+	return d;
+}
+
+/* pin the thread and wait for the common start */
+static void *
+thread_start(void *data)
+{
+	struct targ *t = data;
+	struct glob_arg *g = t->g;
+	void *(*body)(void *) = g->td_body;
+
+	setaffinity(pthread_self(), t->affinity);
+	__atomic_add_fetch(&g->start_ready, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&g->start_go, __ATOMIC_ACQUIRE))
+		;
+	return body(t);
+}
+
 static int
 start_threads(struct glob_arg *g) {
-	int i;
+	int i, started = 0;
+	int node_next[64] = { 0 };
 
-	targs = calloc(g->nthreads, sizeof(*targs));
+	targs = calloc(global_nthreads, sizeof(*targs));
 	struct targ *t;
 	/*
 	 * Now create the desired number of threads, each one
-	 * using a single descriptor.
+	 * using a single descriptor. Threads [k*nthreads, (k+1)*nthreads)
+	 * work on port k.
 	 */
-	for (i = 0; i < g->nthreads; i++) {
+	for (i = 0; i < global_nthreads; i++) {
 		uint64_t seed = (uint64_t)time(0) | ((uint64_t)time(0) << 32);
+		int port = i / g->nthreads, ring = i % g->nthreads;
+
 		t = &targs[i];
 
 		bzero(t, sizeof(*t));
 		t->fd = -1; /* default, with pcap */
 		t->g = g;
+		seed += i;
 		memcpy(t->seed, &seed, sizeof(t->seed));
 
 		if (g->dev_type == DEV_NETMAP) {
+			struct nmport_d *base = g->ports[port].nmd;
 			int m = -1;
 
 			/*
 			 * if the user wants both HW and SW rings, we need to
 			 * know when to switch from NR_REG_ONE_NIC to NR_REG_ONE_SW
 			 */
-			if (g->orig_mode == NR_REG_NIC_SW) {
+			if (g->ports[port].orig_mode == NR_REG_NIC_SW) {
 				m = (g->td_type == TD_TYPE_RECEIVER ?
-						g->nmd->reg.nr_rx_rings :
-						g->nmd->reg.nr_tx_rings);
+						base->reg.nr_rx_rings :
+						base->reg.nr_tx_rings);
 			}
 
-			if (i > 0) {
+			if (ring > 0) {
 				int j;
 				/* the first thread uses the fd opened by the main
 				 * thread, the other threads re-open /dev/netmap
 				 */
-				t->nmd = nmport_clone(g->nmd);
+				t->nmd = nmport_clone(base);
 				if (t->nmd == NULL)
 					return -1;
 
-				j = i;
+				j = ring;
 				if (m > 0 && j >= m) {
 					/* switch to the software rings */
 					t->nmd->reg.nr_mode = NR_REG_ONE_SW;
@@ -2576,7 +3684,7 @@ start_threads(struct glob_arg *g) {
 					return -1;
 				}
 			} else {
-				t->nmd = g->nmd;
+				t->nmd = base;
 			}
 			t->fd = t->nmd->fd;
 			t->frags = g->frags;
@@ -2585,7 +3693,20 @@ start_threads(struct glob_arg *g) {
 		}
 		t->used = 1;
 		t->me = i;
-		if (g->affinity >= 0) {
+		if (g->numa_affinity) {
+			int node = g->dev_type == DEV_NETMAP ?
+				port_numa_node(g->ports[port].nmd) : -1;
+
+			/* no NUMA information, use the cpus in order */
+			t->affinity = g->system_cpus;
+			if (node >= 0 && node < 64)
+				t->affinity = numa_node_cpu(node,
+					node_next[node]++, g->system_cpus);
+			if (t->affinity >= g->system_cpus)
+				t->affinity = i % g->system_cpus;
+			D("thread %d port %s ring %d numa node %d cpu %d", i,
+				g->ports[port].ifname, ring, node, t->affinity);
+		} else if (g->affinity >= 0) {
 			t->affinity = (g->affinity + i) % g->cpus;
 		} else {
 			t->affinity = -1;
@@ -2598,13 +3719,19 @@ start_threads(struct glob_arg *g) {
 	sleep(g->wait_link);
 	D("Ready...");
 
-	for (i = 0; i < g->nthreads; i++) {
+	for (i = 0; i < global_nthreads; i++) {
 		t = &targs[i];
-		if (pthread_create(&t->thread, NULL, g->td_body, t) == -1) {
+		if (pthread_create(&t->thread, NULL, thread_start, t) != 0) {
 			D("Unable to create thread %d: %s", i, strerror(errno));
 			t->used = 0;
+		} else {
+			started++;
 		}
 	}
+	/* common start, once all the threads are pinned and ready */
+	while (__atomic_load_n(&g->start_ready, __ATOMIC_ACQUIRE) < started)
+		usleep(100);
+	__atomic_store_n(&g->start_go, 1, __ATOMIC_RELEASE);
 	return 0;
 }
 
@@ -2634,11 +3761,16 @@ main_thread(struct glob_arg *g)
 		if (usec < 10000) /* too short to be meaningful */
 			continue;
 		/* accumulate counts for all threads */
-		for (i = 0; i < g->nthreads; i++) {
+		for (i = 0; i < global_nthreads; i++) {
 			cur.pkts += targs[i].ctr.pkts;
 			cur.bytes += targs[i].ctr.bytes;
 			cur.events += targs[i].ctr.events;
 			cur.min_space += targs[i].ctr.min_space;
+			if (g->ctrs.hdr != NULL) {
+				x = targs[i].ctr;
+				x.t = cur.t;
+				ctrs_shm_publish(&g->ctrs, i, &x);
+			}
 			targs[i].ctr.min_space = 99999;
 			if (targs[i].used == 0)
 				done++;
@@ -2688,7 +3820,7 @@ main_thread(struct glob_arg *g)
 			abs, (int)cur.min_space);
 		prev = cur;
 
-		if (done == g->nthreads)
+		if (done == global_nthreads)
 			break;
 	}
 
@@ -2696,7 +3828,7 @@ main_thread(struct glob_arg *g)
 	timerclear(&toc);
 	cur.pkts = cur.bytes = cur.events = 0;
 	/* final round */
-	for (i = 0; i < g->nthreads; i++) {
+	for (i = 0; i < global_nthreads; i++) {
 		struct timespec t_tic, t_toc;
 		/*
 		 * Join active threads, unregister interfaces and close
@@ -2721,6 +3853,12 @@ main_thread(struct glob_arg *g)
 		cur.pkts += targs[i].ctr.pkts;
 		cur.bytes += targs[i].ctr.bytes;
 		cur.events += targs[i].ctr.events;
+		if (g->ctrs.hdr != NULL) {
+			struct my_ctrs x = targs[i].ctr;
+
+			gettimeofday(&x.t, NULL);
+			ctrs_shm_publish(&g->ctrs, i, &x);
+		}
 		/* collect the largest start (tic) and end (toc) times,
 		 * XXX maybe we should do the earliest tic, or do a weighted
 		 * average ?
@@ -2733,6 +3871,23 @@ main_thread(struct glob_arg *g)
 			toc = timespec2val(&targs[i].toc);
 	}
 
+	if (g->nports > 1) {
+		int k;
+
+		for (k = 0; k < g->nports; k++) {
+			uint64_t pkts = 0, bytes = 0;
+			char b1[40], b2[40];
+
+			for (i = k * g->nthreads; i < (k + 1) * g->nthreads; i++) {
+				pkts += targs[i].ctr.pkts;
+				bytes += targs[i].ctr.bytes;
+			}
+			D("%s: %spkts %sbytes", g->ports[k].ifname,
+				norm(b1, (double)pkts, normalize),
+				norm(b2, (double)bytes, normalize));
+		}
+	}
+
 	/* print output. */
 	timersub(&toc, &tic, &toc);
 	delta_t = toc.tv_sec + 1e-6* toc.tv_usec;
@@ -2740,6 +3895,9 @@ main_thread(struct glob_arg *g)
 		tx_output(g, &cur, delta_t, "Sent");
 	else if (g->td_type == TD_TYPE_RECEIVER)
 		tx_output(g, &cur, delta_t, "Received");
+	else if (g->td_type == TD_TYPE_REFLECTOR)
+		tx_output(g, &cur, delta_t, "Reflected");
+	ctrs_shm_close(&g->ctrs);
 }
 
 struct td_desc {
@@ -2754,8 +3912,10 @@ static struct td_desc func[] = {
 	{ TD_TYPE_SENDER,	"tx",		sender_body,	512 },
 	{ TD_TYPE_OTHER,	"ping",		ping_body,	1 },
 	{ TD_TYPE_OTHER,	"pong",		pong_body,	1 },
+	{ TD_TYPE_OTHER,	"lat",		latency_body,	1 },
 	{ TD_TYPE_SENDER,	"txseq",	txseq_body,	512 },
 	{ TD_TYPE_RECEIVER,	"rxseq",	rxseq_body,	512 },
+	{ TD_TYPE_REFLECTOR,	"reflect",	reflect_body,	512 },
 	{ 0,			NULL,		NULL, 		0 }
 };
 
@@ -2869,7 +4029,7 @@ main(int arc, char **argv)
 	g.wait_link = 2;	/* wait 2 seconds for physical ports */
 
 	while ((ch = getopt(arc, argv, "46a:f:F:Nn:i:Il:d:s:D:S:b:c:o:p:"
-	    "T:w:WvR:XC:H:rP:zZAhBM:")) != -1) {
+	    "T:w:WvR:XC:H:rP:zZAhBM:Q:E:")) != -1) {
 
 		switch(ch) {
 		default:
@@ -2928,7 +4088,10 @@ main(int arc, char **argv)
 			break;
 
 		case 'a':       /* force affinity */
-			g.affinity = atoi(optarg);
+			if (strcmp(optarg, "numa") == 0)
+				g.numa_affinity = 1;
+			else
+				g.affinity = atoi(optarg);
 			break;
 
 		case 'i':	/* interface */
@@ -2940,6 +4103,21 @@ main(int arc, char **argv)
 				D("ifname too long %s", optarg);
 				break;
 			}
+			if (g.nports > 0) { /* more ports, netmap only */
+				if (g.nports == MAX_PORTS) {
+					D("too many ports, max %d", MAX_PORTS);
+					usage(-1);
+				}
+				if (!strncmp(optarg, "netmap:", 7) ||
+				    !strncmp(optarg, "vale", 4))
+					strcpy(g.ports[g.nports].ifname, optarg);
+				else
+					sprintf(g.ports[g.nports].ifname,
+						"netmap:%s", optarg);
+				g.nports++;
+				break;
+			}
+			g.nports = 1;
 			strcpy(g.ifname, optarg);
 			if (!strcmp(optarg, "null")) {
 				g.dev_type = DEV_NETMAP;
@@ -2966,7 +4144,12 @@ main(int arc, char **argv)
 			break;
 
 		case 'l':	/* pkt_size */
-			if (pkt_size_done) {
+			if (strcmp(optarg, "imix") == 0) {
+				g.imix = 1;
+				g.pkt_size = imix_sizes[
+					sizeof(imix_sizes) / sizeof(imix_sizes[0]) - 1];
+				pkt_size_done = 1;
+			} else if (pkt_size_done) {
 				g.pkt_min_size = atoi(optarg);
 			} else {
 				g.pkt_size = atoi(optarg);
@@ -3043,6 +4226,12 @@ main(int arc, char **argv)
 		case 'A':
 			g.options |= OPT_PPS_STATS;
 			break;
+		case 'Q':
+			g.pool_size = atoi(optarg);
+			break;
+		case 'E':
+			g.ctrs_name = optarg;
+			break;
 		case 'B':
 			/* raw packets have4 bytes crc + 20 bytes framing */
 			// XXX maybe add an option to pass the IFG
@@ -3056,6 +4245,13 @@ main(int arc, char **argv)
 		usage(-1);
 	}
 
+	if (g.nports > 1 && (g.dev_type != DEV_NETMAP || g.dummy_send ||
+			(g.td_type != TD_TYPE_SENDER &&
+			 g.td_type != TD_TYPE_RECEIVER))) {
+		D("several ports only work on netmap, in tx or rx mode");
+		usage(-1);
+	}
+
 	if (g.burst == 0) {
 		g.burst = fn->default_burst;
 		D("using default burst size: %d", g.burst);
@@ -3084,6 +4280,24 @@ main(int arc, char **argv)
 		usage(-1);
 	}
 
+	if (g.imix && g.pool_size == 0) {
+		D("-l imix needs a frame pool (-Q)");
+		usage(-1);
+	}
+
+	if (g.pool_size > 0 && (g.td_type != TD_TYPE_SENDER ||
+			g.dev_type != DEV_NETMAP || g.frags > 1 ||
+			(g.options & (OPT_INDIRECT | OPT_RUBBISH)))) {
+		D("-Q only works in tx mode on netmap ports, without -F, -I, -r");
+		usage(-1);
+	}
+
+#ifndef NO_PCAP
+	if (g.pool_size > 0 && g.packet_file != NULL &&
+			pcap_load_frames(&g) < 0)
+		usage(-1);
+#endif
+
 	if (g.src_mac.name == NULL) {
 		static char mybuf[20] = "00:00:00:00:00:00";
 		/* retrieve source mac address. */
@@ -3128,14 +4342,6 @@ main(int arc, char **argv)
     } else if (g.dummy_send) { /* but DEV_NETMAP */
 	D("using a dummy send routine");
     } else {
-	g.nmd = nmport_prepare(g.ifname);
-	if (g.nmd == NULL)
-		goto out;
-
-	parse_nmr_config(g.nmr_config, &g.nmd->reg);
-
-	g.nmd->reg.nr_flags |= NR_ACCEPT_VNET_HDR;
-
 	/*
 	 * Open the netmap device using nm_open().
 	 *
@@ -3143,22 +4349,8 @@ main(int arc, char **argv)
 	 * which in turn may take some time for the PHY to
 	 * reconfigure. We do the open here to have time to reset.
 	 */
-	g.orig_mode = g.nmd->reg.nr_mode;
-	if (g.nthreads > 1) {
-		switch (g.orig_mode) {
-		case NR_REG_ALL_NIC:
-		case NR_REG_NIC_SW:
-			g.nmd->reg.nr_mode = NR_REG_ONE_NIC;
-			break;
-		case NR_REG_SW:
-			g.nmd->reg.nr_mode = NR_REG_ONE_SW;
-			break;
-		default:
-			break;
-		}
-		g.nmd->reg.nr_ringid = 0;
-	}
-	if (nmport_open_desc(g.nmd) < 0)
+	g.nmd = port_open(&g, g.ifname, &g.orig_mode);
+	if (g.nmd == NULL)
 		goto out;
 	g.main_fd = g.nmd->fd;
 	ND("mapped %luKB at %p", (unsigned long)(g.nmd->req.nr_memsize>>10),
@@ -3167,7 +4359,7 @@ main(int arc, char **argv)
 	if (g.virt_header) {
 		/* Set the virtio-net header length, since the user asked
 		 * for it explicitly. */
-		set_vnet_hdr_len(&g);
+		set_vnet_hdr_len(&g, g.nmd);
 	} else {
 		/* Check whether the netmap port we opened requires us to send
 		 * and receive frames with virtio-net header. */
@@ -3189,6 +4381,9 @@ main(int arc, char **argv)
 	if (g.td_type == TD_TYPE_SENDER) {
 		int mtu = get_if_mtu(&g);
 
+		/* the imix sizes include the ethernet header */
+		if (mtu > 0 && g.imix)
+			mtu += sizeof(struct ether_header);
 		if (mtu > 0 && g.pkt_size > mtu) {
 			D("pkt_size (%d) must be <= mtu (%d)",
 				g.pkt_size, mtu);
@@ -3196,6 +4391,25 @@ main(int arc, char **argv)
 		}
 	}
 
+	strcpy(g.ports[0].ifname, g.ifname);
+	g.ports[0].nmd = g.nmd;
+	g.ports[0].orig_mode = g.orig_mode;
+	for (i = 1; i < g.nports; i++) {
+		struct nmport_d *d = port_open(&g, g.ports[i].ifname,
+				&g.ports[i].orig_mode);
+
+		if (d == NULL) {
+			D("cannot open %s", g.ports[i].ifname);
+			return -1;
+		}
+		g.ports[i].nmd = d;
+		if (g.virt_header)
+			set_vnet_hdr_len(&g, d);
+		if ((g.td_type == TD_TYPE_SENDER ? d->reg.nr_tx_rings :
+				d->reg.nr_rx_rings) < (uint32_t)g.nthreads)
+			D("%s has less than %d rings", g.ports[i].ifname, g.nthreads);
+	}
+
 	if (verbose) {
 		struct netmap_if *nifp = g.nmd->nifp;
 		struct nmreq_register *req = &g.nmd->reg;
@@ -3220,7 +4434,8 @@ main(int arc, char **argv)
 		"%s %s: %d queues, %d threads and %d cpus.\n",
 		(g.td_type == TD_TYPE_SENDER) ? "Sending on" :
 			((g.td_type == TD_TYPE_RECEIVER) ? "Receiving from" :
-			"Working on"),
+			((g.td_type == TD_TYPE_REFLECTOR) ? "Reflecting on" :
+			"Working on")),
 		g.ifname,
 		devqueues,
 		g.nthreads,
@@ -3257,12 +4472,19 @@ out:
 		 * (but no less than one full set of fragments)
 	 	 */
 		uint64_t x;
-		int lim = (g.tx_rate)/300;
+		/* with several ports -R is the total, split among the threads */
+		int rate = g.nports > 1 ? g.tx_rate / (g.nports * g.nthreads) :
+			g.tx_rate;
+		int lim;
+
+		if (rate == 0)
+			rate = 1;
+		lim = rate / 300;
 		if (g.burst > lim)
 			g.burst = lim;
 		if (g.burst == 0)
 			g.burst = 1;
-		x = ((uint64_t)1000000000 * (uint64_t)g.burst) / (uint64_t) g.tx_rate;
+		x = ((uint64_t)1000000000 * (uint64_t)g.burst) / (uint64_t) rate;
 		g.tx_period.tv_nsec = x;
 		g.tx_period.tv_sec = g.tx_period.tv_nsec / 1000000000;
 		g.tx_period.tv_nsec = g.tx_period.tv_nsec % 1000000000;
@@ -3271,7 +4493,7 @@ out:
 	    D("Sending %d packets every  %ld.%09ld s",
 			g.burst, g.tx_period.tv_sec, g.tx_period.tv_nsec);
 	/* Install ^C handler. */
-	global_nthreads = g.nthreads;
+	global_nthreads = g.nthreads * (g.nports > 1 ? g.nports : 1);
 	sigemptyset(&ss);
 	sigaddset(&ss, SIGINT);
 	/* block SIGINT now, so that all created threads will inherit the mask */
@@ -3280,6 +4502,22 @@ out:
 	}
 	if (start_threads(&g) < 0)
 		return 1;
+	if (g.ctrs_name != NULL) {
+		if (ctrs_shm_create(&g.ctrs, g.ctrs_name, "pkt-gen",
+				global_nthreads) < 0) {
+			D("cannot publish the counters in %s: %s",
+				g.ctrs_name, strerror(errno));
+		} else {
+			for (i = 0; i < global_nthreads; i++) {
+				char name[CTRS_SHM_NAMELEN];
+
+				snprintf(name, sizeof(name), "%s/%d",
+					g.ports[i / g.nthreads].ifname,
+					i % g.nthreads);
+				ctrs_shm_set_name(&g.ctrs, i, name);
+			}
+		}
+	}
 	/* Install the handler and re-enable SIGINT for the main thread */
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = sigint_h;
@@ -160,6 +160,8 @@ prod()
 int verbose = 1;
 
 static int do_abort = 0;
+static uint64_t pace_tol = 0;		/* -T: burst coalescing (ns) */
+#define PACE_SPIN_NS	2000		/* spin instead of usleep below this */
 
 #ifdef linux
 static int latency_fd = -1;
@@ -194,6 +196,8 @@ static void latency_reduction_stop(void)
 #include <stddef.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 // for route-mode
 #include <netinet/in.h>
@@ -221,6 +225,7 @@ static void latency_reduction_stop(void)
 #endif
 
 #include "ctrs.h"	/* norm() */
+#include "pacer.h"
 
 #ifdef __APPLE__
 #define cpuset_t        uint64_t        // XXX
@@ -309,6 +314,7 @@ struct _eci {
 	uint64_t	ec_delay_offset;
 	int		ec_allow_drop;
 	uint32_t	ec_qsize;
+	uint32_t	ec_datalen;	/* bytes used in ec_data */
 #define EC_DATASZ       (1U << 17)
         char            ec_data[EC_DATASZ];
 };
@@ -326,6 +332,19 @@ struct _ecs {
          * active field.
          */
         volatile uint64_t active; /* active configuration instance */
+        /*
+         * Readers (the prod() threads) pick up changes at batch
+         * boundaries, in ec_checkactive(). Each change of 'active'
+         * also increments 'gen', and each reader stores in seen[]
+         * the last generation it has switched to. An instance can
+         * be rewritten only when all the readers have seen the
+         * current generation, i.e., none of them is still using
+         * the other instance (see ec_quiesce()).
+         */
+        volatile uint64_t gen;
+        uint32_t        nreaders;       /* written by the server */
+#define EC_MAXREADERS 64
+        volatile uint64_t seen[EC_MAXREADERS];
 #define EC_NINST      2
         struct _eci    instances[EC_NINST];
 };
@@ -335,7 +354,7 @@ struct _ecf {
 #define EC_NOPTS      2
 	struct stats	stats[2 * EC_NOPTS];
         uint32_t        version;
-#define EC_VERSION    1
+#define EC_VERSION    2
         struct _ecs     sets[EC_NOPTS];
 };
 #define EC_HDRSZ (offsetof(struct _ecf, sets))
@@ -365,6 +384,7 @@ struct q_pkt {
 	uint64_t	pktlen;		/* actual packet len */
 	uint64_t	pt_qout;	/* time of output from queue */
 	uint64_t	pt_tx;		/* transmit time */
+	uint64_t	buf_idx;	/* zero-copy netmap buffer, 0 if data follows */
 };
 
 
@@ -399,6 +419,15 @@ approaches a full state.
 To simulate bandwidth limitations efficiently, the producer has a second
 pointer, prod_tail_1, used to check for expired packets. This is done lazily.
 
+In zero-copy mode (-z) the packet data is not copied into the queue.
+The producer swaps the rx slot buffer with a free one taken from a pool
+of netmap extra buffers, and queues only the header with the buffer index.
+The consumer swaps the buffer into a tx slot, and returns the buffer it
+gets back to the pool. The pool is a single-producer single-consumer ring
+of buffer indices, where only the consumer moves zc_tail. Packets that
+cannot be swapped (fragments, reordered packets, pool exhausted) are
+copied as usual, so the two kinds may be mixed in the queue.
+
  */
 
 /* for packets hold for reorderind we only record their size and
@@ -432,6 +461,15 @@ struct _qs { /* shared queue */
         struct _ecs    *ec;             /* external configuration set */
         uint32_t        ec_active;      /* active instance in the set */
         size_t          ec_nta[EC_NINST]; /* allocated byes in each instance */
+        uint64_t        ec_gen;         /* generation in use */
+        uint32_t        ec_reader;      /* our slot in ec->seen[] */
+        char           *ec_data;        /* private copy of the active data */
+		/*
+		 * with multiple queues the impairments are configured
+		 * once per direction, but their run-time state must not
+		 * be shared among the producers. ec_activate() copies the
+		 * data of the active instance here.
+		 */
 	/* the queue has at least 1 empty position */
 	uint64_t	qsize;	/* queue size in bytes */
 
@@ -453,6 +491,11 @@ struct _qs { /* shared queue */
 	const char *	prod_ifname;	/* interface name */
 	struct netmap_ring *rxring;	/* source netmap ring */
 	int		burst;
+	int		zerocopy;	/* swap buffers instead of copying */
+	uint32_t	*zc_pool;	/* free extra buffers */
+	uint32_t	zc_mask;	/* pool size - 1 */
+	uint32_t	zc_head;	/* next free buffer, producer only */
+	struct netmap_slot *cur_slot;	/* rx slot of cur_pkt, if swappable */
 	uint32_t	rx_qmax;	/* stats on max queued */
 
 	uint64_t	qt_qout;	/* queue exit time for last packet */
@@ -537,6 +580,7 @@ struct _qs { /* shared queue */
 	/* shared fields */
 	volatile uint64_t tail ALIGN_CACHE ;	/* producer writes here */
 	volatile uint64_t head ALIGN_CACHE ;	/* consumer reads from here */
+	uint32_t	zc_tail ALIGN_CACHE;	/* consumer returns buffers here */
 };
 
 static int
@@ -665,6 +709,7 @@ ec_allowclients()
 }
 
 static void ec_activate(struct _qs *q); // forward
+static int ec_quiesce(struct _ecs *ec); // forward
 static int
 ec_init(struct _qs *q, struct _ecs *ec, int server)
 {
@@ -672,6 +717,8 @@ ec_init(struct _qs *q, struct _ecs *ec, int server)
     struct _eci *ci;
 
     q->ec = ec;
+    if (!server && ec_quiesce(ec))
+        return 1;
     for (i = 0; i < EC_NINST; i++)
 	q->ec_nta[i] = 0;
     q->ec_active = server ? 0 : ec_next(q->ec->active);
@@ -687,6 +734,8 @@ static void
 ec_terminate(struct _ecs *ec)
 {
     ec->active = EC_NINST;
+    __sync_synchronize();
+    ec->gen++;
 }
 
 /* allocate sz bytes in the non-active config instance */
@@ -710,7 +759,12 @@ ec_alloc(struct _qs *q, struct _ec *ec, size_t sz)
 static inline void
 ec_checkactive(struct _qs *q)
 {
-    uint64_t i = q->ec->active;
+    uint64_t g = q->ec->gen, i;
+
+    if (likely(g == q->ec_gen))
+        return;
+    __sync_synchronize();
+    i = q->ec->active;
     if (unlikely(i >= EC_NINST)) {
         /* setting ec_active to an out-of-bounds value is
          * interpreted as an exit request
@@ -719,12 +773,13 @@ ec_checkactive(struct _qs *q)
         return;
     }
     if (i != q->ec_active) {
-        asm volatile("" ::: "memory");
-        __sync_synchronize();
         ND("switching to configuration %i", i);
         q->ec_active = i;
         ec_activate(q);
     }
+    q->ec_gen = g;
+    __sync_synchronize();
+    q->ec->seen[q->ec_reader] = g; /* we no longer use the old instance */
 }
 
 static void
@@ -735,9 +790,33 @@ ec_switchactive(struct _qs *q)
         __sync_synchronize();
         ND("switching to configuration %i", q->ec_active);
         q->ec->active = q->ec_active;
+        __sync_synchronize();
+        q->ec->gen++;
     }
 }
 
+/*
+ * wait until all the readers have switched to the active instance,
+ * so that the other one can be rewritten. Returns 1 on timeout.
+ */
+static int
+ec_quiesce(struct _ecs *ec)
+{
+    uint64_t g = ec->gen;
+    uint32_t i;
+    int n;
+
+    for (n = 0; n < 10000; n++) {
+        for (i = 0; i < ec->nreaders && ec->seen[i] == g; i++)
+            ;
+        if (i == ec->nreaders)
+            return 0;
+        usleep(100);
+    }
+    ED("timeout waiting for the server to switch configuration");
+    return 1;
+}
+
 /* route-mode data structures and helper functions
  *
  * In route-mode TLEM acts as a router between the two subnets at its ends.
@@ -1135,7 +1214,9 @@ route_mode_init(const char *ifname[], const char *gateways[])
 }
 
 struct pipe_args {
-	int		zerocopy;
+	int		zerocopy;	/* extra buffers for zero-copy, 0 to copy */
+	int		nqueues;	/* number of ring pairs */
+	int		qid;		/* ring pair used by this instance */
 	int		wait_link;
 	int		route_mode;
 	int		hugepages;
@@ -1158,12 +1239,15 @@ struct pipe_args {
 
 	/* raw stats */
 	struct stats	*stats;
+	struct stats	mq_stats[2];	/* private tx/rx stats if nqueues > 1 */
 
 #ifdef WITH_MAX_LAG
 	/* max delay before the consumer starts dropping packets */
 	int64_t		max_lag;
 #endif /* WITH_MAX_LAG */
 
+	struct pacer	pacer;		/* cons() tx pacing */
+
 	struct _qs	q;
 };
 
@@ -1237,6 +1321,29 @@ pkt_at(struct _qs *q, uint64_t ofs)
     return (struct q_pkt *)(q->buf + ofs);
 }
 
+/*
+ * zero-copy buffer pool. zc_get() and zc_avail() are only called by
+ * the producer, zc_put() only by the consumer.
+ */
+static inline int
+zc_avail(struct _qs *q)
+{
+    return q->zc_head != __atomic_load_n(&q->zc_tail, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t
+zc_get(struct _qs *q)
+{
+    return q->zc_pool[q->zc_head++ & q->zc_mask];
+}
+
+static inline void
+zc_put(struct _qs *q, uint32_t idx)
+{
+    q->zc_pool[q->zc_tail & q->zc_mask] = idx;
+    __atomic_store_n(&q->zc_tail, q->zc_tail + 1, __ATOMIC_RELEASE);
+}
+
 /*
  * q_reclaim() accounts for packets whose output time has expired,
  * return 1 if any has been reclaimed.
@@ -1286,7 +1393,8 @@ no_room(struct _qs *q)
     uint64_t h = q->prod_head;	/* shorthand */
     uint64_t t = q->prod_tail;	/* shorthand */
     struct q_pkt *p = pkt_at(q, t);
-    uint64_t need = pad(q->cur_len) + sizeof(*p); /* space for a packet */
+    /* space for a packet, only the header if its buffer is swapped */
+    uint64_t need = (q->cur_slot ? 0 : pad(q->cur_len)) + sizeof(*p);
     uint64_t new_t = t + need;
 
     if (q->buflen - new_t < MAX_PKT + sizeof(*p))
@@ -1330,6 +1438,16 @@ enq(struct _qs *q)
     unsigned int len = q->cur_frags[0].len;
     int i;
 
+    if (q->cur_slot) {
+        struct netmap_slot *rs = q->cur_slot;
+
+        /* keep the buffer, give the ring a free one */
+        p->buf_idx = rs->buf_idx;
+        rs->buf_idx = zc_get(q);
+        rs->flags |= NS_BUF_CHANGED;
+        goto done;
+    }
+    p->buf_idx = 0;
     /* hopefully prefetch has been done ahead */
     nm_pkt_copy(q->cur_pkt, dst, len);
     /* copy the fragments, if any */
@@ -1339,6 +1457,7 @@ enq(struct _qs *q)
         /* we cannot use nm_pkt_copy, since dst may be unaligned */
         memcpy(dst, q->cur_frags[i].buf, len);
     }
+done:
     p->pktlen = q->cur_len;
     p->pt_qout = q->qt_qout;
     p->pt_tx = q->qt_tx - q->cur_tt;
@@ -1456,6 +1575,7 @@ scan_ring(struct _qs *q, int next /* bool */)
     } while (nfrags < MAX_FRAGS);
     q->cur_pkt = q->cur_frags[0].buf;
     q->cur_nfrags = nfrags;
+    q->cur_slot = (q->zerocopy && nfrags == 1) ? rs : NULL;
     rxr->head = rxr->cur;
     //prefetch_packet(rxr, 1); not much better than prefetching q->cur_pkt, one line
     __builtin_prefetch(q->cur_pkt);
@@ -1509,6 +1629,7 @@ reorder_release(struct _qs *q)
     q->cur_frags[0].buf = q->cur_pkt;
     q->cur_frags[0].len = q->cur_len;
     q->cur_nfrags = 1;
+    q->cur_slot = NULL; /* the data is in hold_buf */
     q->hold_head += sizeof(*h) + q->cur_len;
     if (unlikely(q->hold_head >= q->hold_buflen))
         q->hold_head = 0;
@@ -1589,6 +1710,8 @@ prod_procpkt(struct _qs *q)
         q->txstats->drop_bytes += q->cur_len;
         return;
     }
+    if (q->cur_slot && !zc_avail(q))
+        q->cur_slot = NULL; /* pool exhausted, copy */
     if (no_room(q)) {
         q->tail = q->prod_tail; /* notify */
         usleep(1); // XXX give cons a chance to run ?
@@ -1784,6 +1907,52 @@ cons_update_macs(struct pipe_args *pa, void *pkt)
     return injected;
 }
 
+/* send the staged burst at its deadline */
+static void
+cons_flush(struct pipe_args *pa)
+{
+    struct _qs *q = &pa->q;
+
+    q->cons_now = pacer_wait_burst(&pa->pacer, q->t0);
+    ioctl(pa->pb->fd, NIOCTXSYNC, 0);
+    pacer_synced(&pa->pacer, q->cons_now);
+}
+
+/*
+ * zero-copy transmission: exchange the packet buffer with the one
+ * in the first free tx slot. On success p->buf_idx holds the old
+ * tx buffer, which the caller returns to the pool.
+ * Returns 0 if there is no room in the tx rings.
+ */
+static int
+cons_swap(struct nmport_d *d, struct q_pkt *p)
+{
+    u_int c, n = d->last_tx_ring - d->first_tx_ring + 1,
+          ri = d->cur_tx_ring;
+
+    for (c = 0; c < n; c++, ri++) {
+        struct netmap_ring *ring;
+        struct netmap_slot *ts;
+        uint32_t idx;
+
+        if (ri > d->last_tx_ring)
+            ri = d->first_tx_ring;
+        ring = NETMAP_TXRING(d->nifp, ri);
+        if (nm_ring_empty(ring))
+            continue;
+        ts = &ring->slot[ring->cur];
+        idx = ts->buf_idx;
+        ts->buf_idx = p->buf_idx;
+        ts->len = p->pktlen;
+        ts->flags = NS_BUF_CHANGED;
+        p->buf_idx = idx;
+        ring->head = ring->cur = nm_ring_next(ring, ring->cur);
+        d->cur_tx_ring = ri;
+        return 1;
+    }
+    return 0;
+}
+
 /*
  * the consumer reads from the queue using head,
  * advances it every now and then.
@@ -1793,6 +1962,7 @@ cons(void *_pa)
 {
     struct pipe_args *pa = _pa;
     struct _qs *q = &pa->q;
+    struct pacer *pc = &pa->pacer;
     int pending = 0, retrying = 0;
 #if 0
     int cycles = 0;
@@ -1806,13 +1976,16 @@ cons(void *_pa)
     (void)cycles; // XXX disable warning
 #endif
 
+    pacer_init(pc, pace_tol, PACE_SPIN_NS);
     set_tns_now(&q->cons_now, q->t0);
     while (!do_abort) { /* consumer, infinite */
         uint64_t h = q->head; /* read only once */
         uint64_t t = q->tail; /* read only once */
         struct q_pkt *p = (struct q_pkt *)(q->buf + h);
         struct arp_cmd *arpc;
+        char *pkt;
         int64_t delta;
+        int sent;
 #if 0
         struct q_pkt *p = (struct q_pkt *)(q->buf + q->head);
         if (p->next < q->head) { /* wrap around prefetch */
@@ -1849,7 +2022,7 @@ cons(void *_pa)
             }
             arpq_release(pa->cons_arpq);
         }
-        if ( h == t || (delta = ts_cmp(p->pt_tx, q->cons_now) ) > 0) {
+        if (h == t || !pacer_ready(pc, p->pt_tx, q->cons_now)) {
             ND(4, "                 >>>> TXSYNC, pkt not ready yet h %ld t %ld now %ld tx %ld",
                     h, t, q->cons_now, p->pt_tx);
             q->rx_wait++;
@@ -1857,14 +2030,20 @@ cons(void *_pa)
                 /* this also sends any pending arp messages from this or
                  * previous loop iterations
                  */
-                ioctl(pa->pb->fd, NIOCTXSYNC, 0);
+                cons_flush(pa);
                 pending = 0;
+            } else if (h != t) {
+                /* spin if the packet is due soon */
+                q->cons_now = pacer_wait(pc, p->pt_tx, q->t0, 0);
+                if (ts_cmp(p->pt_tx, q->cons_now) > 0)
+                    usleep(5);
             } else {
                 usleep(5);
             }
             set_tns_now(&q->cons_now, q->t0);
             continue;
         }
+        delta = ts_cmp(p->pt_tx, q->cons_now);
 #ifdef WITH_MAX_LAG
         if (delta < -pa->max_lag) {
             q->rxstats->drop_packets++;
@@ -1874,8 +2053,9 @@ cons(void *_pa)
 #endif /* WITH_MAX_LAG */
         ND(5, "drain len %ld now %ld tx %ld h %ld t %ld next %ld",
                 p->pktlen, q->cons_now, p->pt_tx, h, t, p->next);
+        pkt = p->buf_idx ? NETMAP_BUF(q->rxring, p->buf_idx) : (char *)(p + 1);
         if (pa->route_mode && !retrying) {
-            int injected = cons_update_macs(pa, p + 1);
+            int injected = cons_update_macs(pa, pkt);
             if (unlikely(injected < 0)) {
                 /* drop this packet. Any pending arp message
                  * will be sent in the next iteration
@@ -1888,31 +2068,41 @@ cons(void *_pa)
             }
             pending += injected;
         }
-        /* XXX inefficient but simple */
-        if (nmport_inject(pa->pb, (char *)(p + 1), p->pktlen) == 0) {
+        if (p->buf_idx) {
+            sent = cons_swap(pa->pb, p);
+        } else {
+            /* XXX inefficient but simple */
+            sent = nmport_inject(pa->pb, pkt, p->pktlen) != 0;
+        }
+        if (!sent) {
             ND(5, "inject failed len %d now %ld tx %ld h %ld t %ld next %ld",
                     (int)p->pktlen, q->cons_now, p->pt_tx, h, t, p->next);
-            ioctl(pa->pb->fd, NIOCTXSYNC, 0);
+            cons_flush(pa);
             set_tns_now(&q->cons_now, q->t0);
             pending = 0;
             retrying = 1;
             continue;
         }
         retrying = 0;
+        pacer_stage(pc, p->pt_tx);
         pending++;
         if (pending > q->burst) {
-            ioctl(pa->pb->fd, NIOCTXSYNC, 0);
+            cons_flush(pa);
             pending = 0;
         }
 
         q->rxstats->packets++;
         q->rxstats->bytes += p->pktlen;
 next:
+        if (p->buf_idx)
+            zc_put(q, p->buf_idx); /* swapped out, or dropped */
         q->head = p->next;
         /* drain packets from the queue */
         // XXX barrier
     }
     D("exiting on abort");
+    if (verbose)
+        pacer_print(pc, stderr, pa->pb->hdr.nr_name);
     return NULL;
 }
 
@@ -1936,6 +2126,70 @@ static uint64_t get_bufsize(uint64_t max_bps, uint64_t max_delay, uint64_t qsize
     return need;
 }
 
+/*
+ * move the extra buffers obtained from the source port into the
+ * zero-copy pool. Returns 1 if zero-copy cannot be used.
+ */
+static int
+zc_init(struct pipe_args *a)
+{
+    struct _qs *q = &a->q;
+    struct netmap_if *nifp = a->pa->nifp;
+    uint32_t n = a->pa->reg.nr_extra_bufs, sz, idx;
+
+    if (n == 0) {
+        ED("%s: no extra buffers, zerocopy disabled", q->prod_ifname);
+        return 1;
+    }
+    for (sz = 1; sz < n; sz <<= 1)
+        ;
+    q->zc_pool = calloc(sz, sizeof(*q->zc_pool));
+    if (q->zc_pool == NULL) {
+        ED("failed to allocate the zerocopy pool");
+        return 1;
+    }
+    q->zc_mask = sz - 1;
+    q->zc_head = q->zc_tail = 0;
+    for (idx = nifp->ni_bufs_head; idx != 0;
+            idx = *(uint32_t *)NETMAP_BUF(q->rxring, idx))
+        q->zc_pool[q->zc_tail++ & q->zc_mask] = idx;
+    /* the buffers are ours now, zc_fini() will give them back */
+    nifp->ni_bufs_head = 0;
+    ED("%s: zerocopy with %u extra buffers", q->prod_ifname, q->zc_tail);
+    return 0;
+}
+
+/*
+ * called when both prod() and cons() are done: rebuild the list of
+ * extra buffers, so that netmap can free them on close, collecting
+ * the ones still in the pool and in the queue.
+ */
+static void
+zc_fini(struct pipe_args *a)
+{
+    struct _qs *q = &a->q;
+    struct netmap_if *nifp = a->pa->nifp;
+    uint64_t h;
+    uint32_t tot = 0;
+
+#define ZC_FREE(idx) do {					\
+        *(uint32_t *)NETMAP_BUF(q->rxring, idx) = nifp->ni_bufs_head;	\
+        nifp->ni_bufs_head = idx;					\
+        tot++;								\
+    } while (0)
+
+    while (q->zc_head != q->zc_tail)
+        ZC_FREE(zc_get(q));
+    for (h = q->head; h != q->tail; h = pkt_at(q, h)->next) {
+        if (pkt_at(q, h)->buf_idx)
+            ZC_FREE(pkt_at(q, h)->buf_idx);
+    }
+#undef ZC_FREE
+    ED("%s: returned %u extra buffers", q->prod_ifname, tot);
+    free(q->zc_pool);
+    q->zc_pool = NULL;
+}
+
 /*
  * main thread for each direction.
  * Allocates memory for the queues, creates the prod() thread,
@@ -1959,6 +2213,9 @@ tlem_main(void *_a)
 
     a->zerocopy = a->zerocopy && (a->pa->mem == a->pb->mem);
     ND("------- zerocopy %ssupported", a->zerocopy ? "" : "NOT ");
+    if (a->zerocopy && zc_init(a))
+        a->zerocopy = 0;
+    q->zerocopy = a->zerocopy;
 
     need = get_bufsize(q->ec->max_bps, q->ec->max_delay,
             q->qsize, sizeof(struct q_pkt));
@@ -2022,11 +2279,99 @@ retry2:
     pthread_create(&a->prod_tid, NULL, prod, (void*)a);
     /* continue as cons() */
     cons((void*)a);
+    if (q->zerocopy) {
+        pthread_join(a->prod_tid, NULL);
+        zc_fini(a);
+    }
     D("exiting on abort");
     return NULL;
 }
 
 
+/*
+ * create the per-queue instances for one direction, starting from the
+ * configuration in a. Queue k reads from rx ring k and transmits on
+ * tx ring k, and its threads run on the cores of queue 0 shifted by 4*k.
+ * The impairment configuration stays shared, but with more than one
+ * queue each of them keeps a private copy of the run-time data, and
+ * private stats that are periodically summed by mq_collect().
+ */
+static struct pipe_args *
+mq_init(struct pipe_args *a, int nqueues, int ncpus)
+{
+    struct pipe_args *mq;
+    int k, j;
+
+    if (posix_memalign((void **)&mq, MY_CACHELINE, nqueues * sizeof(*mq))) {
+        ED("failed to allocate %d queues", nqueues);
+        return NULL;
+    }
+    a->nqueues = nqueues;
+    for (k = 0; k < nqueues; k++) {
+        struct pipe_args *b = &mq[k];
+        struct _qs *q = &b->q;
+
+        *b = *a;
+        b->nqueues = nqueues;
+        b->qid = k;
+        q->ec_reader = k;
+        if (nqueues == 1)
+            break;
+        b->cons_core = a->cons_core + 4 * k;
+        b->prod_core = a->prod_core + 4 * k;
+        if (ncpus > 0) {
+            b->cons_core %= ncpus;
+            b->prod_core %= ncpus;
+        }
+        q->prod_seed[0] += k;
+        memset(b->mq_stats, 0, sizeof(b->mq_stats));
+        q->txstats = &b->mq_stats[0];
+        q->rxstats = &b->mq_stats[1];
+        q->ec_data = malloc(EC_DATASZ);
+        if (q->ec_data == NULL) {
+            ED("failed to allocate the configuration for queue %d", k);
+            return NULL;
+        }
+        ec_activate(q);
+        for (j = 0; j < I_NUM; j++)
+            q->c_imp[j].optarg = a->q.c_imp[j].optarg;
+    }
+    return mq;
+}
+
+/* update the per-direction stats in a from the queues in mq */
+static void
+mq_collect(struct pipe_args *a, struct pipe_args *mq)
+{
+    struct stats tx, rx;
+    int k;
+
+    bzero(&tx, sizeof(tx));
+    bzero(&rx, sizeof(rx));
+    for (k = 0; k < a->nqueues; k++) {
+        struct _qs *q = &mq[k].q;
+
+        if (q->rx_qmax > a->q.rx_qmax)
+            a->q.rx_qmax = q->rx_qmax;
+        if (q->prod_max_gap > a->q.prod_max_gap)
+            a->q.prod_max_gap = q->prod_max_gap;
+        q->rx_qmax = 0;
+        q->prod_max_gap = 0;
+        if (a->nqueues == 1)
+            return; /* the queue uses the shared stats directly */
+#define ST_ADD(f) do { tx.f += q->txstats->f; rx.f += q->rxstats->f; } while (0)
+        ST_ADD(packets);
+        ST_ADD(bytes);
+        ST_ADD(drop_packets);
+        ST_ADD(drop_bytes);
+        ST_ADD(reorder_packets);
+        ST_ADD(reorder_bytes);
+#undef ST_ADD
+    }
+    *a->q.txstats = tx;
+    *a->q.rxstats = rx;
+}
+
 
 static void
 sigint_h(int sig)
@@ -2043,7 +2388,8 @@ usage(void)
 {
     fprintf(stderr,
             "usage: tlem [-v] [-D delay] [-B bps] [-L loss] [-Q qsize] \n"
-            "\t[-b burst] [-w wait_time] [-G gateway] -i ifa -i ifb\n");
+            "\t[-b burst] [-T tolerance] [-w wait_time] [-G gateway] [-z nbufs]\n"
+            "\t[-m nqueues] [-s session-file] [-S control-socket] -i ifa -i ifb\n");
     exit(1);
 }
 
@@ -2263,12 +2609,210 @@ struct cfg_opt all_cfgs[] = {
     [I_REORDER]	= { 'R', reorder_cfg },
 };
 
+/*
+ * parse the options for one direction into the configuration
+ * instance being prepared (q->ec_active). arg[] is indexed by the
+ * option letter. Returns the number of errors.
+ */
+static int
+ec_parse(struct _qs *q, const char **arg)
+{
+    struct _eci *a = &q->ec->instances[q->ec_active];
+    int k, err = 0;
+
+    for (k = 0; k < I_NUM; k++) {
+        err += cmd_apply(all_cfgs[k].c, arg[all_cfgs[k].opt], q, &q->c_imp[k]);
+    }
+    if (arg['P'] != NULL) {
+        const char *p = arg['P'];
+        if (!strcmp(p, "0") || !strcmp(p, "1")) {
+            a->ec_allow_drop = atoi(p);
+            q->allow_drop = a->ec_allow_drop;
+        } else {
+            ED("-P expects either 0 or 1");
+            err++;
+        }
+    }
+    if (arg['O'] != NULL) {
+        a->ec_delay_offset = parse_time(arg['O']);
+        q->delay_offset = a->ec_delay_offset;
+    }
+    if (arg['Q'] != NULL) {
+        a->ec_qsize = parse_qsize(arg['Q']);
+        q->qsize = a->ec_qsize;
+    } else if (arg['B'] != NULL) {
+        /* we need e small finite queue for bandwidth emulation,
+         * otherwise delay is unbounded
+         */
+        ED("setting qsize to %lluB", (unsigned long long)q->c_imp[I_BW].def_qsize);
+        a->ec_qsize = q->c_imp[I_BW].def_qsize;
+        q->qsize = q->c_imp[I_BW].def_qsize;
+    } else {
+        ED("using unlimited qsize");
+        a->ec_qsize = 0;
+        q->qsize = 0; /* infinite */
+    }
+    a->ec_datalen = q->ec_nta[q->ec_active];
+    return err;
+}
+
+/*
+ * control socket. Clients connect to a unix stream socket and send
+ * one configuration per line, using the per-direction options of the
+ * command line (as for -s clients, the second occurrence of an option
+ * applies to the second direction, and options not given revert to
+ * their default). Each line is answered with "ok" or "error".
+ * The new instances are prepared here and then switched in, so the
+ * data path only sees the change at its next batch.
+ */
+static const char ctl_opts[] = "BDLRQPO";
+
+static int
+ctl_apply(struct _ecf *ecf, struct _qs *cq, char *line)
+{
+    const char *args[EC_NOPTS][256];
+    char *tok, *val, *save = NULL;
+    int i, j, err = 0;
+
+    memset(args, 0, sizeof(args));
+    for (tok = strtok_r(line, " \t\r\n", &save); tok;
+            tok = strtok_r(NULL, " \t\r\n", &save)) {
+        val = strtok_r(NULL, " \t\r\n", &save);
+        if (tok[0] != '-' || tok[1] == '\0' || tok[2] != '\0' ||
+                !strchr(ctl_opts, tok[1]) || val == NULL) {
+            ED("control: invalid option %s", tok);
+            return 1;
+        }
+        j = (unsigned char)tok[1];
+        if (args[0][j] == NULL) {
+            args[0][j] = val;
+        } else if (args[1][j] == NULL) {
+            args[1][j] = val;
+        } else {
+            ED("control: -%c too many times", tok[1]);
+            return 1;
+        }
+    }
+    for (j = 0; j < 256; j++) {
+        if (args[1][j] == NULL)
+            args[1][j] = args[0][j];
+    }
+
+    if (ecf_fd >= 0 && (lseek(ecf_fd, EC_HDRSZ, SEEK_SET) < 0 ||
+                lockf(ecf_fd, F_LOCK, 0) < 0)) {
+        ED("control: failed to lock the client area: %s", strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < EC_NOPTS && !err; i++) {
+        struct _qs *q = &cq[i];
+
+        memset(q, 0, sizeof(*q));
+        for (j = 0; j < I_NUM; j++) {
+            q->c_imp[j].optarg = "0";
+            q->c_imp[j].run = null_run_fn;
+        }
+        if (ec_init(q, &ecf->sets[i], 0))
+            err++;
+        else
+            err += ec_parse(q, args[i]);
+    }
+    if (!err) {
+        for (i = 0; i < EC_NOPTS; i++)
+            ec_switchactive(&cq[i]);
+    }
+    if (ecf_fd >= 0) {
+        lseek(ecf_fd, EC_HDRSZ, SEEK_SET);
+        lockf(ecf_fd, F_ULOCK, 0);
+    }
+    return err != 0;
+}
+
+struct ctl_args {
+    int		fd;
+    struct _ecf	*ecf;
+};
+
+static void *
+ctl_body(void *_a)
+{
+    struct ctl_args *a = _a;
+    struct _qs *cq;
+    char line[1024];
+
+    if (posix_memalign((void **)&cq, MY_CACHELINE, EC_NOPTS * sizeof(*cq))) {
+        ED("control: out of memory");
+        return NULL;
+    }
+    while (!do_abort) {
+        int fd = accept(a->fd, NULL, NULL);
+        FILE *f;
+
+        if (fd < 0) {
+            if (errno != EINTR)
+                ED("control: accept failed: %s", strerror(errno));
+            continue;
+        }
+        f = fdopen(fd, "r+");
+        if (f == NULL) {
+            close(fd);
+            continue;
+        }
+        while (!do_abort && fgets(line, sizeof(line), f)) {
+            fputs(ctl_apply(a->ecf, cq, line) ? "error\n" : "ok\n", f);
+            fflush(f);
+        }
+        fclose(f);
+    }
+    free(cq);
+    return NULL;
+}
+
+/* create the control socket and its thread */
+static int
+ctl_start(const char *path, struct _ecf *ecf)
+{
+    static struct ctl_args a;
+    struct sockaddr_un sun;
+    pthread_t tid;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        ED("control socket path too long: %s", path);
+        return 1;
+    }
+    a.ecf = ecf;
+    a.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (a.fd < 0) {
+        ED("cannot create the control socket: %s", strerror(errno));
+        return 1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    unlink(path);
+    if (bind(a.fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+            listen(a.fd, 4) < 0) {
+        ED("cannot bind the control socket %s: %s", path, strerror(errno));
+        close(a.fd);
+        return 1;
+    }
+    if (pthread_create(&tid, NULL, ctl_body, &a)) {
+        ED("cannot create the control thread");
+        close(a.fd);
+        return 1;
+    }
+    pthread_detach(tid);
+    ED("control socket on %s", path);
+    return 0;
+}
+
 int
 main(int argc, char **argv)
 {
     int ch, i, j, err=0;
 
     struct pipe_args bp[EC_NOPTS];
+    struct pipe_args *mq[EC_NOPTS];	/* one per ring pair */
+    int nqueues = 1;
     struct dir_opt dopt[] = {
         DOPT('B', DOPT_CLONE), /* bandwidth in bps */
         DOPT('D', DOPT_CLONE), /* delay in seconds (float) */
@@ -2292,6 +2836,7 @@ main(int argc, char **argv)
     int cores[4];
     int hugepages = 0;
     char *sfname = NULL; /* session file name */
+    char *ctlname = NULL; /* control socket */
     int server = 1, terminate = 0;
     struct _ecf *ecf;
     char doptstr[MAXOPTS], *strp = doptstr;
@@ -2348,10 +2893,14 @@ main(int argc, char **argv)
     // i	interface name (two mandatory)
     // v	verbose
     // b	batch size
+    // T	pacing tolerance
     // r	route mode
     // d	max consumer delay
+    // z	extra buffers for zero-copy
+    // m	number of ring pairs
+    // S	control socket
 
-    strcat(doptstr, "C:b:cvw:rHs:qa");
+    strcat(doptstr, "C:b:cvw:rHs:qaT:z:m:S:");
     while ( (ch = getopt(argc, argv, doptstr)) != -1) {
         switch (ch) {
             case '?':
@@ -2389,9 +2938,31 @@ main(int argc, char **argv)
                 bp[0].q.burst = atoi(optarg);
                 break;
 
+            case 'T':	/* pacing tolerance */
+                pace_tol = parse_time(optarg);
+                if (pace_tol == U_PARSE_ERR) {
+                    ED("invalid tolerance %s", optarg);
+                    usage();
+                }
+                break;
+
             case 'c':
                 bp[0].zerocopy = 0; /* do not zerocopy */
                 break;
+            case 'm':
+                nqueues = atoi(optarg);
+                if (nqueues < 1) {
+                    ED("invalid number of queues %s", optarg);
+                    usage();
+                }
+                break;
+            case 'z':
+                bp[0].zerocopy = atoi(optarg);
+                if (bp[0].zerocopy < 0) {
+                    ED("invalid number of buffers %s", optarg);
+                    usage();
+                }
+                break;
             case 'v':
                 verbose++;
                 break;
@@ -2415,6 +2986,9 @@ main(int argc, char **argv)
                 }
                 sfname = optarg;
                 break;
+            case 'S':
+                ctlname = optarg;
+                break;
             case 'a':
                 terminate = 1;
                 break;
@@ -2464,6 +3038,14 @@ main(int argc, char **argv)
             bp[0].wait_link = 4;
         }
 
+        if (nqueues > EC_MAXREADERS) {
+            ED("at most %d queues are supported", EC_MAXREADERS);
+            usage();
+        }
+        if (bp[0].route_mode && nqueues > 1) {
+            ED("route-mode cannot be used with multiple queues");
+            usage();
+        }
         if (bp[0].route_mode) {
 	    const char *gateways[] = { invdopt['G']->arg[0], invdopt['G']->arg[1] };
 	    route_mode_init(ifname, gateways);
@@ -2498,7 +3080,7 @@ skip_args:
     j = 0;
     for (i = 0; i < EC_NOPTS; i++) { /* once per queue */
         struct _qs *q = &bp[i].q;
-        struct _eci *a;
+        const char *args[256];
 	int k;
 
         if (ec_init(q, &ecf->sets[i], server))
@@ -2507,10 +3089,9 @@ skip_args:
             ec_terminate(&ecf->sets[i]);
             continue;
         }
-        a = &q->ec->instances[q->ec_active];
-	for (k = 0; k < I_NUM; k++) {
-	    err += cmd_apply(all_cfgs[k].c, invdopt[all_cfgs[k].opt]->arg[i], q, &q->c_imp[k]);
-	}
+        for (k = 0; k < 256; k++)
+            args[k] = invdopt[k] ? invdopt[k]->arg[i] : NULL;
+        err += ec_parse(q, args);
 #ifdef WITH_MAX_LAG
         if (invdopt['d']->arg[i] != NULL) {
             uint64_t max_lag = parse_time(invdopt[(int)'d']->arg[i]);
@@ -2521,35 +3102,6 @@ skip_args:
             }
         }
 #endif /* WITH_MAX_LAG */
-        if (invdopt['P']->arg[i] != NULL) {
-            const char *p = invdopt['P']->arg[i];
-            if (!strcmp(p, "0") || !strcmp(p, "1")) {
-                a->ec_allow_drop = atoi(p);
-                q->allow_drop = a->ec_allow_drop;
-            } else {
-                ED("-P expects either 0 or 1");
-                err++;
-            }
-        }
-        if (invdopt['O']->arg[i] != NULL) {
-            a->ec_delay_offset = parse_time(invdopt['O']->arg[i]);
-            q->delay_offset = a->ec_delay_offset;
-        }
-	if (invdopt['Q']->arg[i] != NULL) {
-            a->ec_qsize = parse_qsize(invdopt['Q']->arg[0]);
-            q->qsize = a->ec_qsize;
-	} else if (invdopt['B']->arg[i] != NULL) {
-	    /* we need e small finite queue for bandwidth emulation,
-	     * otherwise delay is unbounded
-	     */
-	    ED("setting qsize to %lluB", (unsigned long long)q->c_imp[I_BW].def_qsize);
-	    a->ec_qsize = q->c_imp[I_BW].def_qsize;
-	    q->qsize = q->c_imp[I_BW].def_qsize;
-	} else {
-	    ED("using unlimited qsize");
-	    a->ec_qsize = 0;
-	    q->qsize = 0; /* infinite */
-	}
         bp[i].q.txstats = &ecf->stats[j++];
         bp[i].q.rxstats = &ecf->stats[j++];
     }
@@ -2577,9 +3129,14 @@ skip_args:
             if (set_max(invdopt['M']->arg[i], &bp[i].q))
                 exit(1);
         }
+        /* one reader per queue in each direction */
+        for (i = 0; i < EC_NOPTS; i++)
+            ecf->sets[i].nreaders = nqueues;
         /* now the clients may send new configurations */
         if (ec_allowclients())
             exit(1);
+        if (ctlname && ctl_start(ctlname, ecf))
+            exit(1);
     } else {
         for (i = 0; i < EC_NOPTS; i++)
             ec_switchactive(&bp[i].q);
@@ -2612,7 +3169,13 @@ skip_args:
     }
 
     for (i = 0; i < 2; i++) {
-        struct pipe_args *a = &bp[i];
+        mq[i] = mq_init(&bp[i], nqueues, ncpus);
+        if (mq[i] == NULL)
+            exit(1);
+    }
+
+    for (i = 0; i < 2 * nqueues; i++) {
+        struct pipe_args *a = &mq[i % 2][i / 2];
 
         a->pa = nmport_prepare(a->q.prod_ifname);
         if (a->pa == NULL) {
@@ -2620,6 +3183,11 @@ skip_args:
             exit(1);
         }
         a->pa->reg.nr_flags |= NETMAP_NO_TX_POLL;
+        a->pa->reg.nr_extra_bufs = a->zerocopy;
+        if (nqueues > 1) {
+            a->pa->reg.nr_mode = NR_REG_ONE_NIC;
+            a->pa->reg.nr_ringid = a->qid;
+        }
         if (nmport_open_desc(a->pa) < 0) {
             D("cannot open %s", a->q.prod_ifname);
 	    exit(1);
@@ -2629,19 +3197,29 @@ skip_args:
 			    a->q.prod_ifname, a->pa->first_rx_ring);
 	}
 	a->q.rxring = NETMAP_RXRING(a->pa->nifp, a->pa->first_rx_ring);
-        a->pb = nmport_open(a->q.cons_ifname);
+        a->pb = nmport_prepare(a->q.cons_ifname);
         if (a->pb == NULL) {
             D("cannot open %s", a->q.cons_ifname);
             exit(1);
         }
+        if (nqueues > 1) {
+            a->pb->reg.nr_mode = NR_REG_ONE_NIC;
+            a->pb->reg.nr_ringid = a->qid;
+        }
+        if (nmport_open_desc(a->pb) < 0) {
+            D("cannot open %s", a->q.cons_ifname);
+            exit(1);
+        }
 
     }
     sleep(bp[0].wait_link);
 
     latency_reduction_start();
 
-    pthread_create(&bp[0].cons_tid, NULL, tlem_main, (void*)&bp[0]);
-    pthread_create(&bp[1].cons_tid, NULL, tlem_main, (void*)&bp[1]);
+    for (i = 0; i < 2 * nqueues; i++) {
+        struct pipe_args *a = &mq[i % 2][i / 2];
+        pthread_create(&a->cons_tid, NULL, tlem_main, (void*)a);
+    }
 
     signal(SIGINT, sigint_h);
     sleep(1);
@@ -2653,6 +3231,8 @@ skip_args:
         struct _qs *q0 = &bp[0].q, *q1 = &bp[1].q;
 
         sleep(1);
+        mq_collect(&bp[0], mq[0]);
+        mq_collect(&bp[1], mq[1]);
         ED("%lld -> %lld maxq %d round %lld drop %lld/%lld, %lld <- %lld maxq %d round %lld drop %lld/%lld",
                 (long long)(q0->rxstats->packets - old0rx.packets),
                 (long long)(q0->txstats->packets - old0tx.packets),
@@ -2924,6 +3504,194 @@ REORDERING emulation 	-R option_arguments
 
 #endif /* end of comment block */
 
+/*
+ * Trace-driven impairments.
+ *
+ * A trace file is a struct trace_hdr followed by th_count 32-bit
+ * values in host byte order. If th_interval is 0 there is one value
+ * per packet, otherwise each value applies to an interval of
+ * th_interval nanoseconds starting from the first packet. In both
+ * cases the trace restarts from the beginning when exhausted.
+ *
+ * The parse functions only validate the file and store its name in
+ * the configuration data, since the latter may be written by a client.
+ * The file is mapped by the first run() that needs it. Mappings are
+ * cached per process, so that switching configurations does not
+ * map the same file again.
+ */
+#define TRACE_MAGIC	"TLEMTRC1"
+#ifndef MAP_POPULATE
+#define MAP_POPULATE	0	/* prefault if available */
+#endif
+struct trace_hdr {
+	char		th_magic[8];
+	uint64_t	th_interval;	/* ns per value, 0: per packet */
+	uint64_t	th_count;	/* number of values */
+};
+
+struct trace_arg {
+	char		path[256];
+	uint64_t	interval;
+	uint64_t	count;
+	/* run-time state, only valid in the process running prod() */
+	const uint32_t	*v;		/* mapped values */
+	uint64_t	cur;		/* current value */
+	uint64_t	next;		/* end of the current interval */
+	uint64_t	val;		/* derived from v[cur], if needed */
+};
+
+/* open a trace and check its header. Returns the fd, or -1 */
+static int
+trace_open(const char *path, struct trace_hdr *h, size_t *len)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        ED("cannot open trace %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || read(fd, h, sizeof(*h)) != sizeof(*h) ||
+            memcmp(h->th_magic, TRACE_MAGIC, sizeof(h->th_magic)) != 0 ||
+            h->th_count == 0 ||
+            (uint64_t)st.st_size < sizeof(*h) + h->th_count * sizeof(uint32_t)) {
+        ED("%s is not a valid trace", path);
+        close(fd);
+        return -1;
+    }
+    *len = sizeof(*h) + h->th_count * sizeof(uint32_t);
+    return fd;
+}
+
+/*
+ * common parse function. Validates the trace and returns the largest
+ * value in *vmax, so that callers can check it against the maximum
+ * delay or bandwidth. Returns 0 on success, 1 on error, 2 if the
+ * arguments are not for a trace.
+ */
+static int
+trace_parse(struct _qs *q, struct _cfg *dst, int ac, char *av[],
+        int need_interval, uint32_t *vmax)
+{
+    struct trace_hdr h;
+    struct trace_arg *d;
+    const uint32_t *v;
+    size_t len;
+    uint64_t i;
+    char *base;
+    int fd;
+
+    if (strcmp(av[0], "trace") != 0)
+        return 2; /* not recognised */
+    if (ac != 2 || strlen(av[1]) >= sizeof(d->path))
+        return 1; /* error */
+    fd = trace_open(av[1], &h, &len);
+    if (fd < 0)
+        return 1;
+    if (need_interval && h.th_interval == 0) {
+        ED("%s: this impairment needs a per-interval trace", av[1]);
+        close(fd);
+        return 1;
+    }
+    base = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        ED("cannot map %s: %s", av[1], strerror(errno));
+        return 1;
+    }
+    v = (const uint32_t *)(base + sizeof(h));
+    for (*vmax = 0, i = 0; i < h.th_count; i++)
+        if (v[i] > *vmax)
+            *vmax = v[i];
+    munmap(base, len);
+    dst->arg = ec_alloc(q, dst->ec, sizeof(*d));
+    if (dst->arg == NULL)
+        return 1;
+    d = dst->arg;
+    memset(d, 0, sizeof(*d));
+    strcpy(d->path, av[1]);
+    d->interval = h.th_interval;
+    d->count = h.th_count;
+    ED("trace %s: %llu values, interval %lluns", d->path,
+            (unsigned long long)d->count, (unsigned long long)d->interval);
+    return 0;
+}
+
+/* map the values of a trace, or a single 0 if this is not possible */
+static void
+trace_map(struct trace_arg *d)
+{
+#define TRACE_MAPS	16
+    static struct {
+        char		path[256];
+        const uint32_t	*v;
+    } maps[TRACE_MAPS];
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static const uint32_t zero = 0;
+    struct trace_hdr h;
+    size_t len;
+    char *base;
+    int i, fd;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < TRACE_MAPS && maps[i].v; i++) {
+        if (strcmp(maps[i].path, d->path) == 0) {
+            d->v = maps[i].v;
+            goto out;
+        }
+    }
+    fd = trace_open(d->path, &h, &len);
+    base = (fd < 0 || h.th_count < d->count) ? MAP_FAILED :
+        mmap(NULL, len, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (base == MAP_FAILED) {
+        ED("trace %s not available, using 0", d->path);
+        d->v = &zero;
+        d->count = 1;
+        goto out;
+    }
+    d->v = (const uint32_t *)(base + sizeof(h));
+    if (i < TRACE_MAPS) {
+        strcpy(maps[i].path, d->path);
+        maps[i].v = d->v;
+    }
+out:
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * advance the trace for the current packet and return its value.
+ * *changed is set if a new value is used, so that callers can
+ * recompute anything derived from it.
+ */
+static inline uint32_t
+trace_next(struct _qs *q, struct trace_arg *d, int *changed)
+{
+    uint64_t n;
+
+    if (unlikely(d->v == NULL)) {
+        trace_map(d);
+        d->cur = 0;
+        d->next = q->prod_now + d->interval;
+        *changed = 1;
+        return d->v[0];
+    }
+    if (d->interval == 0) {
+        if (unlikely(++d->cur == d->count))
+            d->cur = 0;
+        *changed = 1;
+    } else if (unlikely(ts_cmp(q->prod_now, d->next) >= 0)) {
+        n = (q->prod_now - d->next) / d->interval + 1;
+        d->cur = (d->cur + n) % d->count;
+        d->next += n * d->interval;
+        *changed = 1;
+    } else {
+        *changed = 0;
+    }
+    return d->v[d->cur];
+}
+
 /*
  * Configuration options for delay
  *
@@ -3108,6 +3876,27 @@ interpacket_delay_run(struct _qs *q, struct _cfg *arg)
     return 0;
 }
 
+/* delay from a trace, values in nanoseconds */
+static int
+trace_delay_parse(struct _qs *q, struct _cfg *dst, int ac, char *av[])
+{
+    uint32_t dmax;
+    int ret = trace_parse(q, dst, ac, av, 0, &dmax);
+
+    if (ret == 0 && update_max_delay(q, dmax))
+        ret = 1;
+    return ret;
+}
+
+static int
+trace_delay_run(struct _qs *q, struct _cfg *arg)
+{
+    int changed;
+
+    q->cur_delay = trace_next(q, arg->arg, &changed);
+    return 0;
+}
+
 #define TLEM_CFG_END	NULL, NULL, 0
 
 static struct _cfg delay_cfg[] = {
@@ -3119,6 +3908,8 @@ static struct _cfg delay_cfg[] = {
 		"exp,dmin,davg # dmin <= davg", TLEM_CFG_END },
 	{ interpacket_delay_parse, interpacket_delay_run,
 	        "inter-packet,min-gap,max-gap,delay # min-gap <= max-gap", TLEM_CFG_END },
+	{ trace_delay_parse, trace_delay_run,
+		"trace,file", TLEM_CFG_END },
 	{ NULL, NULL, NULL, TLEM_CFG_END }
 };
 
@@ -3288,12 +4079,44 @@ avg_bw_run(struct _qs *q, struct _cfg *arg)
     return 0;
 }
 
+/*
+ * bandwidth from a per-interval trace, values in kbit/s, 0 is unlimited.
+ * We keep the transmission time per byte as a 16.16 fixed point value,
+ * recomputed only when the interval changes.
+ */
+static int
+trace_bw_parse(struct _qs *q, struct _cfg *dst, int ac, char *av[])
+{
+    uint32_t bwmax;
+    int ret = trace_parse(q, dst, ac, av, 1, &bwmax);
+
+    if (ret == 0 && update_max_bw(q, bwmax * 1000ULL))
+        ret = 1;
+    dst->def_qsize = 50000;
+    return ret;
+}
+
+static int
+trace_bw_run(struct _qs *q, struct _cfg *arg)
+{
+    struct trace_arg *d = arg->arg;
+    int changed;
+    uint32_t kbps = trace_next(q, d, &changed);
+
+    if (unlikely(changed))
+        d->val = kbps ? (8ULL * 1000000 << 16) / kbps : 0;
+    q->cur_tt = (q->cur_len * d->val) >> 16;
+    q->cur_drop = 0;
+    return 0;
+}
+
 static struct _cfg bw_cfg[] = {
 	{ const_bw_parse, const_bw_run,
 		"constant,bps", TLEM_CFG_END },
 	{ ether_bw_parse, ether_bw_run,
 		"ether,bps", TLEM_CFG_END },
 	{ avg_bw_parse, avg_bw_run, "avg,bps", TLEM_CFG_END },
+	{ trace_bw_parse, trace_bw_run, "trace,file", TLEM_CFG_END },
 	{ NULL, NULL, NULL, TLEM_CFG_END }
 };
 
@@ -3405,11 +4228,39 @@ const_ber_run(struct _qs *q, struct _cfg *arg)
 }
 
 
+/*
+ * loss from a trace. Per-packet values drop the packet if not 0,
+ * per-interval values are the loss probability scaled by 2^24.
+ */
+static int
+trace_loss_parse(struct _qs *q, struct _cfg *dst, int ac, char *av[])
+{
+    uint32_t pmax;
+
+    return trace_parse(q, dst, ac, av, 0, &pmax);
+}
+
+static int
+trace_loss_run(struct _qs *q, struct _cfg *arg)
+{
+    struct trace_arg *d = arg->arg;
+    int changed;
+    uint32_t x = trace_next(q, d, &changed);
+
+    if (d->interval == 0)
+        q->cur_drop = (x != 0);
+    else
+        q->cur_drop = x && my_random24(q) < x;
+    return 0;
+}
+
 static struct _cfg loss_cfg[] = {
 	{ const_plr_parse, const_plr_run,
 		"plr,prob # 0 <= prob <= 1", TLEM_CFG_END },
 	{ const_ber_parse, const_ber_run,
 		"ber,prob # 0 <= prob <= 1", TLEM_CFG_END },
+	{ trace_loss_parse, trace_loss_run,
+		"trace,file", TLEM_CFG_END },
 	{ NULL, NULL, NULL, TLEM_CFG_END }
 };
 
@@ -3483,11 +4334,16 @@ ec_activate(struct _qs *q)
 {
     int i = q->ec_active, j;
     struct _eci *a = &q->ec->instances[i];
+    char *data = a->ec_data;
 
+    if (q->ec_data) {
+        memcpy(q->ec_data, a->ec_data, a->ec_datalen);
+        data = q->ec_data;
+    }
     for (j = 0; j < I_NUM; j++) {
 	if (a->ec_imp[j].ec_valid) {
 	    q->c_imp[j] = all_cfgs[j].c[a->ec_imp[j].ec_index];
-	    q->c_imp[j].arg = &a->ec_data[a->ec_imp[j].ec_dataoff];
+	    q->c_imp[j].arg = &data[a->ec_imp[j].ec_dataoff];
 	} else {
 	    switch (j) {
 	    case I_DELAY:
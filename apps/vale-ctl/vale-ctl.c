@@ -40,6 +40,7 @@
 #include <net/if.h>	/* ifreq */
 #include <libgen.h>	/* basename */
 #include <stdlib.h>	/* atoi, free */
+#include <arpa/inet.h>	/* inet_pton */
 
 int verbose;
 
@@ -47,6 +48,9 @@ struct args {
 	const char *name;
 	const char *config;
 	const char *mem_id;
+	uint32_t hash_entries;
+	int interval;
+	int keep_warm;
 
 	uint16_t nr_reqtype;
 	uint32_t nr_mode;
@@ -61,6 +65,7 @@ dump_port_info(struct nmreq_port_info_get *v)
 	printf("tx_rings:   %"PRIu16"\n", v->nr_tx_rings);
 	printf("rx_rings    %"PRIu16"\n", v->nr_rx_rings);
 	printf("mem_id:     %"PRIu16"\n", v->nr_mem_id);
+	printf("meta_caps:  %#"PRIx32"\n", v->nr_meta_caps);
 }
 
 static void
@@ -71,6 +76,8 @@ dump_newif(struct nmreq_vale_newif *v)
 	printf("tx_rings:   %"PRIu16"\n", v->nr_tx_rings);
 	printf("rx_ring:    %"PRIu16"\n", v->nr_rx_rings);
 	printf("mem_id:     %"PRIu16"\n", v->nr_mem_id);
+	if (v->nr_flags & NR_VALE_NEWIF_KEEPWARM)
+		printf("keep_warm:  yes\n");
 }
 
 static void
@@ -80,6 +87,18 @@ dump_vale_list(struct nmreq_vale_list *v)
 	printf("port_idx:   %"PRIu16"\n", v->nr_port_idx);
 }
 
+static void
+dump_hash_info(struct nmreq_vale_hash_info *v)
+{
+	printf("entries:    %"PRIu32"\n", v->nr_entries);
+	printf("ways:       %"PRIu32"\n", v->nr_ways);
+	printf("used:       %"PRIu32"\n", v->nr_used);
+	printf("ttl:        %"PRIu32"\n", v->nr_ttl);
+	printf("hits:       %"PRIu64"\n", v->nr_hits);
+	printf("misses:     %"PRIu64"\n", v->nr_misses);
+	printf("floods:     %"PRIu64"\n", v->nr_floods);
+}
+
 
 static void
 parse_ring_config(const char* conf,
@@ -159,6 +178,212 @@ parse_poll_config(const char *conf, struct nmreq_vale_polling *v)
 	return 0;
 }
 
+/* a number with an optional k, m or g (powers of 1000) suffix */
+static int
+parse_rate(const char *s, uint64_t *v)
+{
+	char *end;
+	double d = strtod(s, &end);
+
+	switch (*end) {
+	case 'g': case 'G':
+		d *= 1000;
+		/* fall through */
+	case 'm': case 'M':
+		d *= 1000;
+		/* fall through */
+	case 'k': case 'K':
+		d *= 1000;
+		end++;
+		break;
+	}
+	if (end == s || *end != '\0' || d < 0)
+		return -1;
+	*v = (uint64_t)d;
+	return 0;
+}
+
+/* rate[,burst[,prio]], rate in bit/s and burst in bytes */
+static int
+parse_qos_config(const char *conf, struct nmreq_vale_qos *v)
+{
+	char *w, *tok;
+	uint64_t x;
+	int i, error = 0;
+
+	w = strdup(conf);
+	for (i = 0, tok = strtok(w, ","); tok && !error;
+			i++, tok = strtok(NULL, ",")) {
+		if (parse_rate(tok, &x) < 0) {
+			fprintf(stderr, "invalid number '%s' in '%s'\n", tok, conf);
+			error = -1;
+			break;
+		}
+		switch (i) {
+		case 0:
+			v->nr_rate = x;
+			break;
+		case 1:
+			v->nr_burst = x;
+			break;
+		case 2:
+			v->nr_prio = x;
+			break;
+		default:
+			fprintf(stderr, "too many numbers in '%s'\n", conf);
+			error = -1;
+			break;
+		}
+	}
+	free(w);
+	return error;
+}
+
+/* batch[,usecs] */
+static int
+parse_defer_config(const char *conf, struct nmreq_vale_defer *v)
+{
+	char *end;
+
+	v->nr_batch = strtoul(conf, &end, 0);
+	if (*end == ',')
+		v->nr_usecs = strtoul(end + 1, &end, 0);
+	if (end == conf || *end != '\0') {
+		fprintf(stderr, "invalid setting '%s'\n", conf);
+		return -1;
+	}
+	return 0;
+}
+
+/* addr[/plen], IPv4 or IPv6; without plen the prefix is a host */
+static int
+parse_prefix(const char *s, uint8_t *addr, uint8_t *plen, uint8_t *family)
+{
+	char *w = strdup(s), *slash;
+	int max, error = 0;
+
+	slash = strchr(w, '/');
+	if (slash != NULL)
+		*slash++ = '\0';
+	if (inet_pton(AF_INET, w, addr) == 1) {
+		*family = NR_VALE_L3_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, w, addr) == 1) {
+		*family = NR_VALE_L3_INET6;
+		max = 128;
+	} else {
+		fprintf(stderr, "invalid address '%s'\n", s);
+		free(w);
+		return -1;
+	}
+	*plen = max;
+	if (slash != NULL) {
+		int l = atoi(slash);
+
+		if (l < 0 || l > max) {
+			fprintf(stderr, "invalid prefix length in '%s'\n", s);
+			error = -1;
+		}
+		*plen = l;
+	}
+	free(w);
+	return error;
+}
+
+/* min[-max] */
+static int
+parse_port_range(const char *s, uint16_t *min, uint16_t *max)
+{
+	const char *dash = strchr(s, '-');
+
+	*min = atoi(s);
+	*max = dash ? atoi(dash + 1) : *min;
+	if (*max < *min) {
+		fprintf(stderr, "invalid port range '%s'\n", s);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * prio,permit|deny[,proto[,src[/plen][,dst[/plen][,dport[-dport]]]]]
+ * where an empty or '*' field matches anything, or -prio to remove
+ * the rule.
+ */
+static int
+parse_acl_config(const char *conf, struct nmreq_vale_l3_acl *v, int *del)
+{
+	char *w, *tok, *next;
+	uint8_t family;
+	int i, have_family = 0, error = 0;
+
+	*del = (conf[0] == '-');
+	if (*del) {
+		v->nr_prio = atoi(conf + 1);
+		return 0;
+	}
+	v->nr_family = NR_VALE_L3_INET;
+	w = strdup(conf);
+	for (i = 0, tok = w; tok && !error; i++, tok = next) {
+		next = strchr(tok, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		if (i > 1 && (*tok == '\0' || !strcmp(tok, "*")))
+			continue;
+		switch (i) {
+		case 0:
+			v->nr_prio = atoi(tok);
+			break;
+		case 1:
+			if (!strcmp(tok, "permit")) {
+				v->nr_action = NR_VALE_L3_PERMIT;
+			} else if (!strcmp(tok, "deny")) {
+				v->nr_action = NR_VALE_L3_DENY;
+			} else {
+				fprintf(stderr, "invalid action '%s'\n", tok);
+				error = -1;
+			}
+			break;
+		case 2:
+			if (!strcmp(tok, "tcp"))
+				v->nr_proto = 6;
+			else if (!strcmp(tok, "udp"))
+				v->nr_proto = 17;
+			else if (!strcmp(tok, "sctp"))
+				v->nr_proto = 132;
+			else
+				v->nr_proto = atoi(tok);
+			break;
+		case 3:
+		case 4:
+			error = parse_prefix(tok, i == 3 ? v->nr_src : v->nr_dst,
+				i == 3 ? &v->nr_src_plen : &v->nr_dst_plen,
+				&family);
+			if (!error && have_family && family != v->nr_family) {
+				fprintf(stderr, "mixed address families in '%s'\n", conf);
+				error = -1;
+			}
+			v->nr_family = family;
+			have_family = 1;
+			break;
+		case 5:
+			error = parse_port_range(tok, &v->nr_dport_min,
+				&v->nr_dport_max);
+			break;
+		default:
+			fprintf(stderr, "too many fields in '%s'\n", conf);
+			error = -1;
+			break;
+		}
+	}
+	if (i < 2) {
+		fprintf(stderr, "missing action in '%s'\n", conf);
+		error = -1;
+	}
+	free(w);
+	return error;
+}
+
 static int32_t
 parse_mem_id(const char *mem_id)
 {
@@ -176,6 +401,134 @@ parse_mem_id(const char *mem_id)
 	return id;
 }
 
+/* list all the ports with a few NETMAP_REQ_VALE_LIST_BULK calls */
+static int
+list_all_bulk(int fd)
+{
+	struct nmreq_vale_list_entry *e;
+	struct nmreq_vale_list_bulk req;
+	struct nmreq_header hdr;
+	uint32_t i;
+	int error = 0;
+
+	e = calloc(NR_VALE_LIST_BULK_MAX, sizeof(*e));
+	if (e == NULL)
+		return ENOMEM;
+	memset(&req, 0, sizeof(req));
+	do {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.nr_version = NETMAP_API;
+		hdr.nr_reqtype = NETMAP_REQ_VALE_LIST_BULK;
+		hdr.nr_body = (uintptr_t)&req;
+		req.nr_entries = (uintptr_t)e;
+		req.nr_num = NR_VALE_LIST_BULK_MAX;
+		if (ioctl(fd, NIOCCTRL, &hdr) < 0) {
+			error = errno;
+			break;
+		}
+		for (i = 0; i < req.nr_num; i++)
+			printf("%s bridge_idx %"PRIu16" port_idx %"PRIu32"\n",
+				e[i].nr_name, e[i].nr_bridge_idx,
+				e[i].nr_port_idx);
+	} while (req.nr_num == NR_VALE_LIST_BULK_MAX);
+	free(e);
+	return error;
+}
+
+/*
+ * write the learning table of a switch to stdout, one
+ * "mac port age" line per entry, in the format read by hash_load()
+ */
+static int
+hash_save(int fd, struct nmreq_header *hdr)
+{
+	struct nmreq_vale_hash_entry *e;
+	struct nmreq_vale_hash_entries req;
+	uint32_t i;
+	int error = 0;
+
+	e = calloc(NR_VALE_HASH_ENTRIES_MAX, sizeof(*e));
+	if (e == NULL)
+		return 1;
+	memset(&req, 0, sizeof(req));
+	hdr->nr_body = (uintptr_t)&req;
+	do {
+		req.nr_entries = (uintptr_t)e;
+		req.nr_num = NR_VALE_HASH_ENTRIES_MAX;
+		if (ioctl(fd, NIOCCTRL, hdr) < 0) {
+			fprintf(stderr, "failed to save the learning table of %s: %s\n",
+				hdr->nr_name, strerror(errno));
+			error = 1;
+			break;
+		}
+		for (i = 0; i < req.nr_num; i++) {
+			uint8_t *m = e[i].nr_mac;
+
+			printf("%02x:%02x:%02x:%02x:%02x:%02x %s %"PRIu16"\n",
+				m[0], m[1], m[2], m[3], m[4], m[5],
+				e[i].nr_port, e[i].nr_age);
+		}
+	} while (req.nr_num == NR_VALE_HASH_ENTRIES_MAX);
+	free(e);
+	return error;
+}
+
+/* learn the entries written by hash_save(), read from stdin */
+static int
+hash_load(int fd, struct nmreq_header *hdr)
+{
+	struct nmreq_vale_hash_entry *e;
+	struct nmreq_vale_hash_entries req;
+	char line[256], port[NETMAP_REQ_IFNAMSIZ];
+	unsigned int m[6], age;
+	uint32_t n = 0, learned = 0, lineno = 0;
+	int i, eof = 0, error = 0;
+
+	e = calloc(NR_VALE_HASH_ENTRIES_MAX, sizeof(*e));
+	if (e == NULL)
+		return 1;
+	memset(&req, 0, sizeof(req));
+	hdr->nr_body = (uintptr_t)&req;
+	while (!eof) {
+		if (fgets(line, sizeof(line), stdin) == NULL) {
+			eof = 1;
+		} else {
+			lineno++;
+			if (sscanf(line, "%x:%x:%x:%x:%x:%x %63s %u", &m[0], &m[1],
+			    &m[2], &m[3], &m[4], &m[5], port, &age) != 8 ||
+			    age > 0xffff) {
+				fprintf(stderr, "line %"PRIu32": invalid entry\n",
+					lineno);
+				error = 1;
+				break;
+			}
+			memset(&e[n], 0, sizeof(e[n]));
+			for (i = 0; i < 6; i++)
+				e[n].nr_mac[i] = m[i];
+			memcpy(e[n].nr_port, port, sizeof(port));
+			e[n].nr_age = age;
+			n++;
+		}
+		if (n == 0 || (!eof && n < NR_VALE_HASH_ENTRIES_MAX))
+			continue;
+		req.nr_entries = (uintptr_t)e;
+		req.nr_num = n;
+		if (ioctl(fd, NIOCCTRL, hdr) < 0) {
+			fprintf(stderr, "failed to restore the learning table of %s: %s\n",
+				hdr->nr_name, strerror(errno));
+			error = 1;
+			break;
+		}
+		learned += req.nr_num;
+		n = 0;
+	}
+	if (verbose && !error)
+		printf("learned:    %"PRIu32" of %"PRIu32" entries\n", learned,
+			lineno);
+	free(e);
+	return error;
+}
+
 static int
 list_all(int fd, struct nmreq_header *hdr)
 {
@@ -183,6 +536,14 @@ list_all(int fd, struct nmreq_header *hdr)
 	struct nmreq_vale_list *vale_list =
 		(struct nmreq_vale_list *)(uintptr_t)hdr->nr_body;
 
+	error = list_all_bulk(fd);
+	if (error == 0)
+		return 1;
+	if (error != EINVAL) {
+		fprintf(stderr, "failed to list all: %s\n", strerror(error));
+		return 1;
+	}
+	/* older kernel, one port per call */
 	for (;;) {
 		hdr->nr_name[0] = '\0';
 		error = ioctl(fd, NIOCCTRL, hdr);
@@ -200,6 +561,193 @@ list_all(int fd, struct nmreq_header *hdr)
 	return 1;
 }
 
+/* print the counters of each ring of a port */
+static int
+ring_stats(int fd, struct nmreq_header *hdr)
+{
+	struct nmreq_port_info_get info;
+	struct nmreq_ring_stats rs;
+	uint16_t nrings[2], nhost[2];
+	int t, i, b;
+
+	memset(&info, 0, sizeof(info));
+	hdr->nr_reqtype = NETMAP_REQ_PORT_INFO_GET;
+	hdr->nr_body = (uintptr_t)&info;
+	if (ioctl(fd, NIOCCTRL, hdr) < 0) {
+		fprintf(stderr, "failed to obtain info for %s: %s\n",
+				hdr->nr_name, strerror(errno));
+		return 1;
+	}
+	nrings[0] = info.nr_rx_rings;
+	nrings[1] = info.nr_tx_rings;
+	nhost[0] = info.nr_host_rx_rings;
+	nhost[1] = info.nr_host_tx_rings;
+
+	printf("%-8s %14s %14s %18s %12s %12s %12s %8s\n", "ring", "syncs",
+		"slots", "bytes", "drops", "notifies", "busy", "batch");
+	for (t = 1; t >= 0; t--) {
+		for (i = 0; i < nrings[t] + nhost[t]; i++) {
+			char name[16];
+
+			memset(&rs, 0, sizeof(rs));
+			rs.nr_ring_id = i;
+			rs.nr_tx = t;
+			hdr->nr_reqtype = NETMAP_REQ_RING_STATS_GET;
+			hdr->nr_body = (uintptr_t)&rs;
+			if (ioctl(fd, NIOCCTRL, hdr) < 0) {
+				if (errno == EINVAL && i >= nrings[t])
+					break; /* no host rings */
+				fprintf(stderr, "failed to obtain ring counters for %s: %s\n",
+						hdr->nr_name, strerror(errno));
+				return 1;
+			}
+			if (i < nrings[t])
+				snprintf(name, sizeof(name), "%s%d",
+					t ? "tx" : "rx", i);
+			else
+				snprintf(name, sizeof(name), "host-%s%d",
+					t ? "tx" : "rx", i - nrings[t]);
+			printf("%-8s %14"PRIu64" %14"PRIu64" %18"PRIu64
+				" %12"PRIu64" %12"PRIu64" %12"PRIu64" %8.1f\n",
+				name, rs.nr_syncs, rs.nr_slots, rs.nr_bytes,
+				rs.nr_drops, rs.nr_notifies, rs.nr_busy,
+				rs.nr_syncs ? (double)rs.nr_slots / rs.nr_syncs : 0.0);
+			/* only with CONFIG_NETMAP_TRACE and trace_sample > 0 */
+			for (b = 0; b < NR_RING_LAT_BUCKETS; b++) {
+				if (rs.nr_lat[b] == 0)
+					continue;
+				printf("         latency %s %10lluns: %"PRIu64"\n",
+					b < NR_RING_LAT_BUCKETS - 1 ? "< " : ">=",
+					1024ULL << (b < NR_RING_LAT_BUCKETS - 1 ?
+						b : b - 1), rs.nr_lat[b]);
+			}
+		}
+	}
+	return 0;
+}
+
+/* collect the counters of all the ports of a switch, *n of them,
+ * into a vector that the caller must free */
+static struct nmreq_vale_port_stats *
+vale_stats_get(int fd, struct nmreq_header *hdr, const char *name, int *n)
+{
+	struct nmreq_vale_port_stats *v = NULL, *nv;
+	int size = 0;
+	uint32_t idx = 0;
+
+	for (*n = 0;; (*n)++) {
+		if (*n == size) {
+			size = size ? 2 * size : 16;
+			nv = realloc(v, size * sizeof(*v));
+			if (nv == NULL) {
+				fprintf(stderr, "out of memory\n");
+				free(v);
+				return NULL;
+			}
+			v = nv;
+		}
+		memset(&v[*n], 0, sizeof(v[*n]));
+		v[*n].nr_port_idx = idx;
+		snprintf(hdr->nr_name, sizeof(hdr->nr_name), "%s", name);
+		hdr->nr_reqtype = NETMAP_REQ_VALE_PORT_STATS_GET;
+		hdr->nr_body = (uintptr_t)&v[*n];
+		if (ioctl(fd, NIOCCTRL, hdr) < 0) {
+			if (errno == ENOENT && idx > 0)
+				break;
+			fprintf(stderr, "failed to obtain port counters for %s: %s\n",
+					name, strerror(errno));
+			free(v);
+			return NULL;
+		}
+		idx = v[*n].nr_port_idx + 1;
+	}
+	return v;
+}
+
+/* the sample of the same port in the previous round, if any */
+static const struct nmreq_vale_port_stats *
+vale_stats_find(const struct nmreq_vale_port_stats *v, int n,
+		const struct nmreq_vale_port_stats *s)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (v[i].nr_port_idx == s->nr_port_idx &&
+		    !strcmp(v[i].nr_port_name, s->nr_port_name))
+			return &v[i];
+	return NULL;
+}
+
+/*
+ * print the forwarding counters of each port of a switch. With an
+ * interval, print the rates over each interval until interrupted.
+ */
+static int
+vale_stats(int fd, struct nmreq_header *hdr, int interval)
+{
+	struct nmreq_vale_port_stats *cur, *prev = NULL;
+	char name[NETMAP_REQ_IFNAMSIZ];
+	int ncur, nprev = 0, i;
+
+	memcpy(name, hdr->nr_name, sizeof(name));
+	for (;;) {
+		cur = vale_stats_get(fd, hdr, name, &ncur);
+		if (cur == NULL) {
+			free(prev);
+			return 1;
+		}
+		if (interval == 0) {
+			printf("%-4s %-20s %14s %18s %14s %18s %12s %12s %12s %10s\n",
+				"port", "name", "tx_pkts", "tx_bytes", "rx_pkts",
+				"rx_bytes", "rx_drops", "floods", "limited",
+				"ns/pkt");
+			for (i = 0; i < ncur; i++) {
+				struct nmreq_vale_port_stats *s = &cur[i];
+
+				printf("%-4"PRIu32" %-20s %14"PRIu64" %18"PRIu64
+					" %14"PRIu64" %18"PRIu64" %12"PRIu64
+					" %12"PRIu64" %12"PRIu64" %10.1f\n",
+					s->nr_port_idx, s->nr_port_name,
+					s->nr_tx_pkts, s->nr_tx_bytes,
+					s->nr_rx_pkts, s->nr_rx_bytes,
+					s->nr_rx_drops, s->nr_floods,
+					s->nr_tx_limited,
+					s->nr_tx_pkts ? (double)s->nr_lookup_ns /
+						s->nr_tx_pkts : 0.0);
+			}
+			free(cur);
+			return 0;
+		}
+		if (prev != NULL) {
+			printf("%-4s %-20s %12s %12s %12s %12s %12s %12s\n",
+				"port", "name", "tx_pps", "tx_Mbps", "rx_pps",
+				"rx_Mbps", "drops/s", "floods/s");
+			for (i = 0; i < ncur; i++) {
+				struct nmreq_vale_port_stats *s = &cur[i];
+				const struct nmreq_vale_port_stats *p =
+					vale_stats_find(prev, nprev, s);
+
+				if (p == NULL)
+					continue; /* new port */
+#define RATE(f)	((double)(s->f - p->f) / interval)
+				printf("%-4"PRIu32" %-20s %12.0f %12.2f %12.0f"
+					" %12.2f %12.0f %12.0f\n",
+					s->nr_port_idx, s->nr_port_name,
+					RATE(nr_tx_pkts), RATE(nr_tx_bytes) * 8e-6,
+					RATE(nr_rx_pkts), RATE(nr_rx_bytes) * 8e-6,
+					RATE(nr_rx_drops), RATE(nr_floods));
+#undef RATE
+			}
+			printf("\n");
+			fflush(stdout);
+		}
+		free(prev);
+		prev = cur;
+		nprev = ncur;
+		sleep(interval);
+	}
+}
+
 static int
 bdg_ctl(struct args *a)
 {
@@ -210,6 +758,13 @@ bdg_ctl(struct args *a)
 	struct nmreq_vale_list     vale_list;
 	struct nmreq_vale_polling  vale_polling;
 	struct nmreq_port_info_get port_info_get;
+	struct nmreq_vale_hash_info vale_hash_info;
+	struct nmreq_vale_qos vale_qos;
+	struct nmreq_vale_defer vale_defer;
+	struct nmreq_vale_l3_route vale_route;
+	struct nmreq_vale_l3_acl vale_acl;
+	struct nmreq_opt_vale_hash opt_hash;
+	int del;
 	int error = 0;
 	int fd;
 	int32_t mem_id;
@@ -247,6 +802,8 @@ bdg_ctl(struct args *a)
 		if (mem_id < 0)
 			return 1;
 		vale_newif.nr_mem_id = mem_id;
+		if (a->keep_warm)
+			vale_newif.nr_flags |= NR_VALE_NEWIF_KEEPWARM;
 		action = "create";
 		break;
 
@@ -263,6 +820,13 @@ bdg_ctl(struct args *a)
 		if (mem_id < 0)
 			return 1;
 		vale_attach.reg.nr_mem_id = mem_id;
+		if (a->hash_entries) {
+			/* only used if the switch does not exist yet */
+			memset(&opt_hash, 0, sizeof(opt_hash));
+			opt_hash.nro_opt.nro_reqtype = NETMAP_REQ_OPT_VALE_HASH;
+			opt_hash.nro_entries = a->hash_entries;
+			hdr.nr_options = (uintptr_t)&opt_hash;
+		}
 		action = "attach";
 		break;
 
@@ -297,6 +861,86 @@ bdg_ctl(struct args *a)
 		hdr.nr_body = (uintptr_t)&port_info_get;
 		action = "obtain info for";
 		break;
+
+	case NETMAP_REQ_VALE_HASH_INFO_GET:
+		memset(&vale_hash_info, 0, sizeof(vale_hash_info));
+		hdr.nr_body = (uintptr_t)&vale_hash_info;
+		action = "obtain learning table info for";
+		break;
+
+	case NETMAP_REQ_RING_STATS_GET:
+		error = ring_stats(fd, &hdr);
+		close(fd);
+		return error;
+
+	case NETMAP_REQ_VALE_PORT_STATS_GET:
+		error = vale_stats(fd, &hdr, a->interval);
+		close(fd);
+		return error;
+
+	case NETMAP_REQ_VALE_HASH_GET:
+		error = hash_save(fd, &hdr);
+		close(fd);
+		return error;
+
+	case NETMAP_REQ_VALE_HASH_SET:
+		error = hash_load(fd, &hdr);
+		close(fd);
+		return error;
+
+	case NETMAP_REQ_VALE_QOS_GET:
+		memset(&vale_qos, 0, sizeof(vale_qos));
+		hdr.nr_body = (uintptr_t)&vale_qos;
+		action = "obtain the rate limit of";
+		if (a->config != NULL) {
+			if (parse_qos_config(a->config, &vale_qos) < 0)
+				return 1;
+			hdr.nr_reqtype = NETMAP_REQ_VALE_QOS_SET;
+			action = "set the rate limit of";
+		}
+		break;
+
+	case NETMAP_REQ_VALE_DEFER_GET:
+		memset(&vale_defer, 0, sizeof(vale_defer));
+		hdr.nr_body = (uintptr_t)&vale_defer;
+		action = "obtain the deferred forwarding of";
+		if (a->config != NULL) {
+			if (parse_defer_config(a->config, &vale_defer) < 0)
+				return 1;
+			hdr.nr_reqtype = NETMAP_REQ_VALE_DEFER_SET;
+			action = "set the deferred forwarding of";
+		}
+		break;
+
+	case NETMAP_REQ_VALE_L3_ROUTE_ADD:
+		memset(&vale_route, 0, sizeof(vale_route));
+		hdr.nr_body = (uintptr_t)&vale_route;
+		if (a->config == NULL) {
+			fprintf(stderr, "-L needs a prefix given with -C\n");
+			return 1;
+		}
+		del = (a->config[0] == '-');
+		if (parse_prefix(a->config + del, vale_route.nr_addr,
+				&vale_route.nr_plen, &vale_route.nr_family) < 0)
+			return 1;
+		if (del)
+			hdr.nr_reqtype = NETMAP_REQ_VALE_L3_ROUTE_DEL;
+		action = del ? "remove a route from" : "add a route to";
+		break;
+
+	case NETMAP_REQ_VALE_L3_ACL_ADD:
+		memset(&vale_acl, 0, sizeof(vale_acl));
+		hdr.nr_body = (uintptr_t)&vale_acl;
+		if (a->config == NULL) {
+			fprintf(stderr, "-F needs a rule given with -C\n");
+			return 1;
+		}
+		if (parse_acl_config(a->config, &vale_acl, &del) < 0)
+			return 1;
+		if (del)
+			hdr.nr_reqtype = NETMAP_REQ_VALE_L3_ACL_DEL;
+		action = del ? "remove a rule from" : "add a rule to";
+		break;
 	}
 	error = ioctl(fd, NIOCCTRL, &hdr);
 	if (error < 0) {
@@ -314,6 +958,8 @@ bdg_ctl(struct args *a)
 	case NETMAP_REQ_VALE_ATTACH:
 		if (verbose) {
 			printf("port_index: %"PRIu32"\n", vale_attach.port_index);
+			if (a->hash_entries && opt_hash.nro_opt.nro_status == 0)
+				printf("hash_size:  %"PRIu32"\n", opt_hash.nro_entries);
 		}
 		break;
 
@@ -330,6 +976,34 @@ bdg_ctl(struct args *a)
 	case NETMAP_REQ_PORT_INFO_GET:
 		dump_port_info(&port_info_get);
 		break;
+
+	case NETMAP_REQ_VALE_HASH_INFO_GET:
+		dump_hash_info(&vale_hash_info);
+		break;
+
+	case NETMAP_REQ_VALE_QOS_SET:
+		if (!verbose)
+			break;
+		/* fall through */
+	case NETMAP_REQ_VALE_QOS_GET:
+		printf("rate:       %"PRIu64" bit/s%s\n", vale_qos.nr_rate,
+			vale_qos.nr_rate ? "" : " (no limit)");
+		printf("burst:      %"PRIu32" bytes\n", vale_qos.nr_burst);
+		printf("prio:       %"PRIu16"\n", vale_qos.nr_prio);
+		break;
+
+	case NETMAP_REQ_VALE_DEFER_SET:
+		if (!verbose)
+			break;
+		/* fall through */
+	case NETMAP_REQ_VALE_DEFER_GET:
+		if (vale_defer.nr_batch == 0) {
+			printf("batch:      0 (forward at each sync)\n");
+			break;
+		}
+		printf("batch:      %"PRIu32" slots\n", vale_defer.nr_batch);
+		printf("deadline:   %"PRIu32" us\n", vale_defer.nr_usecs);
+		break;
 	}
 	close(fd);
 	return error;
@@ -348,6 +1022,22 @@ usage(int errcode)
 	    "\t-n interface	interface name to be created\n"
 	    "\t-r interface	interface name to be deleted\n"
 	    "\t-l vale-port	show bridge and port indices\n"
+	    "\t-H valeSSS:	show the learning table of a switch\n"
+	    "\t-x valeSSS:	save the learning table of a switch to stdout\n"
+	    "\t-X valeSSS:	restore a saved learning table from stdin\n"
+	    "\t-R interface	show the counters of the rings of a port\n"
+	    "\t-s valeSSS:	show the forwarding counters of the ports of a switch\n"
+	    "\t-i seconds	with -s, show the rates every few seconds\n"
+	    "\t-Q vale-port	show the rate limit and priority of a port, or set\n"
+	    "\t\t them with -C rate[,burst[,prio]] (bit/s, bytes, 0 is highest)\n"
+	    "\t-B vale-port	show the deferred forwarding of a port, or set it\n"
+	    "\t\t with -C batch[,usecs] (slots, deadline; batch 0 disables)\n"
+	    "\t-L vale-port	add a route to a port, given with -C addr/plen,\n"
+	    "\t\t or remove it with -C -addr/plen\n"
+	    "\t-F valeSSS:[PPP] add an ACL rule to a switch, for the frames of a\n"
+	    "\t\t port, given with -C prio,permit|deny[,proto[,src[,dst[,dport]]]],\n"
+	    "\t\t or remove it with -C -prio\n"
+	    "\t-t entries	learning table size of a switch created by -a or -h\n"
 	    "\t-C string ring/slot setting of an interface creating by -n\n"
 	    "\t-p interface start polling. Additional -C x,y,z configures\n"
 	    "\t\t x: 0 (REG_ALL_NIC) or 1 (REG_ONE_NIC),\n"
@@ -355,6 +1045,8 @@ usage(int errcode)
 	    "\t\t z: (ONE_NIC only) num of total cores/rings\n"
 	    "\t-P interface stop polling\n"
 	    "\t-m memid to use when creating a new interface\n"
+	    "\t-w keep the rings of an interface created by -n registered,\n"
+	    "\t\t so that they survive the processes using it\n"
 	    "\t-v increase verbosity\n"
 	    "with no arguments: list all existing vale ports\n");
 	exit(errcode);
@@ -368,11 +1060,13 @@ main(int argc, char *argv[])
 		.name = NULL,
 		.config = NULL,
 		.mem_id = NULL,
+		.hash_entries = 0,
+		.interval = 0,
 		.nr_reqtype = 0,
 		.nr_mode = NR_REG_ALL_NIC,
 	};
 
-	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:m:v")) != -1) {
+	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:m:H:x:X:R:s:i:Q:B:L:F:t:wv")) != -1) {
 		switch (ch) {
 		default:
 			fprintf(stderr, "bad option %c %s", ch, optarg);
@@ -426,6 +1120,69 @@ main(int argc, char *argv[])
 		case 'm':
 			a.mem_id = optarg;
 			break;
+		case 'H':
+			a.nr_reqtype = NETMAP_REQ_VALE_HASH_INFO_GET;
+			a.name = optarg;
+			if (strncmp(a.name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+				fprintf(stderr, "invalid vale switch name: '%s'\n", a.name);
+				usage(1);
+			}
+			break;
+		case 'x':
+		case 'X':
+			a.nr_reqtype = ch == 'x' ? NETMAP_REQ_VALE_HASH_GET :
+				NETMAP_REQ_VALE_HASH_SET;
+			a.name = optarg;
+			if (strncmp(a.name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+				fprintf(stderr, "invalid vale switch name: '%s'\n", a.name);
+				usage(1);
+			}
+			break;
+		case 'R':
+			a.nr_reqtype = NETMAP_REQ_RING_STATS_GET;
+			a.name = optarg;
+			break;
+		case 's':
+			a.nr_reqtype = NETMAP_REQ_VALE_PORT_STATS_GET;
+			a.name = optarg;
+			if (strncmp(a.name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+				fprintf(stderr, "invalid vale switch name: '%s'\n", a.name);
+				usage(1);
+			}
+			break;
+		case 'Q':
+		case 'B':
+			a.nr_reqtype = ch == 'Q' ? NETMAP_REQ_VALE_QOS_GET :
+				NETMAP_REQ_VALE_DEFER_GET;
+			a.name = optarg;
+			if (strncmp(a.name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+				fprintf(stderr, "invalid vale port name: '%s'\n", a.name);
+				usage(1);
+			}
+			break;
+		case 'L':
+		case 'F':
+			a.nr_reqtype = ch == 'L' ? NETMAP_REQ_VALE_L3_ROUTE_ADD :
+				NETMAP_REQ_VALE_L3_ACL_ADD;
+			a.name = optarg;
+			if (strncmp(a.name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+				fprintf(stderr, "invalid vale name: '%s'\n", a.name);
+				usage(1);
+			}
+			break;
+		case 'i':
+			a.interval = atoi(optarg);
+			if (a.interval < 0) {
+				fprintf(stderr, "invalid interval: '%s'\n", optarg);
+				usage(1);
+			}
+			break;
+		case 't':
+			a.hash_entries = atoi(optarg);
+			break;
+		case 'w':
+			a.keep_warm = 1;
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -53,7 +53,8 @@ typedef struct {
 void NetmapMemory_dealloc(NetmapMemory *memory);
 void NetmapMemory_new(NetmapMemory *memory);
 int NetmapMemory_setup(NetmapMemory *memory, struct netmap_if *nifp,
-                        int num_tx_rings, int num_rx_rings);
+                        int num_tx_rings, int num_rx_rings,
+                        void *mem, size_t memsize);
 void NetmapMemory_destroy(NetmapMemory *memory);
 
 /*
@@ -115,11 +116,12 @@ typedef struct {
     PyObject *slots;
 
     struct netmap_ring *_ring;            /* Address of struct netmap_ring. */
+    char *_mem_end;                 /* End of the netmap memory area. */
 } NetmapRing;
 
 extern PyTypeObject NetmapRingType;
 
-int NetmapRing_build(NetmapRing *self, void *addr);
+int NetmapRing_build(NetmapRing *self, void *addr, void *mem_end);
 void NetmapRing_destroy(NetmapRing *self);
 
 
@@ -130,11 +132,13 @@ typedef struct {
 
     Py_buffer _view;
     struct netmap_slot *_slot;            /* Address of struct netmap_slot. */
+    struct netmap_ring *_ring;            /* The ring containing the slot. */
 } NetmapSlot;
 
 extern PyTypeObject NetmapSlotType;
 
-int NetmapSlot_build(NetmapSlot *slot, void *addr, void *buf);
+int NetmapSlot_build(NetmapSlot *slot, struct netmap_ring *ring, void *addr,
+                        void *buf);
 void NetmapSlot_destroy(NetmapSlot *slot);
 
 #endif  /* NETMAP_PYTHON_CLASSES_H */
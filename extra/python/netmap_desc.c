@@ -92,7 +92,8 @@ NetmapDesc_init(NetmapDesc *self, PyObject *args, PyObject *kwds)
        the host rings. */
     ret = NetmapMemory_setup(&self->memory, self->nmd->nifp,
                                 self->nmd->req.nr_tx_rings + 1,
-                                    self->nmd->req.nr_rx_rings + 1);
+                                    self->nmd->req.nr_rx_rings + 1,
+                                self->nmd->mem, self->nmd->memsize);
 
     return ret;
 }
@@ -422,7 +422,8 @@ NetmapManager_register(NetmapManager *self)
        The +1 are here to take into account the host rings. */
     ret = NetmapMemory_setup(&self->memory, NETMAP_IF(self->_memaddr,
                         self->nmreq.nr_offset), self->nmreq.nr_tx_rings + 1,
-                        self->nmreq.nr_rx_rings + 1);
+                        self->nmreq.nr_rx_rings + 1,
+                        self->_memaddr, self->nmreq.nr_memsize);
     if (ret) {
         return NULL;
     }
@@ -48,7 +48,8 @@ NetmapMemory_new(NetmapMemory *memory)
 
 int
 NetmapMemory_setup(NetmapMemory *memory, struct netmap_if *nifp,
-                        int num_tx_rings, int num_rx_rings)
+                        int num_tx_rings, int num_rx_rings,
+                        void *mem, size_t memsize)
 {
     NetmapInterface *interface;
     NetmapRing *ring;
@@ -77,7 +78,8 @@ NetmapMemory_setup(NetmapMemory *memory, struct netmap_if *nifp,
         if (!ring) {
             return -1;
         }
-        ret = NetmapRing_build(ring, NETMAP_TXRING(nifp, i));
+        ret = NetmapRing_build(ring, NETMAP_TXRING(nifp, i),
+                                (char *)mem + memsize);
         if (ret) {
             return -1;
         }
@@ -99,7 +101,8 @@ NetmapMemory_setup(NetmapMemory *memory, struct netmap_if *nifp,
         if (!ring) {
             return -1;
         }
-        ret = NetmapRing_build(ring, NETMAP_RXRING(nifp, i));
+        ret = NetmapRing_build(ring, NETMAP_RXRING(nifp, i),
+                                (char *)mem + memsize);
         if (ret) {
             return -1;
         }
@@ -47,6 +47,7 @@ NetmapRing_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     self = (NetmapRing *)type->tp_alloc(type, 0);
     if (self != NULL) {
         self->_ring = NULL;
+        self->_mem_end = NULL;
         self->slots = NULL;
     }
 
@@ -103,7 +104,7 @@ NetmapRing_repr(NetmapRing *self)
 }
 
 int
-NetmapRing_build(NetmapRing *self, void *addr)
+NetmapRing_build(NetmapRing *self, void *addr, void *mem_end)
 {
     NetmapSlot *slot;
     PyObject *list;
@@ -119,6 +120,7 @@ NetmapRing_build(NetmapRing *self, void *addr)
 
     /* Init the pointer to the netmap_ring struct. */
     self->_ring = addr;
+    self->_mem_end = mem_end;
     n = self->_ring->num_slots;
 
     /* Create and populate the list of netmap slots. */
@@ -134,7 +136,7 @@ NetmapRing_build(NetmapRing *self, void *addr)
         if (!slot) {
             return -1;
         }
-        ret = NetmapSlot_build(slot, &self->_ring->slot[i],
+        ret = NetmapSlot_build(slot, self->_ring, &self->_ring->slot[i],
                                 NETMAP_BUF(self->_ring,
                                 self->_ring->slot[i].buf_idx));
         if (ret == -1) {
@@ -154,6 +156,7 @@ void
 NetmapRing_destroy(NetmapRing *self)
 {
     self->_ring = NULL;
+    self->_mem_end = NULL;
 
     if (self->slots) {
         NetmapSlot *slot;
@@ -202,6 +205,36 @@ NetmapRing_slots_set(NetmapRing *self, PyObject *value, void *closure)
     return -1;
 }
 
+/* Return a memoryview of 'len' bytes at 'addr', which keeps the ring
+   object alive until it is released. */
+static PyObject *
+NetmapRing_view(NetmapRing *self, void *addr, Py_ssize_t len)
+{
+    Py_buffer view;
+
+    if (PyBuffer_FillInfo(&view, (PyObject *)self, addr, len, 0,
+                            PyBUF_FULL)) {
+        return NULL;
+    }
+
+    return PyMemoryView_FromBuffer(&view);
+}
+
+static PyObject *
+NetmapRing_buffers_get(NetmapRing *self, void *closure)
+{
+    char *base;
+
+    if (!self->_ring || !self->_mem_end) {
+        Py_RETURN_NONE;
+    }
+    base = NETMAP_BUF(self->_ring, 0);
+
+    return NetmapRing_view(self, base, (self->_mem_end - base) /
+                            self->_ring->nr_buf_size *
+                            self->_ring->nr_buf_size);
+}
+
 #define DEFINE_NETMAP_RING_GETSET(field, type, format)                      \
 static PyObject *                                                           \
 NetmapRing_##field##_get(NetmapRing *self, void *closure)                   \
@@ -288,6 +321,10 @@ static PyGetSetDef NetmapRing_getseters[] = {
         (getter)NetmapRing_slots_get, (setter)NetmapRing_slots_set,
         "netmap ring slots",
         NULL},
+    {"buffers",
+        (getter)NetmapRing_buffers_get, (setter)NetmapRing_slots_set,
+        "memoryview of all the netmap buffers, starting from index 0",
+        NULL},
     {NULL}  /* Sentinel */
 };
 
@@ -308,6 +345,59 @@ NetmapRing_empty(NetmapRing *self)
     Py_RETURN_FALSE;
 }
 
+/* Return a memoryview of the slots from cur to tail (at most 'limit'
+   of them, if not 0), without copying. The view stops at the end of
+   the ring, so call again after release() to get the slots that wrap
+   around. Each slot is a struct netmap_slot, i.e. buf_idx (u4), len
+   (u2), flags (u2) and ptr (u8) in native byte order. */
+static PyObject*
+NetmapRing_batch(NetmapRing *self, PyObject *args)
+{
+    struct netmap_ring *ring = self->_ring;
+    unsigned int limit = 0;
+    uint32_t n;
+
+    if (!PyArg_ParseTuple(args, "|I", &limit)) {
+        return NULL;
+    }
+
+    n = ring->tail >= ring->cur ? ring->tail - ring->cur :
+                                    ring->num_slots - ring->cur;
+    if (limit && n > limit) {
+        n = limit;
+    }
+
+    return NetmapRing_view(self, &ring->slot[ring->cur],
+                            n * sizeof(struct netmap_slot));
+}
+
+/* Give back to the kernel the first 'n' slots after cur. */
+static PyObject*
+NetmapRing_release(NetmapRing *self, PyObject *args)
+{
+    struct netmap_ring *ring = self->_ring;
+    unsigned int n;
+    uint32_t i;
+
+    if (!PyArg_ParseTuple(args, "I", &n)) {
+        return NULL;
+    }
+    i = ring->tail >= ring->cur ? ring->tail - ring->cur :
+                                    ring->tail + ring->num_slots - ring->cur;
+    if (n > i) {
+        PyErr_SetString(PyExc_ValueError, "Not enough slots in the ring");
+        return NULL;
+    }
+
+    i = ring->cur + n;
+    if (i >= ring->num_slots) {
+        i -= ring->num_slots;
+    }
+    ring->head = ring->cur = i;
+
+    Py_RETURN_NONE;
+}
+
 static PyMethodDef NetmapRing_methods[] = {
     {"space", (PyCFunction)NetmapRing_space, METH_NOARGS,
         "Return the number of available ring slots"
@@ -315,6 +405,13 @@ static PyMethodDef NetmapRing_methods[] = {
     {"empty", (PyCFunction)NetmapRing_empty, METH_NOARGS,
         "Returns True if the ring is empty (no available slots)"
     },
+    {"batch", (PyCFunction)NetmapRing_batch, METH_VARARGS,
+        "Return a memoryview of the slots from cur to tail, at most "
+        "the given number, not wrapping around the end of the ring"
+    },
+    {"release", (PyCFunction)NetmapRing_release, METH_VARARGS,
+        "Advance head and cur by the given number of slots"
+    },
     {NULL}
 };
 
@@ -27,6 +27,8 @@
 
 #include <structmember.h>
 
+#include <net/netmap_user.h>
+
 
 static void
 NetmapSlot_dealloc(NetmapSlot* self)
@@ -48,6 +50,7 @@ NetmapSlot_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     self = (NetmapSlot *)type->tp_alloc(type, 0);
     if (self != NULL) {
         self->_slot = NULL;
+        self->_ring = NULL;
         self->memoryview = NULL;
         memset(&self->_view, 0, sizeof(Py_buffer));
     }
@@ -100,10 +103,12 @@ static PyMemberDef NetmapSlot_members[] = {
 };
 
 int
-NetmapSlot_build(NetmapSlot *self, void *addr, void *buf)
+NetmapSlot_build(NetmapSlot *self, struct netmap_ring *ring, void *addr,
+                    void *buf)
 {
-    /* Init the pointer. */
+    /* Init the pointers. */
     self->_slot = (struct netmap_slot *)addr;
+    self->_ring = ring;
 
     /* Populate a Py_buffer struct, which represents a C memory
        buffer. */
@@ -130,6 +135,7 @@ void
 NetmapSlot_destroy(NetmapSlot *self)
 {
     self->_slot = NULL;
+    self->_ring = NULL;
 
     if (self->_view.buf) {
         free(self->_view.shape);
@@ -220,6 +226,34 @@ static PyMethodDef NetmapSlot_methods[] = {
     {NULL}
 };
 
+/*########################## buffer protocol #######################*/
+
+/* Unlike the 'buf' memoryview, which is built once, this looks up
+   buf_idx and len on each request, so that memoryview(slot) or
+   numpy.frombuffer(slot, numpy.uint8) always refer to the buffer
+   currently attached to the slot, without copying it. */
+static int
+NetmapSlot_getbuffer(NetmapSlot *self, Py_buffer *view, int flags)
+{
+    if (!self->_slot) {
+        PyErr_SetString(PyExc_BufferError, "Invalid NetmapSlot");
+        return -1;
+    }
+
+    return PyBuffer_FillInfo(view, (PyObject *)self,
+                NETMAP_BUF(self->_ring, self->_slot->buf_idx),
+                self->_slot->len, 0, flags);
+}
+
+static PyBufferProcs NetmapSlot_as_buffer = {
+    0,                         /* bf_getreadbuffer */
+    0,                         /* bf_getwritebuffer */
+    0,                         /* bf_getsegcount */
+    0,                         /* bf_getcharbuffer */
+    (getbufferproc)NetmapSlot_getbuffer,   /* bf_getbuffer */
+    0,                         /* bf_releasebuffer */
+};
+
 /* Definition exported to netmap.c. */
 PyTypeObject NetmapSlotType = {
     PyObject_HEAD_INIT(NULL)
@@ -241,8 +275,8 @@ PyTypeObject NetmapSlotType = {
     0,                         /*tp_str*/
     0,                         /*tp_getattro*/
     0,                         /*tp_setattro*/
-    0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT, /*tp_flags*/
+    &NetmapSlot_as_buffer,     /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
     "Netmap interface object",           /* tp_doc */
     0,                     /* tp_traverse */
     0,                     /* tp_clear */
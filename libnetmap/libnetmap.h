@@ -39,6 +39,10 @@
  */
 #include <net/netmap_user.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct nmctx;
 struct nmport_d;
 struct nmem_d;
@@ -83,8 +87,10 @@ struct nmem_d;
  *	z		zero copy monitor (both tx and rx)
  *	t		monitor tx side (copy monitor)
  *	r		monitor rx side (copy monitor)
+ *	d		copy the tx side in the monitor rxsync (copy monitor)
  *	R		bind only RX ring(s)
  *	T		bind only TX ring(s)
+ *	p		poll() waits on the bound rings only (Linux)
  *
  *  The "options" start at the first '@' character not followed by a number.
  *  Each option starts with '@' and has the following syntax:
@@ -145,10 +151,14 @@ struct nmem_d;
  *			ring-size	size of each netmap_ring
  *			buf-num		number of pre-allocated buffers
  *			buf-size	size of each buffer
+ *			bufs		file holding the buffers, shared
+ *					with other processes (see
+ *					nmport_extmem_bufs() below)
  *
  *			file must be assigned. The other keys default to zero,
  *			causing netmap to take the corresponding values from
- *			the priv_{if,ring,buf}_{num,size} sysctls.
+ *			the priv_{if,ring,buf}_{num,size} sysctls. With bufs,
+ *			buf-num and buf-size refer to the shared buffers.
  *
  *  offset (multi-key)
  *			reserve (part of) the ptr fields as an offset field
@@ -166,6 +176,42 @@ struct nmem_d;
  *
  *		        This option is disabled by default (see
  *			nmport_enable_option() below)
+ *
+ *  meta (single-key)
+ *			ask the driver to store a struct nm_slot_meta in front
+ *			of each received packet, or to honor the offloads
+ *			requested in front of the transmitted ones (see
+ *			nmport_slot_meta() below).
+ *
+ *			The keys are:
+ *
+ *		       *fields		mask of the NM_META_* fields and
+ *					NM_META_TX_* offloads wanted
+ *
+ *			All the fields are requested if the mask is omitted.
+ *			This option is disabled by default, and needs an
+ *			offset large enough for the metadata.
+ *
+ *  hugemem (multi-key)
+ *			open the port in a memory region of huge pages
+ *			allocated by the library (see nmport_extmem_hugepages()
+ *			below). The body may be omitted.
+ *
+ *			The keys are:
+ *
+ *		       *page		2M, 1G or auto (1G, falling back to 2M)
+ *			node		NUMA node of the pages, -1 for none
+ *					(default: the node of the NIC)
+ *			if-num, if-size, ring-num, ring-size, buf-num,
+ *			buf-size	as for extmem; by default they are
+ *					computed from the rings of the port,
+ *					so conf must come first if used
+ *
+ *  prefault (no body)
+ *			fault in the whole memory region when it is mapped,
+ *			so that the first pass over the rings and buffers
+ *			does not take a page fault on each page (see
+ *			nmport_prefault() below)
  */
 
 
@@ -192,6 +238,7 @@ struct nmport_d {
 	int mmap_done;		/* nmport_mmap() has been called */
 	/* pointer to the extmem option contained in the hdr options, if any */
 	struct nmreq_opt_extmem *extmem;
+	int prefault;		/* nmport_mmap() faults in the region */
 
 	/* the fields below are compatible with nm_open() */
 	int fd;				/* "/dev/netmap", -1 if not open */
@@ -245,6 +292,168 @@ void nmport_close(struct nmport_d *d);
  */
 int nmport_inject(struct nmport_d *d, const void *buf, size_t size);
 
+/* struct nmport_pkt - a slot returned by the burst functions below
+ * @ring	the netmap ring that contains the slot
+ * @slot	the slot
+ * @buf		the packet, i.e. the buffer of the slot plus its offset
+ *
+ * There is one entry per slot, so the frames that span several slots
+ * (NS_MOREFRAG) take several entries, possibly across two bursts.
+ */
+struct nmport_pkt {
+	struct netmap_ring *ring;
+	struct netmap_slot *slot;
+	char *buf;
+};
+
+/* flags for the burst functions */
+#define NMPORT_BURST_SYNC	(1U << 0)	/* sync the rings if needed */
+#define NMPORT_BURST_PREFETCH	(1U << 1)	/* prefetch the buffers */
+
+/* nmport_rx_burst - receive a burst of slots
+ * @d		the port we want to receive from
+ * @pkts	array of at least n entries, filled by the function
+ * @n		maximum number of slots to return
+ * @flags	NMPORT_BURST_* flags
+ *
+ * Collects up to n received slots from all the bound rx rings, starting
+ * from a different ring at each call, and advances the cur pointer of
+ * the rings past them. The slots returned by the previous call, and
+ * their buffers, are given back to the kernel first (head = cur), so
+ * they must not be used afterwards.
+ * If nothing is available and NMPORT_BURST_SYNC is set, the function
+ * issues a NIOCRXSYNC and tries once more; otherwise the application
+ * is in charge of poll() or ioctl(NIOCRXSYNC).
+ *
+ * Returns the number of slots stored in pkts.
+ */
+unsigned int nmport_rx_burst(struct nmport_d *d, struct nmport_pkt *pkts,
+		unsigned int n, int flags);
+
+/* nmport_rx_release - give back the slots of the last nmport_rx_burst
+ * @d		the port
+ *
+ * This is also done by the next nmport_rx_burst() call.
+ */
+void nmport_rx_release(struct nmport_d *d);
+
+/* nmport_tx_burst - reserve a burst of free tx slots
+ * @d		the port we want to send through
+ * @pkts	array of at least n entries, filled by the function
+ * @n		maximum number of slots to reserve
+ * @flags	NMPORT_BURST_* flags
+ *
+ * Collects up to n free slots from the bound tx rings, starting from
+ * cur_tx_ring. The application fills the buffers, sets slot->len
+ * (and slot->flags) and sends the first k of them, k <= the returned
+ * value, with nmport_tx_commit(). The remaining ones are left free.
+ * If no slot is free and NMPORT_BURST_SYNC is set, the function
+ * issues a NIOCTXSYNC and tries once more.
+ *
+ * Returns the number of slots stored in pkts.
+ */
+unsigned int nmport_tx_burst(struct nmport_d *d, struct nmport_pkt *pkts,
+		unsigned int n, int flags);
+
+/* nmport_tx_commit - send the slots reserved by nmport_tx_burst
+ * @d		the port
+ * @pkts	the array filled by the last nmport_tx_burst()
+ * @n		number of slots to send, from the start of pkts
+ * @flags	NMPORT_BURST_SYNC to issue a NIOCTXSYNC right away
+ *
+ * Returns 0 on success and -1 on error (only possible with
+ * NMPORT_BURST_SYNC).
+ */
+int nmport_tx_commit(struct nmport_d *d, const struct nmport_pkt *pkts,
+		unsigned int n, int flags);
+
+/*
+ * nmloop - receive from many ports with a single wait
+ *
+ * A loop watches the rx rings of any number of open ports through an
+ * epoll (linux) or kqueue descriptor in edge-triggered mode, and calls
+ * a function of the application with the bursts of slots received on
+ * the ports that netmap has notified. The ports that stay idle cost
+ * nothing, so an iteration takes time proportional to the number of
+ * ready ports, not to the number of ports in the loop. A port that
+ * fills a whole burst is visited again in the next iteration without
+ * waiting, so that the ready ports are served in turn.
+ *
+ * A loop must only be used by one thread at a time.
+ */
+struct nmloop;
+
+/* nmloop_cb - called by the loop with the received slots
+ * @d		the port, as passed to nmloop_add()
+ * @pkts	the slots, as returned by nmport_rx_burst()
+ * @n		the number of slots (at least 1)
+ * @arg		the argument passed to nmloop_add()
+ *
+ * The slots are given back to the kernel when the function returns, so
+ * it must copy (or swap out) what it wants to keep. It may transmit on
+ * any port, but it must not add or remove ports to or from the loop.
+ */
+typedef void (*nmloop_cb)(struct nmport_d *d, struct nmport_pkt *pkts,
+		unsigned int n, void *arg);
+
+/* nmloop_new - create a loop
+ * @burst	maximum number of slots passed to each call of a callback,
+ *		0 for the default (64)
+ *
+ * Returns NULL on error, setting errno.
+ */
+struct nmloop *nmloop_new(unsigned int burst);
+
+/* flags for nmloop_add() */
+#define NMLOOP_PER_RING		(1U << 0)	/* one wait entry per rx ring */
+
+/* nmloop_add - watch the rx rings of a port
+ * @l		the loop
+ * @d		an open port
+ * @flags	NMLOOP_* flags
+ * @cb		the function to call with the received slots
+ * @arg		argument for cb
+ *
+ * With NMLOOP_PER_RING, each rx ring bound by d is bound again on its
+ * own descriptor (see nmport_open_ring()), so that the loop only reads
+ * from the rings that have been notified; otherwise a notification on
+ * d makes the loop read from all the rings of d. Anything already in
+ * the rings is read at the next nmloop_run_once().
+ * The application must not read from d, nor close it, until d is
+ * removed from the loop.
+ *
+ * Returns 0 on success and -1 on error, setting errno.
+ */
+int nmloop_add(struct nmloop *l, struct nmport_d *d, uint32_t flags,
+		nmloop_cb cb, void *arg);
+
+/* nmloop_remove - stop watching a port
+ * @l		the loop
+ * @d		a port previously added with nmloop_add()
+ *
+ * Returns 0 on success and -1 (with errno ENOENT) if d is not in l.
+ */
+int nmloop_remove(struct nmloop *l, struct nmport_d *d);
+
+/* nmloop_run_once - wait for the ready ports and serve them
+ * @l		the loop
+ * @timeout_ms	maximum wait if no port is ready, -1 to wait forever
+ *
+ * Calls the callback of each ready port (or ring) at most once, with
+ * at most one burst.
+ *
+ * Returns the number of callbacks called, 0 on timeout or if a signal
+ * interrupted the wait, and -1 on error, setting errno.
+ */
+int nmloop_run_once(struct nmloop *l, int timeout_ms);
+
+/* nmloop_delete - remove all the ports and destroy the loop
+ * @l		the loop
+ *
+ * The ports are not closed.
+ */
+void nmloop_delete(struct nmloop *l);
+
 /*
  * the functions below can be used to split the functionality of
  * nmport_open when special features (e.g., extra buffers) are needed
@@ -367,6 +576,23 @@ void nmport_undo_open_desc(struct nmport_d *);
  */
 struct nmport_d *nmport_clone(struct nmport_d *);
 
+/* nmport_open_ring - bind one more ring of an open port
+ * @d		a port already opened (registered and mapped)
+ * @mode	the NR_REG_* mode of the new binding (e.g., NR_REG_ONE_NIC)
+ * @ringid	the ring, for the NR_REG_ONE_* modes
+ *
+ * Clones d, registers the clone with the given mode and ring, and
+ * makes it share the memory region of d, without another mmap() and
+ * without taking the lock of the nmctx. Several threads may call this
+ * function on the same d at the same time, e.g. to bind one ring each
+ * at startup; d must stay open meanwhile. The new descriptor is closed
+ * with nmport_close() as usual.
+ *
+ * Returns NULL on error, setting errno.
+ */
+struct nmport_d *nmport_open_ring(struct nmport_d *d, uint32_t mode,
+		uint16_t ringid);
+
 /* nmport_extmem - use extmem for this port
  * @d		the port we want to use the extmem for
  * @base	the base address of the extmem region
@@ -412,6 +638,59 @@ int nmport_extmem_from_file(struct nmport_d *d, const char *fname);
  */
 struct nmreq_pools_info* nmport_extmem_getinfo(struct nmport_d *d);
 
+/* nmport_extmem_bufs - take the buffers from memory shared with others
+ * @d		the port, which must also use extmem
+ * @base	the base address of the buffer region
+ * @size	the size in bytes of the buffer region
+ *
+ * Normally the extmem region holds the netmap_if's, the rings and the
+ * buffers. With this function the buffers are taken from a separate
+ * region instead, which may be mapped (e.g., from the same file) by
+ * several processes, each one with its own extmem region for the
+ * rings. The kernel lays out the buffers once, and gives each process
+ * a share of them; buffers can then be swapped without copies between
+ * the VALE ports of the processes. The rings of a process remain
+ * private to it, but the contents of the shared buffers are not.
+ *
+ * The share and the buffer size can be chosen with the nro_buf_num and
+ * nro_buf_size fields of the option returned by
+ * nmport_extmem_bufs_getinfo(), which also reports the actual values
+ * after registration.
+ *
+ * It returns 0 on success. On failure it returns -1, sets errno to an error
+ * value and sends an error message to the error() method of the context used
+ * when @d was created. Moreover, *@d is left unchanged.
+ */
+int nmport_extmem_bufs(struct nmport_d *d, void *base, size_t size);
+
+/* nmport_extmem_bufs_getinfo - obtain the shared buffers option
+ * @d		the port we want to obtain the pointer from
+ *
+ * Returns a pointer to the option set by nmport_extmem_bufs(), or NULL.
+ */
+struct nmreq_opt_extmem_bufs *nmport_extmem_bufs_getinfo(struct nmport_d *d);
+
+/* nmport_extmem_hugepages - use huge pages as the memory of the port
+ * @d		the port we want to use the memory for
+ * @pi		the number and size of the objects of each pool, or NULL.
+ * 		The fields left at zero (except nr_memsize, ignored) are
+ * 		computed from the rings of the port, or of the requested
+ * 		conf for a port that does not exist yet
+ * @pagesize	2MB or 1GB; zero tries 1GB pages first, then 2MB ones
+ * @node	the NUMA node of the pages, -1 for no binding, or
+ * 		NMPORT_NUMA_AUTO for the node of the NIC (Linux only)
+ *
+ * Allocates (anonymous) huge pages large enough for the pools and
+ * passes them to the port with nmport_extmem(). On FreeBSD the memory
+ * is allocated superpage aligned and the node is ignored. The memory is
+ * released when the port is closed.
+ *
+ * Returns 0 on success and -1 on error, setting errno.
+ */
+#define NMPORT_NUMA_AUTO	(-2)
+int nmport_extmem_hugepages(struct nmport_d *d,
+		const struct nmreq_pools_info *pi, size_t pagesize, int node);
+
 
 /* nmport_offset - use offsets for this port
  * @initial	the initial offset for all the slots
@@ -454,6 +733,129 @@ struct nmreq_pools_info* nmport_extmem_getinfo(struct nmport_d *d);
 int nmport_offset(struct nmport_d *d, uint64_t initial, uint64_t maxoff,
 		uint64_t bits, uint64_t mingap);
 
+/* nmport_monitor_filter - filter the frames copied by a copy monitor
+ * @d		the monitor port (/r, /t or /rt)
+ * @snaplen	maximum number of bytes copied from each frame, 0 for no limit
+ * @insns	a classic BPF program (e.g., compiled by pcap_compile()), or NULL
+ * @ninsns	number of instructions in @insns, at most
+ *		NM_MONITOR_FILTER_MAXINSNS
+ *
+ * The kernel runs the program on each frame seen by the monitor, before
+ * copying it. Frames for which the program returns 0 are not copied, the
+ * others are truncated to the returned value and to @snaplen. The len
+ * field of the monitor slots reports the number of bytes actually copied.
+ * The snaplen alone can also be set in the portspec with '@snaplen:N'.
+ * Zero-copy monitors do not support filters.
+ *
+ * It returns 0 on success. On failure it returns -1, sets errno to an error
+ * value and sends an error message to the error() method of the context used
+ * when @d was created. Moreover, *@d is left unchanged.
+ */
+int nmport_monitor_filter(struct nmport_d *d, uint32_t snaplen,
+		const struct nm_bpf_insn *insns, uint32_t ninsns);
+
+/* nmport_monitor_sample - copy only a sample of the monitored frames
+ * @d		the monitor port (/r, /t or /rt)
+ * @rate	copy one frame out of @rate (0 and 1 copy all the frames)
+ * @flags	0, or NR_MONITOR_SAMPLE_FLOW to copy all the frames of one
+ *		flow out of @rate, chosen by a hash of the IP addresses and
+ *		TCP/UDP ports
+ *
+ * The kernel decides before any copy (and before the filter, if any), so
+ * a monitor that samples one frame in N costs about 1/N of a full copy
+ * monitor. The option can also be passed through the portspec using the
+ * '@sample:N' or '@sample:N,mode=flow' syntax. Zero-copy monitors do not
+ * support sampling.
+ *
+ * It returns 0 on success. On failure it returns -1, sets errno to an error
+ * value and sends an error message to the error() method of the context used
+ * when @d was created. Moreover, *@d is left unchanged.
+ */
+int nmport_monitor_sample(struct nmport_d *d, uint32_t rate, uint32_t flags);
+
+/* nmport_pipe_fanout - distribute the traffic of a pipe among its rings
+ * @d		one endpoint of the pipe ({ or })
+ * @mode	NM_PIPE_FANOUT_RR or NM_PIPE_FANOUT_HASH
+ *
+ * If the registration creates the pipe, every tx ring of the master will
+ * feed all the rx rings of the slave, choosing the ring for each packet in
+ * round-robin order or by a hash of the IP addresses and TCP/UDP ports.
+ * Each worker can then bind a single slave ring (e.g., 'vale0:x}p-3').
+ * The frames are still moved by swapping buffers, so the tx slots come back
+ * with buffers different from the ones that were sent.  The mode of an
+ * already existing pipe is not changed. The option can also be passed
+ * through the portspec using the '@fanout:rr' or '@fanout:hash' syntax.
+ *
+ * It returns 0 on success. On failure it returns -1, sets errno to an error
+ * value and sends an error message to the error() method of the context used
+ * when @d was created. Moreover, *@d is left unchanged.
+ */
+int nmport_pipe_fanout(struct nmport_d *d, uint32_t mode);
+
+/* nmport_slot_meta - ask for the offload results of the received packets
+ * @d		the port
+ * @flags	NM_META_* fields wanted, ~0 for all of them
+ *
+ * The driver stores a struct nm_slot_meta right before each received
+ * packet, which the application reads with NETMAP_SLOT_META(). The offsets
+ * must leave room for it: use nmport_offset() with an initial offset of at
+ * least sizeof(struct nm_slot_meta). The option can also be passed through
+ * the portspec as '@meta' or '@meta:MASK', once enabled with
+ * nmport_enable_option("meta"). The registration fails with EOPNOTSUPP if
+ * the port cannot provide any of the wanted fields. NM_META_TS is always
+ * available: without hardware support netmap stamps the packets at rxsync.
+ *
+ * NM_META_TX_* flags enable the tx offloads instead: the application fills
+ * in a struct nm_slot_meta in front of the first slot of each packet it
+ * transmits (see netmap.h for the fields). The offloads supported by a
+ * port are also returned in nr_meta_caps by NETMAP_REQ_PORT_INFO_GET.
+ *
+ * It returns 0 on success. On failure it returns -1, sets errno to an error
+ * value and sends an error message to the error() method of the context used
+ * when @d was created. Moreover, *@d is left unchanged.
+ */
+int nmport_slot_meta(struct nmport_d *d, uint32_t flags);
+
+/* nmport_null_traffic - make a null port a synthetic traffic source/sink
+ * @d		the port, registered in NR_REG_NULL mode
+ * @flags	NR_NULL_SOURCE, NR_NULL_SINK or both
+ * @len		length of the generated frames, 0 for 60 bytes
+ * @rate	frames per second on each rx ring of a source, 0 for no limit
+ *
+ * A sink consumes all the slots passed to txsync. A source fills the free
+ * slots of the rx rings with a UDP frame at each rxsync, writing the frame
+ * once in the buffers and again only in the slots marked NS_BUF_CHANGED.
+ * The rate is enforced by rxsync only, so a limited source needs to be
+ * polled (e.g., busy-waiting on NIOCRXSYNC). The option can also be passed
+ * through the portspec as '@null:source,len=N,rate=R' (mode source, sink
+ * or both), which also selects NR_REG_NULL and, unless already set, the
+ * allocator with id 1.
+ *
+ * It returns 0 on success. On failure it returns -1, sets errno to an error
+ * value and sends an error message to the error() method of the context used
+ * when @d was created. Moreover, *@d is left unchanged.
+ */
+int nmport_null_traffic(struct nmport_d *d, uint32_t flags, uint32_t len,
+		uint64_t rate);
+
+/* nmport_prefault - fault in the memory region of the port when mapped
+ * @d		the port, not yet mapped
+ *
+ * Makes nmport_mmap() fault in all the pages of the region (with
+ * MAP_POPULATE where available, reading a byte of each page otherwise),
+ * so that the datapath is warm from the first packet instead of taking
+ * page faults right after a restart. A region already mapped by another
+ * port of the same context is faulted in too. The memory of extmem and
+ * hugemem ports is already resident while the port is registered, and
+ * is left alone. The same is obtained with the '@prefault' portspec
+ * option.
+ *
+ * It returns 0 on success. On failure (the port is already mapped) it
+ * returns -1, sets errno to an error value and sends an error message to
+ * the error() method of the context used when @d was created.
+ */
+int nmport_prefault(struct nmport_d *d);
+
 /* enable/disable options
  *
  * These functions can be used to disable options that the application cannot
@@ -669,6 +1071,7 @@ struct nmem_d {
 	void *mem;		/* memory region base address */
 	size_t size;		/* memory region size */
 	int is_extmem;		/* was it obtained via extmem? */
+	int prefaulted;		/* all the pages have been faulted in */
 
 	/* pointers for the circular list implementation.
 	 * The list head is the mem_descs filed in the nmctx
@@ -713,4 +1116,8 @@ void nmctx_lock(struct nmctx *);
 /* nmctx_unlock - unlock the list of nmem_d */
 void nmctx_unlock(struct nmctx *);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* LIBNETMAP_H_ */
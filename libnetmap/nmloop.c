@@ -0,0 +1,370 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (C) 2026 Universita` di Pisa
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <net/netmap_user.h>
+#define LIBNETMAP_NOTHREADSAFE
+#include "libnetmap.h"
+
+/*
+ * The descriptors are registered in edge-triggered mode, so the kernel
+ * only reports the rings that received something since the last wait.
+ * A source that was reported is kept on the ready list until it is
+ * drained, i.e., until a burst comes out short and a NIOCRXSYNC (which
+ * also gives the released slots back to the kernel) finds nothing
+ * more: only then the next packets will raise a new event.
+ */
+
+/* a descriptor watched by the loop */
+struct nmloop_src {
+	struct nmloop_src *next;	/* all the sources of the loop */
+	struct nmloop_src *rnext;	/* ready list */
+	struct nmport_d *d;		/* where we read from */
+	struct nmport_d *port;		/* what we pass to the callback */
+	nmloop_cb cb;
+	void *arg;
+	int ready;
+};
+
+struct nmloop {
+	struct nmctx *ctx;
+	int fd;				/* epoll or kqueue */
+	unsigned int burst;
+	struct nmport_pkt *pkts;
+	struct nmloop_src *srcs;
+	struct nmloop_src *rhead;
+	struct nmloop_src *rtail;
+};
+
+#define NMLOOP_EVENTS	64	/* events collected by each wait */
+
+static void
+nmloop_set_ready(struct nmloop *l, struct nmloop_src *s)
+{
+	if (s->ready)
+		return;
+	s->ready = 1;
+	s->rnext = NULL;
+	if (l->rtail != NULL)
+		l->rtail->rnext = s;
+	else
+		l->rhead = s;
+	l->rtail = s;
+}
+
+static struct nmloop_src *
+nmloop_pop_ready(struct nmloop *l)
+{
+	struct nmloop_src *s = l->rhead;
+
+	l->rhead = s->rnext;
+	if (l->rhead == NULL)
+		l->rtail = NULL;
+	s->ready = 0;
+	return s;
+}
+
+static int
+nmloop_watch(struct nmloop *l, struct nmloop_src *s, int on)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = s;
+	return epoll_ctl(l->fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+			s->d->fd, &ev);
+#else
+	struct kevent ev;
+
+	EV_SET(&ev, s->d->fd, EVFILT_READ, on ? EV_ADD | EV_CLEAR : EV_DELETE,
+			0, 0, s);
+	return kevent(l->fd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+/* close what nmloop_add() has opened and forget about s */
+static void
+nmloop_src_delete(struct nmloop *l, struct nmloop_src *s)
+{
+	struct nmloop_src **pp;
+
+	nmloop_watch(l, s, 0);
+	if (s->ready) {
+		for (pp = &l->rhead; *pp != s; pp = &(*pp)->rnext)
+			;
+		*pp = s->rnext;
+		if (l->rtail == s) {
+			struct nmloop_src *t;
+
+			for (t = l->rhead; t != NULL && t->rnext != NULL;
+					t = t->rnext)
+				;
+			l->rtail = t;
+		}
+	}
+	if (s->d != s->port)
+		nmport_close(s->d);
+	nmctx_free(l->ctx, s);
+}
+
+struct nmloop *
+nmloop_new(unsigned int burst)
+{
+	struct nmctx *ctx = nmctx_get();
+	struct nmloop *l;
+
+	if (burst == 0)
+		burst = 64;
+	l = nmctx_malloc(ctx, sizeof(*l));
+	if (l == NULL) {
+		nmctx_ferror(ctx, "cannot allocate the loop");
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(l, 0, sizeof(*l));
+	l->ctx = ctx;
+	l->burst = burst;
+	l->pkts = nmctx_malloc(ctx, burst * sizeof(*l->pkts));
+	if (l->pkts == NULL) {
+		nmctx_ferror(ctx, "cannot allocate %u burst entries", burst);
+		nmctx_free(ctx, l);
+		errno = ENOMEM;
+		return NULL;
+	}
+#ifdef __linux__
+	l->fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+	l->fd = kqueue();
+#endif
+	if (l->fd < 0) {
+		int err = errno;
+
+		nmctx_ferror(ctx, "cannot create the event queue: %s",
+				strerror(err));
+		nmctx_free(ctx, l->pkts);
+		nmctx_free(ctx, l);
+		errno = err;
+		return NULL;
+	}
+	return l;
+}
+
+static int
+nmloop_add_src(struct nmloop *l, struct nmport_d *d, struct nmport_d *port,
+		nmloop_cb cb, void *arg)
+{
+	struct nmloop_src *s;
+
+	s = nmctx_malloc(l->ctx, sizeof(*s));
+	if (s == NULL) {
+		nmctx_ferror(l->ctx, "%s: cannot allocate the loop entry",
+				port->hdr.nr_name);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(s, 0, sizeof(*s));
+	s->d = d;
+	s->port = port;
+	s->cb = cb;
+	s->arg = arg;
+	if (nmloop_watch(l, s, 1) < 0) {
+		int err = errno;
+
+		nmctx_ferror(l->ctx, "%s: cannot watch fd %d: %s",
+				port->hdr.nr_name, d->fd, strerror(err));
+		nmctx_free(l->ctx, s);
+		errno = err;
+		return -1;
+	}
+	s->next = l->srcs;
+	l->srcs = s;
+	/* read what may already be there, no event will tell us */
+	nmloop_set_ready(l, s);
+	return 0;
+}
+
+int
+nmloop_add(struct nmloop *l, struct nmport_d *d, uint32_t flags,
+		nmloop_cb cb, void *arg)
+{
+	uint16_t nrx = d->nifp->ni_rx_rings, i;
+	int err;
+
+	if (!(flags & NMLOOP_PER_RING) || d->first_rx_ring == d->last_rx_ring)
+		return nmloop_add_src(l, d, d, cb, arg);
+
+	for (i = d->first_rx_ring; i <= d->last_rx_ring; i++) {
+		struct nmport_d *r;
+
+		/* the host rings follow the hardware ones */
+		if (i < nrx)
+			r = nmport_open_ring(d, NR_REG_ONE_NIC, i);
+		else
+			r = nmport_open_ring(d, NR_REG_ONE_SW, i - nrx);
+		if (r == NULL)
+			goto err;
+		if (nmloop_add_src(l, r, d, cb, arg) < 0) {
+			nmport_close(r);
+			goto err;
+		}
+	}
+	return 0;
+
+err:
+	err = errno;
+	nmloop_remove(l, d);
+	errno = err;
+	return -1;
+}
+
+int
+nmloop_remove(struct nmloop *l, struct nmport_d *d)
+{
+	struct nmloop_src **pp = &l->srcs;
+	int found = 0;
+
+	while (*pp != NULL) {
+		struct nmloop_src *s = *pp;
+
+		if (s->port != d) {
+			pp = &s->next;
+			continue;
+		}
+		*pp = s->next;
+		nmloop_src_delete(l, s);
+		found = 1;
+	}
+	if (!found) {
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+/* anything left in the rings of d after the last sync? */
+static int
+nmloop_rx_pending(struct nmport_d *d)
+{
+	uint16_t i;
+
+	for (i = d->first_rx_ring; i <= d->last_rx_ring; i++)
+		if (!nm_ring_empty(NETMAP_RXRING(d->nifp, i)))
+			return 1;
+	return 0;
+}
+
+int
+nmloop_run_once(struct nmloop *l, int timeout_ms)
+{
+	struct nmloop_src *s, *last;
+	int i, n, calls = 0;
+#ifdef __linux__
+	struct epoll_event ev[NMLOOP_EVENTS];
+
+	n = epoll_wait(l->fd, ev, NMLOOP_EVENTS,
+			l->rhead != NULL ? 0 : timeout_ms);
+#else
+	struct kevent ev[NMLOOP_EVENTS];
+	struct timespec ts, *tp = NULL;
+
+	if (l->rhead != NULL)
+		timeout_ms = 0;
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+		tp = &ts;
+	}
+	n = kevent(l->fd, NULL, 0, ev, NMLOOP_EVENTS, tp);
+#endif
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		nmctx_ferror(l->ctx, "wait failed: %s", strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+#ifdef __linux__
+		nmloop_set_ready(l, ev[i].data.ptr);
+#else
+		nmloop_set_ready(l, ev[i].udata);
+#endif
+	}
+
+	/* one burst for each source that was ready on entry */
+	last = l->rtail;
+	while (l->rhead != NULL) {
+		unsigned int got;
+		int done = (l->rhead == last);
+
+		s = nmloop_pop_ready(l);
+		got = nmport_rx_burst(s->d, l->pkts, l->burst, 0);
+		if (got > 0) {
+			s->cb(s->port, l->pkts, got, s->arg);
+			nmport_rx_release(s->d);
+			calls++;
+		}
+		if (got == l->burst) {
+			nmloop_set_ready(l, s);
+		} else if (ioctl(s->d->fd, NIOCRXSYNC, NULL) == 0 &&
+				nmloop_rx_pending(s->d)) {
+			/* more came in meanwhile, and may raise no event */
+			nmloop_set_ready(l, s);
+		}
+		if (done)
+			break;
+	}
+	return calls;
+}
+
+void
+nmloop_delete(struct nmloop *l)
+{
+	while (l->srcs != NULL) {
+		struct nmloop_src *s = l->srcs;
+
+		l->srcs = s->next;
+		nmloop_src_delete(l, s);
+	}
+	close(l->fd);
+	nmctx_free(l->ctx, l->pkts);
+	nmctx_free(l->ctx, l);
+}
@@ -39,6 +39,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include <net/netmap_user.h>
 #define LIBNETMAP_NOTHREADSAFE
 #include "libnetmap.h"
@@ -183,8 +186,12 @@ void nmport_extmem_from_file_cleanup(struct nmport_cleanup_d *c,
 	munmap(cc->p, cc->size);
 }
 
-int
-nmport_extmem_from_file(struct nmport_d *d, const char *fname)
+/* mmap() the whole file 'fname' and arrange for nmport_close() to
+ * munmap() it
+ */
+static int
+nmport_map_file(struct nmport_d *d, const char *fname, void **pp,
+		size_t *psize)
 {
 	struct nmctx *ctx = d->ctx;
 	int fd = -1;
@@ -198,7 +205,6 @@ nmport_extmem_from_file(struct nmport_d *d, const char *fname)
 		errno = ENOMEM;
 		goto fail;
 	}
-	clnup->up.cleanup = NULL;
 
 	fd = open(fname, O_RDWR);
 	if (fd < 0) {
@@ -210,67 +216,619 @@ nmport_extmem_from_file(struct nmport_d *d, const char *fname)
 		nmctx_ferror(ctx, "failed to obtain filesize of '%s': %s", fname, strerror(errno));
 		goto fail;
 	}
-	p = mmap(0, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (p == MAP_FAILED) {
-		nmctx_ferror(ctx, "cannot mmap '%s': %s", fname, strerror(errno));
-		goto fail;
+	p = mmap(0, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		nmctx_ferror(ctx, "cannot mmap '%s': %s", fname, strerror(errno));
+		goto fail;
+	}
+	close(fd);
+
+	clnup->p = p;
+	clnup->size = mapsize;
+	clnup->up.cleanup = nmport_extmem_from_file_cleanup;
+	nmport_push_cleanup(d, &clnup->up);
+
+	*pp = p;
+	*psize = mapsize;
+	return 0;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	if (clnup != NULL)
+		nmctx_free(ctx, clnup);
+	return -1;
+}
+
+int
+nmport_extmem_from_file(struct nmport_d *d, const char *fname)
+{
+	void *p;
+	size_t size;
+
+	if (nmport_map_file(d, fname, &p, &size) < 0)
+		return -1;
+
+	if (nmport_extmem(d, p, size) < 0) {
+		nmport_pop_cleanup(d);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct nmport_extmem_bufs_cleanup_d {
+	struct nmport_cleanup_d up;
+	struct nmreq_opt_extmem_bufs *opt;
+};
+
+static void
+nmport_extmem_bufs_cleanup(struct nmport_cleanup_d *c, struct nmport_d *d)
+{
+	struct nmport_extmem_bufs_cleanup_d *cc =
+		(struct nmport_extmem_bufs_cleanup_d *)c;
+
+	nmreq_remove_option(&d->hdr, &cc->opt->nro_opt);
+	nmctx_free(d->ctx, cc->opt);
+}
+
+int
+nmport_extmem_bufs(struct nmport_d *d, void *base, size_t size)
+{
+	struct nmctx *ctx = d->ctx;
+	struct nmport_extmem_bufs_cleanup_d *clnup;
+	struct nmreq_opt_extmem_bufs *opt;
+
+	if (d->register_done) {
+		nmctx_ferror(ctx, "%s: cannot set extmem-bufs of an already registered port", d->hdr.nr_name);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (nmreq_find_option(&d->hdr, NETMAP_REQ_OPT_EXTMEM_BUFS) != NULL) {
+		nmctx_ferror(ctx, "%s: extmem-bufs already in use", d->hdr.nr_name);
+		errno = EINVAL;
+		return -1;
+	}
+
+	clnup = nmctx_malloc(ctx, sizeof(*clnup));
+	if (clnup == NULL) {
+		nmctx_ferror(ctx, "failed to allocate cleanup descriptor");
+		errno = ENOMEM;
+		return -1;
+	}
+
+	opt = nmctx_malloc(ctx, sizeof(*opt));
+	if (opt == NULL) {
+		nmctx_ferror(ctx, "%s: cannot allocate extmem-bufs option", d->hdr.nr_name);
+		nmctx_free(ctx, clnup);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(opt, 0, sizeof(*opt));
+	opt->nro_opt.nro_reqtype = NETMAP_REQ_OPT_EXTMEM_BUFS;
+	opt->nro_usrptr = (uintptr_t)base;
+	opt->nro_memsize = size;
+	nmreq_push_option(&d->hdr, &opt->nro_opt);
+
+	clnup->up.cleanup = nmport_extmem_bufs_cleanup;
+	clnup->opt = opt;
+	nmport_push_cleanup(d, &clnup->up);
+
+	return 0;
+}
+
+struct nmreq_opt_extmem_bufs *
+nmport_extmem_bufs_getinfo(struct nmport_d *d)
+{
+	return (struct nmreq_opt_extmem_bufs *)
+		nmreq_find_option(&d->hdr, NETMAP_REQ_OPT_EXTMEM_BUFS);
+}
+
+struct nmreq_pools_info*
+nmport_extmem_getinfo(struct nmport_d *d)
+{
+	if (d->extmem == NULL)
+		return NULL;
+	return &d->extmem->nro_info;
+}
+
+#define NMPORT_HUGE_2M	(1UL << 21)
+#define NMPORT_HUGE_1G	(1UL << 30)
+
+/* the NUMA node of the device of a NIC, -1 if unknown */
+static int
+nmport_dev_numa_node(const char *ifname)
+{
+	int node = -1;
+#ifdef __linux__
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+			ifname);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+#else
+	(void)ifname;
+#endif
+	return node;
+}
+
+/* fill the pool parameters left at zero in pi, from the rings of the
+ * port if it already exists, or from the conf requested in d->reg */
+static void
+nmport_hugemem_fill(struct nmport_d *d, struct nmreq_pools_info *pi)
+{
+	struct nmreq_port_info_get req;
+	struct nmreq_header hdr;
+	uint32_t txr, rxr, htxr, hrxr, txd, rxd;
+	int fd;
+
+	memset(&req, 0, sizeof(req));
+	req.nr_tx_rings = d->reg.nr_tx_rings;
+	req.nr_rx_rings = d->reg.nr_rx_rings;
+	req.nr_host_tx_rings = d->reg.nr_host_tx_rings;
+	req.nr_host_rx_rings = d->reg.nr_host_rx_rings;
+	req.nr_tx_slots = d->reg.nr_tx_slots;
+	req.nr_rx_slots = d->reg.nr_rx_slots;
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd >= 0) {
+		struct nmreq_port_info_get info;
+
+		memset(&info, 0, sizeof(info));
+		memcpy(&hdr, &d->hdr, sizeof(hdr));
+		hdr.nr_reqtype = NETMAP_REQ_PORT_INFO_GET;
+		hdr.nr_body = (uintptr_t)&info;
+		hdr.nr_options = 0;
+		if (ioctl(fd, NIOCCTRL, &hdr) == 0)
+			req = info;
+		close(fd);
+	}
+	txr = req.nr_tx_rings ? req.nr_tx_rings : 1;
+	rxr = req.nr_rx_rings ? req.nr_rx_rings : 1;
+	htxr = req.nr_host_tx_rings ? req.nr_host_tx_rings : 1;
+	hrxr = req.nr_host_rx_rings ? req.nr_host_rx_rings : 1;
+	txd = req.nr_tx_slots ? req.nr_tx_slots : 1024;
+	rxd = req.nr_rx_slots ? req.nr_rx_slots : 1024;
+
+	/* one netmap_if per ring, for the per-ring descriptors */
+	if (pi->nr_if_pool_objtotal == 0)
+		pi->nr_if_pool_objtotal = txr + rxr + 2;
+	if (pi->nr_if_pool_objsize == 0)
+		pi->nr_if_pool_objsize = sizeof(struct netmap_if) +
+			sizeof(ssize_t) * (txr + rxr + htxr + hrxr);
+	if (pi->nr_ring_pool_objtotal == 0)
+		pi->nr_ring_pool_objtotal = txr + rxr + htxr + hrxr;
+	if (pi->nr_ring_pool_objsize == 0)
+		pi->nr_ring_pool_objsize = sizeof(struct netmap_ring) +
+			sizeof(struct netmap_slot) * (txd > rxd ? txd : rxd);
+	/* the +2 is for the fake buffers (indices 0 and 1) */
+	if (pi->nr_buf_pool_objtotal == 0)
+		pi->nr_buf_pool_objtotal = (txr + htxr) * txd +
+			(rxr + hrxr) * rxd + d->reg.nr_extra_bufs + 2;
+	if (pi->nr_buf_pool_objsize == 0)
+		pi->nr_buf_pool_objsize = 2048;
+}
+
+/* bytes taken by objtotal objects of objsize bytes in an extmem region */
+static size_t
+nmport_pool_bytes(uint32_t objtotal, uint32_t objsize)
+{
+	size_t pgsz = (size_t)sysconf(_SC_PAGESIZE);
+	size_t sz = ((size_t)objsize + 63) & ~(size_t)63;
+
+	return ((size_t)objtotal * sz + pgsz - 1) / pgsz * pgsz;
+}
+
+static void *
+nmport_hugemem_alloc(size_t size, size_t pagesize, int node)
+{
+	void *p;
+#if defined(__linux__) && defined(MAP_HUGETLB)
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT	26
+#endif
+	flags |= (pagesize == NMPORT_HUGE_1G ? 30 : 21) << MAP_HUGE_SHIFT;
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED)
+		return p;
+#ifdef SYS_mbind
+	if (node >= 0 && node < 64) {
+		/* MPOL_BIND, before the pages are faulted in */
+		unsigned long mask = 1UL << node;
+
+		if (syscall(SYS_mbind, p, size, 2, &mask, 64, 0) < 0) {
+			munmap(p, size);
+			return MAP_FAILED;
+		}
+	}
+#else
+	(void)node;
+#endif
+#elif defined(__FreeBSD__) && defined(MAP_ALIGNED_SUPER)
+	/* no explicit pages: ask for superpage aligned memory */
+	(void)pagesize;
+	(void)node;
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANON | MAP_ALIGNED_SUPER, -1, 0);
+#else
+	(void)size;
+	(void)pagesize;
+	(void)node;
+	errno = EOPNOTSUPP;
+	p = MAP_FAILED;
+#endif
+	return p;
+}
+
+int
+nmport_extmem_hugepages(struct nmport_d *d, const struct nmreq_pools_info *pi,
+		size_t pagesize, int node)
+{
+	struct nmctx *ctx = d->ctx;
+	struct nmport_extmem_from_file_cleanup_d *clnup = NULL;
+	struct nmreq_pools_info info;
+	size_t size = 0, psz;
+	void *p = MAP_FAILED;
+
+	if (pagesize != 0 && pagesize != NMPORT_HUGE_2M &&
+			pagesize != NMPORT_HUGE_1G) {
+		nmctx_ferror(ctx, "unsupported huge page size %zu", pagesize);
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&info, 0, sizeof(info));
+	if (pi != NULL)
+		info = *pi;
+	nmport_hugemem_fill(d, &info);
+	if (node == NMPORT_NUMA_AUTO)
+		node = nmport_dev_numa_node(d->hdr.nr_name);
+
+	clnup = nmctx_malloc(ctx, sizeof(*clnup));
+	if (clnup == NULL) {
+		nmctx_ferror(ctx, "cannot allocate cleanup descriptor");
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* try 1GB pages first, then 2MB ones, unless told otherwise */
+	for (psz = pagesize ? pagesize : NMPORT_HUGE_1G; ;
+			psz = NMPORT_HUGE_2M) {
+		size = nmport_pool_bytes(info.nr_if_pool_objtotal,
+				info.nr_if_pool_objsize) +
+			nmport_pool_bytes(info.nr_ring_pool_objtotal,
+				info.nr_ring_pool_objsize) +
+			nmport_pool_bytes(info.nr_buf_pool_objtotal,
+				info.nr_buf_pool_objsize);
+		size = (size + psz - 1) / psz * psz;
+		p = nmport_hugemem_alloc(size, psz, node);
+		if (p != MAP_FAILED || pagesize != 0 || psz == NMPORT_HUGE_2M)
+			break;
+	}
+	if (p == MAP_FAILED) {
+		nmctx_ferror(ctx, "%s: cannot allocate %zu bytes of huge pages: %s",
+				d->hdr.nr_name, size, strerror(errno));
+		nmctx_free(ctx, clnup);
+		return -1;
+	}
+	clnup->p = p;
+	clnup->size = size;
+	clnup->up.cleanup = nmport_extmem_from_file_cleanup;
+	nmport_push_cleanup(d, &clnup->up);
+
+	if (nmport_extmem(d, p, size) < 0) {
+		nmport_pop_cleanup(d);
+		return -1;
+	}
+	d->extmem->nro_info = info;
+	d->extmem->nro_info.nr_memsize = size;
+	return 0;
+}
+
+struct nmport_offset_cleanup_d {
+	struct nmport_cleanup_d up;
+	struct nmreq_opt_offsets *opt;
+};
+
+static void
+nmport_offset_cleanup(struct nmport_cleanup_d *c,
+		struct nmport_d *d)
+{
+	struct nmport_offset_cleanup_d *cc =
+		(struct nmport_offset_cleanup_d *)c;
+
+	nmreq_remove_option(&d->hdr, &cc->opt->nro_opt);
+	nmctx_free(d->ctx, cc->opt);
+}
+
+int
+nmport_offset(struct nmport_d *d, uint64_t initial,
+		uint64_t maxoff, uint64_t bits, uint64_t mingap)
+{
+	struct nmctx *ctx = d->ctx;
+	struct nmreq_opt_offsets *opt;
+	struct nmport_offset_cleanup_d *clnup = NULL;
+
+	clnup = nmctx_malloc(ctx, sizeof(*clnup));
+	if (clnup == NULL) {
+		nmctx_ferror(ctx, "cannot allocate cleanup descriptor");
+		errno = ENOMEM;
+		return -1;
+	}
+
+	opt = nmctx_malloc(ctx, sizeof(*opt));
+	if (opt == NULL) {
+		nmctx_ferror(ctx, "%s: cannot allocate offset option", d->hdr.nr_name);
+		nmctx_free(ctx, clnup);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(opt, 0, sizeof(*opt));
+	opt->nro_opt.nro_reqtype = NETMAP_REQ_OPT_OFFSETS;
+	opt->nro_offset_bits = bits;
+	opt->nro_initial_offset = initial;
+	opt->nro_max_offset = maxoff;
+	opt->nro_min_gap = mingap;
+	nmreq_push_option(&d->hdr, &opt->nro_opt);
+
+	clnup->up.cleanup = nmport_offset_cleanup;
+	clnup->opt = opt;
+	nmport_push_cleanup(d, &clnup->up);
+
+	return 0;
+}
+
+struct nmport_monitor_filter_cleanup_d {
+	struct nmport_cleanup_d up;
+	struct nmreq_opt_monitor_filter *opt;
+};
+
+static void
+nmport_monitor_filter_cleanup(struct nmport_cleanup_d *c,
+		struct nmport_d *d)
+{
+	struct nmport_monitor_filter_cleanup_d *cc =
+		(struct nmport_monitor_filter_cleanup_d *)c;
+
+	nmreq_remove_option(&d->hdr, &cc->opt->nro_opt);
+	nmctx_free(d->ctx, cc->opt);
+}
+
+int
+nmport_monitor_filter(struct nmport_d *d, uint32_t snaplen,
+		const struct nm_bpf_insn *insns, uint32_t ninsns)
+{
+	struct nmctx *ctx = d->ctx;
+	struct nmreq_opt_monitor_filter *opt;
+	struct nmport_monitor_filter_cleanup_d *clnup = NULL;
+	size_t size;
+
+	if (ninsns > NM_MONITOR_FILTER_MAXINSNS) {
+		nmctx_ferror(ctx, "%s: filter too long (%"PRIu32" > %d)",
+				d->hdr.nr_name, ninsns, NM_MONITOR_FILTER_MAXINSNS);
+		errno = EINVAL;
+		return -1;
+	}
+
+	clnup = nmctx_malloc(ctx, sizeof(*clnup));
+	if (clnup == NULL) {
+		nmctx_ferror(ctx, "cannot allocate cleanup descriptor");
+		errno = ENOMEM;
+		return -1;
+	}
+
+	size = sizeof(*opt) + ninsns * sizeof(*insns);
+	opt = nmctx_malloc(ctx, size);
+	if (opt == NULL) {
+		nmctx_ferror(ctx, "%s: cannot allocate monitor-filter option",
+				d->hdr.nr_name);
+		nmctx_free(ctx, clnup);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(opt, 0, sizeof(*opt));
+	opt->nro_opt.nro_reqtype = NETMAP_REQ_OPT_MONITOR_FILTER;
+	opt->nro_opt.nro_size = size;
+	opt->nro_snaplen = snaplen;
+	opt->nro_ninsns = ninsns;
+	if (ninsns)
+		memcpy(opt->nro_insns, insns, ninsns * sizeof(*insns));
+	nmreq_push_option(&d->hdr, &opt->nro_opt);
+
+	clnup->up.cleanup = nmport_monitor_filter_cleanup;
+	clnup->opt = opt;
+	nmport_push_cleanup(d, &clnup->up);
+
+	return 0;
+}
+
+struct nmport_monitor_sample_cleanup_d {
+	struct nmport_cleanup_d up;
+	struct nmreq_opt_monitor_sample *opt;
+};
+
+static void
+nmport_monitor_sample_cleanup(struct nmport_cleanup_d *c,
+		struct nmport_d *d)
+{
+	struct nmport_monitor_sample_cleanup_d *cc =
+		(struct nmport_monitor_sample_cleanup_d *)c;
+
+	nmreq_remove_option(&d->hdr, &cc->opt->nro_opt);
+	nmctx_free(d->ctx, cc->opt);
+}
+
+int
+nmport_monitor_sample(struct nmport_d *d, uint32_t rate, uint32_t flags)
+{
+	struct nmctx *ctx = d->ctx;
+	struct nmreq_opt_monitor_sample *opt;
+	struct nmport_monitor_sample_cleanup_d *clnup = NULL;
+
+	if (flags & ~NR_MONITOR_SAMPLE_FLOW) {
+		nmctx_ferror(ctx, "%s: bad monitor sample flags %"PRIu32,
+				d->hdr.nr_name, flags);
+		errno = EINVAL;
+		return -1;
+	}
+
+	clnup = nmctx_malloc(ctx, sizeof(*clnup));
+	if (clnup == NULL) {
+		nmctx_ferror(ctx, "cannot allocate cleanup descriptor");
+		errno = ENOMEM;
+		return -1;
+	}
+
+	opt = nmctx_malloc(ctx, sizeof(*opt));
+	if (opt == NULL) {
+		nmctx_ferror(ctx, "%s: cannot allocate monitor-sample option",
+				d->hdr.nr_name);
+		nmctx_free(ctx, clnup);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(opt, 0, sizeof(*opt));
+	opt->nro_opt.nro_reqtype = NETMAP_REQ_OPT_MONITOR_SAMPLE;
+	opt->nro_rate = rate;
+	opt->nro_flags = flags;
+	nmreq_push_option(&d->hdr, &opt->nro_opt);
+
+	clnup->up.cleanup = nmport_monitor_sample_cleanup;
+	clnup->opt = opt;
+	nmport_push_cleanup(d, &clnup->up);
+
+	return 0;
+}
+
+struct nmport_pipe_fanout_cleanup_d {
+	struct nmport_cleanup_d up;
+	struct nmreq_opt_pipe_fanout *opt;
+};
+
+static void
+nmport_pipe_fanout_cleanup(struct nmport_cleanup_d *c,
+		struct nmport_d *d)
+{
+	struct nmport_pipe_fanout_cleanup_d *cc =
+		(struct nmport_pipe_fanout_cleanup_d *)c;
+
+	nmreq_remove_option(&d->hdr, &cc->opt->nro_opt);
+	nmctx_free(d->ctx, cc->opt);
+}
+
+int
+nmport_pipe_fanout(struct nmport_d *d, uint32_t mode)
+{
+	struct nmctx *ctx = d->ctx;
+	struct nmreq_opt_pipe_fanout *opt;
+	struct nmport_pipe_fanout_cleanup_d *clnup = NULL;
+
+	clnup = nmctx_malloc(ctx, sizeof(*clnup));
+	if (clnup == NULL) {
+		nmctx_ferror(ctx, "cannot allocate cleanup descriptor");
+		errno = ENOMEM;
+		return -1;
+	}
+
+	opt = nmctx_malloc(ctx, sizeof(*opt));
+	if (opt == NULL) {
+		nmctx_ferror(ctx, "%s: cannot allocate pipe-fanout option",
+				d->hdr.nr_name);
+		nmctx_free(ctx, clnup);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(opt, 0, sizeof(*opt));
+	opt->nro_opt.nro_reqtype = NETMAP_REQ_OPT_PIPE_FANOUT;
+	opt->nro_mode = mode;
+	nmreq_push_option(&d->hdr, &opt->nro_opt);
+
+	clnup->up.cleanup = nmport_pipe_fanout_cleanup;
+	clnup->opt = opt;
+	nmport_push_cleanup(d, &clnup->up);
+
+	return 0;
+}
+
+struct nmport_slot_meta_cleanup_d {
+	struct nmport_cleanup_d up;
+	struct nmreq_opt_slot_meta *opt;
+};
+
+static void
+nmport_slot_meta_cleanup(struct nmport_cleanup_d *c,
+		struct nmport_d *d)
+{
+	struct nmport_slot_meta_cleanup_d *cc =
+		(struct nmport_slot_meta_cleanup_d *)c;
+
+	nmreq_remove_option(&d->hdr, &cc->opt->nro_opt);
+	nmctx_free(d->ctx, cc->opt);
+}
+
+int
+nmport_slot_meta(struct nmport_d *d, uint32_t flags)
+{
+	struct nmctx *ctx = d->ctx;
+	struct nmreq_opt_slot_meta *opt;
+	struct nmport_slot_meta_cleanup_d *clnup = NULL;
+
+	clnup = nmctx_malloc(ctx, sizeof(*clnup));
+	if (clnup == NULL) {
+		nmctx_ferror(ctx, "cannot allocate cleanup descriptor");
+		errno = ENOMEM;
+		return -1;
+	}
+
+	opt = nmctx_malloc(ctx, sizeof(*opt));
+	if (opt == NULL) {
+		nmctx_ferror(ctx, "%s: cannot allocate slot-meta option",
+				d->hdr.nr_name);
+		nmctx_free(ctx, clnup);
+		errno = ENOMEM;
+		return -1;
 	}
-	close(fd);
-	fd = -1;
+	memset(opt, 0, sizeof(*opt));
+	opt->nro_opt.nro_reqtype = NETMAP_REQ_OPT_SLOT_META;
+	opt->nro_flags = flags;
+	nmreq_push_option(&d->hdr, &opt->nro_opt);
 
-	clnup->p = p;
-	clnup->size = mapsize;
-	clnup->up.cleanup = nmport_extmem_from_file_cleanup;
+	clnup->up.cleanup = nmport_slot_meta_cleanup;
+	clnup->opt = opt;
 	nmport_push_cleanup(d, &clnup->up);
 
-	if (nmport_extmem(d, p, mapsize) < 0)
-		goto fail;
-
 	return 0;
-
-fail:
-	if (fd >= 0)
-		close(fd);
-	if (clnup != NULL) {
-		if (clnup->up.cleanup != NULL)
-			nmport_pop_cleanup(d);
-		else
-			nmctx_free(ctx, clnup);
-	}
-	return -1;
-}
-
-struct nmreq_pools_info*
-nmport_extmem_getinfo(struct nmport_d *d)
-{
-	if (d->extmem == NULL)
-		return NULL;
-	return &d->extmem->nro_info;
 }
 
-struct nmport_offset_cleanup_d {
+struct nmport_null_traffic_cleanup_d {
 	struct nmport_cleanup_d up;
-	struct nmreq_opt_offsets *opt;
+	struct nmreq_opt_null_traffic *opt;
 };
 
 static void
-nmport_offset_cleanup(struct nmport_cleanup_d *c,
+nmport_null_traffic_cleanup(struct nmport_cleanup_d *c,
 		struct nmport_d *d)
 {
-	struct nmport_offset_cleanup_d *cc =
-		(struct nmport_offset_cleanup_d *)c;
+	struct nmport_null_traffic_cleanup_d *cc =
+		(struct nmport_null_traffic_cleanup_d *)c;
 
 	nmreq_remove_option(&d->hdr, &cc->opt->nro_opt);
 	nmctx_free(d->ctx, cc->opt);
 }
 
 int
-nmport_offset(struct nmport_d *d, uint64_t initial,
-		uint64_t maxoff, uint64_t bits, uint64_t mingap)
+nmport_null_traffic(struct nmport_d *d, uint32_t flags, uint32_t len,
+		uint64_t rate)
 {
 	struct nmctx *ctx = d->ctx;
-	struct nmreq_opt_offsets *opt;
-	struct nmport_offset_cleanup_d *clnup = NULL;
+	struct nmreq_opt_null_traffic *opt;
+	struct nmport_null_traffic_cleanup_d *clnup = NULL;
 
 	clnup = nmctx_malloc(ctx, sizeof(*clnup));
 	if (clnup == NULL) {
@@ -281,20 +839,20 @@ nmport_offset(struct nmport_d *d, uint64_t initial,
 
 	opt = nmctx_malloc(ctx, sizeof(*opt));
 	if (opt == NULL) {
-		nmctx_ferror(ctx, "%s: cannot allocate offset option", d->hdr.nr_name);
+		nmctx_ferror(ctx, "%s: cannot allocate null-traffic option",
+				d->hdr.nr_name);
 		nmctx_free(ctx, clnup);
 		errno = ENOMEM;
 		return -1;
 	}
 	memset(opt, 0, sizeof(*opt));
-	opt->nro_opt.nro_reqtype = NETMAP_REQ_OPT_OFFSETS;
-	opt->nro_offset_bits = bits;
-	opt->nro_initial_offset = initial;
-	opt->nro_max_offset = maxoff;
-	opt->nro_min_gap = mingap;
+	opt->nro_opt.nro_reqtype = NETMAP_REQ_OPT_NULL_TRAFFIC;
+	opt->nro_flags = flags;
+	opt->nro_pkt_len = len;
+	opt->nro_rate = rate;
 	nmreq_push_option(&d->hdr, &opt->nro_opt);
 
-	clnup->up.cleanup = nmport_offset_cleanup;
+	clnup->up.cleanup = nmport_null_traffic_cleanup;
 	clnup->opt = opt;
 	nmport_push_cleanup(d, &clnup->up);
 
@@ -371,6 +929,7 @@ NPOPT_DECL(extmem, 0)
 	NPKEY_DECL(extmem, ring_size, 0)
 	NPKEY_DECL(extmem, buf_num, 0)
 	NPKEY_DECL(extmem, buf_size, 0)
+	NPKEY_DECL(extmem, bufs, 0)
 NPOPT_DECL(conf, 0)
 	NPKEY_DECL(conf, rings, 0)
 	NPKEY_DECL(conf, host_rings, 0)
@@ -384,6 +943,29 @@ NPOPT_DECL(conf, 0)
 NPOPT_DECL(offset, NMREQ_OPTF_DISABLED)
 	NPKEY_DECL(offset, initial, NMREQ_OPTK_DEFAULT|NMREQ_OPTK_MUSTSET)
 	NPKEY_DECL(offset, bits, 0)
+NPOPT_DECL(snaplen, 0)
+	NPKEY_DECL(snaplen, len, NMREQ_OPTK_DEFAULT|NMREQ_OPTK_MUSTSET)
+NPOPT_DECL(sample, 0)
+	NPKEY_DECL(sample, rate, NMREQ_OPTK_DEFAULT|NMREQ_OPTK_MUSTSET)
+	NPKEY_DECL(sample, mode, 0)
+NPOPT_DECL(fanout, 0)
+	NPKEY_DECL(fanout, mode, NMREQ_OPTK_DEFAULT|NMREQ_OPTK_MUSTSET)
+NPOPT_DECL(meta, NMREQ_OPTF_DISABLED)
+	NPKEY_DECL(meta, fields, NMREQ_OPTK_DEFAULT)
+NPOPT_DECL(hugemem, NMREQ_OPTF_ALLOWEMPTY)
+	NPKEY_DECL(hugemem, page, NMREQ_OPTK_DEFAULT)
+	NPKEY_DECL(hugemem, node, 0)
+	NPKEY_DECL(hugemem, if_num, 0)
+	NPKEY_DECL(hugemem, if_size, 0)
+	NPKEY_DECL(hugemem, ring_num, 0)
+	NPKEY_DECL(hugemem, ring_size, 0)
+	NPKEY_DECL(hugemem, buf_num, 0)
+	NPKEY_DECL(hugemem, buf_size, 0)
+NPOPT_DECL(null, NMREQ_OPTF_ALLOWEMPTY)
+	NPKEY_DECL(null, mode, NMREQ_OPTK_DEFAULT)
+	NPKEY_DECL(null, len, 0)
+	NPKEY_DECL(null, rate, 0)
+NPOPT_DECL(prefault, NMREQ_OPTF_ALLOWEMPTY)
 
 
 static int
@@ -412,6 +994,7 @@ NPOPT_PARSER(extmem)(struct nmreq_parse_ctx *p)
 {
 	struct nmport_d *d;
 	struct nmreq_pools_info *pi;
+	struct nmreq_opt_extmem_bufs *bo = NULL;
 	int i;
 
 	d = p->token;
@@ -421,6 +1004,18 @@ NPOPT_PARSER(extmem)(struct nmreq_parse_ctx *p)
 
 	pi = &d->extmem->nro_info;
 
+	if (nmport_key(p, extmem, bufs) != NULL) {
+		void *b;
+		size_t size;
+
+		if (nmport_map_file(d, nmport_key(p, extmem, bufs), &b,
+					&size) < 0)
+			return -1;
+		if (nmport_extmem_bufs(d, b, size) < 0)
+			return -1;
+		bo = nmport_extmem_bufs_getinfo(d);
+	}
+
 	for  (i = 0; i < NPOPT_NRKEYS(extmem); i++) {
 		const char *k = p->keys[i];
 		uint32_t v;
@@ -438,9 +1033,15 @@ NPOPT_PARSER(extmem)(struct nmreq_parse_ctx *p)
 		} else if (i == NPKEY_ID(extmem, ring_size)) {
 			pi->nr_ring_pool_objsize = v;
 		} else if (i == NPKEY_ID(extmem, buf_num)) {
-			pi->nr_buf_pool_objtotal = v;
+			if (bo != NULL)
+				bo->nro_buf_num = v;
+			else
+				pi->nr_buf_pool_objtotal = v;
 		} else if (i == NPKEY_ID(extmem, buf_size)) {
-			pi->nr_buf_pool_objsize = v;
+			if (bo != NULL)
+				bo->nro_buf_size = v;
+			else
+				pi->nr_buf_pool_objsize = v;
 		}
 	}
 	return 0;
@@ -505,6 +1106,143 @@ NPOPT_PARSER(offset)(struct nmreq_parse_ctx *p)
 	return nmport_offset(d, initial, initial, bits, 0);
 }
 
+static int
+NPOPT_PARSER(snaplen)(struct nmreq_parse_ctx *p)
+{
+	struct nmport_d *d = p->token;
+
+	return nmport_monitor_filter(d, atoi(nmport_key(p, snaplen, len)),
+			NULL, 0);
+}
+
+static int
+NPOPT_PARSER(sample)(struct nmreq_parse_ctx *p)
+{
+	struct nmport_d *d = p->token;
+	const char *mode = nmport_key(p, sample, mode);
+	uint32_t flags = 0;
+
+	if (mode != NULL && !strcmp(mode, "flow")) {
+		flags = NR_MONITOR_SAMPLE_FLOW;
+	} else if (mode != NULL && strcmp(mode, "frame")) {
+		nmctx_ferror(p->ctx, "unknown sample mode '%s' "
+				"(use 'frame' or 'flow')", mode);
+		errno = EINVAL;
+		return -1;
+	}
+	return nmport_monitor_sample(d, atoi(nmport_key(p, sample, rate)),
+			flags);
+}
+
+static int
+NPOPT_PARSER(fanout)(struct nmreq_parse_ctx *p)
+{
+	struct nmport_d *d = p->token;
+	const char *mode = nmport_key(p, fanout, mode);
+
+	if (!strcmp(mode, "rr"))
+		return nmport_pipe_fanout(d, NM_PIPE_FANOUT_RR);
+	if (!strcmp(mode, "hash"))
+		return nmport_pipe_fanout(d, NM_PIPE_FANOUT_HASH);
+	nmctx_ferror(p->ctx, "unknown fanout mode '%s' (use 'rr' or 'hash')",
+			mode);
+	errno = EINVAL;
+	return -1;
+}
+
+static int
+NPOPT_PARSER(meta)(struct nmreq_parse_ctx *p)
+{
+	struct nmport_d *d = p->token;
+	const char *fields = nmport_key(p, meta, fields);
+
+	return nmport_slot_meta(d, fields != NULL ?
+			strtoul(fields, NULL, 0) : ~0U);
+}
+
+static int
+NPOPT_PARSER(hugemem)(struct nmreq_parse_ctx *p)
+{
+	struct nmport_d *d = p->token;
+	struct nmreq_pools_info pi;
+	const char *page = nmport_key(p, hugemem, page);
+	const char *node = nmport_key(p, hugemem, node);
+	size_t pagesize = 0;
+	int i;
+
+	if (page != NULL && !strcasecmp(page, "2M")) {
+		pagesize = NMPORT_HUGE_2M;
+	} else if (page != NULL && !strcasecmp(page, "1G")) {
+		pagesize = NMPORT_HUGE_1G;
+	} else if (page != NULL && *page != '\0' && strcmp(page, "auto")) {
+		nmctx_ferror(p->ctx, "unknown page size '%s' (use '2M' or '1G')",
+				page);
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&pi, 0, sizeof(pi));
+	for  (i = 0; i < NPOPT_NRKEYS(hugemem); i++) {
+		const char *k = p->keys[i];
+		uint32_t v;
+
+		if (k == NULL)
+			continue;
+
+		v = atoi(k);
+		if (i == NPKEY_ID(hugemem, if_num)) {
+			pi.nr_if_pool_objtotal = v;
+		} else if (i == NPKEY_ID(hugemem, if_size)) {
+			pi.nr_if_pool_objsize = v;
+		} else if (i == NPKEY_ID(hugemem, ring_num)) {
+			pi.nr_ring_pool_objtotal = v;
+		} else if (i == NPKEY_ID(hugemem, ring_size)) {
+			pi.nr_ring_pool_objsize = v;
+		} else if (i == NPKEY_ID(hugemem, buf_num)) {
+			pi.nr_buf_pool_objtotal = v;
+		} else if (i == NPKEY_ID(hugemem, buf_size)) {
+			pi.nr_buf_pool_objsize = v;
+		}
+	}
+	return nmport_extmem_hugepages(d, &pi, pagesize,
+			node != NULL ? atoi(node) : NMPORT_NUMA_AUTO);
+}
+
+static int
+NPOPT_PARSER(prefault)(struct nmreq_parse_ctx *p)
+{
+	return nmport_prefault(p->token);
+}
+
+static int
+NPOPT_PARSER(null)(struct nmreq_parse_ctx *p)
+{
+	struct nmport_d *d = p->token;
+	const char *mode = nmport_key(p, null, mode);
+	const char *len = nmport_key(p, null, len);
+	const char *rate = nmport_key(p, null, rate);
+	uint32_t flags;
+
+	if (mode == NULL || *mode == '\0' || !strcmp(mode, "both")) {
+		flags = NR_NULL_SOURCE | NR_NULL_SINK;
+	} else if (!strcmp(mode, "source")) {
+		flags = NR_NULL_SOURCE;
+	} else if (!strcmp(mode, "sink")) {
+		flags = NR_NULL_SINK;
+	} else {
+		nmctx_ferror(p->ctx, "unknown null mode '%s' "
+				"(use 'source', 'sink' or 'both')", mode);
+		errno = EINVAL;
+		return -1;
+	}
+	/* the port is a null port on an existing allocator */
+	d->reg.nr_mode = NR_REG_NULL;
+	if (d->reg.nr_mem_id == 0)
+		d->reg.nr_mem_id = 1;
+	return nmport_null_traffic(d, flags, len != NULL ? atoi(len) : 0,
+			rate != NULL ? strtoull(rate, NULL, 0) : 0);
+}
+
 
 void
 nmport_disable_option(const char *opt)
@@ -651,16 +1389,84 @@ nmport_undo_register(struct nmport_d *d)
 	d->register_done = 0;
 }
 
+/* point d to the memory region m and find the bound rings */
+static void
+nmport_attach_mem(struct nmport_d *d, struct nmem_d *m)
+{
+	u_int num_tx, num_rx;
+	unsigned int i;
+
+	d->mem = m;
+
+	d->nifp = NETMAP_IF(m->mem, d->reg.nr_offset);
+
+	num_tx = d->reg.nr_tx_rings + d->nifp->ni_host_tx_rings;
+	for (i = 0; i < num_tx && !d->nifp->ring_ofs[i]; i++)
+		;
+	d->cur_tx_ring = d->first_tx_ring = i;
+	for ( ; i < num_tx && d->nifp->ring_ofs[i]; i++)
+		;
+	d->last_tx_ring = i - 1;
+
+	num_rx = d->reg.nr_rx_rings + d->nifp->ni_host_rx_rings;
+	for (i = 0; i < num_rx && !d->nifp->ring_ofs[i + num_tx]; i++)
+		;
+	d->cur_rx_ring = d->first_rx_ring = i;
+	for ( ; i < num_rx && d->nifp->ring_ofs[i + num_tx]; i++)
+		;
+	d->last_rx_ring = i - 1;
+
+	d->mmap_done = 1;
+}
+
+static struct nmem_d *
+nmport_find_mem(struct nmctx *ctx, uint16_t mem_id)
+{
+	struct nmem_d *m;
+
+	for (m = ctx->mem_descs; m != NULL; m = m->next)
+		if (m->mem_id == mem_id)
+			break;
+	return m;
+}
+
+int
+nmport_prefault(struct nmport_d *d)
+{
+	if (d->mmap_done) {
+		errno = EINVAL;
+		nmctx_ferror(d->ctx, "%s: already mapped", d->hdr.nr_name);
+		return -1;
+	}
+	d->prefault = 1;
+	return 0;
+}
+
+/* read a byte of each page of m, to fault them in */
+static void
+nmport_mem_prefault(struct nmem_d *m)
+{
+	size_t pgsz = (size_t)sysconf(_SC_PAGESIZE);
+	const volatile char *p = m->mem;
+	size_t i;
+
+	if (m->is_extmem || __atomic_load_n(&m->prefaulted, __ATOMIC_RELAXED))
+		return;
+	for (i = 0; i < m->size; i += pgsz)
+		(void)p[i];
+	__atomic_store_n(&m->prefaulted, 1, __ATOMIC_RELAXED);
+}
+
 /* lookup the mem_id in the mem-list: do a new mmap() if
- * not found, reuse existing otherwise
+ * not found, reuse existing otherwise. The mmap() is done
+ * without holding the ctx lock, so that threads opening
+ * ports on different regions do not wait for each other.
  */
 int
 nmport_mmap(struct nmport_d *d)
 {
 	struct nmctx *ctx = d->ctx;
-	struct nmem_d *m = NULL;
-	u_int num_tx, num_rx;
-	unsigned int i;
+	struct nmem_d *m = NULL, *nm = NULL;
 
 	if (d->mmap_done) {
 		errno = EINVAL;
@@ -675,67 +1481,72 @@ nmport_mmap(struct nmport_d *d)
 	}
 
 	nmctx_lock(ctx);
-
-	for (m = ctx->mem_descs; m != NULL; m = m->next)
-		if (m->mem_id == d->reg.nr_mem_id)
-			break;
+	m = nmport_find_mem(ctx, d->reg.nr_mem_id);
+	if (m != NULL)
+		__atomic_add_fetch(&m->refcount, 1, __ATOMIC_RELAXED);
+	nmctx_unlock(ctx);
 
 	if (m == NULL) {
-		m = nmctx_malloc(ctx, sizeof(*m));
-		if (m == NULL) {
+		nm = nmctx_malloc(ctx, sizeof(*nm));
+		if (nm == NULL) {
 			nmctx_ferror(ctx, "cannot allocate memory descriptor");
 			goto err;
 		}
-		memset(m, 0, sizeof(*m));
+		memset(nm, 0, sizeof(*nm));
 		if (d->extmem != NULL) {
-			m->mem = (void *)((uintptr_t)d->extmem->nro_usrptr);
-			m->size = d->extmem->nro_info.nr_memsize;
-			m->is_extmem = 1;
+			nm->mem = (void *)((uintptr_t)d->extmem->nro_usrptr);
+			nm->size = d->extmem->nro_info.nr_memsize;
+			nm->is_extmem = 1;
 		} else {
-			m->mem = mmap(NULL, d->reg.nr_memsize, PROT_READ|PROT_WRITE,
-					MAP_SHARED, d->fd, 0);
-			if (m->mem == MAP_FAILED) {
+			int flags = MAP_SHARED;
+
+#ifdef MAP_POPULATE
+			if (d->prefault) {
+				flags |= MAP_POPULATE;
+				nm->prefaulted = 1;
+			}
+#endif
+			nm->mem = mmap(NULL, d->reg.nr_memsize, PROT_READ|PROT_WRITE,
+					flags, d->fd, 0);
+			if (nm->mem == MAP_FAILED) {
 				nmctx_ferror(ctx, "mmap: %s", strerror(errno));
 				goto err;
 			}
-			m->size = d->reg.nr_memsize;
+			nm->size = d->reg.nr_memsize;
+		}
+		nm->mem_id = d->reg.nr_mem_id;
+		nm->refcount = 1;
+
+		nmctx_lock(ctx);
+		/* somebody may have mapped the same region meanwhile */
+		m = nmport_find_mem(ctx, d->reg.nr_mem_id);
+		if (m != NULL) {
+			__atomic_add_fetch(&m->refcount, 1, __ATOMIC_RELAXED);
+		} else {
+			m = nm;
+			nm = NULL;
+			m->next = ctx->mem_descs;
+			if (ctx->mem_descs != NULL)
+				ctx->mem_descs->prev = m;
+			ctx->mem_descs = m;
+		}
+		nmctx_unlock(ctx);
+		if (nm != NULL) {
+			if (!nm->is_extmem)
+				munmap(nm->mem, nm->size);
+			nmctx_free(ctx, nm);
 		}
-		m->mem_id = d->reg.nr_mem_id;
-		m->next = ctx->mem_descs;
-		if (ctx->mem_descs != NULL)
-			ctx->mem_descs->prev = m;
-		ctx->mem_descs = m;
 	}
-	m->refcount++;
-
-	nmctx_unlock(ctx);
-
-	d->mem = m;
-
-	d->nifp = NETMAP_IF(m->mem, d->reg.nr_offset);
-
-	num_tx = d->reg.nr_tx_rings + d->nifp->ni_host_tx_rings;
-	for (i = 0; i < num_tx && !d->nifp->ring_ofs[i]; i++)
-		;
-	d->cur_tx_ring = d->first_tx_ring = i;
-	for ( ; i < num_tx && d->nifp->ring_ofs[i]; i++)
-		;
-	d->last_tx_ring = i - 1;
-
-	num_rx = d->reg.nr_rx_rings + d->nifp->ni_host_rx_rings;
-	for (i = 0; i < num_rx && !d->nifp->ring_ofs[i + num_tx]; i++)
-		;
-	d->cur_rx_ring = d->first_rx_ring = i;
-	for ( ; i < num_rx && d->nifp->ring_ofs[i + num_tx]; i++)
-		;
-	d->last_rx_ring = i - 1;
 
-	d->mmap_done = 1;
+	nmport_attach_mem(d, m);
+	if (d->prefault)
+		nmport_mem_prefault(m);
 
 	return 0;
 
 err:
-	nmctx_unlock(ctx);
+	if (nm != NULL)
+		nmctx_free(ctx, nm);
 	nmport_undo_mmap(d);
 	return -1;
 }
@@ -750,8 +1561,7 @@ nmport_undo_mmap(struct nmport_d *d)
 	if (m == NULL)
 		return;
 	nmctx_lock(ctx);
-	m->refcount--;
-	if (m->refcount <= 0) {
+	if (__atomic_sub_fetch(&m->refcount, 1, __ATOMIC_ACQ_REL) <= 0) {
 		if (!m->is_extmem && m->mem != MAP_FAILED)
 			munmap(m->mem, m->size);
 		/* extract from the list and free */
@@ -859,6 +1669,7 @@ nmport_clone(struct nmport_d *d)
 	c->register_done = 0;
 	c->mem = NULL;
 	c->extmem = NULL;
+	c->prefault = d->prefault;
 	c->mmap_done = 0;
 	c->first_tx_ring = 0;
 	c->last_tx_ring = 0;
@@ -870,6 +1681,43 @@ nmport_clone(struct nmport_d *d)
 	return c;
 }
 
+struct nmport_d *
+nmport_open_ring(struct nmport_d *d, uint32_t mode, uint16_t ringid)
+{
+	struct nmport_d *c;
+	struct nmem_d *m = d->mem;
+
+	if (!d->mmap_done) {
+		errno = EINVAL;
+		nmctx_ferror(d->ctx, "%s: not mapped", d->hdr.nr_name);
+		return NULL;
+	}
+
+	c = nmport_clone(d);
+	if (c == NULL)
+		return NULL;
+	c->reg.nr_mode = mode;
+	c->reg.nr_ringid = ringid;
+	/* the kernel must use the region we have already mapped */
+	c->reg.nr_mem_id = d->reg.nr_mem_id;
+	if (nmport_register(c) < 0)
+		goto err;
+	if (c->reg.nr_mem_id != m->mem_id) {
+		errno = EINVAL;
+		nmctx_ferror(c->ctx, "%s: unexpected mem_id %u",
+				c->hdr.nr_name, c->reg.nr_mem_id);
+		goto err;
+	}
+	/* d holds a reference to m, no need to lock the ctx */
+	__atomic_add_fetch(&m->refcount, 1, __ATOMIC_RELAXED);
+	nmport_attach_mem(c, m);
+	return c;
+
+err:
+	nmport_close(c);
+	return NULL;
+}
+
 int
 nmport_inject(struct nmport_d *d, const void *buf, size_t size)
 {
@@ -912,3 +1760,132 @@ nmport_inject(struct nmport_d *d, const void *buf, size_t size)
 	}
 	return 0; /* fail */
 }
+
+static inline void
+nmport_prefetch(const void *p, int rw)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	if (rw)
+		__builtin_prefetch(p, 1);
+	else
+		__builtin_prefetch(p, 0);
+#else
+	(void)p;
+	(void)rw;
+#endif
+}
+
+void
+nmport_rx_release(struct nmport_d *d)
+{
+	u_int ri;
+
+	for (ri = d->first_rx_ring; ri <= d->last_rx_ring; ri++) {
+		struct netmap_ring *ring = NETMAP_RXRING(d->nifp, ri);
+
+		ring->head = ring->cur;
+	}
+}
+
+unsigned int
+nmport_rx_burst(struct nmport_d *d, struct nmport_pkt *pkts,
+		unsigned int n, int flags)
+{
+	u_int c, ri, nr = d->last_rx_ring - d->first_rx_ring + 1;
+	unsigned int got = 0;
+	int synced = 0;
+
+	if (d->first_rx_ring > d->last_rx_ring)
+		return 0;
+	nmport_rx_release(d);
+	for (;;) {
+		for (c = 0, ri = d->cur_rx_ring; c < nr && got < n; c++, ri++) {
+			struct netmap_ring *ring;
+			uint32_t i;
+
+			if (ri > d->last_rx_ring)
+				ri = d->first_rx_ring;
+			ring = NETMAP_RXRING(d->nifp, ri);
+			for (i = ring->cur; i != ring->tail && got < n;
+					i = nm_ring_next(ring, i)) {
+				struct nmport_pkt *p = &pkts[got++];
+
+				p->ring = ring;
+				p->slot = &ring->slot[i];
+				p->buf = NETMAP_BUF_OFFSET(ring, p->slot);
+				if (flags & NMPORT_BURST_PREFETCH)
+					nmport_prefetch(p->buf, 0);
+			}
+			ring->cur = i;
+		}
+		if (got > 0 || !(flags & NMPORT_BURST_SYNC) || synced)
+			break;
+		if (ioctl(d->fd, NIOCRXSYNC, NULL) < 0)
+			break;
+		synced = 1;
+	}
+	/* do not let a busy ring starve the others */
+	if (++d->cur_rx_ring > d->last_rx_ring)
+		d->cur_rx_ring = d->first_rx_ring;
+	return got;
+}
+
+unsigned int
+nmport_tx_burst(struct nmport_d *d, struct nmport_pkt *pkts,
+		unsigned int n, int flags)
+{
+	u_int c, ri, nr = d->last_tx_ring - d->first_tx_ring + 1;
+	unsigned int got = 0;
+	int synced = 0;
+
+	if (d->first_tx_ring > d->last_tx_ring)
+		return 0;
+	for (;;) {
+		for (c = 0, ri = d->cur_tx_ring; c < nr && got < n; c++, ri++) {
+			struct netmap_ring *ring;
+			uint32_t i;
+
+			if (ri > d->last_tx_ring)
+				ri = d->first_tx_ring;
+			ring = NETMAP_TXRING(d->nifp, ri);
+			if (got == 0 && ring->cur != ring->tail)
+				d->cur_tx_ring = ri; /* keep using this one */
+			for (i = ring->cur; i != ring->tail && got < n;
+					i = nm_ring_next(ring, i)) {
+				struct nmport_pkt *p = &pkts[got++];
+
+				p->ring = ring;
+				p->slot = &ring->slot[i];
+				p->buf = NETMAP_BUF_OFFSET(ring, p->slot);
+				if (flags & NMPORT_BURST_PREFETCH)
+					nmport_prefetch(p->buf, 1);
+			}
+		}
+		if (got > 0 || !(flags & NMPORT_BURST_SYNC) || synced)
+			break;
+		if (ioctl(d->fd, NIOCTXSYNC, NULL) < 0)
+			break;
+		synced = 1;
+	}
+	return got;
+}
+
+int
+nmport_tx_commit(struct nmport_d *d, const struct nmport_pkt *pkts,
+		unsigned int n, int flags)
+{
+	unsigned int k;
+
+	/* the slots of each ring are contiguous, the last one moves head */
+	for (k = 0; k < n; k++) {
+		struct netmap_ring *ring = pkts[k].ring;
+
+		if (k + 1 < n && pkts[k + 1].ring == ring)
+			continue;
+		ring->head = ring->cur =
+			nm_ring_next(ring, pkts[k].slot - ring->slot);
+	}
+	if ((flags & NMPORT_BURST_SYNC) && ioctl(d->fd, NIOCTXSYNC, NULL) < 0)
+		return -1;
+	return 0;
+}
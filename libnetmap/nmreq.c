@@ -340,12 +340,18 @@ nmreq_register_decode(const char **pifname, struct nmreq_register *r, struct nmc
 			case 'r':
 				nr_flags |= NR_MONITOR_RX;
 				break;
+			case 'd':
+				nr_flags |= NR_MONITOR_DEFER;
+				break;
 			case 'R':
 				nr_flags |= NR_RX_RINGS_ONLY;
 				break;
 			case 'T':
 				nr_flags |= NR_TX_RINGS_ONLY;
 				break;
+			case 'p':
+				nr_flags |= NR_RING_POLL;
+				break;
 			default:
 				nmctx_ferror(ctx, "unrecognized flag: '%c'", *scan);
 				goto fail;
@@ -658,6 +664,28 @@ nmreq_option_name(uint32_t nro_reqtype)
 		return "sync-kloop-mode";
 	case NETMAP_REQ_OPT_OFFSETS:
 		return "offsets";
+	case NETMAP_REQ_OPT_VALE_HASH:
+		return "vale-hash";
+	case NETMAP_REQ_OPT_NUMA:
+		return "numa";
+	case NETMAP_REQ_OPT_MONITOR_FILTER:
+		return "monitor-filter";
+	case NETMAP_REQ_OPT_PIPE_FANOUT:
+		return "pipe-fanout";
+	case NETMAP_REQ_OPT_SYNC_KLOOP_SCHED:
+		return "sync-kloop-sched";
+	case NETMAP_REQ_OPT_SLOT_META:
+		return "slot-meta";
+	case NETMAP_REQ_OPT_BUF_SIZE:
+		return "buf-size";
+	case NETMAP_REQ_OPT_EXTMEM_BUFS:
+		return "extmem-bufs";
+	case NETMAP_REQ_OPT_NULL_TRAFFIC:
+		return "null-traffic";
+	case NETMAP_REQ_OPT_SYNC_KLOOP_PORTS:
+		return "sync-kloop-ports";
+	case NETMAP_REQ_OPT_MONITOR_SAMPLE:
+		return "monitor-sample";
 	default:
 		return "unknown";
 	}
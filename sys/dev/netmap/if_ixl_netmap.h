@@ -371,7 +371,7 @@ ixl_netmap_rxsync(struct netmap_kring *kring, int flags)
 	 * nm_i == (nic_i + kring->nkr_hwofs) % ring_size
 	 */
 	nm_i = kring->nr_hwcur;
-	if (nm_i != head) {
+	if (nm_i != head && !nm_kr_rxrefill_defer(kring, head)) {
 		nic_i = netmap_idx_k2n(kring, nm_i);
 		for (n = 0; nm_i != head; n++) {
 			struct netmap_slot *slot = &ring->slot[nm_i];
@@ -44,6 +44,7 @@
 #include <sys/mutex.h>
 #include <sys/taskqueue.h>
 #include <sys/smp.h>
+#include <sys/cpuset.h>
 #include <sys/time.h>
 #include <machine/smp.h>
 
@@ -140,6 +141,7 @@ struct ptnet_queue {
 #endif /* PTNETMAP_STATS */
 	struct taskqueue		*taskq;
 	struct task			task;
+	int				cpu;	/* for irq and taskq */
 	char				lock_name[16];
 };
 
@@ -171,6 +173,10 @@ struct ptnet_softc {
 	struct nm_csb_ktoa	*csb_hg;
 
 	unsigned int		min_tx_space;
+#ifdef MBUF_HASHFLAG_L4
+	/* Key for the TX queue selection of mbufs without a flowid. */
+	uint32_t		hash_key;
+#endif
 
 	struct netmap_pt_guest_adapter *ptna;
 
@@ -457,6 +463,13 @@ ptnet_attach(device_t dev)
 	}
 
 	ifp->if_capenable = ifp->if_capabilities;
+	/* A TSO packet, with its Ethernet (and 802.1Q) header, must fit
+	 * the slots reserved by min_tx_space. */
+	ifp->if_hw_tsomax = PTNET_MAX_PKT_SIZE -
+			    (ETHER_HDR_LEN + ETHER_VLAN_ENCAP_LEN);
+#ifdef MBUF_HASHFLAG_L4
+	sc->hash_key = m_ether_tcpip_hash_init();
+#endif
 #ifdef DEVICE_POLLING
 	/* Don't enable polling by default. */
 	ifp->if_capabilities |= IFCAP_POLLING;
@@ -666,7 +679,19 @@ ptnet_irqs_init(struct ptnet_softc *sc)
 		}
 	}
 
+	/* The TX and RX queues of the same pair share a CPU, so that the
+	 * flows hashed to a TX queue are served on the same CPU as their
+	 * reverse direction. */
 	cpu_cur = CPU_FIRST();
+	for (i = 0; i < nvecs; i++) {
+		struct ptnet_queue *pq = sc->queues + i;
+
+		if (i == sc->num_tx_rings)
+			cpu_cur = CPU_FIRST();
+		pq->cpu = cpu_cur;
+		cpu_cur = CPU_NEXT(cpu_cur);
+	}
+
 	for (i = 0; i < nvecs; i++) {
 		struct ptnet_queue *pq = sc->queues + i;
 		void (*handler)(void *) = ptnet_tx_intr;
@@ -684,17 +709,16 @@ ptnet_irqs_init(struct ptnet_softc *sc)
 		}
 
 		bus_describe_intr(dev, pq->irq, pq->cookie, "q%d", i);
-#if 0
-		bus_bind_intr(sc->dev, pq->irq, cpu_cur);
-#endif
-		cpu_cur = CPU_NEXT(cpu_cur);
+		if (mp_ncpus > 1) {
+			bus_bind_intr(sc->dev, pq->irq, pq->cpu);
+		}
 	}
 
 	device_printf(dev, "Allocated %d MSI-X vectors\n", nvecs);
 
-	cpu_cur = CPU_FIRST();
 	for (i = 0; i < nvecs; i++) {
 		struct ptnet_queue *pq = sc->queues + i;
+		cpuset_t cpu_mask;
 
 		if (i < sc->num_tx_rings)
 			TASK_INIT(&pq->task, 0, ptnet_tx_task, pq);
@@ -703,9 +727,10 @@ ptnet_irqs_init(struct ptnet_softc *sc)
 
 		pq->taskq = taskqueue_create_fast("ptnet_queue", M_NOWAIT,
 					taskqueue_thread_enqueue, &pq->taskq);
-		taskqueue_start_threads(&pq->taskq, 1, PI_NET, "%s-pq-%d",
-					device_get_nameunit(sc->dev), cpu_cur);
-		cpu_cur = CPU_NEXT(cpu_cur);
+		CPU_SETOF(pq->cpu, &cpu_mask);
+		taskqueue_start_threads_cpuset(&pq->taskq, 1, PI_NET,
+					&cpu_mask, "%s-pq-%d",
+					device_get_nameunit(sc->dev), pq->cpu);
 	}
 
 	return 0;
@@ -1600,9 +1625,19 @@ ptnet_transmit(if_t ifp, struct mbuf *m)
 		m->m_flags &= ~M_VLANTAG;
 	}
 
-	/* Get the flow-id if available. */
-	queue_idx = (M_HASHTYPE_GET(m) != M_HASHTYPE_NONE) ?
-		    m->m_pkthdr.flowid : curcpu;
+	/* Get the flow-id if available, otherwise hash the addresses and
+	 * ports, so that the packets of a flow do not move across queues
+	 * (and get reordered) when the sending thread migrates. */
+	if (M_HASHTYPE_GET(m) != M_HASHTYPE_NONE) {
+		queue_idx = m->m_pkthdr.flowid;
+	} else {
+#ifdef MBUF_HASHFLAG_L4
+		queue_idx = m_ether_tcpip_hash(MBUF_HASHFLAG_L3 |
+				MBUF_HASHFLAG_L4, m, sc->hash_key);
+#else
+		queue_idx = curcpu;
+#endif
+	}
 
 	if (unlikely(queue_idx >= sc->num_tx_rings)) {
 		queue_idx %= sc->num_tx_rings;
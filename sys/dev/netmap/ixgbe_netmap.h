@@ -231,7 +231,12 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 
 	nm_i = kring->nr_hwcur;
 	if (nm_i != head) {	/* we have new packets to send */
+		/* end of the last complete packet */
+		u_int nm_eop, nic_eop;
+
 		nic_i = netmap_idx_k2n(kring, nm_i);
+		nm_eop = nm_i;
+		nic_eop = nic_i;
 
 		__builtin_prefetch(&ring->slot[nm_i]);
 		__builtin_prefetch(&txr->tx_buffers[nic_i]);
@@ -248,6 +253,9 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 			int flags = (slot->flags & NS_REPORT ||
 				nic_i == 0 || nic_i == report_frequency) ?
 				IXGBE_TXD_CMD_RS : 0;
+			/* only the last descriptor of a packet has EOP */
+			int eop = (slot->flags & NS_MOREFRAG) ?
+				0 : IXGBE_TXD_CMD_EOP;
 
 			/* prefetch for next round */
 			__builtin_prefetch(&ring->slot[nm_i + 1]);
@@ -266,7 +274,7 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 			curr->read.buffer_addr = htole64(paddr);
 			curr->read.olinfo_status = 0;
 			curr->read.cmd_type_len = htole32(len | flags |
-				IXGBE_ADVTXD_DCMD_IFCS | IXGBE_TXD_CMD_EOP);
+				IXGBE_ADVTXD_DCMD_IFCS | eop);
 
 			/* make sure changes to the buffer are synced */
 			bus_dmamap_sync(txr->txtag, txbuf->map,
@@ -274,15 +282,21 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 
 			nm_i = nm_next(nm_i, lim);
 			nic_i = nm_next(nic_i, lim);
+			if (eop) {
+				nm_eop = nm_i;
+				nic_eop = nic_i;
+			}
 		}
-		kring->nr_hwcur = head;
+		/* a packet not completed before head waits for the
+		 * next txsync */
+		kring->nr_hwcur = nm_eop;
 
 		/* synchronize the NIC ring */
 		bus_dmamap_sync(txr->txdma.dma_tag, txr->txdma.dma_map,
 			BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
 
-		/* (re)start the tx unit up to slot nic_i (excluded) */
-		IXGBE_WRITE_REG(&adapter->hw, txr->tail, nic_i);
+		/* (re)start the tx unit up to slot nic_eop (excluded) */
+		IXGBE_WRITE_REG(&adapter->hw, txr->tail, nic_eop);
 	}
 
 	/*
@@ -397,6 +411,7 @@ ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
 	 */
 	if (netmap_no_pendintr || force_update) {
 		int crclen = (ix_crcstrip || IXGBE_IS_VF(adapter) ) ? 0 : 4;
+		u_int new_hwtail = (u_int)-1;
 
 		nic_i = rxr->next_to_check; // or also k2n(kring->nr_hwtail)
 		nm_i = netmap_idx_n2k(kring, nic_i);
@@ -404,15 +419,24 @@ ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
 		for (n = 0; ; n++) {
 			union ixgbe_adv_rx_desc *curr = &rxr->rx_base[nic_i];
 			uint32_t staterr = le32toh(curr->wb.upper.status_error);
+			u_int len = le16toh(curr->wb.upper.length);
+			int complete;
 
 			if ((staterr & IXGBE_RXD_STAT_DD) == 0)
 				break;
-			ring->slot[nm_i].len = le16toh(curr->wb.upper.length) - crclen;
-			ring->slot[nm_i].flags = 0;
+			/* frames larger than the buffers span several
+			 * descriptors, the CRC is in the last one */
+			complete = staterr & IXGBE_RXD_STAT_EOP;
+			if (complete && len >= crclen)
+				len -= crclen;
+			ring->slot[nm_i].len = len;
+			ring->slot[nm_i].flags = complete ? 0 : NS_MOREFRAG;
 			bus_dmamap_sync(rxr->ptag,
 			    rxr->rx_buffers[nic_i].pmap, BUS_DMASYNC_POSTREAD);
 			nm_i = nm_next(nm_i, lim);
 			nic_i = nm_next(nic_i, lim);
+			if (complete)
+				new_hwtail = nm_i;
 		}
 		if (n) { /* update the state variables */
 			if (netmap_no_pendintr && !force_update) {
@@ -421,7 +445,9 @@ ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
 				ix_rx_miss_bufs += n;
 			}
 			rxr->next_to_check = nic_i;
-			kring->nr_hwtail = nm_i;
+			/* only expose complete packets to userspace */
+			if (new_hwtail != (u_int)-1)
+				kring->nr_hwtail = new_hwtail;
 		}
 		kring->nr_kflags &= ~NKR_PENDINTR;
 	}
@@ -435,7 +461,7 @@ ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
 	 * nm_i == (nic_i + kring->nkr_hwofs) % ring_size
 	 */
 	nm_i = kring->nr_hwcur;
-	if (nm_i != head) {
+	if (nm_i != head && !nm_kr_rxrefill_defer(kring, head)) {
 		nic_i = netmap_idx_k2n(kring, nm_i);
 		for (n = 0; nm_i != head; n++) {
 			struct netmap_slot *slot = &ring->slot[nm_i];
@@ -479,6 +505,28 @@ ring_reset:
 }
 
 
+/*
+ * The NIC receives into buffers of rx_mbuf_sz bytes and splits larger
+ * frames over more descriptors. init_locked() chooses MJUMPAGESIZE
+ * for jumbo frames; compute the same value here, as rx_mbuf_sz is only
+ * set when the interface is brought up.
+ */
+static int
+ixgbe_netmap_config(struct netmap_adapter *na, struct nm_config_info *info)
+{
+	struct adapter *adapter = na->ifp->if_softc;
+	int ret = netmap_rings_config_get(na, info);
+
+	if (ret)
+		return ret;
+
+	info->rx_buf_maxsize = adapter->max_frame_size <= MCLBYTES ?
+		MCLBYTES : MJUMPAGESIZE;
+
+	return 0;
+}
+
+
 /*
  * The attach routine, called near the end of ixgbe_attach(),
  * fills the parameters for netmap_attach() and calls it.
@@ -494,7 +542,7 @@ ixgbe_netmap_attach(struct adapter *adapter)
 	bzero(&na, sizeof(na));
 
 	na.ifp = adapter->ifp;
-	na.na_flags = NAF_BDG_MAYSLEEP;
+	na.na_flags = NAF_BDG_MAYSLEEP | NAF_MOREFRAG;
 	na.num_tx_desc = adapter->num_tx_desc;
 	na.num_rx_desc = adapter->num_rx_desc;
 	na.nm_txsync = ixgbe_netmap_txsync;
@@ -502,6 +550,7 @@ ixgbe_netmap_attach(struct adapter *adapter)
 	na.nm_register = ixgbe_netmap_reg;
 	na.num_tx_rings = na.num_rx_rings = adapter->num_queues;
 	na.nm_intr = ixgbe_netmap_intr;
+	na.nm_config = ixgbe_netmap_config;
 	netmap_attach(&na);
 }
 
@@ -312,7 +312,8 @@ ports attached to the switch)
  *               netmap_txsync_to_host(na)
  *                 nm_os_send_up()
  *                   FreeBSD: na->if_input() == ether_input()
- *                   linux: netif_rx() with NM_MAGIC_PRIORITY_RX
+ *                   linux: netif_receive_skb_list() (or netif_rx())
+ *                          with NM_MAGIC_PRIORITY_RX
  *
  *
  *               -= SYSTEM DEVICE WITH GENERIC SUPPORT =-
@@ -489,7 +490,10 @@ int netmap_debug;
 
 static int netmap_no_timestamp; /* don't timestamp on rxsync */
 int netmap_no_pendintr = 1;
+int netmap_rx_refill_batch = 32;	/* see nm_kr_rxrefill_defer() */
 int netmap_txsync_retry = 2;
+int netmap_intr_batch = 0;	/* see netmap_bwrap_intr_notify() */
+int netmap_intr_defer_max = 4;
 static int netmap_fwd = 0;	/* force transparent forwarding */
 
 /*
@@ -507,6 +511,15 @@ static int netmap_admode = NETMAP_ADMODE_BEST;
  * nanoseconds. */
 int netmap_generic_mit = 100*1000;
 
+/* With netmap_generic_mit_adaptive, each RX ring uses its own interval,
+ * between netmap_generic_mit_min and netmap_generic_mit. The interval
+ * doubles when more than twice netmap_generic_mit_target packets
+ * arrived during the last one, and halves when less than half of them
+ * did, or when the ring went idle. */
+int netmap_generic_mit_adaptive = 0;
+int netmap_generic_mit_min = 10*1000;
+int netmap_generic_mit_target = 32;
+
 /* We use by default netmap-aware qdiscs with generic netmap adapters,
  * even if there can be a little performance hit with hardware NICs.
  * However, using the qdisc is the safer approach, for two reasons:
@@ -521,18 +534,46 @@ int netmap_generic_mit = 100*1000;
  */
 #ifdef linux
 int netmap_generic_txqdisc = 1;
+
+/*
+ * When generic_txqdisc is 0, generic_txbatch > 1 makes txsync hand
+ * the mbufs directly to the driver in batches of up to generic_txbatch,
+ * deferring the doorbell to the last one of each batch (xmit_more).
+ * Each kring sends on its own device queue, whose lock is taken once
+ * per batch. This skips the qdisc of the device, so it is disabled by
+ * default.
+ */
+int netmap_generic_txbatch = 0;
 #endif
 
 /* Default number of slots and queues for generic adapters. */
 int netmap_generic_ringsize = 1024;
 int netmap_generic_rings = 1;
 
+/* Non-zero to copy received packets into the netmap rings of generic
+ * adapters from the rx handler, rather than queueing them for rxsync. */
+int netmap_generic_rxdirect = 0;
+
 /* Non-zero to enable checksum offloading in NIC drivers */
 int netmap_generic_hwcsum = 0;
 
+#ifdef WITH_TRACE
+/* Sample the latency of one ring notification every trace_sample,
+ * 0 to disable. */
+int netmap_trace_sample = 0;
+#endif /* WITH_TRACE */
+
 /* Non-zero if ptnet devices are allowed to use virtio-net headers. */
 int ptnet_vnet_hdr = 1;
 
+/*
+ * How netmap_transmit() chooses the host rx ring of a packet coming
+ * from the stack: 0 uses the stack tx queue, 1 the flow hash (so that
+ * each flow stays on one ring), 2 the CPU the packet is sent from
+ * (so that a consumer can run on the same CPU as the producers).
+ */
+static int netmap_host_rx_steer = 1;
+
 /*
  * SYSCTL calls are grouped between SYSBEGIN and SYSEND to be emulated
  * in some other operating systems
@@ -552,8 +593,22 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, no_timestamp,
 		CTLFLAG_RW, &netmap_no_timestamp, 0, "no_timestamp");
 SYSCTL_INT(_dev_netmap, OID_AUTO, no_pendintr, CTLFLAG_RW, &netmap_no_pendintr,
 		0, "Always look for new received packets.");
+SYSCTL_INT(_dev_netmap, OID_AUTO, rx_refill_batch, CTLFLAG_RW,
+		&netmap_rx_refill_batch, 0,
+		"Min released slots to refill a NIC rx ring in native mode");
 SYSCTL_INT(_dev_netmap, OID_AUTO, txsync_retry, CTLFLAG_RW,
 		&netmap_txsync_retry, 0, "Number of txsync loops in bridge's flush.");
+SYSCTL_INT(_dev_netmap, OID_AUTO, intr_batch, CTLFLAG_RW,
+		&netmap_intr_batch, 0,
+		"Min new slots to flush a NIC rx ring into a VALE switch");
+SYSCTL_INT(_dev_netmap, OID_AUTO, intr_defer_max, CTLFLAG_RW,
+		&netmap_intr_defer_max, 0,
+		"Max consecutive interrupts deferred by intr_batch");
+#ifdef WITH_TRACE
+SYSCTL_INT(_dev_netmap, OID_AUTO, trace_sample, CTLFLAG_RW,
+		&netmap_trace_sample, 0,
+		"Sample the notification to sync latency every N notifications");
+#endif /* WITH_TRACE */
 
 SYSCTL_INT(_dev_netmap, OID_AUTO, fwd, CTLFLAG_RW, &netmap_fwd, 0,
 		"Force NR_FORWARD mode");
@@ -565,18 +620,37 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, generic_hwcsum, CTLFLAG_RW, &netmap_generic_hw
 		"1 to enable checksum generation by the NIC");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit, CTLFLAG_RW, &netmap_generic_mit,
 		0, "RX notification interval in nanoseconds");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit_adaptive, CTLFLAG_RW,
+		&netmap_generic_mit_adaptive, 0,
+		"Adapt the RX notification interval to the packet rate");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit_min, CTLFLAG_RW,
+		&netmap_generic_mit_min, 0,
+		"Minimum adaptive RX notification interval in nanoseconds");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit_target, CTLFLAG_RW,
+		&netmap_generic_mit_target, 0,
+		"Packets per RX notification sought by adaptive mitigation");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_ringsize, CTLFLAG_RW,
 		&netmap_generic_ringsize, 0,
 		"Number of per-ring slots for emulated netmap mode");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rings, CTLFLAG_RW,
 		&netmap_generic_rings, 0,
 		"Number of TX/RX queues for emulated netmap adapters");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rxdirect, CTLFLAG_RW,
+		&netmap_generic_rxdirect, 0,
+		"Copy received packets into the rings of emulated adapters "
+		"from the rx handler");
 #ifdef linux
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txqdisc, CTLFLAG_RW,
 		&netmap_generic_txqdisc, 0, "Use qdisc for generic adapters");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txbatch, CTLFLAG_RW,
+		&netmap_generic_txbatch, 0,
+		"Max mbufs per driver batch for generic adapters without qdisc");
 #endif
 SYSCTL_INT(_dev_netmap, OID_AUTO, ptnet_vnet_hdr, CTLFLAG_RW, &ptnet_vnet_hdr,
 		0, "Allow ptnet devices to use virtio-net headers");
+SYSCTL_INT(_dev_netmap, OID_AUTO, host_rx_steer, CTLFLAG_RW,
+		&netmap_host_rx_steer, 0,
+		"Host rx ring selection: 0 stack tx queue, 1 flow hash, 2 CPU");
 
 SYSEND;
 
@@ -1097,7 +1171,9 @@ netmap_do_unregif(struct netmap_priv_d *priv)
 	/* possibly decrement counter of tx_si/rx_si users */
 	netmap_unset_ringid(priv);
 	/* delete the nifp */
-	netmap_mem_if_delete(na, priv->np_nifp);
+	netmap_mem_if_delete(na, priv->np_nifp, priv);
+	priv->np_extra_bufs = 0;
+	priv->np_extra_owner = 0;
 	/* drop the allocator */
 	netmap_mem_drop(na);
 	/* mark the priv as unregistered */
@@ -1202,7 +1278,8 @@ netmap_send_up(struct ifnet *dst, struct mbq *q)
 	NET_EPOCH_ENTER(et);
 #endif /* __FreeBSD__ */
 	/* Send packets up, outside the lock; head/prev machinery
-	 * is only useful for Windows. */
+	 * is used by Windows and Linux to deliver the whole batch
+	 * on the last call. */
 	while ((m = mbq_dequeue(q)) != NULL) {
 		if (netmap_debug & NM_DEBUG_HOST)
 			nm_prinf("sending up pkt %p size %d", m, MBUF_LEN(m));
@@ -1384,32 +1461,29 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 	u_int const head = kring->rhead;
 	int ret = 0;
 	struct mbq *q = &kring->rx_queue, fq;
+	struct mbuf *m;
+	u_int first;
 
-	mbq_init(&fq); /* fq holds packets to be freed */
+	mbq_init(&fq); /* fq holds packets to be copied and freed */
 
 	mbq_lock(q);
 
-	/* First part: import newly received packets */
+	/* First part: import newly received packets. We only move
+	 * them to fq and reserve their slots while holding the lock,
+	 * so that netmap_transmit() is not held up by the copies.
+	 * The new hwtail is not visible to userspace before
+	 * we return.
+	 */
+	first = kring->nr_hwtail;
 	n = mbq_len(q);
 	if (n) { /* grab packets from the queue */
-		struct mbuf *m;
 		uint32_t stop_i;
 
 		nm_i = kring->nr_hwtail;
 		stop_i = nm_prev(kring->nr_hwcur, lim);
 		while ( nm_i != stop_i && (m = mbq_dequeue(q)) != NULL ) {
-			int len = MBUF_LEN(m);
-			struct netmap_slot *slot = &ring->slot[nm_i];
-
-			m_copydata(m, 0, len, NMB(na, slot));
-			nm_prdis("nm %d len %d", nm_i, len);
-			if (netmap_debug & NM_DEBUG_HOST)
-				nm_prinf("%s", nm_dump_buf(NMB(na, slot),len, 128, NULL));
-
-			slot->len = len;
-			slot->flags = 0;
-			nm_i = nm_next(nm_i, lim);
 			mbq_enqueue(&fq, m);
+			nm_i = nm_next(nm_i, lim);
 		}
 		kring->nr_hwtail = nm_i;
 	}
@@ -1431,7 +1505,20 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 
 	mbq_unlock(q);
 
-	mbq_purge(&fq);
+	for (nm_i = first; (m = mbq_dequeue(&fq)) != NULL;
+			nm_i = nm_next(nm_i, lim)) {
+		int len = MBUF_LEN(m);
+		struct netmap_slot *slot = &ring->slot[nm_i];
+
+		m_copydata(m, 0, len, NMB(na, slot));
+		nm_prdis("nm %d len %d", nm_i, len);
+		if (netmap_debug & NM_DEBUG_HOST)
+			nm_prinf("%s", nm_dump_buf(NMB(na, slot),len, 128, NULL));
+
+		slot->len = len;
+		slot->flags = 0;
+		m_freem(m);
+	}
 	mbq_fini(&fq);
 
 	return ret;
@@ -1712,6 +1799,7 @@ nm_txsync_prologue(struct netmap_kring *kring, struct netmap_ring *ring)
 	u_int cur = ring->cur; /* read only once */
 	u_int n = kring->nkr_num_slots;
 
+	NM_TRACE(sync, kring, head, cur);
 	nm_prdis(5, "%s kcur %d ktail %d head %d cur %d tail %d",
 		kring->name,
 		kring->nr_hwcur, kring->nr_hwtail,
@@ -1788,6 +1876,7 @@ nm_rxsync_prologue(struct netmap_kring *kring, struct netmap_ring *ring)
 	 */
 	cur = kring->rcur = ring->cur;	/* read only once */
 	head = kring->rhead = ring->head;	/* read only once */
+	NM_TRACE(sync, kring, head, cur);
 #if 1 /* kernel sanity checks */
 	NM_FAIL_ON(kring->nr_hwcur >= n || kring->nr_hwtail >= n);
 #endif /* kernel sanity checks */
@@ -1854,7 +1943,10 @@ netmap_ring_reinit(struct netmap_kring *kring)
 	for (i = 0; i <= lim; i++) {
 		u_int idx = ring->slot[i].buf_idx;
 		u_int len = ring->slot[i].len;
-		if (idx < 2 || idx >= kring->na->na_lut.objtotal) {
+		if (idx < 2 || idx >= kring->na->na_lut.objtotal ||
+		    /* in the room of the pool, not grown yet */
+		    kring->na->na_lut.lut[idx].vaddr ==
+		    NETMAP_BUF_BASE(kring->na)) {
 			nm_prlim(5, "bad index at slot %d idx %d len %d ", i, idx, len);
 			ring->slot[i].buf_idx = 0;
 			ring->slot[i].len = 0;
@@ -2213,9 +2305,11 @@ netmap_csb_validate(struct netmap_priv_d *priv, struct nmreq_opt_csb *csbo)
 			CSB_WRITE(csb_atok, cur, kring->rcur);
 			CSB_WRITE(csb_atok, appl_need_kick, 1);
 			CSB_WRITE(csb_atok, sync_flags, 1);
+			CSB_WRITE(csb_atok, appl_event_idx, kring->nr_hwtail);
 			CSB_WRITE(csb_ktoa, hwcur, kring->nr_hwcur);
 			CSB_WRITE(csb_ktoa, hwtail, kring->nr_hwtail);
 			CSB_WRITE(csb_ktoa, kern_need_kick, 1);
+			CSB_WRITE(csb_ktoa, kern_event_idx, kring->rhead);
 
 			nm_prinf("csb_init for kring %s: head %u, cur %u, "
 				"hwcur %u, hwtail %u", kring->name,
@@ -2227,6 +2321,64 @@ netmap_csb_validate(struct netmap_priv_d *priv, struct nmreq_opt_csb *csbo)
 	return 0;
 }
 
+static inline uint32_t
+nm_rd32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3];
+}
+
+/* symmetric hash of the IP addresses and TCP/UDP ports of a frame, so
+ * that both directions of a flow get the same value (used by the pipe
+ * fan-out and by the monitor sampling). Non-IP frames hash to 0. */
+uint32_t
+nm_flow_hash(const uint8_t *p, u_int len)
+{
+	u_int i, off = 14, l4, proto;
+	uint32_t h = 0;
+	uint16_t etype;
+
+	if (len < 14)
+		return 0;
+	etype = (p[12] << 8) | p[13];
+	if (etype == 0x8100 || etype == 0x88a8) {
+		/* skip one vlan tag */
+		if (len < 18)
+			return 0;
+		etype = (p[16] << 8) | p[17];
+		off = 18;
+	}
+	if (etype == 0x0800) {
+		if (len < off + 20)
+			return 0;
+		proto = p[off + 9];
+		h = nm_rd32(p + off + 12) + nm_rd32(p + off + 16);
+		/* all the fragments must go to the same ring */
+		if ((p[off + 6] & 0x3f) || p[off + 7])
+			proto = 0;
+		l4 = off + ((p[off] & 0xf) << 2);
+	} else if (etype == 0x86dd) {
+		if (len < off + 40)
+			return 0;
+		proto = p[off + 6];
+		for (i = 8; i < 40; i += 4)
+			h += nm_rd32(p + off + i);
+		l4 = off + 40;
+	} else {
+		return 0;
+	}
+	if ((proto == 6 || proto == 17) && len >= l4 + 4)
+		h += ((p[l4] << 8) | p[l4 + 1]) + ((p[l4 + 2] << 8) | p[l4 + 3]);
+	h += proto;
+	/* final mix, from murmur3 */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
 /* Ensure that the netmap adapter can support the given MTU.
  * @return EINVAL if the na cannot be set to mtu, 0 otherwise.
  */
@@ -2404,6 +2556,204 @@ out:
 }
 
 
+/* Handle the slot metadata option, if present in the hdr. It must
+ * come after netmap_offsets_init(), since the metadata is stored in
+ * the room left by the offsets.
+ * Returns 0 on success, or an error.
+ */
+static int
+netmap_meta_init(struct netmap_priv_d *priv, struct nmreq_header *hdr)
+{
+	struct nmreq_opt_slot_meta *opt;
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_kring *kring;
+	uint32_t rx_caps = na->rx_meta_caps | NM_META_SW_CAPS;
+	uint32_t caps = rx_caps | na->tx_meta_caps;
+	uint32_t wanted;
+	u_int i;
+	enum txrx t;
+	int error = 0;
+
+	opt = (struct nmreq_opt_slot_meta *)
+		nmreq_getoption(hdr, NETMAP_REQ_OPT_SLOT_META);
+	if (opt == NULL)
+		return 0;
+
+	wanted = opt->nro_flags & caps;
+	if (wanted == 0) {
+		if (netmap_verbose)
+			nm_prerr("%s cannot provide metadata %x",
+				na->name, opt->nro_flags);
+		error = EOPNOTSUPP;
+		goto out;
+	}
+
+	foreach_selected_ring(priv, t, i, kring) {
+		if (!(wanted & (t == NR_RX ? rx_caps : na->tx_meta_caps)))
+			continue;
+		if (kring->offset_max < sizeof(struct nm_slot_meta)) {
+			if (netmap_verbose)
+				nm_prerr("%s: max offset %llu leaves no room "
+					 "for the metadata", kring->name,
+					 (unsigned long long)kring->offset_max);
+			error = EINVAL;
+			goto out;
+		}
+	}
+
+	/* the metadata only uses the headroom of the buffers, so the
+	 * users of a shared ring can ask for different fields
+	 */
+	foreach_selected_ring(priv, t, i, kring) {
+		kring->meta_flags |= wanted & (t == NR_RX ?
+				rx_caps : na->tx_meta_caps);
+		if (t == NR_RX && (wanted & NM_META_TS) &&
+		    !(na->rx_meta_caps & NM_META_TS) &&
+		    !(kring->nr_kflags & NKR_SWTS)) {
+			kring->sw_ts_last = nm_os_realtime_ns();
+			kring->nr_kflags |= NKR_SWTS;
+		}
+	}
+
+out:
+	opt->nro_opt.nro_status = error;
+	opt->nro_flags = caps;
+	return error;
+}
+
+/* NETMAP_REQ_FLOW_RULE_ADD and NETMAP_REQ_FLOW_RULE_DEL. The rules
+ * belong to the NIC, so any (native or emulated) hardware port will do.
+ */
+static int
+netmap_flow_rule(struct nmreq_header *hdr)
+{
+	struct nmreq_flow_rule *req =
+		(struct nmreq_flow_rule *)(uintptr_t)hdr->nr_body;
+	uint16_t reqtype = hdr->nr_reqtype;
+	struct nmreq_register regreq;
+	struct netmap_adapter *na = NULL;
+	struct ifnet *ifp = NULL;
+	int error;
+
+	/* Build a nmreq_register out of the nmreq_flow_rule,
+	 * so that we can call netmap_get_na(). */
+	bzero(&regreq, sizeof(regreq));
+	regreq.nr_mode = NR_REG_ALL_NIC;
+
+	NMG_LOCK();
+	hdr->nr_reqtype = NETMAP_REQ_REGISTER;
+	hdr->nr_body = (uintptr_t)&regreq;
+	error = netmap_get_na(hdr, &na, &ifp, NULL, 1 /* create */);
+	hdr->nr_reqtype = reqtype; /* reset type */
+	hdr->nr_body = (uintptr_t)req; /* reset nr_body */
+	if (error) {
+		na = NULL;
+		ifp = NULL;
+		goto out;
+	}
+	if (ifp == NULL ||
+	    !((na->na_flags & NAF_NATIVE) || na_is_generic(na))) {
+		error = EOPNOTSUPP;
+		goto out;
+	}
+	if (reqtype == NETMAP_REQ_FLOW_RULE_ADD &&
+	    req->nr_ring >= na->num_rx_rings) {
+		if (netmap_verbose)
+			nm_prerr("%s has no rx ring %u", na->name,
+				 req->nr_ring);
+		error = EINVAL;
+		goto out;
+	}
+	error = nm_os_flow_rule(ifp, req, reqtype == NETMAP_REQ_FLOW_RULE_ADD);
+out:
+	netmap_unget_na(na, ifp);
+	NMG_UNLOCK();
+	return error;
+}
+
+/* NETMAP_REQ_RING_STATS_GET */
+static int
+netmap_ring_stats_get(struct nmreq_header *hdr)
+{
+	struct nmreq_ring_stats *req =
+		(struct nmreq_ring_stats *)(uintptr_t)hdr->nr_body;
+	uint16_t reqtype = hdr->nr_reqtype;
+	struct nmreq_register regreq;
+	struct netmap_adapter *na = NULL;
+	struct ifnet *ifp = NULL;
+	struct netmap_kring *kring;
+	enum txrx t = req->nr_tx ? NR_TX : NR_RX;
+	int error;
+
+	bzero(&regreq, sizeof(regreq));
+	regreq.nr_mode = NR_REG_ALL_NIC;
+
+	NMG_LOCK();
+	hdr->nr_reqtype = NETMAP_REQ_REGISTER;
+	hdr->nr_body = (uintptr_t)&regreq;
+	error = netmap_get_na(hdr, &na, &ifp, NULL, 0 /* no create */);
+	hdr->nr_reqtype = reqtype; /* reset type */
+	hdr->nr_body = (uintptr_t)req; /* reset nr_body */
+	if (error) {
+		na = NULL;
+		ifp = NULL;
+		goto out;
+	}
+	if (na->tx_rings == NULL) {
+		error = ENXIO;
+		goto out;
+	}
+	if (req->nr_ring_id >= netmap_real_rings(na, t)) {
+		error = EINVAL;
+		goto out;
+	}
+	kring = NMR(na, t)[req->nr_ring_id];
+	req->nr_syncs = kring->stats.syncs;
+	req->nr_slots = kring->stats.slots;
+	req->nr_bytes = kring->stats.bytes;
+	req->nr_drops = kring->stats.drops;
+	req->nr_notifies = kring->stats.notifies;
+	req->nr_busy = kring->stats.busy;
+	memcpy(req->nr_lat, kring->stats.lat, sizeof(req->nr_lat));
+out:
+	netmap_unget_na(na, ifp);
+	NMG_UNLOCK();
+	return error;
+}
+
+
+/* choose between the generic and the fast sync routines of the adapter
+ * (nm_txsync_fast/nm_rxsync_fast) for the newly opened rings, now that
+ * their offsets are known. The krings whose callbacks are intercepted
+ * (e.g. by a monitor) are left alone, except for the saved pointer.
+ */
+static void
+netmap_select_sync(struct netmap_priv_d *priv)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_kring *kring;
+	enum txrx t;
+	u_int i;
+
+	foreach_selected_ring(priv, t, i, kring) {
+		int (*gen)(struct netmap_kring *, int) =
+			t == NR_TX ? na->nm_txsync : na->nm_rxsync;
+		int (*fast)(struct netmap_kring *, int) =
+			t == NR_TX ? na->nm_txsync_fast : na->nm_rxsync_fast;
+		int (*sync)(struct netmap_kring *, int);
+
+		if (fast == NULL || i >= nma_get_nrings(na, t))
+			continue;
+		sync = kring->offset_mask ? gen : fast;
+		if (kring->nm_sync == gen || kring->nm_sync == fast)
+			kring->nm_sync = sync;
+#ifdef WITH_MONITOR
+		else if (kring->mon_sync == gen || kring->mon_sync == fast)
+			kring->mon_sync = sync;
+#endif /* WITH_MONITOR */
+	}
+}
+
 /* set the hardware buffer length in each one of the newly opened rings
  * (hwbuf_len field in the kring struct). The purpose it to select
  * the maximum supported input buffer lenght that will not cause writes
@@ -2637,11 +2987,18 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 	if (error)
 		goto err_rel_excl;
 
+	/* enable the slot metadata if requested */
+	error = netmap_meta_init(priv, hdr);
+	if (error)
+		goto err_rel_excl;
+
 	/* compute and validate the buf lengths */
 	error = netmap_compute_buf_len(priv);
 	if (error)
 		goto err_rel_excl;
 
+	netmap_select_sync(priv);
+
 	/* in all cases, create a new netmap if */
 	nifp = netmap_mem_if_new(na, priv);
 	if (nifp == NULL) {
@@ -2678,7 +3035,7 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 	return 0;
 
 err_del_if:
-	netmap_mem_if_delete(na, nifp);
+	netmap_mem_if_delete(na, nifp, NULL);
 err_rel_excl:
 	netmap_krings_put(priv);
 	netmap_update_hostrings_mode(na);
@@ -2687,8 +3044,12 @@ err_del_krings:
 	if (na->active_fds == 0)
 		na->nm_krings_delete(na);
 err_put_lut:
-	if (na->active_fds == 0)
+	if (na->active_fds == 0) {
+		struct plut_entry *plut = na->na_lut.plut;
+
 		memset(&na->na_lut, 0, sizeof(na->na_lut));
+		na->na_lut.plut = plut; /* released by netmap_mem_drop() */
+	}
 err_drop_mem:
 	netmap_mem_drop(na);
 err:
@@ -2703,6 +3064,8 @@ err:
 static inline void
 nm_sync_finalize(struct netmap_kring *kring)
 {
+	nm_kring_stats_sync(kring);
+
 	/*
 	 * Update ring tail to what the kernel knows
 	 * After txsync: head/rhead/hwcur might be behind cur/rcur
@@ -2724,10 +3087,230 @@ ring_timestamp_set(struct netmap_ring *ring)
 	}
 }
 
+/* longest interval over which the software timestamps are spread */
+#define NM_SW_TS_MAX_NS		1000000000U
+
+/*
+ * Software NM_META_TS (NKR_SWTS): stamp the packets that the rxsync
+ * has just made available, between rtail and nr_hwtail, so it must
+ * run before nm_sync_finalize(). They arrived after the previous
+ * rxsync, so their times are spread evenly over the interval since
+ * then, at most NM_SW_TS_MAX_NS, the last packet getting 'now'.
+ */
+static void
+nm_rx_sw_ts(struct netmap_kring *kring)
+{
+	struct netmap_ring *ring = kring->ring;
+	struct netmap_adapter *na = kring->na;
+	u_int lim = kring->nkr_num_slots - 1;
+	uint64_t now = nm_os_realtime_ns();
+	uint64_t ts = kring->sw_ts_last;
+	u_int j, n = 0;
+	uint32_t step;
+
+	kring->sw_ts_last = now;
+	for (j = kring->rtail; j != kring->nr_hwtail; j = nm_next(j, lim)) {
+		if (!(ring->slot[j].flags & NS_MOREFRAG))
+			n++;
+	}
+	if (n == 0)
+		return;
+	if (now - ts > NM_SW_TS_MAX_NS) /* also if the clock went back */
+		ts = now - NM_SW_TS_MAX_NS;
+	step = (uint32_t)(now - ts) / n;
+	ts = now - (uint64_t)step * n;
+
+	for (j = kring->rtail; j != kring->nr_hwtail; j = nm_next(j, lim)) {
+		struct netmap_slot *slot = &ring->slot[j];
+		uint64_t offset = nm_get_offset(kring, slot);
+		struct nm_slot_meta *meta;
+
+		if (slot->flags & NS_MOREFRAG)
+			continue;
+		ts += step;
+		if (unlikely(offset < sizeof(*meta)))
+			continue;
+		meta = (struct nm_slot_meta *)((char *)NMB(na, slot) +
+				offset - sizeof(*meta));
+		/* drivers without metadata do not clear the flags */
+		if (na->rx_meta_caps == 0)
+			meta->flags = 0;
+		meta->ts = ts;
+		meta->flags |= NM_META_TS;
+	}
+}
+
 static int nmreq_copyin(struct nmreq_header *, int);
 static int nmreq_copyout(struct nmreq_header *, int);
 static int nmreq_checkoptions(struct nmreq_header *);
 
+/*
+ * txsync or rxsync the rings [qfirst, qlast) of a bound file
+ * descriptor, on behalf of NIOCTXSYNC/NIOCRXSYNC or of
+ * NETMAP_REQ_SYNC_BATCH. 'flags' are added to the sync flags.
+ */
+static int
+netmap_sync_rings(struct netmap_priv_d *priv, enum txrx t,
+		u_int qfirst, u_int qlast, int flags)
+{
+	struct mbq q;	/* packets from RX hw queues to host stack */
+	struct netmap_adapter *na;
+	struct netmap_kring **krings;
+	int sync_flags;
+	int error = 0;
+	u_int i;
+
+	if (unlikely(priv->np_nifp == NULL)) {
+		return ENXIO;
+	}
+	mb(); /* make sure following reads are not from cache */
+
+	if (unlikely(priv->np_csb_atok_base)) {
+		nm_prerr("Invalid sync in CSB mode");
+		return EBUSY;
+	}
+
+	na = priv->np_na;      /* we have a reference */
+
+	mbq_init(&q);
+	krings = NMR(na, t);
+	sync_flags = priv->np_sync_flags | flags;
+
+	for (i = qfirst; i < qlast; i++) {
+		struct netmap_kring *kring = krings[i];
+		struct netmap_ring *ring = kring->ring;
+
+		if (unlikely(nm_kr_tryget(kring, 1, &error))) {
+			error = (error ? EIO : 0);
+			continue;
+		}
+
+		if (t == NR_TX) {
+			if (netmap_debug & NM_DEBUG_TXSYNC)
+				nm_prinf("pre txsync ring %d cur %d hwcur %d",
+				    i, ring->cur,
+				    kring->nr_hwcur);
+			if (nm_txsync_prologue(kring, ring) >= kring->nkr_num_slots) {
+				netmap_ring_reinit(kring);
+			} else if (kring->nm_sync(kring, sync_flags | NAF_FORCE_RECLAIM) == 0) {
+				nm_sync_finalize(kring);
+			}
+			if (netmap_debug & NM_DEBUG_TXSYNC)
+				nm_prinf("post txsync ring %d cur %d hwcur %d",
+				    i, ring->cur,
+				    kring->nr_hwcur);
+		} else {
+			if (nm_rxsync_prologue(kring, ring) >= kring->nkr_num_slots) {
+				netmap_ring_reinit(kring);
+			}
+			if (nm_may_forward_up(kring)) {
+				/* transparent forwarding, see netmap_poll() */
+				netmap_grab_packets(kring, &q, netmap_fwd);
+			}
+			if (kring->nm_sync(kring, sync_flags | NAF_FORCE_READ) == 0) {
+				if (unlikely(kring->nr_kflags & NKR_SWTS))
+					nm_rx_sw_ts(kring);
+				nm_sync_finalize(kring);
+			}
+			ring_timestamp_set(ring);
+		}
+		nm_kr_put(kring);
+	}
+
+	if (mbq_peek(&q)) {
+		netmap_send_up(na->ifp, &q);
+	}
+
+	return error;
+}
+
+/* one entry of NETMAP_REQ_SYNC_BATCH */
+static int
+netmap_sync_entry(struct netmap_priv_d *priv, struct nmreq_sync_entry *e)
+{
+	enum txrx t;
+	int error = 0;
+
+	if (e->nr_flags == 0 || (e->nr_flags & ~(NR_SYNC_TX | NR_SYNC_RX)))
+		return EINVAL;
+	if (priv->np_nifp == NULL)
+		return ENXIO;
+	for_rx_tx(t) {
+		u_int qfirst = priv->np_qfirst[t], qlast = priv->np_qlast[t];
+		int err;
+
+		if (!(e->nr_flags & (t == NR_TX ? NR_SYNC_TX : NR_SYNC_RX)))
+			continue;
+		if (e->nr_first_ring != 0 || e->nr_last_ring != 0) {
+			/* a subset of the bound rings */
+			if (e->nr_first_ring < qfirst ||
+			    e->nr_first_ring >= e->nr_last_ring ||
+			    e->nr_last_ring > qlast)
+				return EINVAL;
+			qfirst = e->nr_first_ring;
+			qlast = e->nr_last_ring;
+		}
+		/* a batch is usually followed by a wait, as in poll() */
+		err = netmap_sync_rings(priv, t, qfirst, qlast, NAF_FLUSH);
+		if (err && !error)
+			error = err;
+	}
+	return error;
+}
+
+/* NETMAP_REQ_SYNC_BATCH, see nmreq_sync_batch in netmap.h */
+static int
+netmap_sync_batch(struct netmap_priv_d *priv, struct nmreq_header *hdr)
+{
+	struct nmreq_sync_batch *req =
+		(struct nmreq_sync_batch *)(uintptr_t)hdr->nr_body;
+	struct nmreq_sync_entry *entries;
+	void *uentries = (void *)(uintptr_t)req->nr_entries;
+	size_t len;
+	int error = 0;
+	u_int i;
+
+	if (req->nr_num == 0 || req->nr_num > NR_SYNC_BATCH_MAX ||
+	    uentries == NULL)
+		return EINVAL;
+	len = req->nr_num * sizeof(*entries);
+	if (hdr->nr_reserved) {
+		/* the array is in userspace */
+		entries = nm_os_malloc(len);
+		if (entries == NULL)
+			return ENOMEM;
+		error = copyin(uentries, entries, len);
+		if (error)
+			goto out;
+	} else {
+		entries = uentries;
+	}
+
+	for (i = 0; i < req->nr_num; i++) {
+		struct nmreq_sync_entry *e = entries + i;
+		struct netmap_priv_d *epriv = priv;
+		void *ref = NULL;
+
+		if (e->nr_fd != -1) {
+			epriv = nm_os_priv_get(e->nr_fd, &ref);
+			if (epriv == NULL) {
+				e->nr_error = EBADF;
+				continue;
+			}
+		}
+		e->nr_error = netmap_sync_entry(epriv, e);
+		if (ref != NULL)
+			nm_os_priv_put(ref);
+	}
+
+	if (hdr->nr_reserved)
+		error = copyout(entries, uentries, len);
+out:
+	if (hdr->nr_reserved)
+		nm_os_free(entries);
+	return error;
+}
+
 /*
  * ioctl(2) support for the "netmap" device.
  *
@@ -2745,14 +3328,10 @@ int
 netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 		struct thread *td, int nr_body_is_user)
 {
-	struct mbq q;	/* packets from RX hw queues to host stack */
 	struct netmap_adapter *na = NULL;
 	struct netmap_mem_d *nmd = NULL;
 	struct ifnet *ifp = NULL;
 	int error = 0;
-	u_int i, qfirst, qlast;
-	struct netmap_kring **krings;
-	int sync_flags;
 	enum txrx t;
 
 	switch (cmd) {
@@ -2790,6 +3369,10 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			NMG_LOCK();
 			do {
 				struct nmreq_option *opt;
+#ifdef WITH_EXTMEM
+				struct nmreq_option *bopt;
+#endif /* WITH_EXTMEM */
+				struct netmap_mem_d *hinted;
 				u_int memflags;
 
 				if (priv->np_nifp != NULL) {	/* thread already registered */
@@ -2799,13 +3382,23 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 
 #ifdef WITH_EXTMEM
 				opt = nmreq_getoption(hdr, NETMAP_REQ_OPT_EXTMEM);
+				bopt = nmreq_getoption(hdr, NETMAP_REQ_OPT_EXTMEM_BUFS);
+				if (bopt != NULL && opt == NULL) {
+					/* shared buffers need private rings */
+					error = bopt->nro_status = EINVAL;
+					break;
+				}
 				if (opt != NULL) {
 					struct nmreq_opt_extmem *e =
 						(struct nmreq_opt_extmem *)opt;
 
 					nmd = netmap_mem_ext_create(e->nro_usrptr,
-							&e->nro_info, &error);
+							&e->nro_info,
+							(struct nmreq_opt_extmem_bufs *)bopt,
+							&error);
 					opt->nro_status = error;
+					if (bopt != NULL)
+						bopt->nro_status = error;
 					if (nmd == NULL)
 						break;
 				}
@@ -2840,11 +3433,33 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 					break;
 				}
 
+				opt = nmreq_getoption(hdr, NETMAP_REQ_OPT_NUMA);
+				if (opt != NULL) {
+					struct nmreq_opt_numa *numa =
+						(struct nmreq_opt_numa *)opt;
+
+					/* only for this register, we hold
+					 * NMG_LOCK until it is withdrawn */
+					netmap_mem_numa_hint(na->nm_mem,
+							numa->nro_node);
+					opt->nro_status = 0;
+				}
+
+				hinted = na->nm_mem;
 				error = netmap_do_regif(priv, na, hdr);
+				if (opt != NULL)
+					netmap_mem_numa_hint(hinted,
+						NETMAP_MEM_NUMA_NOHINT);
 				if (error) {    /* reg. failed, release priv and ref */
 					break;
 				}
 
+				if (opt != NULL) {
+					/* report where the pools actually are */
+					((struct nmreq_opt_numa *)opt)->nro_node =
+						netmap_mem_numa_node(na->nm_mem);
+				}
+
 				opt = nmreq_getoption(hdr, NETMAP_REQ_OPT_CSB);
 				if (opt != NULL) {
 					struct nmreq_opt_csb *csbo =
@@ -2885,7 +3500,9 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 						nm_prinf("requested %d extra buffers",
 							req->nr_extra_bufs);
 					req->nr_extra_bufs = netmap_extra_alloc(na,
-						&nifp->ni_bufs_head, req->nr_extra_bufs);
+						&nifp->ni_bufs_head, req->nr_extra_bufs,
+						&priv->np_extra_owner);
+					priv->np_extra_bufs = req->nr_extra_bufs;
 					if (netmap_verbose)
 						nm_prinf("got %d extra buffers", req->nr_extra_bufs);
 				} else {
@@ -2975,6 +3592,8 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 				req->nr_tx_slots = na->num_tx_desc;
 				req->nr_host_tx_rings = na->num_host_tx_rings;
 				req->nr_host_rx_rings = na->num_host_rx_rings;
+				req->nr_meta_caps = na->rx_meta_caps |
+					NM_META_SW_CAPS | na->tx_meta_caps;
 			} while (0);
 			netmap_unget_na(na, ifp);
 			if (nmd_ref)
@@ -3066,6 +3685,11 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			break;
 		}
 
+		case NETMAP_REQ_VALE_LIST_BULK: {
+			error = netmap_vale_list_bulk(hdr);
+			break;
+		}
+
 		case NETMAP_REQ_VALE_NEWIF: {
 			error = nm_vi_create(hdr);
 			break;
@@ -3075,6 +3699,50 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			error = nm_vi_destroy(hdr->nr_name);
 			break;
 		}
+
+		case NETMAP_REQ_VALE_HASH_INFO_GET: {
+			error = netmap_vale_hash_info(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_VALE_HASH_GET: {
+			error = netmap_vale_hash_get(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_VALE_HASH_SET: {
+			error = netmap_vale_hash_set(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_VALE_PORT_STATS_GET: {
+			error = netmap_vale_port_stats(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_VALE_QOS_SET:
+		case NETMAP_REQ_VALE_QOS_GET: {
+			error = netmap_vale_qos(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_VALE_DEFER_SET:
+		case NETMAP_REQ_VALE_DEFER_GET: {
+			error = netmap_vale_defer(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_VALE_L3_ROUTE_ADD:
+		case NETMAP_REQ_VALE_L3_ROUTE_DEL:
+		case NETMAP_REQ_VALE_L3_ACL_ADD:
+		case NETMAP_REQ_VALE_L3_ACL_DEL: {
+#ifdef WITH_VALE_L3
+			error = netmap_vale_l3_ctl(hdr);
+#else
+			error = EOPNOTSUPP;
+#endif /* WITH_VALE_L3 */
+			break;
+		}
 #endif  /* WITH_VALE */
 
 		case NETMAP_REQ_VALE_POLLING_ENABLE:
@@ -3082,24 +3750,30 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			error = nm_bdg_polling(hdr);
 			break;
 		}
-		case NETMAP_REQ_POOLS_INFO_GET: {
+		case NETMAP_REQ_POOLS_INFO_GET:
+		case NETMAP_REQ_POOLS_EXPAND:
+		case NETMAP_REQ_POOLS_STATS_GET: {
 			/* Get information from the memory allocator used for
-			 * hdr->nr_name. */
+			 * hdr->nr_name, possibly after growing it. */
 			struct nmreq_pools_info *req =
 				(struct nmreq_pools_info *)(uintptr_t)hdr->nr_body;
+			struct nmreq_pools_stats *sreq =
+				(struct nmreq_pools_stats *)(uintptr_t)hdr->nr_body;
+			uint16_t reqtype = hdr->nr_reqtype;
 			NMG_LOCK();
 			do {
 				/* Build a nmreq_register out of the nmreq_pools_info,
 				 * so that we can call netmap_get_na(). */
 				struct nmreq_register regreq;
 				bzero(&regreq, sizeof(regreq));
-				regreq.nr_mem_id = req->nr_mem_id;
+				regreq.nr_mem_id = reqtype == NETMAP_REQ_POOLS_STATS_GET ?
+					sreq->nr_mem_id : req->nr_mem_id;
 				regreq.nr_mode = NR_REG_ALL_NIC;
 
 				hdr->nr_reqtype = NETMAP_REQ_REGISTER;
 				hdr->nr_body = (uintptr_t)&regreq;
 				error = netmap_get_na(hdr, &na, &ifp, NULL, 1 /* create */);
-				hdr->nr_reqtype = NETMAP_REQ_POOLS_INFO_GET; /* reset type */
+				hdr->nr_reqtype = reqtype; /* reset type */
 				hdr->nr_body = (uintptr_t)req; /* reset nr_body */
 				if (error) {
 					na = NULL;
@@ -3118,7 +3792,13 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 				if (error) {
 					break;
 				}
-				error = netmap_mem_pools_info_get(req, nmd);
+				if (reqtype == NETMAP_REQ_POOLS_EXPAND)
+					error = netmap_mem_expand(nmd,
+						req->nr_buf_pool_objtotal);
+				if (!error && reqtype == NETMAP_REQ_POOLS_STATS_GET)
+					error = netmap_mem_pools_stats_get(sreq, nmd);
+				else if (!error)
+					error = netmap_mem_pools_info_get(req, nmd);
 				netmap_mem_drop(na);
 			} while (0);
 			netmap_unget_na(na, ifp);
@@ -3153,6 +3833,31 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			break;
 		}
 
+		case NETMAP_REQ_FLOW_RULE_ADD:
+		case NETMAP_REQ_FLOW_RULE_DEL: {
+			error = netmap_flow_rule(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_RING_STATS_GET: {
+			error = netmap_ring_stats_get(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_SYNC_BATCH: {
+			error = netmap_sync_batch(priv, hdr);
+			break;
+		}
+
+		case NETMAP_REQ_BENCH: {
+#ifdef WITH_BENCH
+			error = netmap_bench(priv, hdr);
+#else
+			error = EOPNOTSUPP;
+#endif /* WITH_BENCH */
+			break;
+		}
+
 		default: {
 			error = EINVAL;
 			break;
@@ -3166,70 +3871,9 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 
 	case NIOCTXSYNC:
 	case NIOCRXSYNC: {
-		if (unlikely(priv->np_nifp == NULL)) {
-			error = ENXIO;
-			break;
-		}
-		mb(); /* make sure following reads are not from cache */
-
-		if (unlikely(priv->np_csb_atok_base)) {
-			nm_prerr("Invalid sync in CSB mode");
-			error = EBUSY;
-			break;
-		}
-
-		na = priv->np_na;      /* we have a reference */
-
-		mbq_init(&q);
 		t = (cmd == NIOCTXSYNC ? NR_TX : NR_RX);
-		krings = NMR(na, t);
-		qfirst = priv->np_qfirst[t];
-		qlast = priv->np_qlast[t];
-		sync_flags = priv->np_sync_flags;
-
-		for (i = qfirst; i < qlast; i++) {
-			struct netmap_kring *kring = krings[i];
-			struct netmap_ring *ring = kring->ring;
-
-			if (unlikely(nm_kr_tryget(kring, 1, &error))) {
-				error = (error ? EIO : 0);
-				continue;
-			}
-
-			if (cmd == NIOCTXSYNC) {
-				if (netmap_debug & NM_DEBUG_TXSYNC)
-					nm_prinf("pre txsync ring %d cur %d hwcur %d",
-					    i, ring->cur,
-					    kring->nr_hwcur);
-				if (nm_txsync_prologue(kring, ring) >= kring->nkr_num_slots) {
-					netmap_ring_reinit(kring);
-				} else if (kring->nm_sync(kring, sync_flags | NAF_FORCE_RECLAIM) == 0) {
-					nm_sync_finalize(kring);
-				}
-				if (netmap_debug & NM_DEBUG_TXSYNC)
-					nm_prinf("post txsync ring %d cur %d hwcur %d",
-					    i, ring->cur,
-					    kring->nr_hwcur);
-			} else {
-				if (nm_rxsync_prologue(kring, ring) >= kring->nkr_num_slots) {
-					netmap_ring_reinit(kring);
-				}
-				if (nm_may_forward_up(kring)) {
-					/* transparent forwarding, see netmap_poll() */
-					netmap_grab_packets(kring, &q, netmap_fwd);
-				}
-				if (kring->nm_sync(kring, sync_flags | NAF_FORCE_READ) == 0) {
-					nm_sync_finalize(kring);
-				}
-				ring_timestamp_set(ring);
-			}
-			nm_kr_put(kring);
-		}
-
-		if (mbq_peek(&q)) {
-			netmap_send_up(na->ifp, &q);
-		}
-
+		error = netmap_sync_rings(priv, t, priv->np_qfirst[t],
+				priv->np_qlast[t], 0);
 		break;
 	}
 
@@ -3256,6 +3900,8 @@ nmreq_size_by_type(uint16_t nr_reqtype)
 		return sizeof(struct nmreq_vale_detach);
 	case NETMAP_REQ_VALE_LIST:
 		return sizeof(struct nmreq_vale_list);
+	case NETMAP_REQ_VALE_LIST_BULK:
+		return sizeof(struct nmreq_vale_list_bulk);
 	case NETMAP_REQ_PORT_HDR_SET:
 	case NETMAP_REQ_PORT_HDR_GET:
 		return sizeof(struct nmreq_port_hdr);
@@ -3269,9 +3915,40 @@ nmreq_size_by_type(uint16_t nr_reqtype)
 	case NETMAP_REQ_VALE_POLLING_DISABLE:
 		return sizeof(struct nmreq_vale_polling);
 	case NETMAP_REQ_POOLS_INFO_GET:
+	case NETMAP_REQ_POOLS_EXPAND:
 		return sizeof(struct nmreq_pools_info);
+	case NETMAP_REQ_POOLS_STATS_GET:
+		return sizeof(struct nmreq_pools_stats);
 	case NETMAP_REQ_SYNC_KLOOP_START:
 		return sizeof(struct nmreq_sync_kloop_start);
+	case NETMAP_REQ_VALE_HASH_INFO_GET:
+		return sizeof(struct nmreq_vale_hash_info);
+	case NETMAP_REQ_VALE_HASH_GET:
+	case NETMAP_REQ_VALE_HASH_SET:
+		return sizeof(struct nmreq_vale_hash_entries);
+	case NETMAP_REQ_FLOW_RULE_ADD:
+	case NETMAP_REQ_FLOW_RULE_DEL:
+		return sizeof(struct nmreq_flow_rule);
+	case NETMAP_REQ_RING_STATS_GET:
+		return sizeof(struct nmreq_ring_stats);
+	case NETMAP_REQ_SYNC_BATCH:
+		return sizeof(struct nmreq_sync_batch);
+	case NETMAP_REQ_VALE_PORT_STATS_GET:
+		return sizeof(struct nmreq_vale_port_stats);
+	case NETMAP_REQ_VALE_QOS_SET:
+	case NETMAP_REQ_VALE_QOS_GET:
+		return sizeof(struct nmreq_vale_qos);
+	case NETMAP_REQ_VALE_DEFER_SET:
+	case NETMAP_REQ_VALE_DEFER_GET:
+		return sizeof(struct nmreq_vale_defer);
+	case NETMAP_REQ_VALE_L3_ROUTE_ADD:
+	case NETMAP_REQ_VALE_L3_ROUTE_DEL:
+		return sizeof(struct nmreq_vale_l3_route);
+	case NETMAP_REQ_VALE_L3_ACL_ADD:
+	case NETMAP_REQ_VALE_L3_ACL_DEL:
+		return sizeof(struct nmreq_vale_l3_acl);
+	case NETMAP_REQ_BENCH:
+		return sizeof(struct nmreq_bench);
 	}
 	return 0;
 }
@@ -3289,8 +3966,15 @@ nmreq_opt_size_by_type(uint32_t nro_reqtype, uint64_t nro_size)
 	case NETMAP_REQ_OPT_EXTMEM:
 		rv = sizeof(struct nmreq_opt_extmem);
 		break;
+	case NETMAP_REQ_OPT_EXTMEM_BUFS:
+		rv = sizeof(struct nmreq_opt_extmem_bufs);
+		break;
 #endif /* WITH_EXTMEM */
+	case NETMAP_REQ_OPT_NULL_TRAFFIC:
+		rv = sizeof(struct nmreq_opt_null_traffic);
+		break;
 	case NETMAP_REQ_OPT_SYNC_KLOOP_EVENTFDS:
+	case NETMAP_REQ_OPT_SYNC_KLOOP_PORTS:
 		if (nro_size >= rv)
 			rv = nro_size;
 		break;
@@ -3303,6 +3987,32 @@ nmreq_opt_size_by_type(uint32_t nro_reqtype, uint64_t nro_size)
 	case NETMAP_REQ_OPT_OFFSETS:
 		rv = sizeof(struct nmreq_opt_offsets);
 		break;
+	case NETMAP_REQ_OPT_VALE_HASH:
+		rv = sizeof(struct nmreq_opt_vale_hash);
+		break;
+	case NETMAP_REQ_OPT_NUMA:
+		rv = sizeof(struct nmreq_opt_numa);
+		break;
+	case NETMAP_REQ_OPT_MONITOR_SAMPLE:
+		rv = sizeof(struct nmreq_opt_monitor_sample);
+		break;
+	case NETMAP_REQ_OPT_MONITOR_FILTER:
+		rv = sizeof(struct nmreq_opt_monitor_filter);
+		if (nro_size >= rv)
+			rv = nro_size;
+		break;
+	case NETMAP_REQ_OPT_PIPE_FANOUT:
+		rv = sizeof(struct nmreq_opt_pipe_fanout);
+		break;
+	case NETMAP_REQ_OPT_SYNC_KLOOP_SCHED:
+		rv = sizeof(struct nmreq_opt_sync_kloop_sched);
+		break;
+	case NETMAP_REQ_OPT_SLOT_META:
+		rv = sizeof(struct nmreq_opt_slot_meta);
+		break;
+	case NETMAP_REQ_OPT_BUF_SIZE:
+		rv = sizeof(struct nmreq_opt_buf_size);
+		break;
 	}
 	/* subtract the common header */
 	return rv - sizeof(struct nmreq_option);
@@ -3751,8 +4461,22 @@ netmap_poll(struct netmap_priv_d *priv, int events, NM_SELRECORD_T *sr)
 
 #ifdef linux
 	/* The selrecord must be unconditional on linux. */
-	nm_os_selrecord(sr, si[NR_RX]);
-	nm_os_selrecord(sr, si[NR_TX]);
+	if (nm_ring_poll(priv)) {
+		/* only the wait queues of our own rings, for the
+		 * directions we have been asked for */
+		enum txrx t;
+
+		for_rx_tx(t) {
+			if (!(events & (t == NR_TX ? (POLLOUT | POLLWRNORM) :
+						(POLLIN | POLLRDNORM))))
+				continue;
+			for (i = priv->np_qfirst[t]; i < priv->np_qlast[t]; i++)
+				nm_os_selrecord(sr, &NMR(na, t)[i]->si);
+		}
+	} else {
+		nm_os_selrecord(sr, si[NR_RX]);
+		nm_os_selrecord(sr, si[NR_TX]);
+	}
 #endif /* linux */
 
 	/*
@@ -3791,7 +4515,9 @@ flush_tx:
 				netmap_ring_reinit(kring);
 				revents |= POLLERR;
 			} else {
-				if (kring->nm_sync(kring, sync_flags))
+				/* do not leave deferred slots behind
+				 * while we may sleep */
+				if (kring->nm_sync(kring, sync_flags | NAF_FLUSH))
 					revents |= POLLERR;
 				else
 					nm_sync_finalize(kring);
@@ -3858,10 +4584,13 @@ do_retry_rx:
 			 * the nm_sync() below only on for the host RX ring (see
 			 * netmap_rxsync_from_host()). */
 			kring->nr_kflags &= ~NR_FORWARD;
-			if (kring->nm_sync(kring, sync_flags))
+			if (kring->nm_sync(kring, sync_flags)) {
 				revents |= POLLERR;
-			else
+			} else {
+				if (unlikely(kring->nr_kflags & NKR_SWTS))
+					nm_rx_sw_ts(kring);
 				nm_sync_finalize(kring);
+			}
 			send_down |= (kring->nr_kflags & NR_FORWARD);
 			ring_timestamp_set(ring);
 			found = kring->rcur != kring->rtail;
@@ -3952,6 +4681,8 @@ netmap_notify(struct netmap_kring *kring, int flags)
 	struct netmap_adapter *na = kring->notify_na;
 	enum txrx t = kring->tx;
 
+	kring->stats.notifies++;
+	nm_trace_lat_stamp(kring);
 	nm_os_selwakeup(&kring->si);
 	/* optimization: avoid a wake up on the global
 	 * queue if nobody has registered for more
@@ -4162,6 +4893,7 @@ NM_DBG(netmap_adapter_put)(struct netmap_adapter *na)
 	if (!refcount_release(&na->na_refcount))
 		return 0;
 
+	netmap_mem_dma_forget(na->nm_mem, na);
 	if (na->nm_dtor)
 		na->nm_dtor(na);
 
@@ -4214,6 +4946,8 @@ netmap_detach(struct ifnet *ifp)
 
 	na = NA(ifp);
 	netmap_set_all_rings(na, NM_KR_LOCKED);
+	/* the device is going away, do not keep its DMA map */
+	netmap_mem_dma_forget(na->nm_mem, na);
 	/*
 	 * if the netmap adapter is not native, somebody
 	 * changed it, so we can not release it here.
@@ -4234,6 +4968,25 @@ netmap_detach(struct ifnet *ifp)
 }
 
 
+/* host rx ring for a packet from the stack, see netmap_host_rx_steer */
+static inline u_int
+netmap_host_rx_ring(struct netmap_adapter *na, struct mbuf *m)
+{
+	u_int n = na->num_host_rx_rings;
+
+	if (n <= 1)
+		return 0;
+	switch (netmap_host_rx_steer) {
+	case 1:
+		/* reciprocal scaling, uses the high bits of the hash */
+		return ((uint64_t)(uint32_t)MBUF_HASH(m) * n) >> 32;
+	case 2:
+		return nm_os_curcpu() % n;
+	default:
+		return MBUF_TXQ(m) % n;
+	}
+}
+
 /*
  * Intercept packets from the network stack and pass them
  * to netmap as incoming packets on the 'software' ring.
@@ -4258,10 +5011,7 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 	int busy;
 	u_int i;
 
-	i = MBUF_TXQ(m);
-	if (i >= na->num_host_rx_rings) {
-		i = i % na->num_host_rx_rings;
-	}
+	i = netmap_host_rx_ring(na, m);
 	kring = NMR(na, NR_RX)[nma_get_nrings(na, NR_RX) + i];
 
 	// XXX [Linux] we do not need this lock
@@ -4333,8 +5083,10 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 	mbq_unlock(q);
 
 done:
-	if (m)
+	if (m) {
+		kring->stats.drops++;
 		m_freem(m);
+	}
 	/* unconditionally wake up listeners */
 	kring->nm_notify(kring, 0);
 	/* this is normally netmap_notify(), but for nics
@@ -168,6 +168,153 @@ nm_bdg_name_validate(const char *name, size_t prefixlen)
 	return colon_pos;
 }
 
+static struct nm_bdg_fanout *nm_bdg_fanout_get(void);
+static void nm_bdg_fanout_put(struct nm_bdg_fanout *bf);
+
+/* number of flush workers shared by the bridges, see netmap_bdg_fanout_run() */
+static int netmap_bdg_fanout_workers;
+/* idle time before a flush worker sleeps */
+static u_int netmap_bdg_fanout_idle_us = 100;
+
+/* default size of the learning table of new bridges */
+static u_int netmap_bdg_hash_size = NM_BDG_HASH;
+
+u_int netmap_bdg_max_ports = NM_BDG_PORTS;
+
+/* adaptive polling, see netmap_bwrap_polling() */
+static int netmap_bdg_poll_tx = 1;
+static u_int netmap_bdg_poll_idle_us = 200;
+static u_int netmap_bdg_poll_sleep_us = 1000;
+static u_int netmap_bdg_poll_wake_pkts = 8;
+
+SYSBEGIN(vars_bdg);
+SYSCTL_DECL(_dev_netmap);
+SYSCTL_INT(_dev_netmap, OID_AUTO, bdg_fanout_workers, CTLFLAG_RW,
+		&netmap_bdg_fanout_workers, 0,
+		"Number of flush workers, applied when the first bridge is created");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bdg_fanout_idle_us, CTLFLAG_RW,
+		&netmap_bdg_fanout_idle_us, 0,
+		"Idle time before a flush worker sleeps");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, vale_hash_size, CTLFLAG_RW,
+		&netmap_bdg_hash_size, 0,
+		"Default number of entries of the learning table of new bridges");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bdg_max_ports, CTLFLAG_RDTUN,
+		&netmap_bdg_max_ports, 0, "Max number of ports per bridge");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bdg_poll_tx, CTLFLAG_RW,
+		&netmap_bdg_poll_tx, 0,
+		"Polling kthreads also flush the tx rings of the NIC");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bdg_poll_idle_us, CTLFLAG_RW,
+		&netmap_bdg_poll_idle_us, 0,
+		"Idle time before a polling kthread sleeps (0: never)");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bdg_poll_sleep_us, CTLFLAG_RW,
+		&netmap_bdg_poll_sleep_us, 0,
+		"Polling interval of a sleeping polling kthread");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bdg_poll_wake_pkts, CTLFLAG_RW,
+		&netmap_bdg_poll_wake_pkts, 0,
+		"Packets in one sleep that wake up a polling kthread");
+SYSEND;
+
+/*
+ * Allocate a learning table with at least 'entries' entries
+ * (0 means the default). Buckets are aligned to the cache line.
+ */
+struct nm_hash_table *
+nm_bdg_ht_alloc(u_int entries)
+{
+	struct nm_hash_table *ht;
+	u_int nbuckets = 1, words = (netmap_bdg_max_ports + 31) / 32;
+
+	if (entries == 0)
+		entries = netmap_bdg_hash_size;
+	nm_bound_var(&entries, NM_BDG_HASH, NM_BDG_HASH_WAYS,
+			NM_BDG_HASH_MAX, "vale_hash_size");
+	while (nbuckets * NM_BDG_HASH_WAYS < entries)
+		nbuckets <<= 1;
+
+	/* the multicast groups follow the buckets */
+	ht = nm_os_malloc(sizeof(*ht) + NM_BDG_HASH_ALIGN +
+			sizeof(struct nm_hash_bucket) * nbuckets +
+			sizeof(uint64_t) * NM_BDG_MGRPS +
+			sizeof(uint32_t) * NM_BDG_MGRPS * (words + 1));
+	if (ht == NULL)
+		return NULL;
+	ht->nbuckets = nbuckets;
+	ht->buckets = (struct nm_hash_bucket *)(((uintptr_t)(ht + 1) +
+			NM_BDG_HASH_ALIGN - 1) & ~((uintptr_t)NM_BDG_HASH_ALIGN - 1));
+	ht->mgrp_words = words;
+	ht->mgrp_macs = (uint64_t *)(ht->buckets + nbuckets);
+	ht->mgrp_epochs = (uint32_t *)(ht->mgrp_macs + NM_BDG_MGRPS);
+	ht->mgrp_ports = ht->mgrp_epochs + NM_BDG_MGRPS;
+	mtx_init(&ht->mgrp_lock, "nm_mgrp_lock", NULL, MTX_DEF);
+	return ht;
+}
+
+void
+nm_bdg_ht_free(struct nm_hash_table *ht)
+{
+	if (ht == NULL)
+		return;
+	mtx_destroy(&ht->mgrp_lock);
+	nm_os_free(ht);
+}
+
+static void
+nm_bdg_ht_flush(struct nm_hash_table *ht)
+{
+	bzero(ht->buckets, sizeof(struct nm_hash_bucket) * ht->nbuckets);
+	mtx_lock(&ht->mgrp_lock);
+	bzero(ht->mgrp_macs, sizeof(uint64_t) * NM_BDG_MGRPS);
+	bzero(ht->mgrp_ports, sizeof(uint32_t) * NM_BDG_MGRPS *
+			ht->mgrp_words);
+	mtx_unlock(&ht->mgrp_lock);
+}
+
+/* a port left the bridge, drop it from all the multicast groups */
+static void
+nm_bdg_mgrp_port_gone(struct nm_hash_table *ht, int port)
+{
+	u_int g;
+
+	if (port < 0)
+		return;
+	mtx_lock(&ht->mgrp_lock);
+	for (g = 0; g < NM_BDG_MGRPS; g++)
+		nm_bdg_mgrp_ports(ht, g)[port >> 5] &= ~(1U << (port & 31));
+	mtx_unlock(&ht->mgrp_lock);
+}
+
+/*
+ * Process the NETMAP_REQ_OPT_VALE_HASH option. The table can only
+ * be replaced while the bridge is still unused, otherwise we just
+ * report the current size.
+ */
+static int
+nm_bdg_ht_option(struct nmreq_header *hdr, struct nm_bridge *b)
+{
+	struct nmreq_opt_vale_hash *opt = (struct nmreq_opt_vale_hash *)
+		nmreq_getoption(hdr, NETMAP_REQ_OPT_VALE_HASH);
+	struct nm_hash_table *ht;
+
+	if (opt == NULL)
+		return 0;
+	if ((b->bdg_flags & NM_BDG_ACTIVE) + b->bdg_active_ports == 0 &&
+	    opt->nro_entries != b->ht->nbuckets * NM_BDG_HASH_WAYS) {
+		ht = nm_bdg_ht_alloc(opt->nro_entries);
+		if (ht == NULL) {
+			opt->nro_opt.nro_status = ENOMEM;
+			return ENOMEM;
+		}
+		if (b->private_data == b->ht)
+			b->private_data = ht;
+		nm_bdg_ht_free(b->ht);
+		b->ht = ht;
+	}
+	opt->nro_entries = b->ht->nbuckets * NM_BDG_HASH_WAYS;
+	opt->nro_opt.nro_status = 0;
+	return 0;
+}
+
+
 /*
  * locate a bridge among the existing ones.
  * MUST BE CALLED WITH NMG_LOCK()
@@ -212,7 +359,7 @@ nm_find_bridge(const char *name, int create, struct netmap_bdg_ops *ops)
 		/* initialize the bridge */
 		nm_prdis("create new bridge %s with ports %d", b->bdg_basename,
 			b->bdg_active_ports);
-		b->ht = nm_os_malloc(sizeof(struct nm_hash_ent) * NM_BDG_HASH);
+		b->ht = nm_bdg_ht_alloc(0);
 		if (b->ht == NULL) {
 			nm_prerr("failed to allocate hash table");
 			return NULL;
@@ -220,12 +367,14 @@ nm_find_bridge(const char *name, int create, struct netmap_bdg_ops *ops)
 		strncpy(b->bdg_basename, name, namelen);
 		b->bdg_namelen = namelen;
 		b->bdg_active_ports = 0;
-		for (i = 0; i < NM_BDG_MAXPORTS; i++)
+		for (i = 0; i < netmap_bdg_max_ports; i++)
 			b->bdg_port_index[i] = i;
 		/* set the default function */
 		b->bdg_ops = b->bdg_saved_ops = *ops;
 		b->private_data = b->ht;
 		b->bdg_flags = 0;
+		if (b->bdg_fanout == NULL) /* may be left from a failed attach */
+			b->bdg_fanout = nm_bdg_fanout_get();
 		NM_BNS_GET(b);
 	}
 	return b;
@@ -240,7 +389,13 @@ netmap_bdg_free(struct nm_bridge *b)
 	}
 
 	nm_prdis("marking bridge %s as free", b->bdg_basename);
-	nm_os_free(b->ht);
+#ifdef WITH_VALE_L3
+	netmap_vale_l3_free(b);
+#endif /* WITH_VALE_L3 */
+	nm_bdg_ht_free(b->ht);
+	b->ht = NULL;
+	nm_bdg_fanout_put(b->bdg_fanout);
+	b->bdg_fanout = NULL;
 	memset(&b->bdg_ops, 0, sizeof(b->bdg_ops));
 	memset(&b->bdg_saved_ops, 0, sizeof(b->bdg_saved_ops));
 	b->bdg_flags = 0;
@@ -309,7 +464,8 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	/* make a copy of the list of active ports, update it,
 	 * and then copy back within BDG_WLOCK().
 	 */
-	memcpy(b->tmp_bdg_port_index, b->bdg_port_index, sizeof(b->tmp_bdg_port_index));
+	memcpy(b->tmp_bdg_port_index, b->bdg_port_index,
+		sizeof(uint32_t) * netmap_bdg_max_ports);
 	for (i = 0; (hw >= 0 || sw >= 0) && i < lim; ) {
 		if (hw >= 0 && tmp[i] == hw) {
 			nm_prdis("detach hw %d at %d", hw, i);
@@ -331,6 +487,8 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 		nm_prerr("delete failed hw %d sw %d, should panic...", hw, sw);
 	}
 
+	nm_bdg_mgrp_port_gone(b->ht, s_hw);
+	nm_bdg_mgrp_port_gone(b->ht, s_sw);
 	BDG_WLOCK(b);
 	if (b->bdg_ops.dtor)
 		b->bdg_ops.dtor(b->bdg_ports[s_hw]);
@@ -338,7 +496,8 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	if (s_sw >= 0) {
 		b->bdg_ports[s_sw] = NULL;
 	}
-	memcpy(b->bdg_port_index, b->tmp_bdg_port_index, sizeof(b->tmp_bdg_port_index));
+	memcpy(b->bdg_port_index, b->tmp_bdg_port_index,
+		sizeof(uint32_t) * netmap_bdg_max_ports);
 	b->bdg_active_ports = lim;
 	BDG_WUNLOCK(b);
 
@@ -413,6 +572,11 @@ netmap_get_bdg_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	}
 	if (strlen(nr_name) < b->bdg_namelen) /* impossible */
 		panic("x");
+	if (create) {
+		error = nm_bdg_ht_option(hdr, b);
+		if (error)
+			return error;
+	}
 
 	/* Now we are sure that name starts with the bridge's name,
 	 * lookup the port in the bridge. We need to scan the entire
@@ -438,7 +602,7 @@ netmap_get_bdg_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 		return ENXIO;
 	/* yes we should, see if we have space to attach entries */
 	needed = 2; /* in some cases we only need 1 */
-	if (b->bdg_active_ports + needed >= NM_BDG_MAXPORTS) {
+	if (b->bdg_active_ports + needed >= netmap_bdg_max_ports) {
 		nm_prerr("bridge full %d, cannot create new port", b->bdg_active_ports);
 		return ENOMEM;
 	}
@@ -586,7 +750,7 @@ netmap_bdg_attach(struct nmreq_header *hdr, void *auth_token)
 		goto unlock_exit;
 	}
 
-	if (NETMAP_OWNED_BY_ANY(na)) {
+	if (NETMAP_OWNED_BY_ANY(na) && !netmap_vp_warm_only(na)) {
 		error = EBUSY;
 		goto unref_exit;
 	}
@@ -695,6 +859,32 @@ error_exit:
 }
 
 
+/*
+ * Polling kthreads. Each one polls a range of RX rings of the NIC
+ * attached to the bwrap, and is adaptive: it spins while packets
+ * arrive, and after netmap_bdg_poll_idle_us without packets it goes
+ * to sleep, polling its rings once every netmap_bdg_poll_sleep_us.
+ * When all the kthreads are asleep the interrupts of the NIC are
+ * enabled, and the packets are forwarded by netmap_bwrap_intr_notify()
+ * as without polling. A kthread resumes spinning, and the interrupts
+ * are disabled, when at least netmap_bdg_poll_wake_pkts packets were
+ * received on its rings (by the interrupts or by the periodic poll)
+ * during one sleep. Kthreads with an idle queue thus give back their
+ * CPU, with a latency of at most one sleep for the first packets.
+ * netmap_bdg_poll_idle_us = 0 disables sleeping.
+ *
+ * With netmap_bdg_poll_tx, the kthreads also own the TX rings of the
+ * NIC with the same indices as their RX rings (all of them in single
+ * CPU mode). While a kthread spins, the switch only queues packets on
+ * the bwrap RX krings of those rings, marked NKR_TXPOLL, and returns;
+ * the kthread pushes them to the NIC in batches and reclaims the
+ * completed descriptors with the txsync of each iteration, so senders
+ * never run the driver code and transmission does not depend on TX
+ * interrupts. Sleeping kthreads clear NKR_TXPOLL, and the senders
+ * flush the rings themselves as without polling.
+ */
+static int netmap_bwrap_tx_flush(struct netmap_kring *kring, int flags);
+
 struct nm_bdg_polling_state;
 struct
 nm_bdg_kthread {
@@ -702,6 +892,11 @@ nm_bdg_kthread {
 	u_int qfirst;
 	u_int qlast;
 	struct nm_bdg_polling_state *bps;
+	u_int tx_qfirst;	/* TX rings owned, see netmap_bdg_poll_tx */
+	u_int tx_qlast;
+	bool sleeping;
+	bool txpoll;		/* NKR_TXPOLL set on the owned rings */
+	uint64_t last_work;	/* uptime of the last packet seen */
 };
 
 struct nm_bdg_polling_state {
@@ -714,32 +909,150 @@ struct nm_bdg_polling_state {
 	u_int cpu_from;
 	u_int ncpus;
 	struct nm_bdg_kthread *kthreads;
+	u_int *rx_tails;	/* nr_hwtail of each RX ring at the last poll */
+	u_int *tx_tails;	/* same for the bwrap RX krings (to the NIC) */
+	NM_MTX_T intr_lock;	/* protects nsleeping */
+	u_int nsleeping;	/* kthreads asleep, interrupts on if all */
 };
 
+/* ring slots from 'from' to 'to' */
+static inline u_int
+nm_bdg_poll_dist(struct netmap_kring *kring, u_int from, u_int to)
+{
+	return to >= from ? to - from : to + kring->nkr_num_slots - from;
+}
+
+/*
+ * Poll the rings of a kthread, and return the number of packets
+ * received on them since the last poll, also through interrupts
+ * (modulo the ring size).
+ */
+static u_int
+nm_bdg_poll_rings(struct nm_bdg_kthread *nbk)
+{
+	struct nm_bdg_polling_state *bps = nbk->bps;
+	struct netmap_kring **kring0 = NMR(bps->bna->hwna, NR_RX);
+	u_int i, n = 0;
+
+	for (i = nbk->qfirst; i < nbk->qlast; i++) {
+		struct netmap_kring *kring = kring0[i];
+
+		kring->nm_notify(kring, 0);
+		n += nm_bdg_poll_dist(kring, bps->rx_tails[i], kring->nr_hwtail);
+		bps->rx_tails[i] = kring->nr_hwtail;
+	}
+	if (!netmap_bdg_poll_tx)
+		return n;
+	/* packets queued by the switch, and completions */
+	kring0 = NMR(&bps->bna->up.up, NR_RX);
+	for (i = nbk->tx_qfirst; i < nbk->tx_qlast; i++) {
+		struct netmap_kring *kring = kring0[i];
+
+		n += nm_bdg_poll_dist(kring, bps->tx_tails[i], kring->nr_hwtail);
+		bps->tx_tails[i] = kring->nr_hwtail;
+		netmap_bwrap_tx_flush(kring, 0);
+	}
+	return n;
+}
+
+/* Take or give back the TX rings of a kthread. */
+static void
+nm_bdg_poll_set_txpoll(struct nm_bdg_kthread *nbk, bool on)
+{
+	struct netmap_kring **kring0 = NMR(&nbk->bps->bna->up.up, NR_RX);
+	u_int i;
+
+	for (i = nbk->tx_qfirst; i < nbk->tx_qlast; i++) {
+		if (on)
+			kring0[i]->nr_kflags |= NKR_TXPOLL;
+		else
+			kring0[i]->nr_kflags &= ~NKR_TXPOLL;
+	}
+	nbk->txpoll = on;
+	if (on)
+		return;
+	/* flush what senders queued before they saw the flag clear */
+	mb();
+	for (i = nbk->tx_qfirst; i < nbk->tx_qlast; i++)
+		netmap_bwrap_tx_flush(kring0[i], 0);
+}
+
+/* Give the TX rings back to the senders, with the kthreads stopped. */
+static void
+nm_bdg_poll_release_tx(struct nm_bdg_polling_state *bps)
+{
+	u_int i;
+
+	for (i = 0; i < bps->ncpus; i++) {
+		struct nm_bdg_kthread *t = bps->kthreads + i;
+
+		if (t->txpoll)
+			nm_bdg_poll_set_txpoll(t, false);
+	}
+}
+
+/*
+ * Move a kthread to or from sleep. The last kthread to sleep turns the
+ * interrupts on, the first to wake up turns them off.
+ */
+static void
+nm_bdg_poll_set_sleeping(struct nm_bdg_kthread *nbk, bool sleeping)
+{
+	struct nm_bdg_polling_state *bps = nbk->bps;
+
+	NM_MTX_LOCK(bps->intr_lock);
+	nbk->sleeping = sleeping;
+	if (sleeping) {
+		if (++bps->nsleeping == bps->ncpus)
+			nma_intr_enable(bps->bna->hwna, 1);
+	} else {
+		if (bps->nsleeping-- == bps->ncpus)
+			nma_intr_enable(bps->bna->hwna, 0);
+	}
+	NM_MTX_UNLOCK(bps->intr_lock);
+	if (netmap_verbose)
+		nm_prinf("%s: kthread for rings %u-%u %s",
+			bps->bna->hwna->name, nbk->qfirst, nbk->qlast - 1,
+			sleeping ? "sleeps" : "spins");
+}
+
 static void
 netmap_bwrap_polling(void *data)
 {
 	struct nm_bdg_kthread *nbk = data;
-	struct netmap_bwrap_adapter *bna;
-	u_int qfirst, qlast, i;
-	struct netmap_kring **kring0, *kring;
+	u_int idle_us = netmap_bdg_poll_idle_us;
+	uint64_t now;
+	u_int n;
 
 	if (!nbk)
 		return;
-	qfirst = nbk->qfirst;
-	qlast = nbk->qlast;
-	bna = nbk->bps->bna;
-	kring0 = NMR(bna->hwna, NR_RX);
-
-	for (i = qfirst; i < qlast; i++) {
-		kring = kring0[i];
-		kring->nm_notify(kring, 0);
+	if (nbk->txpoll != (netmap_bdg_poll_tx && !nbk->sleeping))
+		nm_bdg_poll_set_txpoll(nbk, !nbk->txpoll);
+	n = nm_bdg_poll_rings(nbk);
+	if (idle_us == 0 && !nbk->sleeping)
+		return;
+	now = nm_os_uptime_ns();
+	if (!nbk->sleeping) {
+		if (n > 0) {
+			nbk->last_work = now;
+		} else if (now - nbk->last_work > idle_us * 1000ULL) {
+			nm_bdg_poll_set_sleeping(nbk, true);
+		}
+		return;
 	}
+	if (idle_us == 0 || n >= netmap_bdg_poll_wake_pkts) {
+		nm_bdg_poll_set_sleeping(nbk, false);
+		nbk->last_work = now;
+		return;
+	}
+	nm_os_kctx_sleep_us(netmap_bdg_poll_sleep_us ?
+		netmap_bdg_poll_sleep_us : 1);
 }
 
 static int
 nm_bdg_create_kthreads(struct nm_bdg_polling_state *bps)
 {
+	u_int ntx = nma_get_nrings(bps->bna->hwna, NR_TX);
 	struct nm_kctx_cfg kcfg;
 	int i, j;
 
@@ -756,8 +1069,17 @@ nm_bdg_create_kthreads(struct nm_bdg_polling_state *bps)
 		int affinity = bps->cpu_from + i;
 
 		t->bps = bps;
+		t->sleeping = false;
+		t->txpoll = false;
+		t->last_work = nm_os_uptime_ns();
 		t->qfirst = all ? bps->qfirst /* must be 0 */: affinity;
 		t->qlast = all ? bps->qlast : t->qfirst + 1;
+		t->tx_qfirst = all ? 0 : t->qfirst;
+		t->tx_qlast = all ? ntx : t->qlast;
+		if (t->tx_qlast > ntx)
+			t->tx_qlast = ntx;
+		if (t->tx_qfirst > t->tx_qlast)
+			t->tx_qfirst = t->tx_qlast;
 		if (netmap_verbose)
 			nm_prinf("kthread %d a:%u qf:%u ql:%u", i, affinity, t->qfirst,
 				t->qlast);
@@ -774,7 +1096,7 @@ nm_bdg_create_kthreads(struct nm_bdg_polling_state *bps)
 
 cleanup:
 	for (j = 0; j < i; j++) {
-		struct nm_bdg_kthread *t = bps->kthreads + i;
+		struct nm_bdg_kthread *t = bps->kthreads + j;
 		nm_os_kctx_destroy(t->nmk);
 	}
 	nm_os_free(bps->kthreads);
@@ -805,7 +1127,7 @@ nm_bdg_polling_start_kthreads(struct nm_bdg_polling_state *bps)
 
 cleanup:
 	for (j = 0; j < i; j++) {
-		struct nm_bdg_kthread *t = bps->kthreads + i;
+		struct nm_bdg_kthread *t = bps->kthreads + j;
 		nm_os_kctx_worker_stop(t->nmk);
 	}
 	bps->stopped = true;
@@ -894,6 +1216,7 @@ nm_bdg_ctl_polling_start(struct nmreq_vale_polling *req, struct netmap_adapter *
 {
 	struct nm_bdg_polling_state *bps;
 	struct netmap_bwrap_adapter *bna;
+	u_int nrx, ntx, i;
 	int error;
 
 	bna = (struct netmap_bwrap_adapter *)na;
@@ -907,20 +1230,36 @@ nm_bdg_ctl_polling_start(struct nmreq_vale_polling *req, struct netmap_adapter *
 		return ENOMEM;
 	bps->configured = false;
 	bps->stopped = true;
+	bps->nsleeping = 0;
+	bps->bna = bna;
 
 	if (get_polling_cfg(req, na, bps)) {
 		nm_os_free(bps);
 		return EINVAL;
 	}
 
+	nrx = nma_get_nrings(bna->hwna, NR_RX);
+	ntx = nma_get_nrings(bna->hwna, NR_TX);
+	bps->rx_tails = nm_os_malloc(sizeof(*bps->rx_tails) * (nrx + ntx));
+	if (!bps->rx_tails) {
+		nm_os_free(bps);
+		return ENOMEM;
+	}
+	bps->tx_tails = bps->rx_tails + nrx;
+	for (i = 0; i < nrx; i++)
+		bps->rx_tails[i] = NMR(bna->hwna, NR_RX)[i]->nr_hwtail;
+	for (i = 0; i < ntx; i++)
+		bps->tx_tails[i] = NMR(na, NR_RX)[i]->nr_hwtail;
+
 	if (nm_bdg_create_kthreads(bps)) {
+		nm_os_free(bps->rx_tails);
 		nm_os_free(bps);
 		return EFAULT;
 	}
+	NM_MTX_INIT(bps->intr_lock);
 
 	bps->configured = true;
 	bna->na_polling_state = bps;
-	bps->bna = bna;
 
 	/* disable interrupts if possible */
 	nma_intr_enable(bna->hwna, 0);
@@ -928,7 +1267,10 @@ nm_bdg_ctl_polling_start(struct nmreq_vale_polling *req, struct netmap_adapter *
 	error = nm_bdg_polling_start_kthreads(bps);
 	if (error) {
 		nm_prerr("ERROR nm_bdg_polling_start_kthread()");
+		nm_bdg_poll_release_tx(bps);
+		NM_MTX_DESTROY(bps->intr_lock);
 		nm_os_free(bps->kthreads);
+		nm_os_free(bps->rx_tails);
 		nm_os_free(bps);
 		bna->na_polling_state = NULL;
 		nma_intr_enable(bna->hwna, 1);
@@ -948,7 +1290,11 @@ nm_bdg_ctl_polling_stop(struct netmap_adapter *na)
 	}
 	bps = bna->na_polling_state;
 	nm_bdg_polling_stop_delete_kthreads(bna->na_polling_state);
+	nm_bdg_poll_release_tx(bps);
 	bps->configured = false;
+	NM_MTX_DESTROY(bps->intr_lock);
+	nm_os_free(bps->kthreads);
+	nm_os_free(bps->rx_tails);
 	nm_os_free(bps);
 	bna->na_polling_state = NULL;
 	/* re-enable interrupts */
@@ -988,6 +1334,252 @@ nm_bdg_polling(struct nmreq_header *hdr)
 	return error;
 }
 
+/*
+ * Fan-out workers for the flush. They reuse the nm_kctx machinery of
+ * the polling kthreads above but, instead of polling a NIC, they wait
+ * for jobs posted by netmap_bdg_fanout_run(). Each worker owns one
+ * slice of the job. A slice that has not been picked up by its worker
+ * when the sender is done with its own share is stolen by the sender,
+ * so a sender never waits for a worker that is not running.
+ *
+ * A single pool of workers is shared by all the bridges, and one
+ * sender at a time uses it. A worker spins while jobs keep coming
+ * and, after netmap_bdg_fanout_idle_us without jobs, sleeps until the
+ * next sender wakes it up. The sender steals the slices of workers
+ * that are still waking up, so a sleeping pool only costs a wakeup.
+ */
+#define NM_FANOUT_IDLE		0
+#define NM_FANOUT_POSTED	1
+#define NM_FANOUT_RUNNING	2
+#define NM_FANOUT_DONE		3
+
+/* longest sleep of an idle worker, only bounds the time to notice a stop */
+#define NM_FANOUT_SLEEP_US	100000
+
+struct nm_bdg_fanout_worker {
+	struct nm_kctx *nmk;
+	struct nm_bdg_fanout *bf;
+	u_int slice;
+	NM_LOCK_T lock;		/* protects state and sleeping */
+	volatile int state;
+	int sleeping;
+	uint64_t last_job;	/* uptime of the last job, in ns */
+};
+
+struct nm_bdg_fanout {
+	NM_ATOMIC_T busy;	/* a sender owns the workers */
+	bdg_fanout_fn_t fn;	/* current job */
+	void *arg;
+	u_int nworkers;
+	struct nm_bdg_fanout_worker *workers;
+};
+
+/* the pool shared by the bridges, protected by NMG_LOCK */
+static struct nm_bdg_fanout *nm_bdg_fanout_pool;
+static u_int nm_bdg_fanout_refcount;
+
+static void
+netmap_bdg_fanout_worker(void *data)
+{
+	struct nm_bdg_fanout_worker *w = data;
+	struct nm_bdg_fanout *bf = w->bf;
+	uint64_t now;
+
+	if (likely(w->state != NM_FANOUT_POSTED)) {
+		now = nm_os_uptime_ns();
+		if (now - w->last_job <= netmap_bdg_fanout_idle_us * 1000ULL)
+			return; /* keep spinning, we will be called again */
+		mtx_lock(&w->lock);
+		if (w->state == NM_FANOUT_POSTED) {
+			mtx_unlock(&w->lock);
+			return;
+		}
+		w->sleeping = 1; /* from now on senders wake us up */
+		mtx_unlock(&w->lock);
+		if (!nm_os_kctx_wait_us(w->nmk, NM_FANOUT_SLEEP_US))
+			return; /* timeout, sleep again */
+		mtx_lock(&w->lock);
+		w->sleeping = 0;
+		mtx_unlock(&w->lock);
+		/* woken by a sender: spin for a while, more jobs are
+		 * likely to follow */
+		w->last_job = nm_os_uptime_ns();
+		return;
+	}
+	mtx_lock(&w->lock);
+	if (w->state != NM_FANOUT_POSTED) {
+		/* stolen by the sender */
+		mtx_unlock(&w->lock);
+		return;
+	}
+	w->state = NM_FANOUT_RUNNING;
+	w->sleeping = 0;
+	mtx_unlock(&w->lock);
+
+	bf->fn(bf->arg, w->slice, bf->nworkers + 1);
+
+	mtx_lock(&w->lock);
+	w->state = NM_FANOUT_DONE;
+	mtx_unlock(&w->lock);
+	w->last_job = nm_os_uptime_ns();
+}
+
+static void
+nm_bdg_fanout_destroy(struct nm_bdg_fanout *bf)
+{
+	u_int i;
+
+	if (bf == NULL)
+		return;
+	for (i = 0; i < bf->nworkers; i++) {
+		struct nm_bdg_fanout_worker *w = bf->workers + i;
+
+		nm_os_kctx_destroy(w->nmk); /* also stops the worker */
+		mtx_destroy(&w->lock);
+	}
+	nm_os_free(bf);
+}
+
+static struct nm_bdg_fanout *
+nm_bdg_fanout_create(int nworkers)
+{
+	struct nm_bdg_fanout *bf;
+	struct nm_kctx_cfg kcfg;
+	u_int i;
+	int error;
+
+	if (nworkers <= 0)
+		return NULL;
+	if ((u_int)nworkers >= nm_os_ncpus()) {
+		/* leave one CPU to the sender */
+		nworkers = nm_os_ncpus() - 1;
+		if (nworkers == 0)
+			return NULL;
+	}
+
+	bf = nm_os_malloc(sizeof(*bf) + nworkers * sizeof(*bf->workers));
+	if (bf == NULL)
+		return NULL;
+	bf->workers = (struct nm_bdg_fanout_worker *)(bf + 1);
+
+	bzero(&kcfg, sizeof(kcfg));
+	kcfg.worker_fn = netmap_bdg_fanout_worker;
+	for (i = 0; i < (u_int)nworkers; i++) {
+		struct nm_bdg_fanout_worker *w = bf->workers + i;
+
+		w->bf = bf;
+		w->slice = i + 1; /* slice 0 belongs to the sender */
+		w->state = NM_FANOUT_IDLE;
+		w->sleeping = 0;
+		w->last_job = 0; /* sleep right away */
+		mtx_init(&w->lock, "nm_fanout_lock", NULL, MTX_DEF);
+		bf->nworkers++;
+		kcfg.type = i;
+		kcfg.worker_private = w;
+		w->nmk = nm_os_kctx_create(&kcfg, NULL);
+		if (w->nmk == NULL)
+			goto cleanup;
+	}
+	for (i = 0; i < bf->nworkers; i++) {
+		error = nm_os_kctx_worker_start(bf->workers[i].nmk);
+		if (error) {
+			nm_prerr("error in nm_os_kctx_worker_start(): %d", error);
+			goto cleanup;
+		}
+	}
+	if (netmap_verbose)
+		nm_prinf("started %u flush workers", bf->nworkers);
+	return bf;
+
+cleanup:
+	nm_bdg_fanout_destroy(bf);
+	return NULL;
+}
+
+/* Take a reference to the shared pool, creating it for the first bridge.
+ * Bridges created while the pool could not be built do not use one.
+ */
+static struct nm_bdg_fanout *
+nm_bdg_fanout_get(void)
+{
+	NMG_LOCK_ASSERT();
+	if (nm_bdg_fanout_refcount == 0)
+		nm_bdg_fanout_pool = nm_bdg_fanout_create(netmap_bdg_fanout_workers);
+	if (nm_bdg_fanout_pool == NULL)
+		return NULL;
+	nm_bdg_fanout_refcount++;
+	return nm_bdg_fanout_pool;
+}
+
+static void
+nm_bdg_fanout_put(struct nm_bdg_fanout *bf)
+{
+	NMG_LOCK_ASSERT();
+	if (bf == NULL)
+		return;
+	if (--nm_bdg_fanout_refcount == 0) {
+		nm_bdg_fanout_destroy(nm_bdg_fanout_pool);
+		nm_bdg_fanout_pool = NULL;
+	}
+}
+
+/* Split a job into nworkers + 1 slices and wait for their completion.
+ * Must be called from a context that can wait for another thread,
+ * i.e. not from interrupt context.
+ */
+int
+netmap_bdg_fanout_run(struct nm_bridge *b, bdg_fanout_fn_t fn, void *arg)
+{
+	struct nm_bdg_fanout *bf = b->bdg_fanout;
+	u_int i;
+
+	if (bf == NULL || NM_ATOMIC_TEST_AND_SET(&bf->busy))
+		return EBUSY;
+
+	bf->fn = fn;
+	bf->arg = arg;
+	for (i = 0; i < bf->nworkers; i++) {
+		struct nm_bdg_fanout_worker *w = bf->workers + i;
+		int sleeping;
+
+		mtx_lock(&w->lock);
+		w->state = NM_FANOUT_POSTED;
+		sleeping = w->sleeping;
+		mtx_unlock(&w->lock);
+		if (sleeping)
+			nm_os_kctx_wakeup(w->nmk);
+	}
+
+	fn(arg, 0, bf->nworkers + 1);
+
+	for (i = 0; i < bf->nworkers; i++) {
+		struct nm_bdg_fanout_worker *w = bf->workers + i;
+		int state;
+
+		mtx_lock(&w->lock);
+		state = w->state;
+		if (state != NM_FANOUT_RUNNING)
+			w->state = NM_FANOUT_IDLE;
+		mtx_unlock(&w->lock);
+		if (state == NM_FANOUT_POSTED) {
+			/* the worker did not start yet, do it here */
+			fn(arg, w->slice, bf->nworkers + 1);
+			continue;
+		}
+		/* wait for a running worker */
+		while (state == NM_FANOUT_RUNNING) {
+			mtx_lock(&w->lock);
+			state = w->state;
+			if (state == NM_FANOUT_DONE)
+				w->state = NM_FANOUT_IDLE;
+			mtx_unlock(&w->lock);
+		}
+	}
+
+	NM_ATOMIC_CLEAR(&bf->busy);
+	return 0;
+}
+
 /* Called by external kernel modules (e.g., Openvswitch).
  * to set configure/lookup/dtor functions of a VALE instance.
  * Register callbacks to the given bridge. 'name' may be just
@@ -1016,7 +1608,7 @@ netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *privat
 	BDG_WLOCK(b);
 	if (!bdg_ops) {
 		/* resetting the bridge */
-		bzero(b->ht, sizeof(struct nm_hash_ent) * NM_BDG_HASH);
+		nm_bdg_ht_flush(b->ht);
 		b->bdg_ops = b->bdg_saved_ops;
 		b->private_data = b->ht;
 	} else {
@@ -1024,6 +1616,9 @@ netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *privat
 		b->private_data = private_data;
 #define nm_bdg_override(m) if (bdg_ops->m) b->bdg_ops.m = bdg_ops->m
 		nm_bdg_override(lookup);
+		/* a per-packet lookup replaces a previous batch one */
+		if (bdg_ops->lookup || bdg_ops->lookup_batch)
+			b->bdg_ops.lookup_batch = bdg_ops->lookup_batch;
 		nm_bdg_override(config);
 		nm_bdg_override(dtor);
 		nm_bdg_override(vp_create);
@@ -1101,6 +1696,8 @@ netmap_vp_rxsync_locked(struct netmap_kring *kring, int flags)
 	struct netmap_ring *ring = kring->ring;
 	u_int nm_i, lim = kring->nkr_num_slots - 1;
 	u_int head = kring->rhead;
+	const u_int *refs;
+	u_int nrefs;
 	int n;
 
 	if (head > lim) {
@@ -1112,9 +1709,14 @@ netmap_vp_rxsync_locked(struct netmap_kring *kring, int flags)
 	/* First part, import newly received packets. */
 	/* actually nothing to do here, they are already in the kring */
 
-	/* Second part, skip past packets that userspace has released. */
+	/* Second part, skip past packets that userspace has released.
+	 * The slots that hold a buffer shared with other rings (see
+	 * nm_vale_brd_hold()) need a private one before we can write
+	 * them again. If none is available the slot is not released.
+	 */
 	nm_i = kring->nr_hwcur;
 	if (nm_i != head) {
+		refs = netmap_mem_bufrefs(na->nm_mem, &nrefs);
 		/* consistency check, but nothing really important here */
 		for (n = 0; likely(nm_i != head); n++) {
 			struct netmap_slot *slot = &ring->slot[nm_i];
@@ -1124,10 +1726,19 @@ netmap_vp_rxsync_locked(struct netmap_kring *kring, int flags)
 				nm_prerr("bad buffer index %d, ignore ?",
 					slot->buf_idx);
 			}
+			if (unlikely(refs != NULL) && slot->buf_idx < nrefs &&
+			    refs[slot->buf_idx] != 0) {
+				uint32_t idx = netmap_mem_buf_unshare(na->nm_mem,
+						slot->buf_idx);
+
+				if (idx == 0)
+					break;
+				slot->buf_idx = idx;
+			}
 			slot->flags &= ~NS_BUF_CHANGED;
 			nm_i = nm_next(nm_i, lim);
 		}
-		kring->nr_hwcur = head;
+		kring->nr_hwcur = nm_i;
 	}
 
 	n = 0;
@@ -1277,6 +1888,30 @@ netmap_bwrap_intr_notify(struct netmap_kring *kring, int flags)
 		goto put_out;
 	}
 
+	/* Coalesce small bursts: leave the packets in the ring and ask
+	 * the driver to poll again (on Linux NM_IRQ_RESCHED keeps NAPI
+	 * scheduled on this CPU), so that a later call flushes the work
+	 * of several interrupts at once. Never wait for more than half
+	 * of the ring, nor more than intr_defer_max times in a row.
+	 */
+	if (netmap_intr_batch > 0 &&
+	    kring->nkr_intr_deferred < (uint32_t)netmap_intr_defer_max) {
+		u_int n = kring->nr_hwtail - kring->rcur;
+
+		if (kring->nr_hwtail < kring->rcur)
+			n += kring->nkr_num_slots;
+		if (n < (u_int)netmap_intr_batch &&
+		    n < kring->nkr_num_slots / 2) {
+			kring->nkr_intr_deferred++;
+			ret = NM_IRQ_RESCHED;
+			goto put_out;
+		}
+	}
+	kring->nkr_intr_deferred = 0;
+
+	NM_TRACE(bwrap_intr, kring, kring->nr_hwtail - kring->rcur +
+		(kring->nr_hwtail < kring->rcur ? kring->nkr_num_slots : 0));
+
 	/* new packets are kring->rcur to kring->nr_hwtail, and the bkring
 	 * had hwcur == bkring->rhead. So advance bkring->rhead to kring->nr_hwtail
 	 * to push all packets out.
@@ -1394,6 +2029,7 @@ netmap_bwrap_reg(struct netmap_adapter *na, int onoff)
 		}
 		hwna->na_lut.lut = NULL;
 		hwna->na_lut.plut = NULL;
+		hwna->na_lut.vbase = NULL;
 		hwna->na_lut.objtotal = 0;
 		hwna->na_lut.objsize = 0;
 
@@ -1597,9 +2233,9 @@ netmap_bwrap_krings_delete_common(struct netmap_adapter *na)
 }
 
 
-/* notify method for the bridge-->hwna direction */
-int
-netmap_bwrap_notify(struct netmap_kring *kring, int flags)
+/* Send the packets queued on a bwrap rx kring through the hwna. */
+static int
+netmap_bwrap_tx_flush(struct netmap_kring *kring, int flags)
 {
 	struct netmap_adapter *na = kring->na;
 	struct netmap_bwrap_adapter *bna = na->na_private;
@@ -1651,6 +2287,17 @@ put_out:
 	return error ? error : NM_IRQ_COMPLETED;
 }
 
+/* notify method for the bridge-->hwna direction */
+int
+netmap_bwrap_notify(struct netmap_kring *kring, int flags)
+{
+	/* the packets are in the ring, order with the read of the flag */
+	mb();
+	if (kring->nr_kflags & NKR_TXPOLL)
+		return NM_IRQ_COMPLETED; /* a polling kthread flushes it */
+	return netmap_bwrap_tx_flush(kring, flags);
+}
+
 
 /* nm_bdg_ctl callback for the bwrap.
  * Called on bridge-attach and detach, as an effect of vale-ctl -[ahd].
@@ -1800,12 +2447,23 @@ netmap_init_bridges2(u_int n)
 {
 	int i;
 	struct nm_bridge *b;
+	uint32_t *idx;
+	struct netmap_vp_adapter **ports;
+	u_int np = netmap_bdg_max_ports;
 
-	b = nm_os_malloc(sizeof(struct nm_bridge) * n);
+	/* the port tables of all the bridges follow the bridges */
+	b = nm_os_malloc((sizeof(struct nm_bridge) +
+		np * (2 * sizeof(uint32_t) + sizeof(*ports))) * n);
 	if (b == NULL)
 		return NULL;
-	for (i = 0; i < n; i++)
+	ports = (struct netmap_vp_adapter **)(b + n);
+	idx = (uint32_t *)(ports + np * n);
+	for (i = 0; i < n; i++) {
+		b[i].bdg_ports = ports + np * i;
+		b[i].bdg_port_index = idx + 2 * np * i;
+		b[i].tmp_bdg_port_index = b[i].bdg_port_index + np;
 		BDG_RWINIT(&b[i]);
+	}
 	return b;
 }
 
@@ -1825,6 +2483,9 @@ netmap_uninit_bridges2(struct nm_bridge *b, u_int n)
 int
 netmap_init_bridges(void)
 {
+	/* leave room for at least a NIC and its host stack */
+	nm_bound_var(&netmap_bdg_max_ports, NM_BDG_PORTS, 3,
+			NM_BDG_MAXPORTS, "bdg_max_ports");
 #ifdef CONFIG_NET_NS
 	return netmap_bns_register();
 #else
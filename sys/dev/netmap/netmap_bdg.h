@@ -49,12 +49,23 @@
  * kernel modules.
  *
  * VALE only supports unicast or broadcast. The lookup
- * function can return 0 .. NM_BDG_MAXPORTS-1 for regular ports,
- * NM_BDG_MAXPORTS for broadcast, NM_BDG_MAXPORTS+1 to indicate
- * drop.
+ * function can return 0 .. netmap_bdg_max_ports-1 for regular ports,
+ * NM_BDG_BROADCAST for broadcast, NM_BDG_NOPORT to indicate
+ * drop, or NM_BDG_MCAST(g) for the members of a multicast group
+ * of the learning table.
  */
 typedef uint32_t (*bdg_lookup_fn_t)(struct nm_bdg_fwd *ft, uint8_t *ring_nr,
 		struct netmap_vp_adapter *, void *private_data);
+/*
+ * Optional batch version of the lookup function, called once per batch
+ * instead of the per-packet lookup. pkts[i] is the fragment where the
+ * ethernet header of the i-th packet starts (as in the per-packet
+ * lookup). The function must set dst_port[i] and may change
+ * dst_ring[i], which is initialized with the source ring.
+ */
+typedef void (*bdg_lookup_batch_fn_t)(struct nm_bdg_fwd **pkts,
+		uint32_t *dst_port, uint8_t *dst_ring, u_int n,
+		struct netmap_vp_adapter *, void *private_data);
 typedef int (*bdg_config_fn_t)(struct nm_ifreq *);
 typedef void (*bdg_dtor_fn_t)(const struct netmap_vp_adapter *);
 typedef void *(*bdg_update_private_data_fn_t)(void *private_data, void *callback_data, int *error);
@@ -64,6 +75,7 @@ typedef int (*bdg_vp_create_fn_t)(struct nmreq_header *hdr,
 typedef int (*bdg_bwrap_attach_fn_t)(const char *nr_name, struct netmap_adapter *hwna);
 struct netmap_bdg_ops {
 	bdg_lookup_fn_t lookup;
+	bdg_lookup_batch_fn_t lookup_batch;
 	bdg_config_fn_t config;
 	bdg_dtor_fn_t	dtor;
 	bdg_vp_create_fn_t	vp_create;
@@ -73,27 +85,101 @@ struct netmap_bdg_ops {
 int netmap_bwrap_attach(const char *name, struct netmap_adapter *, struct netmap_bdg_ops *);
 int netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *private_data, void *auth_token);
 
-#define	NM_BRIDGES		8	/* number of bridges */
-#define	NM_BDG_MAXPORTS		254	/* up to 254 */
+/*
+ * Optional fan-out of the per-destination phase of a flush.
+ * If dev.netmap.bdg_fanout_workers is non zero when the first bridge
+ * is created, that many kernel workers are started and shared by all
+ * the bridges until the last one is destroyed. A sender posts
+ * a job with netmap_bdg_fanout_run(), runs slice 0 itself and the
+ * workers run slices 1 .. nslices-1. The call returns when all
+ * slices are complete, or EBUSY if the workers are not available,
+ * e.g. busy with a flush of another bridge (the caller then does all
+ * the work itself).
+ */
+typedef void (*bdg_fanout_fn_t)(void *arg, u_int slice, u_int nslices);
+struct nm_bdg_fanout;
+struct nm_vale_l3;
+
+#define	NM_BRIDGES		8	/* default number of bridges */
+#define	NM_BDG_PORTS		254	/* default ports per bridge */
+/* Upper bound for netmap_bdg_max_ports. Port and ring are packed in
+ * 16 bits in the forwarding tables, see nm_vale_flush().
+ */
+#define	NM_BDG_MAXPORTS		4094
 #define	NM_BDG_BROADCAST	NM_BDG_MAXPORTS
 #define	NM_BDG_NOPORT		(NM_BDG_MAXPORTS+1)
 
-/* XXX Should go away after fixing find_bridge() - Michio */
-#define NM_BDG_HASH		1024	/* forwarding table entries */
+/* Number of ports of each bridge (loader tunable). */
+extern u_int netmap_bdg_max_ports;
+
+/*
+ * Forwarding table used by the default (learning) lookup function.
+ * The table is set associative: each bucket holds NM_BDG_HASH_WAYS
+ * entries and fits in a cache line. The size is chosen when the
+ * bridge is created (see NETMAP_REQ_OPT_VALE_HASH).
+ */
+#define NM_BDG_HASH		1024	/* default number of entries */
+#define NM_BDG_HASH_MAX		65536	/* max number of entries */
+#define NM_BDG_HASH_WAYS	4	/* entries per bucket */
+#define NM_BDG_HASH_ALIGN	64	/* alignment of the buckets */
 
-/* XXX revise this */
 struct nm_hash_ent {
-	uint64_t	mac;	/* the top 2 bytes are the epoch */
-	uint64_t	ports;
+	uint64_t	mac;
+	uint64_t	ports;	/* the top 4 bytes are the epoch */
+};
+
+struct nm_hash_bucket {
+	struct nm_hash_ent	ent[NM_BDG_HASH_WAYS];
+};
+
+/*
+ * Multicast groups learned by IGMP/MLD snooping (see netmap_vale.c).
+ * The hash table maps the MAC address of group g to the port
+ * NM_BDG_MCAST(g), and frames sent there are only replicated to the
+ * members of g, rather than flooded.
+ */
+#define NM_BDG_MGRPS		255	/* groups per bridge */
+#define NM_BDG_MCAST_BASE	0x10000
+#define NM_BDG_MCAST(g)		(NM_BDG_MCAST_BASE + (g))
+#define NM_BDG_IS_MCAST(p)	((uint32_t)((p) - NM_BDG_MCAST_BASE) < NM_BDG_MGRPS)
+
+struct nm_hash_table {
+	uint32_t		nbuckets;	/* a power of 2 */
+	struct nm_hash_bucket	*buckets;	/* cache aligned */
+
+	NM_LOCK_T		mgrp_lock;	/* serializes joins and leaves */
+	uint32_t		mgrp_words;	/* words in a member bitmap */
+	uint64_t		*mgrp_macs;	/* group address, 0 if free */
+	uint32_t		*mgrp_epochs;	/* last report for each group */
+	uint32_t		*mgrp_ports;	/* member bitmaps, one per group */
 };
 
+static inline uint32_t *
+nm_bdg_mgrp_ports(struct nm_hash_table *ht, u_int g)
+{
+	return ht->mgrp_ports + (size_t)g * ht->mgrp_words;
+}
+
+/* true if 'port' is a member of group g */
+static inline int
+nm_bdg_mgrp_has(struct nm_hash_table *ht, u_int g, u_int port)
+{
+	return (nm_bdg_mgrp_ports(ht, g)[port >> 5] >> (port & 31)) & 1;
+}
+
+/* the epoch, in seconds, is kept in the top 32 bits of nm_hash_ent.ports */
+#define NM_HT_PORT(p)		((uint32_t)(p))
+#define NM_HT_EPOCH(p)		((uint32_t)((p) >> 32))
+#define NM_HT_ENT(port, epoch)	((uint32_t)(port) | ((uint64_t)(epoch) << 32))
+
 /* Default size for the Maximum Frame Size. */
 #define NM_BDG_MFS_DEFAULT	1514
 
 /*
  * nm_bridge is a descriptor for a VALE switch.
  * Interfaces for a bridge are all in bdg_ports[].
- * The array has fixed size, an empty entry does not terminate
+ * The array has netmap_bdg_max_ports entries, allocated together
+ * with the bridges. An empty entry does not terminate
  * the search, but lookups only occur on attach/detach so we
  * don't mind if they are slow.
  *
@@ -114,11 +200,11 @@ struct nm_bridge {
 	/* Indexes of active ports (up to active_ports)
 	 * and all other remaining ports.
 	 */
-	uint32_t	bdg_port_index[NM_BDG_MAXPORTS];
+	uint32_t	*bdg_port_index;
 	/* used by netmap_bdg_detach_common() */
-	uint32_t	tmp_bdg_port_index[NM_BDG_MAXPORTS];
+	uint32_t	*tmp_bdg_port_index;
 
-	struct netmap_vp_adapter *bdg_ports[NM_BDG_MAXPORTS];
+	struct netmap_vp_adapter **bdg_ports;
 
 	/*
 	 * Programmable lookup functions to figure out the destination port.
@@ -138,7 +224,7 @@ struct nm_bridge {
 	 * otherwise will point to the data structure received by netmap_bdg_regops().
 	 */
 	void *private_data;
-	struct nm_hash_ent *ht;
+	struct nm_hash_table *ht;
 
 	/* Currently used to specify if the bridge is still in use while empty and
 	 * if it has been put in exclusive mode by an external module, see netmap_bdg_regops()
@@ -149,6 +235,13 @@ struct nm_bridge {
 #define NM_BDG_NEED_BWRAP	4
 	uint8_t			bdg_flags;
 
+	/* helper workers for the flush, see netmap_bdg_fanout_run() */
+	struct nm_bdg_fanout	*bdg_fanout;
+
+#ifdef WITH_VALE_L3
+	/* routes and ACL rules, see netmap_vale_l3.c */
+	struct nm_vale_l3	*bdg_l3;
+#endif /* WITH_VALE_L3 */
 
 #ifdef CONFIG_NET_NS
 	struct net *ns;
@@ -180,6 +273,16 @@ int netmap_vp_bdg_ctl(struct nmreq_header *hdr, struct netmap_adapter *na);
 int netmap_bwrap_reg(struct netmap_adapter *, int onoff);
 int netmap_bdg_detach_locked(struct nmreq_header *hdr, void *auth_token);
 int netmap_vp_reg(struct netmap_adapter *na, int onoff);
+
+/* true if the only registration of na is the one that keeps a
+ * persistent VALE port warm
+ */
+static inline int
+netmap_vp_warm_only(struct netmap_adapter *na)
+{
+	return na->nm_register == netmap_vp_reg && na->active_fds == 1 &&
+		((struct netmap_vp_adapter *)na)->na_kpriv != NULL;
+}
 int netmap_vp_rxsync(struct netmap_kring *kring, int flags);
 int netmap_bwrap_intr_notify(struct netmap_kring *kring, int flags);
 int netmap_bwrap_notify(struct netmap_kring *kring, int flags);
@@ -193,6 +296,9 @@ int netmap_bdg_update_private_data(const char *name, bdg_update_private_data_fn_
 	void *callback_data, void *auth_token);
 int netmap_bdg_config(struct nm_ifreq *nifr);
 int nm_is_bwrap(struct netmap_adapter *);
+int netmap_bdg_fanout_run(struct nm_bridge *b, bdg_fanout_fn_t fn, void *arg);
+struct nm_hash_table *nm_bdg_ht_alloc(u_int entries);
+void nm_bdg_ht_free(struct nm_hash_table *ht);
 
 #define NM_NEED_BWRAP (-2)
 #endif /* _NET_NETMAP_BDG_H_ */
@@ -0,0 +1,288 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * $FreeBSD$
+ *
+ * Microbenchmarks of the kernel hot paths (NETMAP_REQ_BENCH).
+ *
+ * Each test runs one of the routines used in the datapath in a tight
+ * loop, on the buffers of the port bound to the file descriptor or on
+ * synthetic data, and reports the elapsed cycles and nanoseconds. The
+ * loops run in the context of the calling thread, which is not pinned
+ * or protected from interrupts: applications should run on an idle
+ * CPU and repeat the measure. See utils/kbench.c.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+__FBSDID("$FreeBSD$");
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/malloc.h>
+#include <sys/socket.h> /* sockaddrs */
+#include <sys/selinfo.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <machine/cpu.h>	/* get_cyclecount() */
+
+#define NM_BENCH_CYCLES()	((uint64_t)get_cyclecount())
+#define NM_BENCH_NOW_NS()	((uint64_t)sbttons(sbinuptime()))
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+#include <linux/ktime.h>
+#include <linux/timex.h>	/* get_cycles() */
+
+#define NM_BENCH_CYCLES()	((uint64_t)get_cycles())
+#define NM_BENCH_NOW_NS()	((uint64_t)ktime_get_ns())
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+/*
+ * common headers
+ */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+#include <dev/netmap/netmap_mem2.h>
+#include <dev/netmap/netmap_bdg.h>
+
+#ifdef WITH_BENCH
+
+#define NM_BENCH_FRAME	64	/* bytes per frame in NR_BENCH_LEARN */
+#define NM_BENCH_PORTS	8	/* source ports in NR_BENCH_LEARN */
+#define NM_BENCH_BATCH	1024	/* max nr_batch, as NM_BDG_BATCH */
+
+/* The tests only time their loops, not the setup. */
+struct nm_bench_clock {
+	uint64_t	cycles;
+	uint64_t	ns;
+};
+
+static inline void
+nm_bench_start(struct nm_bench_clock *c)
+{
+	c->ns = NM_BENCH_NOW_NS();
+	c->cycles = NM_BENCH_CYCLES();
+}
+
+static inline void
+nm_bench_stop(struct nm_bench_clock *c, struct nmreq_bench *req)
+{
+	req->nr_cycles = NM_BENCH_CYCLES() - c->cycles;
+	req->nr_ns = NM_BENCH_NOW_NS() - c->ns;
+}
+
+/* Copy between the buffers of the first two slots of a TX ring. */
+static int
+nm_bench_copy(struct netmap_adapter *na, struct nmreq_bench *req)
+{
+	struct netmap_ring *ring = na->tx_rings[0]->ring;
+	struct nm_bench_clock c;
+	void *src, *dst;
+
+	if (req->nr_batch != 1 || ring->num_slots < 2 ||
+	    req->nr_len == 0 || req->nr_len > NETMAP_BUF_SIZE(na))
+		return EINVAL;
+	src = NMB(na, &ring->slot[0]);
+	dst = NMB(na, &ring->slot[1]);
+	nm_bench_start(&c);
+	nm_vale_bench_copy(src, dst, req->nr_len, req->nr_count);
+	nm_bench_stop(&c, req);
+	return 0;
+}
+
+/*
+ * Learning lookup on batches of frames, each one with its own source
+ * address and addressed to the source of the next one, as sent by
+ * NM_BENCH_PORTS ports. After the first batch every lookup hits.
+ */
+static int
+nm_bench_learn(struct netmap_adapter *na, struct nmreq_bench *req)
+{
+	struct netmap_vp_adapter *vpna = NULL;
+	struct nm_hash_table *ht = NULL;
+	struct nm_bdg_fwd *ft = NULL;
+	struct nm_bench_clock c;
+	uint8_t *frames = NULL, dst_ring = 0;
+	u_int n = req->nr_batch, i, k;
+	int error = ENOMEM;
+
+	(void)na;
+	if (n == 0 || n > NM_BENCH_BATCH)
+		return EINVAL;
+	vpna = nm_os_malloc(sizeof(*vpna));
+	ht = nm_bdg_ht_alloc(0);
+	ft = nm_os_malloc(n * sizeof(*ft));
+	frames = nm_os_malloc(n * NM_BENCH_FRAME);
+	if (vpna == NULL || ht == NULL || ft == NULL || frames == NULL)
+		goto out;
+
+	for (k = 0; k < n; k++) {
+		uint8_t *f = frames + k * NM_BENCH_FRAME;
+		u_int next = (k + 1) % n;
+
+		/* locally administered unicast 02:00:00:00:xx:xx */
+		f[0] = 0x02;
+		f[4] = next >> 8;
+		f[5] = next;
+		f[6] = 0x02;
+		f[10] = k >> 8;
+		f[11] = k;
+		f[12] = 0x08; /* IPv4 */
+		ft[k].ft_buf = f;
+		ft[k].ft_len = 60;
+		ft[k].ft_frags = 1;
+	}
+	nm_bench_start(&c);
+	for (i = 0; i < req->nr_count; i++) {
+		for (k = 0; k < n; k++) {
+			vpna->bdg_port = k % NM_BENCH_PORTS;
+			netmap_vale_learning(&ft[k], &dst_ring, vpna, ht);
+		}
+	}
+	nm_bench_stop(&c, req);
+	error = 0;
+out:
+	if (frames)
+		nm_os_free(frames);
+	if (ft)
+		nm_os_free(ft);
+	if (ht)
+		nm_os_free(ht);
+	if (vpna)
+		nm_os_free(vpna);
+	return error;
+}
+
+/* Allocate and free batches of buffers from the pool of the port. */
+static int
+nm_bench_alloc(struct netmap_adapter *na, struct nmreq_bench *req)
+{
+	u_int n = req->nr_batch, i;
+	struct nm_bench_clock c;
+	uint32_t *idx;
+	int error = 0;
+
+	if (n == 0 || n > NM_BENCH_BATCH)
+		return EINVAL;
+	idx = nm_os_malloc(n * sizeof(*idx));
+	if (idx == NULL)
+		return ENOMEM;
+	nm_bench_start(&c);
+	for (i = 0; i < req->nr_count; i++) {
+		u_int got = netmap_mem_bufs_get(na->nm_mem, idx, n);
+
+		netmap_mem_bufs_put(na->nm_mem, idx, got);
+		if (got < n) {
+			error = ENOMEM;
+			break;
+		}
+	}
+	nm_bench_stop(&c, req);
+	nm_os_free(idx);
+	return error;
+}
+
+/* Checksum the buffer of the first slot of a TX ring. */
+static int
+nm_bench_csum(struct netmap_adapter *na, struct nmreq_bench *req)
+{
+	struct netmap_ring *ring = na->tx_rings[0]->ring;
+	uint8_t *buf = NMB(na, &ring->slot[0]);
+	struct nm_bench_clock c;
+	volatile uint16_t sum;
+	u_int i;
+
+	if (req->nr_batch != 1 || req->nr_len == 0 ||
+	    req->nr_len > NETMAP_BUF_SIZE(na))
+		return EINVAL;
+	nm_bench_start(&c);
+	for (i = 0; i < req->nr_count; i++)
+		sum = nm_os_csum_fold(nm_os_csum_raw(buf, req->nr_len, 0));
+	nm_bench_stop(&c, req);
+	(void)sum;
+	return 0;
+}
+
+/* Process NETMAP_REQ_BENCH */
+int
+netmap_bench(struct netmap_priv_d *priv, struct nmreq_header *hdr)
+{
+	struct nmreq_bench *req =
+		(struct nmreq_bench *)(uintptr_t)hdr->nr_body;
+	int (*test)(struct netmap_adapter *, struct nmreq_bench *);
+	struct netmap_adapter *na;
+
+	if (priv->np_nifp == NULL) {
+		return ENXIO;
+	}
+	mb(); /* make sure following reads are not from cache */
+
+	na = priv->np_na;
+	if (!nm_netmap_on(na) || na->num_tx_rings == 0) {
+		return ENXIO;
+	}
+
+	switch (req->nr_test) {
+	case NR_BENCH_COPY:
+		test = nm_bench_copy;
+		break;
+	case NR_BENCH_LEARN:
+		test = nm_bench_learn;
+		break;
+	case NR_BENCH_ALLOC:
+		test = nm_bench_alloc;
+		break;
+	case NR_BENCH_CSUM:
+		test = nm_bench_csum;
+		break;
+	default:
+		return EINVAL;
+	}
+	if (req->nr_count == 0 || req->nr_batch == 0 ||
+	    (uint64_t)req->nr_count * req->nr_batch > NR_BENCH_MAX_OPS)
+		return EINVAL;
+	req->nr_cycles = req->nr_ns = 0;
+
+	return test(na, req);
+}
+#endif /* WITH_BENCH */
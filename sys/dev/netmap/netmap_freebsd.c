@@ -41,6 +41,7 @@
 #include <sys/syscallsubr.h> /* kern_ioctl() */
 
 #include <sys/rwlock.h>
+#include <sys/callout.h>
 
 #include <vm/vm.h>      /* vtophys */
 #include <vm/pmap.h>    /* vtophys */
@@ -60,6 +61,7 @@
 #include <sys/sched.h> /* sched_bind() */
 #include <sys/smp.h> /* mp_maxid */
 #include <sys/taskqueue.h> /* taskqueue_enqueue(), taskqueue_create(), ... */
+#include <sys/sdt.h> /* SDT_PROBE*(), used WITH_TRACE */
 #include <net/if.h>
 #include <net/if_var.h>
 #include <net/if_types.h> /* IFT_ETHER */
@@ -72,6 +74,7 @@
 #include <net/netmap.h>
 #include <dev/netmap/netmap_kern.h>
 #include <net/netmap_virt.h>
+#include <net/netmap_csum.h>
 #include <dev/netmap/netmap_mem2.h>
 
 
@@ -218,34 +221,81 @@ nm_os_ifnet_mtu(struct ifnet *ifp)
 #endif
 }
 
-rawsum_t
-nm_os_csum_raw(uint8_t *data, size_t len, rawsum_t cur_sum)
+int
+nm_os_ifnet_numa_node(struct ifnet *ifp)
 {
-	/* TODO XXX please use the FreeBSD implementation for this. */
-	uint16_t *words = (uint16_t *)data;
-	int nw = len / 2;
-	int i;
+#ifdef IF_NODOM
+	if (ifp->if_numa_domain != IF_NODOM)
+		return ifp->if_numa_domain;
+#endif /* IF_NODOM */
+	return -1;
+}
+
+/* There is no driver-independent interface to the n-tuple filters. */
+int
+nm_os_flow_rule(struct ifnet *ifp, struct nmreq_flow_rule *req, int add)
+{
+	return EOPNOTSUPP;
+}
+
+#ifdef WITH_TRACE
+/* dtrace -l -P netmap */
+SDT_PROVIDER_DEFINE(netmap);
+SDT_PROBE_DEFINE5(netmap, , kring, sync, "struct netmap_kring *", "int",
+    "u_int", "u_int", "u_int");
+SDT_PROBE_DEFINE2(netmap, , kring, bwrap__intr, "struct netmap_kring *",
+    "u_int");
+SDT_PROBE_DEFINE2(netmap, , kring, vale__flush, "struct netmap_kring *",
+    "u_int");
+SDT_PROBE_DEFINE2(netmap, , kring, latency, "struct netmap_kring *",
+    "uint64_t");
+
+void
+nm_os_trace_sync(struct netmap_kring *kring, u_int head, u_int cur)
+{
+	SDT_PROBE5(netmap, , kring, sync, kring, kring->tx == NR_TX,
+	    kring->nr_hwcur, head, cur);
+}
 
-	for (i = 0; i < nw; i++)
-		cur_sum += be16toh(words[i]);
+void
+nm_os_trace_bwrap_intr(struct netmap_kring *kring, u_int slots)
+{
+	SDT_PROBE2(netmap, , kring, bwrap__intr, kring, slots);
+}
 
-	if (len & 1)
-		cur_sum += (data[len-1] << 8);
+void
+nm_os_trace_vale_flush(struct netmap_kring *kring, u_int slots)
+{
+	SDT_PROBE2(netmap, , kring, vale__flush, kring, slots);
+}
 
-	return cur_sum;
+void
+nm_os_trace_latency(struct netmap_kring *kring, uint64_t ns)
+{
+	SDT_PROBE2(netmap, , kring, latency, kring, ns);
 }
 
-/* Fold a raw checksum: 'cur_sum' is in host byte order, while the
- * return value is in network byte order.
+uint64_t
+nm_os_trace_ns(void)
+{
+	return sbttons(sbinuptime());
+}
+#endif /* WITH_TRACE */
+
+/* The words are summed in host byte order, as on Linux. */
+rawsum_t
+nm_os_csum_raw(uint8_t *data, size_t len, rawsum_t cur_sum)
+{
+	return nm_csum_partial(data, len, cur_sum);
+}
+
+/* Fold a raw checksum: the return value can be stored in the packet
+ * as is.
  */
 uint16_t
 nm_os_csum_fold(rawsum_t cur_sum)
 {
-	/* TODO XXX please use the FreeBSD implementation for this. */
-	while (cur_sum >> 16)
-		cur_sum = (cur_sum & 0xFFFF) + (cur_sum >> 16);
-
-	return htobe16((~cur_sum) & 0xFFFF);
+	return nm_csum_fold(cur_sum);
 }
 
 uint16_t nm_os_csum_ipv4(struct nm_iphdr *iph)
@@ -264,13 +314,11 @@ nm_os_csum_tcpudp_ipv4(struct nm_iphdr *iph, void *data,
 #ifdef INET
 	uint16_t pseudolen = datalen + iph->protocol;
 
-	/* Compute and insert the pseudo-header checksum. */
-	*check = in_pseudo(iph->saddr, iph->daddr,
-				 htobe16(pseudolen));
-	/* Compute the checksum on TCP/UDP header + payload
-	 * (includes the pseudo-header).
+	/* Compute the checksum on TCP/UDP header + payload, starting
+	 * from the pseudo-header checksum.
 	 */
-	*check = nm_os_csum_fold(nm_os_csum_raw(data, datalen, 0));
+	*check = nm_os_csum_fold(nm_os_csum_raw(data, datalen,
+			in_pseudo(iph->saddr, iph->daddr, htobe16(pseudolen))));
 #else
 	static int notsupported = 0;
 	if (!notsupported) {
@@ -285,8 +333,8 @@ nm_os_csum_tcpudp_ipv6(struct nm_ipv6hdr *ip6h, void *data,
 					size_t datalen, uint16_t *check)
 {
 #ifdef INET6
-	*check = in6_cksum_pseudo((void*)ip6h, datalen, ip6h->nexthdr, 0);
-	*check = nm_os_csum_fold(nm_os_csum_raw(data, datalen, 0));
+	*check = nm_os_csum_fold(nm_os_csum_raw(data, datalen,
+			in6_cksum_pseudo((void*)ip6h, datalen, ip6h->nexthdr, 0)));
 #else
 	static int notsupported = 0;
 	if (!notsupported) {
@@ -530,6 +578,39 @@ nm_os_mitigation_cleanup(struct nm_generic_mit *mit)
 {
 }
 
+struct nm_os_timer {
+	struct callout c;
+	void (*fn)(void *);
+	void *arg;
+};
+
+struct nm_os_timer *
+nm_os_timer_create(void (*fn)(void *), void *arg)
+{
+	struct nm_os_timer *nt = nm_os_malloc(sizeof(*nt));
+
+	if (nt == NULL)
+		return NULL;
+	callout_init(&nt->c, 1 /* mpsafe */);
+	nt->fn = fn;
+	nt->arg = arg;
+	return nt;
+}
+
+void
+nm_os_timer_arm(struct nm_os_timer *nt, u_int us)
+{
+	if (!callout_pending(&nt->c))
+		callout_reset_sbt(&nt->c, SBT_1US * us, 0, nt->fn, nt->arg, 0);
+}
+
+void
+nm_os_timer_destroy(struct nm_os_timer *nt)
+{
+	callout_drain(&nt->c);
+	nm_os_free(nt);
+}
+
 static int
 nm_vi_dummy(struct ifnet *ifp, u_long cmd, caddr_t addr)
 {
@@ -1178,6 +1259,40 @@ nm_os_ncpus(void)
 	return mp_maxid + 1;
 }
 
+u_int
+nm_os_curcpu(void)
+{
+	return curcpu;
+}
+
+uint64_t
+nm_os_realtime_ns(void)
+{
+	struct timespec ts;
+
+	nanotime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t
+nm_os_uptime_ns(void)
+{
+	return sbttons(sbinuptime());
+}
+
+u_int
+nm_os_cpu_pin(void)
+{
+	critical_enter();
+	return curcpu;
+}
+
+void
+nm_os_cpu_unpin(void)
+{
+	critical_exit();
+}
+
 struct nm_kctx_ctx {
 	/* Userspace thread (kthread creator). */
 	struct thread *user_td;
@@ -1199,6 +1314,7 @@ struct nm_kctx {
 	int run;			/* used to stop kthread */
 	int attach_user;		/* kthread attached to user_process */
 	int affinity;
+	int kicked;			/* see nm_os_kctx_wakeup() */
 };
 
 static void
@@ -1239,6 +1355,36 @@ nm_os_kctx_worker_setaff(struct nm_kctx *nmk, int affinity)
 	nmk->affinity = affinity;
 }
 
+void
+nm_os_kctx_sleep_us(u_int us)
+{
+	pause_sbt("nmksleep", ustosbt(us), 0, C_PREL(1));
+}
+
+int
+nm_os_kctx_wait_us(struct nm_kctx *nmk, u_int us)
+{
+	int kicked;
+
+	mtx_lock(&nmk->worker_lock);
+	if (!nmk->kicked && nmk->run)
+		msleep_sbt(nmk, &nmk->worker_lock, 0, "nmkwait",
+			ustosbt(us), 0, C_PREL(1));
+	kicked = nmk->kicked;
+	nmk->kicked = 0;
+	mtx_unlock(&nmk->worker_lock);
+	return kicked;
+}
+
+void
+nm_os_kctx_wakeup(struct nm_kctx *nmk)
+{
+	mtx_lock(&nmk->worker_lock);
+	nmk->kicked = 1;
+	wakeup(nmk);
+	mtx_unlock(&nmk->worker_lock);
+}
+
 struct nm_kctx *
 nm_os_kctx_create(struct nm_kctx_cfg *cfg, void *opaque)
 {
@@ -1557,6 +1703,46 @@ struct cdevsw netmap_cdevsw = {
 	.d_kqfilter = netmap_kqfilter,
 	.d_close = netmap_close,
 };
+
+#include <sys/capsicum.h>
+#include <sys/file.h>
+#include <sys/vnode.h>
+
+struct netmap_priv_d *
+nm_os_priv_get(int fd, void **ref)
+{
+	struct thread *td = curthread;
+	struct netmap_priv_d *priv = NULL;
+	struct file *fp, *fpop;
+	struct vnode *vp;
+	cap_rights_t rights;
+
+	if (fget(td, fd, cap_rights_init(&rights, CAP_IOCTL), &fp) != 0)
+		return NULL;
+	vp = fp->f_vnode;
+	if (fp->f_type == DTYPE_VNODE && vp != NULL && vp->v_type == VCHR &&
+	    vp->v_rdev != NULL && vp->v_rdev->si_devsw == &netmap_cdevsw) {
+		/* devfs_get_cdevpriv() looks at the file of the
+		 * current operation */
+		fpop = td->td_fpop;
+		td->td_fpop = fp;
+		if (devfs_get_cdevpriv((void **)&priv) != 0)
+			priv = NULL;
+		td->td_fpop = fpop;
+	}
+	if (priv == NULL) {
+		fdrop(fp, td);
+		return NULL;
+	}
+	*ref = fp;
+	return priv;
+}
+
+void
+nm_os_priv_put(void *ref)
+{
+	fdrop((struct file *)ref, curthread);
+}
 /*--- end of kqueue support ----*/
 
 /*
@@ -220,6 +220,40 @@ netmap_generic_irq(struct netmap_adapter *na, u_int q, u_int *work_done)
 #endif  /* RATE_GENERIC */
 }
 
+/*
+ * Return the length of the next mitigation period of a ring, in ns.
+ * restart is non-zero when the timer expired with pending work, zero
+ * when it is started again after the ring was idle for a whole period.
+ */
+u_int
+generic_mit_interval(struct nm_generic_mit *mit, int restart)
+{
+	u_int pkts = mit->mit_pkts;
+	u_int target = netmap_generic_mit_target;
+	u_int hi = netmap_generic_mit;
+	u_int lo = netmap_generic_mit_min;
+	u_int ival = mit->mit_interval;
+
+	mit->mit_pkts = 0;
+	if (!netmap_generic_mit_adaptive)
+		return hi;
+
+	if (lo < 1000)
+		lo = 1000;	/* ival must not get stuck at 0 */
+	if (lo > hi)
+		lo = hi;
+	if (restart && pkts > 2 * target)
+		ival *= 2;	/* busy, batch more */
+	else if (!restart || pkts < target / 2)
+		ival /= 2;	/* light load, cut the latency */
+	if (ival < lo)
+		ival = lo;
+	if (ival > hi)
+		ival = hi;
+	mit->mit_interval = ival;
+	return ival;
+}
+
 static int
 generic_netmap_unregister(struct netmap_adapter *na)
 {
@@ -245,13 +279,26 @@ generic_netmap_unregister(struct netmap_adapter *na)
 		 * RX rings. */
 		mbq_safe_purge(&kring->rx_queue);
 		nm_os_mitigation_cleanup(&gna->mit[r]);
+		if (netmap_verbose) {
+			struct nm_generic_mit *mit = &gna->mit[r];
+
+			nm_prinf("%s: rx ring %d: %llu packets, "
+				"%llu notifications, interval %u ns",
+				na->name, r,
+				(unsigned long long)mit->mit_tot_pkts,
+				(unsigned long long)mit->mit_tot_notify,
+				mit->mit_interval);
+		}
 	}
 
 	/* Decrement reference counter for the mbufs in the
-	 * TX pools. These mbufs can be still pending in drivers,
-	 * (e.g. this happens with virtio-net driver, which
-	 * does lazy reclaiming of transmitted mbufs). */
+	 * TX pools of the rings that left netmap mode. These mbufs
+	 * can be still pending in drivers, (e.g. this happens with
+	 * virtio-net driver, which does lazy reclaiming of transmitted
+	 * mbufs). The rings still bound by other users keep theirs. */
 	for_each_tx_kring(r, kring, na) {
+		if (kring->nr_mode != NKR_NETMAP_OFF)
+			continue;
 		/* We must remove the destructor on the TX event,
 		 * because the destructor invokes netmap code, and
 		 * the netmap module may disappear before the
@@ -262,6 +309,17 @@ generic_netmap_unregister(struct netmap_adapter *na)
 		}
 		kring->tx_event = NULL;
 		mtx_unlock_spin(&kring->tx_event_lock);
+
+		if (kring->tx_pool == NULL) {
+			continue;
+		}
+		for (i=0; i<na->num_tx_desc; i++) {
+			if (kring->tx_pool[i]) {
+				m_freem(kring->tx_pool[i]);
+			}
+		}
+		nm_os_free(kring->tx_pool);
+		kring->tx_pool = NULL;
 	}
 
 	if (na->active_fds == 0) {
@@ -273,17 +331,6 @@ generic_netmap_unregister(struct netmap_adapter *na)
 
 		for_each_tx_kring(r, kring, na) {
 			mtx_destroy(&kring->tx_event_lock);
-			if (kring->tx_pool == NULL) {
-				continue;
-			}
-
-			for (i=0; i<na->num_tx_desc; i++) {
-				if (kring->tx_pool[i]) {
-					m_freem(kring->tx_pool[i]);
-				}
-			}
-			nm_os_free(kring->tx_pool);
-			kring->tx_pool = NULL;
 		}
 
 #ifdef RATE_GENERIC
@@ -305,7 +352,7 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
 	struct netmap_kring *kring = NULL;
 	int error;
-	int i, r;
+	int r;
 
 	if (!na) {
 		return EINVAL;
@@ -318,6 +365,7 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 
 	if (na->active_fds == 0) {
 		nm_prinf("Emulated adapter for %s activated", na->name);
+		gna->rxdirect = netmap_generic_rxdirect;
 		/* Do all memory allocations when (na->active_fds == 0), to
 		 * simplify error management. */
 
@@ -332,6 +380,10 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 		for_each_rx_kring(r, kring, na) {
 			/* Init mitigation support. */
 			nm_os_mitigation_init(&gna->mit[r], r, na);
+			gna->mit[r].mit_interval = netmap_generic_mit;
+			gna->mit[r].mit_pkts = 0;
+			gna->mit[r].mit_tot_pkts = 0;
+			gna->mit[r].mit_tot_notify = 0;
 
 			/* Initialize the rx queue, as generic_rx_handler() can
 			 * be called as soon as nm_os_catch_rx() returns.
@@ -339,38 +391,43 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 			mbq_safe_init(&kring->rx_queue);
 		}
 
-		/*
-		 * Prepare mbuf pools (parallel to the tx rings), for packet
-		 * transmission. Don't preallocate the mbufs here, it's simpler
-		 * to leave this task to txsync.
-		 */
 		for_each_tx_kring(r, kring, na) {
 			kring->tx_pool = NULL;
-		}
-		for_each_tx_kring(r, kring, na) {
-			kring->tx_pool =
-				nm_os_malloc(na->num_tx_desc * sizeof(struct mbuf *));
-			if (!kring->tx_pool) {
-				nm_prerr("tx_pool allocation failed");
-				error = ENOMEM;
-				goto free_tx_pools;
-			}
+			kring->tx_event = NULL;
 			mtx_init(&kring->tx_event_lock, "tx_event_lock",
 				 NULL, MTX_SPIN);
 		}
 	}
 
-	netmap_krings_mode_commit(na, /*onoff=*/1);
-
+	/*
+	 * Prepare mbuf pools (parallel to the tx rings), for packet
+	 * transmission, only for the rings that are being bound, so
+	 * that binding one ring of a NIC with many queues stays cheap.
+	 * Don't preallocate the mbufs here, it's simpler to leave this
+	 * task to txsync.
+	 */
 	for_each_tx_kring(r, kring, na) {
-		/* Initialize tx_pool and tx_event. */
-		for (i=0; i<na->num_tx_desc; i++) {
-			kring->tx_pool[i] = NULL;
+		if (!nm_kring_pending_on(kring) || kring->tx_pool != NULL)
+			continue;
+		kring->tx_pool =
+			nm_os_malloc(na->num_tx_desc * sizeof(struct mbuf *));
+		if (!kring->tx_pool) {
+			nm_prerr("tx_pool allocation failed");
+			error = ENOMEM;
+			goto free_tx_pools;
 		}
-
 		kring->tx_event = NULL;
 	}
 
+	for_each_rx_kring(r, kring, na) {
+		if (nm_kring_pending_on(kring)) {
+			/* First slot to be filled by generic_rx_direct(). */
+			kring->nkr_hwlease = kring->nr_hwtail;
+		}
+	}
+
+	netmap_krings_mode_commit(na, /*onoff=*/1);
+
 	if (na->active_fds == 0) {
 		/* Prepare to intercept incoming traffic. */
 		error = nm_os_catch_rx(gna, 1);
@@ -407,14 +464,21 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 catch_rx:
 	nm_os_catch_rx(gna, 0);
 free_tx_pools:
+	/* if other users are active, only undo the new allocations */
 	for_each_tx_kring(r, kring, na) {
-		mtx_destroy(&kring->tx_event_lock);
-		if (kring->tx_pool == NULL) {
+		if (kring->tx_pool == NULL ||
+		    (na->active_fds > 0 && !nm_kring_pending_on(kring))) {
 			continue;
 		}
 		nm_os_free(kring->tx_pool);
 		kring->tx_pool = NULL;
 	}
+	if (na->active_fds > 0) {
+		return error;
+	}
+	for_each_tx_kring(r, kring, na) {
+		mtx_destroy(&kring->tx_event_lock);
+	}
 	for_each_rx_kring(r, kring, na) {
 		mbq_safe_fini(&kring->rx_queue);
 	}
@@ -688,6 +752,7 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 		a.ifp = ifp;
 		a.ring_nr = ring_nr;
 		a.head = a.tail = NULL;
+		a.qlen = 0;
 
 		while (nm_i != head) {
 			struct netmap_slot *slot = &ring->slot[nm_i];
@@ -769,6 +834,7 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 				 * reasons. In these cases, we just let the
 				 * packet to be dropped. */
 				IFRATE(rate_ctx.new.txdrop++);
+				kring->stats.drops++;
 			}
 
 			slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
@@ -807,33 +873,70 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 
 
 /*
- * This handler is registered (through nm_os_catch_rx())
- * within the attached network interface
- * in the RX subsystem, so that every mbuf passed up by
- * the driver can be stolen to the network stack.
- * Stolen packets are put in a queue where the
- * generic_netmap_rxsync() callback can extract them.
- * Returns 1 if the packet was stolen, 0 otherwise.
+ * Direct receive mode: copy the mbuf into the free slots of the netmap
+ * ring as soon as the driver pushes it up, so that the mbuf (and the
+ * driver pages attached to it) is released right away instead of
+ * sitting in rx_queue until the next rxsync. The rx_queue lock
+ * protects nkr_hwlease, the first slot not yet filled; rxsync only
+ * moves nr_hwtail up to it. Packets that do not fit are dropped.
  */
-int
-generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
+static void
+generic_rx_direct(struct netmap_kring *kring, struct mbuf *m)
 {
-	struct netmap_adapter *na = NA(ifp);
-	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
-	struct netmap_kring *kring;
-	u_int work_done;
-	u_int r = MBUF_RXQ(m); /* receive ring number */
+	struct netmap_adapter *na = kring->na;
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int nm_buf_len = NETMAP_BUF_SIZE(na);
+	int mlen = MBUF_LEN(m);
+	int mbuf_ofs = 0;
+	int avail;
+	u_int nm_i;
 
-	if (r >= na->num_rx_rings) {
-		r = r % na->num_rx_rings;
+	mbq_lock(&kring->rx_queue);
+	nm_i = kring->nkr_hwlease;
+	avail = nm_prev(kring->nr_hwcur, lim) - nm_i;
+	if (avail < 0)
+		avail += lim + 1;
+	avail *= nm_buf_len;
+	if (mlen == 0)
+		goto out;
+	if (mlen > avail) {
+		/* no room in the ring */
+		kring->stats.drops++;
+		goto out;
 	}
 
-	kring = na->rx_rings[r];
+	do {
+		struct netmap_slot *slot = ring->slot + nm_i;
+		char *nmaddr = NMB(na, slot);
+		int copy = mlen - mbuf_ofs;
 
-	if (kring->nr_mode == NKR_NETMAP_OFF) {
-		/* We must not intercept this mbuf. */
-		return 0;
-	}
+		if (unlikely(nmaddr == NETMAP_BUF_BASE(na))) {
+			/* Bad buffer, drop the packet. */
+			kring->stats.drops++;
+			goto out;
+		}
+		if (copy > nm_buf_len)
+			copy = nm_buf_len;
+		m_copydata(m, mbuf_ofs, copy,
+			   nmaddr + nm_get_offset(kring, slot));
+		mbuf_ofs += copy;
+		slot->len = copy;
+		slot->flags = (mbuf_ofs < mlen ? NS_MOREFRAG : 0);
+		nm_i = nm_next(nm_i, lim);
+	} while (mbuf_ofs < mlen);
+	kring->nkr_hwlease = nm_i;
+out:
+	mbq_unlock(&kring->rx_queue);
+	m_freem(m);
+}
+
+/* Queue (or copy, in direct mode) one intercepted mbuf on 'kring'. */
+static void
+generic_rx_enqueue(struct netmap_generic_adapter *gna,
+		struct netmap_kring *kring, struct mbuf *m)
+{
+	struct netmap_adapter *na = &gna->up.up;
 
 	/* limit the size of the queue */
 	if (unlikely(!gna->rxsg && MBUF_LEN(m) > NETMAP_BUF_SIZE(na))) {
@@ -842,15 +945,30 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 		 * support RX scatter-gather. */
 		nm_prlim(2, "Warning: driver pushed up big packet "
 				"(size=%d)", (int)MBUF_LEN(m));
+		kring->stats.drops++;
 		m_freem(m);
+	} else if (gna->rxdirect) {
+		generic_rx_direct(kring, m);
 	} else if (unlikely(mbq_len(&kring->rx_queue) > 1024)) {
+		kring->stats.drops++;
 		m_freem(m);
 	} else {
 		mbq_safe_enqueue(&kring->rx_queue, m);
 	}
+}
 
+/* Account 'pkts' new packets on ring 'r' and notify the receiver. */
+static void
+generic_rx_notify(struct netmap_generic_adapter *gna, u_int r, u_int pkts)
+{
+	struct netmap_adapter *na = &gna->up.up;
+	u_int work_done;
+
+	gna->mit[r].mit_pkts += pkts;
+	gna->mit[r].mit_tot_pkts += pkts;
 	if (netmap_generic_mit < 32768) {
 		/* no rx mitigation, pass notification up */
+		gna->mit[r].mit_tot_notify++;
 		netmap_generic_irq(na, r, &work_done);
 	} else {
 		/* same as send combining, filter notification if there is a
@@ -860,15 +978,90 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 			/* Record that there is some pending work. */
 			gna->mit[r].mit_pending = 1;
 		} else {
+			gna->mit[r].mit_tot_notify++;
 			netmap_generic_irq(na, r, &work_done);
 			nm_os_mitigation_start(&gna->mit[r]);
 		}
 	}
+}
+
+/*
+ * This handler is registered (through nm_os_catch_rx())
+ * within the attached network interface
+ * in the RX subsystem, so that every mbuf passed up by
+ * the driver can be stolen to the network stack.
+ * Stolen packets are put in a queue where the
+ * generic_netmap_rxsync() callback can extract them.
+ * Returns 1 if the packet was stolen, 0 otherwise.
+ */
+int
+generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
+{
+	struct netmap_adapter *na = NA(ifp);
+	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
+	struct netmap_kring *kring;
+	u_int r = MBUF_RXQ(m); /* receive ring number */
+
+	if (r >= na->num_rx_rings) {
+		r = r % na->num_rx_rings;
+	}
+
+	kring = na->rx_rings[r];
+
+	if (kring->nr_mode == NKR_NETMAP_OFF) {
+		/* We must not intercept this mbuf. */
+		return 0;
+	}
+
+	generic_rx_enqueue(gna, kring, m);
+	generic_rx_notify(gna, r, 1);
 
 	/* We have intercepted the mbuf. */
 	return 1;
 }
 
+/*
+ * Same as generic_rx_handler() for a batch of 'n' mbufs, for the
+ * OSes whose drivers pass up packets in lists (NDIS). The receiver
+ * is notified once per run of packets for the same ring instead of
+ * once per packet. Stolen mbufs are replaced by NULL in 'ms', the
+ * others are left to the caller. Returns the number of stolen mbufs.
+ */
+u_int
+generic_rx_handler_batch(struct ifnet *ifp, struct mbuf **ms, u_int n)
+{
+	struct netmap_adapter *na = NA(ifp);
+	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
+	u_int i, stolen = 0, run = 0, cur = 0;
+
+	for (i = 0; i < n; i++) {
+		struct netmap_kring *kring;
+		u_int r = MBUF_RXQ(ms[i]);
+
+		if (r >= na->num_rx_rings) {
+			r = r % na->num_rx_rings;
+		}
+		if (run && r != cur) {
+			generic_rx_notify(gna, cur, run);
+			run = 0;
+		}
+		kring = na->rx_rings[r];
+		if (kring->nr_mode == NKR_NETMAP_OFF) {
+			continue;
+		}
+		generic_rx_enqueue(gna, kring, ms[i]);
+		ms[i] = NULL;
+		cur = r;
+		run++;
+		stolen++;
+	}
+	if (run) {
+		generic_rx_notify(gna, cur, run);
+	}
+
+	return stolen;
+}
+
 /*
  * generic_netmap_rxsync() extracts mbufs from the queue filled by
  * generic_netmap_rx_handler() and puts their content in the netmap
@@ -880,6 +1073,7 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 {
 	struct netmap_ring *ring = kring->ring;
 	struct netmap_adapter *na = kring->na;
+	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
 	u_int nm_i;	/* index into the netmap ring */ //j,
 	u_int n;
 	u_int const lim = kring->nkr_num_slots - 1;
@@ -922,6 +1116,22 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 		return 0;
 	}
 
+	if (gna->rxdirect) {
+		/* The slots have already been filled by generic_rx_direct(). */
+		mbq_lock(&kring->rx_queue);
+		nm_i = kring->nkr_hwlease;
+		mbq_unlock(&kring->rx_queue);
+		n = nm_i - kring->nr_hwtail;
+		if (nm_i < kring->nr_hwtail)
+			n += lim + 1;
+		if (n) {
+			kring->nr_hwtail = nm_i;
+			IFRATE(rate_ctx.new.rxpkt += n);
+		}
+		kring->nr_kflags &= ~NKR_PENDINTR;
+		return 0;
+	}
+
 	nm_i = kring->nr_hwtail; /* First empty slot in the receive ring. */
 
 	/* Compute the available space (in bytes) in this netmap ring.
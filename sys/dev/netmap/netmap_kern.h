@@ -80,6 +80,21 @@
 #define WITH_NMNULL
 #endif
 
+/* hot path tracepoints and latency sampling, off by default */
+#if defined(CONFIG_NETMAP_TRACE) && !defined(_WIN32)
+#define WITH_TRACE
+#endif
+
+/* routing and ACL lookup for the VALE switches, off by default */
+#if defined(CONFIG_NETMAP_VALE_L3) && defined(WITH_VALE)
+#define WITH_VALE_L3
+#endif
+
+/* microbenchmarks of the hot paths (NETMAP_REQ_BENCH), off by default */
+#if defined(CONFIG_NETMAP_BENCH) && defined(WITH_VALE) && !defined(_WIN32)
+#define WITH_BENCH
+#endif
+
 #if defined(__FreeBSD__)
 #include <sys/selinfo.h>
 
@@ -101,6 +116,7 @@
 #define NM_SELRECORD_T	struct thread
 #define	MBUF_LEN(m)	((m)->m_pkthdr.len)
 #define MBUF_TXQ(m)	((m)->m_pkthdr.flowid)
+#define MBUF_HASH(m)	((m)->m_pkthdr.flowid)
 #define MBUF_TRANSMIT(na, ifp, m)	((na)->if_transmit(ifp, m))
 #define	GEN_TX_MBUF_IFP(m)	((m)->m_pkthdr.rcvif)
 
@@ -309,6 +325,32 @@ void nm_os_ifnet_lock(void);
 void nm_os_ifnet_unlock(void);
 
 unsigned nm_os_ifnet_mtu(struct ifnet *ifp);
+/* NUMA node of the device, -1 if unknown */
+int nm_os_ifnet_numa_node(struct ifnet *ifp);
+/* install (add != 0) or remove a rule in the n-tuple filters of the NIC */
+int nm_os_flow_rule(struct ifnet *ifp, struct nmreq_flow_rule *req, int add);
+/* the netmap_priv_d of a netmap file descriptor of the calling process,
+ * or NULL. The reference stored in *ref must be released with
+ * nm_os_priv_put(). */
+struct netmap_priv_d *nm_os_priv_get(int fd, void **ref);
+void nm_os_priv_put(void *ref);
+
+#ifdef WITH_TRACE
+/*
+ * Hot path instrumentation. Each NM_TRACE(point, ...) fires a
+ * tracepoint on Linux or a dtrace SDT probe on FreeBSD, through
+ * nm_os_trace_<point>(). Without WITH_TRACE the macro expands to
+ * nothing and the arguments are not evaluated.
+ */
+void nm_os_trace_sync(struct netmap_kring *, u_int head, u_int cur);
+void nm_os_trace_bwrap_intr(struct netmap_kring *, u_int slots);
+void nm_os_trace_vale_flush(struct netmap_kring *, u_int slots);
+void nm_os_trace_latency(struct netmap_kring *, uint64_t ns);
+uint64_t nm_os_trace_ns(void); /* monotonic clock */
+#define NM_TRACE(point, ...)	nm_os_trace_##point(__VA_ARGS__)
+#else /* !WITH_TRACE */
+#define NM_TRACE(point, ...)	do {} while (0)
+#endif /* !WITH_TRACE */
 
 void nm_os_get_module(void);
 void nm_os_put_module(void);
@@ -447,6 +489,13 @@ struct netmap_kring {
 					 */
 #define NKR_NOINTR      0x10            /* don't use interrupts on this ring */
 #define NKR_FAKERING	0x20		/* don't allocate/free buffers */
+#define NKR_FANOUT	0x40		/* fan-out pipe ring, owns its
+					 * buffers (see netmap_pipe.c)
+					 */
+#define NKR_SWTS	0x80		/* (rx) software NM_META_TS */
+#define NKR_TXPOLL	0x100		/* (bwrap rx) the NIC tx ring is
+					 * flushed by a polling kthread
+					 */
 
 	uint32_t	nr_mode;
 	uint32_t	nr_pending_mode;
@@ -496,6 +545,9 @@ struct netmap_kring {
 #define NR_NOSLOT	((uint32_t)~0)	/* used in nkr_*lease* */
 	uint32_t	nkr_hwlease;
 	uint32_t	nkr_lease_idx;
+	/* (bwrap hw rx) consecutive interrupts not flushed to the switch,
+	 * see netmap_intr_batch */
+	uint32_t	nkr_intr_deferred;
 
 	/* while nkr_stopped is set, no new [tr]xsync operations can
 	 * be started on this kring.
@@ -536,11 +588,48 @@ struct netmap_kring {
 	int (*nm_sync)(struct netmap_kring *kring, int flags);
 	int (*nm_notify)(struct netmap_kring *kring, int flags);
 
+	uint32_t	kloop_busy;	/* served by a sync kloop,
+					 * use with NMG_LOCK held */
+	uint32_t	meta_flags;	/* NM_META_* fields to be stored
+					 * in front of the packets (rx) or
+					 * offloads to honor (tx), see
+					 * nm_slot_meta() */
+	uint64_t	sw_ts_last;	/* time of the previous rxsync,
+					 * with NKR_SWTS */
+	uint64_t	defer_ns;	/* (VALE tx) arrival of the oldest
+					 * deferred slot, 0 if none */
+	struct nm_os_timer *defer_timer; /* (VALE tx) flushes them at
+					 * the deadline */
+
+	/* Counters exported by NETMAP_REQ_RING_STATS_GET. They are
+	 * updated without atomics, so the ones touched outside of the
+	 * ring owner (drops, notifies, busy) may miss some events.
+	 */
+	struct {
+		uint64_t	syncs;
+		uint64_t	slots;	/* moved by the syncs */
+		uint64_t	bytes;
+		uint64_t	drops;
+		uint64_t	notifies;
+		uint64_t	busy;	/* nm_kr_tryget() found the ring busy */
+		uint32_t	last;	/* hwcur (tx) or hwtail (rx) at
+					 * the end of the previous sync */
+		/* WITH_TRACE only, see nm_trace_lat_stamp() */
+		uint32_t	lat_count;
+		uint64_t	lat_stamp;
+		uint64_t	lat[NR_RING_LAT_BUCKETS];
+	} stats;
+
 #ifdef WITH_PIPES
 	struct netmap_kring *pipe;	/* if this is a pipe ring,
 					 * pointer to the other end
 					 */
 	uint32_t pipe_tail;		/* hwtail updated by the other end */
+	/* fan-out pipes only (NKR_FANOUT) */
+	struct netmap_kring *pipe_frag;	/* tx: rx ring receiving the
+					 * current multi-slot packet */
+	uint32_t pipe_rr;		/* tx: next round-robin target */
+	uint32_t pipe_blocked;		/* rx: a tx ring found us full */
 #endif /* WITH_PIPES */
 
 	/* mask for the offset-related part of the ptr field in the slots */
@@ -582,6 +671,13 @@ struct netmap_kring {
 	uint32_t n_monitors;	/* next unused entry in the monitor array */
 	uint32_t mon_pos[NR_TXRX]; /* index of this ring in the monitored ring array */
 	uint32_t mon_tail;  /* last seen slot on rx */
+	uint32_t mon_sample;	/* frames skipped since the last sample */
+
+	/* deferred copy monitors (NR_MONITOR_DEFER), see netmap_monitor.c */
+	struct nm_mon_ref *mon_refs;	/* tx slots still to be copied */
+	uint32_t mon_ref_head, mon_ref_tail;
+	uint64_t mon_tx_sub;	/* tx slots passed to the monitored port */
+	uint64_t mon_tx_done;	/* tx slots given back to its user */
 
 	/* circular list of zero-copy monitors */
 	struct netmap_zmon_list zmon_list[NR_TXRX];
@@ -691,8 +787,18 @@ struct lut_entry;
 struct netmap_lut {
 	struct lut_entry *lut;
 	struct plut_entry *plut;
-	uint32_t objtotal;	/* max buffer index */
+	uint32_t objtotal;	/* max buffer index, including the room
+				 * left to grow (mapped to buffer 0) */
 	uint32_t objsize;	/* buffer size */
+	/* If not NULL, buffer i is at vbase + i * objsize (and, on
+	 * FreeBSD, at physical address pbase + i * objsize), so NMB()
+	 * and PNMB() need not touch the lut. Only set when the whole
+	 * pool sits in one contiguous chunk, never for extmem.
+	 */
+	char *vbase;
+#ifdef __FreeBSD__
+	vm_paddr_t pbase;
+#endif
 };
 
 struct netmap_vp_adapter; // forward
@@ -819,6 +925,13 @@ struct netmap_adapter {
 	 *
 	 * nm_rxsync() collects packets from the underlying hw/switch
 	 *
+	 * nm_txsync_fast() and nm_rxsync_fast(), if not NULL, are variants
+	 *	of the above for the krings that use no offsets (and so no
+	 *	slot metadata), usually built from the same inline function
+	 *	with a constant argument so that the per-slot offset code
+	 *	disappears. netmap_do_regif() installs them in kring->nm_sync
+	 *	when the kring has no offsets.
+	 *
 	 * nm_config() returns configuration information from the OS
 	 *	Called with NMG_LOCK held.
 	 *
@@ -866,11 +979,14 @@ struct netmap_adapter {
 
 	int (*nm_txsync)(struct netmap_kring *kring, int flags);
 	int (*nm_rxsync)(struct netmap_kring *kring, int flags);
+	int (*nm_txsync_fast)(struct netmap_kring *kring, int flags);
+	int (*nm_rxsync_fast)(struct netmap_kring *kring, int flags);
 	int (*nm_notify)(struct netmap_kring *kring, int flags);
 	int (*nm_bufcfg)(struct netmap_kring *kring, uint64_t target);
 #define NAF_FORCE_READ      1
 #define NAF_FORCE_RECLAIM   2
 #define NAF_CAN_FORWARD_DOWN 4
+#define NAF_FLUSH           8	/* do not defer, see NETMAP_REQ_VALE_DEFER_SET */
 	/* return configuration information */
 	int (*nm_config)(struct netmap_adapter *, struct nm_config_info *info);
 	int (*nm_krings_create)(struct netmap_adapter *);
@@ -933,6 +1049,12 @@ struct netmap_adapter {
 	 * require NS_MOREFRAG support. */
 	unsigned rx_buf_maxsize;
 
+	/* NM_META_* fields that the rxsync can store in front of the
+	 * received packets (NETMAP_REQ_OPT_SLOT_META). */
+	unsigned rx_meta_caps;
+	/* NM_META_TX_* offloads that the txsync can perform on request. */
+	unsigned tx_meta_caps;
+
 	char name[NETMAP_REQ_IFNAMSIZ]; /* used at least by pipes */
 
 #ifdef WITH_MONITOR
@@ -1019,11 +1141,49 @@ struct netmap_vp_adapter {	/* VALE software port */
 	struct nm_bridge *na_bdg;
 	int retry;
 	int autodelete; /* remove the ifp on last reference */
+	/* registration that keeps a persistent port warm, see
+	 * NR_VALE_NEWIF_KEEPWARM
+	 */
+	struct netmap_priv_d *na_kpriv;
 
 	/* Maximum Frame Size, used in bdg_mismatch_datapath() */
 	u_int mfs;
-	/* Last source MAC on this port */
+	/* Last source MAC on this port, with the epoch it was learned in */
 	uint64_t last_smac;
+	/* counters of the default lookup function, for frames sent by
+	 * this port. Not atomic, they are only statistics.
+	 */
+	uint64_t ht_hits;
+	uint64_t ht_misses;
+	uint64_t ht_floods;
+	/* counters exported by NETMAP_REQ_VALE_PORT_STATS_GET, tx for
+	 * the frames sent by this port, rx for the ones delivered to it.
+	 * Not atomic either.
+	 */
+	struct {
+		uint64_t	tx_pkts;
+		uint64_t	tx_bytes;
+		uint64_t	rx_pkts;
+		uint64_t	rx_bytes;
+		uint64_t	rx_drops;	/* no room in the rx ring */
+		uint64_t	lookup_ns;	/* WITH_TRACE only */
+		uint64_t	tx_limited;	/* over the rate limit */
+	} bdg_stats;
+	/* token bucket and priority for the frames sent by this port,
+	 * see NETMAP_REQ_VALE_QOS_SET
+	 */
+	struct {
+		uint64_t	rate;	/* bytes per second, 0: no limit */
+		uint64_t	burst;	/* bucket size, in bytes */
+		uint64_t	tokens;
+		uint64_t	last_ns;	/* time of the last refill */
+		u_int		prio;
+	} qos;
+	/* deferred forwarding, see NETMAP_REQ_VALE_DEFER_SET */
+	struct {
+		u_int		batch;	/* slots, 0: forward at each sync */
+		u_int		usecs;	/* max wait of a deferred slot */
+	} defer;
 };
 
 
@@ -1046,6 +1206,11 @@ struct nm_generic_mit {
 	int mit_pending;
 	int mit_ring_idx;  /* index of the ring being mitigated */
 	struct netmap_adapter *mit_na;  /* backpointer */
+	u_int mit_interval;	/* current timer period (ns) */
+	u_int mit_pkts;		/* packets since the period started */
+	/* statistics, to check the batching efficiency */
+	uint64_t mit_tot_pkts;
+	uint64_t mit_tot_notify;
 };
 
 struct netmap_generic_adapter {	/* emulated device */
@@ -1071,6 +1236,10 @@ struct netmap_generic_adapter {	/* emulated device */
 	/* Is the transmission path controlled by a netmap-aware
 	 * device queue (i.e. qdisc on linux)? */
 	int txqdisc;
+
+	/* Does generic_rx_handler() copy the packets into the netmap
+	 * ring directly, instead of queueing them for rxsync? */
+	int rxdirect;
 };
 #endif  /* WITH_GENERIC */
 
@@ -1161,6 +1330,17 @@ int netmap_bdg_attach(struct nmreq_header *hdr, void *auth_token);
 int netmap_bdg_detach(struct nmreq_header *hdr, void *auth_token);
 #ifdef WITH_VALE
 int netmap_vale_list(struct nmreq_header *hdr);
+int netmap_vale_list_bulk(struct nmreq_header *hdr);
+int netmap_vale_hash_info(struct nmreq_header *hdr);
+int netmap_vale_hash_get(struct nmreq_header *hdr);
+int netmap_vale_hash_set(struct nmreq_header *hdr);
+int netmap_vale_port_stats(struct nmreq_header *hdr);
+int netmap_vale_qos(struct nmreq_header *hdr);
+int netmap_vale_defer(struct nmreq_header *hdr);
+#ifdef WITH_VALE_L3
+int netmap_vale_l3_ctl(struct nmreq_header *hdr);
+void netmap_vale_l3_free(struct nm_bridge *b);
+#endif /* WITH_VALE_L3 */
 int netmap_vi_create(struct nmreq_header *hdr, int);
 int nm_vi_create(struct nmreq_header *);
 int nm_vi_destroy(const char *name);
@@ -1186,6 +1366,7 @@ struct netmap_pipe_adapter {
 	struct ifnet *parent_ifp;	/* maybe null */
 
 	u_int parent_slot; /* index in the parent pipe array */
+	u_int fanout;	/* NM_PIPE_FANOUT_* distribution mode */
 };
 
 #endif /* WITH_PIPES */
@@ -1193,6 +1374,13 @@ struct netmap_pipe_adapter {
 #ifdef WITH_NMNULL
 struct netmap_null_adapter {
 	struct netmap_adapter up;
+
+	/* synthetic traffic, see NETMAP_REQ_OPT_NULL_TRAFFIC */
+	uint32_t flags;
+	uint32_t pkt_len;
+	uint64_t rate;		/* frames/s per rx ring, 0: no limit */
+	uint64_t *rx_last_ns;	/* per rx ring, for the rate */
+	uint8_t *frame;		/* pkt_len bytes */
 };
 #endif /* WITH_NMNULL */
 
@@ -1212,6 +1400,27 @@ nm_kr_rxspace(struct netmap_kring *k)
 /* return slots reserved to tx clients */
 #define nm_kr_txspace(_k) nm_kr_rxspace(_k)
 
+/*
+ * Used in the rxsync of native drivers: true if the slots released by
+ * the user (nr_hwcur to head excluded) can be left for a later rxsync,
+ * so that the NIC ring is refilled and its tail register written in
+ * batches of at least netmap_rx_refill_batch slots. We only wait while
+ * the NIC still owns a quarter of the ring.
+ */
+static inline int
+nm_kr_rxrefill_defer(struct netmap_kring *kring, u_int head)
+{
+	int n = kring->nkr_num_slots;
+	int released = head - kring->nr_hwcur;
+	int armed = kring->nr_hwcur - kring->nr_hwtail - 1;
+
+	if (released < 0)
+		released += n;
+	if (armed < 0)
+		armed += n;
+	return released < netmap_rx_refill_batch && armed >= n / 4;
+}
+
 
 /* True if no space in the tx ring, only valid after txsync_prologue */
 static inline int
@@ -1293,7 +1502,11 @@ retry:
 		goto stop;
 	}
 
-	return unlikely(busy) ? NM_KR_BUSY : 0;
+	if (unlikely(busy)) {
+		kr->stats.busy++;
+		return NM_KR_BUSY;
+	}
+	return 0;
 
 stop:
 	if (!busy)
@@ -1537,6 +1750,7 @@ void netmap_disable_all_rings(struct ifnet *);
 void netmap_enable_all_rings(struct ifnet *);
 
 int netmap_buf_size_validate(const struct netmap_adapter *na, unsigned mtu);
+uint32_t nm_flow_hash(const uint8_t *p, u_int len);
 int netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 		struct nmreq_header *);
 void netmap_do_unregif(struct netmap_priv_d *priv);
@@ -1666,6 +1880,7 @@ int netmap_adapter_put(struct netmap_adapter *na);
 #define NETMAP_BUF_BASE(_na)	((_na)->na_lut.lut[0].vaddr)
 #define NETMAP_BUF_SIZE(_na)	((_na)->na_lut.objsize)
 extern int netmap_no_pendintr;
+extern int netmap_rx_refill_batch;
 extern int netmap_verbose;
 #ifdef CONFIG_NETMAP_DEBUG
 extern int netmap_debug;		/* for debugging */
@@ -1687,12 +1902,22 @@ enum {                                  /* debug flags */
 };
 
 extern int netmap_txsync_retry;
+extern int netmap_intr_batch;
+extern int netmap_intr_defer_max;
+#ifdef WITH_TRACE
+extern int netmap_trace_sample;
+#endif /* WITH_TRACE */
 extern int netmap_generic_hwcsum;
 extern int netmap_generic_mit;
+extern int netmap_generic_mit_adaptive;
+extern int netmap_generic_mit_min;
+extern int netmap_generic_mit_target;
 extern int netmap_generic_ringsize;
 extern int netmap_generic_rings;
+extern int netmap_generic_rxdirect;
 #ifdef linux
 extern int netmap_generic_txqdisc;
+extern int netmap_generic_txbatch;
 #endif
 
 /*
@@ -1960,8 +2185,12 @@ NMB(struct netmap_adapter *na, struct netmap_slot *slot)
 {
 	struct lut_entry *lut = na->na_lut.lut;
 	uint32_t i = slot->buf_idx;
-	return (unlikely(i >= na->na_lut.objtotal)) ?
-		lut[0].vaddr : lut[i].vaddr;
+
+	if (unlikely(i >= na->na_lut.objtotal))
+		i = 0;
+	if (likely(na->na_lut.vbase != NULL))
+		return na->na_lut.vbase + (size_t)i * na->na_lut.objsize;
+	return lut[i].vaddr;
 }
 
 static inline void *
@@ -1970,12 +2199,24 @@ PNMB(struct netmap_adapter *na, struct netmap_slot *slot, uint64_t *pp)
 	uint32_t i = slot->buf_idx;
 	struct lut_entry *lut = na->na_lut.lut;
 	struct plut_entry *plut = na->na_lut.plut;
-	void *ret = (i >= na->na_lut.objtotal) ? lut[0].vaddr : lut[i].vaddr;
+	void *ret;
+
+	if (unlikely(i >= na->na_lut.objtotal))
+		i = 0;
+	if (likely(na->na_lut.vbase != NULL)) {
+		ret = na->na_lut.vbase + (size_t)i * na->na_lut.objsize;
+#ifdef __FreeBSD__
+		*pp = na->na_lut.pbase + (uint64_t)i * na->na_lut.objsize;
+		return ret;
+#endif
+	} else {
+		ret = lut[i].vaddr;
+	}
 
 #ifdef _WIN32
-	*pp = (i >= na->na_lut.objtotal) ? (uint64_t)plut[0].paddr.QuadPart : (uint64_t)plut[i].paddr.QuadPart;
+	*pp = (uint64_t)plut[i].paddr.QuadPart;
 #else
-	*pp = (i >= na->na_lut.objtotal) ? plut[0].paddr : plut[i].paddr;
+	*pp = plut[i].paddr;
 #endif
 	return ret;
 }
@@ -2014,6 +2255,109 @@ PNMB_O(struct netmap_kring *kring, struct netmap_slot *slot, uint64_t *pp)
 	return addr;
 }
 
+/* metadata that netmap provides when the driver cannot (rx only) */
+#define NM_META_SW_CAPS	NM_META_TS
+
+/* Return the metadata area in front of the packet of 'slot', cleared,
+ * or NULL if the application has not asked for it or the offset leaves
+ * no room. Drivers call this in rxsync and fill in the fields listed
+ * in kring->meta_flags.
+ */
+static inline struct nm_slot_meta *
+nm_slot_meta(struct netmap_kring *kring, struct netmap_slot *slot)
+{
+	uint64_t offset;
+	struct nm_slot_meta *meta;
+
+	if (likely(kring->meta_flags == 0))
+		return NULL;
+	offset = nm_get_offset(kring, slot);
+	if (unlikely(offset < sizeof(*meta)))
+		return NULL;
+	meta = (struct nm_slot_meta *)((char *)NMB(kring->na, slot) +
+			offset - sizeof(*meta));
+	meta->flags = 0;
+	return meta;
+}
+
+/* Return the offload request in front of the packet of 'slot', or NULL
+ * if the application has not enabled them or the offset leaves no room.
+ * Drivers call this in txsync on the first slot of each packet.
+ */
+static inline const struct nm_slot_meta *
+nm_slot_meta_tx(struct netmap_kring *kring, struct netmap_slot *slot)
+{
+	uint64_t offset;
+
+	if (likely(kring->meta_flags == 0))
+		return NULL;
+	offset = nm_get_offset(kring, slot);
+	if (unlikely(offset < sizeof(struct nm_slot_meta)))
+		return NULL;
+	return (const struct nm_slot_meta *)((char *)NMB(kring->na, slot) +
+			offset - sizeof(struct nm_slot_meta));
+}
+
+#ifdef WITH_TRACE
+/* Latency sampling: one notification every netmap_trace_sample is
+ * stamped, and the next sync of the ring adds the time elapsed since
+ * then to a histogram. This is how long newly notified packets (e.g.
+ * forwarded by nm_vale_flush() or received by the NIC) wait for the
+ * owner of the ring. Stamp and sync may race, which at most loses
+ * a sample.
+ */
+static inline void
+nm_trace_lat_stamp(struct netmap_kring *kring)
+{
+	if (likely(netmap_trace_sample <= 0) || kring->stats.lat_stamp != 0)
+		return;
+	if (++kring->stats.lat_count < (uint32_t)netmap_trace_sample)
+		return;
+	kring->stats.lat_count = 0;
+	kring->stats.lat_stamp = nm_os_trace_ns();
+}
+
+static inline void
+nm_trace_lat_sync(struct netmap_kring *kring)
+{
+	uint64_t stamp = kring->stats.lat_stamp, ns;
+	u_int b = 0;
+
+	if (likely(stamp == 0))
+		return;
+	kring->stats.lat_stamp = 0;
+	ns = nm_os_trace_ns() - stamp;
+	NM_TRACE(latency, kring, ns);
+	/* bucket 0 is below 1024ns, then powers of two */
+	for (stamp = ns >> 10; stamp > 0 && b < NR_RING_LAT_BUCKETS - 1;
+			stamp >>= 1)
+		b++;
+	kring->stats.lat[b]++;
+}
+#else /* !WITH_TRACE */
+#define nm_trace_lat_stamp(kring)
+#define nm_trace_lat_sync(kring)
+#endif /* !WITH_TRACE */
+
+/* Update the kring counters after a successful sync: account for the
+ * slots consumed by the txsync or made available by the rxsync.
+ */
+static inline void
+nm_kring_stats_sync(struct netmap_kring *kring)
+{
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int i, pos;
+
+	pos = kring->tx == NR_TX ? kring->nr_hwcur : kring->nr_hwtail;
+	kring->stats.syncs++;
+	for (i = kring->stats.last; i != pos; i = nm_next(i, lim)) {
+		kring->stats.slots++;
+		kring->stats.bytes += kring->ring->slot[i].len;
+	}
+	kring->stats.last = pos;
+	nm_trace_lat_sync(kring);
+}
+
 
 /*
  * Structure associated to each netmap file descriptor.
@@ -2042,9 +2386,14 @@ struct netmap_priv_d {
 	uint16_t        np_kloop_state;	/* use with NMG_LOCK held */
 #define NM_SYNC_KLOOP_RUNNING	(1 << 0)
 #define NM_SYNC_KLOOP_STOPPING	(1 << 1)
+#define NM_SYNC_KLOOP_MAYSLEEP	(1 << 2) /* restore NAF_BDG_MAYSLEEP */
+	uint16_t	np_kloops;	/* running kloops, use with NMG_LOCK held */
 	int             np_sync_flags; /* to be passed to nm_sync */
 
 	int		np_refs;	/* use with NMG_LOCK held */
+	u_int		np_extra_bufs;	/* extra buffers given on register */
+	uint32_t	np_extra_owner;	/* and their owner id in the allocator,
+					 * see netmap_extra_reclaim() */
 
 	/* pointers to the selinfo to be used for selrecord.
 	 * Either the local or the global one depending on the
@@ -2092,11 +2441,23 @@ static inline int nm_kring_pending(struct netmap_priv_d *np)
 	return 0;
 }
 
+/* NR_RING_POLL needs to record more than two wait queues per file */
+static __inline int
+nm_ring_poll(struct netmap_priv_d *priv)
+{
+#ifdef linux
+	return (priv->np_flags & NR_RING_POLL) != 0;
+#else
+	(void)priv;
+	return 0;
+#endif /* linux */
+}
+
 /* call with NMG_LOCK held */
 static __inline int
 nm_si_user(struct netmap_priv_d *priv, enum txrx t)
 {
-	return (priv->np_na != NULL &&
+	return (priv->np_na != NULL && !nm_ring_poll(priv) &&
 		(priv->np_qlast[t] - priv->np_qfirst[t] > 1));
 }
 
@@ -2113,11 +2474,22 @@ int netmap_pipe_reg_both(struct netmap_adapter *na,
 
 #ifdef WITH_MONITOR
 
+/* sampling, snaplen and BPF program of a copy monitor, from
+ * NETMAP_REQ_OPT_MONITOR_SAMPLE and NETMAP_REQ_OPT_MONITOR_FILTER */
+struct nm_monitor_filter {
+	u_int sample_rate;	/* 0, 1: no sampling */
+	u_int sample_flow;	/* sample flows instead of frames */
+	u_int snaplen;		/* 0: no limit */
+	u_int ninsns;		/* 0: no program */
+	struct nm_bpf_insn insns[0];
+};
+
 struct netmap_monitor_adapter {
 	struct netmap_adapter up;
 
 	struct netmap_priv_d priv;
 	uint32_t flags;
+	struct nm_monitor_filter *filter; /* NULL: copy all frames */
 };
 
 #endif /* WITH_MONITOR */
@@ -2130,6 +2502,7 @@ struct netmap_monitor_adapter {
  */
 int generic_netmap_attach(struct ifnet *ifp);
 int generic_rx_handler(struct ifnet *ifp, struct mbuf *m);;
+u_int generic_rx_handler_batch(struct ifnet *ifp, struct mbuf **ms, u_int n);
 
 int nm_os_catch_rx(struct netmap_generic_adapter *gna, int intercept);
 int nm_os_catch_tx(struct netmap_generic_adapter *gna, int intercept);
@@ -2150,6 +2523,7 @@ struct nm_os_gen_arg {
 	struct ifnet *ifp;
 	void *m;	/* os-specific mbuf-like object */
 	void *head, *tail; /* tailq, if the OS-specific routine needs to build one */
+	u_int qlen;	/* mbufs in the tailq */
 	void *addr;	/* payload of current packet */
 	u_int len;	/* packet length */
 	u_int ring_nr;	/* packet length */
@@ -2190,6 +2564,7 @@ void nm_os_mitigation_start(struct nm_generic_mit *mit);
 void nm_os_mitigation_restart(struct nm_generic_mit *mit);
 int nm_os_mitigation_active(struct nm_generic_mit *mit);
 void nm_os_mitigation_cleanup(struct nm_generic_mit *mit);
+u_int generic_mit_interval(struct nm_generic_mit *mit, int restart);
 #else /* !WITH_GENERIC */
 #define generic_netmap_attach(ifp)	(EOPNOTSUPP)
 #define na_is_generic(na)		(0)
@@ -2206,10 +2581,13 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit);
 struct nm_bdg_fwd {	/* forwarding entry for a bridge */
 	void *ft_buf;		/* netmap or indirect buffer */
 	uint8_t ft_frags;	/* how many fragments (only on 1st frag) */
+	uint8_t ft_mgrp;	/* multicast group + 1, 0 to flood */
 	uint16_t ft_offset;	/* dst port (unused) */
 	uint16_t ft_flags;	/* flags, e.g. indirect */
 	uint16_t ft_len;	/* src fragment len */
 	uint16_t ft_next;	/* next packet to same destination */
+	uint8_t ft_shared;	/* delivered by reference, see nm_vale_flush() */
+	uint32_t ft_slot;	/* src slot, NR_NOSLOT if not swappable */
 };
 
 /* struct 'virtio_net_hdr' from linux. */
@@ -2221,6 +2599,7 @@ struct nm_vnet_hdr {
 #define VIRTIO_NET_HDR_GSO_TCPV4        1       /* GSO frame, IPv4 TCP (TSO) */
 #define VIRTIO_NET_HDR_GSO_UDP          3       /* GSO frame, IPv4 UDP (UFO) */
 #define VIRTIO_NET_HDR_GSO_TCPV6        4       /* GSO frame, IPv6 TCP */
+#define VIRTIO_NET_HDR_GSO_UDP_L4       5       /* GSO frame, UDP (USO) */
 #define VIRTIO_NET_HDR_GSO_ECN          0x80    /* TCP has ECN set */
     uint8_t gso_type;
     uint16_t hdr_len;
@@ -2296,6 +2675,9 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			   const struct nm_bdg_fwd *ft_p,
 			   struct netmap_ring *dst_ring,
 			   u_int *j, u_int lim, u_int *howmany);
+u_int bdg_mismatch_slots(struct netmap_vp_adapter *na,
+			 struct netmap_vp_adapter *dst_na,
+			 const struct nm_bdg_fwd *ft_p);
 
 /* persistent virtual port routines */
 int nm_os_vi_persist(const char *, struct ifnet **);
@@ -2322,12 +2704,47 @@ int nm_os_kctx_worker_start(struct nm_kctx *);
 void nm_os_kctx_worker_stop(struct nm_kctx *);
 void nm_os_kctx_destroy(struct nm_kctx *);
 void nm_os_kctx_worker_setaff(struct nm_kctx *, int);
+/* let other threads run for about 'us' microseconds, from a worker */
+void nm_os_kctx_sleep_us(u_int us);
+/* from a worker, sleep until nm_os_kctx_wakeup() or for at most 'us'
+ * microseconds. A wakeup that comes first makes the next wait return
+ * immediately. Returns non zero if woken up.
+ */
+int nm_os_kctx_wait_us(struct nm_kctx *, u_int us);
+void nm_os_kctx_wakeup(struct nm_kctx *);
+
+/*
+ * One shot timers, for the deadlines of the datapath. The callback
+ * runs in interrupt context (it cannot sleep) and may arm the timer
+ * again. nm_os_timer_arm() does nothing if the timer is already
+ * pending, nm_os_timer_destroy()
+ * cancels it and waits for a running callback. NULL where there is
+ * no support for them.
+ */
+struct nm_os_timer; /* OS-specific - opaque */
+struct nm_os_timer *nm_os_timer_create(void (*fn)(void *), void *arg);
+void nm_os_timer_arm(struct nm_os_timer *, u_int us);
+void nm_os_timer_destroy(struct nm_os_timer *);
 u_int nm_os_ncpus(void);
+/* the CPU we are running on, only a hint if we can be preempted */
+u_int nm_os_curcpu(void);
+/* wall clock time, in ns since the Epoch */
+uint64_t nm_os_realtime_ns(void);
+/* monotonic time, in ns */
+uint64_t nm_os_uptime_ns(void);
+/* stay on the current CPU, not preempted by netmap code, until unpin */
+u_int nm_os_cpu_pin(void);
+void nm_os_cpu_unpin(void);
 
 int netmap_sync_kloop(struct netmap_priv_d *priv,
 		      struct nmreq_header *hdr);
 int netmap_sync_kloop_stop(struct netmap_priv_d *priv);
 
+#ifdef WITH_BENCH
+int netmap_bench(struct netmap_priv_d *priv, struct nmreq_header *hdr);
+void nm_vale_bench_copy(void *src, void *dst, u_int len, u_int count);
+#endif /* WITH_BENCH */
+
 #ifdef WITH_PTNETMAP
 /* ptnetmap guest routines */
 
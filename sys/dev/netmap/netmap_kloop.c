@@ -37,17 +37,24 @@
 #include <sys/types.h>
 #include <sys/selinfo.h>
 #include <sys/socket.h>
+#include <sys/proc.h>
 #include <net/if.h>
 #include <net/if_var.h>
 #include <machine/bus.h>
 
 #define usleep_range(_1, _2) \
         pause_sbt("sync-kloop-sleep", SBT_1US * _1, SBT_1US * 1, C_ABSOLUTE)
+#define sync_kloop_now_us()	((uint64_t)(sbinuptime() / SBT_1US))
+#define sync_kloop_yield()	maybe_yield()
 
 #elif defined(linux)
 #include <bsd_glue.h>
 #include <linux/file.h>
 #include <linux/eventfd.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#define sync_kloop_now_us()	((uint64_t)ktime_to_us(ktime_get()))
+#define sync_kloop_yield()	cond_resched()
 #endif
 
 #include <net/netmap.h>
@@ -155,28 +162,90 @@ struct sync_kloop_ring_args {
 	bool busy_wait;
 	/* Are we processing in the context of VM exit ? */
 	bool direct;
+	/* Index of the ring in the CSB and eventfds arrays. */
+	u_int entry;
+	/* Use the event indices rather than the need_kick flags ? */
+	bool event_idx;
+	/* Statistics. */
+	uint64_t slots;	/* slots moved through hwcur (tx) or hwtail (rx) */
+	uint64_t irqs;	/* notifications sent to the application */
 };
 
-static void
-netmap_sync_kloop_tx_ring(const struct sync_kloop_ring_args *a)
+/* Enable or disable application --> kernel kicks. In event index mode
+ * the kicks are implicitly disabled while we are processing, and
+ * enabling them means asking for a kick as soon as the application
+ * moves head past the value we have seen. */
+static inline void
+sync_kloop_kick_enable(const struct sync_kloop_ring_args *a, uint32_t head,
+		       uint32_t val)
+{
+	if (!a->event_idx) {
+		csb_ktoa_kick_enable(a->csb_ktoa, val);
+	} else if (val) {
+		CSB_WRITE(a->csb_ktoa, kern_event_idx, head);
+	}
+}
+
+#ifdef SYNC_KLOOP_POLL
+/* Does the application want to be notified, now that hwtail moved
+ * from old to new since the last notification ? */
+static inline bool
+sync_kloop_intr_needed(const struct sync_kloop_ring_args *a, uint32_t old,
+		       uint32_t new)
+{
+	uint32_t event;
+
+	if (!a->event_idx) {
+		return csb_atok_intr_enabled(a->csb_atok);
+	}
+	CSB_READ(a->csb_atok, appl_event_idx, event);
+
+	return nm_csb_need_event(event, new, old, a->kring->nkr_num_slots);
+}
+
+static inline void
+sync_kloop_intr(struct sync_kloop_ring_args *a)
+{
+	eventfd_signal(a->irq_ctx, 1);
+	a->irqs++;
+}
+#endif  /* SYNC_KLOOP_POLL */
+
+static inline uint32_t
+sync_kloop_dist(uint32_t from, uint32_t to, uint32_t num_slots)
+{
+	return to >= from ? to - from : to + num_slots - from;
+}
+
+/* The ring functions return true if they moved hwcur or hwtail. */
+static bool
+netmap_sync_kloop_tx_ring(struct sync_kloop_ring_args *a)
 {
 	struct netmap_kring *kring = a->kring;
 	struct nm_csb_atok *csb_atok = a->csb_atok;
 	struct nm_csb_ktoa *csb_ktoa = a->csb_ktoa;
 	struct netmap_ring shadow_ring; /* shadow copy of the netmap_ring */
 	bool more_txspace = false;
-	uint32_t num_slots;
+	uint32_t num_slots, old_hwcur, old_hwtail;
+#ifdef SYNC_KLOOP_POLL
+	uint32_t irq_tail; /* hwtail at the last notification */
+#endif /* SYNC_KLOOP_POLL */
 	int batch;
 
 	if (unlikely(nm_kr_tryget(kring, 1, NULL))) {
-		return;
+		return false;
 	}
 
 	num_slots = kring->nkr_num_slots;
+	old_hwcur = kring->nr_hwcur;
+	old_hwtail = kring->nr_hwtail;
+#ifdef SYNC_KLOOP_POLL
+	irq_tail = kring->rtail;
+#endif /* SYNC_KLOOP_POLL */
 
 	/* Disable application --> kernel notifications. */
 	if (!a->direct) {
-		csb_ktoa_kick_enable(csb_ktoa, 0);
+		sync_kloop_kick_enable(a, 0, 0);
 	}
 	/* Copy the application kring pointers from the CSB */
 	sync_kloop_kernel_read(csb_atok, &shadow_ring, num_slots);
@@ -211,7 +280,7 @@ netmap_sync_kloop_tx_ring(const struct sync_kloop_ring_args *a)
 			/* Reinit ring and enable notifications. */
 			netmap_ring_reinit(kring);
 			if (!a->busy_wait) {
-				csb_ktoa_kick_enable(csb_ktoa, 1);
+				sync_kloop_kick_enable(a, shadow_ring.head, 1);
 			}
 			break;
 		}
@@ -220,14 +289,18 @@ netmap_sync_kloop_tx_ring(const struct sync_kloop_ring_args *a)
 			sync_kloop_kring_dump("pre txsync", kring);
 		}
 
-		if (unlikely(kring->nm_sync(kring, shadow_ring.flags))) {
+		/* Never defer (NETMAP_REQ_VALE_DEFER_SET): the loop may go
+		 * to sleep right after, with the slots still in the ring. */
+		if (unlikely(kring->nm_sync(kring,
+				shadow_ring.flags | NAF_FLUSH))) {
 			if (!a->busy_wait) {
 				/* Re-enable notifications. */
-				csb_ktoa_kick_enable(csb_ktoa, 1);
+				sync_kloop_kick_enable(a, shadow_ring.head, 1);
 			}
 			nm_prerr("txsync() failed");
 			break;
 		}
+		nm_kring_stats_sync(kring);
 
 		/*
 		 * Finalize
@@ -248,11 +321,13 @@ netmap_sync_kloop_tx_ring(const struct sync_kloop_ring_args *a)
 
 		/* Interrupt the application if needed. */
 #ifdef SYNC_KLOOP_POLL
-		if (a->irq_ctx && more_txspace && csb_atok_intr_enabled(csb_atok)) {
+		if (a->irq_ctx && more_txspace &&
+		    sync_kloop_intr_needed(a, irq_tail, kring->rtail)) {
 			/* We could disable kernel --> application kicks here,
 			 * to avoid spurious interrupts. */
-			eventfd_signal(a->irq_ctx, 1);
+			sync_kloop_intr(a);
 			more_txspace = false;
+			irq_tail = kring->rtail;
 		}
 #endif /* SYNC_KLOOP_POLL */
 
@@ -268,14 +343,14 @@ netmap_sync_kloop_tx_ring(const struct sync_kloop_ring_args *a)
 			 * new slots are ready for transmission.
 			 */
 			/* Re-enable notifications. */
-			csb_ktoa_kick_enable(csb_ktoa, 1);
+			sync_kloop_kick_enable(a, shadow_ring.head, 1);
 			/* Double check, with store-load memory barrier. */
 			nm_stld_barrier();
 			sync_kloop_kernel_read(csb_atok, &shadow_ring, num_slots);
 			if (shadow_ring.head != kring->rhead) {
 				/* We won the race condition, there are more packets to
 				 * transmit. Disable notifications and do another cycle */
-				csb_ktoa_kick_enable(csb_ktoa, 0);
+				sync_kloop_kick_enable(a, 0, 0);
 				continue;
 			}
 			break;
@@ -292,10 +367,14 @@ netmap_sync_kloop_tx_ring(const struct sync_kloop_ring_args *a)
 	nm_kr_put(kring);
 
 #ifdef SYNC_KLOOP_POLL
-	if (a->irq_ctx && more_txspace && csb_atok_intr_enabled(csb_atok)) {
-		eventfd_signal(a->irq_ctx, 1);
+	if (a->irq_ctx && more_txspace &&
+	    sync_kloop_intr_needed(a, irq_tail, kring->rtail)) {
+		sync_kloop_intr(a);
 	}
 #endif /* SYNC_KLOOP_POLL */
+	a->slots += sync_kloop_dist(old_hwcur, kring->nr_hwcur, num_slots);
+
+	return old_hwcur != kring->nr_hwcur || old_hwtail != kring->nr_hwtail;
 }
 
 /* RX cycle without receive any packets */
@@ -308,8 +387,8 @@ sync_kloop_norxslots(struct netmap_kring *kring, uint32_t g_head)
 				kring->nkr_num_slots - 1));
 }
 
-static void
-netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
+static bool
+netmap_sync_kloop_rx_ring(struct sync_kloop_ring_args *a)
 {
 
 	struct netmap_kring *kring = a->kring;
@@ -318,20 +397,28 @@ netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
 	struct netmap_ring shadow_ring; /* shadow copy of the netmap_ring */
 	int dry_cycles = 0;
 	bool some_recvd = false;
-	uint32_t num_slots;
+	uint32_t num_slots, old_hwcur, old_hwtail;
+#ifdef SYNC_KLOOP_POLL
+	uint32_t irq_tail; /* hwtail at the last notification */
+#endif /* SYNC_KLOOP_POLL */
 
 	if (unlikely(nm_kr_tryget(kring, 1, NULL))) {
-		return;
+		return false;
 	}
 
 	num_slots = kring->nkr_num_slots;
+	old_hwcur = kring->nr_hwcur;
+	old_hwtail = kring->nr_hwtail;
+#ifdef SYNC_KLOOP_POLL
+	irq_tail = kring->rtail;
+#endif /* SYNC_KLOOP_POLL */
 
 	/* Get RX csb_atok and csb_ktoa pointers from the CSB. */
 	num_slots = kring->nkr_num_slots;
 
 	/* Disable notifications. */
 	if (!a->direct) {
-		csb_ktoa_kick_enable(csb_ktoa, 0);
+		sync_kloop_kick_enable(a, 0, 0);
 	}
 	/* Copy the application kring pointers from the CSB */
 	sync_kloop_kernel_read(csb_atok, &shadow_ring, num_slots);
@@ -345,7 +432,7 @@ netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
 			/* Reinit ring and enable notifications. */
 			netmap_ring_reinit(kring);
 			if (!a->busy_wait) {
-				csb_ktoa_kick_enable(csb_ktoa, 1);
+				sync_kloop_kick_enable(a, shadow_ring.head, 1);
 			}
 			break;
 		}
@@ -357,11 +444,12 @@ netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
 		if (unlikely(kring->nm_sync(kring, shadow_ring.flags))) {
 			if (!a->busy_wait) {
 				/* Re-enable notifications. */
-				csb_ktoa_kick_enable(csb_ktoa, 1);
+				sync_kloop_kick_enable(a, shadow_ring.head, 1);
 			}
 			nm_prerr("rxsync() failed");
 			break;
 		}
+		nm_kring_stats_sync(kring);
 
 		/*
 		 * Finalize
@@ -383,11 +471,13 @@ netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
 
 #ifdef SYNC_KLOOP_POLL
 		/* Interrupt the application if needed. */
-		if (a->irq_ctx && some_recvd && csb_atok_intr_enabled(csb_atok)) {
+		if (a->irq_ctx && some_recvd &&
+		    sync_kloop_intr_needed(a, irq_tail, kring->rtail)) {
 			/* We could disable kernel --> application kicks here,
 			 * to avoid spurious interrupts. */
-			eventfd_signal(a->irq_ctx, 1);
+			sync_kloop_intr(a);
 			some_recvd = false;
+			irq_tail = kring->rtail;
 		}
 #endif /* SYNC_KLOOP_POLL */
 
@@ -403,14 +493,14 @@ netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
 			 * slots are available.
 			 */
 			/* Re-enable notifications. */
-			csb_ktoa_kick_enable(csb_ktoa, 1);
+			sync_kloop_kick_enable(a, shadow_ring.head, 1);
 			/* Double check, with store-load memory barrier. */
 			nm_stld_barrier();
 			sync_kloop_kernel_read(csb_atok, &shadow_ring, num_slots);
 			if (!sync_kloop_norxslots(kring, shadow_ring.head)) {
 				/* We won the race condition, more slots are available. Disable
 				 * notifications and do another cycle. */
-				csb_ktoa_kick_enable(csb_ktoa, 0);
+				sync_kloop_kick_enable(a, 0, 0);
 				continue;
 			}
 			break;
@@ -431,10 +521,14 @@ netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
 
 #ifdef SYNC_KLOOP_POLL
 	/* Interrupt the application if needed. */
-	if (a->irq_ctx && some_recvd && csb_atok_intr_enabled(csb_atok)) {
-		eventfd_signal(a->irq_ctx, 1);
+	if (a->irq_ctx && some_recvd &&
+	    sync_kloop_intr_needed(a, irq_tail, kring->rtail)) {
+		sync_kloop_intr(a);
 	}
 #endif /* SYNC_KLOOP_POLL */
+	a->slots += sync_kloop_dist(old_hwtail, kring->nr_hwtail, num_slots);
+
+	return old_hwcur != kring->nr_hwcur || old_hwtail != kring->nr_hwtail;
 }
 
 #ifdef SYNC_KLOOP_POLL
@@ -557,26 +651,155 @@ sync_kloop_rx_irq_wake_fun(wait_queue_t *wait, unsigned mode,
 }
 #endif  /* SYNC_KLOOP_POLL */
 
+/* Mark the rings served by a kloop, with NMG_LOCK held. The rings are
+ * numbered relative to the ones bound to priv. */
+static int
+sync_kloop_rings_claim(struct netmap_priv_d *priv, const u_int *first,
+		const u_int *num)
+{
+	struct netmap_adapter *na = priv->np_na;
+	enum txrx t;
+	u_int i;
+
+	for_rx_tx(t) {
+		for (i = 0; i < num[t]; i++) {
+			struct netmap_kring *kring =
+				NMR(na, t)[priv->np_qfirst[t] + first[t] + i];
+
+			if (kring->kloop_busy) {
+				return EBUSY;
+			}
+		}
+	}
+	for_rx_tx(t) {
+		for (i = 0; i < num[t]; i++) {
+			NMR(na, t)[priv->np_qfirst[t] + first[t] + i]->kloop_busy = 1;
+		}
+	}
+	return 0;
+}
+
+static void
+sync_kloop_rings_release(struct netmap_priv_d *priv, const u_int *first,
+		const u_int *num)
+{
+	struct netmap_adapter *na = priv->np_na;
+	enum txrx t;
+	u_int i;
+
+	for_rx_tx(t) {
+		for (i = 0; i < num[t]; i++) {
+			NMR(na, t)[priv->np_qfirst[t] + first[t] + i]->kloop_busy = 0;
+		}
+	}
+}
+
+/* A port served by a kloop: the one bound to the file descriptor of
+ * the request comes first, followed by the ones given with
+ * NETMAP_REQ_OPT_SYNC_KLOOP_PORTS. */
+struct sync_kloop_port {
+	struct netmap_priv_d *priv;
+	void *ref;		/* reference to the other file descriptors */
+	u_int first[NR_TXRX], num[NR_TXRX], bound[NR_TXRX];
+	struct sync_kloop_ring_args *args;	/* tx rings, then rx rings */
+	u_int num_rings;
+	u_int efd_base;		/* first entry in the eventfds option */
+#ifdef SYNC_KLOOP_POLL
+	u_int poll_first;	/* first entry in the poll context */
+#endif /* SYNC_KLOOP_POLL */
+	bool active;		/* rings claimed, kloop running on priv */
+};
+
+/* Stop serving a port, with NMG_LOCK held. If this was the last kloop
+ * on the file descriptor, reset its kloop state. */
+static void
+sync_kloop_port_stop(struct sync_kloop_port *port, bool na_could_sleep)
+{
+	struct netmap_priv_d *priv = port->priv;
+
+	sync_kloop_rings_release(priv, port->first, port->num);
+	if (na_could_sleep) {
+		priv->np_kloop_state |= NM_SYNC_KLOOP_MAYSLEEP;
+	}
+	if (--priv->np_kloops == 0) {
+		if (priv->np_kloop_state & NM_SYNC_KLOOP_MAYSLEEP) {
+			priv->np_na->na_flags |= NAF_BDG_MAYSLEEP;
+		}
+		priv->np_kloop_state = 0;
+	}
+	port->active = false;
+}
+
+#ifdef SYNC_KLOOP_POLL
+/* Stop polling the eventfds and the netmap rings of a port. */
+static void
+sync_kloop_port_poll_release(struct sync_kloop_poll_ctx *poll_ctx,
+		struct sync_kloop_port *port)
+{
+	u_int i;
+
+	for (i = 0; i < port->num_rings + 2; i++) {
+		struct sync_kloop_poll_entry *entry =
+			poll_ctx->entries + port->poll_first + i;
+
+		if (entry->wqh)
+			remove_wait_queue(entry->wqh, &entry->wait);
+		/* We got a reference to the eventfds, but not to the
+		 * netmap file descriptor (the last two entries). */
+		if (entry->filp && i < port->num_rings)
+			fput(entry->filp);
+		if (entry->irq_ctx)
+			eventfd_ctx_put(entry->irq_ctx);
+		if (entry->irq_filp)
+			fput(entry->irq_filp);
+		entry->wqh = NULL;
+		entry->filp = NULL;
+		entry->irq_ctx = NULL;
+		entry->irq_filp = NULL;
+	}
+}
+#endif /* SYNC_KLOOP_POLL */
+
+/* Change the busy_wait mode of the rings processed by the main loop. */
+static void
+sync_kloop_set_busy_wait(struct sync_kloop_ring_args *args, int num_rings,
+		bool busy_wait)
+{
+	int i;
+
+	for (i = 0; i < num_rings; i++) {
+		if (!args[i].direct) {
+			args[i].busy_wait = busy_wait;
+		}
+	}
+}
+
 int
 netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 {
 	struct nmreq_sync_kloop_start *req =
 		(struct nmreq_sync_kloop_start *)(uintptr_t)hdr->nr_body;
 	struct nmreq_opt_sync_kloop_eventfds *eventfds_opt = NULL;
+	struct nmreq_opt_sync_kloop_ports *ports_opt = NULL;
 #ifdef SYNC_KLOOP_POLL
 	struct sync_kloop_poll_ctx *poll_ctx = NULL;
 #endif  /* SYNC_KLOOP_POLL */
-	int num_rx_rings, num_tx_rings, num_rings;
+	struct sync_kloop_port *ports = NULL, *port;
+	u_int num_ports = 1, next_port = 0, num_efds = 0, p, q;
+	int num_rings = 0;
 	struct sync_kloop_ring_args *args = NULL;
 	uint32_t sleep_us = req->sleep_us;
-	struct nm_csb_atok* csb_atok_base;
-	struct nm_csb_ktoa* csb_ktoa_base;
+	uint32_t spin_us = 0;
+	uint64_t spin_until = 0;
+	bool spinning = false;
 	struct netmap_adapter *na;
 	struct nmreq_option *opt;
 	bool na_could_sleep = false;
 	bool busy_wait = true;
 	bool direct_tx = false;
 	bool direct_rx = false;
+	bool event_idx = false;
+	enum txrx t;
 	int err = 0;
 	int i;
 
@@ -595,31 +818,136 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 		return ENXIO;
 	}
 
-	NMG_LOCK();
-	/* Make sure the application is working in CSB mode. */
-	if (!priv->np_csb_atok_base || !priv->np_csb_ktoa_base) {
-		NMG_UNLOCK();
-		nm_prerr("sync-kloop on %s requires "
-				"NETMAP_REQ_OPT_CSB option", na->name);
-		return EINVAL;
+	opt = nmreq_getoption(hdr, NETMAP_REQ_OPT_SYNC_KLOOP_PORTS);
+	if (opt != NULL) {
+		size_t len = opt->nro_size - sizeof(*ports_opt);
+
+		ports_opt = (struct nmreq_opt_sync_kloop_ports *)opt;
+		num_ports += len / sizeof(ports_opt->nro_fds[0]);
+		if (len % sizeof(ports_opt->nro_fds[0]) ||
+		    num_ports > NM_SYNC_KLOOP_PORTS_MAX) {
+			opt->nro_status = EINVAL;
+			return EINVAL;
+		}
+	}
+	ports = nm_os_malloc(num_ports * sizeof(*ports));
+	if (ports == NULL) {
+		return ENOMEM;
 	}
+	ports[0].priv = priv;
+	for (p = 1; p < num_ports; p++) {
+		struct netmap_priv_d *ppriv;
+
+		ppriv = nm_os_priv_get(ports_opt->nro_fds[p - 1],
+				&ports[p].ref);
+		if (ppriv == NULL) {
+			err = EBADF;
+			break;
+		}
+		ports[p].priv = ppriv;
+		for (q = 0; q < p; q++) {
+			if (ports[q].priv == ppriv) {
+				err = EINVAL;
+			}
+		}
+		if (!err && (ppriv->np_nifp == NULL ||
+		    !nm_netmap_on(ppriv->np_na))) {
+			err = ENXIO;
+		}
+		if (err) {
+			break;
+		}
+	}
+	if (ports_opt != NULL) {
+		ports_opt->nro_opt.nro_status = err;
+	}
+	if (err) {
+		goto out;
+	}
+
+	for (p = 0; p < num_ports; p++) {
+		struct netmap_priv_d *ppriv = ports[p].priv;
+
+		for_rx_tx(t) {
+			ports[p].bound[t] = ports[p].num[t] =
+				ppriv->np_qlast[t] - ppriv->np_qfirst[t];
+			ports[p].first[t] = 0;
+		}
+	}
+
+	opt = nmreq_getoption(hdr, NETMAP_REQ_OPT_SYNC_KLOOP_SCHED);
+	if (opt != NULL) {
+		struct nmreq_opt_sync_kloop_sched *sched_opt =
+		    (struct nmreq_opt_sync_kloop_sched *)opt;
+
+		if (sched_opt->nro_spin_us > 1000000 ||
+		    (sched_opt->nro_flags & ~NM_OPT_SYNC_KLOOP_SUBSET)) {
+			opt->nro_status = err = EINVAL;
+			goto out;
+		}
+		spin_us = sched_opt->nro_spin_us;
+		if (sched_opt->nro_flags & NM_OPT_SYNC_KLOOP_SUBSET) {
+			/* only for the rings of our file descriptor */
+			port = ports;
+			port->first[NR_TX] = sched_opt->nro_tx_first;
+			port->num[NR_TX] = sched_opt->nro_tx_num;
+			port->first[NR_RX] = sched_opt->nro_rx_first;
+			port->num[NR_RX] = sched_opt->nro_rx_num;
+			if (port->first[NR_TX] + port->num[NR_TX] >
+			    port->bound[NR_TX] ||
+			    port->first[NR_RX] + port->num[NR_RX] >
+			    port->bound[NR_RX] ||
+			    port->num[NR_TX] + port->num[NR_RX] == 0) {
+				opt->nro_status = err = EINVAL;
+				goto out;
+			}
+		}
+		opt->nro_status = 0;
+	}
+
+	NMG_LOCK();
+	for (p = 0; p < num_ports; p++) {
+		struct netmap_priv_d *ppriv = ports[p].priv;
+
+		/* Make sure the application is working in CSB mode. */
+		if (!ppriv->np_csb_atok_base || !ppriv->np_csb_ktoa_base) {
+			nm_prerr("sync-kloop on %s requires "
+					"NETMAP_REQ_OPT_CSB option",
+					ppriv->np_na->name);
+			err = EINVAL;
+			break;
+		}
 
-	csb_atok_base = priv->np_csb_atok_base;
-	csb_ktoa_base = priv->np_csb_ktoa_base;
+		/* The kloop only sleeps on np_si[]. */
+		if (nm_ring_poll(ppriv)) {
+			nm_prerr("sync-kloop on %s does not support "
+					"NR_RING_POLL", ppriv->np_na->name);
+			err = EINVAL;
+			break;
+		}
 
-	/* Make sure that no kloop is currently running. */
-	if (priv->np_kloop_state & NM_SYNC_KLOOP_RUNNING) {
-		err = EBUSY;
+		/* Make sure that no other kloop is serving our rings. */
+		err = sync_kloop_rings_claim(ppriv, ports[p].first,
+				ports[p].num);
+		if (err) {
+			break;
+		}
+		ppriv->np_kloops++;
+		ppriv->np_kloop_state |= NM_SYNC_KLOOP_RUNNING;
+		ports[p].active = true;
 	}
-	priv->np_kloop_state |= NM_SYNC_KLOOP_RUNNING;
 	NMG_UNLOCK();
 	if (err) {
-		return err;
+		goto out;
 	}
 
-	num_rx_rings = priv->np_qlast[NR_RX] - priv->np_qfirst[NR_RX];
-	num_tx_rings = priv->np_qlast[NR_TX] - priv->np_qfirst[NR_TX];
-	num_rings = num_tx_rings + num_rx_rings;
+	for (p = 0; p < num_ports; p++) {
+		port = ports + p;
+		port->num_rings = port->num[NR_TX] + port->num[NR_RX];
+		port->efd_base = num_efds;
+		num_rings += port->num_rings;
+		num_efds += port->bound[NR_TX] + port->bound[NR_RX];
+	}
 
 	args = nm_os_malloc(num_rings * sizeof(args[0]));
 	if (!args) {
@@ -629,23 +957,39 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 
 	/* Prepare the arguments for netmap_sync_kloop_tx_ring()
 	 * and netmap_sync_kloop_rx_ring(). */
-	for (i = 0; i < num_tx_rings; i++) {
-		struct sync_kloop_ring_args *a = args + i;
-
-		a->kring = NMR(na, NR_TX)[i + priv->np_qfirst[NR_TX]];
-		a->csb_atok = csb_atok_base + i;
-		a->csb_ktoa = csb_ktoa_base + i;
-		a->busy_wait = busy_wait;
-		a->direct = direct_tx;
-	}
-	for (i = 0; i < num_rx_rings; i++) {
-		struct sync_kloop_ring_args *a = args + num_tx_rings + i;
-
-		a->kring = NMR(na, NR_RX)[i + priv->np_qfirst[NR_RX]];
-		a->csb_atok = csb_atok_base + num_tx_rings + i;
-		a->csb_ktoa = csb_ktoa_base + num_tx_rings + i;
-		a->busy_wait = busy_wait;
-		a->direct = direct_rx;
+	for (p = 0, i = 0; p < num_ports; p++) {
+		struct netmap_priv_d *ppriv = ports[p].priv;
+		struct netmap_adapter *pna = ppriv->np_na;
+		struct sync_kloop_ring_args *a;
+		u_int k;
+
+		port = ports + p;
+		port->args = args + i;
+		i += port->num_rings;
+		for (k = 0; k < port->num[NR_TX]; k++) {
+			a = port->args + k;
+			a->entry = port->first[NR_TX] + k;
+			a->kring = NMR(pna, NR_TX)[a->entry +
+						ppriv->np_qfirst[NR_TX]];
+			a->csb_atok = ppriv->np_csb_atok_base + a->entry;
+			a->csb_ktoa = ppriv->np_csb_ktoa_base + a->entry;
+			a->busy_wait = busy_wait;
+			a->direct = direct_tx;
+			a->event_idx = false;
+			a->slots = a->irqs = 0;
+		}
+		for (k = 0; k < port->num[NR_RX]; k++) {
+			a = port->args + port->num[NR_TX] + k;
+			a->entry = port->bound[NR_TX] + port->first[NR_RX] + k;
+			a->kring = NMR(pna, NR_RX)[port->first[NR_RX] + k +
+						ppriv->np_qfirst[NR_RX]];
+			a->csb_atok = ppriv->np_csb_atok_base + a->entry;
+			a->csb_ktoa = ppriv->np_csb_ktoa_base + a->entry;
+			a->busy_wait = busy_wait;
+			a->direct = direct_rx;
+			a->event_idx = false;
+			a->slots = a->irqs = 0;
+		}
 	}
 
 	/* Validate notification options. */
@@ -656,17 +1000,30 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 
 		direct_tx = !!(mode_opt->mode & NM_OPT_SYNC_KLOOP_DIRECT_TX);
 		direct_rx = !!(mode_opt->mode & NM_OPT_SYNC_KLOOP_DIRECT_RX);
+		event_idx = !!(mode_opt->mode & NM_OPT_SYNC_KLOOP_EVENT_IDX);
 		if (mode_opt->mode & ~(NM_OPT_SYNC_KLOOP_DIRECT_TX |
-		    NM_OPT_SYNC_KLOOP_DIRECT_RX)) {
+		    NM_OPT_SYNC_KLOOP_DIRECT_RX | NM_OPT_SYNC_KLOOP_EVENT_IDX)) {
+			opt->nro_status = err = EINVAL;
+			goto out;
+		}
+		/* The direct modes process a ring in the context of the
+		 * notification, there is nothing to multiplex. */
+		if ((direct_tx || direct_rx) && num_ports > 1) {
 			opt->nro_status = err = EINVAL;
 			goto out;
 		}
 		opt->nro_status = 0;
+		for (i = 0; i < num_rings; i++) {
+			args[i].event_idx = event_idx;
+		}
 	}
 	opt = nmreq_getoption(hdr, NETMAP_REQ_OPT_SYNC_KLOOP_EVENTFDS);
 	if (opt != NULL) {
+		/* The option has an entry for each bound ring, also
+		 * if this kloop serves only some of them, for all the
+		 * ports in order. */
 		if (opt->nro_size != sizeof(*eventfds_opt) +
-			sizeof(eventfds_opt->eventfds[0]) * num_rings) {
+			sizeof(eventfds_opt->eventfds[0]) * num_efds) {
 			/* Option size not consistent with the number of
 			 * entries. */
 			opt->nro_status = err = EINVAL;
@@ -679,10 +1036,14 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 		/* Check if some ioeventfd entry is not defined, and force sleep
 		 * synchronization in that case. */
 		busy_wait = false;
-		for (i = 0; i < num_rings; i++) {
-			if (eventfds_opt->eventfds[i].ioeventfd < 0) {
-				busy_wait = true;
-				break;
+		for (p = 0; p < num_ports && !busy_wait; p++) {
+			port = ports + p;
+			for (i = 0; i < port->num_rings; i++) {
+				if (eventfds_opt->eventfds[port->efd_base +
+				    port->args[i].entry].ioeventfd < 0) {
+					busy_wait = true;
+					break;
+				}
 			}
 		}
 
@@ -693,16 +1054,23 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 			goto out;
 		}
 
-		/* We need 2 poll entries for TX and RX notifications coming
-		 * from the netmap adapter, plus one entries per ring for the
-		 * notifications coming from the application. */
+		/* For each port we need 2 poll entries for TX and RX
+		 * notifications coming from the netmap adapter, plus one
+		 * entry per ring for the notifications coming from the
+		 * application. */
 		poll_ctx = nm_os_malloc(sizeof(*poll_ctx) +
-				(num_rings + 2) * sizeof(poll_ctx->entries[0]));
+				(num_rings + 2 * num_ports) *
+				sizeof(poll_ctx->entries[0]));
+		if (poll_ctx == NULL) {
+			err = ENOMEM;
+			goto out;
+		}
 		init_poll_funcptr(&poll_ctx->wait_table,
 					sync_kloop_poll_table_queue_proc);
-		poll_ctx->num_entries = 2 + num_rings;
-		poll_ctx->num_tx_rings = num_tx_rings;
-		poll_ctx->num_rings = num_rings;
+		poll_ctx->num_entries = num_rings + 2 * num_ports;
+		/* The direct modes (only with one port) look at these. */
+		poll_ctx->num_tx_rings = ports[0].num[NR_TX];
+		poll_ctx->num_rings = ports[0].num_rings;
 		poll_ctx->next_entry = 0;
 		poll_ctx->next_wake_fun = NULL;
 
@@ -715,93 +1083,111 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 			na_could_sleep = true;
 		}
 
-		for (i = 0; i < num_rings + 2; i++) {
-			poll_ctx->entries[i].args = args + i;
-			poll_ctx->entries[i].parent = poll_ctx;
+		/* The entries of each port are the ones of its rings,
+		 * followed by the TX and RX irq ones. */
+		for (p = 0, q = 0; p < num_ports; p++) {
+			port = ports + p;
+			port->poll_first = q;
+			for (i = 0; i < port->num_rings + 2; i++, q++) {
+				poll_ctx->entries[q].args = i < port->num_rings ?
+					port->args + i : NULL;
+				poll_ctx->entries[q].parent = poll_ctx;
+			}
 		}
 
-		/* Poll for notifications coming from the applications through
-		 * eventfds. */
-		for (i = 0; i < num_rings; i++, poll_ctx->next_entry++) {
-			struct eventfd_ctx *irq = NULL;
-			struct file *filp = NULL;
-			unsigned long mask;
-			bool tx_ring = (i < num_tx_rings);
-
-			if (eventfds_opt->eventfds[i].irqfd >= 0) {
-				filp = eventfd_fget(
-				    eventfds_opt->eventfds[i].irqfd);
-				if (IS_ERR(filp)) {
-					err = PTR_ERR(filp);
-					goto out;
+		for (p = 0; p < num_ports; p++) {
+			port = ports + p;
+			poll_ctx->next_entry = port->poll_first;
+
+			/* Poll for notifications coming from the
+			 * applications through eventfds. */
+			for (i = 0; i < port->num_rings;
+					i++, poll_ctx->next_entry++) {
+				struct sync_kloop_poll_entry *entry =
+				    poll_ctx->entries + poll_ctx->next_entry;
+				struct eventfd_ctx *irq = NULL;
+				struct file *filp = NULL;
+				unsigned long mask;
+				bool tx_ring = (i < port->num[NR_TX]);
+				u_int e = port->efd_base + port->args[i].entry;
+
+				if (eventfds_opt->eventfds[e].irqfd >= 0) {
+					filp = eventfd_fget(
+					    eventfds_opt->eventfds[e].irqfd);
+					if (IS_ERR(filp)) {
+						err = PTR_ERR(filp);
+						goto out;
+					}
+					entry->irq_filp = filp;
+					irq = eventfd_ctx_fileget(filp);
+					if (IS_ERR(irq)) {
+						err = PTR_ERR(irq);
+						goto out;
+					}
 				}
-				irq = eventfd_ctx_fileget(filp);
-				if (IS_ERR(irq)) {
-					err = PTR_ERR(irq);
-					goto out;
+				entry->irq_ctx = irq;
+				entry->args->busy_wait = busy_wait;
+				/* Don't let netmap_sync_kloop_*x_ring() use
+				 * IRQs in direct mode. */
+				entry->args->irq_ctx =
+				    ((tx_ring && direct_tx) ||
+				    (!tx_ring && direct_rx)) ? NULL :
+				    entry->irq_ctx;
+				entry->args->direct =
+				    (tx_ring ? direct_tx : direct_rx);
+
+				if (!busy_wait) {
+					filp = eventfd_fget(
+					    eventfds_opt->eventfds[e].ioeventfd);
+					if (IS_ERR(filp)) {
+						err = PTR_ERR(filp);
+						goto out;
+					}
+					if (tx_ring && direct_tx) {
+						/* Override the wake up function
+						 * so that it can directly call
+						 * netmap_sync_kloop_tx_ring().
+						 */
+						poll_ctx->next_wake_fun =
+						    sync_kloop_tx_kick_wake_fun;
+					} else if (!tx_ring && direct_rx) {
+						/* Same for direct RX. */
+						poll_ctx->next_wake_fun =
+						    sync_kloop_rx_kick_wake_fun;
+					} else {
+						poll_ctx->next_wake_fun = NULL;
+					}
+					mask = filp->f_op->poll(filp,
+					    &poll_ctx->wait_table);
+					if (mask & POLLERR) {
+						err = EINVAL;
+						goto out;
+					}
 				}
 			}
-			poll_ctx->entries[i].irq_filp = filp;
-			poll_ctx->entries[i].irq_ctx = irq;
-			poll_ctx->entries[i].args->busy_wait = busy_wait;
-			/* Don't let netmap_sync_kloop_*x_ring() use
-			 * IRQs in direct mode. */
-			poll_ctx->entries[i].args->irq_ctx =
-			    ((tx_ring && direct_tx) ||
-			    (!tx_ring && direct_rx)) ? NULL :
-			    poll_ctx->entries[i].irq_ctx;
-			poll_ctx->entries[i].args->direct =
-			    (tx_ring ? direct_tx : direct_rx);
 
+			/* Poll for notifications coming from the netmap rings
+			 * bound to the file descriptor of the port. */
 			if (!busy_wait) {
-				filp = eventfd_fget(
-				    eventfds_opt->eventfds[i].ioeventfd);
-				if (IS_ERR(filp)) {
-					err = PTR_ERR(filp);
-					goto out;
-				}
-				if (tx_ring && direct_tx) {
-					/* Override the wake up function
-					 * so that it can directly call
-					 * netmap_sync_kloop_tx_ring().
-					 */
-					poll_ctx->next_wake_fun =
-					    sync_kloop_tx_kick_wake_fun;
-				} else if (!tx_ring && direct_rx) {
-					/* Same for direct RX. */
-					poll_ctx->next_wake_fun =
-					    sync_kloop_rx_kick_wake_fun;
-				} else {
-					poll_ctx->next_wake_fun = NULL;
-				}
-				mask = filp->f_op->poll(filp,
+				struct netmap_priv_d *ppriv = port->priv;
+
+				NMG_LOCK();
+				/* In direct mode, override the wake up
+				 * function so that it can forward the
+				 * netmap_tx_irq() to the guest. */
+				poll_ctx->next_wake_fun = direct_tx ?
+				    sync_kloop_tx_irq_wake_fun : NULL;
+				poll_wait(ppriv->np_filp, ppriv->np_si[NR_TX],
 				    &poll_ctx->wait_table);
-				if (mask & POLLERR) {
-					err = EINVAL;
-					goto out;
-				}
-			}
-		}
+				poll_ctx->next_entry++;
 
-		/* Poll for notifications coming from the netmap rings bound to
-		 * this file descriptor. */
-		if (!busy_wait) {
-			NMG_LOCK();
-			/* In direct mode, override the wake up function so
-			 * that it can forward the netmap_tx_irq() to the
-			 * guest. */
-			poll_ctx->next_wake_fun = direct_tx ?
-			    sync_kloop_tx_irq_wake_fun : NULL;
-			poll_wait(priv->np_filp, priv->np_si[NR_TX],
-			    &poll_ctx->wait_table);
-			poll_ctx->next_entry++;
-
-			poll_ctx->next_wake_fun = direct_rx ?
-			    sync_kloop_rx_irq_wake_fun : NULL;
-			poll_wait(priv->np_filp, priv->np_si[NR_RX],
-			    &poll_ctx->wait_table);
-			poll_ctx->next_entry++;
-			NMG_UNLOCK();
+				poll_ctx->next_wake_fun = direct_rx ?
+				    sync_kloop_rx_irq_wake_fun : NULL;
+				poll_wait(ppriv->np_filp, ppriv->np_si[NR_RX],
+				    &poll_ctx->wait_table);
+				poll_ctx->next_entry++;
+				NMG_UNLOCK();
+			}
 		}
 #else   /* SYNC_KLOOP_POLL */
 		opt->nro_status = EOPNOTSUPP;
@@ -810,17 +1196,43 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 	}
 
 	nm_prinf("kloop busy_wait %u, direct_tx %u, direct_rx %u, "
-	    "na_could_sleep %u", busy_wait, direct_tx, direct_rx,
-	    na_could_sleep);
+	    "event_idx %u, na_could_sleep %u, spin_us %u, tx %u+%u, rx %u+%u, "
+	    "ports %u", busy_wait, direct_tx, direct_rx, event_idx,
+	    na_could_sleep, spin_us, ports[0].first[NR_TX],
+	    ports[0].num[NR_TX], ports[0].first[NR_RX], ports[0].num[NR_RX],
+	    num_ports);
 
 	/* Main loop. */
 	for (;;) {
+		bool progress = false;
+
 		if (unlikely(NM_ACCESS_ONCE(priv->np_kloop_state) & NM_SYNC_KLOOP_STOPPING)) {
 			break;
 		}
 
+		/* The other ports can leave on their own, with a
+		 * NETMAP_REQ_SYNC_KLOOP_STOP on their file descriptor. */
+		for (p = 1; p < num_ports; p++) {
+			port = ports + p;
+			if (likely(!port->active ||
+			    !(NM_ACCESS_ONCE(port->priv->np_kloop_state) &
+			    NM_SYNC_KLOOP_STOPPING))) {
+				continue;
+			}
 #ifdef SYNC_KLOOP_POLL
-		if (!busy_wait) {
+			if (poll_ctx) {
+				sync_kloop_port_poll_release(poll_ctx, port);
+			}
+#endif /* SYNC_KLOOP_POLL */
+			NMG_LOCK();
+			sync_kloop_port_stop(port, false);
+			NMG_UNLOCK();
+			nm_os_priv_put(port->ref);
+			port->ref = NULL;
+		}
+
+#ifdef SYNC_KLOOP_POLL
+		if (!busy_wait && !spinning) {
 			/* It is important to set the task state as
 			 * interruptible before processing any TX/RX ring,
 			 * so that if a notification on ring Y comes after
@@ -834,16 +1246,62 @@ netmap_sync_kloop(struct netmap_priv_d *priv, struct nmreq_header *hdr)
 		}
 #endif  /* SYNC_KLOOP_POLL */
 
-		/* Process all the TX rings bound to this file descriptor. */
-		for (i = 0; !direct_tx && i < num_tx_rings; i++) {
-			struct sync_kloop_ring_args *a = args + i;
-			netmap_sync_kloop_tx_ring(a);
+		/* Process all the rings of the ports, starting from a
+		 * different port at each round, so that none of them is
+		 * always served last. */
+		for (p = 0; p < num_ports; p++) {
+			port = ports + (next_port + p) % num_ports;
+			if (!port->active) {
+				continue;
+			}
+
+			/* Process all the TX rings of the port. */
+			for (i = 0; !direct_tx && i < port->num[NR_TX]; i++) {
+				struct sync_kloop_ring_args *a = port->args + i;
+				progress |= netmap_sync_kloop_tx_ring(a);
+			}
+
+			/* Process all the RX rings of the port. */
+			for (i = 0; !direct_rx && i < port->num[NR_RX]; i++) {
+				struct sync_kloop_ring_args *a = port->args +
+					port->num[NR_TX] + i;
+				progress |= netmap_sync_kloop_rx_ring(a);
+			}
 		}
+		if (++next_port == num_ports) {
+			next_port = 0;
+		}
+
+		if (spin_us) {
+			uint64_t now = sync_kloop_now_us();
 
-		/* Process all the RX rings bound to this file descriptor. */
-		for (i = 0; !direct_rx && i < num_rx_rings; i++) {
-			struct sync_kloop_ring_args *a = args + num_tx_rings + i;
-			netmap_sync_kloop_rx_ring(a);
+			if (progress) {
+				spin_until = now + spin_us;
+			}
+			if ((int64_t)(spin_until - now) > 0) {
+				/* More work is likely to come soon. Keep the
+				 * kicks disabled and poll again. */
+				if (!spinning) {
+					spinning = true;
+					sync_kloop_set_busy_wait(args,
+					    num_rings, true);
+#ifdef SYNC_KLOOP_POLL
+					if (!busy_wait) {
+						__set_current_state(TASK_RUNNING);
+					}
+#endif /* SYNC_KLOOP_POLL */
+				}
+				sync_kloop_yield();
+				continue;
+			}
+			if (spinning) {
+				/* Do one more pass to re-enable the kicks
+				 * (with the double check) before sleeping. */
+				spinning = false;
+				sync_kloop_set_busy_wait(args, num_rings,
+				    busy_wait);
+				continue;
+			}
 		}
 
 		if (busy_wait) {
@@ -866,21 +1324,8 @@ out:
 		if (!busy_wait) {
 			__set_current_state(TASK_RUNNING);
 		}
-		for (i = 0; i < poll_ctx->next_entry; i++) {
-			struct sync_kloop_poll_entry *entry =
-						poll_ctx->entries + i;
-
-			if (entry->wqh)
-				remove_wait_queue(entry->wqh, &entry->wait);
-			/* We did not get a reference to the eventfds, but
-			 * don't do that on netmap file descriptors (since
-			 * a reference was not taken. */
-			if (entry->filp && entry->filp != priv->np_filp)
-				fput(entry->filp);
-			if (entry->irq_ctx)
-				eventfd_ctx_put(entry->irq_ctx);
-			if (entry->irq_filp)
-				fput(entry->irq_filp);
+		for (p = 0; p < num_ports; p++) {
+			sync_kloop_port_poll_release(poll_ctx, ports + p);
 		}
 		nm_os_free(poll_ctx);
 		poll_ctx = NULL;
@@ -888,17 +1333,34 @@ out:
 #endif /* SYNC_KLOOP_POLL */
 
 	if (args) {
+		if (netmap_verbose) {
+			for (i = 0; i < num_rings; i++) {
+				nm_prinf("kloop %s: %llu slots, %llu irqs",
+				    args[i].kring->name,
+				    (unsigned long long)args[i].slots,
+				    (unsigned long long)args[i].irqs);
+			}
+		}
 		nm_os_free(args);
 		args = NULL;
 	}
 
-	/* Reset the kloop state. */
+	/* Release our rings and reset the kloop state of each port, if
+	 * we are the last kloop running on its file descriptor. */
 	NMG_LOCK();
-	priv->np_kloop_state = 0;
-	if (na_could_sleep) {
-		na->na_flags |= NAF_BDG_MAYSLEEP;
+	for (p = 0; p < num_ports; p++) {
+		if (ports[p].active) {
+			sync_kloop_port_stop(ports + p,
+			    p == 0 && na_could_sleep);
+		}
 	}
 	NMG_UNLOCK();
+	for (p = 1; p < num_ports; p++) {
+		if (ports[p].ref != NULL) {
+			nm_os_priv_put(ports[p].ref);
+		}
+	}
+	nm_os_free(ports);
 
 	return err;
 }
@@ -925,12 +1387,12 @@ netmap_sync_kloop_stop(struct netmap_priv_d *priv)
 	priv->np_kloop_state |= NM_SYNC_KLOOP_STOPPING;
 	NMG_UNLOCK();
 
-	/* Send a notification to the kloop, in case it is blocked in
+	/* Send a notification to the kloops, in case they are blocked in
 	 * schedule_timeout(). We can use either RX or TX, because the
-	 * kloop is waiting on both. */
+	 * kloops are waiting on both. */
 	nm_os_selwakeup(priv->np_si[NR_RX]);
 
-	/* Wait for the kloop to actually terminate. */
+	/* Wait for all the kloops to actually terminate. */
 	while (running) {
 		usleep_range(1000, 1500);
 		NMG_LOCK();
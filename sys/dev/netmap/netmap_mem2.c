@@ -53,6 +53,10 @@ __FBSDID("$FreeBSD$");
 #include <net/if_var.h>
 #include <net/vnet.h>
 #include <machine/bus.h>	/* bus_dmamap_* */
+#if __FreeBSD_version >= 1200000
+#include <sys/domainset.h>	/* DOMAINSET_PREF() */
+#include <vm/vm_phys.h>		/* vm_ndomains */
+#endif
 
 /* M_NETMAP only used in here */
 MALLOC_DECLARE(M_NETMAP);
@@ -94,6 +98,26 @@ struct netmap_obj_params {
 	u_int last_num;
 };
 
+/*
+ * Per-CPU cache of free buffer indices, on top of the bitmap.
+ * netmap_mem_bufs_get() and netmap_mem_bufs_put() serve the common
+ * case from the cache of the current CPU without taking the allocator
+ * lock. The bitmap is only touched, under the lock, to refill an empty
+ * cache or to release what does not fit in a full one. Ring setup and
+ * teardown (netmap_new_bufs(), netmap_free_bufs()) and the extra
+ * buffers are served this way, outside of the allocator lock.
+ * Buffers sitting in a cache are in use as far as the bitmap (and
+ * objfree) is concerned. The caches are emptied whenever the bitmaps
+ * are initialized.
+ */
+#define NM_BUF_CACHE_SIZE	63	/* so that the struct is 256 bytes */
+#define NM_BUF_CACHE_BATCH	32	/* buffers moved on refill */
+
+struct netmap_buf_cache {
+	uint32_t n;			/* number of valid entries */
+	uint32_t idx[NM_BUF_CACHE_SIZE];
+};
+
 struct netmap_obj_pool {
 	char name[NETMAP_POOL_MAX_NAMSZ];	/* name of the allocator */
 
@@ -103,6 +127,7 @@ struct netmap_obj_pool {
 	size_t memtotal;	/* actual total memory space */
 
 	struct lut_entry *lut;  /* virt,phys addresses, objtotal entries */
+	u_int lutsize;		/* entries in lut, >= objtotal to grow */
 	uint32_t *bitmap;       /* one bit per buffer, 1 means free */
 	uint32_t *invalid_bitmap;/* one bit per buffer, 1 means invalid */
 	uint32_t bitmap_slots;	/* number of uint32 entries in bitmap */
@@ -110,8 +135,19 @@ struct netmap_obj_pool {
 	u_int objtotal;         /* actual total number of objects. */
 	u_int numclusters;	/* actual number of clusters */
 	u_int objfree;          /* number of free objects. */
+	u_int objmaxused;	/* high watermark of objtotal - objfree */
+
+	struct netmap_buf_cache *bufcache; /* per-CPU, buffer pool only */
+	u_int nbufcache;	/* number of entries in bufcache */
+	uint32_t *xowner;	/* buffer pool only: who was given each
+				 * extra buffer, 0 once back in the pool,
+				 * see netmap_extra_reclaim() */
 
 	int	alloc_done;	/* we have allocated the memory */
+	char	*chunk;		/* single allocation holding the clusters */
+	size_t	chunksize;	/* size of chunk */
+	u_int	chunkobjs;	/* objects carved out of chunk */
+	u_int	contig;		/* leading objects at lut[0].vaddr + i * _objsize */
 	/* ---------------------------------------------------*/
 
 	/* limits */
@@ -125,6 +161,7 @@ struct netmap_obj_pool {
 	u_int _objsize;		/* object size */
 	u_int _clustsize;       /* cluster size */
 	u_int _clustentries;    /* objects per cluster */
+	u_int _clustalign;	/* cluster alignment */
 	u_int _numclusters;	/* number of clusters */
 
 	/* requested values */
@@ -154,7 +191,8 @@ struct netmap_mem_ops {
 	struct netmap_if * (*nmd_if_new)(struct netmap_mem_d *,
 			struct netmap_adapter *, struct netmap_priv_d *);
 	void (*nmd_if_delete)(struct netmap_mem_d *,
-			struct netmap_adapter *, struct netmap_if *);
+			struct netmap_adapter *, struct netmap_if *,
+			struct netmap_priv_d *);
 	int  (*nmd_rings_create)(struct netmap_mem_d *,
 			struct netmap_adapter *);
 	void (*nmd_rings_delete)(struct netmap_mem_d *,
@@ -169,6 +207,7 @@ struct netmap_mem_d {
 #define NETMAP_MEM_FINALIZED	0x1	/* preallocation done */
 #define NETMAP_MEM_HIDDEN	0x8	/* being prepared */
 #define NETMAP_MEM_NOMAP	0x10	/* do not map/unmap pdevs */
+#define NETMAP_MEM_EXTBUFS	0x20	/* buffers shared with other allocators */
 	int lasterr;		/* last error for curr config */
 	int active;		/* active users */
 	int refcount;
@@ -185,6 +224,35 @@ struct netmap_mem_d {
 
 	struct netmap_obj_params params[NETMAP_POOLS_NR];
 
+	int nm_numa_req;	/* requested NUMA node, -1: the NIC's one */
+	int nm_numa_hint;	/* from the registering process, overrides
+				 * nm_numa_req (see netmap_mem_numa_hint()) */
+	int nm_numa_node;	/* NUMA node of the pools, -1 if unknown */
+
+	int nm_huge_req;	/* requested huge clusters */
+	int nm_huge;		/* huge clusters in the current config */
+
+	u_int nm_grow_max;	/* room for buffers added by expand */
+	int64_t nm_bufs_ofs;	/* buffer pool offset if NETMAP_MEM_EXTBUFS */
+	int nm_dmamaps;		/* adapters with a DMA map (linux) */
+#define NM_DMA_CACHE_MAX	4
+	/* adapters no longer registered whose DMA map is kept (linux) */
+	struct netmap_adapter *nm_dma_cache[NM_DMA_CACHE_MAX];
+
+	/* buffers held by several slots, see netmap_mem_buf_share() */
+	NM_LOCK_T nm_share_lock;
+	u_int *nm_bufrefs;	/* holders of each buffer, 0 if one */
+	u_int nm_nbufrefs;	/* entries in nm_bufrefs */
+	uint32_t nm_spare;	/* list of the buffers set aside */
+	u_int nm_nspare;
+
+	/* extra buffers, see netmap_extra_put() */
+	u_int nm_xholders;	/* users holding them */
+	uint32_t nm_xowners;	/* last id given to a user, see xowner */
+	u_int nm_xleaked;	/* not given back, and not reclaimed yet */
+	uint64_t nm_xleaked_tot;
+	uint64_t nm_xreclaimed;
+
 #define NM_MEM_NAMESZ	16
 	char name[NM_MEM_NAMESZ];
 };
@@ -277,13 +345,15 @@ netmap_mem_if_new(struct netmap_adapter *na, struct netmap_priv_d *priv)
 	return nifp;
 }
 
+/* priv is the owner of nif, for its extra buffers, or NULL */
 void
-netmap_mem_if_delete(struct netmap_adapter *na, struct netmap_if *nif)
+netmap_mem_if_delete(struct netmap_adapter *na, struct netmap_if *nif,
+		struct netmap_priv_d *priv)
 {
 	struct netmap_mem_d *nmd = na->nm_mem;
 
 	NMA_LOCK(nmd);
-	nmd->ops->nmd_if_delete(nmd, na, nif);
+	nmd->ops->nmd_if_delete(nmd, na, nif, priv);
 	NMA_UNLOCK(nmd);
 }
 
@@ -312,6 +382,10 @@ netmap_mem_rings_delete(struct netmap_adapter *na)
 
 static int netmap_mem_map(struct netmap_obj_pool *, struct netmap_adapter *);
 static int netmap_mem_unmap(struct netmap_obj_pool *, struct netmap_adapter *);
+static int netmap_mem_dma_keep(struct netmap_mem_d *, struct netmap_adapter *);
+static void netmap_mem_dma_flush(struct netmap_mem_d *, struct netmap_adapter *);
+static void netmap_mem_bufrefs_reset(struct netmap_mem_d *);
+static void netmap_mem_xowner_free(struct netmap_mem_d *);
 static int nm_mem_check_group(struct netmap_mem_d *, bus_dma_tag_t);
 static void nm_mem_release_id(struct netmap_mem_d *);
 
@@ -387,12 +461,30 @@ out:
 	return lasterr;
 }
 
+#ifdef WITH_EXTMEM
+static void netmap_mem_ext_bufs_save(struct netmap_mem_d *);
+static void netmap_mem_ext_bufs_restore(struct netmap_mem_d *);
+#endif /* WITH_EXTMEM */
+
 static int
 nm_isset(uint32_t *bitmap, u_int i)
 {
 	return bitmap[ (i>>5) ] & ( 1U << (i & 31U) );
 }
 
+#ifdef WITH_EXTMEM
+/* number of bits set in v */
+static u_int
+nm_bitcount(uint32_t v)
+{
+	u_int n;
+
+	for (n = 0; v; v &= v - 1)
+		n++;
+	return n;
+}
+#endif /* WITH_EXTMEM */
+
 
 static int
 netmap_init_obj_allocator_bitmap(struct netmap_obj_pool *p)
@@ -414,6 +506,7 @@ netmap_init_obj_allocator_bitmap(struct netmap_obj_pool *p)
 	}
 
 	p->objfree = 0;
+	p->objmaxused = 0;
 	/*
 	 * Set all the bits in the bitmap that have
 	 * corresponding buffers to 1 to indicate they are
@@ -440,6 +533,27 @@ netmap_init_obj_allocator_bitmap(struct netmap_obj_pool *p)
 	return 0;
 }
 
+/*
+ * (Re)initialize the per-CPU buffer caches, which must be empty
+ * when the bitmap is. If we cannot allocate them we just go to
+ * the bitmap every time.
+ */
+static void
+netmap_init_buf_cache(struct netmap_obj_pool *p)
+{
+#ifndef _WIN32
+	if (p->bufcache == NULL) {
+		p->nbufcache = nm_os_ncpus();
+		p->bufcache = nm_os_malloc(sizeof(*p->bufcache) *
+				p->nbufcache);
+		if (p->bufcache == NULL)
+			p->nbufcache = 0;
+	} else {
+		memset(p->bufcache, 0, sizeof(*p->bufcache) * p->nbufcache);
+	}
+#endif /* !_WIN32 */
+}
+
 static int
 netmap_mem_init_bitmaps(struct netmap_mem_d *nmd)
 {
@@ -462,6 +576,15 @@ netmap_mem_init_bitmaps(struct netmap_mem_d *nmd)
 	}
 
 	nmd->pools[NETMAP_BUF_POOL].objfree -= 2;
+	nmd->pools[NETMAP_BUF_POOL].objmaxused = 2;
+	/* whatever was leaked is free again, but for the shared
+	 * external buffers (see netmap_mem_deref()) */
+	if (!(nmd->flags & NETMAP_MEM_EXTBUFS))
+		nmd->nm_xreclaimed += nmd->nm_xleaked;
+	nmd->nm_xleaked = 0;
+	if (nmd->pools[NETMAP_BUF_POOL].xowner != NULL)
+		memset(nmd->pools[NETMAP_BUF_POOL].xowner, 0,
+		    sizeof(uint32_t) * nmd->pools[NETMAP_BUF_POOL].lutsize);
 	if (nmd->pools[NETMAP_BUF_POOL].bitmap) {
 		/* XXX This check is a workaround that prevents a
 		 * NULL pointer crash which currently happens only
@@ -469,6 +592,13 @@ netmap_mem_init_bitmaps(struct netmap_mem_d *nmd)
 		 * Removed shared-info --> is the bug still there? */
 		nmd->pools[NETMAP_BUF_POOL].bitmap[0] = ~3U;
 	}
+#ifdef WITH_EXTMEM
+	if (nmd->flags & NETMAP_MEM_EXTBUFS) {
+		/* only our share of the buffers is free */
+		netmap_mem_ext_bufs_restore(nmd);
+	}
+#endif /* WITH_EXTMEM */
+	netmap_init_buf_cache(&nmd->pools[NETMAP_BUF_POOL]);
 	return 0;
 }
 
@@ -477,7 +607,8 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
 	int last_user = 0;
 	NMA_LOCK(nmd);
-	if (na->active_fds <= 0 && !(nmd->flags & NETMAP_MEM_NOMAP))
+	if (na->active_fds <= 0 && !(nmd->flags & NETMAP_MEM_NOMAP) &&
+	    !netmap_mem_dma_keep(nmd, na))
 		netmap_mem_unmap(&nmd->pools[NETMAP_BUF_POOL], na);
 	if (nmd->active == 1) {
 		last_user = 1;
@@ -486,6 +617,15 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 		 * pool resources leaked by unclean application exits are
 		 * reclaimed.
 		 */
+		netmap_mem_bufrefs_reset(nmd);
+#ifdef WITH_EXTMEM
+		if (nmd->flags & NETMAP_MEM_EXTBUFS) {
+			/* Shared buffers cannot be reclaimed this way:
+			 * our share is what we have free now.
+			 */
+			netmap_mem_ext_bufs_save(nmd);
+		}
+#endif /* WITH_EXTMEM */
 		netmap_mem_init_bitmaps(nmd);
 	}
 	nmd->ops->nmd_deref(nmd, na);
@@ -504,12 +644,24 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 static int
 netmap_mem2_get_lut(struct netmap_mem_d *nmd, struct netmap_lut *lut)
 {
-	lut->lut = nmd->pools[NETMAP_BUF_POOL].lut;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+
+	lut->lut = p->lut;
 #ifdef __FreeBSD__
 	lut->plut = lut->lut;
 #endif
-	lut->objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
-	lut->objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
+	/* The room left for netmap_mem_expand() is part of the lut, and
+	 * maps to buffer 0 until it is filled, like the indices out of
+	 * range. Then the copies of the lut in the adapters stay valid
+	 * when the pool grows under them, and there is no vbase.
+	 * External memory has no room.
+	 */
+	lut->objtotal = p->alloc_done ? p->lutsize : p->objtotal;
+	lut->objsize = p->_objsize;
+	lut->vbase = lut->objtotal <= p->contig ? lut->lut[0].vaddr : NULL;
+#ifdef __FreeBSD__
+	lut->pbase = lut->vbase ? lut->lut[0].paddr : 0;
+#endif
 
 	return 0;
 }
@@ -579,6 +731,13 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 	.nm_id = 1,
 	.nm_grp = -1,
 
+	.nm_numa_req = -1,
+	.nm_numa_hint = NETMAP_MEM_NUMA_NOHINT,
+	.nm_numa_node = -1,
+
+	.nm_huge_req = 0,
+	.nm_grow_max = 0,
+
 	.prev = &nm_mem,
 	.next = &nm_mem,
 
@@ -620,6 +779,10 @@ static const struct netmap_mem_d nm_blueprint = {
 
 	.flags = NETMAP_MEM_PRIVATE,
 
+	.nm_numa_req = -1,
+	.nm_numa_hint = NETMAP_MEM_NUMA_NOHINT,
+	.nm_numa_node = -1,
+
 	.ops = &netmap_mem_global_ops,
 };
 
@@ -651,6 +814,45 @@ DECLARE_SYSCTLS(NETMAP_IF_POOL, if);
 DECLARE_SYSCTLS(NETMAP_RING_POOL, ring);
 DECLARE_SYSCTLS(NETMAP_BUF_POOL, buf);
 
+SYSBEGIN(mem2_numa);
+SYSCTL_INT(_dev_netmap, OID_AUTO, numa_node,
+    CTLFLAG_RW, &nm_mem.nm_numa_req, 0,
+    "Requested NUMA node of the global allocator (-1: the NIC's one)");
+SYSCTL_INT(_dev_netmap, OID_AUTO, numa_curr_node,
+    CTLFLAG_RD, &nm_mem.nm_numa_node, 0,
+    "Current NUMA node of the global allocator");
+SYSEND;
+
+/* defaults for the private allocators created from now on */
+static int netmap_priv_huge_clusters = 0;
+static u_int netmap_priv_buf_grow_max = 0;
+/* largest buffer pool we try to allocate as a single chunk */
+static u_int netmap_buf_contig_max = 4 << 20;
+
+SYSBEGIN(mem2_huge);
+SYSCTL_INT(_dev_netmap, OID_AUTO, huge_clusters,
+    CTLFLAG_RW, &nm_mem.nm_huge_req, 0,
+    "Use 2MB clusters for the global allocator");
+SYSCTL_INT(_dev_netmap, OID_AUTO, priv_huge_clusters,
+    CTLFLAG_RW, &netmap_priv_huge_clusters, 0,
+    "Use 2MB clusters for new private allocators");
+SYSEND;
+
+SYSBEGIN(mem2_grow);
+SYSCTL_UINT(_dev_netmap, OID_AUTO, buf_grow_max,
+    CTLFLAG_RW, &nm_mem.nm_grow_max, 0,
+    "Buffers that can be added to the global allocator while in use");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, priv_buf_grow_max,
+    CTLFLAG_RW, &netmap_priv_buf_grow_max, 0,
+    "Buffers that can be added to new private allocators while in use");
+SYSEND;
+
+SYSBEGIN(mem2_contig);
+SYSCTL_UINT(_dev_netmap, OID_AUTO, buf_contig_max,
+    CTLFLAG_RW, &netmap_buf_contig_max, 0,
+    "Largest buffer pool allocated as a single contiguous chunk");
+SYSEND;
+
 /* call with nm_mem_list_lock held */
 static int
 nm_mem_assign_id_locked(struct netmap_mem_d *nmd, int grp_id)
@@ -1001,6 +1203,21 @@ netmap_obj_offset(struct netmap_obj_pool *p, const void *vaddr)
 #define netmap_if_offset(n, v)					\
 	netmap_obj_offset(&(n)->pools[NETMAP_IF_POOL], (v))
 
+/*
+ * Offset of the buffer pool from the start of the memory of the
+ * process. The buffers normally follow the rings; with shared
+ * external buffers they are in a different user mapping, possibly
+ * at a lower address (the offset is then negative).
+ */
+static int64_t
+netmap_mem_bufs_offset(struct netmap_mem_d *nmd)
+{
+	if (nmd->flags & NETMAP_MEM_EXTBUFS)
+		return nmd->nm_bufs_ofs;
+	return nmd->pools[NETMAP_IF_POOL].memtotal +
+		nmd->pools[NETMAP_RING_POOL].memtotal;
+}
+
 #define netmap_ring_offset(n, v)				\
     ((n)->pools[NETMAP_IF_POOL].memtotal + 			\
 	netmap_obj_offset(&(n)->pools[NETMAP_RING_POOL], (v)))
@@ -1047,6 +1264,8 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 
 		p->bitmap[i] &= ~mask; /* mark object as in use */
 		p->objfree--;
+		if (p->objtotal - p->objfree > p->objmaxused)
+			p->objmaxused = p->objtotal - p->objfree;
 
 		vaddr = p->lut[i * 32 + j].vaddr;
 		if (index)
@@ -1081,8 +1300,347 @@ netmap_obj_free(struct netmap_obj_pool *p, uint32_t j)
 	} else {
 		*ptr |= mask;
 		p->objfree++;
+		if (p->xowner != NULL)
+			p->xowner[j] = 0;
+		return 0;
+	}
+}
+
+/*
+ * Move up to n indices from/to the cache of the current CPU.
+ * Return how many were moved.
+ */
+static u_int
+netmap_buf_cache_pop(struct netmap_obj_pool *p, uint32_t *idx, u_int n)
+{
+#ifndef _WIN32
+	struct netmap_buf_cache *c;
+	u_int i;
+
+	if (p->bufcache == NULL)
+		return 0;
+	c = &p->bufcache[nm_os_cpu_pin() % p->nbufcache];
+	for (i = 0; i < n && c->n > 0; i++)
+		idx[i] = c->idx[--c->n];
+	nm_os_cpu_unpin();
+	return i;
+#else
+	return 0;
+#endif /* !_WIN32 */
+}
+
+static u_int
+netmap_buf_cache_push(struct netmap_obj_pool *p, const uint32_t *idx, u_int n)
+{
+#ifndef _WIN32
+	struct netmap_buf_cache *c;
+	u_int i;
+
+	if (p->bufcache == NULL)
 		return 0;
+	c = &p->bufcache[nm_os_cpu_pin() % p->nbufcache];
+	for (i = 0; i < n && c->n < NM_BUF_CACHE_SIZE; i++) {
+		if (p->xowner != NULL)
+			p->xowner[idx[i]] = 0;
+		c->idx[c->n++] = idx[i];
+	}
+	nm_os_cpu_unpin();
+	return i;
+#else
+	return 0;
+#endif /* !_WIN32 */
+}
+
+/*
+ * Allocate up to n buffers, writing their indices in idx.
+ * Returns the number of buffers actually allocated.
+ * Must not be called with the allocator lock held.
+ */
+u_int
+netmap_mem_bufs_get(struct netmap_mem_d *nmd, uint32_t *idx, u_int n)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t spare[NM_BUF_CACHE_BATCH];
+	uint32_t pos = 0; /* opaque, scan position in the bitmap */
+	u_int i, k, nspare = 0;
+
+	i = netmap_buf_cache_pop(p, idx, n);
+	if (i == n)
+		return n;
+
+	NMA_LOCK(nmd);
+	for (; i < n; i++) {
+		if (netmap_obj_malloc(p, p->_objsize, &pos, &idx[i]) == NULL)
+			break;
+	}
+	/* also grab a batch for the cache, if there is one */
+	if (i == n && p->bufcache != NULL) {
+		while (nspare < NM_BUF_CACHE_BATCH && p->objfree > 0) {
+			netmap_obj_malloc(p, p->_objsize, &pos, &spare[nspare]);
+			nspare++;
+		}
+	}
+	NMA_UNLOCK(nmd);
+
+	k = netmap_buf_cache_push(p, spare, nspare);
+	if (k < nspare) {
+		/* somebody else refilled the cache in the meantime */
+		NMA_LOCK(nmd);
+		for (; k < nspare; k++)
+			netmap_obj_free(p, spare[k]);
+		NMA_UNLOCK(nmd);
+	}
+	return i;
+}
+
+/*
+ * Release n buffers. Must not be called with the allocator lock held.
+ * Double frees are only detected for the buffers that reach the bitmap.
+ */
+void
+netmap_mem_bufs_put(struct netmap_mem_d *nmd, const uint32_t *idx, u_int n)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i;
+
+	for (i = 0; i < n; i++) {
+		if (idx[i] < 2 || idx[i] >= p->objtotal) {
+			nm_prerr("Cannot free buf#%d: should be in [2, %d[",
+			    idx[i], p->objtotal);
+			return;
+		}
+	}
+	i = netmap_buf_cache_push(p, idx, n);
+	if (i == n)
+		return;
+
+	NMA_LOCK(nmd);
+	for (; i < n; i++)
+		netmap_obj_free(p, idx[i]);
+	NMA_UNLOCK(nmd);
+}
+
+/*
+ * Buffers delivered to several slots at once (VALE, vale_brd_zcopy).
+ * nm_bufrefs[b] counts the slots that hold b, and is 0 for the usual
+ * buffers, owned by a single slot. Each time a shared buffer goes in
+ * one more slot, the buffer that the slot held is set aside in a
+ * list, linked through the first word of the buffers. When a holder
+ * other than the last one wants to write into its slot again, it
+ * gets one of these in exchange (netmap_mem_buf_unshare()). Then the
+ * list never runs out, and the datapath neither allocates nor frees.
+ * The buffers left in the list go back to the pool with the others
+ * when the allocator falls out of use.
+ */
+
+/* Enable the shared buffers on nmd. Called under NMG_LOCK. */
+int
+netmap_mem_bufrefs_enable(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int *refs, n;
+	int error = 0;
+
+	NMA_LOCK(nmd);
+	if (nmd->nm_bufrefs != NULL)
+		goto out;
+	if (!p->alloc_done || p->lut == NULL) {
+		error = EINVAL;
+		goto out;
+	}
+	n = p->lutsize; /* also cover what netmap_mem_expand() may add */
+#ifdef linux
+	refs = vmalloc(sizeof(*refs) * n);
+#else
+	refs = nm_os_malloc(sizeof(*refs) * n);
+#endif
+	if (refs == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	memset(refs, 0, sizeof(*refs) * n);
+	mtx_init(&nmd->nm_share_lock, "nm_share_lock", NULL, MTX_DEF);
+	nmd->nm_spare = 0;
+	nmd->nm_nspare = 0;
+	nmd->nm_nbufrefs = n;
+	nm_stst_barrier();
+	nmd->nm_bufrefs = refs;
+out:
+	NMA_UNLOCK(nmd);
+	return error;
+}
+
+/* Return the buffers set aside to the pool. Called under NMA_LOCK. */
+static void
+netmap_mem_bufrefs_reset(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+
+	if (nmd->nm_bufrefs == NULL)
+		return;
+	while (nmd->nm_spare != 0) {
+		uint32_t i = nmd->nm_spare;
+
+		nmd->nm_spare = *(uint32_t *)p->lut[i].vaddr;
+		netmap_obj_free(p, i);
+	}
+	nmd->nm_nspare = 0;
+	memset(nmd->nm_bufrefs, 0, sizeof(u_int) * nmd->nm_nbufrefs);
+}
+
+static void
+netmap_mem_bufrefs_free(struct netmap_mem_d *nmd)
+{
+	if (nmd->nm_bufrefs == NULL)
+		return;
+	mtx_destroy(&nmd->nm_share_lock);
+#ifdef linux
+	vfree(nmd->nm_bufrefs);
+#else
+	nm_os_free(nmd->nm_bufrefs);
+#endif
+	nmd->nm_bufrefs = NULL;
+	nmd->nm_nbufrefs = 0;
+	nmd->nm_spare = 0;
+	nmd->nm_nspare = 0;
+}
+
+/*
+ * A new id for a user of nmd that gets extra buffers, to be written
+ * in xowner for each of them. 0 if they cannot be tracked. Called
+ * under NMA_LOCK.
+ */
+static uint32_t
+netmap_mem_xowner_new(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t *owner;
+
+	if (p->xowner == NULL) {
+		if (!p->alloc_done || p->lutsize == 0)
+			return 0;
+#ifdef linux
+		owner = vmalloc(sizeof(*owner) * p->lutsize);
+#else
+		owner = nm_os_malloc(sizeof(*owner) * p->lutsize);
+#endif
+		if (owner == NULL)
+			return 0;
+		memset(owner, 0, sizeof(*owner) * p->lutsize);
+		/* the datapath frees without the lock */
+		nm_stst_barrier();
+		p->xowner = owner;
+	}
+	if (++nmd->nm_xowners == 0)
+		nmd->nm_xowners = 1;
+	return nmd->nm_xowners;
+}
+
+static void
+netmap_mem_xowner_free(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+
+	if (p->xowner == NULL)
+		return;
+#ifdef linux
+	vfree(p->xowner);
+#else
+	nm_os_free(p->xowner);
+#endif
+	p->xowner = NULL;
+}
+
+/*
+ * Reference counts of the buffers of nmd, and their number in *n.
+ * NULL if the shared buffers are not enabled. Only meant for a quick
+ * check of a buffer that the caller holds: nonzero means shared.
+ */
+const u_int *
+netmap_mem_bufrefs(struct netmap_mem_d *nmd, u_int *n)
+{
+	const u_int *refs = nmd->nm_bufrefs;
+
+	nm_ldld_barrier();
+	*n = nmd->nm_nbufrefs;
+	return refs;
+}
+
+/*
+ * The caller, which holds buffer b in a slot, is going to deliver it
+ * to other slots (netmap_mem_buf_share()). Fails if b is not a buffer
+ * of nmd, or it is already shared.
+ */
+int
+netmap_mem_buf_hold(struct netmap_mem_d *nmd, uint32_t b)
+{
+	int error = 0;
+
+	if (b < 2 || b >= nmd->nm_nbufrefs)
+		return EINVAL;
+	mtx_lock(&nmd->nm_share_lock);
+	if (nmd->nm_bufrefs[b] != 0)
+		error = EBUSY;
+	else
+		nmd->nm_bufrefs[b] = 1;
+	mtx_unlock(&nmd->nm_share_lock);
+	return error;
+}
+
+/*
+ * Put buffer b, held by the caller, also in a slot that holds buffer x.
+ * x is set aside. Fails, leaving things as they are, if x cannot be
+ * set aside because it is not a buffer of nmd, or it is shared.
+ */
+int
+netmap_mem_buf_share(struct netmap_mem_d *nmd, uint32_t b, uint32_t x)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	int error = 0;
+
+	if (x < 2 || x >= nmd->nm_nbufrefs || x == b)
+		return EINVAL;
+	mtx_lock(&nmd->nm_share_lock);
+	if (nmd->nm_bufrefs[x] != 0) {
+		error = EBUSY;
+		goto out;
+	}
+	*(uint32_t *)p->lut[x].vaddr = nmd->nm_spare;
+	nmd->nm_spare = x;
+	nmd->nm_nspare++;
+	nmd->nm_bufrefs[b]++;
+out:
+	mtx_unlock(&nmd->nm_share_lock);
+	return error;
+}
+
+/*
+ * A slot that holds the shared buffer b is going to be written.
+ * Returns the buffer to use in the slot instead: b itself if the slot
+ * was the last holder, one of the buffers set aside otherwise, or 0
+ * (keep b, try later) if there is none.
+ */
+uint32_t
+netmap_mem_buf_unshare(struct netmap_mem_d *nmd, uint32_t b)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t x = b;
+
+	if (b < 2 || b >= nmd->nm_nbufrefs)
+		return b;
+	mtx_lock(&nmd->nm_share_lock);
+	if (nmd->nm_bufrefs[b] <= 1) {
+		nmd->nm_bufrefs[b] = 0;
+	} else if (nmd->nm_spare == 0) {
+		x = 0;
+	} else {
+		x = nmd->nm_spare;
+		nmd->nm_spare = *(uint32_t *)p->lut[x].vaddr;
+		nmd->nm_nspare--;
+		nmd->nm_bufrefs[b]--;
 	}
+	mtx_unlock(&nmd->nm_share_lock);
+	return x;
 }
 
 /*
@@ -1133,35 +1691,62 @@ netmap_mem_bufsize(struct netmap_mem_d *nmd)
 
 /*
  * allocate extra buffers in a linked list.
- * returns the actual number.
+ * returns the actual number. *owner gets the id written in xowner for
+ * each of them, for netmap_extra_reclaim(), or 0.
  */
 uint32_t
-netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n)
+netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n,
+		uint32_t *owner)
 {
 	struct netmap_mem_d *nmd = na->nm_mem;
-	uint32_t i, pos = 0; /* opaque, scan position in the bitmap */
-
-	NMA_LOCK(nmd);
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct lut_entry *lut = p->lut;
+	uint32_t idx[NM_BUF_CACHE_BATCH];
+	uint32_t i = 0;
 
 	*head = 0;	/* default, 'null' index ie empty list */
-	for (i = 0 ; i < n; i++) {
-		uint32_t cur = *head;	/* save current head */
-		uint32_t *p = netmap_buf_malloc(nmd, &pos, head);
-		if (p == NULL) {
+	*owner = 0;
+	if (n == 0)
+		return 0;
+	/* a holder (see netmap_extra_put()) from before the buffers
+	 * leave the pool */
+	NMA_LOCK(nmd);
+	nmd->nm_xholders++;
+	*owner = netmap_mem_xowner_new(nmd);
+	NMA_UNLOCK(nmd);
+	while (i < n) {
+		u_int j, want = n - i, got;
+
+		if (want > NM_BUF_CACHE_BATCH)
+			want = NM_BUF_CACHE_BATCH;
+		got = netmap_mem_bufs_get(nmd, idx, want);
+		for (j = 0; j < got; j++) {
+			uint32_t *buf = lut[idx[j]].vaddr;
+
+			nm_prdis(5, "allocate buffer %d -> %d", idx[j], *head);
+			*buf = *head; /* link to previous head */
+			*head = idx[j];
+			if (*owner != 0)
+				p->xowner[idx[j]] = *owner;
+		}
+		i += got;
+		if (got < want) {
 			nm_prerr("no more buffers after %d of %d", i, n);
-			*head = cur; /* restore */
 			break;
 		}
-		nm_prdis(5, "allocate buffer %d -> %d", *head, cur);
-		*p = cur; /* link to previous head */
 	}
-
-	NMA_UNLOCK(nmd);
+	if (i == 0) {
+		NMA_LOCK(nmd);
+		nmd->nm_xholders--;
+		NMA_UNLOCK(nmd);
+		*owner = 0;
+	}
 
 	return i;
 }
 
-static void
+/* Free the list of extra buffers, return how many there were. */
+static u_int
 netmap_extra_free(struct netmap_adapter *na, uint32_t head)
 {
 	struct lut_entry *lut = na->na_lut.lut;
@@ -1175,87 +1760,258 @@ netmap_extra_free(struct netmap_adapter *na, uint32_t head)
 		buf = lut[head].vaddr;
 		head = *buf;
 		*buf = 0;
-		if (netmap_obj_free(p, cur))
+		/* we hold the lock here, so only use the bitmap
+		 * when the cache is full */
+		if (netmap_buf_cache_push(p, &cur, 1) == 0 &&
+		    netmap_obj_free(p, cur))
 			break;
 	}
 	if (head != 0)
 		nm_prerr("breaking with head %d", head);
 	if (netmap_debug & NM_DEBUG_MEM)
 		nm_prinf("freed %d buffers", i);
+	return i;
 }
 
+/*
+ * Account for the extra buffers that the owner of a netmap_if gives
+ * back on close: back of the nextra it was given. Those missing are
+ * looked for with netmap_extra_reclaim(), and what it cannot find is
+ * recovered with all the others when the allocator falls out of use
+ * (netmap_mem_init_bitmaps()). Called under NMA_LOCK.
+ */
+static void
+netmap_extra_put(struct netmap_mem_d *nmd, u_int nextra, u_int back)
+{
+	if (nextra == 0)
+		return;
+	if (back < nextra) {
+		nmd->nm_xleaked += nextra - back;
+		nmd->nm_xleaked_tot += nextra - back;
+	}
+	if (nmd->nm_xholders > 0)
+		nmd->nm_xholders--;
+}
 
-/* Return nonzero on error */
-static int
-netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
+/*
+ * Clear in cand the buffers that somebody holds: those in the slots
+ * of the rings, in the extra buffer lists of the netmap_if and set
+ * aside for the shared buffers. These are all read as they are, with
+ * bounds, since the processes write them. Return how many were
+ * cleared. Called under NMA_LOCK.
+ */
+static u_int
+netmap_extra_unmark(struct netmap_mem_d *nmd, uint32_t *cand)
 {
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
-	u_int i = 0;	/* slot counter */
-	uint32_t pos = 0;	/* slot in p->bitmap */
-	uint32_t index = 0;	/* buffer index */
-
-	for (i = 0; i < n; i++) {
-		void *vaddr = netmap_buf_malloc(nmd, &pos, &index);
-		if (vaddr == NULL) {
-			nm_prerr("no more buffers after %d of %d", i, n);
-			goto cleanup;
+	struct netmap_obj_pool *rp = &nmd->pools[NETMAP_RING_POOL];
+	struct netmap_obj_pool *ip = &nmd->pools[NETMAP_IF_POOL];
+	u_int i, j, n, max, cleared = 0;
+	uint32_t b;
+
+#define NM_XUNMARK(b) do {						\
+	if ((b) < p->objtotal &&					\
+	    (cand[(b) >> 5] & (1U << ((b) & 31U)))) {			\
+		cand[(b) >> 5] &= ~(1U << ((b) & 31U));			\
+		cleared++;						\
+	}								\
+} while (0)
+
+	max = (rp->_objsize - sizeof(struct netmap_ring)) /
+		sizeof(struct netmap_slot);
+	for (i = 0; i < rp->objtotal; i++) {
+		struct netmap_ring *ring;
+
+		if (rp->bitmap[i >> 5] & (1U << (i & 31U)))
+			continue; /* free */
+		ring = rp->lut[i].vaddr;
+		n = ring->num_slots;
+		if (n > max)
+			n = max;
+		for (j = 0; j < n; j++) {
+			b = ring->slot[j].buf_idx;
+			NM_XUNMARK(b);
 		}
-		slot[i].buf_idx = index;
-		slot[i].len = p->_objsize;
-		slot[i].flags = 0;
-		slot[i].ptr = 0;
 	}
+	for (i = 0; i < ip->objtotal; i++) {
+		struct netmap_if *nifp;
 
-	nm_prdis("%s: allocated %d buffers, %d available, first at %d", p->name, n, p->objfree, pos);
-	return (0);
-
-cleanup:
-	while (i > 0) {
-		i--;
-		netmap_obj_free(p, slot[i].buf_idx);
+		if (ip->bitmap[i >> 5] & (1U << (i & 31U)))
+			continue;
+		nifp = ip->lut[i].vaddr;
+		b = nifp->ni_bufs_head;
+		for (j = 0; j < p->objtotal && b >= 2 && b < p->objtotal; j++) {
+			NM_XUNMARK(b);
+			b = *(uint32_t *)p->lut[b].vaddr;
+		}
 	}
-	bzero(slot, n * sizeof(slot[0]));
-	return (ENOMEM);
+	if (nmd->nm_bufrefs != NULL) {
+		mtx_lock(&nmd->nm_share_lock);
+		b = nmd->nm_spare;
+		for (j = 0; j < nmd->nm_nspare && b >= 2 && b < p->objtotal;
+				j++) {
+			NM_XUNMARK(b);
+			b = *(uint32_t *)p->lut[b].vaddr;
+		}
+		mtx_unlock(&nmd->nm_share_lock);
+	}
+#undef NM_XUNMARK
+	return cleared;
 }
 
-static void
-netmap_mem_set_ring(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n, uint32_t index)
+/*
+ * Free the extra buffers given to 'owner' (netmap_extra_alloc()) that
+ * it has not given back, and that nobody holds: they never went back
+ * to the pool (which clears xowner), and are not found by
+ * netmap_extra_unmark(). Buffers move from slot to slot under our
+ * feet (pipes, monitors and VALE ports swap them), so the holders are
+ * looked at twice, and a buffer is only freed if both looks missed
+ * it. A buffer that went to another process through a shared ring
+ * must be back in a ring or in an extra buffer list by the time its
+ * owner closes. Return how many were freed. Called under NMA_LOCK.
+ */
+static u_int
+netmap_extra_reclaim(struct netmap_mem_d *nmd, uint32_t owner)
 {
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
-	u_int i;
+	uint32_t *cand;
+	u_int i, n = 0, look;
 
-	for (i = 0; i < n; i++) {
-		slot[i].buf_idx = index;
-		slot[i].len = p->_objsize;
-		slot[i].flags = 0;
+	if (owner == 0 || p->xowner == NULL)
+		return 0;
+	cand = nm_os_malloc(sizeof(*cand) * p->bitmap_slots);
+	if (cand == NULL)
+		return 0;
+	for (i = 2; i < p->objtotal; i++) {
+		if (p->xowner[i] != owner ||
+		    (p->bitmap[i >> 5] & (1U << (i & 31U))))
+			continue;
+		cand[i >> 5] |= 1U << (i & 31U);
+		n++;
 	}
+	for (look = 0; look < 2 && n > 0; look++)
+		n -= netmap_extra_unmark(nmd, cand);
+	n = 0;
+	for (i = 2; i < p->objtotal; i++) {
+		/* also skip what has been freed meanwhile */
+		if ((cand[i >> 5] & (1U << (i & 31U))) &&
+		    p->xowner[i] == owner && netmap_obj_free(p, i) == 0)
+			n++;
+	}
+	nm_os_free(cand);
+	return n;
+}
+
+
+static inline void
+netmap_new_slot(struct netmap_obj_pool *p, struct netmap_slot *slot,
+		uint32_t index)
+{
+	slot->buf_idx = index;
+	slot->len = p->_objsize;
+	slot->flags = 0;
+	slot->ptr = 0;
 }
 
+static void netmap_free_bufs(struct netmap_mem_d *, struct netmap_slot *,
+		u_int);
+
+/*
+ * Fill n slots with new buffers, with netmap_mem_bufs_get().
+ * Must not be called with the allocator lock held.
+ * Return nonzero on error.
+ */
+static int
+netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t idx[NM_BUF_CACHE_BATCH];
+	u_int i = 0;	/* slot counter */
+	u_int k, want, got;
+
+	while (i < n) {
+		want = n - i < NM_BUF_CACHE_BATCH ? n - i : NM_BUF_CACHE_BATCH;
+		got = netmap_mem_bufs_get(nmd, idx, want);
+		for (k = 0; k < got; k++)
+			netmap_new_slot(p, &slot[i++], idx[k]);
+		if (got < want) {
+			nm_prerr("no more buffers after %d of %d", i, n);
+			goto cleanup;
+		}
+	}
+
+	nm_prdis("%s: allocated %d buffers, %d available", p->name, n, p->objfree);
+	return (0);
+
+cleanup:
+	netmap_free_bufs(nmd, slot, i);
+	bzero(slot, n * sizeof(slot[0]));
+	return (ENOMEM);
+}
 
 static void
-netmap_free_buf(struct netmap_mem_d *nmd, uint32_t i)
+netmap_mem_set_ring(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n, uint32_t index)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i;
+
+	for (i = 0; i < n; i++) {
+		slot[i].buf_idx = index;
+		slot[i].len = p->_objsize;
+		slot[i].flags = 0;
+	}
+}
+
+
+/* A slot lets go of buffer i. Return nonzero if i goes back to the pool. */
+static int
+netmap_unref_buf(struct netmap_mem_d *nmd, uint32_t i)
 {
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
 
 	if (i < 2 || i >= p->objtotal) {
 		nm_prerr("Cannot free buf#%d: should be in [2, %d[", i, p->objtotal);
-		return;
+		return 0;
+	}
+	if (unlikely(i < nmd->nm_nbufrefs && nmd->nm_bufrefs[i] != 0)) {
+		int last;
+
+		/* drop the reference of the slot, other slots may
+		 * still hold the buffer */
+		mtx_lock(&nmd->nm_share_lock);
+		last = nmd->nm_bufrefs[i] <= 1;
+		nmd->nm_bufrefs[i] = last ? 0 : nmd->nm_bufrefs[i] - 1;
+		mtx_unlock(&nmd->nm_share_lock);
+		return last;
 	}
-	netmap_obj_free(p, i);
+	return 1;
 }
 
-
+/*
+ * Release the buffers of n slots, with netmap_mem_bufs_put().
+ * Must not be called with the allocator lock held.
+ */
 static void
 netmap_free_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
 {
-	u_int i;
+	uint32_t idx[NM_BUF_CACHE_BATCH];
+	u_int i, m = 0;
 
 	for (i = 0; i < n; i++) {
-		if (slot[i].buf_idx > 1)
-			netmap_free_buf(nmd, slot[i].buf_idx);
+		if (slot[i].buf_idx < 2 ||
+		    !netmap_unref_buf(nmd, slot[i].buf_idx))
+			continue;
+		idx[m++] = slot[i].buf_idx;
+		if (m == NM_BUF_CACHE_BATCH) {
+			netmap_mem_bufs_put(nmd, idx, m);
+			m = 0;
+		}
 	}
+	if (m > 0)
+		netmap_mem_bufs_put(nmd, idx, m);
 	nm_prdis("%s: released some buffers, available: %u",
-			p->name, p->objfree);
+			nmd->pools[NETMAP_BUF_POOL].name,
+			nmd->pools[NETMAP_BUF_POOL].objfree);
 }
 
 static void
@@ -1270,6 +2026,10 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 	if (p->invalid_bitmap)
 		nm_os_free(p->invalid_bitmap);
 	p->invalid_bitmap = NULL;
+	if (p->bufcache)
+		nm_os_free(p->bufcache);
+	p->bufcache = NULL;
+	p->nbufcache = 0;
 	if (!p->alloc_done) {
 		/* allocation was done by somebody else.
 		 * Let them clean up after themselves.
@@ -1277,20 +2037,31 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 		return;
 	}
 	if (p->lut) {
-		u_int i;
+		u_int i = 0;
 
+		if (p->chunk) {
+			char *chunk = p->chunk;
+
+			contigfree(chunk, p->chunksize, M_NETMAP);
+			i = p->chunkobjs;
+		}
 		/*
 		 * Free each cluster allocated in
-		 * netmap_finalize_obj_allocator().  The cluster start
-		 * addresses are stored at multiples of p->_clusterentries
-		 * in the lut.
+		 * netmap_finalize_obj_allocator() or netmap_mem_expand().
+		 * The cluster start addresses are stored at multiples of
+		 * p->_clusterentries in the lut.
 		 */
-		for (i = 0; i < p->objtotal; i += p->_clustentries) {
+		for (; i < p->objtotal; i += p->_clustentries) {
 			contigfree(p->lut[i].vaddr, p->_clustsize, M_NETMAP);
 		}
-		nm_free_lut(p->lut, p->objtotal);
+		nm_free_lut(p->lut, p->lutsize);
 	}
+	p->chunk = NULL;
+	p->chunksize = 0;
+	p->chunkobjs = 0;
+	p->contig = 0;
 	p->lut = NULL;
+	p->lutsize = 0;
 	p->objtotal = 0;
 	p->memtotal = 0;
 	p->numclusters = 0;
@@ -1323,7 +2094,8 @@ netmap_destroy_obj_allocator(struct netmap_obj_pool *p)
 
 /* call with NMA_LOCK held */
 static int
-netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int objsize)
+netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal,
+		u_int objsize, int huge)
 {
 	int i;
 	u_int clustsize;	/* the cluster size, multiple of page size */
@@ -1335,6 +2107,7 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	p->r_objsize = objsize;
 
 #define MAX_CLUSTSIZE	(1<<22)		// 4 MB
+#define HUGE_CLUSTSIZE	(1<<21)		// 2 MB, the x86/arm64 large page
 #define LINE_ROUND	NM_BUF_ALIGN	// 64
 	if (objsize >= MAX_CLUSTSIZE) {
 		/* we could do it but there is no point */
@@ -1380,6 +2153,19 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	}
 	/* compute clustsize */
 	clustsize = clustentries * objsize;
+	/*
+	 * With huge clusters we fill a 2 MB frame with as many exact
+	 * solutions as possible, and allocate it 2 MB aligned so that
+	 * the whole cluster sits in a single large page. Pools that
+	 * would not fill one such frame keep the normal layout.
+	 */
+	p->_clustalign = PAGE_SIZE;
+	if (huge && clustsize <= HUGE_CLUSTSIZE &&
+	    (uint64_t)objtotal * objsize >= HUGE_CLUSTSIZE) {
+		clustentries *= HUGE_CLUSTSIZE / clustsize;
+		clustsize = clustentries * objsize;
+		p->_clustalign = HUGE_CLUSTSIZE;
+	}
 	if (netmap_debug & NM_DEBUG_MEM)
 		nm_prinf("objsize %d clustsize %d objects %d",
 			objsize, clustsize, clustentries);
@@ -1399,12 +2185,68 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	return 0;
 }
 
+/*
+ * Allocate a cluster aligned to 'align', preferably from NUMA node
+ * 'node' (if not -1). Clusters are released with contigfree(), as usual.
+ * On linux the pages come from the buddy allocator and are
+ * always aligned to their (power of two) size.
+ */
+static void *
+netmap_clust_alloc(size_t n, u_int align, int node)
+{
+#if defined(__FreeBSD__) && __FreeBSD_version >= 1200000
+	if (node >= 0 && node < vm_ndomains)
+		return contigmalloc_domainset(n, M_NETMAP, DOMAINSET_PREF(node),
+		    M_NOWAIT | M_ZERO, (size_t)0, -1UL, align, 0);
+#elif defined(linux)
+	if (node >= 0 && node < MAX_NUMNODES && node_online(node))
+		return contigmalloc_node(n, M_NETMAP, M_NOWAIT | M_ZERO,
+		    (size_t)0, -1UL, align, 0, node);
+#endif
+	(void)node;
+	return contigmalloc(n, M_NETMAP, M_NOWAIT | M_ZERO,
+	    (size_t)0, -1UL, align, 0);
+}
+
+/*
+ * Try to allocate all the clusters of p as a single chunk, no larger
+ * than max bytes. The chunk is physically contiguous, so the buffers
+ * of a pool allocated this way can be located with arithmetic (see
+ * NMB()) rather than with a load from the lut.
+ */
+static char *
+netmap_chunk_alloc(struct netmap_obj_pool *p, int node, size_t max)
+{
+	size_t n = (size_t)p->_numclusters * p->_clustsize;
+
+	if (n == 0 || n > max)
+		return NULL;
+#ifdef linux
+	/* the page allocator rounds up to a power of two, and warns
+	 * beyond its largest order */
+	if (roundup_pow_of_two(n) > KMALLOC_MAX_SIZE)
+		return NULL;
+	p->chunksize = roundup_pow_of_two(n);
+#else
+	p->chunksize = n;
+#endif
+	p->chunk = netmap_clust_alloc(n, p->_clustalign, node);
+	if (p->chunk == NULL) {
+		p->chunksize = 0;
+		return NULL;
+	}
+	p->chunkobjs = p->_objtotal;
+	return p->chunk;
+}
+
 /* call with NMA_LOCK held */
 static int
-netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
+netmap_finalize_obj_allocator(struct netmap_obj_pool *p, int node,
+		u_int grow_max, size_t contig_max)
 {
 	int i; /* must be signed */
 	size_t n;
+	char *chunk;
 
 	if (p->lut) {
 		/* if the lut is already there we assume that also all the
@@ -1422,7 +2264,11 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	p->objtotal = p->_objtotal;
 	p->alloc_done = 1;
 
-	p->lut = nm_alloc_lut(p->objtotal);
+	/* leave room in the lut for netmap_mem_expand() */
+	p->lutsize = p->objtotal + grow_max;
+	if (p->lutsize < p->objtotal)
+		p->lutsize = p->objtotal;
+	p->lut = nm_alloc_lut(p->lutsize);
 	if (p->lut == NULL) {
 		nm_prerr("Unable to create lookup table for '%s'", p->name);
 		goto clean;
@@ -1433,10 +2279,17 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	 */
 
 	n = p->_clustsize;
+	chunk = netmap_chunk_alloc(p, node, contig_max);
 	for (i = 0; i < (int)p->objtotal;) {
 		int lim = i + p->_clustentries;
 		char *clust;
 
+		if (chunk) {
+			clust = chunk;
+			chunk += n;
+			goto fill;
+		}
+
 		/*
 		 * XXX Note, we only need contigmalloc() for buffers attached
 		 * to native interfaces. In all other cases (nifp, netmap rings
@@ -1444,8 +2297,7 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		 * can live with standard malloc, because the hardware will not
 		 * access the pages directly.
 		 */
-		clust = contigmalloc(n, M_NETMAP, M_NOWAIT | M_ZERO,
-		    (size_t)0, -1UL, PAGE_SIZE, 0);
+		clust = netmap_clust_alloc(n, p->_clustalign, node);
 		if (clust == NULL) {
 			/*
 			 * If we get here, there is a severe memory shortage,
@@ -1468,6 +2320,7 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 			p->numclusters = (i + p->_clustentries - 1) / p->_clustentries;
 			break;
 		}
+	fill:
 		/*
 		 * Set lut state for all buffers in the current cluster.
 		 *
@@ -1486,10 +2339,28 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		}
 	}
 	p->memtotal = (size_t)p->numclusters * (size_t)p->_clustsize;
+	/* separate clusters may still happen to be adjacent */
+	for (p->contig = p->objtotal ? 1 : 0; p->contig < p->objtotal;
+	    p->contig++) {
+		char *va = (char *)p->lut[0].vaddr +
+			(size_t)p->contig * p->_objsize;
+
+		if (p->lut[p->contig].vaddr != va)
+			break;
+#if !defined(linux) && !defined(_WIN32)
+		if (p->lut[p->contig].paddr != p->lut[0].paddr +
+				(vm_paddr_t)p->contig * p->_objsize)
+			break;
+#endif
+	}
+	/* the room for netmap_mem_expand(), see netmap_mem2_get_lut() */
+	for (i = p->objtotal; p->objtotal > 0 && i < (int)p->lutsize; i++)
+		p->lut[i] = p->lut[0];
 	if (netmap_verbose)
-		nm_prinf("Pre-allocated %d clusters (%d/%zuKB) for '%s'",
+		nm_prinf("Pre-allocated %d clusters (%d/%zuKB) for '%s'%s",
 		    p->numclusters, p->_clustsize >> 10,
-		    p->memtotal >> 10, p->name);
+		    p->memtotal >> 10, p->name,
+		    p->contig == p->objtotal ? ", contiguous" : "");
 
 	return 0;
 
@@ -1521,16 +2392,143 @@ netmap_mem_reset_all(struct netmap_mem_d *nmd)
 
 	if (netmap_debug & NM_DEBUG_MEM)
 		nm_prinf("resetting %p", nmd);
+	/* the kept DMA maps point into the clusters we are freeing */
+	netmap_mem_dma_flush(nmd, NULL);
+	netmap_mem_bufrefs_free(nmd);
+	netmap_mem_xowner_free(nmd);
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		netmap_reset_obj_allocator(&nmd->pools[i]);
 	}
 	nmd->flags  &= ~NETMAP_MEM_FINALIZED;
+	nmd->nm_numa_node = -1;
+}
+
+#ifdef linux
+/* keep the DMA maps of unregistered adapters, for their next register */
+static int netmap_dma_cache = 1;
+SYSBEGIN(mem2_dma);
+SYSCTL_INT(_dev_netmap, OID_AUTO, dma_cache,
+    CTLFLAG_RW, &netmap_dma_cache, 0,
+    "Keep the DMA maps of NICs across registrations");
+SYSEND;
+
+/*
+ * Number of clusters, starting from cluster i, that netmap_mem_map()
+ * maps with a single call. Clusters that are adjacent in the kernel
+ * direct map (always the case for a pool allocated as a single chunk)
+ * are physically contiguous, and mapping them together takes one
+ * IOVA range and one IOMMU operation instead of one per cluster.
+ * The result only depends on the lut and on the device, so that
+ * netmap_mem_unmap() finds the same runs.
+ */
+static u_int
+netmap_mem_map_run(struct netmap_obj_pool *p, struct netmap_adapter *na,
+		u_int i)
+{
+	size_t max = dma_max_mapping_size((struct device *)na->pdev);
+	char *next = (char *)p->lut[i].vaddr + p->_clustsize;
+	size_t len = p->_clustsize;
+	u_int n = 1;
+
+	if (max > UINT_MAX)
+		max = UINT_MAX; /* netmap_load_map() takes a u_int */
+	for (i += p->_clustentries; i < p->objtotal;
+			i += p->_clustentries, n++) {
+		if (p->lut[i].vaddr != next || len + p->_clustsize > max)
+			break;
+		next += p->_clustsize;
+		len += p->_clustsize;
+	}
+	return n;
+}
+
+/*
+ * Called on the last unregister of na: park its DMA map in the
+ * allocator instead of tearing it down, so that an application that
+ * restarts does not pay for mapping the whole pool again (which can
+ * take seconds with an IOMMU). Maps of allocators that na only
+ * borrows for this registration are not kept.
+ */
+static int
+netmap_mem_dma_keep(struct netmap_mem_d *nmd, struct netmap_adapter *na)
+{
+	int i, slot = -1;
+
+	if (!netmap_dma_cache || na->pdev == NULL ||
+	    na->na_lut.plut == NULL || na->nm_mem != nmd ||
+	    na->nm_mem_prev != NULL)
+		return 0;
+	for (i = 0; i < NM_DMA_CACHE_MAX; i++) {
+		if (nmd->nm_dma_cache[i] == na)
+			return 1;
+		if (nmd->nm_dma_cache[i] == NULL && slot < 0)
+			slot = i;
+	}
+	if (slot < 0)
+		return 0;
+	nmd->nm_dma_cache[slot] = na;
+	return 1;
+}
+
+/* really unmap the kept maps, of na only or of all the adapters */
+static void
+netmap_mem_dma_flush(struct netmap_mem_d *nmd, struct netmap_adapter *na)
+{
+	int i;
+
+	for (i = 0; i < NM_DMA_CACHE_MAX; i++) {
+		struct netmap_adapter *cna = nmd->nm_dma_cache[i];
+
+		if (cna == NULL || (na != NULL && cna != na))
+			continue;
+		nmd->nm_dma_cache[i] = NULL;
+		netmap_mem_unmap(&nmd->pools[NETMAP_BUF_POOL], cna);
+	}
+}
+
+/* forget a kept map, because na is registering again */
+static void
+netmap_mem_dma_reuse(struct netmap_mem_d *nmd, struct netmap_adapter *na)
+{
+	int i;
+
+	for (i = 0; i < NM_DMA_CACHE_MAX; i++) {
+		if (nmd->nm_dma_cache[i] == na)
+			nmd->nm_dma_cache[i] = NULL;
+	}
+}
+#else /* !linux */
+static int
+netmap_mem_dma_keep(struct netmap_mem_d *nmd, struct netmap_adapter *na)
+{
+	return 0;
+}
+
+static void
+netmap_mem_dma_flush(struct netmap_mem_d *nmd, struct netmap_adapter *na)
+{
+}
+#endif /* linux */
+
+/*
+ * Release the DMA map kept for na, if any. Called when the device of
+ * na goes away and when na is destroyed.
+ */
+void
+netmap_mem_dma_forget(struct netmap_mem_d *nmd, struct netmap_adapter *na)
+{
+	if (nmd == NULL)
+		return;
+	NMA_LOCK(nmd);
+	netmap_mem_dma_flush(nmd, na);
+	NMA_UNLOCK(nmd);
 }
 
 static int
 netmap_mem_unmap(struct netmap_obj_pool *p, struct netmap_adapter *na)
 {
 	int i, lim = p->objtotal;
+	u_int n;
 	struct netmap_lut *lut;
 	if (na == NULL || na->pdev == NULL)
 		return 0;
@@ -1544,22 +2542,27 @@ netmap_mem_unmap(struct netmap_obj_pool *p, struct netmap_adapter *na)
 	 * and rxsync routine, packet by packet. */
 	(void)i;
 	(void)lim;
+	(void)n;
 	(void)lut;
 #elif defined(_WIN32)
 	(void)i;
 	(void)lim;
+	(void)n;
 	(void)lut;
 	nm_prerr("unsupported on Windows");
 #else /* linux */
 	nm_prdis("unmapping and freeing plut for %s", na->name);
 	if (lut->plut == NULL || na->pdev == NULL)
 		return 0;
-	for (i = 0; i < lim; i += p->_clustentries) {
+	for (i = 0; i < lim; i += n * p->_clustentries) {
+		n = netmap_mem_map_run(p, na, i);
 		if (lut->plut[i].paddr)
-			netmap_unload_map(na, (bus_dma_tag_t) na->pdev, &lut->plut[i].paddr, p->_clustsize);
+			netmap_unload_map(na, (bus_dma_tag_t) na->pdev,
+				&lut->plut[i].paddr, n * p->_clustsize);
 	}
 	nm_free_plut(lut->plut);
 	lut->plut = NULL;
+	na->nm_mem->nm_dmamaps--;
 #endif /* linux */
 
 	return 0;
@@ -1570,6 +2573,7 @@ netmap_mem_map(struct netmap_obj_pool *p, struct netmap_adapter *na)
 {
 	int error = 0;
 	int i, lim = p->objtotal;
+	u_int n;
 	struct netmap_lut *lut = &na->na_lut;
 
 	if (na->pdev == NULL)
@@ -1580,50 +2584,59 @@ netmap_mem_map(struct netmap_obj_pool *p, struct netmap_adapter *na)
 	 * and rxsync routine, packet by packet. */
 	(void)i;
 	(void)lim;
+	(void)n;
 	(void)lut;
 #elif defined(_WIN32)
 	(void)i;
 	(void)lim;
+	(void)n;
 	(void)lut;
 	nm_prerr("unsupported on Windows");
 #else /* linux */
 
 	if (lut->plut != NULL) {
+		/* still mapped, or kept since the last unregister */
 		nm_prdis("plut already allocated for %s", na->name);
+		netmap_mem_dma_reuse(na->nm_mem, na);
 		return 0;
 	}
 
 	nm_prdis("allocating physical lut for %s", na->name);
-	lut->plut = nm_alloc_plut(lim);
+	lut->plut = nm_alloc_plut(p->lutsize);
 	if (lut->plut == NULL) {
 		nm_prerr("Failed to allocate physical lut for %s", na->name);
 		return ENOMEM;
 	}
+	na->nm_mem->nm_dmamaps++;
 
 	for (i = 0; i < lim; i += p->_clustentries) {
 		lut->plut[i].paddr = 0;
 	}
 
-	for (i = 0; i < lim; i += p->_clustentries) {
+	for (i = 0; i < lim; i += n * p->_clustentries) {
 		int j;
 
+		n = netmap_mem_map_run(p, na, i);
 		if (p->lut[i].vaddr == NULL)
 			continue;
 
 		error = netmap_load_map(na, (bus_dma_tag_t) na->pdev, &lut->plut[i].paddr,
-				p->lut[i].vaddr, p->_clustsize);
+				p->lut[i].vaddr, n * p->_clustsize);
 		if (error) {
 			nm_prerr("Failed to map cluster #%d from the %s pool", i, p->name);
 			break;
 		}
 
-		for (j = 1; j < p->_clustentries; j++) {
+		for (j = 1; j < (int)(n * p->_clustentries) && i + j < lim; j++) {
 			lut->plut[i + j].paddr = lut->plut[i + j - 1].paddr + p->_objsize;
 		}
 	}
 
 	if (error)
 		netmap_mem_unmap(p, na);
+	else /* the room for netmap_mem_expand() maps to buffer 0 */
+		for (i = lim; i < (int)p->lutsize; i++)
+			lut->plut[i] = lut->plut[0];
 
 #endif /* linux */
 
@@ -1639,11 +2652,16 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 	nmd->lasterr = 0;
 	nmd->nm_totalsize = 0;
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
-		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i]);
+		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i],
+				nmd->nm_numa_node,
+				i == NETMAP_BUF_POOL ? nmd->nm_grow_max : 0,
+				i == NETMAP_BUF_POOL ? netmap_buf_contig_max : 0);
 		if (nmd->lasterr)
 			goto error;
 		nmd->nm_totalsize += nmd->pools[i].memtotal;
 	}
+	if (!nmd->pools[NETMAP_BUF_POOL].alloc_done)
+		nmd->nm_numa_node = -1; /* memory provided by the user */
 	nmd->nm_totalsize = (nmd->nm_totalsize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 	nmd->lasterr = netmap_mem_init_bitmaps(nmd);
 	if (nmd->lasterr)
@@ -1691,6 +2709,8 @@ _netmap_mem_private_new(size_t size, struct netmap_obj_params *p, int grp_id,
 
 	*d = nm_blueprint;
 	d->ops = ops;
+	d->nm_huge_req = netmap_priv_huge_clusters;
+	d->nm_grow_max = netmap_priv_buf_grow_max;
 
 	err = nm_mem_assign_id(d, grp_id);
 	if (err)
@@ -1751,7 +2771,7 @@ error:
 
 struct netmap_mem_d *
 netmap_mem_private_new(u_int txr, u_int txd, u_int rxr, u_int rxd,
-		u_int extra_bufs, u_int npipes, int *perr)
+		u_int extra_bufs, u_int npipes, u_int buf_size, int *perr)
 {
 	struct netmap_mem_d *d = NULL;
 	struct netmap_obj_params p[NETMAP_POOLS_NR];
@@ -1792,6 +2812,9 @@ netmap_mem_private_new(u_int txr, u_int txd, u_int rxr, u_int rxd,
 		/* the +2 is for the tx and rx fake buffers (indices 0 and 1) */
 	if (p[NETMAP_BUF_POOL].num < v)
 		p[NETMAP_BUF_POOL].num = v;
+	/* the caller may want a different buffer size (0 for the default) */
+	if (buf_size)
+		p[NETMAP_BUF_POOL].size = buf_size;
 
 	if (netmap_verbose)
 		nm_prinf("req if %d*%d ring %d*%d buf %d*%d",
@@ -1868,8 +2891,10 @@ netmap_mem2_config(struct netmap_mem_d *nmd)
 {
 	int i;
 
-	if (!netmap_mem_params_changed(nmd->params))
+	if (!netmap_mem_params_changed(nmd->params) &&
+	    nmd->nm_huge == nmd->nm_huge_req)
 		goto out;
+	nmd->nm_huge = nmd->nm_huge_req;
 
 	nm_prdis("reconfiguring");
 
@@ -1883,7 +2908,8 @@ netmap_mem2_config(struct netmap_mem_d *nmd)
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		nmd->lasterr = netmap_config_obj_allocator(&nmd->pools[i],
-				nmd->params[i].num, nmd->params[i].size);
+				nmd->params[i].num, nmd->params[i].size,
+				nmd->nm_huge);
 		if (nmd->lasterr)
 			goto out;
 	}
@@ -1899,6 +2925,14 @@ netmap_mem2_finalize(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 	if (nmd->flags & NETMAP_MEM_FINALIZED)
 		goto out;
 
+	/* place the pools on the requested node, or close to the
+	 * NIC that first uses them.
+	 */
+	nmd->nm_numa_node = nmd->nm_numa_hint != NETMAP_MEM_NUMA_NOHINT ?
+		nmd->nm_numa_hint : nmd->nm_numa_req;
+	if (nmd->nm_numa_node < 0 && na != NULL && na->ifp != NULL)
+		nmd->nm_numa_node = nm_os_ifnet_numa_node(na->ifp);
+
 	if (netmap_mem_finalize_all(nmd))
 		goto out;
 
@@ -1913,6 +2947,8 @@ netmap_mem2_delete(struct netmap_mem_d *nmd)
 {
 	int i;
 
+	netmap_mem_bufrefs_free(nmd);
+	netmap_mem_xowner_free(nmd);
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 	    netmap_destroy_obj_allocator(&nmd->pools[i]);
 	}
@@ -1964,7 +3000,7 @@ netmap_mem_ring_todelete(struct netmap_kring *kring)
 }
 
 
-/* call with NMA_LOCK held *
+/* call with NMA_LOCK held (dropped while filling the rings) *
  *
  * Allocate netmap rings and buffers for this card
  * The rings are contiguous, but have variable size.
@@ -2005,8 +3041,7 @@ netmap_mem2_rings_create(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 			kring->ring = ring;
 			*(uint32_t *)(uintptr_t)&ring->num_slots = ndesc;
 			*(int64_t *)(uintptr_t)&ring->buf_ofs =
-			    (nmd->pools[NETMAP_IF_POOL].memtotal +
-				nmd->pools[NETMAP_RING_POOL].memtotal) -
+			    netmap_mem_bufs_offset(nmd) -
 				netmap_ring_offset(nmd, ring);
 
 			/* copy values from kring */
@@ -2020,9 +3055,19 @@ netmap_mem2_rings_create(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 			nm_prdis("initializing slots for %s_ring", nm_txrx2str(t));
 			if (!(kring->nr_kflags & NKR_FAKERING)) {
 				/* this is a real ring */
+				int error;
+
 				if (netmap_debug & NM_DEBUG_MEM)
 					nm_prinf("allocating buffers for %s", kring->name);
-				if (netmap_new_bufs(nmd, ring->slot, ndesc)) {
+				/* the buffers come from the per-CPU caches,
+				 * which only take the lock to refill. The
+				 * rings are not visible to anybody else yet,
+				 * and NMG_LOCK serializes their creation.
+				 */
+				NMA_UNLOCK(nmd);
+				error = netmap_new_bufs(nmd, ring->slot, ndesc);
+				NMA_LOCK(nmd);
+				if (error) {
 					nm_prerr("Cannot allocate buffers for %s_ring", nm_txrx2str(t));
 					goto cleanup;
 				}
@@ -2071,7 +3116,10 @@ netmap_mem2_rings_delete(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 				nm_prinf("deleting ring %s", kring->name);
 			if (!(kring->nr_kflags & NKR_FAKERING)) {
 				nm_prdis("freeing bufs for %s", kring->name);
+				/* as in netmap_mem2_rings_create() */
+				NMA_UNLOCK(nmd);
 				netmap_free_bufs(nmd, ring->slot, kring->nkr_num_slots);
+				NMA_LOCK(nmd);
 			} else {
 				nm_prdis("NOT freeing bufs for %s", kring->name);
 			}
@@ -2122,6 +3170,7 @@ netmap_mem2_if_new(struct netmap_mem_d *nmd,
 		(na->num_host_tx_rings ? na->num_host_tx_rings : 1);
 	*(u_int *)(uintptr_t)&nifp->ni_host_rx_rings =
 		(na->num_host_rx_rings ? na->num_host_rx_rings : 1);
+	*(uint64_t *)(uintptr_t)&nifp->ni_memsize = nmd->nm_totalsize;
 	strlcpy(nifp->ni_name, na->name, sizeof(nifp->ni_name));
 
 	/*
@@ -2160,13 +3209,28 @@ netmap_mem2_if_new(struct netmap_mem_d *nmd,
 
 static void
 netmap_mem2_if_delete(struct netmap_mem_d *nmd,
-		struct netmap_adapter *na, struct netmap_if *nifp)
+		struct netmap_adapter *na, struct netmap_if *nifp,
+		struct netmap_priv_d *priv)
 {
+	u_int nextra = priv ? priv->np_extra_bufs : 0, back = 0, n;
+
 	if (nifp == NULL)
 		/* nothing to do */
 		return;
 	if (nifp->ni_bufs_head)
-		netmap_extra_free(na, nifp->ni_bufs_head);
+		back = netmap_extra_free(na, nifp->ni_bufs_head);
+	netmap_extra_put(nmd, nextra, back);
+	if (back < nextra) {
+		/* the list is gone, do not look at it again */
+		nifp->ni_bufs_head = 0;
+		n = netmap_extra_reclaim(nmd, priv->np_extra_owner);
+		if (n > nmd->nm_xleaked)
+			n = nmd->nm_xleaked;
+		nmd->nm_xleaked -= n;
+		nmd->nm_xreclaimed += n;
+		if (n > 0 && netmap_verbose)
+			nm_prinf("%s: reclaimed %u extra buffers", na->name, n);
+	}
 	netmap_if_free(nmd, nifp);
 }
 
@@ -2215,21 +3279,237 @@ netmap_mem_pools_info_get(struct nmreq_pools_info *req,
 	req->nr_ring_pool_objtotal = nmd->pools[NETMAP_RING_POOL].objtotal;
 	req->nr_ring_pool_objsize = nmd->pools[NETMAP_RING_POOL]._objsize;
 
-	req->nr_buf_pool_offset = nmd->pools[NETMAP_IF_POOL].memtotal +
-			     nmd->pools[NETMAP_RING_POOL].memtotal;
+	req->nr_buf_pool_offset = netmap_mem_bufs_offset(nmd);
 	req->nr_buf_pool_objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
 	req->nr_buf_pool_objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
+	req->nr_numa_node = nmd->nm_numa_node;
 	NMA_UNLOCK(nmd);
 
 	return 0;
 }
 
+static void
+netmap_pool_stats(struct netmap_obj_pool *p, struct nmreq_pool_stats *s)
+{
+	s->nr_objtotal = p->objtotal;
+	s->nr_free = p->objfree;
+	s->nr_inuse = p->objtotal - p->objfree;
+	s->nr_max_inuse = p->objmaxused;
+}
+
+int
+netmap_mem_pools_stats_get(struct nmreq_pools_stats *req,
+				struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i, cached = 0;
+	int ret;
+
+	ret = netmap_mem_get_info(nmd, NULL, NULL, &req->nr_mem_id);
+	if (ret)
+		return ret;
+
+	NMA_LOCK(nmd);
+	netmap_pool_stats(&nmd->pools[NETMAP_IF_POOL], &req->nr_if);
+	netmap_pool_stats(&nmd->pools[NETMAP_RING_POOL], &req->nr_ring);
+	netmap_pool_stats(p, &req->nr_buf);
+	/* the caches change under our feet, this is only a snapshot */
+	for (i = 0; i < p->nbufcache; i++)
+		cached += p->bufcache[i].n;
+	if (cached > req->nr_buf.nr_inuse)
+		cached = req->nr_buf.nr_inuse;
+	req->nr_buf.nr_inuse -= cached;
+	req->nr_buf.nr_free += cached;
+	req->nr_buf_cached = cached;
+	req->nr_extra_holders = nmd->nm_xholders;
+	req->nr_extra_leaked = nmd->nm_xleaked_tot;
+	req->nr_extra_reclaimed = nmd->nm_xreclaimed;
+	NMA_UNLOCK(nmd);
+
+	return 0;
+}
+
+/*
+ * Tell the processes using nmd about its current size, through the
+ * ni_memsize of all the netmap_if in use (a zero in the bitmap).
+ * Called with NMA_LOCK held.
+ */
+static void
+netmap_mem_if_set_memsize(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_IF_POOL];
+	u_int i;
+
+	for (i = 0; i < p->objtotal; i++) {
+		struct netmap_if *nifp;
+
+		if (p->bitmap[i >> 5] & (1U << (i & 31U)))
+			continue;
+		nifp = p->lut[i].vaddr;
+		*(uint64_t *)(uintptr_t)&nifp->ni_memsize = nmd->nm_totalsize;
+	}
+}
+
+/*
+ * Append at least nbufs buffers (whole clusters) to the buffer pool
+ * of nmd, which the caller has finalized. The lut was allocated at
+ * finalize time with room for nm_grow_max more entries, so the new
+ * ones are filled in place and the pools stay allocated, grown, for
+ * the next users.
+ * The ports already registered keep running: the copies of the lut
+ * in their adapters cover the whole room (see netmap_mem2_get_lut()),
+ * where the new entries are written before the buffers are published
+ * in the bitmap, under the lock that any allocation takes. Their
+ * processes learn about the new size from ni_memsize in each
+ * netmap_if, and must mmap() the region again to reach the new
+ * buffers.
+ * On linux the new clusters cannot be added to the DMA maps of the
+ * NICs, so we refuse to expand an allocator they still map.
+ */
+int
+netmap_mem_expand(struct netmap_mem_d *nmd, u_int nbufs)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i, lim, objtotal, slots;
+	uint32_t *bitmap;
+	size_t added;
+	int error = 0;
+
+	NMA_LOCK(nmd);
+	if (nmd->ops != &netmap_mem_global_ops ||
+	    !(nmd->flags & NETMAP_MEM_FINALIZED) || !p->alloc_done ||
+	    p->objtotal % p->_clustentries) {
+		/* not ours, or shrunk in the middle of a cluster */
+		error = EINVAL;
+		goto out;
+	}
+	netmap_mem_dma_flush(nmd, NULL);
+	if (nmd->nm_dmamaps > 0) {
+		error = EBUSY;
+		goto out;
+	}
+	if (nbufs == 0 || nbufs > p->lutsize - p->objtotal) {
+		error = ENOSPC;
+		goto out;
+	}
+	lim = (nbufs + p->_clustentries - 1) / p->_clustentries;
+	objtotal = p->objtotal + lim * p->_clustentries;
+	if (objtotal > p->lutsize)
+		objtotal -= p->_clustentries; /* partial cluster, round down */
+	if (objtotal == p->objtotal) {
+		error = ENOSPC;
+		goto out;
+	}
+
+	slots = (objtotal + 31) / 32;
+	bitmap = nm_os_malloc(sizeof(bitmap[0]) * slots);
+	if (bitmap == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	memcpy(bitmap, p->bitmap, sizeof(bitmap[0]) * p->bitmap_slots);
+
+	for (i = p->objtotal; i < objtotal; ) {
+		char *clust = netmap_clust_alloc(p->_clustsize,
+				p->_clustalign, nmd->nm_numa_node);
+
+		if (clust == NULL) {
+			nm_prerr("Unable to create cluster at %d for '%s' allocator",
+			    i, p->name);
+			break;
+		}
+		for (lim = i + p->_clustentries; i < lim;
+				i++, clust += p->_objsize) {
+			p->lut[i].vaddr = clust;
+#if !defined(linux) && !defined(_WIN32)
+			p->lut[i].paddr = vtophys(clust);
+#endif
+			bitmap[i >> 5] |= (1U << (i & 31U));
+		}
+	}
+	if (i == p->objtotal) {
+		nm_os_free(bitmap);
+		error = ENOMEM;
+		goto out;
+	}
+
+	added = (size_t)(i - p->objtotal) / p->_clustentries * p->_clustsize;
+	nm_os_free(p->bitmap);
+	p->bitmap = bitmap;
+	p->bitmap_slots = slots;
+	p->objfree += i - p->objtotal;
+	p->numclusters += (i - p->objtotal) / p->_clustentries;
+	p->objtotal = i;
+	p->memtotal += added;
+	nmd->nm_totalsize += added;
+	netmap_mem_if_set_memsize(nmd);
+	if (netmap_verbose)
+		nm_prinf("%s: grown to %u objects (%zuKB)", p->name,
+		    p->objtotal, p->memtotal >> 10);
+out:
+	NMA_UNLOCK(nmd);
+	return error;
+}
+
+/*
+ * Set the NUMA node for the pools of nmd (-1: the one of the NIC),
+ * if they are allocated before the hint is withdrawn by passing
+ * NETMAP_MEM_NUMA_NOHINT. Ignored if the pools are already there.
+ * The hint is kept apart from nm_numa_req, which is the setting of
+ * the administrator (dev.netmap.numa_node) for the global allocator.
+ */
+void
+netmap_mem_numa_hint(struct netmap_mem_d *nmd, int node)
+{
+	NMA_LOCK(nmd);
+	if (node == NETMAP_MEM_NUMA_NOHINT)
+		nmd->nm_numa_hint = node;
+	else if (!(nmd->flags & NETMAP_MEM_FINALIZED))
+		nmd->nm_numa_hint = node < 0 ? -1 : node;
+	NMA_UNLOCK(nmd);
+}
+
+int
+netmap_mem_numa_node(struct netmap_mem_d *nmd)
+{
+	int node;
+
+	NMA_LOCK(nmd);
+	node = nmd->nm_numa_node;
+	NMA_UNLOCK(nmd);
+
+	return node;
+}
+
 #ifdef WITH_EXTMEM
+/*
+ * A buffer pool in user memory shared by the external allocators of
+ * several processes (NETMAP_REQ_OPT_EXTMEM_BUFS). The lut is built
+ * once, so a buffer index means the same in all of them. Each
+ * allocator owns a share of the buffers ('own' in netmap_mem_ext),
+ * 'avail' has a bit set for each buffer that nobody owns.
+ * Protected by nm_mem_ext_list_lock.
+ */
+struct netmap_mem_ext_bufs {
+	struct nm_os_extmem *os;
+	struct netmap_obj_pool pool;	/* lut and layout of the buffers */
+	uint32_t *avail;
+	u_int navail;
+	int refcount;
+	struct netmap_mem_ext_bufs *next;
+};
+
+static struct netmap_mem_ext_bufs *netmap_mem_ext_bufs_list = NULL;
+
 struct netmap_mem_ext {
 	struct netmap_mem_d up;
 
 	struct nm_os_extmem *os;
 	struct netmap_mem_ext *next, *prev;
+
+	/* only with NETMAP_MEM_EXTBUFS */
+	struct netmap_mem_ext_bufs *bufs;
+	uint32_t *own;		/* our share, valid while not in use */
 };
 
 /* call with nm_mem_list_lock held */
@@ -2274,6 +3554,305 @@ netmap_mem_ext_search(struct nm_os_extmem *os)
 	return e;
 }
 
+/*
+ * Lay out the objects of pool p (o->num at most, o->size each) in the
+ * user pages of os, starting at *pclust. Objects that would straddle
+ * two non contiguous pages are marked invalid.
+ */
+static int
+netmap_mem_ext_layout(struct nm_os_extmem *os, struct netmap_obj_pool *p,
+		struct netmap_obj_params *o, char **pclust, int *pnr_pages)
+{
+	char *clust = *pclust;
+	int nr_pages = *pnr_pages;
+	size_t off = 0;
+	int j;
+
+	p->_objsize = o->size;
+	p->_clustsize = o->size;
+	p->_clustentries = 1;
+
+	p->lut = nm_alloc_lut(o->num);
+	p->lutsize = o->num;
+	if (p->lut == NULL)
+		return ENOMEM;
+
+	p->bitmap_slots = (o->num + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+	p->invalid_bitmap = nm_os_malloc(sizeof(uint32_t) * p->bitmap_slots);
+	if (p->invalid_bitmap == NULL)
+		return ENOMEM;
+
+	if (nr_pages == 0) {
+		p->objtotal = 0;
+		p->memtotal = 0;
+		p->objfree = 0;
+		return 0;
+	}
+
+	for (j = 0; j < o->num && nr_pages > 0; j++) {
+		size_t noff;
+
+		p->lut[j].vaddr = clust + off;
+#if !defined(linux) && !defined(_WIN32)
+		p->lut[j].paddr = vtophys(p->lut[j].vaddr);
+#endif
+		nm_prdis("%s %d at %p", p->name, j, p->lut[j].vaddr);
+		noff = off + p->_objsize;
+		if (noff < PAGE_SIZE) {
+			off = noff;
+			continue;
+		}
+		nm_prdis("too big, recomputing offset...");
+		while (noff >= PAGE_SIZE) {
+			char *old_clust = clust;
+			noff -= PAGE_SIZE;
+			clust = nm_os_extmem_nextpage(os);
+			nr_pages--;
+			nm_prdis("noff %zu page %p nr_pages %d", noff,
+					page_to_virt(*pages), nr_pages);
+			if (noff > 0 && !nm_isset(p->invalid_bitmap, j) &&
+				(nr_pages == 0 ||
+				 old_clust + PAGE_SIZE != clust))
+			{
+				/* out of space or non contiguous,
+				 * drop this object
+				 * */
+				p->invalid_bitmap[ (j>>5) ] |= 1U << (j & 31U);
+				nm_prdis("non contiguous at off %zu, drop", noff);
+			}
+			if (nr_pages == 0)
+				break;
+		}
+		off = noff;
+	}
+	p->objtotal = j;
+	p->numclusters = p->objtotal;
+	p->memtotal = j * (size_t)p->_objsize;
+	if (p->memtotal & (PAGE_SIZE - 1)) {
+		// make sure that the objects of the next pool start page-aligned
+		p->memtotal = (p->memtotal & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+		if (nr_pages > 0) {
+			clust = nm_os_extmem_nextpage(os);
+			nr_pages--;
+		}
+	}
+	nm_prdis("%d memtotal %zu", j, p->memtotal);
+	*pclust = clust;
+	*pnr_pages = nr_pages;
+	return 0;
+}
+
+static void
+netmap_mem_ext_bufs_free(struct netmap_mem_ext_bufs *b)
+{
+	if (b->pool.lut)
+		nm_free_lut(b->pool.lut, b->pool.lutsize);
+	if (b->pool.invalid_bitmap)
+		nm_os_free(b->pool.invalid_bitmap);
+	if (b->avail)
+		nm_os_free(b->avail);
+	if (b->os)
+		nm_os_extmem_delete(b->os);
+	nm_os_free(b);
+}
+
+/*
+ * Find the shared buffer pool in the user memory described by 'bo',
+ * or lay out a new one, and give 'e' a share of its buffers.
+ */
+static int
+netmap_mem_ext_bufs_attach(struct netmap_mem_ext *e,
+		struct nmreq_opt_extmem_bufs *bo)
+{
+	struct nmreq_pools_info pi;
+	struct netmap_mem_ext_bufs *b;
+	struct nm_os_extmem *os;
+	u_int i, n, want, slots;
+	int error = 0;
+
+	memset(&pi, 0, sizeof(pi));
+	pi.nr_memsize = bo->nro_memsize;
+	os = nm_os_extmem_create(bo->nro_usrptr, &pi, &error);
+	if (os == NULL)
+		return error ? error : EINVAL;
+
+	NM_MTX_LOCK(nm_mem_ext_list_lock);
+	for (b = netmap_mem_ext_bufs_list; b; b = b->next) {
+		if (nm_os_extmem_isequal(b->os, os))
+			break;
+	}
+	if (b != NULL) {
+		/* the pool keeps the pages pinned by the first user */
+		nm_os_extmem_delete(os);
+		if (bo->nro_buf_size && bo->nro_buf_size != b->pool._objsize) {
+			error = EINVAL;
+			goto out;
+		}
+	} else {
+		struct netmap_obj_params o;
+		char *clust;
+		int nr_pages;
+
+		o.size = bo->nro_buf_size ? bo->nro_buf_size :
+			netmap_min_priv_params[NETMAP_BUF_POOL].size;
+		if (o.size < 64 || o.size > 65536) {
+			nm_os_extmem_delete(os);
+			error = EINVAL;
+			goto out;
+		}
+		o.num = bo->nro_memsize / o.size;
+		b = nm_os_malloc(sizeof(*b));
+		if (b == NULL) {
+			nm_os_extmem_delete(os);
+			error = ENOMEM;
+			goto out;
+		}
+		b->os = os;
+		snprintf(b->pool.name, sizeof(b->pool.name), "extbufs");
+		nr_pages = nm_os_extmem_nr_pages(os);
+		clust = nm_os_extmem_nextpage(os);
+		error = netmap_mem_ext_layout(os, &b->pool, &o, &clust,
+				&nr_pages);
+		if (!error) {
+			slots = (b->pool.objtotal + 31) / 32;
+			b->avail = nm_os_malloc(sizeof(uint32_t) * slots);
+			if (b->avail == NULL)
+				error = ENOMEM;
+		}
+		if (error) {
+			netmap_mem_ext_bufs_free(b);
+			goto out;
+		}
+		/* buffers 0 and 1 are reserved in every allocator */
+		for (i = 2; i < b->pool.objtotal; i++) {
+			if (nm_isset(b->pool.invalid_bitmap, i))
+				continue;
+			b->avail[i >> 5] |= 1U << (i & 31U);
+			b->navail++;
+		}
+		b->next = netmap_mem_ext_bufs_list;
+		netmap_mem_ext_bufs_list = b;
+	}
+
+	/* take our share */
+	slots = (b->pool.objtotal + 31) / 32;
+	e->own = nm_os_malloc(sizeof(uint32_t) * slots);
+	if (e->own == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	want = bo->nro_buf_num ? bo->nro_buf_num :
+		netmap_min_priv_params[NETMAP_BUF_POOL].num;
+	for (i = 2, n = 0; i < b->pool.objtotal && n < want; i++) {
+		if (nm_isset(b->avail, i)) {
+			b->avail[i >> 5] &= ~(1U << (i & 31U));
+			e->own[i >> 5] |= 1U << (i & 31U);
+			n++;
+		}
+	}
+	b->navail -= n;
+	if (n == 0) {
+		error = ENOMEM;
+		goto out;
+	}
+	b->refcount++;
+	e->bufs = b;
+	bo->nro_buf_size = b->pool._objsize;
+	bo->nro_buf_total = b->pool.objtotal;
+	bo->nro_buf_num = n;
+out:
+	if (error && b != NULL && b->refcount == 0) {
+		/* we just created it */
+		netmap_mem_ext_bufs_list = b->next;
+		netmap_mem_ext_bufs_free(b);
+	}
+	NM_MTX_UNLOCK(nm_mem_ext_list_lock);
+	if (error && e->own != NULL) {
+		nm_os_free(e->own);
+		e->own = NULL;
+	}
+	return error;
+}
+
+/* give our share back to the shared pool */
+static void
+netmap_mem_ext_bufs_detach(struct netmap_mem_ext *e)
+{
+	struct netmap_mem_ext_bufs *b = e->bufs, **pb;
+	u_int i;
+
+	NM_MTX_LOCK(nm_mem_ext_list_lock);
+	for (i = 0; i < (b->pool.objtotal + 31) / 32; i++) {
+		b->avail[i] |= e->own[i];
+		b->navail += nm_bitcount(e->own[i]);
+	}
+	if (--b->refcount == 0) {
+		for (pb = &netmap_mem_ext_bufs_list; *pb != b;
+				pb = &(*pb)->next)
+			;
+		*pb = b->next;
+		netmap_mem_ext_bufs_free(b);
+	}
+	NM_MTX_UNLOCK(nm_mem_ext_list_lock);
+	nm_os_free(e->own);
+	e->own = NULL;
+	e->bufs = NULL;
+}
+
+/*
+ * Called with the allocator lock held when the last user goes away:
+ * our share is whatever we have free now, in the bitmap or in the
+ * per-CPU caches, since swaps with other allocators may have changed
+ * the buffers we hold (one for one).
+ */
+static void
+netmap_mem_ext_bufs_save(struct netmap_mem_d *nmd)
+{
+	struct netmap_mem_ext *e = (struct netmap_mem_ext *)nmd;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i, j;
+
+	if (p->bitmap == NULL)
+		return;	/* never finalized, the share is unchanged */
+	memcpy(e->own, p->bitmap, sizeof(uint32_t) * ((p->objtotal + 31) / 32));
+	for (i = 0; i < p->nbufcache; i++) {
+		struct netmap_buf_cache *c = &p->bufcache[i];
+
+		for (j = 0; j < c->n; j++)
+			e->own[c->idx[j] >> 5] |= 1U << (c->idx[j] & 31U);
+	}
+	e->own[0] &= ~3U;
+}
+
+/* restrict the free buffers of the allocator to our share */
+static void
+netmap_mem_ext_bufs_restore(struct netmap_mem_d *nmd)
+{
+	struct netmap_mem_ext *e = (struct netmap_mem_ext *)nmd;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i;
+
+	p->objfree = 0;
+	for (i = 0; i < (p->objtotal + 31) / 32; i++) {
+		p->bitmap[i] &= e->own[i];
+		p->objfree += nm_bitcount(p->bitmap[i]);
+	}
+}
+
+/*
+ * True if buffers can be moved between the slots of the two
+ * allocators, i.e., if they are the same or share the buffer pool.
+ */
+int
+netmap_mem_bufs_shared(struct netmap_mem_d *a, struct netmap_mem_d *b)
+{
+	if (a == b)
+		return 1;
+	return (a->flags & NETMAP_MEM_EXTBUFS) &&
+		(b->flags & NETMAP_MEM_EXTBUFS) &&
+		((struct netmap_mem_ext *)a)->bufs ==
+			((struct netmap_mem_ext *)b)->bufs;
+}
 
 static void
 netmap_mem_ext_delete(struct netmap_mem_d *d)
@@ -2284,6 +3863,11 @@ netmap_mem_ext_delete(struct netmap_mem_d *d)
 
 	netmap_mem_ext_unregister(e);
 
+	if (e->bufs) {
+		/* the lut belongs to the shared pool */
+		d->pools[NETMAP_BUF_POOL].lut = NULL;
+		netmap_mem_ext_bufs_detach(e);
+	}
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		struct netmap_obj_pool *p = &d->pools[i];
 
@@ -2318,14 +3902,19 @@ struct netmap_mem_ops netmap_mem_ext_ops = {
 	.nmd_rings_delete = netmap_mem2_rings_delete
 };
 
+/*
+ * Create an allocator in the user memory at usrptr. With 'bo', the
+ * buffers come from the shared pool it describes, and the user memory
+ * only holds the netmap_if and ring pools.
+ */
 struct netmap_mem_d *
-netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi, int *perror)
+netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi,
+		struct nmreq_opt_extmem_bufs *bo, int *perror)
 {
 	int error = 0;
-	int i, j;
+	int i;
 	struct netmap_mem_ext *nme;
 	char *clust;
-	size_t off;
 	struct nm_os_extmem *os = NULL;
 	int nr_pages;
 
@@ -2357,6 +3946,17 @@ netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi, int *perror)
 	nme = netmap_mem_ext_search(os);
 	if (nme) {
 		nm_os_extmem_delete(os);
+		if ((bo != NULL) != (nme->bufs != NULL)) {
+			/* same memory, used in a different way */
+			netmap_mem_put(&nme->up);
+			error = EINVAL;
+			goto out;
+		}
+		if (bo != NULL) {
+			/* report what the allocator already has */
+			bo->nro_buf_size = nme->bufs->pool._objsize;
+			bo->nro_buf_total = nme->bufs->pool.objtotal;
+		}
 		return &nme->up;
 	}
 	if (netmap_verbose & NM_DEBUG_MEM)
@@ -2370,7 +3970,7 @@ netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi, int *perror)
 				{ pi->nr_buf_pool_objsize, pi->nr_buf_pool_objtotal }},
 			-1,
 			&netmap_mem_ext_ops,
-			pi->nr_memsize,
+			bo ? 0 : pi->nr_memsize,
 			&error);
 	if (nme == NULL)
 		goto out_unmap;
@@ -2388,80 +3988,43 @@ netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi, int *perror)
 		struct netmap_obj_pool *p = &nme->up.pools[i];
 		struct netmap_obj_params *o = &nme->up.params[i];
 
-		off = 0;
+		if (i == NETMAP_BUF_POOL && bo != NULL)
+			break;
+		error = netmap_mem_ext_layout(nme->os, p, o, &clust, &nr_pages);
+		if (error)
+			goto out_delete;
+	}
 
-		p->_objsize = o->size;
-		p->_clustsize = o->size;
-		p->_clustentries = 1;
+	if (bo != NULL) {
+		struct netmap_obj_pool *p = &nme->up.pools[NETMAP_BUF_POOL];
+		struct netmap_obj_pool *sp;
 
-		p->lut = nm_alloc_lut(o->num);
-		if (p->lut == NULL) {
-			error = ENOMEM;
+		error = netmap_mem_ext_bufs_attach(nme, bo);
+		if (error)
 			goto out_delete;
-		}
-
-		p->bitmap_slots = (o->num + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+		/* use the lut of the shared pool, and a copy of its
+		 * invalid objects */
+		sp = &nme->bufs->pool;
+		p->_objsize = p->_clustsize = sp->_objsize;
+		p->_clustentries = 1;
+		p->lut = sp->lut;
+		p->lutsize = sp->lutsize;
+		p->objtotal = p->numclusters = sp->objtotal;
+		p->memtotal = sp->memtotal;
+		p->bitmap_slots = sp->bitmap_slots;
 		p->invalid_bitmap = nm_os_malloc(sizeof(uint32_t) * p->bitmap_slots);
 		if (p->invalid_bitmap == NULL) {
 			error = ENOMEM;
 			goto out_delete;
 		}
-
-		if (nr_pages == 0) {
-			p->objtotal = 0;
-			p->memtotal = 0;
-			p->objfree = 0;
-			continue;
-		}
-
-		for (j = 0; j < o->num && nr_pages > 0; j++) {
-			size_t noff;
-
-			p->lut[j].vaddr = clust + off;
-#if !defined(linux) && !defined(_WIN32)
-			p->lut[j].paddr = vtophys(p->lut[j].vaddr);
-#endif
-			nm_prdis("%s %d at %p", p->name, j, p->lut[j].vaddr);
-			noff = off + p->_objsize;
-			if (noff < PAGE_SIZE) {
-				off = noff;
-				continue;
-			}
-			nm_prdis("too big, recomputing offset...");
-			while (noff >= PAGE_SIZE) {
-				char *old_clust = clust;
-				noff -= PAGE_SIZE;
-				clust = nm_os_extmem_nextpage(nme->os);
-				nr_pages--;
-				nm_prdis("noff %zu page %p nr_pages %d", noff,
-						page_to_virt(*pages), nr_pages);
-				if (noff > 0 && !nm_isset(p->invalid_bitmap, j) &&
-					(nr_pages == 0 ||
-					 old_clust + PAGE_SIZE != clust))
-				{
-					/* out of space or non contiguous,
-					 * drop this object
-					 * */
-					p->invalid_bitmap[ (j>>5) ] |= 1U << (j & 31U);
-					nm_prdis("non contiguous at off %zu, drop", noff);
-				}
-				if (nr_pages == 0)
-					break;
-			}
-			off = noff;
-		}
-		p->objtotal = j;
-		p->numclusters = p->objtotal;
-		p->memtotal = j * (size_t)p->_objsize;
-		if (p->memtotal & (PAGE_SIZE - 1)) {
-			// make sure that the objects of the next pool start page-aligned
-			p->memtotal = (p->memtotal & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
-			if (nr_pages > 0) {
-				clust = nm_os_extmem_nextpage(nme->os);
-				nr_pages--;
-			}
-		}
-		nm_prdis("%d memtotal %zu", j, p->memtotal);
+		memcpy(p->invalid_bitmap, sp->invalid_bitmap,
+				sizeof(uint32_t) * p->bitmap_slots);
+		nme->up.params[NETMAP_BUF_POOL].size = sp->_objsize;
+		nme->up.params[NETMAP_BUF_POOL].num = sp->objtotal;
+		nme->up.nm_bufs_ofs = (int64_t)(bo->nro_usrptr - usrptr);
+		nme->up.flags |= NETMAP_MEM_EXTBUFS;
+		pi->nr_buf_pool_objsize = sp->_objsize;
+		pi->nr_buf_pool_objtotal = sp->objtotal;
 	}
 
 	netmap_mem_ext_register(nme);
@@ -2769,7 +4332,8 @@ out:
 
 static void
 netmap_mem_pt_guest_if_delete(struct netmap_mem_d * nmd,
-		struct netmap_adapter *na, struct netmap_if *nifp)
+		struct netmap_adapter *na, struct netmap_if *nifp,
+		struct netmap_priv_d *priv)
 {
 	struct mem_pt_if *ptif;
 
@@ -2888,6 +4452,8 @@ netmap_mem_pt_guest_create(nm_memid_t mem_id)
 	}
 
 	ptnmd->up.ops = &netmap_mem_pt_guest_ops;
+	ptnmd->up.nm_numa_req = ptnmd->up.nm_numa_node = -1;
+	ptnmd->up.nm_numa_hint = NETMAP_MEM_NUMA_NOHINT;
 	ptnmd->host_mem_id = mem_id;
 	ptnmd->pt_ifs = NULL;
 
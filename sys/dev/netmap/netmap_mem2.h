@@ -133,16 +133,18 @@ int	   netmap_mem_finalize(struct netmap_mem_d *, struct netmap_adapter *);
 int 	   netmap_mem_init(void);
 void 	   netmap_mem_fini(void);
 struct netmap_if * netmap_mem_if_new(struct netmap_adapter *, struct netmap_priv_d *);
-void 	   netmap_mem_if_delete(struct netmap_adapter *, struct netmap_if *);
+void 	   netmap_mem_if_delete(struct netmap_adapter *, struct netmap_if *,
+		struct netmap_priv_d *);
 int	   netmap_mem_rings_create(struct netmap_adapter *);
 void	   netmap_mem_rings_delete(struct netmap_adapter *);
 int 	   netmap_mem_deref(struct netmap_mem_d *, struct netmap_adapter *);
+void	   netmap_mem_dma_forget(struct netmap_mem_d *, struct netmap_adapter *);
 int	   netmap_mem2_get_pool_info(struct netmap_mem_d *, u_int, u_int *, u_int *);
 int	   netmap_mem_get_info(struct netmap_mem_d *, uint64_t *size,
 				u_int *memflags, nm_memid_t *id);
 ssize_t    netmap_mem_if_offset(struct netmap_mem_d *, const void *vaddr);
 struct netmap_mem_d* netmap_mem_private_new( u_int txr, u_int txd, u_int rxr, u_int rxd,
-		u_int extra_bufs, u_int npipes, int* error);
+		u_int extra_bufs, u_int npipes, u_int buf_size, int* error);
 
 #define netmap_mem_get(d) __netmap_mem_get(d, __FUNCTION__, __LINE__)
 #define netmap_mem_put(d) __netmap_mem_put(d, __FUNCTION__, __LINE__)
@@ -153,10 +155,13 @@ struct netmap_mem_d* netmap_mem_find(nm_memid_t);
 unsigned netmap_mem_bufsize(struct netmap_mem_d *nmd);
 
 #ifdef WITH_EXTMEM
-struct netmap_mem_d* netmap_mem_ext_create(uint64_t, struct nmreq_pools_info *, int *);
+struct netmap_mem_d* netmap_mem_ext_create(uint64_t, struct nmreq_pools_info *,
+		struct nmreq_opt_extmem_bufs *, int *);
+int netmap_mem_bufs_shared(struct netmap_mem_d *, struct netmap_mem_d *);
 #else /* !WITH_EXTMEM */
-#define netmap_mem_ext_create(nmr, _perr) \
+#define netmap_mem_ext_create(nmr, _pi, _bo, _perr) \
 	({ int *perr = _perr; if (perr) *(perr) = EOPNOTSUPP; NULL; })
+#define netmap_mem_bufs_shared(a, b)	((a) == (b))
 #endif /* WITH_EXTMEM */
 
 #ifdef WITH_PTNETMAP
@@ -170,11 +175,25 @@ int netmap_mem_pt_guest_ifp_del(struct netmap_mem_d *, struct ifnet *);
 
 int netmap_mem_pools_info_get(struct nmreq_pools_info *,
 				struct netmap_mem_d *);
+int netmap_mem_pools_stats_get(struct nmreq_pools_stats *,
+				struct netmap_mem_d *);
+void netmap_mem_numa_hint(struct netmap_mem_d *, int node);
+#define NETMAP_MEM_NUMA_NOHINT	(-2)
+int netmap_mem_numa_node(struct netmap_mem_d *);
 
 #define NETMAP_MEM_PRIVATE	0x2	/* allocator uses private address space */
 #define NETMAP_MEM_IO		0x4	/* the underlying memory is mmapped I/O */
 
-uint32_t netmap_extra_alloc(struct netmap_adapter *, uint32_t *, uint32_t n);
+uint32_t netmap_extra_alloc(struct netmap_adapter *, uint32_t *, uint32_t n,
+		uint32_t *owner);
+u_int netmap_mem_bufs_get(struct netmap_mem_d *, uint32_t *idx, u_int n);
+void netmap_mem_bufs_put(struct netmap_mem_d *, const uint32_t *idx, u_int n);
+int netmap_mem_expand(struct netmap_mem_d *, u_int nbufs);
+int netmap_mem_bufrefs_enable(struct netmap_mem_d *);
+const u_int *netmap_mem_bufrefs(struct netmap_mem_d *, u_int *n);
+int netmap_mem_buf_hold(struct netmap_mem_d *, uint32_t b);
+int netmap_mem_buf_share(struct netmap_mem_d *, uint32_t b, uint32_t x);
+uint32_t netmap_mem_buf_unshare(struct netmap_mem_d *, uint32_t b);
 
 #ifdef WITH_EXTMEM
 #include <net/netmap_virt.h>
@@ -70,6 +70,26 @@
  *
  * Several copy or zero-copy monitors may be active on any ring.
  *
+ * Copy monitors opened with NR_MONITOR_DEFER move the copy of the tx
+ * frames out of the txsync of the monitored port: the txsync only
+ * records a reference to each new slot in the monitor kring, and the
+ * copy is done in the rxsync of the monitor. The frame is still in the
+ * tx buffer until the slot is given back to the user of the monitored
+ * port, which is tracked by the mon_tx_sub/mon_tx_done counters of the
+ * monitored kring: references to slots already given back are dropped,
+ * as well as copies which raced with the release of the slot.
+ * Rx traffic is always copied in the rxsync of the monitored port,
+ * since the application may modify the frames as soon as it gets them.
+ *
+ * Copy monitors may also be registered with the
+ * NETMAP_REQ_OPT_MONITOR_FILTER option, which limits the number of
+ * bytes copied from each frame (snaplen) and/or runs a classic BPF
+ * program on the frame before the copy. Frames rejected by the program
+ * do not use any slot in the monitor ring.
+ * With NETMAP_REQ_OPT_MONITOR_SAMPLE only one frame in N (counted in
+ * each monitor kring), or the frames of one flow in N, are considered
+ * at all, which keeps always-on monitors cheap for the monitored port.
+ *
  */
 
 
@@ -122,6 +142,16 @@
 
 #define NM_MONITOR_MAXSLOTS 4096
 
+/* a tx slot of the monitored port, still to be copied by a deferred
+ * copy monitor */
+struct nm_mon_ref {
+	struct netmap_slot slot;	/* the slot at the time of the txsync */
+	uint64_t pos;		/* its position in the mon_tx_sub sequence */
+};
+
+static void netmap_monitor_defer_copy(struct netmap_kring *mkring,
+		struct netmap_kring *kring);
+
 /*
  ********************************************************************
  * functions common to both kind of monitors
@@ -163,6 +193,11 @@ netmap_monitor_rxsync(struct netmap_kring *kring, int flags)
 	nm_prdis("%s %x", kring->name, flags);
 	kring->nr_hwcur = kring->rhead;
 	mb();
+	if (kring->mon_refs != NULL) {
+		/* deferred copy monitor, copy the pending tx frames */
+		netmap_monitor_defer_copy(kring,
+				NMR(mna->priv.np_na, NR_TX)[kring->ring_id]);
+	}
 	return 0;
 }
 
@@ -193,6 +228,17 @@ netmap_monitor_krings_create(struct netmap_adapter *na)
 static void
 netmap_monitor_krings_delete(struct netmap_adapter *na)
 {
+	struct netmap_kring *kring;
+	u_int i;
+
+	/* the references left if the monitored port went away first */
+	for (i = 0; i < netmap_all_rings(na, NR_RX); i++) {
+		kring = NMR(na, NR_RX)[i];
+		if (kring->mon_refs != NULL) {
+			nm_os_free(kring->mon_refs);
+			kring->mon_refs = NULL;
+		}
+	}
 	netmap_krings_delete(na);
 }
 
@@ -278,6 +324,12 @@ nm_monitor_intercept_callbacks(struct netmap_kring *kring)
 	kring->mon_notify = kring->nm_notify;
 	if (kring->tx == NR_TX) {
 		kring->nm_sync = netmap_monitor_parent_txsync;
+		/* the slots between hwtail and hwcur (including the one at
+		 * hwtail) are not available to the user */
+		kring->mon_tx_done = 0;
+		kring->mon_tx_sub = kring->nr_hwcur - kring->nr_hwtail;
+		if (kring->nr_hwcur < kring->nr_hwtail)
+			kring->mon_tx_sub += kring->nkr_num_slots;
 	} else {
 		kring->nm_sync = netmap_monitor_parent_rxsync;
 		kring->nm_notify = netmap_monitor_parent_notify;
@@ -351,10 +403,22 @@ netmap_monitor_add(struct netmap_kring *mkring, struct netmap_kring *kring, int
 		 */
 		netmap_adapter_get(ikring->na);
 	} else {
+		struct netmap_monitor_adapter *mna =
+			(struct netmap_monitor_adapter *)mkring->na;
+
 		/* make sure the monitor array exists and is big enough */
 		error = nm_monitor_alloc(kring, kring->n_monitors + 1);
 		if (error)
 			goto out;
+		if ((mna->flags & NR_MONITOR_DEFER) && t == NR_TX) {
+			mkring->mon_refs = nm_os_malloc(mkring->nkr_num_slots *
+					sizeof(*mkring->mon_refs));
+			if (mkring->mon_refs == NULL) {
+				error = ENOMEM;
+				goto out;
+			}
+			mkring->mon_ref_head = mkring->mon_ref_tail = 0;
+		}
 		kring->monitors[kring->n_monitors] = mkring;
 		mkring->mon_pos[kring->tx] = kring->n_monitors;
 		kring->n_monitors++;
@@ -416,6 +480,10 @@ netmap_monitor_del(struct netmap_kring *mkring, struct netmap_kring *kring, enum
 	} else {
 		/* this is a copy monitor */
 		uint32_t mon_pos = mkring->mon_pos[kring->tx];
+		if (kring->tx == NR_TX && mkring->mon_refs != NULL) {
+			nm_os_free(mkring->mon_refs);
+			mkring->mon_refs = NULL;
+		}
 		kring->n_monitors--;
 		if (mon_pos != kring->n_monitors) {
 			kring->monitors[mon_pos] =
@@ -463,11 +531,17 @@ netmap_monitor_stop(struct netmap_adapter *na)
 					kring->monitors[j];
 				struct netmap_monitor_adapter *mna =
 					(struct netmap_monitor_adapter *)mkring->na;
+				/* a deferred copy monitor may be copying from
+				 * our buffers in its rxsync, wait for it */
+				if (mkring->mon_refs != NULL)
+					nm_kr_stop(mkring, NM_KR_LOCKED);
 				/* forget about this adapter */
 				if (mna->priv.np_na != NULL) {
 					netmap_adapter_put(mna->priv.np_na);
 					mna->priv.np_na = NULL;
 				}
+				if (mkring->mon_refs != NULL)
+					nm_kr_start(mkring);
 				kring->monitors[j] = NULL;
 			}
 
@@ -572,6 +646,25 @@ netmap_monitor_reg_common(struct netmap_adapter *na, int onoff, int zmon)
 	return 0;
 }
 
+/*
+ * The last sync of the monitored tx kring has given back to the user
+ * the slots that follow old_hwtail: frames in their buffers can no
+ * longer be copied by deferred copy monitors. This must be called
+ * before the buffers can be changed.
+ */
+static inline void
+nm_monitor_tx_reclaimed(struct netmap_kring *kring, u_int old_hwtail)
+{
+	int n = kring->nr_hwtail - old_hwtail;
+
+	if (n < 0)
+		n += kring->nkr_num_slots;
+	if (n) {
+		kring->mon_tx_done += n;
+		wmb();
+	}
+}
+
 /*
  ****************************************************************
  * functions specific for zero-copy monitors
@@ -589,10 +682,11 @@ netmap_zmon_parent_sync(struct netmap_kring *kring, int flags, enum txrx tx)
 	struct netmap_ring *ring = kring->ring, *mring;
 	int error = 0;
 	int rel_slots, free_slots, busy, sent = 0;
-	u_int beg, end, i;
+	u_int beg, end, i, nrefs;
 	u_int lim = kring->nkr_num_slots - 1,
 	      mlim; // = mkring->nkr_num_slots - 1;
 	uint16_t txmon = kring->tx == NR_TX ? NS_TXMON : 0;
+	const u_int *refs;
 
 	if (mkring == NULL) {
 		nm_prlim(5, "NULL monitor on %s", kring->name);
@@ -607,6 +701,8 @@ netmap_zmon_parent_sync(struct netmap_kring *kring, int flags, enum txrx tx)
 		error = kring->mon_sync(kring, flags);
 		if (error)
 			return error;
+		/* before the buffers are swapped below */
+		nm_monitor_tx_reclaimed(kring, beg - 1);
 		end = kring->nr_hwtail + 1;
 	} else { /* NR_RX */
 		beg = kring->nr_hwcur;
@@ -647,12 +743,16 @@ netmap_zmon_parent_sync(struct netmap_kring *kring, int flags, enum txrx tx)
 	if (unlikely(beg >= kring->nkr_num_slots))
 		beg -= kring->nkr_num_slots;
 
-	sent = rel_slots;
+	refs = netmap_mem_bufrefs(kring->na->nm_mem, &nrefs);
 	for ( ; rel_slots; rel_slots--) {
 		struct netmap_slot *s = &ring->slot[beg];
 		struct netmap_slot *ms = &mring->slot[i];
 		uint32_t tmp;
 
+		if (unlikely(refs != NULL) && s->buf_idx < nrefs &&
+		    refs[s->buf_idx] != 0 && nm_zmon_unshare(kring, s) < 0)
+			break;
+
 		tmp = ms->buf_idx;
 		ms->buf_idx = s->buf_idx;
 		s->buf_idx = tmp;
@@ -667,7 +767,7 @@ netmap_zmon_parent_sync(struct netmap_kring *kring, int flags, enum txrx tx)
 
 		beg = nm_next(beg, lim);
 		i = nm_next(i, mlim);
-
+		sent++;
 	}
 	mb();
 	mkring->nr_hwtail = i;
@@ -687,6 +787,29 @@ out_rxsync:
 	return error;
 }
 
+/*
+ * A VALE receive slot may hold a buffer shared with other rings
+ * (vale_brd_zcopy, see nm_vale_brd_hold()), which must not move to the
+ * monitor ring: give the slot a private copy first. Returns -1 if no
+ * private buffer is available right now.
+ */
+static int
+nm_zmon_unshare(struct netmap_kring *kring, struct netmap_slot *s)
+{
+	struct netmap_adapter *na = kring->na;
+	void *src = NMB(na, s);
+	uint32_t x;
+
+	x = netmap_mem_buf_unshare(na->nm_mem, s->buf_idx);
+	if (x == 0)
+		return -1;
+	if (x != s->buf_idx) {
+		s->buf_idx = x;
+		memcpy(NMB(na, s), src, nm_get_offset(kring, s) + s->len);
+	}
+	return 0;
+}
+
 /* callback used to replace the nm_sync callback in the monitored tx rings */
 static int
 netmap_zmon_parent_txsync(struct netmap_kring *kring, int flags)
@@ -725,6 +848,510 @@ netmap_zmon_dtor(struct netmap_adapter *na)
  ****************************************************************
  */
 
+/*
+ * A small classic BPF interpreter, used to filter the frames before
+ * they are copied into the monitor rings. The opcodes are the ones of
+ * <net/bpf.h>, which we cannot include on all platforms.
+ */
+#define NM_BPF_CLASS(c)	((c) & 0x07)
+#define	NM_BPF_LD	0x00
+#define	NM_BPF_LDX	0x01
+#define	NM_BPF_ST	0x02
+#define	NM_BPF_STX	0x03
+#define	NM_BPF_ALU	0x04
+#define	NM_BPF_JMP	0x05
+#define	NM_BPF_RET	0x06
+#define	NM_BPF_MISC	0x07
+#define NM_BPF_SIZE(c)	((c) & 0x18)
+#define	NM_BPF_W	0x00
+#define	NM_BPF_H	0x08
+#define	NM_BPF_B	0x10
+#define NM_BPF_MODE(c)	((c) & 0xe0)
+#define	NM_BPF_IMM	0x00
+#define	NM_BPF_ABS	0x20
+#define	NM_BPF_IND	0x40
+#define	NM_BPF_MEM	0x60
+#define	NM_BPF_LEN	0x80
+#define	NM_BPF_MSH	0xa0
+#define NM_BPF_OP(c)	((c) & 0xf0)
+#define	NM_BPF_ADD	0x00
+#define	NM_BPF_SUB	0x10
+#define	NM_BPF_MUL	0x20
+#define	NM_BPF_DIV	0x30
+#define	NM_BPF_OR	0x40
+#define	NM_BPF_AND	0x50
+#define	NM_BPF_LSH	0x60
+#define	NM_BPF_RSH	0x70
+#define	NM_BPF_NEG	0x80
+#define	NM_BPF_MOD	0x90
+#define	NM_BPF_XOR	0xa0
+#define	NM_BPF_JA	0x00
+#define	NM_BPF_JEQ	0x10
+#define	NM_BPF_JGT	0x20
+#define	NM_BPF_JGE	0x30
+#define	NM_BPF_JSET	0x40
+#define NM_BPF_SRC(c)	((c) & 0x08)
+#define	NM_BPF_K	0x00
+#define	NM_BPF_X	0x08
+#define NM_BPF_RVAL(c)	((c) & 0x18)
+#define	NM_BPF_A	0x10
+#define NM_BPF_MISCOP(c) ((c) & 0xf8)
+#define	NM_BPF_TAX	0x00
+#define	NM_BPF_TXA	0x80
+#define NM_BPF_MEMWORDS	16
+
+/*
+ * Check that the program can be run by nm_bpf_filter(): only known
+ * opcodes, forward jumps within the program, scratch memory in range,
+ * no division by a constant zero, and a return at the end.
+ * Returns 0 or EINVAL.
+ */
+static int
+nm_bpf_validate(const struct nm_bpf_insn *insns, u_int n)
+{
+	u_int pc;
+
+	if (n == 0 || n > NM_MONITOR_FILTER_MAXINSNS)
+		return EINVAL;
+	for (pc = 0; pc < n; pc++) {
+		const struct nm_bpf_insn *p = &insns[pc];
+		u_int left = n - pc - 1; /* instructions after this one */
+
+		switch (NM_BPF_CLASS(p->code)) {
+		case NM_BPF_LD:
+		case NM_BPF_LDX:
+			switch (NM_BPF_MODE(p->code)) {
+			case NM_BPF_IMM:
+			case NM_BPF_LEN:
+				break;
+			case NM_BPF_ABS:
+			case NM_BPF_IND:
+				if (NM_BPF_CLASS(p->code) == NM_BPF_LDX ||
+				    NM_BPF_SIZE(p->code) == 0x18)
+					return EINVAL;
+				break;
+			case NM_BPF_MSH:
+				if (p->code != (NM_BPF_LDX|NM_BPF_B|NM_BPF_MSH))
+					return EINVAL;
+				break;
+			case NM_BPF_MEM:
+				if (p->k >= NM_BPF_MEMWORDS)
+					return EINVAL;
+				break;
+			default:
+				return EINVAL;
+			}
+			break;
+		case NM_BPF_ST:
+		case NM_BPF_STX:
+			if (p->k >= NM_BPF_MEMWORDS)
+				return EINVAL;
+			break;
+		case NM_BPF_ALU:
+			switch (NM_BPF_OP(p->code)) {
+			case NM_BPF_DIV:
+			case NM_BPF_MOD:
+				if (NM_BPF_SRC(p->code) == NM_BPF_K && p->k == 0)
+					return EINVAL;
+				break;
+			case NM_BPF_ADD: case NM_BPF_SUB: case NM_BPF_MUL:
+			case NM_BPF_OR: case NM_BPF_AND: case NM_BPF_LSH:
+			case NM_BPF_RSH: case NM_BPF_NEG: case NM_BPF_XOR:
+				break;
+			default:
+				return EINVAL;
+			}
+			break;
+		case NM_BPF_JMP:
+			switch (NM_BPF_OP(p->code)) {
+			case NM_BPF_JA:
+				if (p->k >= left)
+					return EINVAL;
+				break;
+			case NM_BPF_JEQ: case NM_BPF_JGT:
+			case NM_BPF_JGE: case NM_BPF_JSET:
+				if (p->jt >= left || p->jf >= left)
+					return EINVAL;
+				break;
+			default:
+				return EINVAL;
+			}
+			break;
+		case NM_BPF_RET:
+			if (NM_BPF_RVAL(p->code) != NM_BPF_K &&
+			    NM_BPF_RVAL(p->code) != NM_BPF_A)
+				return EINVAL;
+			break;
+		case NM_BPF_MISC:
+			if (NM_BPF_MISCOP(p->code) != NM_BPF_TAX &&
+			    NM_BPF_MISCOP(p->code) != NM_BPF_TXA)
+				return EINVAL;
+			break;
+		}
+	}
+	if (NM_BPF_CLASS(insns[n - 1].code) != NM_BPF_RET)
+		return EINVAL;
+	return 0;
+}
+
+/* load size bytes (1, 2 or 4) in network order, -1 if out of bounds */
+static inline int
+nm_bpf_load(const uint8_t *buf, u_int buflen, uint32_t off, u_int size,
+		uint32_t *v)
+{
+	if (off > buflen || size > buflen - off)
+		return -1;
+	buf += off;
+	switch (size) {
+	case 1:
+		*v = buf[0];
+		break;
+	case 2:
+		*v = ((uint32_t)buf[0] << 8) | buf[1];
+		break;
+	default:
+		*v = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+			((uint32_t)buf[2] << 8) | buf[3];
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Run a program accepted by nm_bpf_validate() on the frame in buf.
+ * Returns the number of bytes to keep, 0 to drop the frame. As in
+ * bpf_filter(), loads out of the frame and divisions by zero reject
+ * the frame.
+ */
+static u_int
+nm_bpf_filter(const struct nm_bpf_insn *pc, const uint8_t *buf, u_int buflen)
+{
+	uint32_t A = 0, X = 0, v;
+	uint32_t mem[NM_BPF_MEMWORDS];
+	static const u_int sizes[] = { 4, 2, 1 };
+
+	for (;; pc++) {
+		switch (NM_BPF_CLASS(pc->code)) {
+		case NM_BPF_RET:
+			return NM_BPF_RVAL(pc->code) == NM_BPF_A ? A : pc->k;
+		case NM_BPF_LD:
+			switch (NM_BPF_MODE(pc->code)) {
+			case NM_BPF_ABS:
+				if (nm_bpf_load(buf, buflen, pc->k,
+				    sizes[NM_BPF_SIZE(pc->code) >> 3], &A))
+					return 0;
+				break;
+			case NM_BPF_IND:
+				if (pc->k > UINT32_MAX - X ||
+				    nm_bpf_load(buf, buflen, X + pc->k,
+				    sizes[NM_BPF_SIZE(pc->code) >> 3], &A))
+					return 0;
+				break;
+			case NM_BPF_LEN:
+				A = buflen;
+				break;
+			case NM_BPF_MEM:
+				A = mem[pc->k];
+				break;
+			default: /* NM_BPF_IMM */
+				A = pc->k;
+				break;
+			}
+			break;
+		case NM_BPF_LDX:
+			switch (NM_BPF_MODE(pc->code)) {
+			case NM_BPF_MSH:
+				if (nm_bpf_load(buf, buflen, pc->k, 1, &v))
+					return 0;
+				X = (v & 0xf) << 2;
+				break;
+			case NM_BPF_LEN:
+				X = buflen;
+				break;
+			case NM_BPF_MEM:
+				X = mem[pc->k];
+				break;
+			default: /* NM_BPF_IMM */
+				X = pc->k;
+				break;
+			}
+			break;
+		case NM_BPF_ST:
+			mem[pc->k] = A;
+			break;
+		case NM_BPF_STX:
+			mem[pc->k] = X;
+			break;
+		case NM_BPF_ALU:
+			v = NM_BPF_SRC(pc->code) == NM_BPF_X ? X : pc->k;
+			switch (NM_BPF_OP(pc->code)) {
+			case NM_BPF_ADD:
+				A += v;
+				break;
+			case NM_BPF_SUB:
+				A -= v;
+				break;
+			case NM_BPF_MUL:
+				A *= v;
+				break;
+			case NM_BPF_DIV:
+				if (v == 0)
+					return 0;
+				A /= v;
+				break;
+			case NM_BPF_MOD:
+				if (v == 0)
+					return 0;
+				A %= v;
+				break;
+			case NM_BPF_OR:
+				A |= v;
+				break;
+			case NM_BPF_AND:
+				A &= v;
+				break;
+			case NM_BPF_LSH:
+				A = v < 32 ? A << v : 0;
+				break;
+			case NM_BPF_RSH:
+				A = v < 32 ? A >> v : 0;
+				break;
+			case NM_BPF_XOR:
+				A ^= v;
+				break;
+			default: /* NM_BPF_NEG */
+				A = -A;
+				break;
+			}
+			break;
+		case NM_BPF_JMP:
+			v = NM_BPF_SRC(pc->code) == NM_BPF_X ? X : pc->k;
+			switch (NM_BPF_OP(pc->code)) {
+			case NM_BPF_JA:
+				pc += pc->k;
+				break;
+			case NM_BPF_JEQ:
+				pc += (A == v) ? pc->jt : pc->jf;
+				break;
+			case NM_BPF_JGT:
+				pc += (A > v) ? pc->jt : pc->jf;
+				break;
+			case NM_BPF_JGE:
+				pc += (A >= v) ? pc->jt : pc->jf;
+				break;
+			default: /* NM_BPF_JSET */
+				pc += (A & v) ? pc->jt : pc->jf;
+				break;
+			}
+			break;
+		default: /* NM_BPF_MISC */
+			if (NM_BPF_MISCOP(pc->code) == NM_BPF_TAX)
+				X = A;
+			else
+				A = X;
+			break;
+		}
+	}
+}
+
+/*
+ * Apply the sampling and the filter of the monitor owning mkring to a
+ * frame of *len bytes. Returns 0 if the frame must be dropped, otherwise
+ * 1 and the number of bytes to copy in *len. Called with the q_lock of
+ * mkring held.
+ */
+static inline int
+nm_monitor_filter(struct netmap_kring *mkring, const void *buf, u_int *len)
+{
+	struct nm_monitor_filter *f =
+		((struct netmap_monitor_adapter *)mkring->na)->filter;
+	u_int keep;
+
+	if (likely(f == NULL))
+		return 1;
+	if (f->sample_rate > 1) {
+		if (f->sample_flow) {
+			if (nm_flow_hash(buf, *len) % f->sample_rate)
+				return 0;
+		} else if (++mkring->mon_sample < f->sample_rate) {
+			return 0;
+		} else {
+			mkring->mon_sample = 0;
+		}
+	}
+	if (f->ninsns) {
+		keep = nm_bpf_filter(f->insns, buf, *len);
+		if (keep == 0)
+			return 0;
+		if (keep < *len)
+			*len = keep;
+	}
+	if (f->snaplen && f->snaplen < *len)
+		*len = f->snaplen;
+	return 1;
+}
+
+/* build the filter of a new copy monitor from the
+ * NETMAP_REQ_OPT_MONITOR_SAMPLE and NETMAP_REQ_OPT_MONITOR_FILTER
+ * options, if any */
+static int
+nm_monitor_filter_create(struct nmreq_header *hdr,
+		struct nm_monitor_filter **pf)
+{
+	struct nmreq_opt_monitor_filter *opt;
+	struct nmreq_opt_monitor_sample *sopt;
+	struct nm_monitor_filter *f;
+	u_int ninsns = 0;
+	int error;
+
+	*pf = NULL;
+	opt = (struct nmreq_opt_monitor_filter *)
+		nmreq_getoption(hdr, NETMAP_REQ_OPT_MONITOR_FILTER);
+	sopt = (struct nmreq_opt_monitor_sample *)
+		nmreq_getoption(hdr, NETMAP_REQ_OPT_MONITOR_SAMPLE);
+	if (opt == NULL && sopt == NULL)
+		return 0;
+	if (sopt != NULL && (sopt->nro_flags & ~NR_MONITOR_SAMPLE_FLOW)) {
+		nm_prerr("bad monitor sample flags %x", sopt->nro_flags);
+		sopt->nro_opt.nro_status = EINVAL;
+		return EINVAL;
+	}
+	if (opt != NULL) {
+		if (opt->nro_ninsns > NM_MONITOR_FILTER_MAXINSNS ||
+		    opt->nro_opt.nro_size < sizeof(*opt) +
+				opt->nro_ninsns * sizeof(struct nm_bpf_insn)) {
+			nm_prerr("bad monitor filter size");
+			return EINVAL;
+		}
+		if (opt->nro_ninsns) {
+			error = nm_bpf_validate(opt->nro_insns,
+					opt->nro_ninsns);
+			if (error) {
+				nm_prerr("invalid monitor filter program");
+				return error;
+			}
+		}
+		ninsns = opt->nro_ninsns;
+	}
+	f = nm_os_malloc(sizeof(*f) + ninsns * sizeof(struct nm_bpf_insn));
+	if (f == NULL)
+		return ENOMEM;
+	if (opt != NULL) {
+		f->snaplen = opt->nro_snaplen;
+		f->ninsns = ninsns;
+		memcpy(f->insns, opt->nro_insns,
+				ninsns * sizeof(struct nm_bpf_insn));
+		opt->nro_opt.nro_status = 0;
+	}
+	if (sopt != NULL) {
+		f->sample_rate = sopt->nro_rate;
+		f->sample_flow = !!(sopt->nro_flags & NR_MONITOR_SAMPLE_FLOW);
+		sopt->nro_opt.nro_status = 0;
+	}
+	*pf = f;
+	return 0;
+}
+
+/*
+ * Record the new tx slots of kring in the deferred copy monitor mkring.
+ * As in netmap_monitor_parent_sync(), the oldest slots are dropped
+ * if there is no room.
+ */
+static void
+netmap_monitor_defer(struct netmap_kring *kring, struct netmap_kring *mkring,
+		u_int first_new, int new_slots)
+{
+	u_int lim = kring->nkr_num_slots - 1;
+	u_int mlim = mkring->nkr_num_slots - 1;
+	uint64_t pos = kring->mon_tx_sub;
+	u_int beg = first_new, i;
+	int free_refs, m = new_slots;
+
+	mtx_lock(&mkring->q_lock);
+	i = mkring->mon_ref_tail;
+	free_refs = mkring->mon_ref_head - i - 1;
+	if (free_refs < 0)
+		free_refs += mkring->nkr_num_slots;
+	if (free_refs < m) {
+		beg += (m - free_refs);
+		if (beg >= kring->nkr_num_slots)
+			beg -= kring->nkr_num_slots;
+		pos += (m - free_refs);
+		m = free_refs;
+	}
+	for ( ; m; m--) {
+		struct nm_mon_ref *ref = &mkring->mon_refs[i];
+
+		ref->slot = kring->ring->slot[beg];
+		ref->pos = pos++;
+		beg = nm_next(beg, lim);
+		i = nm_next(i, mlim);
+	}
+	mkring->mon_ref_tail = i;
+	mtx_unlock(&mkring->q_lock);
+
+	/* let the monitor do the copy */
+	mkring->nm_notify(mkring, 0);
+}
+
+/*
+ * Called by the rxsync of a deferred copy monitor: copy the frames
+ * recorded by netmap_monitor_defer() from the buffers of the monitored
+ * tx kring, as long as they have not been given back to its user.
+ * Copies are checked again afterwards, since the monitored port may
+ * have released the slot in the meantime.
+ */
+static void
+netmap_monitor_defer_copy(struct netmap_kring *mkring, struct netmap_kring *kring)
+{
+	struct netmap_ring *mring = mkring->ring;
+	u_int mlim = mkring->nkr_num_slots - 1;
+	u_int i, h;
+	int free_slots, busy, sent = 0;
+
+	mtx_lock(&mkring->q_lock);
+	i = mkring->nr_hwtail;
+	busy = i - mkring->nr_hwcur;
+	if (busy < 0)
+		busy += mkring->nkr_num_slots;
+	free_slots = mlim - busy;
+
+	for (h = mkring->mon_ref_head;
+	     h != mkring->mon_ref_tail && free_slots > 0;
+	     h = nm_next(h, mlim)) {
+		struct nm_mon_ref *ref = &mkring->mon_refs[h];
+		struct netmap_slot *ms = &mring->slot[i];
+		u_int copy_len = ref->slot.len;
+		u_int max_len;
+
+		rmb();
+		if (kring->mon_tx_done > ref->pos)
+			continue;	/* the buffer is gone */
+		if (!nm_monitor_filter(mkring, NMB_O(kring, &ref->slot),
+					&copy_len))
+			continue;
+		max_len = NETMAP_BUF_SIZE(mkring->na) - nm_get_offset(mkring, ms);
+		if (unlikely(copy_len > max_len))
+			copy_len = max_len;
+		memcpy(NMB_O(mkring, ms), NMB_O(kring, &ref->slot), copy_len);
+		rmb();
+		if (kring->mon_tx_done > ref->pos)
+			continue;	/* released while we were copying, the
+					 * filter may have seen garbage too */
+		ms->len = copy_len;
+		ms->flags = ref->slot.flags | NS_TXMON;
+		i = nm_next(i, mlim);
+		free_slots--;
+		sent++;
+	}
+	mkring->mon_ref_head = h;
+	if (sent) {
+		mb();
+		mkring->nr_hwtail = i;
+	}
+	mtx_unlock(&mkring->q_lock);
+}
+
 static void
 netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_slots)
 {
@@ -740,6 +1367,11 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 		u_int max_len;
 		mlim = mkring->nkr_num_slots - 1;
 
+		if (txmon && mkring->mon_refs != NULL) {
+			netmap_monitor_defer(kring, mkring, first_new, new_slots);
+			continue;
+		}
+
 		/* we need to lock the monitor receive ring, since it
 		 * is the target of bot tx and rx traffic from the monitored
 		 * adapter
@@ -772,6 +1404,10 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 			char *src = NMB_O(kring, s),
 			     *dst = NMB_O(mkring, ms);
 
+			beg = nm_next(beg, lim);
+			if (!nm_monitor_filter(mkring, src, &copy_len))
+				continue;
+
 			max_len = NETMAP_BUF_SIZE(mkring->na) - nm_get_offset(mkring, ms);
 			if (unlikely(copy_len > max_len)) {
 				nm_prlim(5, "%s->%s: truncating %d to %d", kring->name,
@@ -784,7 +1420,6 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 			ms->flags = (s->flags & ~NS_TXMON) | txmon;
 			sent++;
 
-			beg = nm_next(beg, lim);
 			i = nm_next(i, mlim);
 		}
 		mb();
@@ -803,12 +1438,11 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 static int
 netmap_monitor_parent_txsync(struct netmap_kring *kring, int flags)
 {
-	u_int first_new;
-	int new_slots;
+	u_int first_new = kring->nr_hwcur, old_hwtail = kring->nr_hwtail;
+	int new_slots, error;
 
 	/* get the new slots */
 	if (kring->n_monitors > 0) {
-		first_new = kring->nr_hwcur;
 		new_slots = kring->rhead - first_new;
 		if (new_slots < 0)
 			new_slots += kring->nkr_num_slots;
@@ -816,9 +1450,18 @@ netmap_monitor_parent_txsync(struct netmap_kring *kring, int flags)
 			netmap_monitor_parent_sync(kring, first_new, new_slots);
 	}
 	if (kring->zmon_list[NR_TX].next != NULL) {
-		return netmap_zmon_parent_txsync(kring, flags);
+		error = netmap_zmon_parent_txsync(kring, flags);
+	} else {
+		error = kring->mon_sync(kring, flags);
+		nm_monitor_tx_reclaimed(kring, old_hwtail);
 	}
-	return kring->mon_sync(kring, flags);
+	/* count the slots actually passed to the port, see
+	 * netmap_monitor_defer_copy() */
+	new_slots = kring->nr_hwcur - first_new;
+	if (new_slots < 0)
+		new_slots += kring->nkr_num_slots;
+	kring->mon_tx_sub += new_slots;
+	return error;
 }
 
 /* callback used to replace the nm_sync callback in the monitored rx rings */
@@ -892,6 +1535,8 @@ netmap_monitor_dtor(struct netmap_adapter *na)
 	struct netmap_priv_d *priv = &mna->priv;
 	struct netmap_adapter *pna = priv->np_na;
 
+	if (mna->filter)
+		nm_os_free(mna->filter);
 	netmap_adapter_put(pna);
 }
 
@@ -905,11 +1550,21 @@ netmap_get_monitor_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	struct nmreq_register preq;
 	struct netmap_adapter *pna; /* parent adapter */
 	struct netmap_monitor_adapter *mna;
+	struct nm_monitor_filter *filter = NULL;
 	struct ifnet *ifp = NULL;
 	int  error;
 	int zcopy = (req->nr_flags & NR_ZCOPY_MON);
 
 	if (zcopy) {
+		if (req->nr_flags & NR_MONITOR_DEFER) {
+			nm_prerr("deferred copies make no sense for zero-copy monitors");
+			return EINVAL;
+		}
+		if (nmreq_getoption(hdr, NETMAP_REQ_OPT_MONITOR_FILTER) ||
+		    nmreq_getoption(hdr, NETMAP_REQ_OPT_MONITOR_SAMPLE)) {
+			nm_prerr("zero-copy monitors cannot filter");
+			return EINVAL;
+		}
 		req->nr_flags |= (NR_MONITOR_TX | NR_MONITOR_RX);
 	}
 	if ((req->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX)) == 0) {
@@ -926,7 +1581,8 @@ netmap_get_monitor_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	 * except other monitors.
 	 */
 	memcpy(&preq, req, sizeof(preq));
-	preq.nr_flags &= ~(NR_MONITOR_TX | NR_MONITOR_RX | NR_ZCOPY_MON);
+	preq.nr_flags &= ~(NR_MONITOR_TX | NR_MONITOR_RX | NR_ZCOPY_MON |
+			NR_MONITOR_DEFER);
 	hdr->nr_body = (uintptr_t)&preq;
 	error = netmap_get_na(hdr, &pna, &ifp, nmd, create);
 	hdr->nr_body = (uintptr_t)req;
@@ -946,6 +1602,10 @@ netmap_get_monitor_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 		goto put_out;
 	}
 
+	error = nm_monitor_filter_create(hdr, &filter);
+	if (error)
+		goto put_out;
+
 	mna = nm_os_malloc(sizeof(*mna));
 	if (mna == NULL) {
 		error = ENOMEM;
@@ -1010,6 +1670,7 @@ netmap_get_monitor_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 				mna->up.num_rx_desc,
 				0, /* extra bufs */
 				0, /* pipes */
+				0, /* default buffer size */
 				&error);
 		if (mna->up.nm_mem == NULL)
 			goto put_out;
@@ -1022,7 +1683,9 @@ netmap_get_monitor_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	}
 
 	/* remember the traffic directions we have to monitor */
-	mna->flags = (req->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX | NR_ZCOPY_MON));
+	mna->flags = (req->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX | NR_ZCOPY_MON |
+				NR_MONITOR_DEFER));
+	mna->filter = filter;
 
 	*na = &mna->up;
 	netmap_adapter_get(*na);
@@ -1041,6 +1704,8 @@ mem_put_out:
 free_out:
 	nm_os_free(mna);
 put_out:
+	if (filter)
+		nm_os_free(filter);
 	netmap_unget_na(pna, ifp);
 	return error;
 }
@@ -81,15 +81,129 @@ netmap_null_sync(struct netmap_kring *kring, int flags)
 	return 0;
 }
 
+/* NR_NULL_SINK: drop everything */
+static int
+netmap_null_txsync_sink(struct netmap_kring *kring, int flags)
+{
+	(void)flags;
+	kring->nr_hwcur = kring->rhead;
+	kring->nr_hwtail = nm_prev(kring->rhead, kring->nkr_num_slots - 1);
+	return 0;
+}
+
+/* write the frame of the source in the buffer of slot */
+static void
+netmap_null_fill(struct netmap_kring *kring, struct netmap_slot *slot)
+{
+	struct netmap_null_adapter *nna =
+		(struct netmap_null_adapter *)kring->na;
+	uint64_t off = nm_get_offset(kring, slot);
+	u_int len = nna->pkt_len;
+
+	if (off + len > NETMAP_BUF_SIZE(kring->na))
+		len = off < NETMAP_BUF_SIZE(kring->na) ?
+			NETMAP_BUF_SIZE(kring->na) - off : 0;
+	memcpy((char *)NMB(kring->na, slot) + off, nna->frame, len);
+}
+
+/* NR_NULL_SOURCE: fill the free slots with frames */
+static int
+netmap_null_rxsync_source(struct netmap_kring *kring, int flags)
+{
+	struct netmap_null_adapter *nna =
+		(struct netmap_null_adapter *)kring->na;
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int const head = kring->rhead;
+	u_int nm_i, n;
+
+	(void)flags;
+	/* first part: buffers given back, maybe new ones */
+	for (nm_i = kring->nr_hwcur; nm_i != head; nm_i = nm_next(nm_i, lim)) {
+		struct netmap_slot *slot = &ring->slot[nm_i];
+
+		if (slot->flags & NS_BUF_CHANGED) {
+			netmap_null_fill(kring, slot);
+			slot->flags &= ~NS_BUF_CHANGED;
+		}
+	}
+	kring->nr_hwcur = head;
+
+	/* second part: new frames */
+	n = kring->nr_hwcur + lim - kring->nr_hwtail;
+	if (n > lim)
+		n -= kring->nkr_num_slots;
+	if (nna->rate && n) {
+		uint64_t *last = &nna->rx_last_ns[kring->ring_id];
+		uint64_t now = nm_os_uptime_ns(), tokens;
+
+		if (now - *last > 1000000000ULL) {
+			/* idle for a while, do not burst */
+			*last = now - 1000000000ULL / nna->rate;
+		}
+		tokens = (now - *last) * nna->rate / 1000000000ULL;
+		if (tokens < n)
+			n = tokens;
+		*last += n * 1000000000ULL / nna->rate;
+	}
+	for (nm_i = kring->nr_hwtail; n > 0; n--, nm_i = nm_next(nm_i, lim)) {
+		struct netmap_slot *slot = &ring->slot[nm_i];
+
+		slot->len = nna->pkt_len;
+		slot->flags = 0;
+	}
+	kring->nr_hwtail = nm_i;
+	return 0;
+}
+
 static int
 netmap_null_krings_create(struct netmap_adapter *na)
 {
-	return netmap_krings_create(na, 0);
+	struct netmap_null_adapter *nna = (struct netmap_null_adapter *)na;
+	int error;
+
+	error = netmap_krings_create(na, 0);
+	if (error || !(nna->flags & NR_NULL_SOURCE))
+		return error;
+	nna->rx_last_ns = nm_os_malloc(sizeof(uint64_t) * na->num_rx_rings);
+	if (nna->rx_last_ns == NULL) {
+		netmap_krings_delete(na);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static void
+netmap_null_krings_delete(struct netmap_adapter *na)
+{
+	struct netmap_null_adapter *nna = (struct netmap_null_adapter *)na;
+
+	if (nna->rx_last_ns) {
+		nm_os_free(nna->rx_last_ns);
+		nna->rx_last_ns = NULL;
+	}
+	netmap_krings_delete(na);
 }
 
 static int
 netmap_null_reg(struct netmap_adapter *na, int onoff)
 {
+	struct netmap_null_adapter *nna = (struct netmap_null_adapter *)na;
+	u_int i, j;
+
+	if (onoff && (nna->flags & NR_NULL_SOURCE)) {
+		/* write the frames once in the buffers of the new rings */
+		for (i = 0; i < na->num_rx_rings; i++) {
+			struct netmap_kring *kring = na->rx_rings[i];
+
+			if (!nm_kring_pending_on(kring))
+				continue;
+			for (j = 0; j < kring->nkr_num_slots; j++)
+				netmap_null_fill(kring, &kring->ring->slot[j]);
+			nna->rx_last_ns[i] = nm_os_uptime_ns();
+		}
+	}
+	netmap_krings_mode_commit(na, onoff);
 	if (na->active_fds == 0) {
 		if (onoff)
 			na->na_flags |= NAF_NETMAP_ON;
@@ -99,6 +213,48 @@ netmap_null_reg(struct netmap_adapter *na, int onoff)
 	return 0;
 }
 
+static void
+netmap_null_dtor(struct netmap_adapter *na)
+{
+	struct netmap_null_adapter *nna = (struct netmap_null_adapter *)na;
+
+	if (nna->frame)
+		nm_os_free(nna->frame);
+}
+
+/* the frame of a source: UDP over IPv4, between locally administered
+ * addresses, with a zero payload
+ */
+static int
+netmap_null_frame_init(struct netmap_null_adapter *nna)
+{
+	static const uint8_t eth[14] = {
+		0x02, 0, 0, 0, 0, 0x02,		/* dst */
+		0x02, 0, 0, 0, 0, 0x01,		/* src */
+		0x08, 0x00 };
+	struct nm_iphdr *iph;
+	struct nm_udphdr *udph;
+	u_int len = nna->pkt_len;
+
+	nna->frame = nm_os_malloc(len);
+	if (nna->frame == NULL)
+		return ENOMEM;
+	memcpy(nna->frame, eth, sizeof(eth));
+	iph = (struct nm_iphdr *)(nna->frame + sizeof(eth));
+	iph->version_ihl = 0x45;
+	iph->tot_len = htons(len - sizeof(eth));
+	iph->ttl = 64;
+	iph->protocol = 17;	/* UDP */
+	iph->saddr = htonl(0x0a000001);	/* 10.0.0.1 */
+	iph->daddr = htonl(0x0a000002);	/* 10.0.0.2 */
+	iph->check = nm_os_csum_ipv4(iph);
+	udph = (struct nm_udphdr *)(iph + 1);
+	udph->source = htons(1234);
+	udph->dest = htons(1234);
+	udph->len = htons(len - sizeof(eth) - sizeof(*iph));
+	return 0;
+}
+
 static int
 netmap_null_bdg_attach(const char *name, struct netmap_adapter *na,
 		struct nm_bridge *b)
@@ -114,6 +270,7 @@ netmap_get_null_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 		struct netmap_mem_d *nmd, int create)
 {
 	struct nmreq_register *req = (struct nmreq_register *)(uintptr_t)hdr->nr_body;
+	struct nmreq_opt_null_traffic *topt;
 	struct netmap_null_adapter *nna;
 	int error;
 
@@ -132,6 +289,20 @@ netmap_get_null_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 		return EINVAL;
 	}
 
+	topt = (struct nmreq_opt_null_traffic *)
+		nmreq_getoption(hdr, NETMAP_REQ_OPT_NULL_TRAFFIC);
+	if (topt != NULL) {
+		if (topt->nro_pkt_len == 0)
+			topt->nro_pkt_len = 60;
+		if ((topt->nro_flags & ~(NR_NULL_SOURCE | NR_NULL_SINK)) ||
+		    topt->nro_pkt_len < 42 ||
+		    topt->nro_pkt_len > netmap_mem_bufsize(nmd)) {
+			error = topt->nro_opt.nro_status = EINVAL;
+			goto err;
+		}
+		topt->nro_opt.nro_status = 0;
+	}
+
 	nna = nm_os_malloc(sizeof(*nna));
 	if (nna == NULL) {
 		error = ENOMEM;
@@ -141,9 +312,23 @@ netmap_get_null_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 
 	nna->up.nm_txsync = netmap_null_sync;
 	nna->up.nm_rxsync = netmap_null_sync;
+	if (topt != NULL) {
+		nna->flags = topt->nro_flags;
+		nna->pkt_len = topt->nro_pkt_len;
+		nna->rate = topt->nro_rate;
+		if (nna->flags & NR_NULL_SINK)
+			nna->up.nm_txsync = netmap_null_txsync_sink;
+		if (nna->flags & NR_NULL_SOURCE) {
+			error = netmap_null_frame_init(nna);
+			if (error)
+				goto free_nna;
+			nna->up.nm_rxsync = netmap_null_rxsync_source;
+		}
+	}
 	nna->up.nm_register = netmap_null_reg;
+	nna->up.nm_dtor = netmap_null_dtor;
 	nna->up.nm_krings_create = netmap_null_krings_create;
-	nna->up.nm_krings_delete = netmap_krings_delete;
+	nna->up.nm_krings_delete = netmap_null_krings_delete;
 	nna->up.nm_bdg_attach = netmap_null_bdg_attach;
 	nna->up.nm_mem = netmap_mem_get(nmd);
 
@@ -162,6 +347,7 @@ netmap_get_null_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	return 0;
 
 free_nna:
+	netmap_null_dtor(&nna->up);
 	nm_os_free(nna);
 err:
 	return error;
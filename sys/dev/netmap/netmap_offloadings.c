@@ -64,25 +64,65 @@
 
 
 
+/* Headers of the GSO packet being segmented, as parsed by
+ * gso_parse_hdr().
+ */
+struct gso_state {
+	u_int ipv4;	/* IPv4 or IPv6 */
+	u_int tcp;	/* TCP or UDP */
+	u_int ethhlen;	/* 14, plus 4 for each 802.1q tag */
+	u_int iphlen;	/* including the IPv4 options or IPv6 extensions */
+	u_int l4hlen;	/* TCP header with options, or 8 for UDP */
+	rawsum_t pseudo; /* pseudo-header sum, without the length */
+};
+
+/* Fold a raw checksum to 16 bits, without complementing it. */
+static inline rawsum_t
+gso_csum_fold16(rawsum_t sum)
+{
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (sum & 0xFFFF) + (sum >> 16);
+}
+
+/* Add to 'sum' the checksum of 'len' bytes of 'data', which are found
+ * at offset 'off' in the checksummed area. The checksum is byte order
+ * independent, so a chunk starting at an odd offset only needs its
+ * partial sum to be byte-swapped (RFC 1071).
+ */
+static inline rawsum_t
+gso_csum_add(rawsum_t sum, uint8_t *data, size_t len, u_int off)
+{
+	rawsum_t part = gso_csum_fold16(nm_os_csum_raw(data, len, 0));
+
+	if (off & 1)
+		part = ((part & 0xFF) << 8) | (part >> 8);
+	return sum + part;
+}
+
 /* This routine is called by bdg_mismatch_datapath() when it finishes
  * accumulating bytes for a segment, in order to fix some fields in the
  * segment headers (which still contain the same content as the header
  * of the original GSO packet). 'pkt' points to the beginning of the IP
  * header of the segment, while 'len' is the length of the IP packet.
+ * 'payload_sum' is the sum of the segment payload, which has been
+ * collected while copying it, so that only the headers are read here.
  */
 static void
-gso_fix_segment(uint8_t *pkt, size_t len, u_int ipv4, u_int iphlen, u_int tcp,
-		u_int idx, u_int segmented_bytes, u_int last_segment)
+gso_fix_segment(uint8_t *pkt, size_t len, const struct gso_state *g,
+		u_int idx, u_int segmented_bytes, u_int last_segment,
+		rawsum_t payload_sum)
 {
 	struct nm_iphdr *iph = (struct nm_iphdr *)(pkt);
 	struct nm_ipv6hdr *ip6h = (struct nm_ipv6hdr *)(pkt);
+	uint8_t *l4 = pkt + g->iphlen;
+	uint16_t l4len = htobe16(len - g->iphlen);
 	uint16_t *check = NULL;
-	uint8_t *check_data = NULL;
+	rawsum_t sum;
 
-	if (ipv4) {
+	if (g->ipv4) {
 		/* Set the IPv4 "Total Length" field. */
 		iph->tot_len = htobe16(len);
-		nm_prdis("ip total length %u", be16toh(ip->tot_len));
+		nm_prdis("ip total length %u", be16toh(iph->tot_len));
 
 		/* Set the IPv4 "Identification" field. */
 		iph->id = htobe16(be16toh(iph->id) + idx);
@@ -93,12 +133,13 @@ gso_fix_segment(uint8_t *pkt, size_t len, u_int ipv4, u_int iphlen, u_int tcp,
 		iph->check = nm_os_csum_ipv4(iph);
 		nm_prdis("IP csum %x", be16toh(iph->check));
 	} else {
-		/* Set the IPv6 "Payload Len" field. */
-		ip6h->payload_len = htobe16(len-iphlen);
+		/* Set the IPv6 "Payload Len" field, which also covers
+		 * the extension headers. */
+		ip6h->payload_len = htobe16(len - sizeof(struct nm_ipv6hdr));
 	}
 
-	if (tcp) {
-		struct nm_tcphdr *tcph = (struct nm_tcphdr *)(pkt + iphlen);
+	if (g->tcp) {
+		struct nm_tcphdr *tcph = (struct nm_tcphdr *)l4;
 
 		/* Set the TCP sequence number. */
 		tcph->seq = htobe32(be32toh(tcph->seq) + segmented_bytes);
@@ -111,27 +152,160 @@ gso_fix_segment(uint8_t *pkt, size_t len, u_int ipv4, u_int iphlen, u_int tcp,
 		nm_prdis("last_segment %u", last_segment);
 
 		check = &tcph->check;
-		check_data = (uint8_t *)tcph;
 	} else { /* UDP */
-		struct nm_udphdr *udph = (struct nm_udphdr *)(pkt + iphlen);
+		struct nm_udphdr *udph = (struct nm_udphdr *)l4;
 
 		/* Set the UDP 'Length' field. */
-		udph->len = htobe16(len-iphlen);
+		udph->len = l4len;
 
 		check = &udph->check;
-		check_data = (uint8_t *)udph;
 	}
 
-	/* Compute and insert TCP/UDP checksum. */
+	/* Compute and insert TCP/UDP checksum: the L4 header and the
+	 * length are the only parts that change across segments. */
 	*check = 0;
-	if (ipv4)
-		nm_os_csum_tcpudp_ipv4(iph, check_data, len-iphlen, check);
-	else
-		nm_os_csum_tcpudp_ipv6(ip6h, check_data, len-iphlen, check);
+	sum = nm_os_csum_raw(l4, g->l4hlen, g->pseudo);
+	sum = nm_os_csum_raw((uint8_t *)&l4len, sizeof(l4len), sum);
+	*check = nm_os_csum_fold(gso_csum_fold16(sum) +
+				 gso_csum_fold16(payload_sum));
+	if (!g->tcp && *check == 0)
+		*check = 0xFFFF; /* zero means no checksum for UDP */
 
 	nm_prdis("TCP/UDP csum %x", be16toh(*check));
 }
 
+/* Parse the Ethernet, IP and TCP/UDP headers of a GSO packet. They are
+ * assumed to be in the first fragment, which is 'len' bytes long.
+ * Returns the length of the headers, or 0 if the packet must be dropped.
+ */
+static u_int
+gso_parse_hdr(uint8_t *hdr, size_t len, struct gso_state *g)
+{
+	uint16_t ethertype;
+	uint16_t proto;
+	u_int l4proto;
+
+	/* Look at the 'Ethertype' field to see if this packet
+	 * is IPv4 or IPv6, taking into account VLAN
+	 * encapsulation. */
+	g->ethhlen = 14;
+	for (;;) {
+		if (len < g->ethhlen) {
+			nm_prlim(1, "Short GSO fragment [eth], dropping");
+			return 0;
+		}
+		ethertype = be16toh(*((uint16_t *)(hdr + g->ethhlen - 2)));
+		if (ethertype != 0x8100) /* not 802.1q */
+			break;
+		g->ethhlen += 4;
+	}
+	switch (ethertype) {
+		case 0x0800:  /* IPv4 */
+		{
+			struct nm_iphdr *iph = (struct nm_iphdr *)
+						(hdr + g->ethhlen);
+
+			if (len < g->ethhlen + 20) {
+				nm_prlim(1, "Short GSO fragment "
+				      "[IPv4], dropping");
+				return 0;
+			}
+			g->ipv4 = 1;
+			g->iphlen = 4 * (iph->version_ihl & 0x0F);
+			l4proto = iph->protocol;
+			g->pseudo = nm_os_csum_raw((uint8_t *)&iph->saddr,
+					2 * sizeof(iph->saddr), 0);
+			break;
+		}
+		case 0x86DD:  /* IPv6 */
+		{
+			struct nm_ipv6hdr *ip6h = (struct nm_ipv6hdr *)
+						(hdr + g->ethhlen);
+
+			g->ipv4 = 0;
+			g->iphlen = sizeof(*ip6h);
+			if (len < g->ethhlen + g->iphlen) {
+				nm_prlim(1, "Short GSO fragment "
+				      "[IPv6], dropping");
+				return 0;
+			}
+			g->pseudo = nm_os_csum_raw(ip6h->saddr,
+				sizeof(ip6h->saddr) + sizeof(ip6h->daddr), 0);
+			/* Skip the extension headers that may precede
+			 * the TCP/UDP header. A routing header with
+			 * segments left would change the destination
+			 * address of the pseudo-header, and fragments
+			 * cannot be segmented. */
+			for (l4proto = ip6h->nexthdr;
+			     l4proto != 6 && l4proto != 17;) {
+				uint8_t *eh = hdr + g->ethhlen + g->iphlen;
+
+				if (l4proto != 0 && l4proto != 43 &&
+				    l4proto != 60) {
+					nm_prlim(1, "Unsupported IPv6 header %u, "
+					      "dropping GSO packet", l4proto);
+					return 0;
+				}
+				if (len < g->ethhlen + g->iphlen + 8) {
+					nm_prlim(1, "Short GSO fragment "
+					      "[IPv6 ext], dropping");
+					return 0;
+				}
+				if (l4proto == 43 && eh[3] != 0) {
+					nm_prlim(1, "Source routed GSO packet, "
+					      "dropping");
+					return 0;
+				}
+				l4proto = eh[0];
+				g->iphlen += 8 * (eh[1] + 1);
+			}
+			break;
+		}
+		default:
+			nm_prlim(1, "Unsupported ethertype, "
+			      "dropping GSO packet");
+			return 0;
+	}
+	nm_prdis(3, "type=%04x", ethertype);
+
+	if (len < g->ethhlen + g->iphlen) {
+		nm_prlim(1, "Short GSO fragment [IP], dropping");
+		return 0;
+	}
+	if (l4proto != (g->tcp ? 6 : 17)) {
+		nm_prlim(1, "GSO type does not match IP protocol %u, "
+		      "dropping", l4proto);
+		return 0;
+	}
+	proto = htobe16(l4proto);
+	g->pseudo = nm_os_csum_raw((uint8_t *)&proto, sizeof(proto),
+				   g->pseudo);
+
+	/* Compute the L4 header length. For TCP we need to read the
+	 * content of the 'Data Offset' field.
+	 */
+	if (g->tcp) {
+		struct nm_tcphdr *tcph = (struct nm_tcphdr *)
+					(hdr + g->ethhlen + g->iphlen);
+
+		if (len < g->ethhlen + g->iphlen + 20) {
+			nm_prlim(1, "Short GSO fragment "
+					"[TCP], dropping");
+			return 0;
+		}
+		g->l4hlen = 4 * (tcph->doff >> 4);
+	} else {
+		g->l4hlen = 8; /* UDP */
+	}
+
+	if (len < g->ethhlen + g->iphlen + g->l4hlen) {
+		nm_prlim(1, "Short GSO fragment [TCP/UDP], dropping");
+		return 0;
+	}
+
+	return g->ethhlen + g->iphlen + g->l4hlen;
+}
+
 static inline int
 vnet_hdr_is_bad(struct nm_vnet_hdr *vh)
 {
@@ -141,13 +315,44 @@ vnet_hdr_is_bad(struct nm_vnet_hdr *vh)
 		(gso_type != VIRTIO_NET_HDR_GSO_NONE &&
 		 gso_type != VIRTIO_NET_HDR_GSO_TCPV4 &&
 		 gso_type != VIRTIO_NET_HDR_GSO_UDP &&
-		 gso_type != VIRTIO_NET_HDR_GSO_TCPV6)
+		 gso_type != VIRTIO_NET_HDR_GSO_TCPV6 &&
+		 gso_type != VIRTIO_NET_HDR_GSO_UDP_L4)
 		||
 		 (vh->flags & ~(VIRTIO_NET_HDR_F_NEEDS_CSUM
 			       | VIRTIO_NET_HDR_F_DATA_VALID))
 	       );
 }
 
+/* Upper bound on the number of destination slots that
+ * bdg_mismatch_datapath() uses for the packet starting at 'ft_p'.
+ * Segmentation may need more slots than the input fragments, either
+ * because the destination frames are smaller or because an USO
+ * packet must be split at the datagram size chosen by the sender.
+ */
+u_int
+bdg_mismatch_slots(struct netmap_vp_adapter *na,
+		   struct netmap_vp_adapter *dst_na,
+		   const struct nm_bdg_fwd *ft_p)
+{
+	struct nm_vnet_hdr *vh = (struct nm_vnet_hdr *)ft_p->ft_buf;
+	u_int seg_len, len = 0, i;
+
+	if (!na->up.virt_hdr_len || dst_na->up.virt_hdr_len ||
+	    ft_p->ft_len < na->up.virt_hdr_len ||
+	    vh->gso_type == VIRTIO_NET_HDR_GSO_NONE ||
+	    dst_na->mfs <= WORST_CASE_GSO_HEADER)
+		return ft_p->ft_frags;
+
+	for (i = 0; i < ft_p->ft_frags; i++)
+		len += ft_p[i].ft_len;
+	seg_len = dst_na->mfs - WORST_CASE_GSO_HEADER;
+	if ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+			VIRTIO_NET_HDR_GSO_UDP_L4 &&
+	    vh->gso_size > 0 && vh->gso_size < seg_len)
+		seg_len = vh->gso_size;
+	return len / seg_len + 1;
+}
+
 /* The VALE mismatch datapath implementation. */
 void
 bdg_mismatch_datapath(struct netmap_vp_adapter *na,
@@ -249,15 +454,16 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		u_int gso_idx = 0;
 		/* Payload data bytes segmented so far (e.g. TCP data bytes). */
 		u_int segmented_bytes = 0;
-		/* Is this an IPv4 or IPv6 GSO packet? */
-		u_int ipv4 = 0;
-		/* Length of the IP header (20 if IPv4, 40 if IPv6). */
-		u_int iphlen = 0;
-		/* Length of the Ethernet header (18 if 802.1q, otherwise 14). */
-		u_int ethhlen = 14;
+		/* Maximum length of a segment. */
+		u_int seg_mfs = dst_na->mfs;
+		/* Sum of the payload of the current segment. */
+		rawsum_t payload_sum = 0;
+		uint8_t gso_type = vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+		struct gso_state g;
+
 		/* Is this a TCP or an UDP GSO packet? */
-		u_int tcp = ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN)
-				== VIRTIO_NET_HDR_GSO_UDP) ? 0 : 1;
+		g.tcp = (gso_type == VIRTIO_NET_HDR_GSO_UDP ||
+			 gso_type == VIRTIO_NET_HDR_GSO_UDP_L4) ? 0 : 1;
 
 		/* Segment the GSO packet contained into the input slots (frags). */
 		for (;;) {
@@ -272,80 +478,25 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 
 			/* Grab the GSO header if we don't have it. */
 			if (!gso_hdr) {
-				uint16_t ethertype;
-
 				gso_hdr = src;
-
-				/* Look at the 'Ethertype' field to see if this packet
-				 * is IPv4 or IPv6, taking into account VLAN
-				 * encapsulation. */
-				for (;;) {
-					if (src_len < ethhlen) {
-						nm_prlim(1, "Short GSO fragment [eth], dropping");
-						return;
-					}
-					ethertype = be16toh(*((uint16_t *)
-							    (gso_hdr + ethhlen - 2)));
-					if (ethertype != 0x8100) /* not 802.1q */
-						break;
-					ethhlen += 4;
-				}
-				switch (ethertype) {
-					case 0x0800:  /* IPv4 */
-					{
-						struct nm_iphdr *iph = (struct nm_iphdr *)
-									(gso_hdr + ethhlen);
-
-						if (src_len < ethhlen + 20) {
-							nm_prlim(1, "Short GSO fragment "
-							      "[IPv4], dropping");
-							return;
-						}
-						ipv4 = 1;
-						iphlen = 4 * (iph->version_ihl & 0x0F);
-						break;
-					}
-					case 0x86DD:  /* IPv6 */
-						ipv4 = 0;
-						iphlen = 40;
-						break;
-					default:
-						nm_prlim(1, "Unsupported ethertype, "
-						      "dropping GSO packet");
-						return;
-				}
-				nm_prdis(3, "type=%04x", ethertype);
-
-				if (src_len < ethhlen + iphlen) {
-					nm_prlim(1, "Short GSO fragment [IP], dropping");
+				gso_hdr_len = gso_parse_hdr(gso_hdr, src_len, &g);
+				if (gso_hdr_len == 0)
 					return;
-				}
-
-				/* Compute gso_hdr_len. For TCP we need to read the
-				 * content of the 'Data Offset' field.
-				 */
-				if (tcp) {
-					struct nm_tcphdr *tcph = (struct nm_tcphdr *)
-								(gso_hdr + ethhlen + iphlen);
-
-					if (src_len < ethhlen + iphlen + 20) {
-						nm_prlim(1, "Short GSO fragment "
-								"[TCP], dropping");
-						return;
-					}
-					gso_hdr_len = ethhlen + iphlen +
-						      4 * (tcph->doff >> 4);
-				} else {
-					gso_hdr_len = ethhlen + iphlen + 8; /* UDP */
-				}
-
-				if (src_len < gso_hdr_len) {
-					nm_prlim(1, "Short GSO fragment [TCP/UDP], dropping");
+				if (gso_hdr_len >= dst_na->mfs) {
+					nm_prlim(1, "GSO header longer than "
+					      "the frame size, dropping");
 					return;
 				}
+				/* USO segments are datagrams of the size
+				 * chosen by the sender, TSO segments can
+				 * be as large as the destination allows. */
+				if (gso_type == VIRTIO_NET_HDR_GSO_UDP_L4 &&
+				    vh->gso_size > 0 &&
+				    gso_hdr_len + vh->gso_size < seg_mfs)
+					seg_mfs = gso_hdr_len + vh->gso_size;
 
 				nm_prdis(3, "gso_hdr_len %u gso_mtu %d", gso_hdr_len,
-								   dst_na->mfs);
+								   seg_mfs);
 
 				/* Advance source pointers. */
 				src += gso_hdr_len;
@@ -367,24 +518,27 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 
 			/* Fill in data and update source and dest pointers. */
 			copy = src_len;
-			if (gso_bytes + copy > dst_na->mfs)
-				copy = dst_na->mfs - gso_bytes;
+			if (gso_bytes + copy > seg_mfs)
+				copy = seg_mfs - gso_bytes;
 			memcpy(dst + gso_bytes, src, copy);
+			/* Sum the payload while it is still in the cache. */
+			payload_sum = gso_csum_add(payload_sum, dst + gso_bytes,
+						   copy, gso_bytes - gso_hdr_len);
 			gso_bytes += copy;
 			src += copy;
 			src_len -= copy;
 
 			/* A segment is complete or we have processed all the
 			   the GSO payload bytes. */
-			if (gso_bytes >= dst_na->mfs ||
+			if (gso_bytes >= seg_mfs ||
 				(src_len == 0 && ft_p + 1 == ft_end)) {
 				/* After raw segmentation, we must fix some header
 				 * fields and compute checksums, in a protocol dependent
 				 * way. */
-				gso_fix_segment(dst + ethhlen, gso_bytes - ethhlen,
-						ipv4, iphlen, tcp,
-						gso_idx, segmented_bytes,
-						src_len == 0 && ft_p + 1 == ft_end);
+				gso_fix_segment(dst + g.ethhlen, gso_bytes - g.ethhlen,
+						&g, gso_idx, segmented_bytes,
+						src_len == 0 && ft_p + 1 == ft_end,
+						payload_sum);
 
 				nm_prdis("frame %u completed with %d bytes", gso_idx, (int)gso_bytes);
 				dst_slot->len = gso_bytes;
@@ -393,6 +547,7 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 				segmented_bytes += gso_bytes - gso_hdr_len;
 
 				gso_bytes = 0;
+				payload_sum = 0;
 				gso_idx++;
 
 				/* Next destination slot. */
@@ -417,6 +572,8 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		uint16_t *check = NULL;
 		/* Accumulator for an unfolded checksum. */
 		rawsum_t csum = 0;
+		/* Bytes summed so far. */
+		u_int csum_off = 0;
 
 		/* Process a non-GSO packet. */
 
@@ -432,11 +589,16 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		while (ft_p != ft_end) {
 			/* Init/update the packet checksum if needed. */
 			if (vh && (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
-				if (!dst_slots)
+				if (!dst_slots) {
 					csum = nm_os_csum_raw(src + vh->csum_start,
 								src_len - vh->csum_start, 0);
-				else
-					csum = nm_os_csum_raw(src, src_len, csum);
+					csum_off = src_len - vh->csum_start;
+				} else {
+					/* Fragments may have an odd length. */
+					csum = gso_csum_add(gso_csum_fold16(csum),
+							src, src_len, csum_off);
+					csum_off += src_len;
+				}
 			}
 
 			/* Round to a multiple of 64 */
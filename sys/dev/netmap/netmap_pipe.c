@@ -181,6 +181,243 @@ netmap_pipe_remove(struct netmap_adapter *parent, struct netmap_pipe_adapter *na
 	parent->na_pipes[n] = NULL;
 }
 
+/*
+ * Fan-out pipes (NETMAP_REQ_OPT_PIPE_FANOUT).
+ *
+ * Each tx ring of the master feeds all the rx rings of the slave, so
+ * that a pool of workers can each bind one slave ring. Since the
+ * position of a packet in the rx ring is no longer the position it
+ * had in the tx ring, these rings (marked NKR_FANOUT) own their
+ * buffers, and the txsync swaps the buffer of each tx slot with the
+ * one of a free rx slot. The tx slots are free again as soon as the
+ * txsync returns, but they come back with different buffers.
+ *
+ * Several tx rings may feed the same rx ring, so the rx side is
+ * protected by the q_lock of the rx kring. In the rx kring,
+ * nkr_hwlease is the next slot to fill and pipe_tail the end of the
+ * complete packets, which is what the rxsync publishes. While a
+ * multi-slot packet is being moved, pipe_frag points to the tx kring
+ * that owns the rx ring, which is not available to the other tx rings
+ * until the packet is complete.
+ */
+
+/* the rx kring currently locked by a fan-out txsync */
+struct nm_pipe_fanout_target {
+	struct netmap_kring *kring;
+	uint32_t tail;		/* pipe_tail when we locked it */
+};
+
+static void
+nm_pipe_fanout_unlock(struct nm_pipe_fanout_target *tg)
+{
+	struct netmap_kring *rxkring = tg->kring;
+	int notify;
+
+	if (rxkring == NULL)
+		return;
+	notify = (rxkring->pipe_tail != tg->tail);
+	mtx_unlock(&rxkring->q_lock);
+	tg->kring = NULL;
+	if (notify)
+		rxkring->nm_notify(rxkring, 0);
+}
+
+/* lock rxkring on behalf of txkring and return the number of slots
+ * we can fill. If there are none, ask the rxsync to wake us up. */
+static u_int
+nm_pipe_fanout_lock(struct nm_pipe_fanout_target *tg,
+		struct netmap_kring *txkring, struct netmap_kring *rxkring)
+{
+	int n;
+
+	if (tg->kring != rxkring) {
+		nm_pipe_fanout_unlock(tg);
+		mtx_lock(&rxkring->q_lock);
+		tg->kring = rxkring;
+		tg->tail = rxkring->pipe_tail;
+	}
+	if (unlikely(rxkring->ring == NULL) ||
+	    (rxkring->pipe_frag != NULL && rxkring->pipe_frag != txkring)) {
+		n = 0;
+	} else {
+		n = rxkring->nr_hwcur - rxkring->nkr_hwlease - 1;
+		if (n < 0)
+			n += rxkring->nkr_num_slots;
+	}
+	if (n == 0)
+		rxkring->pipe_blocked = 1;
+	return n;
+}
+
+/* choose and lock the rx kring for the packet starting at ts.
+ * Returns NULL if the chosen rings are full. */
+static struct netmap_kring *
+nm_pipe_fanout_pick(struct nm_pipe_fanout_target *tg,
+		struct netmap_kring *txkring, struct netmap_slot *ts)
+{
+	struct netmap_pipe_adapter *pna =
+		(struct netmap_pipe_adapter *)txkring->na;
+	struct netmap_adapter *ona = &pna->peer->up;
+	u_int nrx = ona->num_rx_rings, i;
+	struct netmap_kring *rxkring;
+
+	if (pna->fanout == NM_PIPE_FANOUT_HASH) {
+		u_int len = ts->len, max = NETMAP_BUF_SIZE(txkring->na);
+		uint64_t off = nm_get_offset(txkring, ts);
+
+		if (off >= max)
+			len = 0;
+		else if (len > max - off)
+			len = max - off;
+		i = nm_flow_hash(NMB_O(txkring, ts), len) % nrx;
+		rxkring = NMR(ona, NR_RX)[i];
+		return nm_pipe_fanout_lock(tg, txkring, rxkring) ? rxkring : NULL;
+	}
+
+	/* round robin, skipping the full rings */
+	for (i = 0; i < nrx; i++) {
+		rxkring = NMR(ona, NR_RX)[txkring->pipe_rr];
+		if (++txkring->pipe_rr >= nrx)
+			txkring->pipe_rr = 0;
+		if (nm_pipe_fanout_lock(tg, txkring, rxkring))
+			return rxkring;
+	}
+	return NULL;
+}
+
+static int
+netmap_pipe_fanout_txsync(struct netmap_kring *txkring, int flags)
+{
+	struct nm_pipe_fanout_target tg = { NULL, 0 };
+	struct netmap_kring *rxkring = txkring->pipe_frag;
+	struct netmap_ring *txring = txkring->ring;
+	u_int k, lim = txkring->nkr_num_slots - 1;
+	int m; /* slots to transfer */
+
+	m = txkring->rhead - txkring->nr_hwcur; /* new slots */
+	if (m < 0)
+		m += txkring->nkr_num_slots;
+
+	for (k = txkring->nr_hwcur; m; m--, k = nm_next(k, lim)) {
+		struct netmap_slot *ts = &txring->slot[k], *rs;
+		uint64_t off;
+		uint32_t idx;
+
+		if (rxkring == NULL) {
+			/* first slot of a packet */
+			rxkring = nm_pipe_fanout_pick(&tg, txkring, ts);
+			if (rxkring == NULL)
+				break;
+		} else if (nm_pipe_fanout_lock(&tg, txkring, rxkring) == 0) {
+			break;
+		}
+
+		/* swap the buffers. This also propagates any offset */
+		rs = &rxkring->ring->slot[rxkring->nkr_hwlease];
+		off = nm_get_offset(rxkring, rs);
+		idx = rs->buf_idx;
+		*rs = *ts;
+		if (nm_get_offset(rxkring, rs) < off) {
+			nm_write_offset(rxkring, rs, off);
+		}
+		rs->flags |= NS_BUF_CHANGED;
+		ts->buf_idx = idx;
+		ts->flags |= NS_BUF_CHANGED;
+		rxkring->nkr_hwlease = nm_next(rxkring->nkr_hwlease,
+				rxkring->nkr_num_slots - 1);
+
+		if (ts->flags & NS_MOREFRAG) {
+			rxkring->pipe_frag = txkring;
+		} else {
+			/* only publish complete packets */
+			rxkring->pipe_frag = NULL;
+			rxkring->pipe_tail = rxkring->nkr_hwlease;
+			rxkring = NULL;
+		}
+	}
+	nm_pipe_fanout_unlock(&tg);
+
+	txkring->pipe_frag = rxkring;
+	txkring->nr_hwcur = k;
+	txkring->nr_hwtail = nm_prev(k, lim);
+
+	return 0;
+}
+
+static int
+netmap_pipe_fanout_rxsync(struct netmap_kring *rxkring, int flags)
+{
+	struct netmap_adapter *ona = rxkring->pipe->na;
+	int wakeup = 0;
+	u_int i;
+
+	mtx_lock(&rxkring->q_lock);
+	rxkring->nr_hwtail = rxkring->pipe_tail;
+	if (rxkring->rhead != rxkring->nr_hwcur) {
+		rxkring->nr_hwcur = rxkring->rhead;
+		wakeup = rxkring->pipe_blocked;
+		rxkring->pipe_blocked = 0;
+	}
+	mtx_unlock(&rxkring->q_lock);
+
+	if (wakeup) {
+		/* any of the tx rings may be waiting for us */
+		for (i = 0; i < ona->num_tx_rings; i++) {
+			struct netmap_kring *txkring = NMR(ona, NR_TX)[i];
+
+			if (txkring->nr_mode == NKR_NETMAP_ON)
+				txkring->nm_notify(txkring, 0);
+		}
+	}
+
+	return 0;
+}
+
+/* called when the krings of a fan-out pipe are created */
+static void
+netmap_pipe_fanout_init(struct netmap_pipe_adapter *pna)
+{
+	struct netmap_adapter *mna = (pna->role == NM_PIPE_ROLE_MASTER) ?
+		&pna->up : &pna->peer->up;
+	u_int i;
+
+	for (i = 0; i < mna->num_tx_rings; i++) {
+		struct netmap_kring *txkring = NMR(mna, NR_TX)[i],
+				    *rxkring = txkring->pipe;
+
+		/* both rings get their own buffers */
+		txkring->nr_kflags &= ~NKR_FAKERING;
+		txkring->nr_kflags |= NKR_FANOUT;
+		txkring->pipe_frag = NULL;
+		txkring->pipe_rr = i;
+		rxkring->nr_kflags &= ~NKR_FAKERING;
+		rxkring->nr_kflags |= NKR_FANOUT;
+		rxkring->pipe_frag = NULL;
+		rxkring->pipe_blocked = 0;
+		rxkring->nkr_hwlease = rxkring->pipe_tail;
+	}
+}
+
+/* a fan-out ring is needed: all of them are, on both ends */
+static void
+nm_pipe_fanout_needring(struct netmap_kring *kring)
+{
+	struct netmap_adapter *ends[2] = { kring->na, kring->pipe->na };
+	enum txrx t;
+	int e, i;
+
+	for (e = 0; e < 2; e++) {
+		for_rx_tx(t) {
+			for (i = 0; i < nma_get_nrings(ends[e], t); i++) {
+				struct netmap_kring *k = NMR(ends[e], t)[i];
+
+				if (k->nr_kflags & NKR_FANOUT)
+					k->nr_kflags |= NKR_NEEDRING;
+			}
+		}
+	}
+}
+
 int
 netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 {
@@ -190,6 +427,9 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 	int complete; /* did we see a complete packet ? */
 	struct netmap_ring *txring = txkring->ring, *rxring = rxkring->ring;
 
+	if (txkring->nr_kflags & NKR_FANOUT)
+		return netmap_pipe_fanout_txsync(txkring, flags);
+
 	nm_prdis("%p: %s %x -> %s", txkring, txkring->name, flags, rxkring->name);
 	nm_prdis(20, "TX before: hwcur %d hwtail %d cur %d head %d tail %d",
 		txkring->nr_hwcur, txkring->nr_hwtail,
@@ -246,6 +486,9 @@ netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags)
 	int m; /* slots to release */
 	struct netmap_ring *txring = txkring->ring, *rxring = rxkring->ring;
 
+	if (rxkring->nr_kflags & NKR_FANOUT)
+		return netmap_pipe_fanout_rxsync(rxkring, flags);
+
 	nm_prdis("%p: %s %x -> %s", txkring, txkring->name, flags, rxkring->name);
 	nm_prdis(20, "RX before: hwcur %d hwtail %d cur %d head %d tail %d",
 		rxkring->nr_hwcur, rxkring->nr_hwtail,
@@ -263,15 +506,26 @@ netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags)
 		return 0;
 	}
 
+	/* The txsync has copied each tx slot into the rx slot with the
+	 * same index, so the two slots already point to the same buffer.
+	 * We only write to the tx slots (which are in the cache of the
+	 * sender) if the receiver has replaced the buffer, or may have
+	 * changed the offset.
+	 */
 	for (k = rxkring->nr_hwcur; m; m--, k = nm_next(k, lim)) {
 		struct netmap_slot *rs = &rxring->slot[k];
 		struct netmap_slot *ts = &txring->slot[k];
 
-		/* copy the slot. This also propagates any offset */
-		*ts = *rs;
-		if (rs->flags & NS_BUF_CHANGED) {
+		if (unlikely(rs->flags & NS_BUF_CHANGED)) {
+			/* tell the sender, see NS_BUF_CHANGED */
+			ts->buf_idx = rs->buf_idx;
+			ts->flags |= NS_BUF_CHANGED;
 			rs->flags &= ~NS_BUF_CHANGED;
 		}
+		if (unlikely(rxkring->offset_mask)) {
+			/* propagate any offset */
+			ts->ptr = rs->ptr;
+		}
 	}
 
 	mb(); /* make sure the slots are updated before publishing them */
@@ -381,9 +635,14 @@ netmap_pipe_krings_create(struct netmap_adapter *na)
 	struct netmap_pipe_adapter *pna =
 		(struct netmap_pipe_adapter *)na;
 	struct netmap_adapter *ona = &pna->peer->up;
+	int error;
 
-	if (pna->peer_ref)
-		return netmap_pipe_krings_create_both(na, ona);
+	if (pna->peer_ref) {
+		error = netmap_pipe_krings_create_both(na, ona);
+		if (error == 0 && pna->fanout != NM_PIPE_FANOUT_NONE)
+			netmap_pipe_fanout_init(pna);
+		return error;
+	}
 
 	return 0;
 }
@@ -398,7 +657,11 @@ netmap_pipe_reg_both(struct netmap_adapter *na, struct netmap_adapter *ona)
 		for (i = 0; i < nma_get_nrings(na, t); i++) {
 			struct netmap_kring *kring = NMR(na, t)[i];
 
-			if (nm_kring_pending_on(kring)) {
+			if (!nm_kring_pending_on(kring))
+				continue;
+			if (kring->nr_kflags & NKR_FANOUT) {
+				nm_pipe_fanout_needring(kring);
+			} else {
 				/* mark the peer ring as needed */
 				kring->pipe->nr_kflags |= NKR_NEEDRING;
 			}
@@ -420,6 +683,10 @@ netmap_pipe_reg_both(struct netmap_adapter *na, struct netmap_adapter *ona)
 			if (nm_kring_pending_on(kring)) {
 
 				kring->nr_mode = NKR_NETMAP_ON;
+				if (kring->nr_kflags & NKR_FANOUT) {
+					/* the ring uses its own buffers */
+					continue;
+				}
 				if ((kring->nr_kflags & NKR_FAKERING) &&
 				    (kring->pipe->nr_kflags & NKR_FAKERING)) {
 					/* this is a re-open of a pipe
@@ -564,6 +831,12 @@ cleanup:
 			if (ring == NULL)
 				continue;
 
+			if (kring->nr_kflags & NKR_FANOUT) {
+				/* all the buffers in the ring are ours */
+				kring->nr_kflags &= ~NKR_NEEDRING;
+				continue;
+			}
+
 			if (kring->tx == NR_RX)
 				ring->slot[kring->pipe_tail].buf_idx = 0;
 
@@ -657,6 +930,7 @@ netmap_get_pipe_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	struct nmreq_register *req = (struct nmreq_register *)(uintptr_t)hdr->nr_body;
 	struct netmap_adapter *pna; /* parent adapter */
 	struct netmap_pipe_adapter *mna, *sna, *reqna;
+	struct nmreq_opt_pipe_fanout *fopt;
 	struct ifnet *ifp = NULL;
 	const char *pipe_id = NULL;
 	int role = 0;
@@ -690,6 +964,15 @@ netmap_get_pipe_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 		return EINVAL;
 	}
 
+	fopt = (struct nmreq_opt_pipe_fanout *)
+		nmreq_getoption(hdr, NETMAP_REQ_OPT_PIPE_FANOUT);
+	if (fopt != NULL && fopt->nro_mode != NM_PIPE_FANOUT_NONE &&
+	    fopt->nro_mode != NM_PIPE_FANOUT_RR &&
+	    fopt->nro_mode != NM_PIPE_FANOUT_HASH) {
+		nm_prerr("unknown pipe fan-out mode %u", fopt->nro_mode);
+		return EINVAL;
+	}
+
 	/* first, try to find the parent adapter */
 	for (;;) {
 		int create_error;
@@ -763,6 +1046,7 @@ netmap_get_pipe_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	mna->role = NM_PIPE_ROLE_MASTER;
 	mna->parent = pna;
 	mna->parent_ifp = ifp;
+	mna->fanout = fopt ? fopt->nro_mode : NM_PIPE_FANOUT_NONE;
 
 	mna->up.nm_txsync = netmap_pipe_txsync;
 	mna->up.nm_rxsync = netmap_pipe_rxsync;
@@ -840,6 +1124,11 @@ found:
 
 	nm_prdis("pipe %s %s at %p", pipe_id,
 		(reqna->role == NM_PIPE_ROLE_MASTER ? "master" : "slave"), reqna);
+	if (fopt != NULL) {
+		/* report the mode the pipe was created with */
+		fopt->nro_mode = reqna->fanout;
+		fopt->nro_opt.nro_status = 0;
+	}
 	*na = &reqna->up;
 	netmap_adapter_get(*na);
 
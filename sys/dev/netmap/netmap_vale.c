@@ -85,8 +85,8 @@ __FBSDID("$FreeBSD$");
 /*
  * system parameters (most of them in netmap_kern.h)
  * NM_BDG_NAME		prefix for switch port names, default "vale"
- * NM_BDG_MAXPORTS	number of ports
- * NM_BRIDGES		max number of switches in the system.
+ * NM_BDG_PORTS		default number of ports (netmap_bdg_max_ports)
+ * NM_BRIDGES		default number of switches (vale_max_bridges)
  *
  * Switch ports are named valeX:Y where X is the switch name and Y
  * is the port. If Y matches a physical interface name, the port is
@@ -106,6 +106,26 @@ __FBSDID("$FreeBSD$");
 #define NM_BDG_BATCH_MAX	(NM_BDG_BATCH + NETMAP_MAX_FRAGS)
 /* NM_FT_NULL terminates a list of slots in the ft */
 #define NM_FT_NULL		NM_BDG_BATCH_MAX
+/* the broadcast queue follows the port:ring queues */
+#define NM_BDG_BRDQ		(netmap_bdg_max_ports * NM_BDG_MAXRINGS)
+
+/*
+ * Work area for the batch lookup, one entry per packet. It follows
+ * the queues in the forwarding table of each ring, and it is followed
+ * by the destination indexes (NM_BDG_BATCH_MAX plus one per port,
+ * for the broadcast traffic).
+ */
+struct nm_vale_batch {
+	struct nm_bdg_fwd	*pkts[NM_BDG_BATCH_MAX];
+	uint32_t		ports[NM_BDG_BATCH_MAX];
+	uint16_t		idx[NM_BDG_BATCH_MAX];
+	uint8_t			rings[NM_BDG_BATCH_MAX];
+};
+#define NM_VALE_BATCH(dst_ents)	\
+	((struct nm_vale_batch *)((dst_ents) + NM_BDG_BRDQ + 1))
+#define NM_VALE_DSTS(dst_ents)	\
+	((uint16_t *)(NM_VALE_BATCH(dst_ents) + 1))
+#define NM_VALE_NDSTS		(NM_BDG_BATCH_MAX + netmap_bdg_max_ports)
 
 
 /*
@@ -118,14 +138,60 @@ static int bridge_batch = NM_BDG_BATCH; /* bridge batch size */
 /* Max number of vale bridges (loader tunable). */
 unsigned int vale_max_bridges = NM_BRIDGES;
 
+/* Lifetime of the entries of the learning table. */
+static unsigned int vale_hash_ttl = 300;
+
+/* Swap buffers instead of copying between ports sharing the memory. */
+static int vale_zcopy = 1;
+
+/* Send multicast only to the ports that joined the group. */
+static int vale_mcast_snoop = 0;
+
+/* Deliver broadcast and multicast by reference, see nm_vale_flush(). */
+static int vale_brd_zcopy = 0;
+
+/* Spread the frames sent to a NIC over its tx rings, see nm_vale_flush(). */
+static int vale_uplink_hash = 1;
+
 SYSBEGIN(vars_vale);
 SYSCTL_DECL(_dev_netmap);
 SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch, CTLFLAG_RW, &bridge_batch, 0,
 		"Max batch size to be used in the bridge");
 SYSCTL_UINT(_dev_netmap, OID_AUTO, max_bridges, CTLFLAG_RDTUN, &vale_max_bridges, 0,
 		"Max number of vale bridges");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, vale_hash_ttl, CTLFLAG_RW, &vale_hash_ttl, 0,
+		"Seconds before a learned address expires (0: never)");
+SYSCTL_INT(_dev_netmap, OID_AUTO, vale_zcopy, CTLFLAG_RW, &vale_zcopy, 0,
+		"Swap buffers between VALE ports sharing the same memory");
+SYSCTL_INT(_dev_netmap, OID_AUTO, vale_mcast_snoop, CTLFLAG_RW,
+		&vale_mcast_snoop, 0,
+		"Replicate multicast to the IGMP/MLD subscribers only");
+SYSCTL_INT(_dev_netmap, OID_AUTO, vale_brd_zcopy, CTLFLAG_RW,
+		&vale_brd_zcopy, 0,
+		"Share one buffer among the receivers of a VALE broadcast");
+SYSCTL_INT(_dev_netmap, OID_AUTO, vale_uplink_hash, CTLFLAG_RW,
+		&vale_uplink_hash, 0,
+		"Choose the NIC tx ring of a VALE frame by its flow");
 SYSEND;
 
+/* Epoch of the learning table entries, in seconds since boot. */
+#if defined(__FreeBSD__)
+#define NM_HT_NOW()	((uint32_t)time_uptime)
+#elif defined(linux)
+#define NM_HT_NOW()	((uint32_t)(get_jiffies_64() / HZ))
+#else
+#define NM_HT_NOW()	0 /* entries never age */
+#endif
+
+/* Clock of the token buckets of the rate limited ports. */
+#if defined(__FreeBSD__)
+#define NM_VALE_NOW_NS()	((uint64_t)sbttons(sbinuptime()))
+#define NM_VALE_DIV64(a, b)	((a) / (b))
+#elif defined(linux)
+#define NM_VALE_NOW_NS()	((uint64_t)ktime_get_ns())
+#define NM_VALE_DIV64(a, b)	div64_u64(a, b)
+#endif
+
 static int netmap_vale_vp_create(struct nmreq_header *hdr, struct ifnet *,
 		struct netmap_mem_d *nmd, struct netmap_vp_adapter **);
 static int netmap_vale_vp_bdg_attach(const char *, struct netmap_adapter *,
@@ -184,6 +250,48 @@ pkt_copy(void *_src, void *_dst, int l)
 	}
 }
 
+#ifdef WITH_BENCH
+/* NR_BENCH_COPY, kept here so that pkt_copy() is inlined as usual */
+void
+nm_vale_bench_copy(void *src, void *dst, u_int len, u_int count)
+{
+	while (count--)
+		pkt_copy(src, dst, len);
+}
+#endif /* WITH_BENCH */
+
+
+/*
+ * True if the buffer of slot 'j' of src_kring can be swapped into
+ * dst_kring, i.e., if its offset is one that the receiver can be
+ * told about.
+ */
+static inline int
+nm_vale_swap_ok(struct netmap_kring *src_kring,
+		struct netmap_kring *dst_kring, u_int j)
+{
+	uint64_t off = nm_get_offset(src_kring, &src_kring->ring->slot[j]);
+
+	return off == 0 || (off <= dst_kring->offset_max &&
+			(off & ~dst_kring->offset_mask) == 0);
+}
+
+/*
+ * Number of destination slots for the packet starting at ft_p, when
+ * each slot can hold at least 'room' bytes of a fragment.
+ */
+static inline u_int
+nm_vale_dst_slots(const struct nm_bdg_fwd *ft_p, u_int room)
+{
+	u_int k, n = 0;
+
+	for (k = 0; k < ft_p->ft_frags; k++) {
+		u_int len = ft_p[k].ft_len;
+
+		n += len <= room ? 1 : (len + room - 1) / room;
+	}
+	return n;
+}
 
 /*
  * Free the forwarding tables for rings attached to switch ports.
@@ -217,10 +325,11 @@ nm_alloc_bdgfwd(struct netmap_adapter *na)
 
 	NMG_LOCK_ASSERT();
 	/* all port:rings + broadcast */
-	num_dstq = NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1;
+	num_dstq = NM_BDG_BRDQ + 1;
 	l = sizeof(struct nm_bdg_fwd) * NM_BDG_BATCH_MAX;
 	l += sizeof(struct nm_vale_q) * num_dstq;
-	l += sizeof(uint16_t) * NM_BDG_BATCH_MAX;
+	l += sizeof(struct nm_vale_batch);
+	l += sizeof(uint16_t) * NM_VALE_NDSTS;
 
 	nrings = netmap_real_rings(na, NR_TX);
 	kring = na->tx_rings;
@@ -373,7 +482,7 @@ netmap_vale_list(struct nmreq_header *hdr)
 		NMG_LOCK();
 		for (error = ENOENT; i < vale_max_bridges; i++) {
 			b = bridges + i;
-			for ( ; j < NM_BDG_MAXPORTS; j++) {
+			for ( ; j < netmap_bdg_max_ports; j++) {
 				if (b->bdg_ports[j] == NULL)
 					continue;
 				vpna = b->bdg_ports[j];
@@ -394,6 +503,134 @@ netmap_vale_list(struct nmreq_header *hdr)
 	return error;
 }
 
+/* entries of NETMAP_REQ_VALE_LIST_BULK filled at a time */
+#define NM_VALE_LIST_CHUNK	32
+
+static void
+nm_vale_list_entry_fill(struct nmreq_vale_list_entry *e,
+		struct netmap_vp_adapter *vpna, u_int bi, u_int pi)
+{
+	struct netmap_adapter *na = &vpna->up;
+	struct nmreq_port_info_get *info = &e->nr_info;
+
+	memset(e, 0, sizeof(*e));
+	strlcpy(e->nr_name, na->name, sizeof(e->nr_name));
+	e->nr_bridge_idx = bi;
+	e->nr_port_idx = pi;
+	netmap_mem_get_info(na->nm_mem, &info->nr_memsize, NULL,
+		&info->nr_mem_id);
+	netmap_update_config(na);
+	info->nr_rx_rings = na->num_rx_rings;
+	info->nr_tx_rings = na->num_tx_rings;
+	info->nr_rx_slots = na->num_rx_desc;
+	info->nr_tx_slots = na->num_tx_desc;
+	info->nr_host_tx_rings = na->num_host_tx_rings;
+	info->nr_host_rx_rings = na->num_host_rx_rings;
+	info->nr_meta_caps = na->rx_meta_caps | NM_META_SW_CAPS |
+		na->tx_meta_caps;
+}
+
+/*
+ * The arrays of NETMAP_REQ_VALE_LIST_BULK and NETMAP_REQ_VALE_HASH_GET/SET
+ * may be in userspace.
+ */
+static int
+nm_vale_array_copyout(struct nmreq_header *hdr, void *dst, const void *src,
+		size_t len)
+{
+	if (hdr->nr_reserved)
+		return copyout(src, dst, len);
+	memcpy(dst, src, len);
+	return 0;
+}
+
+static int
+nm_vale_array_copyin(struct nmreq_header *hdr, void *dst, const void *src,
+		size_t len)
+{
+	if (hdr->nr_reserved)
+		return copyin(src, dst, len);
+	memcpy(dst, src, len);
+	return 0;
+}
+
+/*
+ * Process NETMAP_REQ_VALE_LIST_BULK. The ports are collected under
+ * NMG_LOCK, as NETMAP_REQ_VALE_LIST does, a chunk at a time so that the
+ * kernel buffer stays small whatever the size of the user array. The
+ * switches themselves are not locked, so the forwarding goes on.
+ */
+int
+netmap_vale_list_bulk(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_list_bulk *req =
+		(struct nmreq_vale_list_bulk *)(uintptr_t)hdr->nr_body;
+	struct nmreq_vale_list_entry *chunk, *uentries =
+		(struct nmreq_vale_list_entry *)(uintptr_t)req->nr_entries;
+	struct nm_bridge *b, *bridges;
+	u_int num_bridges, i, j, last, n = 0, k = 0;
+	int error = 0;
+
+	if (req->nr_num == 0 || req->nr_num > NR_VALE_LIST_BULK_MAX ||
+	    uentries == NULL)
+		return EINVAL;
+	chunk = nm_os_malloc(NM_VALE_LIST_CHUNK * sizeof(*chunk));
+	if (chunk == NULL)
+		return ENOMEM;
+
+	netmap_bns_getbridges(&bridges, &num_bridges);
+	i = req->nr_bridge_idx;
+	j = req->nr_port_idx;
+	last = vale_max_bridges;
+	NMG_LOCK();
+	if (hdr->nr_name[0] != '\0') {
+		/* only one switch */
+		if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+			error = EINVAL;
+			goto out;
+		}
+		b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+		if (b == NULL) {
+			error = ENOENT;
+			goto out;
+		}
+		last = b - bridges + 1;
+		if (i < last - 1) {
+			i = last - 1;
+			j = 0;
+		}
+	}
+	for (; i < last && n < req->nr_num; i++, j = 0) {
+		b = bridges + i;
+		for (; j < netmap_bdg_max_ports && n < req->nr_num; j++) {
+			if (b->bdg_ports[j] == NULL)
+				continue;
+			nm_vale_list_entry_fill(chunk + k, b->bdg_ports[j], i, j);
+			n++;
+			if (++k < NM_VALE_LIST_CHUNK)
+				continue;
+			/* flush the chunk */
+			error = nm_vale_array_copyout(hdr, uentries + n - k,
+					chunk, k * sizeof(*chunk));
+			if (error)
+				goto out;
+			k = 0;
+		}
+		if (j < netmap_bdg_max_ports)
+			break; /* the array is full, resume from here */
+	}
+	if (k > 0)
+		error = nm_vale_array_copyout(hdr, uentries + n - k, chunk,
+				k * sizeof(*chunk));
+	req->nr_num = n;
+	req->nr_bridge_idx = i;
+	req->nr_port_idx = j;
+out:
+	NMG_UNLOCK();
+	nm_os_free(chunk);
+	return error;
+}
+
 
 /* nm_dtor callback for ephemeral VALE ports */
 static void
@@ -454,6 +691,18 @@ netmap_vale_vp_krings_create(struct netmap_adapter *na)
 		netmap_krings_delete(na);
 		return error;
 	}
+	/* not fatal, broadcasts are copied if this fails */
+	if (vale_brd_zcopy)
+		netmap_mem_bufrefs_enable(na->nm_mem);
+#ifdef NM_VALE_NOW_NS
+	/* not fatal either, deferred slots then wait for the next sync */
+	for (i = 0; i < netmap_real_rings(na, NR_TX); i++) {
+		struct netmap_kring *kring = na->tx_rings[i];
+
+		kring->defer_timer = nm_os_timer_create(nm_vale_defer_timeout,
+				kring);
+	}
+#endif /* NM_VALE_NOW_NS */
 
 	return 0;
 }
@@ -463,6 +712,16 @@ netmap_vale_vp_krings_create(struct netmap_adapter *na)
 static void
 netmap_vale_vp_krings_delete(struct netmap_adapter *na)
 {
+	int i;
+
+	for (i = 0; i < netmap_real_rings(na, NR_TX); i++) {
+		struct netmap_kring *kring = na->tx_rings[i];
+
+		if (kring->defer_timer != NULL) {
+			nm_os_timer_destroy(kring->defer_timer);
+			kring->defer_timer = NULL;
+		}
+	}
 	nm_free_bdgfwd(na);
 	netmap_krings_delete(na);
 }
@@ -470,7 +729,10 @@ netmap_vale_vp_krings_delete(struct netmap_adapter *na)
 
 static int
 nm_vale_flush(struct nm_bdg_fwd *ft, u_int n,
-	struct netmap_vp_adapter *na, u_int ring_nr);
+	struct netmap_vp_adapter *na, u_int ring_nr, int maysleep);
+#ifdef NM_VALE_NOW_NS
+static void nm_vale_defer_timeout(void *);
+#endif /* NM_VALE_NOW_NS */
 
 
 /*
@@ -478,10 +740,11 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n,
  * Grab packets from a kring, move them into the ft structure
  * associated to the tx (input) port. Max one instance per port,
  * filtered on input (ioctl, poll or XXX).
+ * 'maysleep' tells whether we can wait for the bridge lock.
  * Returns the next position in the ring.
  */
 static int
-nm_vale_preflush(struct netmap_kring *kring, u_int end)
+nm_vale_preflush(struct netmap_kring *kring, u_int end, int maysleep)
 {
 	struct netmap_vp_adapter *na =
 		(struct netmap_vp_adapter*)kring->na;
@@ -492,13 +755,15 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 	u_int ft_i = 0;	/* start from 0 */
 	u_int frags = 1; /* how many frags ? */
 	struct nm_bridge *b = na->na_bdg;
+	uint64_t pkts = 0, bytes = 0;
 
 	/* To protect against modifications to the bridge we acquire a
 	 * shared lock, waiting if we can sleep (if the source port is
-	 * attached to a user process) or with a trylock otherwise (NICs).
+	 * attached to a user process) or with a trylock otherwise (NICs,
+	 * deadline of the deferred slots).
 	 */
 	nm_prdis("wait rlock for %d packets", ((j > end ? lim+1 : 0) + end) - j);
-	if (na->up.na_flags & NAF_BDG_MAYSLEEP)
+	if (maysleep)
 		BDG_RLOCK(b);
 	else if (!BDG_RTRYLOCK(b))
 		return j;
@@ -512,6 +777,7 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 		ft[ft_i].ft_len = slot->len;
 		ft[ft_i].ft_flags = slot->flags;
 		ft[ft_i].ft_offset = 0;
+		ft[ft_i].ft_slot = j;
 
 		nm_prdis("flags is 0x%x", slot->flags);
 		/* we do not use the buf changed flag, but we still need to reset it */
@@ -519,9 +785,11 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 
 		/* this slot goes into a list so initialize the link field */
 		ft[ft_i].ft_next = NM_FT_NULL;
-		buf = ft[ft_i].ft_buf = (slot->flags & NS_INDIRECT) ?
+		buf = ft[ft_i].ft_buf = (ft[ft_i].ft_flags & NS_INDIRECT) ?
 			(void *)(uintptr_t)slot->ptr : NMB_O(kring, slot);
 		if (unlikely(buf == NULL ||
+		     /* no user memory if we cannot sleep */
+		     (!maysleep && (ft[ft_i].ft_flags & NS_INDIRECT)) ||
 		     slot->len > NETMAP_BUF_SIZE(&na->up) - nm_get_offset(kring, slot))) {
 			nm_prlim(5, "NULL %s buffer pointer from %s slot %d len %d",
 				(slot->flags & NS_INDIRECT) ? "INDIRECT" : "DIRECT",
@@ -529,19 +797,23 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 			buf = ft[ft_i].ft_buf = NETMAP_BUF_BASE(&na->up);
 			ft[ft_i].ft_len = 0;
 			ft[ft_i].ft_flags = 0;
+			ft[ft_i].ft_slot = NR_NOSLOT;
 		}
 		__builtin_prefetch(buf);
+		bytes += ft[ft_i].ft_len;
 		++ft_i;
 		if (slot->flags & NS_MOREFRAG) {
 			frags++;
 			continue;
 		}
+		pkts++;
 		if (unlikely(netmap_verbose && frags > 1))
 			nm_prlim(5, "%d frags at %d", frags, ft_i - frags);
 		ft[ft_i - frags].ft_frags = frags;
 		frags = 1;
 		if (unlikely((int)ft_i >= bridge_batch))
-			ft_i = nm_vale_flush(ft, ft_i, na, ring_nr);
+			ft_i = nm_vale_flush(ft, ft_i, na, ring_nr,
+					maysleep);
 	}
 	if (frags > 1) {
 		/* Here ft_i > 0, ft[ft_i-1].flags has NS_MOREFRAG, and we
@@ -550,10 +822,13 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 		ft[ft_i - 1].ft_flags &= ~NS_MOREFRAG;
 		ft[ft_i - frags].ft_frags = frags;
 		nm_prlim(5, "Truncate incomplete fragment at %d (%d frags)", ft_i, frags);
+		pkts++;
 	}
 	if (ft_i)
-		ft_i = nm_vale_flush(ft, ft_i, na, ring_nr);
+		ft_i = nm_vale_flush(ft, ft_i, na, ring_nr, maysleep);
 	BDG_RUNLOCK(b);
+	na->bdg_stats.tx_pkts += pkts;
+	na->bdg_stats.tx_bytes += bytes;
 	return j;
 }
 
@@ -593,12 +868,373 @@ nm_vale_rthash(const uint8_t *addr)
 	a += addr[0];
 
 	mix(a, b, c);
-#define BRIDGE_RTHASH_MASK	(NM_BDG_HASH-1)
-	return (c & BRIDGE_RTHASH_MASK);
+	return c;
+}
+
+#define NM_RD32(p)	((uint32_t)(p)[0] << 24 | (p)[1] << 16 | (p)[2] << 8 | (p)[3])
+
+/*
+ * Hash of the flow of a frame: addresses, protocol and ports for IPv4
+ * and IPv6 (with at most one VLAN tag), MAC addresses otherwise.
+ * Only the first 'len' bytes are looked at.
+ */
+static uint32_t
+nm_vale_flow_hash(const uint8_t *buf, u_int len)
+{
+	uint32_t a = 0x9e3779b9, b = 0x9e3779b9, c = 0; // hash key
+	u_int l3 = 14, l4, proto, i;
+	uint16_t type;
+
+	if (len < 14)
+		return 0;
+	type = buf[12] << 8 | buf[13];
+	if (type == 0x8100 && len >= 18) {
+		type = buf[16] << 8 | buf[17];
+		l3 = 18;
+	}
+	if (type == 0x0800 && len >= l3 + 20) {
+		const uint8_t *ip = buf + l3;
+
+		a += NM_RD32(ip + 12);
+		b += NM_RD32(ip + 16);
+		proto = ip[9];
+		l4 = l3 + ((ip[0] & 0xf) << 2);
+		if ((ip[6] & 0x3f) | ip[7])
+			proto = 0; /* fragment, no ports */
+	} else if (type == 0x86dd && len >= l3 + 40) {
+		const uint8_t *ip6 = buf + l3;
+
+		for (i = 0; i < 16; i += 4) {
+			a += NM_RD32(ip6 + 8 + i);
+			b += NM_RD32(ip6 + 24 + i);
+			mix(a, b, c);
+		}
+		proto = ip6[6];
+		l4 = l3 + 40;
+	} else {
+		a += NM_RD32(buf);
+		b += NM_RD32(buf + 4);
+		c += NM_RD32(buf + 8);
+		mix(a, b, c);
+		return c;
+	}
+	c += proto;
+	if ((proto == 6 /* TCP */ || proto == 17 /* UDP */ ||
+	    proto == 132 /* SCTP */) && len >= l4 + 4)
+		a += NM_RD32(buf + l4);
+	mix(a, b, c);
+	return c;
 }
 
+#undef NM_RD32
 #undef mix
 
+/* Age of an entry. The epoch has 32 bits, so it cannot wrap around
+ * and make an old entry look fresh again.
+ */
+static inline u_int
+nm_vale_ht_age(uint32_t epoch, uint32_t now)
+{
+	return (uint32_t)(now - epoch);
+}
+
+static inline int
+nm_vale_ht_expired(uint32_t epoch, uint32_t now)
+{
+	u_int ttl = vale_hash_ttl;
+
+	return ttl != 0 && nm_vale_ht_age(epoch, now) > ttl;
+}
+
+static inline struct nm_hash_bucket *
+nm_vale_ht_bucket(struct nm_hash_table *ht, const uint8_t *addr)
+{
+	return ht->buckets + (nm_vale_rthash(addr) & (ht->nbuckets - 1));
+}
+
+/*
+ * Lookups run without locks, concurrently with the updates done by
+ * other senders. Updates always write 'ports' (with the epoch) before
+ * 'mac', and an entry is invalidated before being reused for a
+ * different address. Readers check 'mac' again after reading 'ports',
+ * as with a seqlock: if the entry was reused meanwhile they flood the
+ * frame rather than pairing an address with the port of another one.
+ */
+static inline uint32_t
+nm_vale_ht_lookup(struct nm_hash_table *ht, const uint8_t *addr,
+		uint64_t mac, uint32_t now)
+{
+	struct nm_hash_bucket *bkt = nm_vale_ht_bucket(ht, addr);
+	int i;
+
+	for (i = 0; i < NM_BDG_HASH_WAYS; i++) {
+		struct nm_hash_ent *e = &bkt->ent[i];
+		uint64_t m = e->mac;
+		uint64_t ports;
+
+		if (m == 0 || m != mac)
+			continue;
+		nm_ldld_barrier();
+		ports = e->ports;
+		nm_ldld_barrier();
+		if (unlikely(e->mac != mac))
+			break; /* reused under our feet */
+		if (unlikely(nm_vale_ht_expired(NM_HT_EPOCH(ports), now)))
+			break;
+		return NM_HT_PORT(ports);
+	}
+	return NM_BDG_BROADCAST;
+}
+
+/* Record that 'mac' was seen at time 'epoch' on 'port'. */
+static inline void
+nm_vale_ht_learn(struct nm_hash_table *ht, const uint8_t *addr,
+		uint64_t mac, uint32_t port, uint32_t epoch, uint32_t now)
+{
+	struct nm_hash_bucket *bkt = nm_vale_ht_bucket(ht, addr);
+	struct nm_hash_ent *victim = NULL;
+	uint64_t ent = NM_HT_ENT(port, epoch);
+	u_int victim_age = 0;
+	int i;
+
+	for (i = 0; i < NM_BDG_HASH_WAYS; i++) {
+		struct nm_hash_ent *e = &bkt->ent[i];
+		uint64_t m = e->mac;
+		u_int age;
+
+		if (m != 0 && m == mac) {
+			/* refresh, avoid dirtying the cache line if possible */
+			if (e->ports != ent)
+				e->ports = ent;
+			return;
+		}
+		/* empty entries are the oldest */
+		age = m == 0 ? ~0U : nm_vale_ht_age(NM_HT_EPOCH(e->ports), now);
+		if (victim == NULL || age > victim_age) {
+			victim = e;
+			victim_age = age;
+		}
+	}
+	/* not found, reuse the empty, expired or oldest entry */
+	victim->mac = 0;
+	nm_stst_barrier();
+	victim->ports = ent;
+	nm_stst_barrier();
+	victim->mac = mac;
+}
+
+
+/* Remove the entry that maps 'mac' to 'port', if any. */
+static void
+nm_vale_ht_forget(struct nm_hash_table *ht, uint64_t mac, uint64_t port)
+{
+	struct nm_hash_bucket *bkt;
+	uint8_t addr[6];
+	int i;
+
+	for (i = 0; i < 6; i++)
+		addr[i] = mac >> (8 * i);
+	bkt = nm_vale_ht_bucket(ht, addr);
+	for (i = 0; i < NM_BDG_HASH_WAYS; i++) {
+		struct nm_hash_ent *e = &bkt->ent[i];
+
+		if (e->mac == mac && NM_HT_PORT(e->ports) == port)
+			e->mac = 0;
+	}
+}
+
+/*
+ * Multicast snooping (vale_mcast_snoop). Membership reports and
+ * leaves seen on a port add it to, or remove it from, the group of
+ * the destination MAC address. The group address is then learned as
+ * reachable through NM_BDG_MCAST(g), and nm_vale_flush() replicates
+ * the frames sent to it to the members of g only. Groups expire with
+ * the other entries of the table, unless they are refreshed by the
+ * periodic reports, and are released when the last member leaves, so
+ * that their traffic is flooded again. Unknown groups, and those that
+ * do not fit in the table, are flooded as usual.
+ */
+static void
+nm_vale_mgrp_update(struct nm_hash_table *ht, const uint8_t *gaddr,
+		u_int port, int join, uint32_t now)
+{
+	uint64_t mac = 0;
+	uint32_t *bits;
+	u_int g, w;
+	int slot = -1;
+
+	for (g = 0; g < 6; g++)
+		mac |= (uint64_t)gaddr[g] << (8 * g);
+	mtx_lock(&ht->mgrp_lock);
+	for (g = 0; g < NM_BDG_MGRPS; g++) {
+		uint64_t m = ht->mgrp_macs[g];
+
+		if (m != 0 && m == mac)
+			break;
+		if (slot < 0 && (m == 0 ||
+		    nm_vale_ht_expired(ht->mgrp_epochs[g], now)))
+			slot = g;
+	}
+	if (g == NM_BDG_MGRPS) {
+		if (!join || slot < 0)
+			goto out; /* unknown group, or no room */
+		g = slot;
+		if (ht->mgrp_macs[g] != 0)
+			nm_vale_ht_forget(ht, ht->mgrp_macs[g],
+					NM_BDG_MCAST(g));
+		bzero(nm_bdg_mgrp_ports(ht, g), sizeof(uint32_t) *
+				ht->mgrp_words);
+	}
+	bits = nm_bdg_mgrp_ports(ht, g);
+	if (join) {
+		bits[port >> 5] |= 1U << (port & 31);
+		ht->mgrp_macs[g] = mac;
+		ht->mgrp_epochs[g] = now;
+		nm_vale_ht_learn(ht, gaddr, mac, NM_BDG_MCAST(g), now, now);
+		goto out;
+	}
+	bits[port >> 5] &= ~(1U << (port & 31));
+	for (w = 0; w < ht->mgrp_words; w++)
+		if (bits[w] != 0)
+			goto out;
+	/* no members left */
+	nm_vale_ht_forget(ht, mac, NM_BDG_MCAST(g));
+	ht->mgrp_macs[g] = 0;
+out:
+	mtx_unlock(&ht->mgrp_lock);
+}
+
+/* IPv4 group g, ignoring the link local ones (224.0.0.0/24) */
+static void
+nm_vale_mgrp_ip4(struct nm_hash_table *ht, const uint8_t *g, u_int port,
+		int join, uint32_t now)
+{
+	uint8_t gaddr[6] = { 0x01, 0x00, 0x5e };
+
+	if ((g[0] & 0xf0) != 0xe0 || (g[0] == 224 && g[1] == 0 && g[2] == 0))
+		return;
+	gaddr[3] = g[1] & 0x7f;
+	gaddr[4] = g[2];
+	gaddr[5] = g[3];
+	nm_vale_mgrp_update(ht, gaddr, port, join, now);
+}
+
+/* IPv6 group g, ignoring the interface and link local scopes */
+static void
+nm_vale_mgrp_ip6(struct nm_hash_table *ht, const uint8_t *g, u_int port,
+		int join, uint32_t now)
+{
+	uint8_t gaddr[6] = { 0x33, 0x33 };
+
+	if (g[0] != 0xff || (g[1] & 0x0f) <= 2)
+		return;
+	memcpy(gaddr + 2, g + 12, 4);
+	nm_vale_mgrp_update(ht, gaddr, port, join, now);
+}
+
+/*
+ * Membership change of an IGMPv3 or MLDv2 group record: the port
+ * listens to the group (1) unless it asks to include no sources (0).
+ * -1 if the record does not change the membership.
+ */
+static inline int
+nm_vale_mgrp_rec_join(u_int type, u_int nsrc)
+{
+	switch (type) {
+	case 1: /* MODE_IS_INCLUDE */
+	case 3: /* CHANGE_TO_INCLUDE_MODE */
+		return nsrc != 0;
+	case 2: /* MODE_IS_EXCLUDE */
+	case 4: /* CHANGE_TO_EXCLUDE_MODE */
+		return 1;
+	case 5: /* ALLOW_NEW_SOURCES */
+		return nsrc != 0 ? 1 : -1;
+	default: /* BLOCK_OLD_SOURCES, does not change the membership */
+		return -1;
+	}
+}
+
+/*
+ * Look for IGMP and MLD membership messages in the frame 'buf', sent
+ * by 'port', and update the groups. Returns nonzero for the messages,
+ * which are flooded like before, so that the routers and the other
+ * hosts keep seeing them.
+ */
+static int
+nm_vale_snoop(struct nm_hash_table *ht, const uint8_t *buf, u_int len,
+		u_int port, uint32_t now)
+{
+	u_int off = 14, type, l, n, nrec, nsrc;
+	const uint8_t *p;
+	int join;
+
+	type = (buf[12] << 8) | buf[13];
+	if (type == 0x8100 && len >= 18) { /* skip a VLAN tag */
+		type = (buf[16] << 8) | buf[17];
+		off = 18;
+	}
+	p = buf + off;
+	len -= off;
+	if (type == 0x0800) {
+		if (len < 20 || (p[0] >> 4) != 4 || p[9] != 2 /* IGMP */)
+			return 0;
+		l = (p[0] & 0x0f) * 4;
+		if (l < 20 || len < l + 8)
+			return 0;
+		p += l;
+		len -= l;
+		switch (p[0]) {
+		case 0x12: /* v1 report */
+		case 0x16: /* v2 report */
+		case 0x17: /* v2 leave */
+			nm_vale_mgrp_ip4(ht, p + 4, port, p[0] != 0x17, now);
+			return 1;
+		case 0x22: /* v3 report */
+			break;
+		default:
+			return 0;
+		}
+		nrec = (p[6] << 8) | p[7];
+		for (l = 8, n = 0; n < nrec && l + 8 <= len; n++) {
+			nsrc = (p[l + 2] << 8) | p[l + 3];
+			join = nm_vale_mgrp_rec_join(p[l], nsrc);
+			if (join >= 0)
+				nm_vale_mgrp_ip4(ht, p + l + 4, port, join, now);
+			l += 8 + 4 * nsrc + 4 * p[l + 1];
+		}
+		return 1;
+	}
+	if (type != 0x86dd || len < 40 || (p[0] >> 4) != 6)
+		return 0;
+	/* MLD messages carry a hop-by-hop header with a router alert */
+	if (p[6] != 0 || len < 48)
+		return 0;
+	l = 40 + (p[41] + 1) * 8;
+	if (p[40] != 58 /* ICMPv6 */ || len < l + 24)
+		return 0;
+	p += l;
+	len -= l;
+	switch (p[0]) {
+	case 131: /* v1 report */
+	case 132: /* v1 done */
+		nm_vale_mgrp_ip6(ht, p + 8, port, p[0] == 131, now);
+		return 1;
+	case 143: /* v2 report */
+		break;
+	default:
+		return 0;
+	}
+	nrec = (p[6] << 8) | p[7];
+	for (l = 8, n = 0; n < nrec && l + 20 <= len; n++) {
+		nsrc = (p[l + 2] << 8) | p[l + 3];
+		join = nm_vale_mgrp_rec_join(p[l], nsrc);
+		if (join >= 0)
+			nm_vale_mgrp_ip6(ht, p + l + 4, port, join, now);
+		l += 20 + 16 * nsrc + 4 * p[l + 1];
+	}
+	return 1;
+}
+
 
 /*
  * Lookup function for a learning bridge.
@@ -612,8 +1248,8 @@ netmap_vale_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 {
 	uint8_t *buf = ((uint8_t *)ft->ft_buf) + ft->ft_offset;
 	u_int buf_len = ft->ft_len - ft->ft_offset;
-	struct nm_hash_ent *ht = private_data;
-	uint32_t sh, dh;
+	struct nm_hash_table *ht = private_data;
+	uint32_t now = NM_HT_NOW();
 	u_int dst, mysrc = na->bdg_port;
 	uint64_t smac, dmac;
 	uint8_t indbuf[12];
@@ -634,89 +1270,489 @@ netmap_vale_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 	smac >>= 16;
 
 	/*
-	 * The hash is somewhat expensive, there might be some
-	 * worthwhile optimizations here.
+	 * The hash is somewhat expensive, so we skip learning when the
+	 * source is the same as in the previous frame on this port,
+	 * unless the entry needs to be refreshed.
 	 */
-	if (((buf[6] & 1) == 0) && (na->last_smac != smac)) { /* valid src */
-		uint8_t *s = buf+6;
-		sh = nm_vale_rthash(s); /* hash of source */
-		/* update source port forwarding entry */
-		na->last_smac = ht[sh].mac = smac;	/* XXX expire ? */
-		ht[sh].ports = mysrc;
-		if (netmap_debug & NM_DEBUG_VALE)
-		    nm_prinf("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
-			s[0], s[1], s[2], s[3], s[4], s[5], mysrc);
+	if ((buf[6] & 1) == 0) { /* valid src */
+		/* only the low bits of the epoch, this is just a hint */
+		uint64_t ent = smac | ((uint64_t)now << 48);
+
+		if (na->last_smac != ent) {
+			uint8_t *s = buf+6;
+
+			/* update source port forwarding entry */
+			nm_vale_ht_learn(ht, s, smac, mysrc, now, now);
+			na->last_smac = ent;
+			if (netmap_debug & NM_DEBUG_VALE)
+			    nm_prinf("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
+				s[0], s[1], s[2], s[3], s[4], s[5], mysrc);
+		}
 	}
 	dst = NM_BDG_BROADCAST;
 	if ((buf[0] & 1) == 0) { /* unicast */
-		dh = nm_vale_rthash(buf); /* hash of dst */
-		if (ht[dh].mac == dmac) {	/* found dst */
-			dst = ht[dh].ports;
+		dst = nm_vale_ht_lookup(ht, buf, dmac, now);
+		if (dst == NM_BDG_BROADCAST)
+			na->ht_misses++;
+		else
+			na->ht_hits++;
+	} else if (vale_mcast_snoop && dmac != 0xffffffffffffULL) {
+		/* the membership messages themselves are flooded */
+		if ((ft->ft_flags & NS_INDIRECT) ||
+		    !nm_vale_snoop(ht, buf, buf_len, mysrc, now)) {
+			dst = nm_vale_ht_lookup(ht, buf, dmac, now);
+			if (!NM_BDG_IS_MCAST(dst))
+				dst = NM_BDG_BROADCAST;
 		}
+		if (dst == NM_BDG_BROADCAST)
+			na->ht_misses++;
+		else
+			na->ht_hits++;
 	}
+	if (dst == NM_BDG_BROADCAST)
+		na->ht_floods++;
 	return dst;
 }
 
+/* Process NETMAP_REQ_VALE_HASH_INFO_GET */
+int
+netmap_vale_hash_info(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_hash_info *req =
+		(struct nmreq_vale_hash_info *)(uintptr_t)hdr->nr_body;
+	uint32_t now = NM_HT_NOW();
+	struct nm_hash_table *ht;
+	struct nm_bridge *b;
+	u_int i, j;
+	int error = 0;
 
-/*
- * Available space in the ring. Only used in VALE code
- * and only with is_rx = 1
- */
-static inline uint32_t
-nm_kr_space(struct netmap_kring *k, int is_rx)
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME)))
+		return EINVAL;
+
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (b == NULL) {
+		error = ENOENT;
+		goto out;
+	}
+	ht = b->ht;
+	req->nr_entries = ht->nbuckets * NM_BDG_HASH_WAYS;
+	req->nr_ways = NM_BDG_HASH_WAYS;
+	req->nr_ttl = vale_hash_ttl;
+	req->nr_used = 0;
+	for (i = 0; i < ht->nbuckets; i++) {
+		for (j = 0; j < NM_BDG_HASH_WAYS; j++) {
+			struct nm_hash_ent *e = &ht->buckets[i].ent[j];
+
+			if (e->mac != 0 &&
+			    !nm_vale_ht_expired(NM_HT_EPOCH(e->ports), now))
+				req->nr_used++;
+		}
+	}
+	req->nr_hits = req->nr_misses = req->nr_floods = 0;
+	for (j = 0; j < b->bdg_active_ports; j++) {
+		struct netmap_vp_adapter *vpna =
+			b->bdg_ports[b->bdg_port_index[j]];
+
+		if (vpna == NULL)
+			continue;
+		req->nr_hits += vpna->ht_hits;
+		req->nr_misses += vpna->ht_misses;
+		req->nr_floods += vpna->ht_floods;
+	}
+out:
+	NMG_UNLOCK();
+	return error;
+}
+
+/* entries of NETMAP_REQ_VALE_HASH_GET/SET copied at a time */
+#define NM_VALE_HASH_CHUNK	32
+
+/* Process NETMAP_REQ_VALE_HASH_GET */
+int
+netmap_vale_hash_get(struct nmreq_header *hdr)
 {
-	int space;
+	struct nmreq_vale_hash_entries *req =
+		(struct nmreq_vale_hash_entries *)(uintptr_t)hdr->nr_body;
+	struct nmreq_vale_hash_entry *chunk, *uentries =
+		(struct nmreq_vale_hash_entry *)(uintptr_t)req->nr_entries;
+	uint32_t now = NM_HT_NOW();
+	struct nm_hash_table *ht;
+	struct nm_bridge *b;
+	u_int size, i, j, n = 0, k = 0;
+	int error = 0;
 
-	if (is_rx) {
-		int busy = k->nkr_hwlease - k->nr_hwcur;
-		if (busy < 0)
-			busy += k->nkr_num_slots;
-		space = k->nkr_num_slots - 1 - busy;
-	} else {
-		/* XXX never used in this branch */
-		space = k->nr_hwtail - k->nkr_hwlease;
-		if (space < 0)
-			space += k->nkr_num_slots;
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME)))
+		return EINVAL;
+	if (req->nr_num == 0 || req->nr_num > NR_VALE_HASH_ENTRIES_MAX ||
+	    uentries == NULL)
+		return EINVAL;
+	chunk = nm_os_malloc(NM_VALE_HASH_CHUNK * sizeof(*chunk));
+	if (chunk == NULL)
+		return ENOMEM;
+
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (b == NULL) {
+		error = ENOENT;
+		goto out;
 	}
-#if 0
-	// sanity check
-	if (k->nkr_hwlease >= k->nkr_num_slots ||
-		k->nr_hwcur >= k->nkr_num_slots ||
-		k->nr_tail >= k->nkr_num_slots ||
-		busy < 0 ||
-		busy >= k->nkr_num_slots) {
-		nm_prerr("invalid kring, cur %d tail %d lease %d lease_idx %d lim %d",
-		    k->nr_hwcur, k->nr_hwtail, k->nkr_hwlease,
-		    k->nkr_lease_idx, k->nkr_num_slots);
+	ht = b->ht;
+	size = ht->nbuckets * NM_BDG_HASH_WAYS;
+	for (i = req->nr_pos; i < size && n < req->nr_num; i++) {
+		struct nm_hash_ent *he =
+			&ht->buckets[i / NM_BDG_HASH_WAYS].ent[i % NM_BDG_HASH_WAYS];
+		struct nmreq_vale_hash_entry *e = chunk + k;
+		uint64_t m = he->mac, ports;
+		u_int port, age;
+
+		if (m == 0)
+			continue;
+		nm_ldld_barrier();
+		ports = he->ports;
+		nm_ldld_barrier();
+		if (he->mac != m)
+			continue; /* changed under our feet */
+		if (nm_vale_ht_expired(NM_HT_EPOCH(ports), now))
+			continue;
+		port = NM_HT_PORT(ports);
+		/* skip the multicast groups, and the ports gone */
+		if (port >= netmap_bdg_max_ports || b->bdg_ports[port] == NULL)
+			continue;
+		memset(e, 0, sizeof(*e));
+		strlcpy(e->nr_port, b->bdg_ports[port]->up.name,
+			sizeof(e->nr_port));
+		for (j = 0; j < 6; j++)
+			e->nr_mac[j] = m >> (8 * j);
+		age = nm_vale_ht_age(NM_HT_EPOCH(ports), now);
+		e->nr_age = age > 0xffff ? 0xffff : age; /* saturate */
+		n++;
+		if (++k < NM_VALE_HASH_CHUNK)
+			continue;
+		error = nm_vale_array_copyout(hdr, uentries + n - k, chunk,
+				k * sizeof(*chunk));
+		if (error)
+			goto out;
+		k = 0;
 	}
-#endif
-	return space;
+	if (k > 0)
+		error = nm_vale_array_copyout(hdr, uentries + n - k, chunk,
+				k * sizeof(*chunk));
+	req->nr_num = n;
+	req->nr_pos = i;
+out:
+	NMG_UNLOCK();
+	nm_os_free(chunk);
+	return error;
 }
 
+/* the port of switch b with the given name, if attached */
+static struct netmap_vp_adapter *
+nm_vale_port_by_name(struct nm_bridge *b, const char *name)
+{
+	u_int i;
 
+	for (i = 0; i < b->bdg_active_ports; i++) {
+		struct netmap_vp_adapter *vpna =
+			b->bdg_ports[b->bdg_port_index[i]];
 
+		if (vpna != NULL && !strcmp(vpna->up.name, name))
+			return vpna;
+	}
+	return NULL;
+}
 
-/* make a lease on the kring for N positions. return the
- * lease index
- * XXX only used in VALE code and with is_rx = 1
+/*
+ * Process NETMAP_REQ_VALE_HASH_SET. The entries are learned like the
+ * ones seen by the senders, which may run concurrently, except that
+ * the addresses already in the table are left alone: what the switch
+ * learned from live traffic is more recent than the saved table.
  */
-static inline uint32_t
-nm_kr_lease(struct netmap_kring *k, u_int n, int is_rx)
+int
+netmap_vale_hash_set(struct nmreq_header *hdr)
 {
-	uint32_t lim = k->nkr_num_slots - 1;
-	uint32_t lease_idx = k->nkr_lease_idx;
+	struct nmreq_vale_hash_entries *req =
+		(struct nmreq_vale_hash_entries *)(uintptr_t)hdr->nr_body;
+	struct nmreq_vale_hash_entry *chunk, *uentries =
+		(struct nmreq_vale_hash_entry *)(uintptr_t)req->nr_entries;
+	uint32_t now = NM_HT_NOW();
+	u_int ttl = vale_hash_ttl;
+	struct nm_hash_table *ht;
+	struct nm_bridge *b;
+	u_int i, j, k, learned = 0;
+	int error = 0;
 
-	k->nkr_leases[lease_idx] = NR_NOSLOT;
-	k->nkr_lease_idx = nm_next(lease_idx, lim);
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME)))
+		return EINVAL;
+	if (req->nr_num == 0 || req->nr_num > NR_VALE_HASH_ENTRIES_MAX ||
+	    uentries == NULL)
+		return EINVAL;
+	chunk = nm_os_malloc(NM_VALE_HASH_CHUNK * sizeof(*chunk));
+	if (chunk == NULL)
+		return ENOMEM;
 
-#ifdef CONFIG_NETMAP_DEBUG
-	if (n > nm_kr_space(k, is_rx)) {
-		nm_prerr("invalid request for %d slots", n);
-		panic("x");
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (b == NULL) {
+		error = ENOENT;
+		goto out;
 	}
-#endif /* CONFIG NETMAP_DEBUG */
-	/* XXX verify that there are n slots */
-	k->nkr_hwlease += n;
+	ht = b->ht;
+	for (i = 0; i < req->nr_num; i += k) {
+		k = req->nr_num - i;
+		if (k > NM_VALE_HASH_CHUNK)
+			k = NM_VALE_HASH_CHUNK;
+		error = nm_vale_array_copyin(hdr, chunk, uentries + i,
+				k * sizeof(*chunk));
+		if (error)
+			goto out;
+		for (j = 0; j < k; j++) {
+			struct nmreq_vale_hash_entry *e = chunk + j;
+			struct netmap_vp_adapter *vpna;
+			uint64_t mac = 0;
+			int l;
+
+			if ((e->nr_mac[0] & 1) || (ttl != 0 && e->nr_age > ttl))
+				continue;
+			e->nr_port[sizeof(e->nr_port) - 1] = '\0';
+			vpna = nm_vale_port_by_name(b, e->nr_port);
+			if (vpna == NULL)
+				continue;
+			for (l = 0; l < 6; l++)
+				mac |= (uint64_t)e->nr_mac[l] << (8 * l);
+			if (mac == 0 || nm_vale_ht_lookup(ht, e->nr_mac, mac,
+			    now) != NM_BDG_BROADCAST)
+				continue;
+			nm_vale_ht_learn(ht, e->nr_mac, mac, vpna->bdg_port,
+				now - e->nr_age, now);
+			learned++;
+		}
+	}
+	req->nr_num = learned;
+out:
+	NMG_UNLOCK();
+	nm_os_free(chunk);
+	return error;
+}
+
+/* Process NETMAP_REQ_VALE_PORT_STATS_GET */
+int
+netmap_vale_port_stats(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_port_stats *req =
+		(struct nmreq_vale_port_stats *)(uintptr_t)hdr->nr_body;
+	struct netmap_vp_adapter *vpna = NULL;
+	struct nm_bridge *b;
+	u_int i;
+	int error = 0;
+
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME)))
+		return EINVAL;
+
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (b == NULL) {
+		error = ENOENT;
+		goto out;
+	}
+	for (i = req->nr_port_idx; i < netmap_bdg_max_ports; i++) {
+		vpna = b->bdg_ports[i];
+		if (vpna != NULL)
+			break;
+	}
+	if (vpna == NULL) {
+		error = ENOENT;
+		goto out;
+	}
+	req->nr_port_idx = i;
+	strlcpy(req->nr_port_name, vpna->up.name, sizeof(req->nr_port_name));
+	req->nr_tx_pkts = vpna->bdg_stats.tx_pkts;
+	req->nr_tx_bytes = vpna->bdg_stats.tx_bytes;
+	req->nr_rx_pkts = vpna->bdg_stats.rx_pkts;
+	req->nr_rx_bytes = vpna->bdg_stats.rx_bytes;
+	req->nr_rx_drops = vpna->bdg_stats.rx_drops;
+	req->nr_floods = vpna->ht_floods;
+	req->nr_lookup_ns = vpna->bdg_stats.lookup_ns;
+	req->nr_tx_limited = vpna->bdg_stats.tx_limited;
+out:
+	NMG_UNLOCK();
+	return error;
+}
+
+/* Process NETMAP_REQ_VALE_DEFER_SET and NETMAP_REQ_VALE_DEFER_GET */
+int
+netmap_vale_defer(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_defer *req =
+		(struct nmreq_vale_defer *)(uintptr_t)hdr->nr_body;
+	struct netmap_vp_adapter *vpna;
+	struct nm_bridge *b;
+	int error = 0;
+
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME)))
+		return EINVAL;
+	if (hdr->nr_reqtype == NETMAP_REQ_VALE_DEFER_SET) {
+		if (req->nr_usecs > NR_VALE_DEFER_MAX_USECS)
+			return EINVAL;
+#ifndef NM_VALE_NOW_NS
+		if (req->nr_batch != 0)
+			return EOPNOTSUPP;
+#endif /* !NM_VALE_NOW_NS */
+	}
+
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (b == NULL) {
+		error = ENOENT;
+		goto out;
+	}
+	vpna = nm_vale_port_by_name(b, hdr->nr_name);
+	if (vpna == NULL) {
+		error = ENOENT;
+		goto out;
+	}
+	if (hdr->nr_reqtype == NETMAP_REQ_VALE_DEFER_SET) {
+		/* the senders read both fields without locks, the
+		 * worst they can see is a mix of old and new values */
+		vpna->defer.usecs = req->nr_usecs ? req->nr_usecs :
+			NR_VALE_DEFER_USECS;
+		vpna->defer.batch = req->nr_batch;
+	}
+	req->nr_batch = vpna->defer.batch;
+	req->nr_usecs = vpna->defer.batch ? vpna->defer.usecs : 0;
+out:
+	NMG_UNLOCK();
+	return error;
+}
+
+/* Process NETMAP_REQ_VALE_QOS_SET and NETMAP_REQ_VALE_QOS_GET */
+int
+netmap_vale_qos(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_qos *req =
+		(struct nmreq_vale_qos *)(uintptr_t)hdr->nr_body;
+	struct netmap_vp_adapter *vpna = NULL;
+	struct nm_bridge *b;
+	int error = 0, j;
+
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME)))
+		return EINVAL;
+	if (hdr->nr_reqtype == NETMAP_REQ_VALE_QOS_SET) {
+		if (req->nr_prio >= NR_VALE_PRIOS ||
+		    req->nr_rate > NR_VALE_MAX_RATE)
+			return EINVAL;
+#ifndef NM_VALE_NOW_NS
+		if (req->nr_rate != 0)
+			return EOPNOTSUPP;
+#endif /* !NM_VALE_NOW_NS */
+	}
+
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (b == NULL) {
+		error = ENOENT;
+		goto out;
+	}
+	for (j = 0; j < b->bdg_active_ports; j++) {
+		struct netmap_vp_adapter *p =
+			b->bdg_ports[b->bdg_port_index[j]];
+
+		if (p != NULL && !strcmp(p->up.name, hdr->nr_name)) {
+			vpna = p;
+			break;
+		}
+	}
+	if (vpna == NULL) {
+		error = ENOENT;
+		goto out;
+	}
+	if (hdr->nr_reqtype == NETMAP_REQ_VALE_QOS_SET) {
+		uint64_t rate = req->nr_rate / 8;
+
+		/* keep the forwarding out while the bucket changes */
+		BDG_WLOCK(b);
+		vpna->qos.rate = rate;
+		vpna->qos.burst = req->nr_burst;
+		if (vpna->qos.burst == 0) {
+			vpna->qos.burst = rate / 100;
+			if (vpna->qos.burst < NR_VALE_MIN_BURST)
+				vpna->qos.burst = NR_VALE_MIN_BURST;
+		}
+		vpna->qos.tokens = vpna->qos.burst;
+#ifdef NM_VALE_NOW_NS
+		vpna->qos.last_ns = NM_VALE_NOW_NS();
+#endif /* NM_VALE_NOW_NS */
+		vpna->qos.prio = req->nr_prio;
+		BDG_WUNLOCK(b);
+	}
+	req->nr_rate = vpna->qos.rate * 8;
+	req->nr_burst = vpna->qos.burst;
+	req->nr_prio = vpna->qos.prio;
+out:
+	NMG_UNLOCK();
+	return error;
+}
+
+
+/*
+ * Available space in the ring. Only used in VALE code
+ * and only with is_rx = 1
+ */
+static inline uint32_t
+nm_kr_space(struct netmap_kring *k, int is_rx)
+{
+	int space;
+
+	if (is_rx) {
+		int busy = k->nkr_hwlease - k->nr_hwcur;
+		if (busy < 0)
+			busy += k->nkr_num_slots;
+		space = k->nkr_num_slots - 1 - busy;
+	} else {
+		/* XXX never used in this branch */
+		space = k->nr_hwtail - k->nkr_hwlease;
+		if (space < 0)
+			space += k->nkr_num_slots;
+	}
+#if 0
+	// sanity check
+	if (k->nkr_hwlease >= k->nkr_num_slots ||
+		k->nr_hwcur >= k->nkr_num_slots ||
+		k->nr_tail >= k->nkr_num_slots ||
+		busy < 0 ||
+		busy >= k->nkr_num_slots) {
+		nm_prerr("invalid kring, cur %d tail %d lease %d lease_idx %d lim %d",
+		    k->nr_hwcur, k->nr_hwtail, k->nkr_hwlease,
+		    k->nkr_lease_idx, k->nkr_num_slots);
+	}
+#endif
+	return space;
+}
+
+
+
+
+/* make a lease on the kring for N positions. return the
+ * lease index
+ * XXX only used in VALE code and with is_rx = 1
+ */
+static inline uint32_t
+nm_kr_lease(struct netmap_kring *k, u_int n, int is_rx)
+{
+	uint32_t lim = k->nkr_num_slots - 1;
+	uint32_t lease_idx = k->nkr_lease_idx;
+
+	k->nkr_leases[lease_idx] = NR_NOSLOT;
+	k->nkr_lease_idx = nm_next(lease_idx, lim);
+
+#ifdef CONFIG_NETMAP_DEBUG
+	if (n > nm_kr_space(k, is_rx)) {
+		nm_prerr("invalid request for %d slots", n);
+		panic("x");
+	}
+#endif /* CONFIG NETMAP_DEBUG */
+	/* XXX verify that there are n slots */
+	k->nkr_hwlease += n;
 	if (k->nkr_hwlease > lim)
 		k->nkr_hwlease -= lim + 1;
 
@@ -735,250 +1771,303 @@ nm_kr_lease(struct netmap_kring *k, u_int n, int is_rx)
 }
 
 /*
+ * Next packet of the broadcast queue, starting from i, that goes to
+ * 'port': the multicast ones only go to the members of their group.
+ * ht is NULL if the queue holds no multicast.
+ */
+static inline u_int
+nm_vale_brd_next(struct nm_bdg_fwd *ft, u_int i, struct nm_hash_table *ht,
+		u_int port)
+{
+	if (ht == NULL)
+		return i;
+	while (i != NM_FT_NULL && ft[i].ft_mgrp != 0 &&
+	    !nm_bdg_mgrp_has(ht, ft[i].ft_mgrp - 1, port))
+		i = ft[i].ft_next;
+	return i;
+}
+
+/*
+ * Second pass of nm_vale_flush(): move the packets queued for the
+ * destination d_i, and the broadcast ones, into the destination ring.
+ * Different destinations can be handled in parallel, as the leases
+ * on the destination krings already allow concurrent writers.
+ *
+ * If source and destination use the same memory allocator, unicast
+ * packets are moved by swapping the buffers of the source (src_kring)
+ * and destination slots, as it is done for pipes. Broadcast packets
+ * are copied, since they are delivered to several ports, unless
+ * nm_vale_brd_hold() marked them to be delivered by reference.
  *
- * This flush routine supports only unicast and broadcast but a large
- * number of ports, and lets us replace the learn and dispatch functions.
+ * The q_lock of the destination is only held to take the lease and
+ * to commit it: the copy, and the filling of the slots left unused,
+ * run unlocked, so that many senders to the same port only serialize
+ * on two short critical sections.
  */
-int
-nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
-		u_int ring_nr)
+static void
+nm_vale_flush_dst(struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na,
+		struct netmap_kring *src_kring, struct nm_vale_q *dst_ents,
+		u_int d_i, struct nm_hash_table *mht)
 {
-	struct nm_vale_q *dst_ents, *brddst;
-	uint16_t num_dsts = 0, *dsts;
 	struct nm_bridge *b = na->na_bdg;
-	u_int i, me = na->bdg_port;
-
+	struct nm_vale_q *brddst = dst_ents + NM_BDG_BRDQ;
+	u_int port = d_i / NM_BDG_MAXRINGS;
+	struct netmap_vp_adapter *dst_na;
+	struct netmap_kring *kring;
+	struct netmap_ring *ring;
+	u_int dst_nr, lim, i, j, next, brd_next;
+	u_int needed, howmany;
+	int retry = netmap_txsync_retry;
+	struct nm_vale_q *d;
+	uint32_t my_start = 0, lease_idx = 0;
+	int nrings;
+	int virt_hdr_mismatch = 0;
+	int zcopy, brd_share;
+	u_int dst_bufsz, room = 0, reserve;
+	u_int dropped = 0, delivered = 0;
+	uint64_t delivered_bytes = 0;
+
+	nm_prdis("second pass port %d", d_i);
+	d = dst_ents + d_i;
+	// XXX fix the division
+	dst_na = b->bdg_ports[d_i/NM_BDG_MAXRINGS];
+	/* protect from the lookup function returning an inactive
+	 * destination port
+	 */
+	if (unlikely(dst_na == NULL))
+		goto cleanup;
+	if (dst_na->up.na_flags & NAF_SW_ONLY)
+		goto cleanup;
 	/*
-	 * The work area (pointed by ft) is followed by an array of
-	 * pointers to queues , dst_ents; there are NM_BDG_MAXRINGS
-	 * queues per port plus one for the broadcast traffic.
-	 * Then we have an array of destination indexes.
+	 * The interface may be in !netmap mode in two cases:
+	 * - when na is attached but not activated yet;
+	 * - when na is being deactivated but is still attached.
 	 */
-	dst_ents = (struct nm_vale_q *)(ft + NM_BDG_BATCH_MAX);
-	dsts = (uint16_t *)(dst_ents + NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1);
-
-	/* first pass: find a destination for each packet in the batch */
-	for (i = 0; likely(i < n); i += ft[i].ft_frags) {
-		uint8_t dst_ring = ring_nr; /* default, same ring as origin */
-		uint16_t dst_port, d_i;
-		struct nm_vale_q *d;
-		struct nm_bdg_fwd *start_ft = NULL;
-
-		nm_prdis("slot %d frags %d", i, ft[i].ft_frags);
-
-		if (na->up.virt_hdr_len < ft[i].ft_len) {
-			ft[i].ft_offset = na->up.virt_hdr_len;
-			start_ft = &ft[i];
-		} else if (na->up.virt_hdr_len == ft[i].ft_len && ft[i].ft_flags & NS_MOREFRAG) {
-			ft[i].ft_offset = ft[i].ft_len;
-			start_ft = &ft[i+1];
-		} else {
-			/* Drop the packet if the virtio-net header is not into the first
-			 * fragment nor at the very beginning of the second.
-			 */
-			continue;
-		}
-		dst_port = b->bdg_ops.lookup(start_ft, &dst_ring, na, b->private_data);
-		if (netmap_verbose > 255)
-			nm_prlim(5, "slot %d port %d -> %d", i, me, dst_port);
-		if (dst_port >= NM_BDG_NOPORT)
-			continue; /* this packet is identified to be dropped */
-		else if (dst_port == NM_BDG_BROADCAST)
-			dst_ring = 0; /* broadcasts always go to ring 0 */
-		else if (unlikely(dst_port == me ||
-		    !b->bdg_ports[dst_port]))
-			continue;
-
-		/* get a position in the scratch pad */
-		d_i = dst_port * NM_BDG_MAXRINGS + dst_ring;
-		d = dst_ents + d_i;
-
-		/* append the first fragment to the list */
-		if (d->bq_head == NM_FT_NULL) { /* new destination */
-			d->bq_head = d->bq_tail = i;
-			/* remember this position to be scanned later */
-			if (dst_port != NM_BDG_BROADCAST)
-				dsts[num_dsts++] = d_i;
-		} else {
-			ft[d->bq_tail].ft_next = i;
-			d->bq_tail = i;
-		}
-		d->bq_len += ft[i].ft_frags;
+	if (unlikely(!nm_netmap_on(&dst_na->up))) {
+		nm_prdis("not in netmap mode!");
+		goto cleanup;
 	}
 
-	/*
-	 * Broadcast traffic goes to ring 0 on all destinations.
-	 * So we need to add these rings to the list of ports to scan.
+	/* there is at least one either unicast or broadcast packet */
+	brd_next = nm_vale_brd_next(ft, brddst->bq_head, mht, port);
+	next = d->bq_head;
+	/* we need to reserve this many slots. If fewer are
+	 * available, some packets will be dropped.
+	 * Packets may have multiple fragments, so
+	 * there is a chance that we may not use all of the slots
+	 * we have claimed, so we will need to handle the leftover
+	 * ones when we regain the lock.
 	 */
-	brddst = dst_ents + NM_BDG_BROADCAST * NM_BDG_MAXRINGS;
-	if (brddst->bq_head != NM_FT_NULL) {
-		u_int j;
-		for (j = 0; likely(j < b->bdg_active_ports); j++) {
-			uint16_t d_i;
-			i = b->bdg_port_index[j];
-			if (unlikely(i == me))
-				continue;
-			d_i = i * NM_BDG_MAXRINGS;
-			if (dst_ents[d_i].bq_head == NM_FT_NULL)
-				dsts[num_dsts++] = d_i;
-		}
+	needed = d->bq_len;
+	if (mht == NULL) {
+		needed += brddst->bq_len;
+	} else {
+		for (i = brd_next; i != NM_FT_NULL;
+		    i = nm_vale_brd_next(ft, ft[i].ft_next, mht, port))
+			needed += ft[i].ft_frags;
 	}
 
-	nm_prdis(5, "pass 1 done %d pkts %d dsts", n, num_dsts);
-	/* second pass: scan destinations */
-	for (i = 0; i < num_dsts; i++) {
-		struct netmap_vp_adapter *dst_na;
-		struct netmap_kring *kring;
-		struct netmap_ring *ring;
-		u_int dst_nr, lim, j, d_i, next, brd_next;
-		u_int needed, howmany;
-		int retry = netmap_txsync_retry;
-		struct nm_vale_q *d;
-		uint32_t my_start = 0, lease_idx = 0;
-		int nrings;
-		int virt_hdr_mismatch = 0;
-
-		d_i = dsts[i];
-		nm_prdis("second pass %d port %d", i, d_i);
-		d = dst_ents + d_i;
-		// XXX fix the division
-		dst_na = b->bdg_ports[d_i/NM_BDG_MAXRINGS];
-		/* protect from the lookup function returning an inactive
-		 * destination port
-		 */
-		if (unlikely(dst_na == NULL))
-			goto cleanup;
-		if (dst_na->up.na_flags & NAF_SW_ONLY)
-			goto cleanup;
-		/*
-		 * The interface may be in !netmap mode in two cases:
-		 * - when na is attached but not activated yet;
-		 * - when na is being deactivated but is still attached.
-		 */
-		if (unlikely(!nm_netmap_on(&dst_na->up))) {
-			nm_prdis("not in netmap mode!");
-			goto cleanup;
+	if (unlikely(dst_na->up.virt_hdr_len != na->up.virt_hdr_len)) {
+		if (netmap_verbose) {
+			nm_prlim(3, "virt_hdr_mismatch, src %d dst %d", na->up.virt_hdr_len,
+					dst_na->up.virt_hdr_len);
 		}
-
-		/* there is at least one either unicast or broadcast packet */
-		brd_next = brddst->bq_head;
-		next = d->bq_head;
-		/* we need to reserve this many slots. If fewer are
-		 * available, some packets will be dropped.
-		 * Packets may have multiple fragments, so
-		 * there is a chance that we may not use all of the slots
-		 * we have claimed, so we will need to handle the leftover
-		 * ones when we regain the lock.
+		/* There is a virtio-net header/offloadings mismatch between
+		 * source and destination. The slower mismatch datapath will
+		 * be used to cope with all the mismatches.
 		 */
-		needed = d->bq_len + brddst->bq_len;
-
-		if (unlikely(dst_na->up.virt_hdr_len != na->up.virt_hdr_len)) {
-			if (netmap_verbose) {
-				nm_prlim(3, "virt_hdr_mismatch, src %d dst %d", na->up.virt_hdr_len,
-						dst_na->up.virt_hdr_len);
-			}
-			/* There is a virtio-net header/offloadings mismatch between
-			 * source and destination. The slower mismatch datapath will
-			 * be used to cope with all the mismatches.
+		virt_hdr_mismatch = 1;
+		if (na->up.virt_hdr_len && !dst_na->up.virt_hdr_len) {
+			/* Segmentation offloadings may need more
+			 * destination slots than the input slots, and
+			 * USO packets are split at the size chosen
+			 * by the sender, so look at each packet.
 			 */
-			virt_hdr_mismatch = 1;
-			if (dst_na->mfs < na->mfs) {
-				/* We may need to do segmentation offloadings, and so
-				 * we may need a number of destination slots greater
-				 * than the number of input slots ('needed').
-				 * We look for the smallest integer 'x' which satisfies:
-				 *	needed * na->mfs + x * H <= x * na->mfs
-				 * where 'H' is the length of the longest header that may
-				 * be replicated in the segmentation process (e.g. for
-				 * TCPv4 we must account for ethernet header, IP header
-				 * and TCPv4 header).
-				 */
-				KASSERT(dst_na->mfs > 0, ("vpna->mfs is 0"));
-				needed = (needed * na->mfs) /
-						(dst_na->mfs - WORST_CASE_GSO_HEADER) + 1;
-				nm_prdis(3, "srcmtu=%u, dstmtu=%u, x=%u", na->mfs, dst_na->mfs, needed);
-			}
+			needed = 0;
+			for (i = d->bq_head; i != NM_FT_NULL; i = ft[i].ft_next)
+				needed += bdg_mismatch_slots(na, dst_na, ft + i);
+			for (i = brd_next; i != NM_FT_NULL;
+			    i = nm_vale_brd_next(ft, ft[i].ft_next, mht, port))
+				needed += bdg_mismatch_slots(na, dst_na, ft + i);
+			nm_prdis(3, "srcmtu=%u, dstmtu=%u, x=%u", na->mfs, dst_na->mfs, needed);
+		} else if (dst_na->mfs < na->mfs) {
+			/* We may need to do segmentation offloadings, and so
+			 * we may need a number of destination slots greater
+			 * than the number of input slots ('needed').
+			 * We look for the smallest integer 'x' which satisfies:
+			 *	needed * na->mfs + x * H <= x * na->mfs
+			 * where 'H' is the length of the longest header that may
+			 * be replicated in the segmentation process (e.g. for
+			 * TCPv4 we must account for ethernet header, IP header
+			 * and TCPv4 header).
+			 */
+			KASSERT(dst_na->mfs > 0, ("vpna->mfs is 0"));
+			needed = (needed * na->mfs) /
+					(dst_na->mfs - WORST_CASE_GSO_HEADER) + 1;
+			nm_prdis(3, "srcmtu=%u, dstmtu=%u, x=%u", na->mfs, dst_na->mfs, needed);
 		}
+	}
+
+	nm_prdis(5, "pass 2 dst %x is %s",
+		d_i, nm_is_bwrap(&dst_na->up) ? "nic/host" : "virtual");
+	dst_nr = d_i & (NM_BDG_MAXRINGS-1);
+	nrings = dst_na->up.num_rx_rings;
+	if (dst_nr >= nrings)
+		dst_nr = dst_nr % nrings;
+	kring = dst_na->up.rx_rings[dst_nr];
+	ring = kring->ring;
+	/* the destination ring may have not been opened for RX */
+	if (unlikely(ring == NULL || kring->nr_mode != NKR_NETMAP_ON))
+		goto cleanup;
+	lim = kring->nkr_num_slots - 1;
+
+	/* Fragments that do not fit in a destination buffer (e.g. 9K
+	 * jumbo slots sent to a port with 2K buffers) are split across
+	 * several destination slots, so the chain reaches the receiver
+	 * instead of being dropped. 'room' is what a destination slot
+	 * holds for sure, given the largest offset and the cache line
+	 * alignment of the copy.
+	 */
+	dst_bufsz = NETMAP_BUF_SIZE(&dst_na->up);
+	if (!virt_hdr_mismatch &&
+	    dst_bufsz > kring->offset_max + 2 * NM_BUF_ALIGN) {
+		room = dst_bufsz - kring->offset_max - 2 * NM_BUF_ALIGN;
+		needed = 0;
+		for (i = d->bq_head; i != NM_FT_NULL; i = ft[i].ft_next)
+			needed += nm_vale_dst_slots(ft + i, room);
+		for (i = brd_next; i != NM_FT_NULL;
+		    i = nm_vale_brd_next(ft, ft[i].ft_next, mht, port))
+			needed += nm_vale_dst_slots(ft + i, room);
+	}
 
-		nm_prdis(5, "pass 2 dst %d is %x %s",
-			i, d_i, nm_is_bwrap(&dst_na->up) ? "nic/host" : "virtual");
-		dst_nr = d_i & (NM_BDG_MAXRINGS-1);
-		nrings = dst_na->up.num_rx_rings;
-		if (dst_nr >= nrings)
-			dst_nr = dst_nr % nrings;
-		kring = dst_na->up.rx_rings[dst_nr];
-		ring = kring->ring;
-		/* the destination ring may have not been opened for RX */
-		if (unlikely(ring == NULL || kring->nr_mode != NKR_NETMAP_ON))
-			goto cleanup;
-		lim = kring->nkr_num_slots - 1;
+	/* buffers can only be swapped between plain VALE ports using
+	 * the same allocator, or external allocators sharing the buffer
+	 * pool (NETMAP_REQ_OPT_EXTMEM_BUFS).
+	 * The source offset travels with the buffer, so the headroom
+	 * in front of the packet is preserved; packets whose offset
+	 * the receiver cannot represent are copied (nm_vale_swap_ok()).
+	 */
+	zcopy = vale_zcopy && !virt_hdr_mismatch &&
+		netmap_mem_bufs_shared(dst_na->up.nm_mem, na->up.nm_mem) &&
+		!nm_is_bwrap(&na->up) && !nm_is_bwrap(&dst_na->up);
+	/* the reference counts are per allocator. A zero-copy monitor
+	 * swaps the received buffers out of the ring, so its rings get
+	 * a copy (see also nm_zmon_unshare()).
+	 */
+	brd_share = zcopy && dst_na->up.nm_mem == na->up.nm_mem &&
+		kring->zmon_list[NR_RX].next == NULL;
 
 retry:
 
-		if (dst_na->retry && retry) {
-			/* try to get some free slot from the previous run */
-			kring->nm_notify(kring, NAF_FORCE_RECLAIM);
-			/* actually useful only for bwraps, since there
-			 * the notify will trigger a txsync on the hwna. VALE ports
-			 * have dst_na->retry == 0
-			 */
-		}
-		/* reserve the buffers in the queue and an entry
-		 * to report completion, and drop lock.
-		 * XXX this might become a helper function.
+	if (dst_na->retry && retry) {
+		/* try to get some free slot from the previous run */
+		kring->nm_notify(kring, NAF_FORCE_RECLAIM);
+		/* actually useful only for bwraps, since there
+		 * the notify will trigger a txsync on the hwna. VALE ports
+		 * have dst_na->retry == 0
 		 */
-		mtx_lock(&kring->q_lock);
-		if (kring->nkr_stopped) {
-			mtx_unlock(&kring->q_lock);
-			goto cleanup;
-		}
-		my_start = j = kring->nkr_hwlease;
-		howmany = nm_kr_space(kring, 1);
-		if (needed < howmany)
-			howmany = needed;
-		lease_idx = nm_kr_lease(kring, howmany, 1);
+	}
+	/* reserve the buffers in the queue and an entry
+	 * to report completion, and drop lock.
+	 * XXX this might become a helper function.
+	 */
+	/* leave some room to the ports with a higher priority */
+	reserve = na->qos.prio * (kring->nkr_num_slots / (2 * NR_VALE_PRIOS));
+	mtx_lock(&kring->q_lock);
+	if (kring->nkr_stopped) {
 		mtx_unlock(&kring->q_lock);
-
-		/* only retry if we need more than available slots */
-		if (retry && needed <= howmany)
-			retry = 0;
-
-		/* copy to the destination queue */
-		while (howmany > 0) {
-			struct netmap_slot *slot;
-			struct nm_bdg_fwd *ft_p, *ft_end;
-			u_int cnt;
-
-			/* find the queue from which we pick next packet.
-			 * NM_FT_NULL is always higher than valid indexes
-			 * so we never dereference it if the other list
-			 * has packets (and if both are empty we never
-			 * get here).
-			 */
-			if (next < brd_next) {
-				ft_p = ft + next;
-				next = ft_p->ft_next;
-			} else { /* insert broadcast */
-				ft_p = ft + brd_next;
-				brd_next = ft_p->ft_next;
-			}
-			cnt = ft_p->ft_frags; // cnt > 0
-			if (unlikely(cnt > howmany))
-			    break; /* no more space */
-			if (netmap_verbose && cnt > 1)
-				nm_prlim(5, "rx %d frags to %d", cnt, j);
-			ft_end = ft_p + cnt;
-			if (unlikely(virt_hdr_mismatch)) {
-				bdg_mismatch_datapath(na, dst_na, ft_p, ring, &j, lim, &howmany);
-			} else {
-				howmany -= cnt;
+		goto cleanup;
+	}
+	my_start = j = kring->nkr_hwlease;
+	howmany = nm_kr_space(kring, 1);
+	howmany = howmany > reserve ? howmany - reserve : 0;
+	if (needed < howmany)
+		howmany = needed;
+	lease_idx = nm_kr_lease(kring, howmany, 1);
+	mtx_unlock(&kring->q_lock);
+
+	/* only retry if we need more than available slots */
+	if (retry && needed <= howmany)
+		retry = 0;
+
+	/* copy to the destination queue */
+	while (howmany > 0) {
+		struct netmap_slot *slot;
+		struct nm_bdg_fwd *ft_p, *ft_end;
+		u_int cnt, dcnt, used, j_pkt;
+		int swap, share;
+
+		/* find the queue from which we pick next packet.
+		 * NM_FT_NULL is always higher than valid indexes
+		 * so we never dereference it if the other list
+		 * has packets (and if both are empty we never
+		 * get here).
+		 */
+		if (next < brd_next) {
+			ft_p = ft + next;
+			next = ft_p->ft_next;
+			swap = zcopy;
+			share = 0;
+		} else { /* insert broadcast */
+			ft_p = ft + brd_next;
+			brd_next = nm_vale_brd_next(ft, ft_p->ft_next, mht, port);
+			swap = 0;
+			share = brd_share && ft_p->ft_shared;
+		}
+		cnt = ft_p->ft_frags; // cnt > 0
+		dcnt = room ? nm_vale_dst_slots(ft_p, room) : cnt;
+		if (unlikely(dcnt > howmany)) {
+			dropped++;
+			break; /* no more space */
+		}
+		delivered++;
+		for (i = 0; i < cnt; i++)
+			delivered_bytes += ft_p[i].ft_len;
+		if (netmap_verbose && cnt > 1)
+			nm_prlim(5, "rx %d frags to %d", cnt, j);
+		ft_end = ft_p + cnt;
+		if (unlikely(virt_hdr_mismatch)) {
+			bdg_mismatch_datapath(na, dst_na, ft_p, ring, &j, lim, &howmany);
+		} else {
+			used = 0;
+			j_pkt = j;
+			do {
+				char *src = ft_p->ft_buf;
+				size_t left = ft_p->ft_len;
+				const uintptr_t mask = NM_BUF_ALIGN - 1;
+
+				slot = &ring->slot[j];
+				if ((swap || share) && ft_p->ft_slot != NR_NOSLOT &&
+				    !(ft_p->ft_flags & NS_INDIRECT) &&
+				    nm_vale_swap_ok(src_kring, kring, ft_p->ft_slot) &&
+				    (!share || netmap_mem_buf_share(dst_na->up.nm_mem,
+				    src_kring->ring->slot[ft_p->ft_slot].buf_idx,
+				    slot->buf_idx) == 0)) {
+					struct netmap_slot *src_slot =
+						&src_kring->ring->slot[ft_p->ft_slot];
+					uint32_t idx = slot->buf_idx;
+
+					slot->buf_idx = src_slot->buf_idx;
+					if (swap) {
+						src_slot->buf_idx = idx;
+						src_slot->flags |= NS_BUF_CHANGED;
+					}
+					slot->len = left;
+					slot->flags = (cnt << 8)| NS_MOREFRAG;
+					nm_write_offset(kring, slot,
+						nm_get_offset(src_kring, src_slot));
+					j = nm_next(j, lim);
+					used++;
+					ft_p++;
+					continue;
+				}
+				/* one or more destination slots per fragment */
 				do {
-					char *dst, *src = ft_p->ft_buf;
-					size_t copy_len = ft_p->ft_len, dst_len = copy_len;
+					char *dst;
+					size_t copy_len, dst_len = left;
 					uintptr_t src_cb;
 					uint64_t dstoff, dstoff_cb;
 					int src_co, dst_co;
-					const uintptr_t mask = NM_BUF_ALIGN - 1;
 
 					slot = &ring->slot[j];
 					dst = NMB(&dst_na->up, slot);
@@ -991,114 +2080,648 @@ retry:
 						dstoff_cb += NM_BUF_ALIGN;
 					}
 					dstoff = dstoff_cb + src_co;
-					copy_len += src_co;
 
-					nm_prdis("send [%d] %d(%d) bytes at %s:%d",
-							i, (int)copy_len, (int)dst_len,
+					nm_prdis("send [%d] %d bytes at %s:%d",
+							d_i, (int)dst_len,
 							NM_IFPNAME(dst_ifp), j);
 
-					if (unlikely(dstoff > NETMAP_BUF_SIZE(&dst_na->up) ||
-				                     dst_len > NETMAP_BUF_SIZE(&dst_na->up) - dstoff)) {
+					if (unlikely(dstoff >= dst_bufsz)) {
 						nm_prlim(5, "dropping packet/fragment of len %zu, dest offset %llu",
 								dst_len, (unsigned long long)dstoff);
-						copy_len = dst_len = 0;
+						dst_len = left = 0;
 						dstoff = nm_get_offset(kring, slot);
+					} else if (dst_len > dst_bufsz - dstoff) {
+						if (room == 0 || used + 1 >= dcnt) {
+							nm_prlim(5, "dropping packet/fragment of len %zu, dest offset %llu",
+									dst_len, (unsigned long long)dstoff);
+							dst_len = left = 0;
+							dstoff = nm_get_offset(kring, slot);
+						} else {
+							/* the rest goes to the next slot */
+							dst_len = dst_bufsz - dstoff;
+						}
 					}
+					copy_len = dst_len + src_co;
 
 					if (ft_p->ft_flags & NS_INDIRECT) {
-						if (copyin(src, dst, copy_len)) {
+						if (copyin(src, dst + dstoff, dst_len)) {
 							// invalid user pointer, pretend len is 0
-							dst_len = 0;
+							dst_len = left = 0;
 						}
-					} else {
+					} else if (dst_len > 0) {
 						//memcpy(dst, src, copy_len);
 						pkt_copy((char *)src_cb, dst + dstoff_cb, (int)copy_len);
 					}
 					slot->len = dst_len;
-					slot->flags = (cnt << 8)| NS_MOREFRAG;
+					slot->flags = (dcnt << 8)| NS_MOREFRAG;
 					nm_write_offset(kring, slot, dstoff);
 					j = nm_next(j, lim);
-					needed--;
-					ft_p++;
-				} while (ft_p != ft_end);
-				slot->flags = (cnt << 8); /* clear flag on last entry */
+					used++;
+					src += dst_len;
+					left -= dst_len;
+				} while (left > 0);
+				ft_p++;
+			} while (ft_p != ft_end);
+			slot->flags = (dcnt << 8); /* clear flag on last entry */
+			if (unlikely(used != dcnt)) {
+				/* fewer splits than the worst case */
+				for (; j_pkt != j; j_pkt = nm_next(j_pkt, lim))
+					ring->slot[j_pkt].flags = (used << 8) |
+						(ring->slot[j_pkt].flags & NS_MOREFRAG);
 			}
-			/* are we done ? */
-			if (next == NM_FT_NULL && brd_next == NM_FT_NULL)
-				break;
+			howmany -= used;
+			needed -= used;
 		}
-		{
-		    /* current position */
-		    uint32_t *p = kring->nkr_leases; /* shorthand */
-		    uint32_t update_pos;
-		    int still_locked = 1;
-
-		    mtx_lock(&kring->q_lock);
-		    if (unlikely(howmany > 0)) {
-			/* not used all bufs. If i am the last one
-			 * i can recover the slots, otherwise must
-			 * fill them with 0 to mark empty packets.
-			 */
-			nm_prdis("leftover %d bufs", howmany);
-			if (nm_next(lease_idx, lim) == kring->nkr_lease_idx) {
-			    /* yes i am the last one */
-			    nm_prdis("roll back nkr_hwlease to %d", j);
-			    kring->nkr_hwlease = j;
-			} else {
-			    while (howmany-- > 0) {
-				ring->slot[j].len = 0;
-				ring->slot[j].flags = 0;
-				j = nm_next(j, lim);
-			    }
-			}
-		    }
-		    p[lease_idx] = j; /* report I am done */
-
-		    update_pos = kring->nr_hwtail;
-
-		    if (my_start == update_pos) {
-			/* all slots before my_start have been reported,
-			 * so scan subsequent leases to see if other ranges
-			 * have been completed, and to a selwakeup or txsync.
-		         */
-			while (lease_idx != kring->nkr_lease_idx &&
-				p[lease_idx] != NR_NOSLOT) {
-			    j = p[lease_idx];
-			    p[lease_idx] = NR_NOSLOT;
-			    lease_idx = nm_next(lease_idx, lim);
-			}
-			/* j is the new 'write' position. j != my_start
-			 * means there are new buffers to report
+		/* are we done ? */
+		if (next == NM_FT_NULL && brd_next == NM_FT_NULL)
+			break;
+	}
+	if (!dst_na->retry) {
+		/* nothing else will fit, account for the drops in the
+		 * commit below rather than taking the lock once more
+		 */
+		for (i = next; i != NM_FT_NULL; i = ft[i].ft_next)
+			dropped++;
+		for (i = brd_next; i != NM_FT_NULL;
+		    i = nm_vale_brd_next(ft, ft[i].ft_next, mht, port))
+			dropped++;
+		next = brd_next = NM_FT_NULL;
+	}
+	{
+	    /* current position */
+	    uint32_t *p = kring->nkr_leases; /* shorthand */
+	    uint32_t update_pos, my_end = j;
+	    int still_locked = 1;
+
+	    /* Commit. Slots we reserved but did not use are turned into
+	     * empty packets before taking the lock, since nobody else
+	     * writes them. If we turn out to hold the last lease they are
+	     * given back instead, and the marks are simply not published.
+	     */
+	    if (unlikely(howmany > 0)) {
+		nm_prdis("leftover %d bufs", howmany);
+		for (i = howmany; i > 0; i--) {
+		    ring->slot[my_end].len = 0;
+		    ring->slot[my_end].flags = 0;
+		    my_end = nm_next(my_end, lim);
+		}
+	    }
+
+	    mtx_lock(&kring->q_lock);
+	    if (unlikely(howmany > 0) &&
+		    nm_next(lease_idx, lim) == kring->nkr_lease_idx) {
+		/* yes i am the last one */
+		nm_prdis("roll back nkr_hwlease to %d", j);
+		kring->nkr_hwlease = j;
+	    } else {
+		j = my_end;
+	    }
+	    howmany = 0;
+	    p[lease_idx] = j; /* report I am done */
+	    dst_na->bdg_stats.rx_pkts += delivered;
+	    dst_na->bdg_stats.rx_bytes += delivered_bytes;
+	    delivered = 0;
+	    delivered_bytes = 0;
+	    if (unlikely(dropped)) {
+		kring->stats.drops += dropped;
+		dst_na->bdg_stats.rx_drops += dropped;
+		dropped = 0;
+	    }
+
+	    update_pos = kring->nr_hwtail;
+
+	    if (my_start == update_pos) {
+		/* all slots before my_start have been reported,
+		 * so scan subsequent leases to see if other ranges
+		 * have been completed, and to a selwakeup or txsync.
+	         */
+		while (lease_idx != kring->nkr_lease_idx &&
+			p[lease_idx] != NR_NOSLOT) {
+		    j = p[lease_idx];
+		    p[lease_idx] = NR_NOSLOT;
+		    lease_idx = nm_next(lease_idx, lim);
+		}
+		/* j is the new 'write' position. j != my_start
+		 * means there are new buffers to report
+		 */
+		if (likely(j != my_start)) {
+			kring->nr_hwtail = j;
+			still_locked = 0;
+			mtx_unlock(&kring->q_lock);
+			kring->nm_notify(kring, 0);
+			/* this is netmap_notify for VALE ports and
+			 * netmap_bwrap_notify for bwrap. The latter will
+			 * trigger a txsync on the underlying hwna
 			 */
-			if (likely(j != my_start)) {
-				kring->nr_hwtail = j;
-				still_locked = 0;
-				mtx_unlock(&kring->q_lock);
-				kring->nm_notify(kring, 0);
-				/* this is netmap_notify for VALE ports and
-				 * netmap_bwrap_notify for bwrap. The latter will
-				 * trigger a txsync on the underlying hwna
+			if (dst_na->retry && retry--) {
+				/* XXX this is going to call nm_notify again.
+				 * Only useful for bwrap in virtual machines
 				 */
-				if (dst_na->retry && retry--) {
-					/* XXX this is going to call nm_notify again.
-					 * Only useful for bwrap in virtual machines
-					 */
-					goto retry;
-				}
+				goto retry;
 			}
-		    }
-		    if (still_locked)
-			mtx_unlock(&kring->q_lock);
 		}
+	    }
+	    if (still_locked)
+		mtx_unlock(&kring->q_lock);
+	}
+	/* whatever is left in the queues did not fit */
+	for (i = next; i != NM_FT_NULL; i = ft[i].ft_next)
+		dropped++;
+	for (i = brd_next; i != NM_FT_NULL;
+	    i = nm_vale_brd_next(ft, ft[i].ft_next, mht, port))
+		dropped++;
+	if (unlikely(dropped)) {
+		mtx_lock(&kring->q_lock);
+		kring->stats.drops += dropped;
+		dst_na->bdg_stats.rx_drops += dropped;
+		mtx_unlock(&kring->q_lock);
+	}
 cleanup:
-		d->bq_head = d->bq_tail = NM_FT_NULL; /* cleanup */
-		d->bq_len = 0;
+	d->bq_head = d->bq_tail = NM_FT_NULL; /* cleanup */
+	d->bq_len = 0;
+}
+
+/* A fan-out job, see netmap_bdg_fanout_run() */
+struct nm_vale_flush_job {
+	struct nm_bdg_fwd *ft;
+	struct netmap_vp_adapter *na;
+	struct netmap_kring *src_kring;
+	struct nm_vale_q *dst_ents;
+	uint16_t *dsts;
+	u_int num_dsts;
+	struct nm_hash_table *mht;
+};
+
+static void
+nm_vale_flush_slice(void *arg, u_int slice, u_int nslices)
+{
+	struct nm_vale_flush_job *job = arg;
+	u_int i;
+
+	for (i = slice; i < job->num_dsts; i += nslices)
+		nm_vale_flush_dst(job->ft, job->na, job->src_kring,
+				job->dst_ents, job->dsts[i], job->mht);
+}
+
+#ifdef NM_VALE_NOW_NS
+/* Add the tokens earned since the last refill, once per batch. */
+static inline void
+nm_vale_qos_refill(struct netmap_vp_adapter *na)
+{
+	uint64_t now = NM_VALE_NOW_NS();
+	uint64_t ns = now - na->qos.last_ns, add;
+
+	if (ns > 1000000000ULL)
+		ns = 1000000000ULL; /* no overflow below NR_VALE_MAX_RATE */
+	add = NM_VALE_DIV64(ns * na->qos.rate, 1000000000ULL);
+	if (add == 0)
+		return; /* keep the fraction for the next time */
+	na->qos.last_ns = now;
+	na->qos.tokens += add;
+	if (na->qos.tokens > na->qos.burst)
+		na->qos.tokens = na->qos.burst;
+}
+#endif /* NM_VALE_NOW_NS */
+
+/*
+ * Return nonzero if packet ft[i] exceeds the rate limit of the
+ * source port, and take its length from the bucket otherwise.
+ * Tokens are taken without locks, so concurrent tx rings of the
+ * same port may let a little more through.
+ */
+static inline int
+nm_vale_qos_drop(struct netmap_vp_adapter *na, struct nm_bdg_fwd *ft, u_int i)
+{
+	u_int k, len = 0;
+
+	if (likely(na->qos.rate == 0))
+		return 0;
+	for (k = 0; k < ft[i].ft_frags; k++)
+		len += ft[i + k].ft_len;
+	if (na->qos.tokens < len) {
+		na->bdg_stats.tx_limited++;
+		return 1;
+	}
+	na->qos.tokens -= len;
+	return 0;
+}
+
+/*
+ * Return the fragment of packet ft[i] where the ethernet header
+ * starts, skipping the virtio-net header, or NULL if the packet must
+ * be dropped.
+ */
+static inline struct nm_bdg_fwd *
+nm_vale_fwd_start(struct netmap_vp_adapter *na, struct nm_bdg_fwd *ft, u_int i)
+{
+	if (na->up.virt_hdr_len < ft[i].ft_len) {
+		ft[i].ft_offset = na->up.virt_hdr_len;
+		return &ft[i];
+	} else if (na->up.virt_hdr_len == ft[i].ft_len && ft[i].ft_flags & NS_MOREFRAG) {
+		ft[i].ft_offset = ft[i].ft_len;
+		return &ft[i+1];
+	}
+	/* Drop the packet if the virtio-net header is not into the first
+	 * fragment nor at the very beginning of the second.
+	 */
+	return NULL;
+}
+
+/*
+ * vale_uplink_hash: a unicast frame sent to a NIC goes to the tx ring
+ * chosen by the hash of its flow, rather than to the ring with the
+ * index of the sender's ring, so that all the queues of the NIC are
+ * used even when the senders (e.g. VMs) have a single ring, and the
+ * frames of a flow stay in order. With bdg_poll_tx each ring is then
+ * transmitted by the polling thread that owns it.
+ * Only done for the learning lookup, which never chooses a ring: the
+ * ring returned by any other lookup function is left alone.
+ */
+static inline uint8_t
+nm_vale_uplink_ring(struct nm_bridge *b, struct nm_bdg_fwd *start_ft,
+	uint32_t dst_port, uint8_t dst_ring)
+{
+	struct netmap_vp_adapter *dst_na;
+	u_int nrings;
+
+	if (!vale_uplink_hash || b->bdg_ops.lookup != netmap_vale_learning ||
+	    dst_port >= netmap_bdg_max_ports ||
+	    (start_ft->ft_flags & NS_INDIRECT))
+		return dst_ring;
+	dst_na = b->bdg_ports[dst_port];
+	if (dst_na == NULL || dst_na->up.num_rx_rings < 2 ||
+	    !nm_is_bwrap(&dst_na->up))
+		return dst_ring;
+	nrings = dst_na->up.num_rx_rings;
+	if (nrings > NM_BDG_MAXRINGS)
+		nrings = NM_BDG_MAXRINGS;
+	return nm_vale_flow_hash((uint8_t *)start_ft->ft_buf +
+		start_ft->ft_offset, start_ft->ft_len - start_ft->ft_offset) %
+		nrings;
+}
+
+/*
+ * Append packet ft[i] to the queue of (dst_port, dst_ring), as
+ * returned by the lookup function. New unicast destinations are
+ * recorded in dsts[]. Returns the new number of destinations.
+ */
+static inline uint16_t
+nm_vale_fwd_enqueue(struct nm_bdg_fwd *ft, u_int i, struct nm_vale_q *dst_ents,
+	uint16_t *dsts, uint16_t num_dsts, struct netmap_vp_adapter *na,
+	uint32_t dst_port, uint8_t dst_ring)
+{
+	struct nm_bridge *b = na->na_bdg;
+	struct nm_vale_q *d;
+	uint16_t d_i;
+
+	if (netmap_verbose > 255)
+		nm_prlim(5, "slot %d port %d -> %d", i, na->bdg_port, dst_port);
+	if (NM_BDG_IS_MCAST(dst_port)) {
+		/* multicast shares the broadcast queue */
+		ft[i].ft_mgrp = dst_port - NM_BDG_MCAST_BASE + 1;
+		ft[i].ft_shared = 0;
+		dst_port = NM_BDG_BROADCAST;
+		d_i = NM_BDG_BRDQ;
+	} else if (dst_port >= NM_BDG_NOPORT)
+		return num_dsts; /* this packet is identified to be dropped */
+	else if (dst_port == NM_BDG_BROADCAST) {
+		ft[i].ft_mgrp = 0;
+		ft[i].ft_shared = 0;
+		d_i = NM_BDG_BRDQ; /* broadcasts always go to ring 0 */
+	} else if (unlikely(dst_port == na->bdg_port ||
+	    dst_port >= netmap_bdg_max_ports ||
+	    !b->bdg_ports[dst_port]))
+		return num_dsts;
+	else /* get a position in the scratch pad */
+		d_i = dst_port * NM_BDG_MAXRINGS +
+			(dst_ring & (NM_BDG_MAXRINGS - 1));
+	d = dst_ents + d_i;
+
+	/* append the first fragment to the list */
+	if (d->bq_head == NM_FT_NULL) { /* new destination */
+		d->bq_head = d->bq_tail = i;
+		/* remember this position to be scanned later */
+		if (dst_port != NM_BDG_BROADCAST)
+			dsts[num_dsts++] = d_i;
+	} else {
+		ft[d->bq_tail].ft_next = i;
+		d->bq_tail = i;
 	}
+	d->bq_len += ft[i].ft_frags;
+	return num_dsts;
+}
+
+/*
+ * Zero-copy broadcast (vale_brd_zcopy). The broadcast packets made of
+ * a single buffer are delivered by reference to the destinations that
+ * use the same allocator as the sender, instead of being copied for
+ * each of them: all the destination slots get the buffer of the
+ * sender, and the buffers they held are set aside by the allocator
+ * (see netmap_mem_buf_share()). The receivers get a private buffer
+ * back in netmap_vp_rxsync(), when they release the slot, so they
+ * must not write the shared ones, nor swap them out of the ring.
+ *
+ * nm_vale_brd_hold() marks the packets that can be shared, before the
+ * second pass, and takes a reference on their buffers for the sender.
+ * nm_vale_brd_release() drops it after the second pass, and gives the
+ * sender a different buffer if some destination took the packet.
+ */
+static u_int
+nm_vale_brd_hold(struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na,
+		struct netmap_kring *src_kring, struct nm_vale_q *brddst)
+{
+	struct netmap_mem_d *nmd = na->up.nm_mem;
+	struct netmap_slot *slot;
+	u_int i, n = 0, nrefs;
+
+	if (!vale_zcopy || nm_is_bwrap(&na->up) ||
+	    netmap_mem_bufrefs(nmd, &nrefs) == NULL)
+		return 0;
+	for (i = brddst->bq_head; i != NM_FT_NULL; i = ft[i].ft_next) {
+		if (ft[i].ft_frags != 1 || ft[i].ft_slot == NR_NOSLOT ||
+		    (ft[i].ft_flags & NS_INDIRECT))
+			continue;
+		slot = &src_kring->ring->slot[ft[i].ft_slot];
+		if (netmap_mem_buf_hold(nmd, slot->buf_idx) == 0) {
+			ft[i].ft_shared = 1;
+			n++;
+		}
+	}
+	return n;
+}
+
+static void
+nm_vale_brd_release(struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na,
+		struct netmap_kring *src_kring, struct nm_vale_q *brddst)
+{
+	struct netmap_mem_d *nmd = na->up.nm_mem;
+	struct netmap_slot *slot;
+	uint32_t idx;
+	u_int i;
+
+	for (i = brddst->bq_head; i != NM_FT_NULL; i = ft[i].ft_next) {
+		if (!ft[i].ft_shared)
+			continue;
+		slot = &src_kring->ring->slot[ft[i].ft_slot];
+		idx = netmap_mem_buf_unshare(nmd, slot->buf_idx);
+		if (unlikely(idx == 0)) {
+			/* cannot happen, there is a spare buffer for
+			 * each delivery */
+			nm_prlim(1, "no spare buffer for %u", slot->buf_idx);
+			continue;
+		}
+		if (idx != slot->buf_idx) {
+			slot->buf_idx = idx;
+			slot->flags |= NS_BUF_CHANGED;
+		}
+	}
+}
+
+/*
+ *
+ * This flush routine supports unicast, broadcast and the multicast
+ * groups of the learning table, and a large number of ports, and lets
+ * us replace the learn and dispatch functions.
+ */
+int
+nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
+		u_int ring_nr, int maysleep)
+{
+	struct nm_vale_q *dst_ents, *brddst;
+	uint16_t num_dsts = 0, *dsts;
+	struct nm_bridge *b = na->na_bdg;
+	struct netmap_kring *src_kring = na->up.tx_rings[ring_nr];
+	struct nm_hash_table *mht = NULL;
+	u_int i, me = na->bdg_port, nshared = 0;
+	int indirect = 0;
+#ifdef WITH_TRACE
+	uint64_t t0 = nm_os_trace_ns();
+#endif /* WITH_TRACE */
+
+	/*
+	 * The work area (pointed by ft) is followed by an array of
+	 * pointers to queues , dst_ents; there are NM_BDG_MAXRINGS
+	 * queues per port plus one for the broadcast traffic.
+	 * Then we have the work area for the batch lookup (see
+	 * struct nm_vale_batch) and an array of destination indexes.
+	 */
+	dst_ents = (struct nm_vale_q *)(ft + NM_BDG_BATCH_MAX);
+	dsts = NM_VALE_DSTS(dst_ents);
+
+	NM_TRACE(vale_flush, src_kring, n);
+
+#ifdef NM_VALE_NOW_NS
+	if (unlikely(na->qos.rate != 0))
+		nm_vale_qos_refill(na);
+#endif /* NM_VALE_NOW_NS */
+
+	/* first pass: find a destination for each packet in the batch */
+	if (b->bdg_ops.lookup_batch != NULL) {
+		struct nm_vale_batch *bt = NM_VALE_BATCH(dst_ents);
+		u_int k, npkts = 0;
+
+		for (i = 0; likely(i < n); i += ft[i].ft_frags) {
+			struct nm_bdg_fwd *start_ft;
+
+			indirect |= ft[i].ft_flags & NS_INDIRECT;
+			start_ft = nm_vale_fwd_start(na, ft, i);
+			if (start_ft == NULL || nm_vale_qos_drop(na, ft, i))
+				continue;
+			bt->pkts[npkts] = start_ft;
+			bt->idx[npkts] = i;
+			bt->rings[npkts] = ring_nr;
+			npkts++;
+		}
+		if (npkts > 0)
+			b->bdg_ops.lookup_batch(bt->pkts, bt->ports, bt->rings,
+					npkts, na, b->private_data);
+		for (k = 0; k < npkts; k++)
+			num_dsts = nm_vale_fwd_enqueue(ft, bt->idx[k], dst_ents,
+				dsts, num_dsts, na, bt->ports[k], bt->rings[k]);
+	} else {
+		for (i = 0; likely(i < n); i += ft[i].ft_frags) {
+			uint8_t dst_ring = ring_nr; /* default, same ring as origin */
+			uint32_t dst_port;
+			struct nm_bdg_fwd *start_ft;
+
+			nm_prdis("slot %d frags %d", i, ft[i].ft_frags);
+			indirect |= ft[i].ft_flags & NS_INDIRECT;
+			start_ft = nm_vale_fwd_start(na, ft, i);
+			if (start_ft == NULL || nm_vale_qos_drop(na, ft, i))
+				continue;
+			dst_port = b->bdg_ops.lookup(start_ft, &dst_ring, na,
+					b->private_data);
+			dst_ring = nm_vale_uplink_ring(b, start_ft, dst_port,
+					dst_ring);
+			num_dsts = nm_vale_fwd_enqueue(ft, i, dst_ents, dsts,
+					num_dsts, na, dst_port, dst_ring);
+		}
+	}
+#ifdef WITH_TRACE
+	na->bdg_stats.lookup_ns += nm_os_trace_ns() - t0;
+#endif /* WITH_TRACE */
+
+	/*
+	 * Broadcast traffic goes to ring 0 on all destinations.
+	 * So we need to add these rings to the list of ports to scan.
+	 * If the queue only holds multicast, the ports that are not
+	 * members of any of the groups are left out.
+	 */
+	brddst = dst_ents + NM_BDG_BRDQ;
+	if (brddst->bq_head != NM_FT_NULL) {
+		uint32_t gset[(NM_BDG_MGRPS + 31) / 32];
+		uint8_t grps[NM_BDG_MGRPS];
+		u_int j, k, ngrps = 0;
+		int flood = !vale_mcast_snoop;
+
+		if (!flood) {
+			bzero(gset, sizeof(gset));
+			for (i = brddst->bq_head; i != NM_FT_NULL;
+			    i = ft[i].ft_next) {
+				u_int g = ft[i].ft_mgrp;
+
+				if (g == 0) {
+					flood = 1;
+					continue;
+				}
+				g--;
+				if (gset[g >> 5] & (1U << (g & 31)))
+					continue;
+				gset[g >> 5] |= 1U << (g & 31);
+				grps[ngrps++] = g;
+			}
+			if (ngrps > 0)
+				mht = b->ht;
+		}
+		for (j = 0; likely(j < b->bdg_active_ports); j++) {
+			uint16_t d_i;
+			i = b->bdg_port_index[j];
+			if (unlikely(i == me))
+				continue;
+			if (!flood) {
+				for (k = 0; k < ngrps; k++)
+					if (nm_bdg_mgrp_has(mht, grps[k], i))
+						break;
+				if (k == ngrps)
+					continue;
+			}
+			d_i = i * NM_BDG_MAXRINGS;
+			if (dst_ents[d_i].bq_head == NM_FT_NULL)
+				dsts[num_dsts++] = d_i;
+		}
+	}
+
+	if (unlikely(vale_brd_zcopy) && brddst->bq_head != NM_FT_NULL)
+		nshared = nm_vale_brd_hold(ft, na, src_kring, brddst);
+
+	nm_prdis(5, "pass 1 done %d pkts %d dsts", n, num_dsts);
+	/* second pass: scan destinations. If the bridge has flush
+	 * workers, the destinations are spread among them. This needs
+	 * a sender that can wait (not a NIC), and no user pointers in
+	 * the batch since the workers run in a different address space.
+	 */
+	if (b->bdg_fanout != NULL && num_dsts > 1 && !indirect && maysleep) {
+		struct nm_vale_flush_job job = {
+			.ft = ft,
+			.na = na,
+			.src_kring = src_kring,
+			.dst_ents = dst_ents,
+			.dsts = dsts,
+			.num_dsts = num_dsts,
+			.mht = mht,
+		};
+
+		if (netmap_bdg_fanout_run(b, nm_vale_flush_slice, &job) == 0)
+			num_dsts = 0; /* all done */
+	}
+	for (i = 0; i < num_dsts; i++)
+		nm_vale_flush_dst(ft, na, src_kring, dst_ents, dsts[i], mht);
+	if (nshared > 0)
+		nm_vale_brd_release(ft, na, src_kring, brddst);
 	brddst->bq_head = brddst->bq_tail = NM_FT_NULL; /* cleanup */
 	brddst->bq_len = 0;
 	return 0;
 }
 
+/*
+ * Deferred forwarding (NETMAP_REQ_VALE_DEFER_SET): tell whether the
+ * slots from hwcur to head can wait for the next sync. They wait in
+ * the ring itself, which is the natural accumulator: nothing is copied
+ * and the sender cannot reuse them until they are forwarded.
+ */
+static inline int
+nm_vale_defer(struct netmap_vp_adapter *na, struct netmap_kring *kring,
+		u_int head)
+{
+#ifdef NM_VALE_NOW_NS
+	u_int n = kring->nkr_num_slots;
+	u_int pending = (head + n - kring->nr_hwcur) % n;
+	uint64_t now;
+
+	if (pending == 0 || pending >= na->defer.batch || pending == n - 1)
+		return 0;
+	now = NM_VALE_NOW_NS();
+	if (kring->defer_ns == 0) {
+		kring->defer_ns = now;
+		if (kring->defer_timer != NULL)
+			nm_os_timer_arm(kring->defer_timer, na->defer.usecs);
+		return 1;
+	}
+	return now - kring->defer_ns < na->defer.usecs * 1000ULL;
+#else /* !NM_VALE_NOW_NS */
+	return 0;
+#endif /* !NM_VALE_NOW_NS */
+}
+
+#ifdef NM_VALE_NOW_NS
+/*
+ * Timer armed by nm_vale_defer() at the first deferred slot: forward
+ * the slots still deferred at the deadline, hwcur to rhead, which the
+ * sender has already passed to us. We run in interrupt context, so we
+ * only try the locks, and try again a bit later if a sync is running
+ * or the bridge is being reconfigured. Slots with user pointers
+ * (NS_INDIRECT) cannot be read from here and wait for the next sync.
+ */
+static void
+nm_vale_defer_timeout(void *arg)
+{
+	struct netmap_kring *kring = arg;
+	struct netmap_vp_adapter *na =
+		(struct netmap_vp_adapter *)kring->na;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int head, i, done;
+
+	if (kring->defer_ns == 0)
+		return; /* forwarded by a sync meanwhile */
+	switch (nm_kr_tryget(kring, 0, NULL)) {
+	case 0:
+		break;
+	case NM_KR_STOPPED:
+		return; /* going away */
+	default: /* being synced, or briefly stopped */
+		nm_os_timer_arm(kring->defer_timer, NR_VALE_DEFER_USECS);
+		return;
+	}
+	if (kring->defer_ns == 0 || na->na_bdg == NULL)
+		goto out;
+	head = kring->rhead;
+	for (i = kring->nr_hwcur; i != head; i = nm_next(i, lim))
+		if (kring->ring->slot[i].flags & NS_INDIRECT)
+			goto out;
+	done = nm_vale_preflush(kring, head, 0 /* cannot sleep */);
+	if (done != head) {
+		/* bridge busy, nothing was sent */
+		nm_os_timer_arm(kring->defer_timer, NR_VALE_DEFER_USECS);
+		goto out;
+	}
+	kring->defer_ns = 0;
+	kring->nr_hwcur = done;
+	kring->nr_hwtail = nm_prev(done, lim);
+out:
+	nm_kr_put(kring);
+}
+#endif /* NM_VALE_NOW_NS */
+
 /* nm_txsync callback for VALE ports */
 static int
 netmap_vale_vp_txsync(struct netmap_kring *kring, int flags)
@@ -1120,7 +2743,14 @@ netmap_vale_vp_txsync(struct netmap_kring *kring, int flags)
 	if (bridge_batch > NM_BDG_BATCH)
 		bridge_batch = NM_BDG_BATCH;
 
-	done = nm_vale_preflush(kring, head);
+	if (unlikely(na->defer.batch != 0) && !(flags & NAF_FLUSH) &&
+	    nm_vale_defer(na, kring, head)) {
+		done = kring->nr_hwcur; /* keep the new slots in the ring */
+		goto deferred;
+	}
+	kring->defer_ns = 0;
+	done = nm_vale_preflush(kring, head,
+			na->up.na_flags & NAF_BDG_MAYSLEEP);
 done:
 	if (done != head)
 		nm_prerr("early break at %d/ %d, tail %d", done, head, kring->nr_hwtail);
@@ -1128,6 +2758,7 @@ done:
 	 * packets between 'done' and 'cur' are left unsent.
 	 */
 	kring->nr_hwcur = done;
+deferred:
 	kring->nr_hwtail = nm_prev(done, lim);
 	if (netmap_debug & NM_DEBUG_TXSYNC)
 		nm_prinf("%s ring %d flags %d", na->up.name, kring->ring_id, flags);
@@ -1143,16 +2774,32 @@ netmap_vale_vp_create(struct nmreq_header *hdr, struct ifnet *ifp,
 		struct netmap_mem_d *nmd, struct netmap_vp_adapter **ret)
 {
 	struct nmreq_register *req = (struct nmreq_register *)(uintptr_t)hdr->nr_body;
+	struct nmreq_opt_buf_size *bopt = NULL;
 	struct netmap_vp_adapter *vpna;
 	struct netmap_adapter *na;
 	int error = 0;
 	u_int npipes = 0;
 	u_int extrabufs = 0;
+	u_int buf_size = 0;
 
 	if (hdr->nr_reqtype != NETMAP_REQ_REGISTER) {
 		return EINVAL;
 	}
 
+	/* the buffer size can only be chosen for a private allocator */
+	if (nmd == NULL)
+		bopt = (struct nmreq_opt_buf_size *)
+			nmreq_getoption(hdr, NETMAP_REQ_OPT_BUF_SIZE);
+	if (bopt != NULL) {
+		buf_size = bopt->nro_buf_size;
+		if (buf_size != 0 &&
+		    (buf_size < NM_BUF_ALIGN || buf_size > 65536)) {
+			nm_prerr("unsupported buffer size %u", buf_size);
+			bopt->nro_opt.nro_status = EINVAL;
+			return EINVAL;
+		}
+	}
+
 	vpna = nm_os_malloc(sizeof(*vpna));
 	if (vpna == NULL)
 		return ENOMEM;
@@ -1213,9 +2860,14 @@ netmap_vale_vp_create(struct nmreq_header *hdr, struct ifnet *ifp,
 		netmap_mem_private_new(
 			na->num_tx_rings, na->num_tx_desc,
 			na->num_rx_rings, na->num_rx_desc,
-			req->nr_extra_bufs, npipes, &error);
+			req->nr_extra_bufs, npipes, buf_size, &error);
 	if (na->nm_mem == NULL)
 		goto err;
+	if (bopt != NULL) {
+		/* the allocator rounds the size to the cache line */
+		bopt->nro_buf_size = netmap_mem_bufsize(na->nm_mem);
+		bopt->nro_opt.nro_status = 0;
+	}
 	na->nm_bdg_attach = netmap_vale_vp_bdg_attach;
 	/* other nmd fields are set in the common routine */
 	error = netmap_attach_common(na);
@@ -1318,6 +2970,56 @@ netmap_get_vale_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 }
 
 
+/*
+ * Register all the rings of the persistent port hdr->nr_name on
+ * behalf of the kernel, so that they stay in netmap mode (with their
+ * memory, contents and pointers) while no process has them open.
+ * hdr->nr_body is a nmreq_register.
+ */
+static int
+nm_vi_keep_warm(struct nmreq_header *hdr)
+{
+	struct nmreq_register *req =
+		(struct nmreq_register *)(uintptr_t)hdr->nr_body;
+	struct netmap_priv_d *npriv;
+	struct netmap_vp_adapter *vpna;
+	struct ifnet *ifp;
+	int error;
+
+	ifp = ifunit_ref(hdr->nr_name);
+	if (!ifp)
+		return ENXIO;
+	NMG_LOCK();
+	if (!NM_NA_VALID(ifp) || NA(ifp)->nm_register != netmap_vp_reg) {
+		error = EINVAL;
+		goto out;
+	}
+	vpna = (struct netmap_vp_adapter *)NA(ifp);
+	npriv = netmap_priv_new();
+	if (npriv == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	req->nr_mode = NR_REG_ALL_NIC;
+	req->nr_ringid = 0;
+	req->nr_flags = 0;
+	error = netmap_do_regif(npriv, &vpna->up, hdr);
+	if (error) {
+		netmap_priv_delete(npriv);
+		goto out;
+	}
+	/* let the priv destructor release the references */
+	netmap_adapter_get(&vpna->up);
+	npriv->np_ifp = ifp;
+	ifp = NULL;
+	vpna->na_kpriv = npriv;
+out:
+	NMG_UNLOCK();
+	if (ifp)
+		if_rele(ifp);
+	return error;
+}
+
 /* creates a persistent VALE port */
 int
 nm_vi_create(struct nmreq_header *hdr)
@@ -1337,6 +3039,11 @@ nm_vi_create(struct nmreq_header *hdr)
 	hdr->nr_reqtype = NETMAP_REQ_REGISTER;
 	hdr->nr_body = (uintptr_t)&regreq;
 	error = netmap_vi_create(hdr, 0 /* no autodelete */);
+	if (!error && (req->nr_flags & NR_VALE_NEWIF_KEEPWARM)) {
+		error = nm_vi_keep_warm(hdr);
+		if (error)
+			nm_vi_destroy(hdr->nr_name);
+	}
 	hdr->nr_reqtype = NETMAP_REQ_VALE_NEWIF;
 	hdr->nr_body = (uintptr_t)req;
 	/* Write back to the original struct. */
@@ -1374,6 +3081,14 @@ nm_vi_destroy(const char *name)
 		goto err;
 	}
 
+	/* drop the keep-warm registration, unless somebody else is
+	 * using the interface
+	 */
+	if (netmap_vp_warm_only(&vpna->up) && vpna->up.na_refcount == 2) {
+		netmap_priv_delete(vpna->na_kpriv);
+		vpna->na_kpriv = NULL;
+	}
+
 	/* also make sure that nobody is using the interface */
 	if (NETMAP_OWNED_BY_ANY(&vpna->up) ||
 	    vpna->up.na_refcount > 1 /* any ref besides the one in nm_vi_create()? */) {
@@ -0,0 +1,695 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * $FreeBSD$
+ *
+ * Routing and access control lookup for the VALE switches.
+ *
+ * When a switch has routes or ACL rules (NETMAP_REQ_VALE_L3_*), its
+ * lookup becomes nm_vale_l3_lookup(), a batch lookup that
+ *  - drops the IP frames denied by the ACL;
+ *  - sends the IP frames with a route to the port of the longest
+ *    matching prefix;
+ *  - switches everything else with the learning lookup.
+ *
+ * The routes of each address family are compiled into a multibit trie,
+ * a direct table indexed by the first 16 bits of the address followed
+ * by 8 bit groups (DIR-16-8-8 for IPv4). Shorter prefixes are pushed
+ * to the leaves, so a lookup is at most 3 (IPv4) or 15 (IPv6) memory
+ * accesses and no backtracking. The ACL is kept sorted by priority,
+ * with the masks precomputed, and is scanned linearly.
+ *
+ * Tables are never modified in place: a change builds a new copy of
+ * the whole state, which replaces the old one under BDG_WLOCK().
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+__FBSDID("$FreeBSD$");
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/malloc.h>
+#include <sys/rwlock.h>
+#include <sys/socket.h> /* sockaddrs */
+#include <sys/selinfo.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/endian.h>
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#elif defined(_WIN32)
+#include "win_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+/*
+ * common headers
+ */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+#include <dev/netmap/netmap_bdg.h>
+
+#ifdef WITH_VALE_L3
+
+#define NM_L3_MAX_ROUTES	4096	/* per address family */
+#define NM_L3_MAX_RULES		1024
+
+/* trie entries: 0 (no route), port + 1, or NM_L3_GROUP | group */
+#define NM_L3_GROUP		0x8000
+#define NM_L3_MAX_GROUPS	NM_L3_GROUP
+#define NM_L3_TBL16		65536
+
+/* address families, as indexes */
+#define NM_L3_NONE		0
+#define NM_L3_INET		1
+#define NM_L3_INET6		2
+#define NM_L3_FAMILIES		2
+
+struct nm_l3_route {
+	uint8_t		addr[16];	/* masked */
+	uint8_t		plen;
+	uint16_t	port;
+};
+
+struct nm_l3_trie {
+	uint16_t	*tbl16;		/* NULL if there are no routes */
+	uint16_t	*tbl8;		/* groups of 256 entries */
+	u_int		ngroups;
+};
+
+/* ACL rule, addresses and masks in network order */
+struct nm_l3_rule {
+	uint32_t	src[4], smask[4];
+	uint32_t	dst[4], dmask[4];
+	uint16_t	sport_min, sport_max;
+	uint16_t	dport_min, dport_max;
+	uint16_t	prio;
+	uint16_t	in_port;	/* NM_BDG_NOPORT for any */
+	uint8_t		family;		/* NM_L3_INET{,6} */
+	uint8_t		proto;
+	uint8_t		action;
+};
+
+struct nm_vale_l3 {
+	struct nm_bridge	*b;	/* for the learning table */
+	struct nm_l3_route	*routes[NM_L3_FAMILIES]; /* by plen */
+	u_int			nroutes[NM_L3_FAMILIES];
+	struct nm_l3_trie	trie[NM_L3_FAMILIES];
+	struct nm_l3_rule	*acl;	/* by prio */
+	u_int			nacl;
+};
+
+/* what nm_vale_l3_lookup() needs from a frame */
+struct nm_l3_key {
+	union {
+		uint32_t	w[4];
+		uint8_t		b[16];
+	} src, dst;
+	uint16_t	sport, dport;	/* host order */
+	uint8_t		family;
+	uint8_t		proto;
+};
+
+static inline u_int
+nm_l3_alen(u_int family)
+{
+	return family == NM_L3_INET ? 4 : 16;
+}
+
+/* make the host part of a prefix zero */
+static void
+nm_l3_mask(uint8_t *addr, u_int plen, u_int alen)
+{
+	u_int i;
+
+	for (i = 0; i < alen; i++) {
+		if (plen >= 8) {
+			plen -= 8;
+		} else {
+			addr[i] &= (uint8_t)(0xff00 >> plen);
+			plen = 0;
+		}
+	}
+}
+
+static void
+nm_l3_trie_fill(struct nm_l3_trie *t, uint16_t *p, uint16_t nh)
+{
+	if (*p & NM_L3_GROUP) {
+		uint16_t *grp = t->tbl8 + ((u_int)(*p & ~NM_L3_GROUP) << 8);
+		u_int k;
+
+		for (k = 0; k < 256; k++)
+			nm_l3_trie_fill(t, grp + k, nh);
+	} else {
+		*p = nh;
+	}
+}
+
+/*
+ * Routes must be inserted in increasing prefix length, so that a
+ * route only overwrites the entries of shorter prefixes.
+ */
+static void
+nm_l3_trie_insert(struct nm_l3_trie *t, const struct nm_l3_route *r)
+{
+	uint16_t nh = r->port + 1, *p, *grp;
+	u_int base, count, i, b = 2, left;
+
+	if (r->plen <= 16) {
+		base = (r->addr[0] << 8) | r->addr[1];
+		count = 1 << (16 - r->plen);
+		for (i = 0; i < count; i++)
+			nm_l3_trie_fill(t, t->tbl16 + base + i, nh);
+		return;
+	}
+	p = t->tbl16 + ((r->addr[0] << 8) | r->addr[1]);
+	left = r->plen - 16;
+	for (;;) {
+		if (!(*p & NM_L3_GROUP)) {
+			/* expand the leaf into a group */
+			grp = t->tbl8 + (t->ngroups << 8);
+			for (i = 0; i < 256; i++)
+				grp[i] = *p;
+			*p = NM_L3_GROUP | t->ngroups++;
+		}
+		grp = t->tbl8 + ((u_int)(*p & ~NM_L3_GROUP) << 8);
+		if (left <= 8)
+			break;
+		p = grp + r->addr[b++];
+		left -= 8;
+	}
+	base = r->addr[b];
+	count = 1 << (8 - left);
+	for (i = 0; i < count; i++)
+		nm_l3_trie_fill(t, grp + base + i, nh);
+}
+
+static void
+nm_l3_trie_free(struct nm_l3_trie *t)
+{
+	if (t->tbl16)
+		nm_os_free(t->tbl16);
+	if (t->tbl8)
+		nm_os_free(t->tbl8);
+	memset(t, 0, sizeof(*t));
+}
+
+static int
+nm_l3_trie_build(struct nm_l3_trie *t, const struct nm_l3_route *r, u_int n)
+{
+	u_int i, maxgroups = 0;
+
+	memset(t, 0, sizeof(*t));
+	if (n == 0)
+		return 0;
+	/* each prefix longer than 16 adds at most a group per 8 bits */
+	for (i = 0; i < n; i++) {
+		if (r[i].plen > 16)
+			maxgroups += (r[i].plen - 16 + 7) / 8;
+	}
+	if (maxgroups > NM_L3_MAX_GROUPS)
+		return E2BIG;
+	t->tbl16 = nm_os_malloc(NM_L3_TBL16 * sizeof(uint16_t));
+	if (t->tbl16 == NULL)
+		return ENOMEM;
+	if (maxgroups) {
+		t->tbl8 = nm_os_malloc(maxgroups * 256 * sizeof(uint16_t));
+		if (t->tbl8 == NULL) {
+			nm_l3_trie_free(t);
+			return ENOMEM;
+		}
+	}
+	for (i = 0; i < n; i++)
+		nm_l3_trie_insert(t, r + i);
+	return 0;
+}
+
+/* returns the port + 1, or 0 if there is no route */
+static inline u_int
+nm_l3_trie_lookup(const struct nm_l3_trie *t, const uint8_t *a)
+{
+	uint16_t e = t->tbl16[(a[0] << 8) | a[1]];
+	u_int b = 2;
+
+	while (e & NM_L3_GROUP)
+		e = t->tbl8[((u_int)(e & ~NM_L3_GROUP) << 8) | a[b++]];
+	return e;
+}
+
+static inline int
+nm_l3_prefix_match(const uint32_t *a, const uint32_t *net,
+		const uint32_t *mask, u_int nw)
+{
+	u_int i;
+
+	for (i = 0; i < nw; i++) {
+		if ((a[i] & mask[i]) != net[i])
+			return 0;
+	}
+	return 1;
+}
+
+/* returns 1 if the first matching rule drops the frame */
+static int
+nm_l3_acl_deny(const struct nm_vale_l3 *l3, const struct nm_l3_key *k,
+		u_int in_port)
+{
+	u_int i, nw = k->family == NM_L3_INET ? 1 : 4;
+
+	for (i = 0; i < l3->nacl; i++) {
+		const struct nm_l3_rule *r = l3->acl + i;
+
+		if (r->family != k->family ||
+		    (r->in_port != NM_BDG_NOPORT && r->in_port != in_port) ||
+		    (r->proto && r->proto != k->proto) ||
+		    k->sport < r->sport_min || k->sport > r->sport_max ||
+		    k->dport < r->dport_min || k->dport > r->dport_max ||
+		    !nm_l3_prefix_match(k->src.w, r->src, r->smask, nw) ||
+		    !nm_l3_prefix_match(k->dst.w, r->dst, r->dmask, nw))
+			continue;
+		return r->action == NR_VALE_L3_DENY;
+	}
+	return 0;
+}
+
+/*
+ * Extract addresses and ports from the frame. Only the first fragment
+ * is looked at. Returns -1 for IP frames whose headers do not fit in
+ * it, which are dropped if the switch has an ACL.
+ */
+static int
+nm_l3_parse(struct nm_bdg_fwd *ft, struct nm_l3_key *k)
+{
+	uint8_t *buf = ((uint8_t *)ft->ft_buf) + ft->ft_offset;
+	u_int len = ft->ft_len - ft->ft_offset;
+	uint8_t indbuf[96];
+	u_int off = 14, type, l4 = 0;
+
+	k->family = NM_L3_NONE;
+	k->sport = k->dport = 0;
+	if (len < 14)
+		return 0;
+	if (ft->ft_flags & NS_INDIRECT) {
+		if (len > sizeof(indbuf))
+			len = sizeof(indbuf);
+		if (copyin(buf, indbuf, len))
+			return 0;
+		buf = indbuf;
+	}
+	type = (buf[12] << 8) | buf[13];
+	if (type == 0x8100) { /* one VLAN tag */
+		if (len < 18)
+			return 0;
+		type = (buf[16] << 8) | buf[17];
+		off = 18;
+	}
+	if (type == 0x0800) {
+		if (len < off + 20)
+			return -1;
+		k->family = NM_L3_INET;
+		k->proto = buf[off + 9];
+		memcpy(k->src.b, buf + off + 12, 4);
+		memcpy(k->dst.b, buf + off + 16, 4);
+		/* no ports in the non-first IP fragments */
+		if (((buf[off + 6] & 0x1f) | buf[off + 7]) == 0)
+			l4 = off + (buf[off] & 0xf) * 4;
+	} else if (type == 0x86dd) {
+		if (len < off + 40)
+			return -1;
+		k->family = NM_L3_INET6;
+		k->proto = buf[off + 6];
+		memcpy(k->src.b, buf + off + 8, 16);
+		memcpy(k->dst.b, buf + off + 24, 16);
+		l4 = off + 40;
+	} else {
+		return 0;
+	}
+	if (l4 && (k->proto == 6 || k->proto == 17 || k->proto == 132)) {
+		if (len < l4 + 4)
+			return -1;
+		k->sport = (buf[l4] << 8) | buf[l4 + 1];
+		k->dport = (buf[l4 + 2] << 8) | buf[l4 + 3];
+	}
+	return 0;
+}
+
+/* bdg_ops.lookup_batch of the switches with routes or ACL rules */
+static void
+nm_vale_l3_lookup(struct nm_bdg_fwd **pkts, uint32_t *dst_port,
+		uint8_t *dst_ring, u_int n, struct netmap_vp_adapter *na,
+		void *private_data)
+{
+	struct nm_vale_l3 *l3 = private_data;
+	struct nm_l3_key k;
+	u_int i, nh;
+
+	for (i = 0; i < n; i++) {
+		if (i + 1 < n)
+			__builtin_prefetch(pkts[i + 1]->ft_buf);
+		if (nm_l3_parse(pkts[i], &k) < 0 && l3->nacl) {
+			dst_port[i] = NM_BDG_NOPORT;
+			continue;
+		}
+		if (k.family != NM_L3_NONE && l3->nacl &&
+		    nm_l3_acl_deny(l3, &k, na->bdg_port)) {
+			dst_port[i] = NM_BDG_NOPORT;
+			continue;
+		}
+		/* learn the source in any case, the frames that are not
+		 * routed are switched by MAC address
+		 */
+		dst_port[i] = netmap_vale_learning(pkts[i], dst_ring + i, na,
+				l3->b->ht);
+		if (k.family != NM_L3_NONE &&
+		    l3->trie[k.family - 1].tbl16 != NULL) {
+			nh = nm_l3_trie_lookup(&l3->trie[k.family - 1],
+					k.dst.b);
+			if (nh)
+				dst_port[i] = nh - 1;
+		}
+	}
+}
+
+static void
+nm_vale_l3_destroy(struct nm_vale_l3 *l3)
+{
+	int f;
+
+	if (l3 == NULL)
+		return;
+	for (f = 0; f < NM_L3_FAMILIES; f++) {
+		nm_l3_trie_free(&l3->trie[f]);
+		if (l3->routes[f])
+			nm_os_free(l3->routes[f]);
+	}
+	if (l3->acl)
+		nm_os_free(l3->acl);
+	nm_os_free(l3);
+}
+
+/* copy the rules of 'old', with room for one more of each kind */
+static struct nm_vale_l3 *
+nm_vale_l3_clone(const struct nm_vale_l3 *old, struct nm_bridge *b)
+{
+	struct nm_vale_l3 *l3;
+	int f;
+
+	l3 = nm_os_malloc(sizeof(*l3));
+	if (l3 == NULL)
+		return NULL;
+	l3->b = b;
+	for (f = 0; f < NM_L3_FAMILIES; f++) {
+		u_int n = old ? old->nroutes[f] : 0;
+
+		l3->routes[f] = nm_os_malloc((n + 1) * sizeof(struct nm_l3_route));
+		if (l3->routes[f] == NULL)
+			goto fail;
+		if (n)
+			memcpy(l3->routes[f], old->routes[f],
+				n * sizeof(struct nm_l3_route));
+		l3->nroutes[f] = n;
+	}
+	l3->nacl = old ? old->nacl : 0;
+	l3->acl = nm_os_malloc((l3->nacl + 1) * sizeof(struct nm_l3_rule));
+	if (l3->acl == NULL)
+		goto fail;
+	if (l3->nacl)
+		memcpy(l3->acl, old->acl, l3->nacl * sizeof(struct nm_l3_rule));
+	return l3;
+fail:
+	nm_vale_l3_destroy(l3);
+	return NULL;
+}
+
+static int
+nm_vale_l3_family(uint8_t nr_family)
+{
+	switch (nr_family) {
+	case NR_VALE_L3_INET:
+		return NM_L3_INET;
+	case NR_VALE_L3_INET6:
+		return NM_L3_INET6;
+	}
+	return NM_L3_NONE;
+}
+
+static int
+nm_vale_l3_route(struct nm_vale_l3 *l3, struct nmreq_header *hdr,
+		struct netmap_vp_adapter *vpna)
+{
+	struct nmreq_vale_l3_route *req =
+		(struct nmreq_vale_l3_route *)(uintptr_t)hdr->nr_body;
+	int f = nm_vale_l3_family(req->nr_family);
+	struct nm_l3_route r, *v;
+	u_int i, *n;
+
+	if (f == NM_L3_NONE || req->nr_plen > 8 * nm_l3_alen(f))
+		return EINVAL;
+	memset(&r, 0, sizeof(r));
+	memcpy(r.addr, req->nr_addr, nm_l3_alen(f));
+	nm_l3_mask(r.addr, req->nr_plen, nm_l3_alen(f));
+	r.plen = req->nr_plen;
+	v = l3->routes[f - 1];
+	n = &l3->nroutes[f - 1];
+	for (i = 0; i < *n; i++) {
+		if (v[i].plen == r.plen && !memcmp(v[i].addr, r.addr, 16))
+			break;
+	}
+	if (hdr->nr_reqtype == NETMAP_REQ_VALE_L3_ROUTE_DEL) {
+		if (i == *n)
+			return ENOENT;
+		memmove(v + i, v + i + 1, (*n - i - 1) * sizeof(*v));
+		(*n)--;
+		return 0;
+	}
+	if (vpna == NULL)
+		return EINVAL;
+	if (i < *n) { /* move the prefix to the new port */
+		v[i].port = vpna->bdg_port;
+		return 0;
+	}
+	if (*n == NM_L3_MAX_ROUTES)
+		return E2BIG;
+	r.port = vpna->bdg_port;
+	/* keep the routes sorted by prefix length */
+	for (i = *n; i > 0 && v[i - 1].plen > r.plen; i--)
+		v[i] = v[i - 1];
+	v[i] = r;
+	(*n)++;
+	return 0;
+}
+
+static void
+nm_l3_rule_prefix(uint32_t *net, uint32_t *mask, const uint8_t *addr,
+		u_int plen, u_int alen)
+{
+	uint8_t a[16], m[16];
+
+	memset(a, 0, sizeof(a));
+	memset(m, 0xff, sizeof(m));
+	memcpy(a, addr, alen);
+	nm_l3_mask(a, plen, alen);
+	nm_l3_mask(m, plen, alen);
+	memcpy(net, a, sizeof(a));
+	memcpy(mask, m, sizeof(m));
+}
+
+static int
+nm_vale_l3_acl(struct nm_vale_l3 *l3, struct nmreq_header *hdr,
+		struct netmap_vp_adapter *vpna)
+{
+	struct nmreq_vale_l3_acl *req =
+		(struct nmreq_vale_l3_acl *)(uintptr_t)hdr->nr_body;
+	struct nm_l3_rule r;
+	int f;
+	u_int i;
+
+	for (i = 0; i < l3->nacl; i++) {
+		if (l3->acl[i].prio >= req->nr_prio)
+			break;
+	}
+	if (hdr->nr_reqtype == NETMAP_REQ_VALE_L3_ACL_DEL) {
+		if (i == l3->nacl || l3->acl[i].prio != req->nr_prio)
+			return ENOENT;
+		memmove(l3->acl + i, l3->acl + i + 1,
+			(l3->nacl - i - 1) * sizeof(r));
+		l3->nacl--;
+		return 0;
+	}
+	if (i < l3->nacl && l3->acl[i].prio == req->nr_prio)
+		return EEXIST;
+	if (l3->nacl == NM_L3_MAX_RULES)
+		return E2BIG;
+	f = nm_vale_l3_family(req->nr_family);
+	if (f == NM_L3_NONE ||
+	    req->nr_src_plen > 8 * nm_l3_alen(f) ||
+	    req->nr_dst_plen > 8 * nm_l3_alen(f) ||
+	    req->nr_sport_min > req->nr_sport_max ||
+	    req->nr_dport_min > req->nr_dport_max ||
+	    req->nr_action > NR_VALE_L3_DENY)
+		return EINVAL;
+	memset(&r, 0, sizeof(r));
+	nm_l3_rule_prefix(r.src, r.smask, req->nr_src, req->nr_src_plen,
+		nm_l3_alen(f));
+	nm_l3_rule_prefix(r.dst, r.dmask, req->nr_dst, req->nr_dst_plen,
+		nm_l3_alen(f));
+	r.sport_min = req->nr_sport_min;
+	r.sport_max = req->nr_sport_max;
+	r.dport_min = req->nr_dport_min;
+	r.dport_max = req->nr_dport_max;
+	if (r.sport_max == 0)
+		r.sport_max = 0xffff;
+	if (r.dport_max == 0)
+		r.dport_max = 0xffff;
+	r.prio = req->nr_prio;
+	r.in_port = vpna ? vpna->bdg_port : NM_BDG_NOPORT;
+	r.family = f;
+	r.proto = req->nr_proto;
+	r.action = req->nr_action;
+	memmove(l3->acl + i + 1, l3->acl + i, (l3->nacl - i) * sizeof(r));
+	l3->acl[i] = r;
+	l3->nacl++;
+	return 0;
+}
+
+/* Process NETMAP_REQ_VALE_L3_{ROUTE,ACL}_{ADD,DEL} */
+int
+netmap_vale_l3_ctl(struct nmreq_header *hdr)
+{
+	struct netmap_vp_adapter *vpna = NULL;
+	struct nm_vale_l3 *old, *l3 = NULL;
+	struct nm_bridge *b;
+	const char *port;
+	int error = 0, f, j;
+
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME)))
+		return EINVAL;
+
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (b == NULL) {
+		error = ENOENT;
+		goto out;
+	}
+	if (!nm_bdg_valid_auth_token(b, NULL)) {
+		error = EACCES;
+		goto out;
+	}
+	port = strchr(hdr->nr_name, ':');
+	if (port != NULL && port[1] != '\0') {
+		for (j = 0; j < b->bdg_active_ports; j++) {
+			struct netmap_vp_adapter *p =
+				b->bdg_ports[b->bdg_port_index[j]];
+
+			if (p != NULL && !strcmp(p->up.name, hdr->nr_name)) {
+				vpna = p;
+				break;
+			}
+		}
+		if (vpna == NULL) {
+			error = ENOENT;
+			goto out;
+		}
+	}
+	old = b->bdg_l3;
+	if (old == NULL &&
+	    (b->bdg_ops.lookup != b->bdg_saved_ops.lookup ||
+	     b->bdg_ops.lookup_batch != b->bdg_saved_ops.lookup_batch)) {
+		/* the lookup belongs to an external module */
+		error = EBUSY;
+		goto out;
+	}
+
+	l3 = nm_vale_l3_clone(old, b);
+	if (l3 == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	switch (hdr->nr_reqtype) {
+	case NETMAP_REQ_VALE_L3_ROUTE_ADD:
+	case NETMAP_REQ_VALE_L3_ROUTE_DEL:
+		error = nm_vale_l3_route(l3, hdr, vpna);
+		break;
+	default:
+		error = nm_vale_l3_acl(l3, hdr, vpna);
+		break;
+	}
+	for (f = 0; !error && f < NM_L3_FAMILIES; f++)
+		error = nm_l3_trie_build(&l3->trie[f], l3->routes[f],
+				l3->nroutes[f]);
+	if (error) {
+		nm_vale_l3_destroy(l3);
+		goto out;
+	}
+	if (l3->nroutes[0] + l3->nroutes[1] + l3->nacl == 0) {
+		nm_vale_l3_destroy(l3);
+		l3 = NULL;
+	}
+
+	BDG_WLOCK(b);
+	if (l3 != NULL) {
+		b->bdg_ops.lookup_batch = nm_vale_l3_lookup;
+		b->private_data = l3;
+	} else {
+		b->bdg_ops.lookup_batch = b->bdg_saved_ops.lookup_batch;
+		b->private_data = b->ht;
+	}
+	b->bdg_l3 = l3;
+	BDG_WUNLOCK(b);
+	nm_vale_l3_destroy(old);
+out:
+	NMG_UNLOCK();
+	return error;
+}
+
+/* called when the switch is freed */
+void
+netmap_vale_l3_free(struct nm_bridge *b)
+{
+	nm_vale_l3_destroy(b->bdg_l3);
+	b->bdg_l3 = NULL;
+}
+
+#endif /* WITH_VALE_L3 */
@@ -390,7 +390,16 @@ struct netmap_if {
 	uint32_t	ni_bufs_head;	/* head index for extra bufs */
 	const uint32_t	ni_host_tx_rings; /* number of SW tx rings */
 	const uint32_t	ni_host_rx_rings; /* number of SW rx rings */
-	uint32_t	ni_spare1[3];
+	uint32_t	ni_spare1;
+	/*
+	 * Size of the memory region. It grows when NETMAP_REQ_POOLS_EXPAND
+	 * adds buffers, which may then show up in the rings and in the
+	 * extra buffers of every port using the region. A process that
+	 * finds it larger than its mapping must mmap() the region again
+	 * with the new size (the offsets do not change) before it
+	 * accesses a buffer beyond the old mapping.
+	 */
+	const uint64_t	ni_memsize;
 	/*
 	 * The following array contains the offset of each netmap ring
 	 * from this structure, in the following order:
@@ -470,8 +479,8 @@ struct netmap_if {
  *			reflects the common usage.
  *
  *		Other options are NR_MONITOR_TX, NR_MONITOR_RX, NR_ZCOPY_MON,
- *		NR_EXCLUSIVE, NR_RX_RINGS_ONLY, NR_TX_RINGS_ONLY and
- *		NR_ACCEPT_VNET_HDR.
+ *		NR_MONITOR_DEFER, NR_EXCLUSIVE, NR_RX_RINGS_ONLY,
+ *		NR_TX_RINGS_ONLY and NR_ACCEPT_VNET_HDR.
  *
  *	nr_mem_id (in/out)
  *		The identity of the memory region used.
@@ -555,6 +564,41 @@ enum {
 	NETMAP_REQ_SYNC_KLOOP_STOP,
 	/* Enable CSB mode on a registered netmap control device. */
 	NETMAP_REQ_CSB_ENABLE,
+	/* Get info about the learning table of a VALE switch. */
+	NETMAP_REQ_VALE_HASH_INFO_GET,
+	/* Add buffers to the pool of a memory allocator in use. */
+	NETMAP_REQ_POOLS_EXPAND,
+	/* Install a hardware flow steering rule on a NIC port. */
+	NETMAP_REQ_FLOW_RULE_ADD,
+	/* Remove a hardware flow steering rule from a NIC port. */
+	NETMAP_REQ_FLOW_RULE_DEL,
+	/* Get the counters of a ring of a netmap port. */
+	NETMAP_REQ_RING_STATS_GET,
+	/* Sync the rings of several file descriptors in one call. */
+	NETMAP_REQ_SYNC_BATCH,
+	/* Get the forwarding counters of a port of a VALE switch. */
+	NETMAP_REQ_VALE_PORT_STATS_GET,
+	/* Set or get the rate limit and priority of a VALE port. */
+	NETMAP_REQ_VALE_QOS_SET,
+	NETMAP_REQ_VALE_QOS_GET,
+	/* Add or remove an IPv4/IPv6 route of a VALE switch. */
+	NETMAP_REQ_VALE_L3_ROUTE_ADD,
+	NETMAP_REQ_VALE_L3_ROUTE_DEL,
+	/* Add or remove an access control rule of a VALE switch. */
+	NETMAP_REQ_VALE_L3_ACL_ADD,
+	NETMAP_REQ_VALE_L3_ACL_DEL,
+	/* Run a microbenchmark of a kernel hot path. */
+	NETMAP_REQ_BENCH,
+	/* List many ports of the VALE switches, with their info. */
+	NETMAP_REQ_VALE_LIST_BULK,
+	/* Save or restore the learning table of a VALE switch. */
+	NETMAP_REQ_VALE_HASH_GET,
+	NETMAP_REQ_VALE_HASH_SET,
+	/* Set or get the deferred forwarding of a VALE port. */
+	NETMAP_REQ_VALE_DEFER_SET,
+	NETMAP_REQ_VALE_DEFER_GET,
+	/* Get the occupancy of the pools of a memory allocator. */
+	NETMAP_REQ_POOLS_STATS_GET,
 };
 
 enum {
@@ -587,6 +631,75 @@ enum {
 	 */
 	NETMAP_REQ_OPT_OFFSETS,
 
+	/* On NETMAP_REQ_REGISTER and NETMAP_REQ_VALE_ATTACH, choose the
+	 * size of the learning table of the VALE switch, if the request
+	 * creates the switch.
+	 */
+	NETMAP_REQ_OPT_VALE_HASH,
+
+	/* On NETMAP_REQ_REGISTER, choose the NUMA node for the pools of
+	 * the memory allocator of the port, if not already in use.
+	 */
+	NETMAP_REQ_OPT_NUMA,
+
+	/* On NETMAP_REQ_REGISTER of a copy monitor (/r, /t or /z with
+	 * the copy flags), limit the number of bytes copied from each
+	 * frame and optionally drop frames with a classic BPF program,
+	 * before they are copied into the monitor rings.
+	 */
+	NETMAP_REQ_OPT_MONITOR_FILTER,
+
+	/* On NETMAP_REQ_REGISTER of a pipe endpoint, choose how the
+	 * frames sent on the tx rings of the master are distributed
+	 * among the rx rings of the slave, if the request creates
+	 * the pipe.
+	 */
+	NETMAP_REQ_OPT_PIPE_FANOUT,
+
+	/* On NETMAP_REQ_SYNC_KLOOP_START, keep polling the rings for a
+	 * while after some work has been done, instead of sleeping
+	 * right away, and optionally restrict the kloop to a subset of
+	 * the bound rings, so that several kloops (e.g., one per CPU)
+	 * can serve the same file descriptor.
+	 */
+	NETMAP_REQ_OPT_SYNC_KLOOP_SCHED,
+
+	/* On NETMAP_REQ_REGISTER, ask the driver to store the offload
+	 * results of each received packet (RSS hash, stripped VLAN tag,
+	 * checksum status, timestamp) in the buffer, right before the
+	 * packet. Requires NETMAP_REQ_OPT_OFFSETS.
+	 */
+	NETMAP_REQ_OPT_SLOT_META,
+
+	/* On NETMAP_REQ_REGISTER and NETMAP_REQ_VALE_NEWIF, choose the
+	 * size of the buffers of the private memory allocator of a VALE
+	 * port, if the request creates the port.
+	 */
+	NETMAP_REQ_OPT_BUF_SIZE,
+
+	/* On NETMAP_REQ_REGISTER, together with NETMAP_REQ_OPT_EXTMEM,
+	 * take the netmap buffers from a second user memory area that
+	 * several processes can share, while the netmap_if and the rings
+	 * stay in the (private) memory of NETMAP_REQ_OPT_EXTMEM.
+	 */
+	NETMAP_REQ_OPT_EXTMEM_BUFS,
+
+	/* On NETMAP_REQ_REGISTER of a null port (NR_REG_NULL), make the
+	 * rx rings a source of synthetic frames and/or the tx rings a
+	 * sink, for benchmarking without a NIC.
+	 */
+	NETMAP_REQ_OPT_NULL_TRAFFIC,
+
+	/* On NETMAP_REQ_SYNC_KLOOP_START, also serve the rings of other
+	 * netmap file descriptors from the same kloop.
+	 */
+	NETMAP_REQ_OPT_SYNC_KLOOP_PORTS,
+
+	/* On NETMAP_REQ_REGISTER of a copy monitor, only copy a sample
+	 * of the frames, one in N or the frames of one flow in N.
+	 */
+	NETMAP_REQ_OPT_MONITOR_SAMPLE,
+
 	/* This is a marker to count the number of available options.
 	 * New options must be added above it. */
 	NETMAP_REQ_OPT_MAX,
@@ -631,6 +744,13 @@ struct nmreq_register {
  * NETMAP_DO_RX_POLL. */
 #define NR_DO_RX_POLL		0x10000
 #define NR_NO_TX_POLL		0x20000
+/* copy monitors: copy the tx frames in the rxsync of the monitor,
+ * instead of the txsync of the monitored port */
+#define NR_MONITOR_DEFER	0x40000
+/* poll()/select() sleep on the wait queue of each bound ring, only for
+ * the requested directions, rather than on the global queue of the
+ * adapter. Linux only, ignored elsewhere. */
+#define NR_RING_POLL		0x80000
 };
 
 /* Valid values for nmreq_register.nr_mode (see above). */
@@ -675,7 +795,122 @@ struct nmreq_port_info_get {
 	uint16_t	nr_host_tx_rings; /* number of host tx rings */
 	uint16_t	nr_host_rx_rings; /* number of host rx rings */
 	uint16_t	nr_mem_id;	/* memory allocator id (in/out) */
-	uint16_t	pad[3];
+	uint16_t	pad1;
+	uint32_t	nr_meta_caps;	/* NM_META_* flags supported by the
+					 * port (see NETMAP_REQ_OPT_SLOT_META) */
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_FLOW_RULE_ADD
+ * Ask the NIC specified by hdr.nr_name to deliver the packets matching
+ * the fields selected by nr_match to rx ring nr_ring, so that each
+ * worker bound to a ring only receives its own flows. The rule goes
+ * into the n-tuple filter table of the NIC (ethtool -N on Linux) and
+ * stays there until NETMAP_REQ_FLOW_RULE_DEL, also after the netmap
+ * file descriptor is closed. nr_rule_id (in/out) is the location of
+ * the rule in the table, NR_FLOW_RULE_ANY to let the kernel choose a
+ * free one. Addresses and ports are in network byte order, and IPv4
+ * addresses use the first 4 bytes of the arrays.
+ * The request fails with EOPNOTSUPP if the NIC has no n-tuple filters,
+ * or they are disabled, and with EINVAL if the NIC cannot match the
+ * given combination of fields.
+ *
+ * nr_reqtype: NETMAP_REQ_FLOW_RULE_DEL
+ * Remove the rule at location nr_rule_id. The other fields are ignored.
+ *
+ * The netmap control device used for these operations does not need
+ * to be bound to a netmap port.
+ */
+struct nmreq_flow_rule {
+	uint32_t	nr_rule_id;
+#define NR_FLOW_RULE_ANY	0xFFFFFFFFU
+	uint32_t	nr_match;	/* NR_FLOW_* fields to be matched */
+#define NR_FLOW_PROTO		(1 << 0)  /* nr_proto */
+#define NR_FLOW_SRC_IP		(1 << 1)  /* nr_src_ip */
+#define NR_FLOW_DST_IP		(1 << 2)  /* nr_dst_ip */
+#define NR_FLOW_SRC_PORT	(1 << 3)  /* nr_src_port, needs TCP/UDP */
+#define NR_FLOW_DST_PORT	(1 << 4)  /* nr_dst_port, needs TCP/UDP */
+#define NR_FLOW_IPV6		(1 << 5)  /* match IPv6 packets, not IPv4 */
+	uint16_t	nr_ring;	/* destination rx ring */
+	uint8_t		nr_proto;	/* IPPROTO_* */
+	uint8_t		pad1;
+	uint16_t	nr_src_port;
+	uint16_t	nr_dst_port;
+	uint8_t		nr_src_ip[16];
+	uint8_t		nr_dst_ip[16];
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_RING_STATS_GET
+ * Get the counters of the tx (nr_tx = 1) or rx (nr_tx = 0) ring
+ * nr_ring_id of the port specified by hdr.nr_name. Host rings come
+ * after the hardware ones, as in nmreq_register. The counters start
+ * from zero when the port rings are created, i.e. when the first
+ * process binds the port, and the request fails with ENXIO if nobody
+ * is using the port or EINVAL if the ring does not exist.
+ * nr_syncs counts the txsync/rxsync calls and nr_slots/nr_bytes the
+ * slots (and their lengths) consumed by the txsyncs or delivered by
+ * the rxsyncs, so nr_slots/nr_syncs is the average batch. nr_drops
+ * counts the packets that were lost because the ring was full or
+ * could not hold them, nr_notifies the wakeups of the ring and
+ * nr_busy the times a sync was skipped because another thread
+ * was already syncing the ring. The last three are updated without
+ * locks and may miss some events.
+ * If netmap is built with CONFIG_NETMAP_TRACE and the trace_sample
+ * parameter is N > 0, one notification of the ring every N is
+ * timestamped and the time until the end of the next sync goes
+ * into nr_lat: bucket 0 counts the samples below 1024ns, bucket i
+ * those below 1024ns << i, and the last one all the longer ones.
+ * The netmap control device used for this operation does not need
+ * to be bound to a netmap port.
+ */
+struct nmreq_ring_stats {
+	uint16_t	nr_ring_id;
+	uint16_t	nr_tx;
+	uint32_t	pad1;
+	uint64_t	nr_syncs;
+	uint64_t	nr_slots;
+	uint64_t	nr_bytes;
+	uint64_t	nr_drops;
+	uint64_t	nr_notifies;
+	uint64_t	nr_busy;
+#define NR_RING_LAT_BUCKETS	20
+	uint64_t	nr_lat[NR_RING_LAT_BUCKETS];
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_SYNC_BATCH
+ * Sync the rings of several bound netmap file descriptors with a
+ * single system call. nr_entries points to an array of nr_num
+ * (at most NR_SYNC_BATCH_MAX) struct nmreq_sync_entry. For each
+ * entry the kernel does what NIOCTXSYNC (NR_SYNC_TX) and/or
+ * NIOCRXSYNC (NR_SYNC_RX) would do on nr_fd, or on the file
+ * descriptor of this ioctl if nr_fd is -1. If nr_first_ring and
+ * nr_last_ring are not both zero, only the bound rings in
+ * [nr_first_ring, nr_last_ring) are synced; the indices are the same
+ * for tx and rx, with the host rings after the hardware ones.
+ * The outcome of each entry goes in its nr_error field (an errno value,
+ * EBADF if nr_fd is not a netmap file descriptor). The request itself
+ * only fails if its arguments are invalid.
+ * The netmap control device used for this operation does not need
+ * to be bound to a netmap port.
+ */
+struct nmreq_sync_entry {
+	int32_t		nr_fd;
+	uint16_t	nr_flags;
+#define NR_SYNC_TX	0x1
+#define NR_SYNC_RX	0x2
+	uint16_t	nr_first_ring;
+	uint16_t	nr_last_ring;
+	uint16_t	pad1;
+	int32_t		nr_error;	/* out */
+};
+
+struct nmreq_sync_batch {
+	uint64_t	nr_entries;	/* (struct nmreq_sync_entry *) */
+	uint32_t	nr_num;
+#define NR_SYNC_BATCH_MAX	256
+	uint32_t	pad1;
 };
 
 #define	NM_BDG_NAME		"vale"	/* prefix for bridge port name */
@@ -716,6 +951,260 @@ struct nmreq_vale_list {
 	uint32_t	nr_port_idx;
 };
 
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_LIST_BULK
+ * List the ports of all the VALE switches, or only of the switch named
+ * in hdr.nr_name (e.g. "vale0:"), with a single call. nr_entries points
+ * to an array of nr_num (at most NR_VALE_LIST_BULK_MAX) entries, which
+ * the kernel fills with the ports found from the position
+ * (nr_bridge_idx, nr_port_idx) on, setting nr_num to the number of
+ * entries written and the position to the one following the last entry.
+ * The walk is complete when fewer entries than requested come back; a
+ * further call from the returned position continues it. Each entry has
+ * the same information of NETMAP_REQ_VALE_LIST and
+ * NETMAP_REQ_PORT_INFO_GET for that port. The netmap control device
+ * used for this operation does not need to be bound to a netmap port.
+ */
+struct nmreq_vale_list_entry {
+	char		nr_name[NETMAP_REQ_IFNAMSIZ]; /* port name */
+	uint16_t	nr_bridge_idx;
+	uint16_t	pad1;
+	uint32_t	nr_port_idx;
+	struct nmreq_port_info_get nr_info;
+};
+
+struct nmreq_vale_list_bulk {
+	uint64_t	nr_entries;	/* (struct nmreq_vale_list_entry *) */
+	uint32_t	nr_num;		/* in: array size, out: entries */
+#define NR_VALE_LIST_BULK_MAX	1024
+	uint16_t	nr_bridge_idx;	/* in/out: where to start */
+	uint16_t	pad1;
+	uint32_t	nr_port_idx;	/* in/out: where to start */
+	uint32_t	pad2;
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_HASH_INFO_GET
+ * Get size, occupancy and counters of the learning table of the VALE
+ * switch named in hdr.nr_name (e.g. "vale0:"). The counters are the
+ * sum over the ports currently attached to the switch.
+ */
+struct nmreq_vale_hash_info {
+	uint32_t	nr_entries;	/* size of the table */
+	uint32_t	nr_ways;	/* entries per bucket */
+	uint32_t	nr_used;	/* valid (not expired) entries */
+	uint32_t	nr_ttl;		/* seconds before an entry expires */
+	uint64_t	nr_hits;	/* unicast destination found */
+	uint64_t	nr_misses;	/* unicast destination not found */
+	uint64_t	nr_floods;	/* frames sent to all ports */
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_HASH_GET, NETMAP_REQ_VALE_HASH_SET
+ * Save and restore the learning table of the VALE switch named in
+ * hdr.nr_name (e.g. "vale0:"), so that a switch created again (e.g.
+ * after a maintenance) forwards unicast frames at once, rather than
+ * flooding them until all the addresses are learned again. The entries
+ * name the port, since port indexes are not preserved across attaches.
+ * nr_entries points to an array of nr_num (at most
+ * NR_VALE_HASH_ENTRIES_MAX) entries.
+ * GET fills the array with the valid unicast entries found from table
+ * position nr_pos on, setting nr_num to the number of entries written
+ * and nr_pos to the position following the last one. The walk is
+ * complete when fewer entries than requested come back.
+ * SET learns the entries whose port is currently attached to the
+ * switch, as if a frame from nr_mac had been seen on that port nr_age
+ * seconds ago, and sets nr_num to the number of entries learned.
+ * Entries older than the ttl of the table, and addresses the switch
+ * has already learned from live traffic, are skipped.
+ */
+struct nmreq_vale_hash_entry {
+	char		nr_port[NETMAP_REQ_IFNAMSIZ]; /* e.g. "vale0:p1" */
+	uint8_t		nr_mac[6];
+	uint16_t	nr_age;		/* seconds since last seen, at most 65535 */
+};
+
+struct nmreq_vale_hash_entries {
+	uint64_t	nr_entries;	/* (struct nmreq_vale_hash_entry *) */
+	uint32_t	nr_num;		/* in: array size, out: entries */
+#define NR_VALE_HASH_ENTRIES_MAX	1024
+	uint32_t	nr_pos;		/* GET, in/out: where to start */
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_PORT_STATS_GET
+ * Get the forwarding counters of a port of the VALE switch named in
+ * hdr.nr_name (e.g. "vale0:"). The request looks at the first port
+ * with index nr_port_idx or higher and returns its index and name,
+ * or fails with ENOENT if there is none: start from 0 and increment
+ * nr_port_idx after each call to walk all the ports of the switch.
+ * tx counts the frames sent by the port into the switch and rx the
+ * frames the switch delivered to the port. nr_rx_drops counts the
+ * frames that were lost because the rx ring of the port had no room
+ * left. nr_floods counts the frames sent by the port that went to all
+ * the other ports (default lookup function only). If netmap is built
+ * with CONFIG_NETMAP_TRACE, nr_lookup_ns is the time spent in the
+ * lookup function for the frames sent by the port. nr_tx_limited
+ * counts the frames dropped because they exceeded the rate limit set
+ * by NETMAP_REQ_VALE_QOS_SET.
+ * The counters start from zero when the port is attached and are
+ * updated without atomics, so they may miss some events.
+ */
+struct nmreq_vale_port_stats {
+	uint32_t	nr_port_idx;	/* in/out */
+	uint32_t	pad1;
+	char		nr_port_name[NETMAP_REQ_IFNAMSIZ];	/* out */
+	uint64_t	nr_tx_pkts;
+	uint64_t	nr_tx_bytes;
+	uint64_t	nr_rx_pkts;
+	uint64_t	nr_rx_bytes;
+	uint64_t	nr_rx_drops;
+	uint64_t	nr_floods;
+	uint64_t	nr_lookup_ns;
+	uint64_t	nr_tx_limited;
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_QOS_SET or NETMAP_REQ_VALE_QOS_GET
+ * Set or get the rate limit and the priority of the frames sent into
+ * the switch by the VALE port named in hdr.nr_name (e.g. "vale0:vm1").
+ * nr_rate is in bits per second, up to NR_VALE_MAX_RATE, and 0 means
+ * no limit. nr_burst is the size in bytes of the token bucket; if 0
+ * it is set to 10ms at nr_rate, but at least NR_VALE_MIN_BURST. Frames
+ * beyond the limit are dropped as they enter the switch.
+ * nr_prio goes from 0 (the default and highest) to NR_VALE_PRIOS - 1.
+ * A frame from a port with priority p only takes the free slots of
+ * the destination rx ring beyond p/(2 * NR_VALE_PRIOS) of its size,
+ * so when a destination is congested the rest is left to the ports
+ * with a higher priority.
+ * On NETMAP_REQ_VALE_QOS_SET all the fields are set at once, and the
+ * actual values are written back.
+ */
+struct nmreq_vale_qos {
+	uint64_t	nr_rate;
+#define NR_VALE_MAX_RATE	100000000000ULL	/* 100 Gbit/s */
+	uint32_t	nr_burst;
+#define NR_VALE_MIN_BURST	65536
+	uint16_t	nr_prio;
+#define NR_VALE_PRIOS		4
+	uint16_t	pad1;
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_DEFER_SET or NETMAP_REQ_VALE_DEFER_GET
+ * Set or get the deferred forwarding of the frames sent into the switch
+ * by the VALE port named in hdr.nr_name (e.g. "vale0:vm1"). When
+ * nr_batch is not 0, a NIOCTXSYNC on the port forwards nothing until
+ * its tx ring holds at least nr_batch new slots, or the oldest of them
+ * has waited nr_usecs microseconds (at most NR_VALE_DEFER_MAX_USECS,
+ * 0 selects NR_VALE_DEFER_USECS), or the ring is full. The slots stay
+ * in the ring meanwhile, and the frames of several syncs are forwarded
+ * together, so that senders that sync after every few frames pay the
+ * cost of the forwarding once per batch. A timer forwards the slots
+ * still waiting after nr_usecs, so a sender may stop at any time;
+ * slots with NS_INDIRECT set can only be forwarded by its next sync.
+ * poll(), NETMAP_REQ_SYNC_BATCH and the sync kloop always forward
+ * everything. nr_batch = 0 (the default) forwards at each sync.
+ */
+struct nmreq_vale_defer {
+	uint32_t	nr_batch;
+	uint32_t	nr_usecs;
+#define NR_VALE_DEFER_USECS	50
+#define NR_VALE_DEFER_MAX_USECS	10000
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_L3_ROUTE_ADD or NETMAP_REQ_VALE_L3_ROUTE_DEL
+ * Add or remove a route to the VALE port named in hdr.nr_name (e.g.
+ * "vale0:vm1"). nr_addr holds the prefix in network order, in the
+ * first 4 bytes for NR_VALE_L3_INET. The first route or ACL rule
+ * added to a switch replaces MAC learning with a lookup that forwards
+ * the IP frames with a route to the port of the longest matching
+ * prefix; all the other frames are still switched by MAC address.
+ * Frames are not modified. Removing the last route and rule gives
+ * the switch back its learning lookup. Routes to a port are not
+ * removed when the port is detached. Needs netmap built with the
+ * vale-l3 subsystem, otherwise the request fails with EOPNOTSUPP.
+ */
+struct nmreq_vale_l3_route {
+	uint8_t		nr_addr[16];
+	uint8_t		nr_family;
+#define NR_VALE_L3_INET		4
+#define NR_VALE_L3_INET6	6
+	uint8_t		nr_plen;	/* prefix length, in bits */
+	uint16_t	pad1;
+	uint32_t	pad2;
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_L3_ACL_ADD or NETMAP_REQ_VALE_L3_ACL_DEL
+ * Add or remove an access control rule of the VALE switch in
+ * hdr.nr_name. If hdr.nr_name also names a port ("vale0:vm1") the
+ * rule only applies to the frames sent by that port. The rules are
+ * evaluated on the IP frames entering the switch in increasing
+ * nr_prio order, the first one that matches decides whether the frame
+ * is forwarded (NR_VALE_L3_PERMIT) or dropped (NR_VALE_L3_DENY), and
+ * frames matching no rule are forwarded. A zero nr_plen, nr_proto or
+ * port range matches anything. Ports are in host order, and only
+ * match TCP, UDP and SCTP packets. nr_prio is unique in a switch, and
+ * it is the only field used by NETMAP_REQ_VALE_L3_ACL_DEL.
+ */
+struct nmreq_vale_l3_acl {
+	uint8_t		nr_src[16];
+	uint8_t		nr_dst[16];
+	uint8_t		nr_family;	/* NR_VALE_L3_INET{,6} */
+	uint8_t		nr_src_plen;
+	uint8_t		nr_dst_plen;
+	uint8_t		nr_proto;
+	uint16_t	nr_sport_min;
+	uint16_t	nr_sport_max;
+	uint16_t	nr_dport_min;
+	uint16_t	nr_dport_max;
+	uint16_t	nr_prio;
+	uint8_t		nr_action;
+#define NR_VALE_L3_PERMIT	0
+#define NR_VALE_L3_DENY		1
+	uint8_t		pad1;
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_BENCH
+ * Run nr_count iterations of the kernel routine selected by nr_test
+ * in a tight loop, and report the total time it took in nr_cycles
+ * (CPU cycle counter) and nr_ns. Each iteration performs nr_batch
+ * operations, so the cost of one operation is nr_cycles divided by
+ * nr_count * nr_batch. The request must be issued on a file
+ * descriptor bound to a port (NETMAP_REQ_REGISTER); the buffers and
+ * the allocator of the port are used by the tests:
+ *  - NR_BENCH_COPY copies nr_len bytes between two buffers of the
+ *    port, with the routine used by the VALE switches (nr_batch 1);
+ *  - NR_BENCH_LEARN runs the learning lookup of the VALE switches on
+ *    a batch of nr_batch frames with distinct source addresses, over
+ *    a private forwarding table;
+ *  - NR_BENCH_ALLOC allocates nr_batch buffers from the buffer pool
+ *    of the port, and frees them;
+ *  - NR_BENCH_CSUM computes the Internet checksum of nr_len bytes,
+ *    with the routine used to segment and checksum offloaded packets
+ *    (nr_batch 1).
+ * nr_count * nr_batch must not exceed NR_BENCH_MAX_OPS, longer runs
+ * must be split. Needs netmap built with the bench subsystem,
+ * otherwise the request fails with EOPNOTSUPP.
+ */
+struct nmreq_bench {
+	uint32_t	nr_test;
+#define NR_BENCH_COPY		1
+#define NR_BENCH_LEARN		2
+#define NR_BENCH_ALLOC		3
+#define NR_BENCH_CSUM		4
+	uint32_t	nr_count;
+	uint32_t	nr_batch;
+	uint32_t	nr_len;
+#define NR_BENCH_MAX_OPS	(1U << 20)
+	/* output */
+	uint64_t	nr_cycles;
+	uint64_t	nr_ns;
+};
+
 /*
  * nr_reqtype: NETMAP_REQ_PORT_HDR_SET or NETMAP_REQ_PORT_HDR_GET
  * Set or get the port header length of the port identified by hdr.nr_name.
@@ -729,6 +1218,12 @@ struct nmreq_port_hdr {
 /*
  * nr_reqtype: NETMAP_REQ_VALE_NEWIF
  * Create a new persistent VALE port.
+ *
+ * With NR_VALE_NEWIF_KEEPWARM the kernel keeps the port registered
+ * on all its rings until NETMAP_REQ_VALE_DELIF, so the memory, the
+ * rings and the packets queued in them survive the processes that
+ * open the port: a restarted process finds them as they were left.
+ * Such ports cannot be opened with NR_EXCLUSIVE.
  */
 struct nmreq_vale_newif {
 	uint32_t	nr_tx_slots;	/* slots in tx rings */
@@ -736,7 +1231,8 @@ struct nmreq_vale_newif {
 	uint16_t	nr_tx_rings;	/* number of tx rings */
 	uint16_t	nr_rx_rings;	/* number of rx rings */
 	uint16_t	nr_mem_id;	/* id of the memory allocator */
-	uint16_t	pad1;
+	uint16_t	nr_flags;
+#define NR_VALE_NEWIF_KEEPWARM	0x1
 };
 
 /*
@@ -758,11 +1254,22 @@ struct nmreq_vale_polling {
  * port specified by hdr.nr_name and nr_mem_id. The netmap control
  * device used for this operation does not need to be bound to a netmap
  * port.
+ *
+ * nr_reqtype: NETMAP_REQ_POOLS_EXPAND
+ * Same as above, but first append at least nr_buf_pool_objtotal (in)
+ * buffers to the buffer pool, in whole clusters, within the room given
+ * by dev.netmap.buf_grow_max (or priv_buf_grow_max for private
+ * allocators) when the allocator was created. On return the struct
+ * describes the grown pools. The ports already registered keep
+ * running, and learn about the new size from netmap_if.ni_memsize.
+ * On Linux, fails with EBUSY while a NIC maps the allocator for DMA.
  */
 struct nmreq_pools_info {
 	uint64_t	nr_memsize;
 	uint16_t	nr_mem_id; /* in/out argument */
-	uint16_t	pad1[3];
+	/* (out) NUMA node of the pools, -1 if unknown */
+	int16_t		nr_numa_node;
+	uint16_t	pad1[2];
 	uint64_t	nr_if_pool_offset;
 	uint32_t	nr_if_pool_objtotal;
 	uint32_t	nr_if_pool_objsize;
@@ -774,12 +1281,54 @@ struct nmreq_pools_info {
 	uint32_t	nr_buf_pool_objsize;
 };
 
+/*
+ * nr_reqtype: NETMAP_REQ_POOLS_STATS_GET
+ * Get the occupancy of the pools of the memory allocator of the netmap
+ * port specified by hdr.nr_name and nr_mem_id, as for
+ * NETMAP_REQ_POOLS_INFO_GET. nr_max_inuse is the highest number of
+ * objects in use since the allocator was last (re)initialized, which
+ * happens when it has no users. The free buffers parked in the per-CPU
+ * caches are counted in nr_free, and also in nr_max_inuse, which is
+ * then an upper bound.
+ * Extra buffers (nr_extra_bufs in nmreq_register) that a process does
+ * not give back on close are counted in nr_extra_leaked. Those of the
+ * buffers it was given that are neither in a ring nor in the extra
+ * buffer list of another port go back to the pool on close; the
+ * others (e.g. buffers that came from a ring) when no port is
+ * registered on the allocator anymore (except for
+ * NETMAP_REQ_OPT_EXTMEM_BUFS allocators, which keep them). Both are
+ * counted in nr_extra_reclaimed.
+ */
+struct nmreq_pool_stats {
+	uint32_t	nr_objtotal;
+	uint32_t	nr_inuse;
+	uint32_t	nr_free;
+	uint32_t	nr_max_inuse;
+};
+
+struct nmreq_pools_stats {
+	uint16_t	nr_mem_id; /* in/out argument */
+	uint16_t	pad1[3];
+	struct nmreq_pool_stats nr_if;
+	struct nmreq_pool_stats nr_ring;
+	struct nmreq_pool_stats nr_buf;
+	uint32_t	nr_buf_cached;		/* free, in the per-CPU caches */
+	uint32_t	nr_extra_holders;	/* ports holding extra buffers */
+	uint64_t	nr_extra_leaked;
+	uint64_t	nr_extra_reclaimed;
+};
+
 /*
  * nr_reqtype: NETMAP_REQ_SYNC_KLOOP_START
  * Start an in-kernel loop that syncs the rings periodically or on
  * notifications. The loop runs in the context of the ioctl syscall,
  * and only stops on NETMAP_REQ_SYNC_KLOOP_STOP.
  * The registered netmap port must be open in CSB mode.
+ * Several loops may run on the same file descriptor, each one on a
+ * different subset of the rings (see NETMAP_REQ_OPT_SYNC_KLOOP_SCHED),
+ * e.g. from threads pinned to different CPUs.
+ * Conversely, a single loop may serve the rings of several file
+ * descriptors (see NETMAP_REQ_OPT_SYNC_KLOOP_PORTS).
  */
 struct nmreq_sync_kloop_start {
 	/* Sleeping is the default synchronization method for the kloop.
@@ -796,7 +1345,9 @@ struct nm_csb_atok {
 	uint32_t cur;		  /* AW+ KR+ the cur of the appl netmap_ring */
 	uint32_t appl_need_kick;  /* AW+ KR+ kern --> appl notification enable */
 	uint32_t sync_flags;	  /* AW+ KR+ the flags of the appl [tx|rx]sync() */
-	uint32_t pad[12];	  /* pad to a 64 bytes cacheline */
+	uint32_t appl_event_idx;  /* AW+ KR+ notify the appl when hwtail moves
+				   * past this slot (event index mode) */
+	uint32_t pad[11];	  /* pad to a 64 bytes cacheline */
 };
 
 /* A CSB entry for the application <-- kernel direction. */
@@ -804,9 +1355,38 @@ struct nm_csb_ktoa {
 	uint32_t hwcur;		  /* AR+ KW+ the hwcur of the kern netmap_kring */
 	uint32_t hwtail;	  /* AR+ KW+ the hwtail of the kern netmap_kring */
 	uint32_t kern_need_kick;  /* AR+ KW+ appl-->kern notification enable */
-	uint32_t pad[13];
+	uint32_t kern_event_idx;  /* AR+ KW+ kick the kern when head moves
+				   * past this slot (event index mode) */
+	uint32_t pad[12];
 };
 
+/*
+ * Event index mode (NM_OPT_SYNC_KLOOP_EVENT_IDX) replaces the
+ * kern_need_kick and appl_need_kick booleans with slot indices, as
+ * in virtio. Notifications are implicitly disabled while the other
+ * side is busy catching up, without the need to toggle the flags.
+ * The application kicks the kernel only if the update of head it
+ * has just published crosses kern_event_idx (see
+ * nm_sync_kloop_appl_need_kick()). The kernel notifies the
+ * application only when hwtail moves past appl_event_idx, so the
+ * application can ask to be notified, e.g., when half of a tx ring
+ * has been completed, or when the next packet is received (setting
+ * it to the current tail).
+ */
+
+/* True if the move of an index from 'old' to 'new' crossed 'event',
+ * i.e. if event is in [old, new) on a ring of num_slots slots. */
+static inline int
+nm_csb_need_event(uint32_t event, uint32_t new_idx, uint32_t old,
+		  uint32_t num_slots)
+{
+	uint32_t dist = new_idx >= old ? new_idx - old :
+					 new_idx + num_slots - old;
+	uint32_t edist = event >= old ? event - old : event + num_slots - old;
+
+	return edist < dist;
+}
+
 #ifdef __linux__
 
 #ifdef __KERNEL__
@@ -828,6 +1408,10 @@ static inline void nm_ldld_barrier(void)
 	 * which is fine for us. */
 	__atomic_thread_fence(__ATOMIC_ACQUIRE);
 }
+static inline void nm_stld_barrier(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
 #endif /* !__KERNEL__ */
 
 #elif defined(__FreeBSD__)
@@ -842,6 +1426,7 @@ static inline void nm_ldld_barrier(void)
 #include <atomic>
 using std::memory_order_release;
 using std::memory_order_acquire;
+using std::memory_order_seq_cst;
 
 #else /* __cplusplus */
 #include <stdatomic.h>
@@ -855,6 +1440,10 @@ static inline void nm_ldld_barrier(void)
 {
 	atomic_thread_fence(memory_order_acquire);
 }
+static inline void nm_stld_barrier(void)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+}
 #endif /* !_KERNEL */
 
 #else  /* !__linux__ && !__FreeBSD__ */
@@ -917,6 +1506,21 @@ nm_sync_kloop_appl_read(struct nm_csb_ktoa *ktoa, uint32_t *hwtail,
 	nm_ldld_barrier();
 }
 
+/* Application side of sync-kloop, event index mode: call after
+ * nm_sync_kloop_appl_write() has moved head from old_head to head,
+ * returns true if the kernel must be kicked. */
+static inline int
+nm_sync_kloop_appl_need_kick(struct nm_csb_ktoa *ktoa, uint32_t old_head,
+			     uint32_t head, uint32_t num_slots)
+{
+	/* The store to atok->head must be visible before we load
+	 * ktoa->kern_event_idx (store-load barrier), see
+	 * sync_kloop_kick_enable(). */
+	nm_stld_barrier();
+	return nm_csb_need_event(ktoa->kern_event_idx, head, old_head,
+				 num_slots);
+}
+
 /*
  * data for NETMAP_REQ_OPT_* options
  */
@@ -947,9 +1551,54 @@ struct nmreq_opt_sync_kloop_mode {
 	struct nmreq_option	nro_opt;	/* common header */
 #define NM_OPT_SYNC_KLOOP_DIRECT_TX (1 << 0)
 #define NM_OPT_SYNC_KLOOP_DIRECT_RX (1 << 1)
+/* use kern_event_idx and appl_event_idx in place of the
+ * kern_need_kick and appl_need_kick flags */
+#define NM_OPT_SYNC_KLOOP_EVENT_IDX (1 << 2)
 	uint32_t mode;
 };
 
+struct nmreq_opt_sync_kloop_sched {
+	struct nmreq_option	nro_opt;	/* common header */
+	/* (in) after a loop iteration that moved some ring pointer,
+	 * keep polling all the rings for nro_spin_us microseconds,
+	 * with the kicks from the application disabled, before
+	 * going back to sleep_us (or to the eventfd wait).
+	 * Zero means the default behaviour. At most one second. */
+	uint32_t		nro_spin_us;
+	uint32_t		nro_flags;
+/* serve only the rings selected below. Indices are relative to the
+ * rings bound to the file descriptor, i.e., to the CSB entries.
+ * Each ring can be served by at most one kloop at a time. */
+#define NM_OPT_SYNC_KLOOP_SUBSET	(1 << 0)
+	uint16_t		nro_tx_first;
+	uint16_t		nro_tx_num;
+	uint16_t		nro_rx_first;
+	uint16_t		nro_rx_num;
+};
+
+/* option NETMAP_REQ_OPT_SYNC_KLOOP_PORTS
+ *
+ * The kloop also serves all the rings bound to each of the netmap file
+ * descriptors in nro_fds[], which must be open in CSB mode, in addition
+ * to the ones of the file descriptor of the request (which may be
+ * restricted with NETMAP_REQ_OPT_SYNC_KLOOP_SCHED). The number of
+ * entries follows from nro_opt.nro_size, and is less than
+ * NM_SYNC_KLOOP_PORTS_MAX. The ports are processed round-robin,
+ * starting from a different one at each iteration.
+ * With NETMAP_REQ_OPT_SYNC_KLOOP_EVENTFDS, the eventfds of the file
+ * descriptor of the request come first, followed by the ones of each
+ * port in nro_fds[], in order. The direct modes of
+ * NETMAP_REQ_OPT_SYNC_KLOOP_MODE are not supported.
+ * A NETMAP_REQ_SYNC_KLOOP_STOP on one of the nro_fds[] only removes
+ * that port from the kloop, while on the file descriptor of the
+ * request it stops the kloop.
+ */
+struct nmreq_opt_sync_kloop_ports {
+	struct nmreq_option	nro_opt;	/* common header */
+#define NM_SYNC_KLOOP_PORTS_MAX	64
+	int32_t			nro_fds[0];
+};
+
 struct nmreq_opt_extmem {
 	struct nmreq_option	nro_opt;	/* common header */
 	uint64_t		nro_usrptr;	/* (in) ptr to usr memory */
@@ -993,4 +1642,229 @@ struct nmreq_opt_offsets {
 	uint64_t		nro_min_gap;
 };
 
+/* option NETMAP_REQ_OPT_VALE_HASH */
+struct nmreq_opt_vale_hash {
+	struct nmreq_option	nro_opt;
+	/* (in/out) number of entries of the learning table, rounded up
+	 * to a multiple of the bucket size. 0 means the default
+	 * (dev.netmap.vale_hash_size). The actual size of the table
+	 * is returned, also when the switch already exists.
+	 */
+	uint32_t		nro_entries;
+	uint32_t		pad1;
+};
+
+/* option NETMAP_REQ_OPT_NUMA */
+struct nmreq_opt_numa {
+	struct nmreq_option	nro_opt;
+	/* (in/out) NUMA node for the pools, or -1 to use the node of
+	 * the NIC (the default). The hint is ignored if the pools are
+	 * already allocated. The node actually used is returned, or -1
+	 * if unknown.
+	 */
+	int32_t			nro_node;
+	uint32_t		pad1;
+};
+
+/* one instruction of a classic BPF program, same layout as
+ * struct bpf_insn.
+ */
+struct nm_bpf_insn {
+	uint16_t		code;
+	uint8_t			jt;
+	uint8_t			jf;
+	uint32_t		k;
+};
+
+#define NM_MONITOR_FILTER_MAXINSNS	256
+
+/* option NETMAP_REQ_OPT_MONITOR_FILTER */
+struct nmreq_opt_monitor_filter {
+	struct nmreq_option	nro_opt;
+	/* (in) maximum number of bytes copied from each frame,
+	 * 0 means no limit. The slot len of the monitor reports
+	 * the number of bytes actually copied.
+	 */
+	uint32_t		nro_snaplen;
+	/* (in) number of instructions in nro_insns, at most
+	 * NM_MONITOR_FILTER_MAXINSNS. 0 means no filter. The program
+	 * returns the number of bytes to keep, 0 to drop the frame.
+	 * nro_opt.nro_size must cover the whole array.
+	 */
+	uint32_t		nro_ninsns;
+	struct nm_bpf_insn	nro_insns[0];
+};
+
+/* option NETMAP_REQ_OPT_MONITOR_SAMPLE
+ *
+ * The sampling is applied before NETMAP_REQ_OPT_MONITOR_FILTER and
+ * before any copy, so the frames that are not sampled only cost a
+ * counter increment (or a hash of the headers) in the monitored port.
+ * Not available for zero-copy monitors.
+ */
+struct nmreq_opt_monitor_sample {
+	struct nmreq_option	nro_opt;
+	/* (in) copy one frame out of nro_rate, independently on each
+	 * monitored ring. 0 and 1 copy all the frames. */
+	uint32_t		nro_rate;
+	uint32_t		nro_flags;
+/* sample flows instead of frames: a frame is copied if the symmetric
+ * hash of its IP addresses and TCP/UDP ports is a multiple of
+ * nro_rate, so both directions of a sampled flow are copied in full.
+ * Non-IP frames always are. */
+#define NR_MONITOR_SAMPLE_FLOW	0x1
+};
+
+/* option NETMAP_REQ_OPT_PIPE_FANOUT */
+struct nmreq_opt_pipe_fanout {
+	struct nmreq_option	nro_opt;
+	/* (in/out) distribution mode. With NM_PIPE_FANOUT_NONE (the
+	 * default) master tx ring i is connected to slave rx ring i.
+	 * Otherwise each master tx ring feeds all the slave rx rings,
+	 * one packet at a time, choosing the ring in round-robin order
+	 * or by a symmetric hash of the IP addresses and TCP/UDP ports.
+	 * The mode of the pipe is returned, also if it already exists.
+	 */
+	uint32_t		nro_mode;
+#define NM_PIPE_FANOUT_NONE	0
+#define NM_PIPE_FANOUT_RR	1
+#define NM_PIPE_FANOUT_HASH	2
+	uint32_t		pad1;
+};
+
+/*
+ * Per-packet metadata enabled by NETMAP_REQ_OPT_SLOT_META. The
+ * structure is stored in the netmap buffer right before the packet,
+ * i.e. at NETMAP_BUF_OFFSET(ring, slot) - sizeof(struct nm_slot_meta)
+ * (see NETMAP_SLOT_META() in netmap_user.h), so the application must
+ * put an offset of at least that many bytes, multiple of 8, in the
+ * slots it returns to the rx ring. Slots with a smaller offset get
+ * no metadata. For packets that span several slots, the metadata is
+ * in the last one. 'flags' tells which fields are valid.
+ *
+ * NM_META_TS is available on the rx rings of all ports: when the
+ * driver cannot timestamp the packets, netmap does it at rxsync, and
+ * spreads the packets of a sync evenly between the time of the
+ * previous rxsync and the current one.
+ *
+ * On the tx rings the same structure carries the offloads requested
+ * for the packet, in the first slot of the packet, and 'flags' holds
+ * NM_META_TX_* bits. The application fills in the header lengths and
+ * stores in the TCP/UDP checksum field the sum of the pseudo-header
+ * (not complemented, as for the virtio-net NEEDS_CSUM packets); the
+ * driver ignores the request if the slot offset leaves no room for it.
+ * The application must clear 'flags' for the packets that need no
+ * offload.
+ */
+struct nm_slot_meta {
+	uint64_t		ts;	  /* receive time (ns since the Epoch) */
+	uint32_t		hash;	  /* RSS hash computed by the NIC */
+	uint16_t		vlan_tci; /* VLAN tag stripped by the NIC */
+	uint16_t		flags;
+#define NM_META_HASH		(1 << 0)  /* hash is valid */
+#define NM_META_VLAN		(1 << 1)  /* vlan_tci is valid */
+#define NM_META_TS		(1 << 2)  /* ts is valid */
+#define NM_META_L3_CSUM_OK	(1 << 3)  /* IPv4 header checksum verified */
+#define NM_META_L4_CSUM_OK	(1 << 4)  /* TCP/UDP checksum verified */
+#define NM_META_CSUM_BAD	(1 << 5)  /* a verified checksum was wrong */
+#define NM_META_TX_IP_CSUM	(1 << 8)  /* compute the IPv4 header checksum */
+#define NM_META_TX_TCP_CSUM	(1 << 9)  /* compute the TCP checksum */
+#define NM_META_TX_UDP_CSUM	(1 << 10) /* compute the UDP checksum */
+#define NM_META_TX_TSO		(1 << 11) /* split in mss-sized TCP segments */
+#define NM_META_TX_IPV6		(1 << 12) /* the L3 header is IPv6 (not a
+					   * capability) */
+	/* tx only */
+	uint16_t		mss;	  /* TCP payload per segment (TSO) */
+	uint8_t			l2_len;	  /* bytes up to the L3 header */
+	uint8_t			l4_len;	  /* bytes in the TCP/UDP header */
+	uint16_t		l3_len;	  /* bytes in the L3 header, IPv6
+					   * extension headers included */
+	uint16_t		pad;
+};
+
+/* option NETMAP_REQ_OPT_SLOT_META */
+struct nmreq_opt_slot_meta {
+	struct nmreq_option	nro_opt;
+	/* (in) NM_META_* fields and NM_META_TX_* offloads wanted by
+	 * the application, (out) the ones that the driver of the port
+	 * supports (also reported by NETMAP_REQ_PORT_INFO_GET).
+	 * The request fails with EOPNOTSUPP if none of the wanted
+	 * fields is supported, and with EINVAL if the offsets do not
+	 * leave room for the metadata.
+	 */
+	uint32_t		nro_flags;
+	uint32_t		pad1;
+};
+
+/* option NETMAP_REQ_OPT_BUF_SIZE */
+struct nmreq_opt_buf_size {
+	struct nmreq_option	nro_opt;
+	/* (in) size of the netmap buffers, between 64 and 65536 bytes.
+	 * It is rounded up to a multiple of 64 and, on return, (out)
+	 * holds the actual size. Zero asks for the default size.
+	 * The frames that do not fit in one buffer are split across
+	 * several slots (NS_MOREFRAG) when they are forwarded to the
+	 * port. The option is not accepted if the port uses a memory
+	 * allocator chosen with nr_mem_id, or if it already exists.
+	 */
+	uint32_t		nro_buf_size;
+	uint32_t		pad1;
+};
+
+/* option NETMAP_REQ_OPT_EXTMEM_BUFS
+ *
+ * The buffer pool is laid out in the nro_memsize bytes at nro_usrptr
+ * (typically a shared file mapping) and is shared by all the allocators
+ * that attach to the same pages, each one with its own rings and
+ * netmap_if from NETMAP_REQ_OPT_EXTMEM. Each allocator owns a share
+ * of the buffers, and buffer indexes mean the same in all of them,
+ * so VALE ports of different processes swap buffers instead of
+ * copying packets. The share follows the buffers: a swap gives one
+ * buffer for another, and the buffers an allocator holds when it is
+ * destroyed go back to the pool. The rings of a process are not
+ * visible to the others; the buffers are.
+ * The ring buf_ofs field accounts for the distance between the two
+ * areas, so NETMAP_BUF() works as usual.
+ */
+struct nmreq_opt_extmem_bufs {
+	struct nmreq_option	nro_opt;	/* common header */
+	uint64_t		nro_usrptr;	/* (in) ptr to the shared memory */
+	uint64_t		nro_memsize;	/* (in) size of the shared memory */
+	/* (in/out) buffer size, which must be the same for all the
+	 * processes. Zero asks for the one of the first process, or
+	 * for the default. */
+	uint32_t		nro_buf_size;
+	/* (out) number of buffers in the shared memory */
+	uint32_t		nro_buf_total;
+	/* (in/out) number of buffers given to this allocator, taken
+	 * among the ones no other allocator owns. Zero asks for the
+	 * default number of buffers of a private allocator. */
+	uint32_t		nro_buf_num;
+	uint32_t		pad1;
+};
+
+/* option NETMAP_REQ_OPT_NULL_TRAFFIC
+ *
+ * With NR_NULL_SOURCE each rxsync fills the free slots of the rx ring
+ * with a UDP/IPv4 frame of nro_pkt_len bytes, written once in each
+ * buffer (buffers swapped in with NS_BUF_CHANGED are written again).
+ * With nro_rate, each ring produces at most that many frames per
+ * second; since nothing wakes up a sleeping poll(), rate limited
+ * sources are meant for busy waiting applications.
+ * With NR_NULL_SINK each txsync consumes all the slots of the tx
+ * ring. The frames are counted in the ring statistics
+ * (NETMAP_REQ_RING_STATS_GET).
+ */
+struct nmreq_opt_null_traffic {
+	struct nmreq_option	nro_opt;	/* common header */
+	uint32_t		nro_flags;
+#define NR_NULL_SOURCE		0x1
+#define NR_NULL_SINK		0x2
+	/* (in/out) frame length, between 42 and the buffer size.
+	 * Zero means 60. */
+	uint32_t		nro_pkt_len;
+	/* (in) frames per second per rx ring, 0 for no limit */
+	uint64_t		nro_rate;
+};
+
 #endif /* _NET_NETMAP_H_ */
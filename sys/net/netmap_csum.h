@@ -0,0 +1,185 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#ifndef NETMAP_CSUM_H
+#define NETMAP_CSUM_H
+
+/*
+ * Internet checksum (RFC 1071) shared by the kernel offloadings and
+ * the applications.
+ *
+ * nm_csum_partial() returns a 32 bit partial sum of the 16 bit words
+ * of a buffer, taken in host byte order as Linux csum_partial() does.
+ * The partial sum can be passed to further calls, reduced to 16 bits
+ * with nm_csum_reduce(), or complemented with nm_csum_fold() to get
+ * the value to be stored in the packet as is.
+ *
+ * The main loop adds 64 bit words with an add-with-carry chain on
+ * amd64, and 32 bit words into a 64 bit accumulator elsewhere.
+ * Userspace programs built for AVX2 or NEON use a vector loop; the
+ * kernels do not touch the vector registers and get the scalar one.
+ */
+
+#if !defined(_KERNEL) && !defined(__KERNEL__)
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NM_CSUM_AVX2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define NM_CSUM_NEON
+#endif
+#endif /* !_KERNEL && !__KERNEL__ */
+
+/* unaligned loads that do not break strict aliasing */
+typedef uint32_t __attribute__((__may_alias__, __aligned__(1))) nm_csum_u32;
+typedef uint16_t __attribute__((__may_alias__, __aligned__(1))) nm_csum_u16;
+
+static inline uint32_t
+nm_csum_reduce64(uint64_t sum)
+{
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	return (uint32_t)sum;
+}
+
+/* reduce a partial sum to 16 bits, without complementing it */
+static inline uint16_t
+nm_csum_reduce(uint32_t sum)
+{
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+static inline uint16_t
+nm_csum_fold(uint32_t sum)
+{
+	return (uint16_t)~nm_csum_reduce(sum);
+}
+
+static inline uint32_t
+nm_csum_partial(const void *data, size_t len, uint32_t sum)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	uint64_t acc = sum;
+
+#if defined(NM_CSUM_AVX2)
+	if (len >= 64) {
+		const __m256i lo16 = _mm256_set1_epi32(0xFFFF);
+		const __m256i lo32 = _mm256_set1_epi64x(0xFFFFFFFF);
+		__m256i acc64 = _mm256_setzero_si256();
+		uint64_t lanes[4];
+
+		while (len >= 64) {
+			__m256i acc32 = _mm256_setzero_si256();
+			/* each step adds less than 2^18 to a 32 bit lane */
+			size_t n = len / 64 < 8192 ? len / 64 : 8192;
+
+			len -= n * 64;
+			for (; n > 0; n--, p += 64) {
+				__m256i a = _mm256_loadu_si256((const __m256i *)p);
+				__m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+
+				acc32 = _mm256_add_epi32(acc32,
+					_mm256_and_si256(a, lo16));
+				acc32 = _mm256_add_epi32(acc32,
+					_mm256_srli_epi32(a, 16));
+				acc32 = _mm256_add_epi32(acc32,
+					_mm256_and_si256(b, lo16));
+				acc32 = _mm256_add_epi32(acc32,
+					_mm256_srli_epi32(b, 16));
+			}
+			acc64 = _mm256_add_epi64(acc64,
+				_mm256_and_si256(acc32, lo32));
+			acc64 = _mm256_add_epi64(acc64,
+				_mm256_srli_epi64(acc32, 32));
+		}
+		_mm256_storeu_si256((__m256i *)lanes, acc64);
+		acc += nm_csum_reduce64(lanes[0] + lanes[1]);
+		acc += nm_csum_reduce64(lanes[2] + lanes[3]);
+	}
+#elif defined(NM_CSUM_NEON)
+	if (len >= 64) {
+		uint64x2_t acc64 = vdupq_n_u64(0);
+
+		while (len >= 64) {
+			uint32x4_t acc32 = vdupq_n_u32(0);
+			/* each step adds less than 2^19 to a 32 bit lane */
+			size_t n = len / 64 < 4096 ? len / 64 : 4096;
+
+			len -= n * 64;
+			for (; n > 0; n--, p += 64) {
+				acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(vld1q_u8(p)));
+				acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(vld1q_u8(p + 16)));
+				acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(vld1q_u8(p + 32)));
+				acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(vld1q_u8(p + 48)));
+			}
+			acc64 = vpadalq_u32(acc64, acc32);
+		}
+		acc += nm_csum_reduce64(vgetq_lane_u64(acc64, 0) +
+					vgetq_lane_u64(acc64, 1));
+	}
+#elif defined(__x86_64__) && defined(__GNUC__)
+	for (; len >= 32; len -= 32, p += 32) {
+		__asm__(
+			"addq 0(%1), %0\n\t"
+			"adcq 8(%1), %0\n\t"
+			"adcq 16(%1), %0\n\t"
+			"adcq 24(%1), %0\n\t"
+			"adcq $0, %0"
+			: "+r" (acc)
+			: "r" (p), "m" (*(const uint8_t (*)[32])p)
+			: "cc");
+	}
+	/* the carries are folded in, make room for the tail */
+	acc = nm_csum_reduce64(acc);
+#endif
+	for (; len >= 16; len -= 16, p += 16) {
+		acc += (uint64_t)((const nm_csum_u32 *)p)[0] +
+			((const nm_csum_u32 *)p)[1] +
+			((const nm_csum_u32 *)p)[2] +
+			((const nm_csum_u32 *)p)[3];
+	}
+	for (; len >= 4; len -= 4, p += 4)
+		acc += *(const nm_csum_u32 *)p;
+	if (len >= 2) {
+		acc += *(const nm_csum_u16 *)p;
+		p += 2;
+	}
+	if (len & 1) {
+		/* pad with a zero byte, in whatever byte order */
+		uint16_t last = 0;
+
+		*(uint8_t *)&last = *p;
+		acc += last;
+	}
+	return nm_csum_reduce64(acc);
+}
+
+#endif /* NETMAP_CSUM_H */
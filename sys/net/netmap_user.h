@@ -95,6 +95,9 @@
 #include <ctype.h>
 #include <string.h>	/* memset */
 #include <sys/time.h>   /* gettimeofday */
+#ifdef __SSE2__
+#include <emmintrin.h>	/* nm_pkt_copy_nt() */
+#endif
 
 #ifndef likely
 #define likely(x)	__builtin_expect(!!(x), 1)
@@ -138,6 +141,11 @@
 #define NETMAP_BUF_OFFSET(ring, slot)			\
 	(NETMAP_BUF(ring, (slot)->buf_idx) + NETMAP_ROFFSET(ring, slot))
 
+/* the metadata in front of the packet (NETMAP_REQ_OPT_SLOT_META) */
+#define NETMAP_SLOT_META(ring, slot)			\
+	((struct nm_slot_meta *)(NETMAP_BUF_OFFSET(ring, slot) - \
+		sizeof(struct nm_slot_meta)))
+
 
 static inline uint32_t
 nm_ring_next(struct netmap_ring *r, uint32_t i)
@@ -195,32 +203,113 @@ nm_ring_space(struct netmap_ring *ring)
     } while (0)
 #endif
 
+/*
+ * Vector width used by nm_pkt_copy(), chosen at compile time from the
+ * instruction sets enabled for the program (e.g. -mavx2, -march=native).
+ * Vectors are accessed unaligned, so buffers need no special alignment.
+ */
+#if defined(__AVX512F__)
+#define NM_PKT_COPY_VEC		64
+#elif defined(__AVX2__) || defined(__AVX__)
+#define NM_PKT_COPY_VEC		32
+#elif defined(__SSE2__) || defined(__ARM_NEON)
+#define NM_PKT_COPY_VEC		16
+#endif
+
+#ifdef NM_PKT_COPY_VEC
+typedef uint64_t nm_pkt_vec_t __attribute__((vector_size(NM_PKT_COPY_VEC),
+			aligned(1), __may_alias__));
+#endif
+
+/* copy one 64 byte block */
+static inline void
+nm_pkt_copy64(const void *_src, void *_dst)
+{
+#ifdef NM_PKT_COPY_VEC
+	const nm_pkt_vec_t *src = (const nm_pkt_vec_t *)_src;
+	nm_pkt_vec_t *dst = (nm_pkt_vec_t *)_dst;
+	int i;
+
+	for (i = 0; i < 64 / NM_PKT_COPY_VEC; i++)
+		dst[i] = src[i];
+#else
+	const uint64_t *src = (const uint64_t *)_src;
+	uint64_t *dst = (uint64_t *)_dst;
+
+	dst[0] = src[0];
+	dst[1] = src[1];
+	dst[2] = src[2];
+	dst[3] = src[3];
+	dst[4] = src[4];
+	dst[5] = src[5];
+	dst[6] = src[6];
+	dst[7] = src[7];
+#endif
+}
+
 /*
  * this is a slightly optimized copy routine which rounds
  * to multiple of 64 bytes and is often faster than dealing
  * with other odd sizes. We assume there is enough room
  * in the source and destination buffers.
+ * Long or odd sized frames are left to memcpy().
  */
 static inline void
 nm_pkt_copy(const void *_src, void *_dst, int l)
 {
-	const uint64_t *src = (const uint64_t *)_src;
-	uint64_t *dst = (uint64_t *)_dst;
+	const char *src = (const char *)_src;
+	char *dst = (char *)_dst;
 
 	if (unlikely(l >= 1024 || l % 64)) {
 		memcpy(dst, src, l);
 		return;
 	}
-	for (; likely(l > 0); l-=64) {
-		*dst++ = *src++;
-		*dst++ = *src++;
-		*dst++ = *src++;
-		*dst++ = *src++;
-		*dst++ = *src++;
-		*dst++ = *src++;
-		*dst++ = *src++;
-		*dst++ = *src++;
+	for (; likely(l > 0); l-=64, src += 64, dst += 64)
+		nm_pkt_copy64(src, dst);
+}
+
+/*
+ * Same as nm_pkt_copy(), but with non-temporal stores where available
+ * (x86 with SSE2 and a 16 byte aligned destination), so that the copy
+ * does not evict useful data from the cache. Use it when the
+ * destination will be read by a different core, e.g. a port on a
+ * remote NUMA node, and not by the caller.
+ * Non-temporal stores are weakly ordered: call nm_pkt_copy_nt_done()
+ * once per batch, before updating head and cur in the ring.
+ */
+static inline void
+nm_pkt_copy_nt(const void *_src, void *_dst, int l)
+{
+#ifdef __SSE2__
+	const __m128i *src = (const __m128i *)_src;
+	__m128i *dst = (__m128i *)_dst;
+
+	if (unlikely(l % 64 || ((uintptr_t)dst & 15))) {
+		nm_pkt_copy(src, dst, l);
+		return;
+	}
+	for (; likely(l > 0); l -= 64, src += 4, dst += 4) {
+		__m128i a = _mm_loadu_si128(src);
+		__m128i b = _mm_loadu_si128(src + 1);
+		__m128i c = _mm_loadu_si128(src + 2);
+		__m128i d = _mm_loadu_si128(src + 3);
+
+		_mm_stream_si128(dst, a);
+		_mm_stream_si128(dst + 1, b);
+		_mm_stream_si128(dst + 2, c);
+		_mm_stream_si128(dst + 3, d);
 	}
+#else
+	nm_pkt_copy(_src, _dst, l);
+#endif
+}
+
+static inline void
+nm_pkt_copy_nt_done(void)
+{
+#ifdef __SSE2__
+	_mm_sfence();
+#endif
 }
 
 #ifdef NETMAP_WITH_LIBS
@@ -365,6 +454,7 @@ enum {
 	NM_OPEN_ARG2 =		0x200000,
 	NM_OPEN_ARG3 =		0x400000,
 	NM_OPEN_RING_CFG =	0x800000, /* tx|rx rings|slots */
+	NM_OPEN_PREFAULT =	0x1000000, /* fault in the mapped region */
 };
 
 
@@ -762,6 +852,9 @@ nm_parse(const char *ifname, struct nm_desc *d, char *err)
 			case 'r':
 				nr_flags |= NR_MONITOR_RX;
 				break;
+			case 'd':
+				nr_flags |= NR_MONITOR_DEFER;
+				break;
 			case 'R':
 				nr_flags |= NR_RX_RINGS_ONLY;
 				break;
@@ -826,6 +919,8 @@ fail:
  * NM_OPEN_ARG1		use req.nr_arg1 from arg
  * NM_OPEN_ARG2		use req.nr_arg2 from arg
  * NM_OPEN_RING_CFG	user ring config from arg
+ * NM_OPEN_PREFAULT	touch each page of the region after mmap, so that
+ *			the datapath does not take page faults at startup
  */
 static struct nm_desc *
 nm_open(const char *ifname, const struct nmreq *req,
@@ -934,6 +1029,13 @@ nm_open(const char *ifname, const struct nmreq *req,
 	        snprintf(errmsg, MAXERRMSG, "mmap failed: %s", strerror(errno));
 		goto fail;
 	}
+	if ((new_flags & NM_OPEN_PREFAULT) && d->mem != NULL) {
+		const volatile char *p = (const char *)d->mem;
+		size_t i, pgsz = (size_t)sysconf(_SC_PAGESIZE);
+
+		for (i = 0; i < d->memsize; i += pgsz)
+			(void)p[i];
+	}
 
 
 #ifdef DEBUG_NETMAP_USER
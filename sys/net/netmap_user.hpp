@@ -0,0 +1,300 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * $FreeBSD$
+ *
+ * C++17 wrappers for the netmap rings, header only.
+ *
+ * netmap::ring<Slots, Offsets> wraps a struct netmap_ring. With Slots
+ * a power of two known at compile time the index arithmetic becomes a
+ * mask, and with Offsets == false the buffer address ignores the slot
+ * offset (NETMAP_REQ_OPT_OFFSETS), so that the compiler can specialize
+ * the per-packet loop. Slots == 0 falls back to the run time ring size
+ * of nm_ring_next(). netmap::with_ring() picks the specialization that
+ * matches a given ring at run time:
+ *
+ *	netmap::with_ring<512, 1024, 2048>(NETMAP_RXRING(nifp, i),
+ *	    [&](auto rx) {
+ *		for (auto s : rx.pending())
+ *			consume(s.buf(), s.len());
+ *		rx.release_all();
+ *	    });
+ *
+ * If <libnetmap.h> is available netmap::port is also defined, an
+ * owning (RAII) handle for a struct nmport_d.
+ */
+
+#ifndef _NET_NETMAP_USER_HPP_
+#define _NET_NETMAP_USER_HPP_
+
+#include <cassert>
+#include <cstdint>
+#include <utility>
+
+#include <net/netmap_user.h>
+
+#if __has_include(<libnetmap.h>)
+#include <cerrno>
+#include <system_error>
+#include <libnetmap.h>
+#define NETMAP_USER_HPP_PORT
+#endif
+
+namespace netmap {
+
+template <uint32_t Slots = 0, bool Offsets = false>
+class ring {
+	static_assert((Slots & (Slots - 1)) == 0,
+		"the ring size must be a power of two");
+
+public:
+	/* a slot of the ring, as seen by the iterators */
+	class slot_ref {
+	public:
+		slot_ref(const ring *r, uint32_t i) noexcept : r_(r), i_(i) {}
+
+		uint32_t index() const noexcept { return i_; }
+		struct netmap_slot &slot() const noexcept
+		{
+			return r_->r_->slot[i_];
+		}
+		char *buf() const noexcept { return r_->buf(slot()); }
+		uint16_t len() const noexcept { return slot().len; }
+		void set_len(uint16_t len) const noexcept { slot().len = len; }
+		uint16_t flags() const noexcept { return slot().flags; }
+		void set_flags(uint16_t f) const noexcept { slot().flags = f; }
+		bool more_frag() const noexcept
+		{
+			return slot().flags & NS_MOREFRAG;
+		}
+
+	private:
+		const ring *r_;
+		uint32_t i_;
+	};
+
+	class iterator {
+	public:
+		iterator(const ring *r, uint32_t i) noexcept : r_(r), i_(i) {}
+
+		slot_ref operator*() const noexcept { return slot_ref(r_, i_); }
+		iterator &operator++() noexcept
+		{
+			i_ = r_->next(i_);
+			return *this;
+		}
+		bool operator==(const iterator &o) const noexcept
+		{
+			return i_ == o.i_;
+		}
+		bool operator!=(const iterator &o) const noexcept
+		{
+			return i_ != o.i_;
+		}
+		uint32_t index() const noexcept { return i_; }
+
+	private:
+		const ring *r_;
+		uint32_t i_;
+	};
+
+	/* the slots in [first, last) */
+	class range {
+	public:
+		range(iterator b, iterator e) noexcept : b_(b), e_(e) {}
+		iterator begin() const noexcept { return b_; }
+		iterator end() const noexcept { return e_; }
+
+	private:
+		iterator b_, e_;
+	};
+
+	explicit ring(struct netmap_ring *r) noexcept : r_(r)
+	{
+		assert(Slots == 0 || r->num_slots == Slots);
+		assert(Offsets || r->offset_mask == 0);
+	}
+
+	struct netmap_ring *get() const noexcept { return r_; }
+
+	uint32_t size() const noexcept
+	{
+		if constexpr (Slots != 0)
+			return Slots;
+		else
+			return r_->num_slots;
+	}
+
+	uint32_t next(uint32_t i) const noexcept
+	{
+		if constexpr (Slots != 0)
+			return (i + 1) & (Slots - 1);
+		else
+			return nm_ring_next(r_, i);
+	}
+
+	/* number of slots from i to j, going forward */
+	uint32_t distance(uint32_t i, uint32_t j) const noexcept
+	{
+		if constexpr (Slots != 0) {
+			return (j - i) & (Slots - 1);
+		} else {
+			return j >= i ? j - i : j + r_->num_slots - i;
+		}
+	}
+
+	/* as nm_ring_space(): slots from head to tail */
+	uint32_t space() const noexcept { return distance(r_->head, r_->tail); }
+	bool empty() const noexcept { return r_->cur == r_->tail; }
+
+	char *buf(const struct netmap_slot &s) const noexcept
+	{
+		if constexpr (Offsets)
+			return NETMAP_BUF_OFFSET(r_, &s);
+		else
+			return NETMAP_BUF(r_, s.buf_idx);
+	}
+
+	/* the slots owned by the application, from cur to tail */
+	range pending() const noexcept
+	{
+		return range(iterator(this, r_->cur), iterator(this, r_->tail));
+	}
+
+	/* give back to the kernel the slots before it */
+	void release(iterator it) const noexcept
+	{
+		r_->head = r_->cur = it.index();
+	}
+	void release_all() const noexcept { r_->head = r_->cur = r_->tail; }
+
+	/* move cur, but keep the slots until head is moved */
+	void advance(iterator it) const noexcept { r_->cur = it.index(); }
+
+private:
+	struct netmap_ring *r_;
+};
+
+namespace detail {
+
+template <bool Offsets, typename F>
+inline void
+with_ring_size(struct netmap_ring *r, F &&f)
+{
+	f(ring<0, Offsets>(r));
+}
+
+template <bool Offsets, uint32_t N, uint32_t... Rest, typename F>
+inline void
+with_ring_size(struct netmap_ring *r, F &&f)
+{
+	if (r->num_slots == N)
+		f(ring<N, Offsets>(r));
+	else
+		with_ring_size<Offsets, Rest...>(r, std::forward<F>(f));
+}
+
+} /* namespace detail */
+
+/*
+ * Call f with the ring<> that matches r: one of the Sizes, or the
+ * generic one, with or without offsets. Each combination instantiates
+ * f once, so keep the list short.
+ */
+template <uint32_t... Sizes, typename F>
+inline void
+with_ring(struct netmap_ring *r, F &&f)
+{
+	if (r->offset_mask != 0)
+		detail::with_ring_size<true, Sizes...>(r, std::forward<F>(f));
+	else
+		detail::with_ring_size<false, Sizes...>(r, std::forward<F>(f));
+}
+
+#ifdef NETMAP_USER_HPP_PORT
+/* owns a struct nmport_d, closed by the destructor */
+class port {
+public:
+	/* nmport_open(), throws std::system_error on failure */
+	explicit port(const char *portspec) : d_(nmport_open(portspec))
+	{
+		if (d_ == nullptr)
+			throw std::system_error(errno, std::generic_category(),
+					portspec);
+	}
+	/* adopt a descriptor already opened with the C API */
+	explicit port(struct nmport_d *d) noexcept : d_(d) {}
+	port(port &&o) noexcept : d_(std::exchange(o.d_, nullptr)) {}
+	port &operator=(port &&o) noexcept
+	{
+		if (this != &o) {
+			reset();
+			d_ = std::exchange(o.d_, nullptr);
+		}
+		return *this;
+	}
+	port(const port &) = delete;
+	port &operator=(const port &) = delete;
+	~port() { reset(); }
+
+	void reset() noexcept
+	{
+		if (d_ != nullptr)
+			nmport_close(d_);
+		d_ = nullptr;
+	}
+	struct nmport_d *release() noexcept
+	{
+		return std::exchange(d_, nullptr);
+	}
+
+	struct nmport_d *get() const noexcept { return d_; }
+	int fd() const noexcept { return d_->fd; }
+	struct netmap_if *nifp() const noexcept { return d_->nifp; }
+
+	uint16_t first_tx_ring() const noexcept { return d_->first_tx_ring; }
+	uint16_t last_tx_ring() const noexcept { return d_->last_tx_ring; }
+	uint16_t first_rx_ring() const noexcept { return d_->first_rx_ring; }
+	uint16_t last_rx_ring() const noexcept { return d_->last_rx_ring; }
+
+	struct netmap_ring *tx_ring(uint16_t i) const noexcept
+	{
+		return NETMAP_TXRING(d_->nifp, i);
+	}
+	struct netmap_ring *rx_ring(uint16_t i) const noexcept
+	{
+		return NETMAP_RXRING(d_->nifp, i);
+	}
+
+private:
+	struct nmport_d *d_;
+};
+#endif /* NETMAP_USER_HPP_PORT */
+
+} /* namespace netmap */
+
+#endif /* _NET_NETMAP_USER_HPP_ */
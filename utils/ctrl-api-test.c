@@ -46,8 +46,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <arpa/inet.h>
 #include <net/if.h>
 #include <net/netmap.h>
+#include <netinet/in.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdint.h>
@@ -216,6 +218,7 @@ port_info_get(struct TestContext *ctx)
 	printf("nr_tx_rings %u\n", req.nr_tx_rings);
 	printf("nr_rx_rings %u\n", req.nr_rx_rings);
 	printf("nr_mem_id %u\n", req.nr_mem_id);
+	printf("nr_meta_caps %#x\n", req.nr_meta_caps);
 
 	success = req.nr_memsize && req.nr_tx_slots && req.nr_rx_slots &&
 	          req.nr_tx_rings && req.nr_rx_rings && req.nr_tx_rings;
@@ -742,6 +745,80 @@ vale_persistent_port(struct TestContext *ctx)
 	return result;
 }
 
+/* Register all the rings of a port on a new file descriptor and close
+ * it, returning the memory id. */
+static int
+open_close_port(const char *ifname, uint16_t *mem_id)
+{
+	struct nmreq_register req;
+	struct nmreq_header hdr;
+	int fd, ret;
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0) {
+		perror("open(/dev/netmap)");
+		return -1;
+	}
+	nmreq_hdr_init(&hdr, ifname);
+	hdr.nr_reqtype = NETMAP_REQ_REGISTER;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_mode = NR_REG_ALL_NIC;
+	ret         = ioctl(fd, NIOCCTRL, &hdr);
+	if (ret != 0)
+		perror("ioctl(/dev/netmap, NIOCCTRL, REGISTER)");
+	*mem_id = req.nr_mem_id;
+	close(fd);
+	return ret;
+}
+
+static int
+vale_persistent_port_keepwarm(struct TestContext *ctx)
+{
+	struct nmreq_vale_newif req;
+	struct nmreq_header hdr;
+	uint16_t mem_id1 = 0, mem_id2 = 0;
+	int result;
+	int ret;
+
+	strncpy(ctx->ifname_ext, "per5", sizeof(ctx->ifname_ext));
+
+	printf("Testing NETMAP_REQ_VALE_NEWIF with keep-warm on '%s'\n",
+	       ctx->ifname_ext);
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_NEWIF;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_flags = NR_VALE_NEWIF_KEEPWARM;
+	ret          = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_NEWIF)");
+		return ret;
+	}
+
+	/* the same memory must be found after a restart */
+	result = open_close_port(ctx->ifname_ext, &mem_id1);
+	if (result == 0)
+		result = open_close_port(ctx->ifname_ext, &mem_id2);
+	if (result == 0 && mem_id1 != mem_id2) {
+		printf("mem_id %u then %u\n", mem_id1, mem_id2);
+		result = -1;
+	}
+
+	hdr.nr_reqtype = NETMAP_REQ_VALE_DELIF;
+	hdr.nr_body    = (uintptr_t)NULL;
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_DELIF)");
+		if (result == 0) {
+			result = ret;
+		}
+	}
+
+	return result;
+}
+
 /* Single NETMAP_REQ_POOLS_INFO_GET. */
 static int
 pools_info_get(struct TestContext *ctx)
@@ -776,6 +853,7 @@ pools_info_get(struct TestContext *ctx)
 		(unsigned long long)req.nr_buf_pool_offset);
 	printf("nr_buf_pool_objtotal %u\n", req.nr_buf_pool_objtotal);
 	printf("nr_buf_pool_objsize %u\n", req.nr_buf_pool_objsize);
+	printf("nr_numa_node %d\n", req.nr_numa_node);
 
 	return req.nr_memsize && req.nr_if_pool_objtotal &&
 	                       req.nr_if_pool_objsize &&
@@ -787,6 +865,29 @@ pools_info_get(struct TestContext *ctx)
 	               : -1;
 }
 
+/* NETMAP_REQ_POOLS_INFO_GET, checking the NUMA node of the pools. */
+static int
+pools_info_expect_node(struct TestContext *ctx, int node)
+{
+	struct nmreq_pools_info req;
+	struct nmreq_header hdr;
+	int ret;
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_INFO_GET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_mem_id = ctx->nr_mem_id;
+	ret           = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_INFO_GET)");
+		return ret;
+	}
+	printf("nr_numa_node %d, expected %d\n", req.nr_numa_node, node);
+
+	return req.nr_numa_node == node ? 0 : -1;
+}
+
 static int
 pools_info_get_and_register(struct TestContext *ctx)
 {
@@ -818,121 +919,763 @@ pools_info_get_empty_ifname(struct TestContext *ctx)
 }
 
 static int
-pipe_master(struct TestContext *ctx)
+pools_stats_get(struct TestContext *ctx, const char *name, uint16_t mem_id,
+		struct nmreq_pools_stats *req)
 {
-	strncat(ctx->ifname_ext, "{pipeid1", sizeof(ctx->ifname_ext));
-	ctx->nr_mode = NR_REG_NIC_SW;
+	struct nmreq_header hdr;
+	int ret;
 
-	if (port_register(ctx) == 0) {
-		printf("pipes should not accept NR_REG_NIC_SW\n");
+	nmreq_hdr_init(&hdr, name);
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_STATS_GET;
+	hdr.nr_body    = (uintptr_t)req;
+	memset(req, 0, sizeof(*req));
+	req->nr_mem_id = mem_id;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_STATS_GET)");
+		return ret;
+	}
+	printf("mem %u: buf total %u inuse %u free %u (cached %u) max %u\n",
+	       req->nr_mem_id, req->nr_buf.nr_objtotal, req->nr_buf.nr_inuse,
+	       req->nr_buf.nr_free, req->nr_buf_cached,
+	       req->nr_buf.nr_max_inuse);
+	printf("extra holders %u leaked %llu reclaimed %llu\n",
+	       req->nr_extra_holders,
+	       (unsigned long long)req->nr_extra_leaked,
+	       (unsigned long long)req->nr_extra_reclaimed);
+	if (req->nr_buf.nr_inuse + req->nr_buf.nr_free !=
+	    req->nr_buf.nr_objtotal ||
+	    req->nr_buf.nr_max_inuse < req->nr_buf.nr_inuse ||
+	    req->nr_ring.nr_inuse + req->nr_ring.nr_free !=
+	    req->nr_ring.nr_objtotal)
+		return -1;
+	return 0;
+}
+
+/* NETMAP_REQ_POOLS_STATS_GET, before and after a port leaks its extra
+ * buffers, which must go back to the pool on close, although the
+ * allocator (the global one, which outlives its ports) is still in use
+ * by another port. */
+static int
+pools_stats_leak(struct TestContext *ctx)
+{
+	struct nmreq_pools_stats before, after;
+	struct nmport_d *d, *keep = NULL;
+	int ret = -1;
+
+	d = nmport_prepare("valeps:0");
+	if (d == NULL)
 		return -1;
+	d->reg.nr_mem_id = 1;
+	d->reg.nr_extra_bufs = 16;
+	if (nmport_open_desc(d) < 0 || d->reg.nr_extra_bufs != 16)
+		goto out;
+	/* another port, to look at the allocator after the close */
+	keep = nmport_prepare("valeps:1");
+	if (keep == NULL)
+		goto out;
+	keep->reg.nr_mem_id = 1;
+	if (nmport_open_desc(keep) < 0)
+		goto out;
+
+	printf("Testing NETMAP_REQ_POOLS_STATS_GET on 'valeps:1'\n");
+	if (pools_stats_get(ctx, "valeps:1", 1, &before) != 0)
+		goto out;
+	if (before.nr_extra_holders != 1 || before.nr_buf.nr_inuse < 16)
+		goto out;
+
+	d->nifp->ni_bufs_head = 0; /* forget about them */
+	nmport_close(d);
+	d = NULL;
+
+	/* counted, and free again with keep still there */
+	if (pools_stats_get(ctx, "valeps:1", 1, &after) != 0)
+		goto out;
+	printf("free buffers %u -> %u, leaked %llu, reclaimed %llu\n",
+	       before.nr_buf.nr_free, after.nr_buf.nr_free,
+	       (unsigned long long)(after.nr_extra_leaked -
+				    before.nr_extra_leaked),
+	       (unsigned long long)(after.nr_extra_reclaimed -
+				    before.nr_extra_reclaimed));
+	if (after.nr_extra_holders != 0 ||
+	    after.nr_extra_leaked != before.nr_extra_leaked + 16 ||
+	    after.nr_extra_reclaimed != before.nr_extra_reclaimed + 16 ||
+	    after.nr_buf.nr_free < before.nr_buf.nr_free + 16) {
+		printf("leaked buffers not reclaimed on close\n");
+		goto out;
 	}
-	ctx->nr_mode = NR_REG_ALL_NIC;
 
-	return port_register(ctx);
+	/* and not twice when the allocator falls out of use */
+	nmport_close(keep);
+	keep = NULL;
+	if (pools_stats_get(ctx, "valeps:1", 1, &after) != 0)
+		goto out;
+	if (after.nr_extra_reclaimed != before.nr_extra_reclaimed + 16) {
+		printf("reclaimed %llu buffers, expected 16\n",
+		       (unsigned long long)(after.nr_extra_reclaimed -
+					    before.nr_extra_reclaimed));
+		goto out;
+	}
+	ret = 0;
+out:
+	if (d != NULL)
+		nmport_close(d);
+	if (keep != NULL)
+		nmport_close(keep);
+	return ret;
 }
 
-static int
-pipe_slave(struct TestContext *ctx)
+int
+change_param(const char *pname, unsigned long newv, unsigned long *poldv)
 {
-	strncat(ctx->ifname_ext, "}pipeid2", sizeof(ctx->ifname_ext));
-	ctx->nr_mode = NR_REG_ALL_NIC;
+#ifdef __linux__
+	char param[256] = "/sys/module/netmap/parameters/";
+	unsigned long oldv;
+	FILE *f;
 
-	return port_register(ctx);
+	strncat(param, pname, sizeof(param) - 1);
+
+	f = fopen(param, "r+");
+	if (f == NULL) {
+		perror(param);
+		return -1;
+	}
+	if (fscanf(f, "%ld", &oldv) != 1) {
+		perror(param);
+		fclose(f);
+		return -1;
+	}
+	if (poldv)
+		*poldv = oldv;
+	rewind(f);
+	if (fprintf(f, "%ld\n", newv) < 0) {
+		perror(param);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	printf("change_param: %s: %ld -> %ld\n", pname, oldv, newv);
+#endif /* __linux__ */
+	return 0;
 }
 
-/* Test PORT_INFO_GET and POOLS_INFO_GET on a pipe. This is useful to test the
- * registration request used internally by netmap. */
 static int
-pipe_port_info_get(struct TestContext *ctx)
+pools_expand_req(struct TestContext *ctx, struct nmreq_pools_info *req,
+		uint16_t reqtype, uint32_t nbufs)
 {
-	strncat(ctx->ifname_ext, "}pipeid3", sizeof(ctx->ifname_ext));
+	struct nmreq_header hdr;
 
-	return port_info_get(ctx);
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = reqtype;
+	hdr.nr_body    = (uintptr_t)req;
+	memset(req, 0, sizeof(*req));
+	req->nr_buf_pool_objtotal = nbufs;
+	return ioctl(ctx->fd, NIOCCTRL, &hdr);
 }
 
+/* NETMAP_REQ_POOLS_EXPAND on the private allocator of a persistent
+ * VALE port, created with room to grow. It must grow both while the
+ * port is not registered and while it is, and then the registered
+ * process must see the new size in ni_memsize and be able to map it. */
 static int
-pipe_pools_info_get(struct TestContext *ctx)
+pools_expand(struct TestContext *ctx)
 {
-	strncat(ctx->ifname_ext, "{xid", sizeof(ctx->ifname_ext));
+	struct nmreq_pools_info req, exp;
+	struct nmreq_vale_newif nreq;
+	struct nmreq_register rreq;
+	struct nmreq_header hdr;
+	struct netmap_if *nifp;
+	unsigned long oldv = 0;
+	void *mem;
+	int fd, ret = -1;
 
-	return pools_info_get(ctx);
+	if (change_param("priv_buf_grow_max", 1024, &oldv) < 0)
+		return -1;
+
+	strncpy(ctx->ifname_ext, "per6", sizeof(ctx->ifname_ext));
+	printf("Testing NETMAP_REQ_POOLS_EXPAND on '%s'\n", ctx->ifname_ext);
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_NEWIF;
+	hdr.nr_body    = (uintptr_t)&nreq;
+	memset(&nreq, 0, sizeof(nreq));
+	if (ioctl(ctx->fd, NIOCCTRL, &hdr) != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_NEWIF)");
+		goto out_param;
+	}
+
+	if (pools_expand_req(ctx, &req, NETMAP_REQ_POOLS_INFO_GET, 0) != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_INFO_GET)");
+		goto out;
+	}
+	if (pools_expand_req(ctx, &exp, NETMAP_REQ_POOLS_EXPAND, 1) != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_EXPAND)");
+		goto out;
+	}
+	printf("nr_buf_pool_objtotal %u -> %u\n", req.nr_buf_pool_objtotal,
+	       exp.nr_buf_pool_objtotal);
+	if (exp.nr_buf_pool_objtotal <= req.nr_buf_pool_objtotal ||
+	    exp.nr_memsize <= req.nr_memsize ||
+	    exp.nr_buf_pool_offset != req.nr_buf_pool_offset) {
+		printf("allocator %u did not grow as expected\n",
+		       req.nr_mem_id);
+		goto out;
+	}
+
+	/* the grown pool is what the next users get */
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0) {
+		perror("open(/dev/netmap)");
+		goto out;
+	}
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_REGISTER;
+	hdr.nr_body    = (uintptr_t)&rreq;
+	memset(&rreq, 0, sizeof(rreq));
+	rreq.nr_mode = NR_REG_ALL_NIC;
+	if (ioctl(fd, NIOCCTRL, &hdr) != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, REGISTER)");
+		goto out_close;
+	}
+	if (rreq.nr_memsize != exp.nr_memsize) {
+		printf("registered with memsize %llu, expected %llu\n",
+		       (unsigned long long)rreq.nr_memsize,
+		       (unsigned long long)exp.nr_memsize);
+		goto out_close;
+	}
+	mem = mmap(NULL, rreq.nr_memsize, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		goto out_close;
+	}
+	nifp = NETMAP_IF(mem, rreq.nr_offset);
+
+	/* now grow it under the registered port */
+	if (pools_expand_req(ctx, &req, NETMAP_REQ_POOLS_EXPAND, 1) != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_EXPAND)");
+		goto out_unmap;
+	}
+	printf("ni_memsize %llu -> %llu\n",
+	       (unsigned long long)rreq.nr_memsize,
+	       (unsigned long long)nifp->ni_memsize);
+	if (req.nr_memsize <= exp.nr_memsize ||
+	    nifp->ni_memsize != req.nr_memsize) {
+		printf("ni_memsize %llu, expected %llu\n",
+		       (unsigned long long)nifp->ni_memsize,
+		       (unsigned long long)req.nr_memsize);
+		goto out_unmap;
+	}
+	munmap(mem, rreq.nr_memsize);
+	rreq.nr_memsize = req.nr_memsize;
+	mem = mmap(NULL, rreq.nr_memsize, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap (grown)");
+		goto out_close;
+	}
+	ret = 0;
+out_unmap:
+	munmap(mem, rreq.nr_memsize);
+out_close:
+	close(fd);
+out:
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_DELIF;
+	hdr.nr_body    = (uintptr_t)NULL;
+	if (ioctl(ctx->fd, NIOCCTRL, &hdr) != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_DELIF)");
+		ret = -1;
+	}
+out_param:
+	change_param("priv_buf_grow_max", oldv, NULL);
+	return ret;
 }
 
-/* NETMAP_REQ_VALE_POLLING_ENABLE */
+/* NETMAP_REQ_FLOW_RULE_ADD. VALE ports have no n-tuple filters, so
+ * the request must fail with EOPNOTSUPP. */
 static int
-vale_polling_enable(struct TestContext *ctx)
+flow_rule_unsupported(struct TestContext *ctx)
 {
-	struct nmreq_vale_polling req;
+	struct nmreq_flow_rule req;
 	struct nmreq_header hdr;
-	char vpname[NM_IFNAMSZ];
 	int ret;
 
-	if (vale_mkname(vpname, ctx) < 0)
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	printf("Testing NETMAP_REQ_FLOW_RULE_ADD on '%s'\n", ctx->ifname_ext);
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_FLOW_RULE_ADD;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_rule_id = NR_FLOW_RULE_ANY;
+	req.nr_match   = NR_FLOW_PROTO | NR_FLOW_DST_PORT;
+	req.nr_proto   = IPPROTO_UDP;
+	req.nr_dst_port = htons(7777);
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0) {
+		printf("rule %u installed on a VALE port\n", req.nr_rule_id);
+		return -1;
+	}
+	if (errno != EOPNOTSUPP) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, FLOW_RULE_ADD)");
 		return -1;
+	}
+	return 0;
+}
 
-	printf("Testing NETMAP_REQ_VALE_POLLING_ENABLE on '%s'\n", vpname);
+/* Register a VALE port, issue a txsync and check that the counters
+ * of the tx ring have seen it. A ring that does not exist must
+ * be rejected. */
+static int
+ring_stats_get(struct TestContext *ctx)
+{
+	struct nmreq_ring_stats req;
+	struct nmreq_header hdr;
+	int ret;
 
-	nmreq_hdr_init(&hdr, vpname);
-	hdr.nr_reqtype = NETMAP_REQ_VALE_POLLING_ENABLE;
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ret = port_register_hwall(ctx);
+	if (ret != 0) {
+		return ret;
+	}
+	ret = ioctl(ctx->fd, NIOCTXSYNC, 0);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCTXSYNC)");
+		return ret;
+	}
+
+	printf("Testing NETMAP_REQ_RING_STATS_GET on '%s'\n", ctx->ifname_ext);
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_RING_STATS_GET;
 	hdr.nr_body    = (uintptr_t)&req;
 	memset(&req, 0, sizeof(req));
-	req.nr_mode             = ctx->nr_mode;
-	req.nr_first_cpu_id     = ctx->nr_first_cpu_id;
-	req.nr_num_polling_cpus = ctx->nr_num_polling_cpus;
-	ret                     = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	req.nr_ring_id = 0;
+	req.nr_tx      = 1;
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
 	if (ret != 0) {
-		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_POLLING_ENABLE)");
+		perror("ioctl(/dev/netmap, NIOCCTRL, RING_STATS_GET)");
 		return ret;
 	}
+	printf("syncs %llu slots %llu bytes %llu drops %llu notifies %llu "
+	       "busy %llu\n", (unsigned long long)req.nr_syncs,
+	       (unsigned long long)req.nr_slots,
+	       (unsigned long long)req.nr_bytes,
+	       (unsigned long long)req.nr_drops,
+	       (unsigned long long)req.nr_notifies,
+	       (unsigned long long)req.nr_busy);
+	if (req.nr_syncs == 0) {
+		printf("txsync not counted\n");
+		return -1;
+	}
 
-	return (req.nr_mode == ctx->nr_mode &&
-	        req.nr_first_cpu_id == ctx->nr_first_cpu_id &&
-	        req.nr_num_polling_cpus == ctx->nr_num_polling_cpus)
-	               ? 0
-	               : -1;
+	memset(&req, 0, sizeof(req));
+	req.nr_ring_id = 1000;
+	req.nr_tx      = 1;
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0) {
+		printf("counters returned for a non existing ring\n");
+		return -1;
+	}
+	if (errno != EINVAL) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, RING_STATS_GET)");
+		return -1;
+	}
+	return 0;
 }
 
-/* NETMAP_REQ_VALE_POLLING_DISABLE */
+/* Sync a registered VALE port through NETMAP_REQ_SYNC_BATCH, together
+ * with an entry for a non-netmap fd and one with an invalid range. */
 static int
-vale_polling_disable(struct TestContext *ctx)
+sync_batch(struct TestContext *ctx)
 {
-	struct nmreq_vale_polling req;
+	struct nmreq_sync_entry e[3];
+	struct nmreq_sync_batch req;
 	struct nmreq_header hdr;
-	char vpname[NM_IFNAMSZ];
 	int ret;
 
-	if (vale_mkname(vpname, ctx) < 0)
-		return -1;
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ret = port_register_hwall(ctx);
+	if (ret != 0) {
+		return ret;
+	}
 
-	printf("Testing NETMAP_REQ_VALE_POLLING_DISABLE on '%s'\n", vpname);
+	printf("Testing NETMAP_REQ_SYNC_BATCH on '%s'\n", ctx->ifname_ext);
+	memset(e, 0, sizeof(e));
+	e[0].nr_fd    = -1;
+	e[0].nr_flags = NR_SYNC_TX | NR_SYNC_RX;
+	e[1].nr_fd    = 0; /* stdin */
+	e[1].nr_flags = NR_SYNC_TX;
+	e[2].nr_fd    = -1;
+	e[2].nr_flags = NR_SYNC_RX;
+	e[2].nr_first_ring = 0;
+	e[2].nr_last_ring  = 1000;
 
-	nmreq_hdr_init(&hdr, vpname);
-	hdr.nr_reqtype = NETMAP_REQ_VALE_POLLING_DISABLE;
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_SYNC_BATCH;
 	hdr.nr_body    = (uintptr_t)&req;
 	memset(&req, 0, sizeof(req));
-	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	req.nr_entries = (uintptr_t)e;
+	req.nr_num     = 3;
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
 	if (ret != 0) {
-		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_POLLING_DISABLE)");
+		perror("ioctl(/dev/netmap, NIOCCTRL, SYNC_BATCH)");
 		return ret;
 	}
-
+	printf("errors: %d %d %d\n", e[0].nr_error, e[1].nr_error,
+			e[2].nr_error);
+	if (e[0].nr_error != 0 || e[1].nr_error != EBADF ||
+	    e[2].nr_error != EINVAL) {
+		return -1;
+	}
 	return 0;
 }
 
 static int
-vale_polling_enable_disable(struct TestContext *ctx)
+pipe_master(struct TestContext *ctx)
 {
-	int ret = 0;
+	strncat(ctx->ifname_ext, "{pipeid1", sizeof(ctx->ifname_ext));
+	ctx->nr_mode = NR_REG_NIC_SW;
 
-	if ((ret = vale_attach(ctx)) != 0) {
-		return ret;
+	if (port_register(ctx) == 0) {
+		printf("pipes should not accept NR_REG_NIC_SW\n");
+		return -1;
 	}
+	ctx->nr_mode = NR_REG_ALL_NIC;
 
-	ctx->nr_mode             = NETMAP_POLLING_MODE_SINGLE_CPU;
-	ctx->nr_num_polling_cpus = 1;
-	ctx->nr_first_cpu_id     = 0;
-	if ((ret = vale_polling_enable(ctx))) {
+	return port_register(ctx);
+}
+
+static int
+pipe_slave(struct TestContext *ctx)
+{
+	strncat(ctx->ifname_ext, "}pipeid2", sizeof(ctx->ifname_ext));
+	ctx->nr_mode = NR_REG_ALL_NIC;
+
+	return port_register(ctx);
+}
+
+/* nmport_tx_burst()/nmport_rx_burst() through the two ends of a pipe */
+static int
+pipe_burst(struct TestContext *ctx)
+{
+	const char *pfx = strncmp(ctx->ifname_ext, "vale", 4) ? "netmap:" : "";
+	struct nmport_pkt pkts[8];
+	struct nmport_d *m, *s;
+	char name[NM_IFNAMSZ + 16];
+	unsigned int i, n;
+	int ret = -1;
+
+	snprintf(name, sizeof(name), "%s%s{burst", pfx, ctx->ifname_ext);
+	m = nmport_open(name);
+	if (m == NULL)
+		return -1;
+	snprintf(name, sizeof(name), "%s%s}burst", pfx, ctx->ifname_ext);
+	s = nmport_open(name);
+	if (s == NULL)
+		goto out_m;
+
+	printf("Testing nmport bursts on '%s'\n", name);
+	n = nmport_tx_burst(m, pkts, 8, NMPORT_BURST_PREFETCH);
+	if (n != 8) {
+		printf("tx burst of %u slots, expected 8\n", n);
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		memset(pkts[i].buf, 'a' + i, 60);
+		pkts[i].slot->len = 60;
+		pkts[i].slot->flags = 0;
+	}
+	/* only send the first 5 */
+	if (nmport_tx_commit(m, pkts, 5, NMPORT_BURST_SYNC) < 0) {
+		perror("nmport_tx_commit");
+		goto out;
+	}
+
+	n = nmport_rx_burst(s, pkts, 8, NMPORT_BURST_SYNC);
+	if (n != 5) {
+		printf("rx burst of %u slots, expected 5\n", n);
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (pkts[i].slot->len != 60 || pkts[i].buf[59] != 'a' + (int)i) {
+			printf("slot %u: len %u byte %c\n", i,
+				pkts[i].slot->len, pkts[i].buf[59]);
+			goto out;
+		}
+	}
+	/* the slots are released by the next call */
+	n = nmport_rx_burst(s, pkts, 8, NMPORT_BURST_SYNC);
+	if (n != 0) {
+		printf("rx burst of %u slots, expected 0\n", n);
+		goto out;
+	}
+	ret = 0;
+out:
+	nmport_close(s);
+out_m:
+	nmport_close(m);
+	return ret;
+}
+
+static void
+nmloop_count(struct nmport_d *d, struct nmport_pkt *pkts, unsigned int n,
+		void *arg)
+{
+	unsigned int *cnt = arg;
+
+	(void)d;
+	(void)pkts;
+	*cnt += n;
+}
+
+/* an nmloop over the slave ends of several pipes, only some of them busy */
+static int
+nmloop_pipes(struct TestContext *ctx)
+{
+	const char *pfx = strncmp(ctx->ifname_ext, "vale", 4) ? "netmap:" : "";
+	struct nmport_d *m[4] = { NULL }, *s[4] = { NULL };
+	unsigned int cnt[4] = { 0 }, want[4] = { 0, 5, 0, 12 };
+	struct nmport_pkt pkts[16];
+	char name[NM_IFNAMSZ + 16];
+	struct nmloop *l;
+	int i, iter, ret = -1;
+
+	l = nmloop_new(8);
+	if (l == NULL)
+		return -1;
+	for (i = 0; i < 4; i++) {
+		snprintf(name, sizeof(name), "%s%s{loop%d", pfx,
+				ctx->ifname_ext, i);
+		m[i] = nmport_open(name);
+		snprintf(name, sizeof(name), "%s%s}loop%d", pfx,
+				ctx->ifname_ext, i);
+		s[i] = nmport_open(name);
+		if (m[i] == NULL || s[i] == NULL)
+			goto out;
+		if (nmloop_add(l, s[i], NMLOOP_PER_RING, nmloop_count,
+					&cnt[i]) < 0) {
+			perror("nmloop_add");
+			goto out;
+		}
+	}
+	printf("Testing nmloop on '%s'\n", name);
+	/* nothing to read yet */
+	if (nmloop_run_once(l, 0) != 0) {
+		printf("callbacks called on idle pipes\n");
+		goto out;
+	}
+	for (i = 0; i < 4; i++) {
+		unsigned int n, j;
+
+		if (want[i] == 0)
+			continue;
+		n = nmport_tx_burst(m[i], pkts, want[i], 0);
+		if (n != want[i]) {
+			printf("tx burst of %u slots, expected %u\n", n,
+					want[i]);
+			goto out;
+		}
+		for (j = 0; j < n; j++)
+			pkts[j].slot->len = 60;
+		if (nmport_tx_commit(m[i], pkts, n, NMPORT_BURST_SYNC) < 0) {
+			perror("nmport_tx_commit");
+			goto out;
+		}
+	}
+	/* 12 slots take two bursts of 8 */
+	for (iter = 0; iter < 10; iter++) {
+		if (nmloop_run_once(l, 100) < 0)
+			goto out;
+		if (cnt[1] == want[1] && cnt[3] == want[3])
+			break;
+	}
+	for (i = 0; i < 4; i++) {
+		if (cnt[i] != want[i]) {
+			printf("pipe %d: received %u, expected %u\n", i,
+					cnt[i], want[i]);
+			goto out;
+		}
+	}
+	if (nmloop_remove(l, s[1]) < 0 || nmloop_remove(l, s[1]) == 0) {
+		printf("nmloop_remove failed\n");
+		goto out;
+	}
+	ret = 0;
+out:
+	nmloop_delete(l);
+	for (i = 0; i < 4; i++) {
+		if (s[i] != NULL)
+			nmport_close(s[i]);
+		if (m[i] != NULL)
+			nmport_close(m[i]);
+	}
+	return ret;
+}
+
+struct open_ring_arg {
+	struct nmport_d *parent;
+	struct nmport_d *d;
+	uint16_t ring;
+};
+
+static void *
+open_ring_thread(void *arg)
+{
+	struct open_ring_arg *a = arg;
+
+	a->d = nmport_open_ring(a->parent, NR_REG_ONE_NIC, a->ring);
+	return NULL;
+}
+
+/* nmport_open_ring() from several threads on the same parent */
+static int
+nmport_open_ring_threads(struct TestContext *ctx)
+{
+	struct open_ring_arg args[4];
+	pthread_t th[4];
+	int started[4];
+	struct nmport_d *p;
+	char name[NM_IFNAMSZ + 16];
+	int i, ret = 0;
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	snprintf(name, sizeof(name), "%s@conf:rings=4", ctx->ifname_ext);
+	printf("Testing nmport_open_ring on '%s'\n", name);
+	p = nmport_open(name);
+	if (p == NULL)
+		return -1;
+	for (i = 0; i < 4; i++) {
+		args[i].parent = p;
+		args[i].d = NULL;
+		args[i].ring = i;
+		started[i] = !pthread_create(&th[i], NULL, open_ring_thread,
+				&args[i]);
+		if (!started[i]) {
+			perror("pthread_create");
+			ret = -1;
+		}
+	}
+	for (i = 0; i < 4; i++) {
+		struct nmport_d *d;
+
+		if (started[i])
+			pthread_join(th[i], NULL);
+		d = args[i].d;
+		if (d == NULL) {
+			printf("ring %d: open failed\n", i);
+			ret = -1;
+			continue;
+		}
+		if (d->mem != p->mem || d->first_rx_ring != i ||
+				d->last_rx_ring != i) {
+			printf("ring %d: mem %p/%p rx rings [%u, %u]\n", i,
+				d->mem, p->mem, d->first_rx_ring,
+				d->last_rx_ring);
+			ret = -1;
+		}
+	}
+	if (ret == 0 && p->mem->refcount != 5) {
+		printf("refcount %d, expected 5\n", p->mem->refcount);
+		ret = -1;
+	}
+	for (i = 0; i < 4; i++)
+		nmport_close(args[i].d);
+	nmport_close(p);
+	return ret;
+}
+
+/* Test PORT_INFO_GET and POOLS_INFO_GET on a pipe. This is useful to test the
+ * registration request used internally by netmap. */
+static int
+pipe_port_info_get(struct TestContext *ctx)
+{
+	strncat(ctx->ifname_ext, "}pipeid3", sizeof(ctx->ifname_ext));
+
+	return port_info_get(ctx);
+}
+
+static int
+pipe_pools_info_get(struct TestContext *ctx)
+{
+	strncat(ctx->ifname_ext, "{xid", sizeof(ctx->ifname_ext));
+
+	return pools_info_get(ctx);
+}
+
+/* NETMAP_REQ_VALE_POLLING_ENABLE */
+static int
+vale_polling_enable(struct TestContext *ctx)
+{
+	struct nmreq_vale_polling req;
+	struct nmreq_header hdr;
+	char vpname[NM_IFNAMSZ];
+	int ret;
+
+	if (vale_mkname(vpname, ctx) < 0)
+		return -1;
+
+	printf("Testing NETMAP_REQ_VALE_POLLING_ENABLE on '%s'\n", vpname);
+
+	nmreq_hdr_init(&hdr, vpname);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_POLLING_ENABLE;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_mode             = ctx->nr_mode;
+	req.nr_first_cpu_id     = ctx->nr_first_cpu_id;
+	req.nr_num_polling_cpus = ctx->nr_num_polling_cpus;
+	ret                     = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_POLLING_ENABLE)");
+		return ret;
+	}
+
+	return (req.nr_mode == ctx->nr_mode &&
+	        req.nr_first_cpu_id == ctx->nr_first_cpu_id &&
+	        req.nr_num_polling_cpus == ctx->nr_num_polling_cpus)
+	               ? 0
+	               : -1;
+}
+
+/* NETMAP_REQ_VALE_POLLING_DISABLE */
+static int
+vale_polling_disable(struct TestContext *ctx)
+{
+	struct nmreq_vale_polling req;
+	struct nmreq_header hdr;
+	char vpname[NM_IFNAMSZ];
+	int ret;
+
+	if (vale_mkname(vpname, ctx) < 0)
+		return -1;
+
+	printf("Testing NETMAP_REQ_VALE_POLLING_DISABLE on '%s'\n", vpname);
+
+	nmreq_hdr_init(&hdr, vpname);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_POLLING_DISABLE;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_POLLING_DISABLE)");
+		return ret;
+	}
+
+	return 0;
+}
+
+static int
+vale_polling_enable_disable(struct TestContext *ctx)
+{
+	int ret = 0;
+
+	if ((ret = vale_attach(ctx)) != 0) {
+		return ret;
+	}
+
+	ctx->nr_mode             = NETMAP_POLLING_MODE_SINGLE_CPU;
+	ctx->nr_num_polling_cpus = 1;
+	ctx->nr_first_cpu_id     = 0;
+	if ((ret = vale_polling_enable(ctx))) {
 		vale_detach(ctx);
 #ifdef __FreeBSD__
 		/* NETMAP_REQ_VALE_POLLING_DISABLE is disabled on FreeBSD,
@@ -944,44 +1687,875 @@ vale_polling_enable_disable(struct TestContext *ctx)
 #endif
 	}
 
-	if ((ret = vale_polling_disable(ctx))) {
-		vale_detach(ctx);
+	if ((ret = vale_polling_disable(ctx))) {
+		vale_detach(ctx);
+		return ret;
+	}
+
+	return vale_detach(ctx);
+}
+
+static void
+push_option(struct nmreq_option *opt, struct TestContext *ctx)
+{
+	opt->nro_next = (uintptr_t)ctx->nr_opt;
+	ctx->nr_opt   = opt;
+}
+
+static void
+clear_options(struct TestContext *ctx)
+{
+	ctx->nr_opt = NULL;
+}
+
+static int
+checkoption(struct nmreq_option *opt, struct nmreq_option *exp)
+{
+	if (opt->nro_next != exp->nro_next) {
+		printf("nro_next %p expected %p\n",
+		       (void *)(uintptr_t)opt->nro_next,
+		       (void *)(uintptr_t)exp->nro_next);
+		return -1;
+	}
+	if (opt->nro_reqtype != exp->nro_reqtype) {
+		printf("nro_reqtype %u expected %u\n", opt->nro_reqtype,
+		       exp->nro_reqtype);
+		return -1;
+	}
+	if (opt->nro_status != exp->nro_status) {
+		printf("nro_status %u expected %u\n", opt->nro_status,
+		       exp->nro_status);
+		return -1;
+	}
+	return 0;
+}
+
+/* NETMAP_REQ_OPT_VALE_HASH on a new switch, then check the size
+ * with NETMAP_REQ_VALE_HASH_INFO_GET. */
+static int
+vale_hash_size(struct TestContext *ctx)
+{
+	struct nmreq_opt_vale_hash opt, save;
+	struct nmreq_vale_hash_info req;
+	struct nmreq_header hdr;
+	int ret;
+
+	strncpy(ctx->ifname_ext, "valeht:eph0", sizeof(ctx->ifname_ext));
+	ctx->nr_mode = NR_REG_ALL_NIC;
+
+	printf("Testing NETMAP_REQ_OPT_VALE_HASH on '%s'\n", ctx->ifname_ext);
+	memset(&opt, 0, sizeof(opt));
+	opt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_VALE_HASH;
+	opt.nro_entries = 3000; /* rounded up to 4096 */
+	push_option(&opt.nro_opt, ctx);
+	save = opt;
+	ret = port_register(ctx);
+	clear_options(ctx);
+	if (ret != 0)
+		return ret;
+	save.nro_opt.nro_status = 0;
+	if (checkoption(&opt.nro_opt, &save.nro_opt))
+		return -1;
+	if (opt.nro_entries != 4096) {
+		printf("nro_entries %u expected 4096\n", opt.nro_entries);
+		return -1;
+	}
+
+	printf("Testing NETMAP_REQ_VALE_HASH_INFO_GET on 'valeht:'\n");
+	nmreq_hdr_init(&hdr, "valeht:");
+	hdr.nr_reqtype = NETMAP_REQ_VALE_HASH_INFO_GET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_HASH_INFO_GET)");
+		return ret;
+	}
+	printf("nr_entries %u nr_ways %u nr_used %u\n", req.nr_entries,
+			req.nr_ways, req.nr_used);
+
+	return (req.nr_entries == 4096 && req.nr_ways > 0 &&
+			req.nr_used == 0) ? 0 : -1;
+}
+
+/* Walk the ports of a new switch with NETMAP_REQ_VALE_PORT_STATS_GET. */
+static int
+vale_port_stats(struct TestContext *ctx)
+{
+	struct nmreq_vale_port_stats req;
+	struct nmreq_header hdr;
+	int ret;
+
+	strncpy(ctx->ifname_ext, "valeps:0", sizeof(ctx->ifname_ext));
+	ret = port_register_hwall(ctx);
+	if (ret != 0)
+		return ret;
+
+	printf("Testing NETMAP_REQ_VALE_PORT_STATS_GET on 'valeps:'\n");
+	nmreq_hdr_init(&hdr, "valeps:");
+	hdr.nr_reqtype = NETMAP_REQ_VALE_PORT_STATS_GET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_PORT_STATS_GET)");
+		return ret;
+	}
+	printf("port %u name %s tx_pkts %llu rx_pkts %llu\n", req.nr_port_idx,
+	       req.nr_port_name, (unsigned long long)req.nr_tx_pkts,
+	       (unsigned long long)req.nr_rx_pkts);
+	if (strcmp(req.nr_port_name, "valeps:0") != 0 ||
+	    req.nr_tx_pkts != 0 || req.nr_rx_pkts != 0)
+		return -1;
+
+	/* no more ports */
+	req.nr_port_idx++;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0) {
+		printf("counters returned for a non existing port\n");
+		return -1;
+	}
+	if (errno != ENOENT) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_PORT_STATS_GET)");
+		return -1;
+	}
+	return 0;
+}
+
+/* List the ports of a new switch with NETMAP_REQ_VALE_LIST_BULK. */
+static int
+vale_list_bulk(struct TestContext *ctx)
+{
+	struct nmreq_vale_list_entry e[4];
+	struct nmreq_vale_list_bulk req;
+	struct nmreq_header hdr;
+	int ret;
+
+	strncpy(ctx->ifname_ext, "valelb:0", sizeof(ctx->ifname_ext));
+	ret = port_register_hwall(ctx);
+	if (ret != 0)
+		return ret;
+
+	printf("Testing NETMAP_REQ_VALE_LIST_BULK on 'valelb:'\n");
+	nmreq_hdr_init(&hdr, "valelb:");
+	hdr.nr_reqtype = NETMAP_REQ_VALE_LIST_BULK;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	memset(e, 0, sizeof(e));
+	req.nr_entries = (uintptr_t)e;
+	req.nr_num     = 4;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_LIST_BULK)");
+		return ret;
+	}
+	printf("nr_num %u: %s port %u tx_rings %u rx_slots %u\n", req.nr_num,
+	       e[0].nr_name, e[0].nr_port_idx, e[0].nr_info.nr_tx_rings,
+	       e[0].nr_info.nr_rx_slots);
+	if (req.nr_num != 1 || strcmp(e[0].nr_name, "valelb:0") != 0 ||
+	    e[0].nr_info.nr_tx_rings == 0 || e[0].nr_info.nr_rx_slots == 0)
+		return -1;
+
+	/* the walk is over, nothing more from the returned position */
+	req.nr_num = 4;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_LIST_BULK)");
+		return ret;
+	}
+	if (req.nr_num != 0) {
+		printf("%u entries after the end of the walk\n", req.nr_num);
+		return -1;
+	}
+
+	/* too many entries */
+	req.nr_num = NR_VALE_LIST_BULK_MAX + 1;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0 || errno != EINVAL) {
+		printf("nr_num %u accepted\n", req.nr_num);
+		return -1;
+	}
+	return 0;
+}
+
+/* Restore an entry in the learning table of a new switch with
+ * NETMAP_REQ_VALE_HASH_SET and save it with NETMAP_REQ_VALE_HASH_GET. */
+static int
+vale_hash_save_restore(struct TestContext *ctx)
+{
+	static const uint8_t mac[6] = { 0x02, 0, 0, 0, 0x12, 0x34 };
+	struct nmreq_vale_hash_entry e[2];
+	struct nmreq_vale_hash_entries req;
+	struct nmreq_header hdr;
+	int ret;
+
+	strncpy(ctx->ifname_ext, "valehs:0", sizeof(ctx->ifname_ext));
+	ret = port_register_hwall(ctx);
+	if (ret != 0)
+		return ret;
+
+	printf("Testing NETMAP_REQ_VALE_HASH_SET on 'valehs:'\n");
+	nmreq_hdr_init(&hdr, "valehs:");
+	hdr.nr_reqtype = NETMAP_REQ_VALE_HASH_SET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	memset(e, 0, sizeof(e));
+	strncpy(e[0].nr_port, "valehs:0", sizeof(e[0].nr_port));
+	memcpy(e[0].nr_mac, mac, sizeof(mac));
+	e[0].nr_age = 5;
+	/* a port that is not attached, skipped */
+	strncpy(e[1].nr_port, "valehs:1", sizeof(e[1].nr_port));
+	memcpy(e[1].nr_mac, mac, sizeof(mac));
+	e[1].nr_mac[5]++;
+	req.nr_entries = (uintptr_t)e;
+	req.nr_num     = 2;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_HASH_SET)");
+		return ret;
+	}
+	if (req.nr_num != 1) {
+		printf("%u entries learned, expected 1\n", req.nr_num);
+		return -1;
+	}
+
+	printf("Testing NETMAP_REQ_VALE_HASH_GET on 'valehs:'\n");
+	hdr.nr_reqtype = NETMAP_REQ_VALE_HASH_GET;
+	memset(&req, 0, sizeof(req));
+	memset(e, 0, sizeof(e));
+	req.nr_entries = (uintptr_t)e;
+	req.nr_num     = 2;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_HASH_GET)");
+		return ret;
+	}
+	printf("nr_num %u: %s age %u\n", req.nr_num, e[0].nr_port,
+	       e[0].nr_age);
+	if (req.nr_num != 1 || strcmp(e[0].nr_port, "valehs:0") != 0 ||
+	    memcmp(e[0].nr_mac, mac, sizeof(mac)) != 0 || e[0].nr_age < 5)
+		return -1;
+
+	/* empty array */
+	req.nr_num = 0;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0 || errno != EINVAL) {
+		printf("nr_num 0 accepted\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Set the rate limit of a VALE port and read it back. */
+static int
+vale_qos(struct TestContext *ctx)
+{
+	struct nmreq_vale_qos req;
+	struct nmreq_header hdr;
+	int ret;
+
+	strncpy(ctx->ifname_ext, "valeqs:0", sizeof(ctx->ifname_ext));
+	ret = port_register_hwall(ctx);
+	if (ret != 0)
+		return ret;
+
+	printf("Testing NETMAP_REQ_VALE_QOS_SET on '%s'\n", ctx->ifname_ext);
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_QOS_SET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_rate = 1000000000; /* the burst defaults to 10ms */
+	req.nr_prio = 2;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_QOS_SET)");
+		return ret;
+	}
+
+	hdr.nr_reqtype = NETMAP_REQ_VALE_QOS_GET;
+	memset(&req, 0, sizeof(req));
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_QOS_GET)");
+		return ret;
+	}
+	printf("rate %llu burst %u prio %u\n", (unsigned long long)req.nr_rate,
+	       req.nr_burst, req.nr_prio);
+	if (req.nr_rate != 1000000000 || req.nr_burst != 1250000 ||
+	    req.nr_prio != 2)
+		return -1;
+
+	hdr.nr_reqtype = NETMAP_REQ_VALE_QOS_SET;
+	req.nr_prio = NR_VALE_PRIOS;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0) {
+		printf("invalid priority accepted\n");
+		return -1;
+	}
+	if (errno != EINVAL) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_QOS_SET)");
+		return -1;
+	}
+	return 0;
+}
+
+/* Send 4 broadcast frames from s with NIOCTXSYNC, ending with the
+ * letters from 'c' on. */
+static int
+vale_defer_send(struct nmport_d *s, char c)
+{
+	struct nmport_pkt pkts[4];
+	unsigned int i, n;
+
+	n = nmport_tx_burst(s, pkts, 4, 0);
+	if (n != 4) {
+		printf("tx burst of %u slots, expected 4\n", n);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		memset(pkts[i].buf, 0, 60);
+		memset(pkts[i].buf, 0xff, 6); /* broadcast */
+		pkts[i].buf[6] = 0x02;
+		pkts[i].buf[11] = 0x01;
+		pkts[i].buf[59] = c + i;
+		pkts[i].slot->len = 60;
+		pkts[i].slot->flags = 0;
+	}
+	if (nmport_tx_commit(s, pkts, n, NMPORT_BURST_SYNC) < 0) {
+		perror("nmport_tx_commit");
+		return -1;
+	}
+	return 0;
+}
+
+/* Receive on r the 4 frames of vale_defer_send(s, c). */
+static int
+vale_defer_recv(struct nmport_d *r, char c)
+{
+	struct nmport_pkt pkts[8];
+	unsigned int i, n;
+
+	n = nmport_rx_burst(r, pkts, 8, NMPORT_BURST_SYNC);
+	if (n != 4) {
+		printf("rx burst of %u slots, expected 4\n", n);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (pkts[i].slot->len != 60 || pkts[i].buf[59] != c + (int)i) {
+			printf("slot %u: len %u byte %c\n", i,
+				pkts[i].slot->len, pkts[i].buf[59]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* The frames held back by a deferring port must reach the other ports
+ * when the sender flushes with NETMAP_REQ_SYNC_BATCH, even if fewer
+ * than the batch and long before the deadline, and at the deadline if
+ * the sender does nothing more. */
+static int
+vale_defer_deliver(struct TestContext *ctx)
+{
+	struct nmreq_vale_defer req;
+	struct nmreq_sync_entry e;
+	struct nmreq_sync_batch sb;
+	struct nmreq_header hdr;
+	struct nmport_d *s, *r;
+	int ret = -1;
+
+	s = nmport_open("valedf:1");
+	if (s == NULL)
+		return -1;
+	r = nmport_open("valedf:2");
+	if (r == NULL)
+		goto out_s;
+
+	printf("Testing deferred delivery from 'valedf:1' to 'valedf:2'\n");
+	nmreq_hdr_init(&hdr, "valedf:1");
+	hdr.nr_reqtype = NETMAP_REQ_VALE_DEFER_SET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_batch = 32;
+	req.nr_usecs = NR_VALE_DEFER_MAX_USECS;
+	if (ioctl(ctx->fd, NIOCCTRL, &hdr) != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_DEFER_SET)");
+		goto out;
+	}
+
+	if (vale_defer_send(s, 'a') != 0)
+		goto out;
+	if (ioctl(r->fd, NIOCRXSYNC, NULL) < 0) {
+		perror("ioctl(NIOCRXSYNC)");
+		goto out;
+	}
+	/* nothing, unless the platform cannot defer */
+	printf("%u slots before the flush\n",
+		nm_ring_space(NETMAP_RXRING(r->nifp, 0)));
+
+	memset(&e, 0, sizeof(e));
+	e.nr_fd    = s->fd;
+	e.nr_flags = NR_SYNC_TX;
+	nmreq_hdr_init(&hdr, "valedf:1");
+	hdr.nr_reqtype = NETMAP_REQ_SYNC_BATCH;
+	hdr.nr_body    = (uintptr_t)&sb;
+	memset(&sb, 0, sizeof(sb));
+	sb.nr_entries = (uintptr_t)&e;
+	sb.nr_num     = 1;
+	if (ioctl(ctx->fd, NIOCCTRL, &hdr) != 0 || e.nr_error != 0) {
+		printf("SYNC_BATCH failed: %s (entry %d)\n", strerror(errno),
+			e.nr_error);
+		goto out;
+	}
+
+	if (vale_defer_recv(r, 'a') != 0)
+		goto out;
+
+	/* the same, but now the sender stops after the txsync */
+	if (vale_defer_send(s, 'e') != 0)
+		goto out;
+	usleep(4 * NR_VALE_DEFER_MAX_USECS);
+	if (vale_defer_recv(r, 'e') != 0)
+		goto out;
+	ret = 0;
+out:
+	nmport_close(r);
+out_s:
+	nmport_close(s);
+	return ret;
+}
+
+/* Set the deferred forwarding of a VALE port and read it back. */
+static int
+vale_defer(struct TestContext *ctx)
+{
+	struct nmreq_vale_defer req;
+	struct nmreq_header hdr;
+	int ret;
+
+	strncpy(ctx->ifname_ext, "valedf:0", sizeof(ctx->ifname_ext));
+	ret = port_register_hwall(ctx);
+	if (ret != 0)
+		return ret;
+
+	printf("Testing NETMAP_REQ_VALE_DEFER_SET on '%s'\n", ctx->ifname_ext);
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_DEFER_SET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_batch = 32; /* the deadline defaults to 50us */
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_DEFER_SET)");
+		return ret;
+	}
+
+	hdr.nr_reqtype = NETMAP_REQ_VALE_DEFER_GET;
+	memset(&req, 0, sizeof(req));
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_DEFER_GET)");
+		return ret;
+	}
+	printf("batch %u usecs %u\n", req.nr_batch, req.nr_usecs);
+	if (req.nr_batch != 32 || req.nr_usecs != NR_VALE_DEFER_USECS)
+		return -1;
+
+	hdr.nr_reqtype = NETMAP_REQ_VALE_DEFER_SET;
+	req.nr_usecs = NR_VALE_DEFER_MAX_USECS + 1;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0) {
+		printf("invalid deadline accepted\n");
+		return -1;
+	}
+	if (errno != EINVAL) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_DEFER_SET)");
+		return -1;
+	}
+	return vale_defer_deliver(ctx);
+}
+
+/* Add and remove a route and an ACL rule of a VALE switch. Without
+ * the vale-l3 subsystem the requests must fail with EOPNOTSUPP. */
+static int
+vale_l3(struct TestContext *ctx)
+{
+	struct nmreq_vale_l3_route route;
+	struct nmreq_vale_l3_acl acl;
+	struct nmreq_header hdr;
+	int ret;
+
+	strncpy(ctx->ifname_ext, "valel3:0", sizeof(ctx->ifname_ext));
+	ret = port_register_hwall(ctx);
+	if (ret != 0)
+		return ret;
+
+	printf("Testing NETMAP_REQ_VALE_L3_ROUTE_ADD on '%s'\n", ctx->ifname_ext);
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_L3_ROUTE_ADD;
+	hdr.nr_body    = (uintptr_t)&route;
+	memset(&route, 0, sizeof(route));
+	route.nr_family = NR_VALE_L3_INET;
+	route.nr_addr[0] = 10;
+	route.nr_plen = 8;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0 && errno == EOPNOTSUPP) {
+		printf("vale-l3 not available\n");
+		return 0;
+	}
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_L3_ROUTE_ADD)");
+		return ret;
+	}
+
+	nmreq_hdr_init(&hdr, "valel3:");
+	hdr.nr_reqtype = NETMAP_REQ_VALE_L3_ACL_ADD;
+	hdr.nr_body    = (uintptr_t)&acl;
+	memset(&acl, 0, sizeof(acl));
+	acl.nr_family = NR_VALE_L3_INET;
+	acl.nr_proto = 6;
+	acl.nr_dport_min = acl.nr_dport_max = 22;
+	acl.nr_prio = 10;
+	acl.nr_action = NR_VALE_L3_DENY;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_L3_ACL_ADD)");
+		return ret;
+	}
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0 || errno != EEXIST) {
+		printf("duplicate priority accepted\n");
+		return -1;
+	}
+	hdr.nr_reqtype = NETMAP_REQ_VALE_L3_ACL_DEL;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_L3_ACL_DEL)");
+		return ret;
+	}
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_L3_ROUTE_DEL;
+	hdr.nr_body    = (uintptr_t)&route;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_L3_ROUTE_DEL)");
+		return ret;
+	}
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0 || errno != ENOENT) {
+		printf("missing route removed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Run each microbenchmark for a few iterations on a VALE port. Without
+ * the bench subsystem the requests must fail with EOPNOTSUPP. */
+static int
+kernel_bench(struct TestContext *ctx)
+{
+	static const struct {
+		uint32_t test, batch, len;
+	} tests[] = {
+		{ NR_BENCH_COPY, 1, 1514 },
+		{ NR_BENCH_LEARN, 64, 0 },
+		{ NR_BENCH_ALLOC, 64, 0 },
+		{ NR_BENCH_CSUM, 1, 1514 },
+	};
+	struct nmreq_bench req;
+	struct nmreq_header hdr;
+	unsigned i;
+	int ret;
+
+	strncpy(ctx->ifname_ext, "valebench:0", sizeof(ctx->ifname_ext));
+	ret = port_register_hwall(ctx);
+	if (ret != 0)
+		return ret;
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		printf("Testing NETMAP_REQ_BENCH %u on '%s'\n", tests[i].test,
+		       ctx->ifname_ext);
+		nmreq_hdr_init(&hdr, ctx->ifname_ext);
+		hdr.nr_reqtype = NETMAP_REQ_BENCH;
+		hdr.nr_body    = (uintptr_t)&req;
+		memset(&req, 0, sizeof(req));
+		req.nr_test  = tests[i].test;
+		req.nr_count = 1000;
+		req.nr_batch = tests[i].batch;
+		req.nr_len   = tests[i].len;
+		ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+		if (ret != 0 && errno == EOPNOTSUPP) {
+			printf("bench not available\n");
+			return 0;
+		}
+		if (ret != 0) {
+			perror("ioctl(/dev/netmap, NIOCCTRL, BENCH)");
+			return ret;
+		}
+		printf("%llu cycles, %llu ns\n",
+		       (unsigned long long)req.nr_cycles,
+		       (unsigned long long)req.nr_ns);
+	}
+
+	req.nr_count = NR_BENCH_MAX_OPS + 1;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0 || errno != EINVAL) {
+		printf("too many iterations accepted\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* NETMAP_REQ_OPT_NUMA on a VALE port, which has no NIC to follow. */
+static int
+numa_option(struct TestContext *ctx)
+{
+	struct nmreq_opt_numa opt, save;
+	int ret;
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_mode = NR_REG_ALL_NIC;
+
+	printf("Testing NETMAP_REQ_OPT_NUMA on '%s'\n", ctx->ifname_ext);
+	memset(&opt, 0, sizeof(opt));
+	opt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_NUMA;
+	opt.nro_node = -1;
+	push_option(&opt.nro_opt, ctx);
+	save = opt;
+	ret = port_register(ctx);
+	clear_options(ctx);
+	if (ret != 0)
+		return ret;
+	save.nro_opt.nro_status = 0;
+	if (checkoption(&opt.nro_opt, &save.nro_opt))
+		return -1;
+	ctx->nr_mem_id = 0;
+
+	/* the option and the pools info must agree */
+	return pools_info_expect_node(ctx, opt.nro_node);
+}
+
+/* NETMAP_REQ_OPT_BUF_SIZE on a new VALE port: the size is rounded to
+ * the cache line and it must show up in the pools info. */
+static int
+buf_size_option(struct TestContext *ctx)
+{
+	struct nmreq_opt_buf_size opt, save;
+	struct nmreq_pools_info req;
+	struct nmreq_header hdr;
+	int ret;
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_mode = NR_REG_ALL_NIC;
+
+	printf("Testing NETMAP_REQ_OPT_BUF_SIZE on '%s'\n", ctx->ifname_ext);
+	memset(&opt, 0, sizeof(opt));
+	opt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_BUF_SIZE;
+	opt.nro_buf_size = 1000;
+	push_option(&opt.nro_opt, ctx);
+	save = opt;
+	ret = port_register(ctx);
+	clear_options(ctx);
+	if (ret != 0)
+		return ret;
+	save.nro_opt.nro_status = 0;
+	save.nro_buf_size = 1024;
+	if (checkoption(&opt.nro_opt, &save.nro_opt))
+		return -1;
+	ctx->nr_mem_id = 0;
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_INFO_GET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_INFO_GET)");
+		return ret;
+	}
+	printf("nr_buf_pool_objsize %u, expected 1024\n",
+			req.nr_buf_pool_objsize);
+
+	return req.nr_buf_pool_objsize == 1024 ? 0 : -1;
+}
+
+/* buffers smaller than a cache line are refused */
+static int
+buf_size_option_invalid(struct TestContext *ctx)
+{
+	struct nmreq_opt_buf_size opt, save;
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_mode = NR_REG_ALL_NIC;
+
+	printf("Testing invalid NETMAP_REQ_OPT_BUF_SIZE on '%s'\n",
+			ctx->ifname_ext);
+	memset(&opt, 0, sizeof(opt));
+	opt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_BUF_SIZE;
+	opt.nro_buf_size = 32;
+	push_option(&opt.nro_opt, ctx);
+	save = opt;
+	if (port_register(ctx) >= 0)
+		return -1;
+	clear_options(ctx);
+	save.nro_opt.nro_status = EINVAL;
+	return checkoption(&opt.nro_opt, &save.nro_opt);
+}
+
+/* VALE ports have no hardware offloads, so NETMAP_REQ_OPT_SLOT_META
+ * must be refused and only report the software timestamps. */
+static int
+slot_meta_unsupported(struct TestContext *ctx)
+{
+	struct nmreq_opt_slot_meta opt, save;
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_mode = NR_REG_ALL_NIC;
+
+	printf("Testing NETMAP_REQ_OPT_SLOT_META on '%s'\n", ctx->ifname_ext);
+	memset(&opt, 0, sizeof(opt));
+	opt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_SLOT_META;
+	opt.nro_flags = ~NM_META_TS;
+	push_option(&opt.nro_opt, ctx);
+	save = opt;
+	if (port_register(ctx) >= 0)
+		return -1;
+	clear_options(ctx);
+	save.nro_opt.nro_status = EOPNOTSUPP;
+	if (checkoption(&opt.nro_opt, &save.nro_opt))
+		return -1;
+	if (opt.nro_flags != NM_META_TS) {
+		printf("nro_flags %x expected %x\n", opt.nro_flags,
+		       NM_META_TS);
+		return -1;
+	}
+	return 0;
+}
+
+/* register a monitor (NR_MONITOR_* or NR_ZCOPY_MON in flags) of the port
+ * 'name' on a new fd, with a NETMAP_REQ_OPT_MONITOR_FILTER or
+ * NETMAP_REQ_OPT_MONITOR_SAMPLE option */
+static int
+monitor_filter_register(const char *name, uint64_t flags,
+			struct nmreq_option *opt)
+{
+	struct nmreq_register req;
+	struct nmreq_header hdr;
+	int fd, ret;
+
+	nmreq_hdr_init(&hdr, name);
+	hdr.nr_reqtype = NETMAP_REQ_REGISTER;
+	hdr.nr_body    = (uintptr_t)&req;
+	hdr.nr_options = (uintptr_t)opt;
+	memset(&req, 0, sizeof(req));
+	req.nr_mode = NR_REG_ALL_NIC;
+	req.nr_flags = flags;
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0) {
+		perror("open(/dev/netmap)");
+		return -1;
+	}
+	ret = ioctl(fd, NIOCCTRL, &hdr);
+	if (ret != 0)
+		perror("ioctl(/dev/netmap, NIOCCTRL, REGISTER)");
+	close(fd);
+	return ret;
+}
+
+/* NETMAP_REQ_OPT_MONITOR_FILTER with a valid and an invalid program */
+static int
+monitor_filter_option(struct TestContext *ctx)
+{
+	struct {
+		struct nmreq_opt_monitor_filter opt;
+		struct nm_bpf_insn insns[4];
+	} f;
+	/* accept IPv4 frames (ethertype 0x0800), 128 bytes at most */
+	static const struct nm_bpf_insn prog[4] = {
+		{ 0x28, 0, 0, 12 },	/* ldh [12] */
+		{ 0x15, 0, 1, 0x0800 },	/* jeq #0x800, L1, L2 */
+		{ 0x06, 0, 0, 128 },	/* L1: ret #128 */
+		{ 0x06, 0, 0, 0 },	/* L2: ret #0 */
+	};
+	int ret;
+
+	strncpy(ctx->ifname_ext, "vale0:mf", sizeof(ctx->ifname_ext));
+	ctx->nr_mode = NR_REG_ALL_NIC;
+	if (port_register(ctx) < 0)
+		return -1;
+
+	printf("Testing NETMAP_REQ_OPT_MONITOR_FILTER on 'vale0:mf/r'\n");
+	memset(&f, 0, sizeof(f));
+	f.opt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_MONITOR_FILTER;
+	f.opt.nro_opt.nro_size = sizeof(f);
+	f.opt.nro_snaplen = 64;
+	f.opt.nro_ninsns = 4;
+	memcpy(f.insns, prog, sizeof(prog));
+	f.opt.nro_opt.nro_status = EINVAL;
+	ret = monitor_filter_register("vale0:mf", NR_MONITOR_RX,
+			    &f.opt.nro_opt);
+	if (ret != 0)
 		return ret;
+	if (f.opt.nro_opt.nro_status != 0) {
+		printf("nro_status %u expected 0\n", f.opt.nro_opt.nro_status);
+		return -1;
 	}
 
-	return vale_detach(ctx);
+	/* a jump past the end of the program must be rejected */
+	f.insns[1].jf = 2;
+	f.opt.nro_opt.nro_next = 0;
+	f.opt.nro_opt.nro_status = 0;
+	if (monitor_filter_register("vale0:mf", NR_MONITOR_RX,
+			    &f.opt.nro_opt) == 0) {
+		printf("invalid filter accepted\n");
+		return -1;
+	}
+	return 0;
 }
 
-static void
-push_option(struct nmreq_option *opt, struct TestContext *ctx)
+/* NETMAP_REQ_OPT_MONITOR_SAMPLE on copy and zero-copy monitors */
+static int
+monitor_sample_option(struct TestContext *ctx)
 {
-	opt->nro_next = (uintptr_t)ctx->nr_opt;
-	ctx->nr_opt   = opt;
-}
+	struct nmreq_opt_monitor_sample s;
 
-static void
-clear_options(struct TestContext *ctx)
-{
-	ctx->nr_opt = NULL;
-}
+	strncpy(ctx->ifname_ext, "vale0:ms", sizeof(ctx->ifname_ext));
+	ctx->nr_mode = NR_REG_ALL_NIC;
+	if (port_register(ctx) < 0)
+		return -1;
 
-static int
-checkoption(struct nmreq_option *opt, struct nmreq_option *exp)
-{
-	if (opt->nro_next != exp->nro_next) {
-		printf("nro_next %p expected %p\n",
-		       (void *)(uintptr_t)opt->nro_next,
-		       (void *)(uintptr_t)exp->nro_next);
+	printf("Testing NETMAP_REQ_OPT_MONITOR_SAMPLE on 'vale0:ms/rt'\n");
+	memset(&s, 0, sizeof(s));
+	s.nro_opt.nro_reqtype = NETMAP_REQ_OPT_MONITOR_SAMPLE;
+	s.nro_rate = 16;
+	s.nro_flags = NR_MONITOR_SAMPLE_FLOW;
+	s.nro_opt.nro_status = EINVAL;
+	if (monitor_filter_register("vale0:ms",
+	    NR_MONITOR_TX | NR_MONITOR_RX, &s.nro_opt) != 0)
+		return -1;
+	if (s.nro_opt.nro_status != 0) {
+		printf("nro_status %u expected 0\n", s.nro_opt.nro_status);
 		return -1;
 	}
-	if (opt->nro_reqtype != exp->nro_reqtype) {
-		printf("nro_reqtype %u expected %u\n", opt->nro_reqtype,
-		       exp->nro_reqtype);
+
+	/* unknown flags */
+	s.nro_flags = 0x80;
+	s.nro_opt.nro_next = 0;
+	s.nro_opt.nro_status = 0;
+	if (monitor_filter_register("vale0:ms",
+	    NR_MONITOR_TX | NR_MONITOR_RX, &s.nro_opt) == 0) {
+		printf("invalid sample flags accepted\n");
 		return -1;
 	}
-	if (opt->nro_status != exp->nro_status) {
-		printf("nro_status %u expected %u\n", opt->nro_status,
-		       exp->nro_status);
+
+	/* zero-copy monitors cannot sample */
+	s.nro_flags = 0;
+	s.nro_opt.nro_next = 0;
+	s.nro_opt.nro_status = 0;
+	if (monitor_filter_register("vale0:ms", NR_ZCOPY_MON,
+	    &s.nro_opt) == 0) {
+		printf("sampling zero-copy monitor accepted\n");
 		return -1;
 	}
 	return 0;
@@ -1024,40 +2598,6 @@ infinite_options(struct TestContext *ctx)
 }
 
 #ifdef CONFIG_NETMAP_EXTMEM
-int
-change_param(const char *pname, unsigned long newv, unsigned long *poldv)
-{
-#ifdef __linux__
-	char param[256] = "/sys/module/netmap/parameters/";
-	unsigned long oldv;
-	FILE *f;
-
-	strncat(param, pname, sizeof(param) - 1);
-
-	f = fopen(param, "r+");
-	if (f == NULL) {
-		perror(param);
-		return -1;
-	}
-	if (fscanf(f, "%ld", &oldv) != 1) {
-		perror(param);
-		fclose(f);
-		return -1;
-	}
-	if (poldv)
-		*poldv = oldv;
-	rewind(f);
-	if (fprintf(f, "%ld\n", newv) < 0) {
-		perror(param);
-		fclose(f);
-		return -1;
-	}
-	fclose(f);
-	printf("change_param: %s: %ld -> %ld\n", pname, oldv, newv);
-#endif /* __linux__ */
-	return 0;
-}
-
 static int
 push_extmem_option(struct TestContext *ctx, const struct nmreq_pools_info *pi,
 		struct nmreq_opt_extmem *e)
@@ -1234,6 +2774,120 @@ duplicate_extmem_options(struct TestContext *ctx)
 
 	return 0;
 }
+
+static int
+push_extmem_bufs_option(struct TestContext *ctx, size_t memsize,
+		struct nmreq_opt_extmem_bufs *b)
+{
+	void *addr;
+
+	addr = mmap(NULL, memsize, PROT_READ | PROT_WRITE,
+	            MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	memset(b, 0, sizeof(*b));
+	b->nro_opt.nro_reqtype = NETMAP_REQ_OPT_EXTMEM_BUFS;
+	b->nro_usrptr = (uintptr_t)addr;
+	b->nro_memsize = memsize;
+	b->nro_buf_size = 2048;
+	b->nro_buf_num = 256;
+
+	push_option(&b->nro_opt, ctx);
+
+	return 0;
+}
+
+static int
+pop_extmem_bufs_option(struct TestContext *ctx,
+		struct nmreq_opt_extmem_bufs *exp)
+{
+	struct nmreq_opt_extmem_bufs *b;
+	int ret;
+
+	b           = (struct nmreq_opt_extmem_bufs *)(uintptr_t)ctx->nr_opt;
+	ctx->nr_opt = (struct nmreq_option *)(uintptr_t)ctx->nr_opt->nro_next;
+
+	if ((ret = checkoption(&b->nro_opt, &exp->nro_opt))) {
+		return ret;
+	}
+
+	if (exp->nro_opt.nro_status == 0 &&
+	    (b->nro_buf_size != 2048 || b->nro_buf_num == 0 ||
+	     b->nro_buf_num > 256 || b->nro_buf_total < b->nro_buf_num)) {
+		printf("buf_size %u buf_num %u buf_total %u\n",
+		       b->nro_buf_size, b->nro_buf_num, b->nro_buf_total);
+		return -1;
+	}
+
+	return munmap((void *)(uintptr_t)b->nro_usrptr, b->nro_memsize);
+}
+
+/* extmem with the buffers in a separate region */
+static int
+extmem_bufs_option(struct TestContext *ctx)
+{
+	struct nmreq_opt_extmem e, save;
+	struct nmreq_opt_extmem_bufs b, bsave;
+	struct nmreq_pools_info	pools_info;
+	int ret;
+
+	printf("Testing extmem-bufs option on vale0:0\n");
+
+	pools_info_fill(&pools_info);
+	pools_info.nr_buf_pool_objtotal = 0;
+	pools_info.nr_memsize = pools_info_min_memsize(&pools_info);
+
+	if ((ret = push_extmem_option(ctx, &pools_info, &e)) < 0)
+		return ret;
+	if ((ret = push_extmem_bufs_option(ctx, 1024 * 2048, &b)) < 0) {
+		clear_options(ctx);
+		return ret;
+	}
+	save = e;
+	bsave = b;
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_tx_slots = 16;
+	ctx->nr_rx_slots = 16;
+
+	if ((ret = port_register_hwall(ctx))) {
+		clear_options(ctx);
+		return ret;
+	}
+
+	if ((ret = pop_extmem_bufs_option(ctx, &bsave)))
+		return ret;
+	return pop_extmem_option(ctx, &save);
+}
+
+static int
+extmem_bufs_without_extmem(struct TestContext *ctx)
+{
+	struct nmreq_opt_extmem_bufs b, bsave;
+	int ret;
+
+	printf("Testing extmem-bufs option without extmem on vale0:0\n");
+
+	if ((ret = push_extmem_bufs_option(ctx, 1024 * 2048, &b)) < 0)
+		return ret;
+	bsave = b;
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_tx_slots = 16;
+	ctx->nr_rx_slots = 16;
+
+	if (port_register_hwall(ctx) >= 0) {
+		printf("extmem-bufs without extmem not rejected\n");
+		clear_options(ctx);
+		return -1;
+	}
+
+	bsave.nro_opt.nro_status = EINVAL;
+	return pop_extmem_bufs_option(ctx, &bsave);
+}
 #endif /* CONFIG_NETMAP_EXTMEM */
 
 static int
@@ -1512,6 +3166,13 @@ sync_kloop_eventfds_all_direct_rx(struct TestContext *ctx)
 	    NM_OPT_SYNC_KLOOP_DIRECT_RX);
 }
 
+static int
+sync_kloop_eventfds_all_event_idx(struct TestContext *ctx)
+{
+	return sync_kloop_eventfds_all_mode(ctx,
+	    NM_OPT_SYNC_KLOOP_EVENT_IDX);
+}
+
 static int
 sync_kloop_nocsb(struct TestContext *ctx)
 {
@@ -1581,7 +3242,7 @@ sync_kloop_csb_enable(struct TestContext *ctx)
 }
 
 static int
-sync_kloop_conflict(struct TestContext *ctx)
+sync_kloop_conflict_opt(struct TestContext *ctx, struct nmreq_option *kopt)
 {
 	struct nmreq_opt_csb opt;
 	pthread_t th1, th2;
@@ -1601,6 +3262,10 @@ sync_kloop_conflict(struct TestContext *ctx)
 		return ret;
 	}
 	clear_options(ctx);
+	if (kopt != NULL) {
+		/* Both kloops use the same options. */
+		push_option(kopt, ctx);
+	}
 
 	ret = sem_init(&sem, 0, 0);
 	if (ret != 0) {
@@ -1648,6 +3313,7 @@ sync_kloop_conflict(struct TestContext *ctx)
 
 	sem_destroy(&sem);
 	ctx->sem = NULL;
+	clear_options(ctx);
 	if (err) {
 		return err;
 	}
@@ -1659,6 +3325,136 @@ sync_kloop_conflict(struct TestContext *ctx)
 	               : -1;
 }
 
+static int
+sync_kloop_conflict(struct TestContext *ctx)
+{
+	return sync_kloop_conflict_opt(ctx, NULL);
+}
+
+static void
+sync_kloop_sched_option(struct nmreq_opt_sync_kloop_sched *opt,
+			uint32_t spin_us, uint16_t tx_first, uint16_t tx_num,
+			uint16_t rx_first, uint16_t rx_num)
+{
+	memset(opt, 0, sizeof(*opt));
+	opt->nro_opt.nro_reqtype = NETMAP_REQ_OPT_SYNC_KLOOP_SCHED;
+	opt->nro_spin_us         = spin_us;
+	opt->nro_flags           = NM_OPT_SYNC_KLOOP_SUBSET;
+	opt->nro_tx_first        = tx_first;
+	opt->nro_tx_num          = tx_num;
+	opt->nro_rx_first        = rx_first;
+	opt->nro_rx_num          = rx_num;
+}
+
+/* Two kloops serving the same tx ring cannot run together. */
+static int
+sync_kloop_subset_conflict(struct TestContext *ctx)
+{
+	struct nmreq_opt_sync_kloop_sched opt;
+
+	sync_kloop_sched_option(&opt, 50, 0, 1, 0, 0);
+	return sync_kloop_conflict_opt(ctx, &opt.nro_opt);
+}
+
+static int
+sync_kloop_subset_invalid(struct TestContext *ctx)
+{
+	struct nmreq_opt_sync_kloop_sched opt;
+	int ret;
+
+	ret = csb_mode(ctx);
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* One ring more than the bound ones. */
+	sync_kloop_sched_option(&opt, 0, 0, ctx->nr_tx_rings + 1, 0, 0);
+	push_option(&opt.nro_opt, ctx);
+	ret = sync_kloop_start_stop(ctx);
+	clear_options(ctx);
+	if (ret == 0) {
+		return -1;
+	}
+	return opt.nro_opt.nro_status == EINVAL ? 0 : -1;
+}
+
+/* A kloop that also serves the rings of a second VALE port, open in
+ * CSB mode on another file descriptor (NETMAP_REQ_OPT_SYNC_KLOOP_PORTS). */
+static int
+sync_kloop_ports(struct TestContext *ctx)
+{
+	struct {
+		struct nmreq_opt_sync_kloop_ports opt;
+		int32_t fds[1];
+	} p;
+	struct nm_csb_atok atok[2];
+	struct nm_csb_ktoa ktoa[2];
+	struct nmreq_opt_csb csbopt;
+	struct nmreq_register req;
+	struct nmreq_header hdr;
+	char name[NM_IFNAMSZ];
+	int fd, ret;
+
+	ret = csb_mode(ctx);
+	if (ret != 0) {
+		return ret;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.opt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_SYNC_KLOOP_PORTS;
+	p.opt.nro_opt.nro_size    = sizeof(p);
+
+	/* Not a netmap file descriptor. */
+	p.fds[0] = -1;
+	push_option(&p.opt.nro_opt, ctx);
+	ret = sync_kloop_start_stop(ctx);
+	clear_options(ctx);
+	if (ret == 0 || p.opt.nro_opt.nro_status != EBADF) {
+		return -1;
+	}
+
+	/* A one-ring VALE port, with its own CSB. */
+	if (snprintf(name, sizeof(name), "%s:klp", ctx->bdgname) >=
+	    (int)sizeof(name)) {
+		return -1;
+	}
+	memset(atok, 0, sizeof(atok));
+	memset(ktoa, 0, sizeof(ktoa));
+	memset(&csbopt, 0, sizeof(csbopt));
+	csbopt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_CSB;
+	csbopt.csb_atok            = (uintptr_t)atok;
+	csbopt.csb_ktoa            = (uintptr_t)ktoa;
+	nmreq_hdr_init(&hdr, name);
+	hdr.nr_reqtype = NETMAP_REQ_REGISTER;
+	hdr.nr_body    = (uintptr_t)&req;
+	hdr.nr_options = (uintptr_t)&csbopt;
+	memset(&req, 0, sizeof(req));
+	req.nr_mode  = NR_REG_ALL_NIC;
+	req.nr_flags = NR_EXCLUSIVE;
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0) {
+		perror("open(/dev/netmap)");
+		return -1;
+	}
+	ret = ioctl(fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, REGISTER)");
+		close(fd);
+		return ret;
+	}
+
+	printf("Testing NETMAP_REQ_OPT_SYNC_KLOOP_PORTS with '%s'\n", name);
+	p.fds[0] = fd;
+	push_option(&p.opt.nro_opt, ctx);
+	ret = sync_kloop_start_stop(ctx);
+	clear_options(ctx);
+	close(fd);
+	if (ret != 0) {
+		return ret;
+	}
+	return p.opt.nro_opt.nro_status == 0 ? 0 : -1;
+}
+
 static int
 sync_kloop_eventfds_mismatch(struct TestContext *ctx)
 {
@@ -1743,6 +3539,97 @@ null_port_sync(struct TestContext *ctx)
 	return 0;
 }
 
+/* a null port as a traffic source and sink (NETMAP_REQ_OPT_NULL_TRAFFIC,
+ * through the @null portspec option) */
+static int
+null_port_traffic(struct TestContext *ctx)
+{
+	const char *name = "netmap:nullt@conf:rings=1,slots=64@null:len=128";
+	struct netmap_ring *ring;
+	struct nmport_d *d;
+	uint8_t *buf;
+	int ret = -1;
+
+	(void)ctx;
+	printf("Testing null traffic on '%s'\n", name);
+	d = nmport_open(name);
+	if (d == NULL)
+		return -1;
+
+	ring = NETMAP_RXRING(d->nifp, 0);
+	if (ioctl(d->fd, NIOCRXSYNC, NULL) < 0) {
+		perror("NIOCRXSYNC");
+		goto out;
+	}
+	if (nm_ring_space(ring) != ring->num_slots - 1) {
+		printf("%u rx slots, expected %u\n", nm_ring_space(ring),
+				ring->num_slots - 1);
+		goto out;
+	}
+	buf = (uint8_t *)NETMAP_BUF(ring, ring->slot[ring->head].buf_idx);
+	if (ring->slot[ring->head].len != 128 || buf[12] != 0x08 ||
+	    buf[13] != 0x00 || buf[23] != 17) {
+		printf("unexpected frame: len %u type %02x%02x proto %u\n",
+				ring->slot[ring->head].len, buf[12], buf[13],
+				buf[23]);
+		goto out;
+	}
+
+	ring = NETMAP_TXRING(d->nifp, 0);
+	ring->head = ring->cur = ring->tail;
+	if (ioctl(d->fd, NIOCTXSYNC, NULL) < 0) {
+		perror("NIOCTXSYNC");
+		goto out;
+	}
+	if (nm_ring_space(ring) != ring->num_slots - 1) {
+		printf("%u tx slots, expected %u\n", nm_ring_space(ring),
+				ring->num_slots - 1);
+		goto out;
+	}
+	ret = 0;
+out:
+	nmport_close(d);
+	return ret;
+}
+
+/* the @prefault option faults in the region in nmport_mmap() */
+static int
+prefault_mmap(struct TestContext *ctx)
+{
+	const char *name = "vale0:pf@prefault";
+	struct nmport_d *d, *c;
+	int ret = -1;
+
+	(void)ctx;
+	printf("Testing prefaulted mmap on '%s'\n", name);
+	d = nmport_open(name);
+	if (d == NULL)
+		return -1;
+	if (!d->prefault || !d->mem->prefaulted) {
+		printf("region of '%s' not prefaulted\n", name);
+		goto out;
+	}
+	if (nmport_prefault(d) == 0) {
+		printf("nmport_prefault() accepted a mapped port\n");
+		goto out;
+	}
+	c = nmport_clone(d);
+	if (c == NULL)
+		goto out;
+	if (nmport_open_desc(c) < 0) {
+		nmport_close(c);
+		goto out;
+	}
+	if (c->mem != d->mem)
+		printf("clone did not share the region\n");
+	else
+		ret = 0;
+	nmport_close(c);
+out:
+	nmport_close(d);
+	return ret;
+}
+
 struct nmreq_parse_test {
 	const char *ifname;
 	const char *exp_port;
@@ -2040,12 +3927,35 @@ static struct mytest tests[] = {
 	decltest(vale_attach_detach_host_rings),
 	decltest(vale_ephemeral_port_hdr_manipulation),
 	decltest(vale_persistent_port),
+	decltest(vale_persistent_port_keepwarm),
+	decltest(vale_hash_size),
+	decltest(vale_port_stats),
+	decltest(vale_list_bulk),
+	decltest(vale_hash_save_restore),
+	decltest(vale_qos),
+	decltest(vale_defer),
+	decltest(vale_l3),
+	decltest(kernel_bench),
 	decltest(pools_info_get_and_register),
 	decltest(pools_info_get_empty_ifname),
+	decltest(pools_stats_leak),
+	decltest(numa_option),
+	decltest(slot_meta_unsupported),
+	decltest(buf_size_option),
+	decltest(buf_size_option_invalid),
+	decltest(monitor_filter_option),
+	decltest(monitor_sample_option),
+	decltest(pools_expand),
+	decltest(flow_rule_unsupported),
+	decltest(ring_stats_get),
+	decltest(sync_batch),
 	decltest(pipe_master),
 	decltest(pipe_slave),
 	decltest(pipe_port_info_get),
 	decltest(pipe_pools_info_get),
+	decltest(pipe_burst),
+	decltest(nmloop_pipes),
+	decltest(nmport_open_ring_threads),
 	decltest(vale_polling_enable_disable),
 	decltest(unsupported_option),
 	decltest(infinite_options),
@@ -2053,6 +3963,8 @@ static struct mytest tests[] = {
 	decltest(extmem_option),
 	decltest(bad_extmem_option),
 	decltest(duplicate_extmem_options),
+	decltest(extmem_bufs_option),
+	decltest(extmem_bufs_without_extmem),
 #endif /* CONFIG_NETMAP_EXTMEM */
 	decltest(csb_mode),
 	decltest(csb_mode_invalid_memory),
@@ -2062,13 +3974,19 @@ static struct mytest tests[] = {
 	decltest(sync_kloop_eventfds_all_direct),
 	decltest(sync_kloop_eventfds_all_direct_tx),
 	decltest(sync_kloop_eventfds_all_direct_rx),
+	decltest(sync_kloop_eventfds_all_event_idx),
 	decltest(sync_kloop_nocsb),
 	decltest(sync_kloop_csb_enable),
 	decltest(sync_kloop_conflict),
+	decltest(sync_kloop_subset_conflict),
+	decltest(sync_kloop_subset_invalid),
+	decltest(sync_kloop_ports),
 	decltest(sync_kloop_eventfds_mismatch),
 	decltest(null_port),
 	decltest(null_port_all_zero),
 	decltest(null_port_sync),
+	decltest(null_port_traffic),
+	decltest(prefault_mmap),
 	decltest(legacy_regif_default),
 	decltest(legacy_regif_all_nic),
 	decltest(legacy_regif_12),
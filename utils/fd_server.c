@@ -1,6 +1,10 @@
+#ifdef __linux__
+#define _GNU_SOURCE	/* struct ucred */
+#endif /* __linux__ */
 #include <errno.h>
 #include <fcntl.h>
 #include <net/if.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -19,11 +23,28 @@
 
 #include "fd_server.h"
 
+/*
+ * The server keeps a table of open descriptors, indexed by the name
+ * used to open them through a hash table, so that a lookup does not
+ * depend on the number of entries. The ports given with -p are opened
+ * at startup, together with one descriptor for each of their hardware
+ * rings (named port-N, as in NR_REG_ONE_NIC), so that the workers
+ * asking for them do not wait for a NIOCREGIF.
+ *
+ * A descriptor handed out with FD_GET stays in use until the client
+ * sends FD_RELEASE, or until the process that got it has died (where
+ * the pid of the peer is known), so that the rings of a crashed worker
+ * can be given to its replacement. Clients are served concurrently,
+ * and may send several requests on the same connection.
+ */
 struct nmd_entry {
 	char if_name[NETMAP_REQ_IFNAMSIZ];
 	struct nmport_d *nmd;
 	uint8_t is_in_use;
 	uint8_t is_open;
+	uint8_t is_preopened;	/* opened at startup, never closed */
+	pid_t owner;		/* process using it, 0 if unknown */
+	int next;		/* next entry in the same bucket, or -1 */
 };
 
 int foreground = 0;
@@ -36,10 +57,30 @@ int foreground = 0;
 	}							\
 } while(0)
 
-#define MAX_OPEN_IF 128
+#define MAX_OPEN_IF 1024
 struct nmd_entry entries[MAX_OPEN_IF];
 int num_entries = 0;
 
+#define NUM_BUCKETS 2048	/* power of 2, larger than MAX_OPEN_IF */
+int buckets[NUM_BUCKETS];
+
+#define MAX_CONN 256
+struct pollfd conns[MAX_CONN + 1];	/* conns[0] is the listen socket */
+int num_conns = 0;
+
+static unsigned
+name_hash(const char *if_name)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < NETMAP_REQ_IFNAMSIZ && if_name[i] != '\0'; i++) {
+		h ^= (uint8_t)if_name[i];
+		h *= 16777619U;
+	}
+	return h & (NUM_BUCKETS - 1);
+}
+
 static void
 print_request(struct fd_request *req)
 {
@@ -59,35 +100,99 @@ search_des(const char *if_name)
 {
 	int i;
 
-	// msg("searching %s\n", if_name);
-	for (i = 0; i < num_entries; ++i) {
+	for (i = buckets[name_hash(if_name)]; i >= 0; i = entries[i].next) {
 		struct nmd_entry *entry = &entries[i];
 
-		// msg("i=%d, is_open=%d, is_in_use=%d, if_name=%s\n",
-		// 	i, entry->is_open, entry->is_in_use, entry->if_name);
-
-		if (entry->is_open == 0) {
-			continue;
-		}
-
-		if (strncmp(entry->if_name, if_name, IFNAMSIZ) == 0) {
-			// msg("finished searching with a match\n");
+		if (entry->is_open &&
+		    strncmp(entry->if_name, if_name, NETMAP_REQ_IFNAMSIZ) == 0) {
 			return entry;
 		}
 	}
 
-	// msg("finished searching without a match\n");
 	return NULL;
 }
 
+/* returns an entry for if_name, linked in its bucket */
 struct nmd_entry *
-get_free_des(void)
+get_free_des(const char *if_name)
 {
-	if (num_entries == MAX_OPEN_IF) {
-		return NULL;
+	struct nmd_entry *entry = NULL;
+	unsigned h = name_hash(if_name);
+	int i;
+
+	/* reuse a closed entry of the same bucket, if any */
+	for (i = buckets[h]; i >= 0; i = entries[i].next) {
+		if (!entries[i].is_open) {
+			entry = &entries[i];
+			break;
+		}
+	}
+	if (entry == NULL) {
+		if (num_entries == MAX_OPEN_IF) {
+			return NULL;
+		}
+		entry = &entries[num_entries];
+		entry->next = buckets[h];
+		buckets[h] = num_entries++;
 	}
+	strncpy(entry->if_name, if_name, sizeof(entry->if_name));
+	entry->if_name[sizeof(entry->if_name) - 1] = '\0';
+	entry->nmd = NULL;
+	entry->is_in_use = 0;
+	entry->is_preopened = 0;
+	return entry;
+}
 
-	return &entries[num_entries++];
+/* open port and one descriptor for each of its hardware rings */
+static int
+preopen_port(const char *port)
+{
+	struct nmd_entry *entry;
+	struct nmport_d *d;
+	char name[NETMAP_REQ_IFNAMSIZ];
+	int i, n;
+
+	if (search_des(port) != NULL)
+		return 0;
+	d = nmport_open(port);
+	if (d == NULL) {
+		msg("Failed to nmport_open(%s) with error %d\n", port, errno);
+		return -1;
+	}
+	entry = get_free_des(port);
+	if (entry == NULL) {
+		msg("Out of memory\n");
+		nmport_close(d);
+		return -1;
+	}
+	entry->nmd = d;
+	entry->is_open = 1;
+	entry->is_preopened = 1;
+
+	n = d->reg.nr_tx_rings < d->reg.nr_rx_rings ?
+		d->reg.nr_rx_rings : d->reg.nr_tx_rings;
+	for (i = 0; i < n; i++) {
+		struct nmport_d *r;
+
+		snprintf(name, sizeof(name), "%s-%d", port, i);
+		r = nmport_open_ring(d, NR_REG_ONE_NIC, i);
+		if (r == NULL) {
+			msg("Failed to open ring %d of %s with error %d\n",
+					i, port, errno);
+			return -1;
+		}
+		entry = get_free_des(name);
+		if (entry == NULL) {
+			msg("Out of memory\n");
+			nmport_close(r);
+			return -1;
+		}
+		entry->nmd = r;
+		entry->is_open = 1;
+		entry->is_preopened = 1;
+	}
+	msg("preopened %s and its %d rings\n", port, n);
+	return 0;
 }
 
 int
@@ -108,13 +213,36 @@ marshal(struct fd_response *res, struct nmd_entry *entry)
 	return 0;
 }
 
+/* pid of the process on the other side of conn, 0 if unknown */
+static pid_t
+peer_pid(int conn)
+{
+#ifdef SO_PEERCRED
+	struct ucred cr;
+	socklen_t len = sizeof(cr);
+
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cr, &len) == 0)
+		return cr.pid;
+#else
+	(void)conn;
+#endif /* SO_PEERCRED */
+	return 0;
+}
+
 int
-get_fd(const char *if_name, struct fd_response *res)
+get_fd(const char *if_name, struct fd_response *res, pid_t pid)
 {
 	struct nmd_entry *entry;
+	struct nmport_d *d;
 
 	entry = search_des(if_name);
 	if (entry != NULL) {
+		if (entry->is_in_use == 1 && entry->owner > 0 &&
+		    kill(entry->owner, 0) < 0 && errno == ESRCH) {
+			msg("reclaiming %s from %d\n", if_name,
+					(int)entry->owner);
+			entry->is_in_use = 0;
+		}
 		if (entry->is_in_use == 1) {
 			msg("if_name %s is in use\n", if_name);
 			res->result = EBUSY;
@@ -122,30 +250,33 @@ get_fd(const char *if_name, struct fd_response *res)
 		}
 		if (marshal(res, entry) < 0)
 			return -1;
+		res->result = 0;
+		entry->is_in_use = 1;
+		entry->owner = pid;
 		return entry->nmd->fd;
 	}
 
-	entry = get_free_des();
+	d = nmport_open(if_name);
+	if (d == NULL) {
+		msg("Failed to nm_open(%s) with error %d\n", if_name, errno);
+		res->result = errno;
+		return -1;
+	}
+	entry = get_free_des(if_name);
 	if (entry == NULL) {
 		msg("Out of memory\n");
+		nmport_close(d);
 		res->result = ENOMEM;
 		return -1;
 	}
-
-	entry->nmd = nmport_open(if_name);
-	if (entry->nmd == NULL) {
-		msg("Failed to nm_open(%s) with error %d\n", if_name, errno);
-		res->result = errno;
-		return -1;
-	}
-	strncpy(entry->if_name, if_name, sizeof(entry->if_name));
-	entry->if_name[sizeof(entry->if_name) - 1] = '\0';
+	entry->nmd = d;
+	entry->is_open = 1;
 
 	if (marshal(res, entry) < 0)
 		return -1;
 	res->result = 0;
 	entry->is_in_use = 1;
-	entry->is_open   = 1;
+	entry->owner = pid;
 	return entry->nmd->fd;
 }
 
@@ -164,6 +295,7 @@ release_fd(const char *if_name, struct fd_response *res)
 	entry->is_in_use = 0;
 }
 
+
 void
 close_fd(const char *if_name, struct fd_response *res)
 {
@@ -180,6 +312,12 @@ close_fd(const char *if_name, struct fd_response *res)
 		msg("if_name %s hasn't been opened\n", if_name);
 		return;
 	}
+	if (entry->is_preopened) {
+		/* other workers may need it */
+		release_fd(if_name, res);
+		res->result = 0;
+		return;
+	}
 
 	nmport_close(entry->nmd);
 	res->result = 0;
@@ -238,11 +376,16 @@ handle_request(int accept_socket, int listen_socket)
 		msg("error while receiving the request\n");
 		return -1;
 	}
+	if (amount == 0) {
+		/* the client has gone */
+		return 1;
+	}
 
+	memset(&res, 0, sizeof(res));
 	print_request(&req);
 	switch (req.action) {
 	case FD_GET:
-		fd = get_fd(req.if_name, &res);
+		fd = get_fd(req.if_name, &res, peer_pid(accept_socket));
 		break;
 	case FD_RELEASE:
 		release_fd(req.if_name, &res);
@@ -263,8 +406,16 @@ handle_request(int accept_socket, int listen_socket)
 	ret = send_fd(accept_socket, fd, &res, sizeof(res));
 	if (ret == -1) {
 		msg("error while sending the response\n");
+		return ret;
 	}
-	return ret;
+	return 0;
+}
+
+static void
+drop_conn(int i)
+{
+	close(conns[i].fd);
+	conns[i] = conns[num_conns--];
 }
 
 void
@@ -295,29 +446,57 @@ main_loop(void)
 		exit(EXIT_FAILURE);
 	}
 
-	ret = listen(socket_fd, 2);
+	/* a whole pool of workers may connect at the same time */
+	ret = listen(socket_fd, MAX_CONN);
 	if (ret == -1) {
 		msg("error during listen()");
 		exit(EXIT_FAILURE);
 	}
 
 	msg("listening\n");
+	conns[0].fd = socket_fd;
+	conns[0].events = POLLIN;
 	for (;;) {
-		int conn_fd;
-		int ret;
+		int i;
 
-		conn_fd = accept(socket_fd, NULL, NULL);
-		if (conn_fd == -1) {
-			msg("error during accept(), shutting down\n");
+		ret = poll(conns, num_conns + 1, -1);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			msg("error during poll(), shutting down\n");
 			exit(EXIT_FAILURE);
 		}
 
-		ret = handle_request(conn_fd, socket_fd);
-		if (ret == -1) {
-			msg("error while handling a request\n");
+		/* serve the clients, then accept the new ones */
+		for (i = num_conns; i > 0; i--) {
+			if (conns[i].revents == 0)
+				continue;
+			ret = handle_request(conns[i].fd, socket_fd);
+			if (ret == -1) {
+				msg("error while handling a request\n");
+			}
+			if (ret != 0)
+				drop_conn(i);
+		}
+
+		if (conns[0].revents & POLLIN) {
+			int conn_fd;
+
+			conn_fd = accept(socket_fd, NULL, NULL);
+			if (conn_fd == -1) {
+				msg("error during accept(), shutting down\n");
+				exit(EXIT_FAILURE);
+			}
+			if (num_conns == MAX_CONN) {
+				msg("too many clients\n");
+				close(conn_fd);
+				continue;
+			}
+			num_conns++;
+			conns[num_conns].fd = conn_fd;
+			conns[num_conns].events = POLLIN;
+			conns[num_conns].revents = 0;
 		}
-		(void)ret;
-		close(conn_fd);
 	}
 }
 
@@ -366,13 +545,24 @@ daemonize(void)
 int
 main(int argc, char *argv[])
 {
+	const char *ports[MAX_OPEN_IF];
+	int num_ports = 0;
 	int opt;
+	int i;
 
-	while ( (opt = getopt(argc, argv, "f")) != -1) {
+	memset(buckets, -1, sizeof(buckets));
+	while ( (opt = getopt(argc, argv, "fp:")) != -1) {
 		switch (opt) {
 		case 'f':
 			foreground = 1;
 			break;
+		case 'p':
+			if (num_ports == MAX_OPEN_IF) {
+				fprintf(stderr, "too many ports\n");
+				exit(EXIT_FAILURE);
+			}
+			ports[num_ports++] = optarg;
+			break;
 		default:
 			fprintf(stderr, "Unknown option: %c\n", opt);
 			exit(EXIT_FAILURE);
@@ -381,6 +571,11 @@ main(int argc, char *argv[])
 	}
 	if (!foreground)
 		daemonize();
+	/* open everything before accepting requests */
+	for (i = 0; i < num_ports; i++) {
+		if (preopen_port(ports[i]) < 0)
+			exit(EXIT_FAILURE);
+	}
 	main_loop();
 	return 0;
 }
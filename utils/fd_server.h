@@ -7,6 +7,11 @@
 
 #define SOCKET_NAME "/tmp/netmap-fdserver"
 
+/*
+ * A client may send several requests on the same connection. The
+ * descriptors obtained with FD_GET are released by FD_RELEASE, or
+ * when the process that obtained them has died.
+ */
 struct fd_request {
 #define FD_GET 1
 #define FD_RELEASE 2
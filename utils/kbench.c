@@ -0,0 +1,203 @@
+/*
+ * driver for the kernel microbenchmarks (NETMAP_REQ_BENCH)
+ *
+ * Usage: kbench [-i port] [-t test] [-n count] [-b batch] [-r runs]
+ *		[size ...]
+ *
+ * Opens 'port' (default vale0:kbench), asks the kernel to run each
+ * test on it 'runs' times, and reports the best and the median cost
+ * of one operation, in cycles (of the kernel cycle counter) and ns.
+ * The kernel must be built with the bench subsystem (configure
+ * --enable-bench on Linux, CONFIG_NETMAP_BENCH on FreeBSD).
+ *
+ * test is one of
+ *	copy	pkt_copy() between two buffers, for each size
+ *	csum	Internet checksum of a buffer, for each size
+ *	learn	learning lookup of the VALE switches, 'batch' frames
+ *	alloc	allocation and release of 'batch' buffers
+ *	all	all of the above (default)
+ *
+ * Without sizes, copy and csum run the usual classes from 64 bytes
+ * to a full buffer. Run it pinned to an idle CPU, e.g. with taskset.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <net/netmap_user.h>
+#include <libnetmap.h>
+
+static struct {
+	const char *name;
+	uint32_t test;
+	int sized;	/* uses the sizes, otherwise the batch */
+} tests[] = {
+	{ "copy",	NR_BENCH_COPY,	1 },
+	{ "csum",	NR_BENCH_CSUM,	1 },
+	{ "learn",	NR_BENCH_LEARN,	0 },
+	{ "alloc",	NR_BENCH_ALLOC,	0 },
+	{ NULL, 0, 0 }
+};
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* runs a test 'runs' times and prints a line with the results */
+static int
+run(struct nmport_d *d, int t, uint32_t count, uint32_t batch,
+		uint32_t size, int runs)
+{
+	struct nmreq_header hdr;
+	struct nmreq_bench req;
+	double *cyc, *ns;
+	double ops;
+	int i, ret = 0;
+
+	if ((uint64_t)count * batch > NR_BENCH_MAX_OPS)
+		count = NR_BENCH_MAX_OPS / batch;
+	ops = (double)count * batch;
+	cyc = calloc(runs, sizeof(*cyc));
+	ns = calloc(runs, sizeof(*ns));
+	if (cyc == NULL || ns == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < runs; i++) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.nr_version = NETMAP_API;
+		hdr.nr_reqtype = NETMAP_REQ_BENCH;
+		hdr.nr_body = (uintptr_t)&req;
+		memcpy(hdr.nr_name, d->hdr.nr_name, sizeof(hdr.nr_name));
+		memset(&req, 0, sizeof(req));
+		req.nr_test = tests[t].test;
+		req.nr_count = count;
+		req.nr_batch = batch;
+		req.nr_len = size;
+		if (ioctl(d->fd, NIOCCTRL, &hdr) < 0) {
+			ret = errno;
+			if (ret == EOPNOTSUPP)
+				fprintf(stderr, "netmap built without the "
+						"bench subsystem\n");
+			else
+				fprintf(stderr, "%s: %s\n", tests[t].name,
+						strerror(ret));
+			goto out;
+		}
+		cyc[i] = req.nr_cycles / ops;
+		ns[i] = req.nr_ns / ops;
+	}
+	qsort(cyc, runs, sizeof(*cyc), cmp_double);
+	qsort(ns, runs, sizeof(*ns), cmp_double);
+	printf("%-6s %5u %5u %10.2f %10.2f %10.2f %10.2f\n", tests[t].name,
+			size, batch, cyc[0], cyc[runs / 2], ns[0], ns[runs / 2]);
+out:
+	free(cyc);
+	free(ns);
+	return ret;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: kbench [-i port] [-t test] [-n count] "
+			"[-b batch] [-r runs] [size ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const uint32_t def_sizes[] = { 64, 128, 256, 512, 1024, 1514,
+		2048 };
+	const char *port = "vale0:kbench";
+	const char *tname = "all";
+	long count = 100000, batch = 64;
+	int runs = 5;
+	struct nmport_d *d;
+	uint32_t bufsize;
+	int ch, i, j, found = 0;
+
+	while ((ch = getopt(argc, argv, "i:t:n:b:r:")) != -1) {
+		switch (ch) {
+		case 'i':
+			port = optarg;
+			break;
+		case 't':
+			tname = optarg;
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 'b':
+			batch = atol(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (count <= 0 || count > NR_BENCH_MAX_OPS || batch <= 0 ||
+	    batch > 1024 || runs <= 0)
+		usage();
+
+	d = nmport_open(port);
+	if (d == NULL) {
+		fprintf(stderr, "cannot open %s\n", port);
+		return 1;
+	}
+	bufsize = NETMAP_TXRING(d->nifp, d->first_tx_ring)->nr_buf_size;
+
+	printf("%-6s %5s %5s %10s %10s %10s %10s\n", "test", "size", "batch",
+			"cyc/op min", "cyc/op med", "ns/op min", "ns/op med");
+	for (j = 0; tests[j].name != NULL; j++) {
+		if (strcmp(tname, "all") && strcmp(tname, tests[j].name))
+			continue;
+		found = 1;
+		if (!tests[j].sized) {
+			if (run(d, j, count, batch, 0, runs))
+				goto fail;
+			continue;
+		}
+		if (argc == 0) {
+			for (i = 0; i < (int)(sizeof(def_sizes) /
+					sizeof(def_sizes[0])); i++) {
+				if (def_sizes[i] > bufsize)
+					continue;
+				if (run(d, j, count, 1, def_sizes[i], runs))
+					goto fail;
+			}
+		}
+		for (i = 0; i < argc; i++) {
+			int size = atoi(argv[i]);
+
+			if (size <= 0) {
+				fprintf(stderr, "invalid size %s\n", argv[i]);
+				goto fail;
+			}
+			if (run(d, j, count, 1, size, runs))
+				goto fail;
+		}
+	}
+	nmport_close(d);
+	if (!found) {
+		fprintf(stderr, "unknown test %s\n", tname);
+		usage();
+	}
+	return 0;
+fail:
+	nmport_close(d);
+	return 1;
+}
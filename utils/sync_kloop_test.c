@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	/* pthread_setaffinity_np */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -11,9 +12,14 @@
 #include <signal.h>
 #include <math.h>
 #include <sys/time.h>
+#include <sched.h>
 #ifdef __linux__
 #include <sys/eventfd.h>
-#endif /* __linux__ */
+#define cpuset_t	cpu_set_t
+#else  /* !__linux__ */
+#include <sys/cpuset.h>
+#include <pthread_np.h>
+#endif /* !__linux__ */
 
 #define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
 
@@ -36,6 +42,9 @@ struct context {
 	struct nm_csb_atok *atok_base;
 	struct nm_csb_ktoa *ktoa_base;
 	int sleep_us;
+	int spin_us;
+	int cpu; /* pin the kloop thread here, if >= 0 */
+	int event_idx; /* NM_OPT_SYNC_KLOOP_EVENT_IDX */
 	int verbose;
 	int batch;
 	int num_entries;
@@ -46,11 +55,27 @@ static void *
 kloop_worker(void *opaque)
 {
 	struct nmreq_opt_sync_kloop_eventfds *opt = NULL;
+	struct nmreq_opt_sync_kloop_sched sched;
+	struct nmreq_opt_sync_kloop_mode mode;
 	struct context *ctx                       = opaque;
 	struct nmreq_sync_kloop_start req;
 	struct nmreq_header hdr;
 	int ret;
 
+	if (ctx->cpu >= 0) {
+		cpuset_t cpumask;
+
+		CPU_ZERO(&cpumask);
+		CPU_SET(ctx->cpu, &cpumask);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpumask),
+		                             &cpumask);
+		if (ret) {
+			printf("pthread_setaffinity_np() failed: %s\n",
+			       strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	if (ctx->eventfds) {
 		size_t opt_size = sizeof(*opt) +
 		                  ctx->num_entries * sizeof(opt->eventfds[0]);
@@ -75,6 +100,20 @@ kloop_worker(void *opaque)
 	hdr.nr_reqtype = NETMAP_REQ_SYNC_KLOOP_START;
 	hdr.nr_body    = (uintptr_t)&req;
 	hdr.nr_options = (uintptr_t)opt;
+	if (ctx->event_idx) {
+		memset(&mode, 0, sizeof(mode));
+		mode.nro_opt.nro_next    = hdr.nr_options;
+		mode.nro_opt.nro_reqtype = NETMAP_REQ_OPT_SYNC_KLOOP_MODE;
+		mode.mode                = NM_OPT_SYNC_KLOOP_EVENT_IDX;
+		hdr.nr_options           = (uintptr_t)&mode;
+	}
+	if (ctx->spin_us) {
+		memset(&sched, 0, sizeof(sched));
+		sched.nro_opt.nro_next    = hdr.nr_options;
+		sched.nro_opt.nro_reqtype = NETMAP_REQ_OPT_SYNC_KLOOP_SCHED;
+		sched.nro_spin_us         = (uint32_t)ctx->spin_us;
+		hdr.nr_options            = (uintptr_t)&sched;
+	}
 	memset(&req, 0, sizeof(req));
 	req.sleep_us = (uint32_t)ctx->sleep_us;
 	ret          = ioctl(ctx->fd, NIOCCTRL, &hdr);
@@ -108,7 +147,10 @@ usage(const char *progname)
 	       "[-R RATE_PPS (0 = infinite)]\n"
 	       "[-b BATCH_SIZE (in packets)]\n"
 	       "[-u KLOOP_SLEEP_US (in microseconds)]\n"
+	       "[-s KLOOP_SPIN_US (keep polling after some work, in microseconds)]\n"
+	       "[-a CPU (pin the kloop thread)]\n"
 	       "[-k (use eventfd-based notifications)]\n"
+	       "[-e (use event indices for the notifications)]\n"
 	       "-i NETMAP_PORT\n",
 	       progname);
 }
@@ -127,6 +169,7 @@ main(int argc, char **argv)
 	int num_tx_entries, num_rx_entries;
 	unsigned long long bytes = 0;
 	unsigned long long pkts  = 0;
+	unsigned long long kicks = 0;
 	const char *ifname       = NULL;
 	void *csb                = NULL;
 	uint16_t first_ring, last_ring;
@@ -165,8 +208,9 @@ main(int argc, char **argv)
 	ctx.verbose  = 0;
 	ctx.batch    = 1;
 	ctx.sleep_us = 100;
+	ctx.cpu      = -1;
 
-	while ((opt = getopt(argc, argv, "hi:f:vR:b:u:k")) != -1) {
+	while ((opt = getopt(argc, argv, "hi:f:vR:b:u:s:a:ke")) != -1) {
 		switch (opt) {
 		case 'h':
 			usage(argv[0]);
@@ -214,10 +258,30 @@ main(int argc, char **argv)
 			}
 			break;
 
+		case 's':
+			ctx.spin_us = atoi(optarg);
+			if (ctx.spin_us < 0) {
+				printf("    Invalid spin_us %s\n", optarg);
+				return -1;
+			}
+			break;
+
+		case 'a':
+			ctx.cpu = atoi(optarg);
+			if (ctx.cpu < 0) {
+				printf("    Invalid cpu %s\n", optarg);
+				return -1;
+			}
+			break;
+
 		case 'k':
 			use_eventfds = 1;
 			break;
 
+		case 'e':
+			ctx.event_idx = 1;
+			break;
+
 		default:
 			printf("    Unrecognized option %c\n", opt);
 			usage(argv[0]);
@@ -427,7 +491,7 @@ main(int argc, char **argv)
 			struct nm_csb_ktoa *ktoa = ktoa_base + r;
 			struct netmap_ring *ring;
 			struct netmap_slot *slot;
-			uint32_t head;
+			uint32_t head, old_head;
 			int batch;
 
 			if (func == F_TX) {
@@ -436,7 +500,7 @@ main(int argc, char **argv)
 				ring = NETMAP_RXRING(nifp, r);
 			}
 
-			head = atok->head;
+			head = old_head = atok->head;
 			/* For convenience we reuse the netmap_ring
 			 * header to store hwtail and hwcur, since the
 			 * cur, head and tail fields are not used. */
@@ -501,11 +565,15 @@ main(int argc, char **argv)
 			/* Write updated information for the kernel. */
 			nm_sync_kloop_appl_write(atok, head, head);
 			/* Notify the kernel if needed. */
-			if (evfds && ACCESS_ONCE(ktoa->kern_need_kick)) {
+			if (evfds && (ctx.event_idx ?
+			    nm_sync_kloop_appl_need_kick(ktoa, old_head, head,
+			                                 ring->num_slots) :
+			    ACCESS_ONCE(ktoa->kern_need_kick) != 0)) {
 				uint64_t x = 1;
 				int n = write(evfds->ioeventfd, &x, sizeof(x));
 
 				assert(n == sizeof(x));
+				kicks++;
 				if (ctx.verbose) {
 					printf("Kernel notified\n");
 				}
@@ -530,6 +598,10 @@ main(int argc, char **argv)
 		udiff         = duration.tv_sec * 1000000 + duration.tv_usec;
 		measured_rate = (double)pkts / (double)udiff;
 		printf("Measured rate: %.6f Mpps\n", measured_rate);
+		if (ctx.eventfds) {
+			printf("Kicks: %llu (%.3f per packet)\n", kicks,
+			       pkts ? (double)kicks / pkts : 0.0);
+		}
 	}
 
 	/* Stop the kernel worker thread. */
@@ -0,0 +1,206 @@
+/*
+ * benchmark for the packet copy routines in netmap_user.h
+ *
+ * Usage: testcopy [-n count] [-b bufs] [-f function] [size ...]
+ *
+ * Copies 'count' packets of each size between two sets of 'bufs'
+ * 2 KB buffers (use many buffers to work out of the cache) and reports
+ * the throughput in bytes per cycle (bytes per ns if there is no TSC).
+ * Without sizes, runs the usual classes from 64 bytes to jumbo frames.
+ *
+ * function is one of
+ *	memcpy		libc memcpy
+ *	u64		64-bit unrolled loop (the old nm_pkt_copy)
+ *	pkt_copy	nm_pkt_copy
+ *	pkt_copy_nt	nm_pkt_copy_nt (non-temporal stores)
+ *	all		all of the above (default)
+ *
+ * nm_pkt_copy() picks the vector width at compile time, so
+ * compare builds with different CFLAGS (e.g. -march=native).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <net/netmap_user.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#define BUF_SIZE	2048
+
+typedef void (*copy_fn_t)(const void *, void *, int);
+
+static void
+copy_memcpy(const void *src, void *dst, int l)
+{
+	memcpy(dst, src, l);
+}
+
+static void
+copy_u64(const void *_src, void *_dst, int l)
+{
+	const uint64_t *src = _src;
+	uint64_t *dst = _dst;
+
+	if (unlikely(l >= 1024 || l % 64)) {
+		memcpy(dst, src, l);
+		return;
+	}
+	for (; likely(l > 0); l -= 64) {
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+	}
+}
+
+static void
+copy_pkt(const void *src, void *dst, int l)
+{
+	nm_pkt_copy(src, dst, l);
+}
+
+static void
+copy_pkt_nt(const void *src, void *dst, int l)
+{
+	nm_pkt_copy_nt(src, dst, l);
+}
+
+static struct {
+	const char *name;
+	copy_fn_t fn;
+} funcs[] = {
+	{ "memcpy",	copy_memcpy },
+	{ "u64",	copy_u64 },
+	{ "pkt_copy",	copy_pkt },
+	{ "pkt_copy_nt", copy_pkt_nt },
+	{ NULL, NULL }
+};
+
+static uint64_t
+now(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void
+run(const char *name, copy_fn_t fn, char *src, char *dst, int bufs,
+		int size, long count)
+{
+	uint64_t t0, t1;
+	long i;
+	int b = 0;
+	/* round up as netmap applications do */
+	int l = (size + 63) & ~63;
+
+	t0 = now();
+	for (i = 0; i < count; i++) {
+		fn(src + b * BUF_SIZE, dst + b * BUF_SIZE, l);
+		if (++b == bufs)
+			b = 0;
+	}
+	nm_pkt_copy_nt_done();
+	t1 = now();
+	printf("%-12s %5d %8.2f\n", name, size,
+			(double)size * count / (t1 - t0 ? t1 - t0 : 1));
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: testcopy [-n count] [-b bufs] "
+			"[-f function] [size ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int def_sizes[] = { 64, 128, 256, 512, 1024, 1514,
+		2048 };
+	long count = 10000000;
+	int bufs = 1024;
+	const char *fname = "all";
+	char *src, *dst;
+	int ch, i, j, found = 0;
+
+	while ((ch = getopt(argc, argv, "n:b:f:")) != -1) {
+		switch (ch) {
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 'b':
+			bufs = atoi(optarg);
+			break;
+		case 'f':
+			fname = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (count <= 0 || bufs <= 0)
+		usage();
+
+	if (posix_memalign((void **)&src, 64, (size_t)bufs * BUF_SIZE) ||
+	    posix_memalign((void **)&dst, 64, (size_t)bufs * BUF_SIZE)) {
+		perror("posix_memalign");
+		return 1;
+	}
+	memset(src, 0x5a, (size_t)bufs * BUF_SIZE);
+	memset(dst, 0, (size_t)bufs * BUF_SIZE);
+
+	printf("%-12s %5s %8s\n", "function", "size",
+#ifdef HAVE_TSC
+			"B/cycle"
+#else
+			"B/ns"
+#endif
+			);
+	for (j = 0; funcs[j].name != NULL; j++) {
+		if (strcmp(fname, "all") && strcmp(fname, funcs[j].name))
+			continue;
+		found = 1;
+		if (argc == 0) {
+			for (i = 0; i < (int)(sizeof(def_sizes) /
+					sizeof(def_sizes[0])); i++)
+				run(funcs[j].name, funcs[j].fn, src, dst, bufs,
+						def_sizes[i], count);
+		}
+		for (i = 0; i < argc; i++) {
+			int size = atoi(argv[i]);
+
+			if (size <= 0 || size > BUF_SIZE) {
+				fprintf(stderr, "invalid size %s\n", argv[i]);
+				return 1;
+			}
+			run(funcs[j].name, funcs[j].fn, src, dst, bufs, size,
+					count);
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "unknown function %s\n", fname);
+		usage();
+	}
+	free(src);
+	free(dst);
+	return 0;
+}
@@ -781,6 +781,235 @@ test_netmap(struct targ *t)
 	return;
 }
 
+/*
+ * Models of the protocols used to own a kring (netmap_kern.h and
+ * netmap_vale.c), and of some alternatives. All threads contend for
+ * the same ring, as the sources of a VALE switch sending to the same
+ * destination port. Each iteration moves a batch of -l slots
+ * (default 32) into the ring, and count is the number of slots moved.
+ * The ring is drained as soon as it is written, so there is always
+ * room for a batch.
+ * Run at most one thread per core (-a 1): a thread that spins while
+ * the owner is descheduled wastes a whole time slice.
+ *
+ *	kr_tryget	nm_kr_tryget()/nm_kr_put(): test-and-set on
+ *			nr_busy, the losers give up and retry (as
+ *			netmap_poll() does); the copy is done by the owner
+ *	kr_lease	the q_lock/nm_kr_lease() protocol of nm_vale_flush():
+ *			the lock is only held to take the lease and to
+ *			report its completion, copies run in parallel
+ *	kr_qlock	copy under q_lock (test-and-set spinlock)
+ *	kr_ticket	copy under a ticket lock
+ *	kr_mcs		copy under an MCS queue lock
+ *	kr_mpsc		lock-free multi-producer ring: reserve with
+ *			fetch-and-add, copy, publish in order
+ */
+#define KR_SLOTS	1024
+#define KR_NOSLOT	((uint32_t)-1)
+#define KR_ALIGN	__attribute__ ((aligned(64)))
+
+#define cpu_relax()	__asm __volatile("pause" ::: "memory")
+
+struct mcs_node {
+	struct mcs_node * volatile next;
+	volatile uint32_t locked;
+} KR_ALIGN;
+
+static struct kr_model {
+	volatile uint32_t busy KR_ALIGN;	/* nr_busy */
+	volatile uint32_t q_lock KR_ALIGN;
+	uint32_t	hwlease, hwtail, lease_idx;
+	uint32_t	leases[KR_SLOTS];
+	volatile uint32_t next_ticket KR_ALIGN;
+	volatile uint32_t now_serving KR_ALIGN;
+	struct mcs_node * volatile mcs_tail KR_ALIGN;
+	volatile uint32_t prod_head KR_ALIGN;
+	volatile uint32_t prod_tail KR_ALIGN;
+	uint64_t	slot[KR_SLOTS] KR_ALIGN;
+} kr;
+
+/* slots per batch, so that the batches in flight fit the ring */
+static uint32_t
+kr_batch(struct targ *t)
+{
+	uint32_t n = t->g->arg > 0 ? t->g->arg : 32;
+
+	if (n * t->g->nthreads > KR_SLOTS)
+		n = KR_SLOTS / t->g->nthreads;
+	return n;
+}
+
+/* the copy into the destination slots */
+static inline void
+kr_fill(uint32_t start, uint32_t n, int me)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		kr.slot[(start + i) & (KR_SLOTS - 1)] = me;
+}
+
+static inline void
+kr_spin_lock(volatile uint32_t *l)
+{
+	while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE)) {
+		while (*l)
+			cpu_relax();
+	}
+}
+
+static inline void
+kr_spin_unlock(volatile uint32_t *l)
+{
+	__atomic_store_n(l, 0, __ATOMIC_RELEASE);
+}
+
+void
+test_kr_tryget(struct targ *t)
+{
+	uint32_t n = kr_batch(t), start;
+	uint64_t busy = 0;
+	int64_t m;
+
+	for (m = 0; m < t->g->m_cycles; m++) {
+		if (__atomic_exchange_n(&kr.busy, 1, __ATOMIC_ACQUIRE)) {
+			busy++;	/* NM_KR_BUSY */
+			continue;
+		}
+		start = kr.hwtail;
+		kr_fill(start, n, t->me);
+		kr.hwtail = (start + n) & (KR_SLOTS - 1);
+		__atomic_store_n(&kr.busy, 0, __ATOMIC_RELEASE);
+		t->count += n;
+	}
+	D("thread %d busy %" PRIu64 " out of %" PRId64, t->me, busy, m);
+}
+
+void
+test_kr_lease(struct targ *t)
+{
+	uint32_t n = kr_batch(t), lim = KR_SLOTS - 1;
+	uint32_t my_start, lease_idx, j;
+	int64_t m;
+
+	for (m = 0; m < t->g->m_cycles; m++) {
+		kr_spin_lock(&kr.q_lock);
+		my_start = kr.hwlease;
+		lease_idx = kr.lease_idx;	/* nm_kr_lease() */
+		kr.leases[lease_idx] = KR_NOSLOT;
+		kr.lease_idx = (lease_idx + 1) & lim;
+		kr.hwlease = (my_start + n) & lim;
+		kr_spin_unlock(&kr.q_lock);
+
+		kr_fill(my_start, n, t->me);
+
+		kr_spin_lock(&kr.q_lock);
+		kr.leases[lease_idx] = j = (my_start + n) & lim;
+		if (my_start == kr.hwtail) {
+			/* first pending lease, also report the next ones */
+			while (lease_idx != kr.lease_idx &&
+			    kr.leases[lease_idx] != KR_NOSLOT) {
+				j = kr.leases[lease_idx];
+				kr.leases[lease_idx] = KR_NOSLOT;
+				lease_idx = (lease_idx + 1) & lim;
+			}
+			kr.hwtail = j;
+		}
+		kr_spin_unlock(&kr.q_lock);
+		t->count += n;
+	}
+}
+
+void
+test_kr_qlock(struct targ *t)
+{
+	uint32_t n = kr_batch(t), start;
+	int64_t m;
+
+	for (m = 0; m < t->g->m_cycles; m++) {
+		kr_spin_lock(&kr.q_lock);
+		start = kr.hwtail;
+		kr_fill(start, n, t->me);
+		kr.hwtail = (start + n) & (KR_SLOTS - 1);
+		kr_spin_unlock(&kr.q_lock);
+		t->count += n;
+	}
+}
+
+void
+test_kr_ticket(struct targ *t)
+{
+	uint32_t n = kr_batch(t), start, my;
+	int64_t m;
+
+	for (m = 0; m < t->g->m_cycles; m++) {
+		my = __atomic_fetch_add(&kr.next_ticket, 1, __ATOMIC_RELAXED);
+		while (__atomic_load_n(&kr.now_serving, __ATOMIC_ACQUIRE) != my)
+			cpu_relax();
+		start = kr.hwtail;
+		kr_fill(start, n, t->me);
+		kr.hwtail = (start + n) & (KR_SLOTS - 1);
+		__atomic_store_n(&kr.now_serving, my + 1, __ATOMIC_RELEASE);
+		t->count += n;
+	}
+}
+
+void
+test_kr_mcs(struct targ *t)
+{
+	uint32_t n = kr_batch(t), start;
+	struct mcs_node me, *prev, *next;
+	int64_t m;
+
+	for (m = 0; m < t->g->m_cycles; m++) {
+		me.next = NULL;
+		me.locked = 1;
+		prev = __atomic_exchange_n(&kr.mcs_tail, &me, __ATOMIC_ACQ_REL);
+		if (prev != NULL) {
+			__atomic_store_n(&prev->next, &me, __ATOMIC_RELEASE);
+			while (__atomic_load_n(&me.locked, __ATOMIC_ACQUIRE))
+				cpu_relax();
+		}
+
+		start = kr.hwtail;
+		kr_fill(start, n, t->me);
+		kr.hwtail = (start + n) & (KR_SLOTS - 1);
+
+		next = __atomic_load_n(&me.next, __ATOMIC_ACQUIRE);
+		if (next == NULL) {
+			prev = &me;
+			if (__atomic_compare_exchange_n(&kr.mcs_tail, &prev,
+			    NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+				t->count += n;
+				continue;
+			}
+			/* a successor is linking itself */
+			while ((next = __atomic_load_n(&me.next,
+			    __ATOMIC_ACQUIRE)) == NULL)
+				cpu_relax();
+		}
+		__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+		t->count += n;
+	}
+}
+
+void
+test_kr_mpsc(struct targ *t)
+{
+	uint32_t n = kr_batch(t), start;
+	int64_t m;
+
+	for (m = 0; m < t->g->m_cycles; m++) {
+		start = __atomic_fetch_add(&kr.prod_head, n, __ATOMIC_RELAXED);
+		kr_fill(start, n, t->me);
+		/* publish after the batches reserved before ours */
+		while (__atomic_load_n(&kr.prod_tail, __ATOMIC_ACQUIRE) != start)
+			cpu_relax();
+		__atomic_store_n(&kr.prod_tail, start + n, __ATOMIC_RELEASE);
+		t->count += n;
+	}
+}
+
 struct entry {
 	void (*fn)(struct targ *);
 	char *name;
@@ -812,6 +1041,12 @@ struct entry tests[] = {
 	EE(netmap, _1K, _100M),
 	EE(pthread_mutex, _1K, _100M),
 	EE(spinlock, _1K, _100M),
+	EE(kr_tryget, _1M, _10M),
+	EE(kr_lease, _1M, _1M),
+	EE(kr_qlock, _1M, _1M),
+	EE(kr_ticket, _1M, _1M),
+	EE(kr_mcs, _1M, _1M),
+	EE(kr_mpsc, _1M, _1M),
 	{ NULL, NULL, 0, 0 }
 };
 
@@ -826,7 +1061,7 @@ usage(void)
 		"%s arguments\n"
 		"\t-m name		test name\n"
 		"\t-n cycles		(millions) of cycles\n"
-		"\t-l arg		bytes, usec, ... \n"
+		"\t-l arg		bytes, usec, slots per batch (kr_*) ... \n"
 		"\t-t threads		total threads\n"
 		"\t-c cores		cores to use\n"
 		"\t-a n			force affinity every n cores\n"
@@ -605,8 +605,9 @@ do_if()
 	printf("bufs_head       %u\n", nifp->ni_bufs_head);
 	printf("host_tx_rings   %u\n", nifp->ni_host_tx_rings);
 	printf("host_rx_rings   %u\n", nifp->ni_host_rx_rings);
-	for (i = 0; i < 3; i++)
-		printf("spare1[%d]  %u\n", i, nifp->ni_spare1[i]);
+	printf("spare1          %u\n", nifp->ni_spare1);
+	printf("memsize         %llu\n",
+	    (unsigned long long)nifp->ni_memsize);
 	for (i = 0; i < (nifp->ni_tx_rings + nifp->ni_rx_rings + nifp->ni_host_tx_rings + nifp->ni_host_rx_rings); i++)
 		printf("ring_ofs[%d] %zd\n", i, nifp->ring_ofs[i]);
 }
@@ -1569,7 +1570,6 @@ static void
 nmr_body_dump_port_info_get(void *b)
 {
 	struct nmreq_port_info_get *r = b;
-	int i;
 
 	printf("memsize:        %" PRIu64 " [", r->nr_memsize);
 	if (r->nr_memsize < (1 << 20)) {
@@ -1587,8 +1587,8 @@ nmr_body_dump_port_info_get(void *b)
 	printf("mem_id:         %" PRIu16 " [%s memory region]\n", r->nr_mem_id,
 	       (r->nr_mem_id == 0 ? "default"
 				  : r->nr_mem_id == 1 ? "global" : "private"));
-	for (i = 0; i < 3; i++)
-		printf("pad[%d]         %" PRIu16 "\n", i, r->pad[i]);
+	printf("pad1:           %" PRIu16 "\n", r->pad1);
+	printf("meta_caps:      %#" PRIx32 "\n", r->nr_meta_caps);
 }
 
 static void